@@ -0,0 +1,108 @@
+// batch_runner.cpp - In-process batch harness for instrumented cdylib builds.
+//
+// run_pipeline.py execs one instrumented process per iteration; for
+// sub-millisecond benchmarks (semver's parse, memchr on short haystacks)
+// loader, ctor registration and runtime init dominate the measurement and
+// the aggregator spends its time filtering startup noise. This runner
+// dlopens one instrumented cdylib and drives N iterations in-process:
+//
+//   per iteration: call the benchmark entry, append a '# batch_iteration'
+//   marker plus the per-family stat sections to the stats stream (comment
+//   lines never start a data row, so every existing parser skips the
+//   markers), then __unsafe_reset_stats() so the next iteration starts
+//   from zero.
+//
+// The entry symbol is called as extern "C" void entry(void) and must be
+// exported by the cdylib (a #[no_mangle] pub extern "C" wrapper around
+// the benchmark's work function). Point UNSAFE_INSTR_OUT at a file, or
+// the records land on stderr like any other instrumented run.
+//
+// Build: g++ -O2 -o batch_runner batch_runner.cpp -ldl
+// Usage: batch_runner <cdylib.so> <entry-symbol> <iterations>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+
+namespace {
+
+// Stat printers the runtime may export, depending on which probe families
+// the build carries. Missing symbols are simply skipped; the families that
+// print from static atexit hooks (heap, external calls) still report their
+// final cumulative section at process exit.
+const char *const SnapshotSymbols[] = {
+    "print_cpu_cycle_stats",
+    "__unsafe_dump_stats",
+    "print_unsafe_coverage_stats",
+};
+
+// Appends one comment marker to the same stream the runtime writes. The
+// runtime holds its own FILE handle, but both open the UNSAFE_INSTR_OUT
+// path in append mode, so short writes interleave at line granularity.
+void writeIterationMarker(unsigned Iteration) {
+  const char *Path = getenv("UNSAFE_INSTR_OUT");
+  FILE *Out = Path ? fopen(Path, "a") : stderr;
+  if (!Out)
+    Out = stderr;
+  fprintf(Out, "# batch_iteration\t%u\n", Iteration);
+  if (Out != stderr)
+    fclose(Out);
+  else
+    fflush(Out);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    fprintf(stderr, "usage: %s <cdylib.so> <entry-symbol> <iterations>\n",
+            argv[0]);
+    return 2;
+  }
+  unsigned long Iterations = strtoul(argv[3], nullptr, 10);
+  if (!Iterations) {
+    fprintf(stderr, "batch_runner: iteration count must be positive\n");
+    return 2;
+  }
+
+  // RTLD_NOW so a build/runtime mismatch fails here, not mid-measurement.
+  void *Lib = dlopen(argv[1], RTLD_NOW);
+  if (!Lib) {
+    fprintf(stderr, "batch_runner: %s\n", dlerror());
+    return 1;
+  }
+
+  auto Entry = reinterpret_cast<void (*)()>(dlsym(Lib, argv[2]));
+  if (!Entry) {
+    fprintf(stderr, "batch_runner: entry symbol %s not found: %s\n", argv[2],
+            dlerror());
+    return 1;
+  }
+  auto Reset = reinterpret_cast<void (*)()>(dlsym(Lib, "__unsafe_reset_stats"));
+  if (!Reset) {
+    fprintf(stderr, "batch_runner: __unsafe_reset_stats not found — is %s "
+                    "an instrumented build?\n",
+            argv[1]);
+    return 1;
+  }
+
+  void (*Snapshots[sizeof(SnapshotSymbols) / sizeof(SnapshotSymbols[0])])();
+  unsigned NumSnapshots = 0;
+  for (const char *Sym : SnapshotSymbols)
+    if (void *Fn = dlsym(Lib, Sym))
+      Snapshots[NumSnapshots++] = reinterpret_cast<void (*)()>(Fn);
+
+  for (unsigned I = 0; I < Iterations; ++I) {
+    Entry();
+    writeIterationMarker(I);
+    for (unsigned S = 0; S < NumSnapshots; ++S)
+      Snapshots[S]();
+    Reset();
+  }
+
+  // Leave the library loaded: its exit-time printers append one final
+  // (post-reset, near-empty) set of sections, which the markers above
+  // keep distinguishable from the per-iteration records.
+  return 0;
+}
@@ -0,0 +1,181 @@
+// Copyright 2009 The RE2 Authors.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "re2/atom_scanner.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include <algorithm>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "absl/strings/string_view.h"
+
+namespace re2 {
+
+static bool IsAlpha(uint8_t c) {
+  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+}
+
+static uint8_t ToLower(uint8_t c) {
+  if ('A' <= c && c <= 'Z')
+    return c + ('a' - 'A');
+  return c;
+}
+
+// The atoms are already lowercased, so only the text needs folding.
+static bool CaseEqual(const char* text, const std::string& atom) {
+  for (size_t i = 0; i < atom.size(); i++)
+    if (ToLower(text[i]) != static_cast<uint8_t>(atom[i]))
+      return false;
+  return true;
+}
+
+AtomScanner::AtomScanner()
+    : depth_(0) {
+  memset(lo_, 0, sizeof(lo_));
+  memset(hi_, 0, sizeof(hi_));
+}
+
+AtomScanner::~AtomScanner() {}
+
+void AtomScanner::Compile(const std::vector<std::string>& atoms) {
+  atoms_ = atoms;
+  for (int b = 0; b < kBuckets; b++)
+    bucket_atoms_[b].clear();
+  depth_ = 0;
+  memset(lo_, 0, sizeof(lo_));
+  memset(hi_, 0, sizeof(hi_));
+  if (atoms_.empty())
+    return;
+
+  // The classified prefix can only be as long as the shortest atom.
+  size_t minlen = atoms_[0].size();
+  for (size_t i = 1; i < atoms_.size(); i++)
+    minlen = std::min(minlen, atoms_[i].size());
+  depth_ = static_cast<int>(std::min<size_t>(minlen, kMaxDepth));
+  if (depth_ == 0)
+    return;  // an empty atom matches everywhere; nothing to scan for
+
+  for (size_t i = 0; i < atoms_.size(); i++) {
+    int b = static_cast<int>(i % kBuckets);
+    bucket_atoms_[b].push_back(static_cast<int>(i));
+    for (int j = 0; j < depth_; j++) {
+      // Enter both case variants so the text need not be lowercased.
+      // Mixing the low nibble of one variant with the high nibble of
+      // the other can classify extra bytes into the bucket, but that
+      // only costs a confirmation, never a missed match.
+      uint8_t c = static_cast<uint8_t>(atoms_[i][j]);
+      uint8_t variants[2] = {c, c};
+      if (IsAlpha(c))
+        variants[1] = c ^ 0x20;
+      for (int v = 0; v < 2; v++) {
+        lo_[j][variants[v] & 0xF] |= 1 << b;
+        hi_[j][variants[v] >> 4] |= 1 << b;
+      }
+    }
+  }
+}
+
+void AtomScanner::Verify(absl::string_view text, size_t s, uint8_t buckets,
+                         std::vector<bool>* seen,
+                         std::vector<int>* matched_atoms) const {
+  for (int b = 0; b < kBuckets; b++) {
+    if (!(buckets & (1 << b)))
+      continue;
+    for (size_t k = 0; k < bucket_atoms_[b].size(); k++) {
+      int id = bucket_atoms_[b][k];
+      if ((*seen)[id])
+        continue;
+      const std::string& atom = atoms_[id];
+      if (s + atom.size() <= text.size() && CaseEqual(text.data() + s, atom)) {
+        (*seen)[id] = true;
+        matched_atoms->push_back(id);
+      }
+    }
+  }
+}
+
+void AtomScanner::Scan(absl::string_view text,
+                       std::vector<int>* matched_atoms) const {
+  matched_atoms->clear();
+  if (atoms_.empty() || depth_ == 0 ||
+      text.size() < static_cast<size_t>(depth_))
+    return;
+  std::vector<bool> seen(atoms_.size());
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(text.data());
+  size_t n = text.size();
+  size_t s = 0;  // first candidate start not yet scanned
+
+#ifdef __SSSE3__
+  if (n >= 16) {
+    const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+    __m128i lo[kMaxDepth];
+    __m128i hi[kMaxDepth];
+    for (int j = 0; j < depth_; j++) {
+      lo[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lo_[j]));
+      hi[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hi_[j]));
+    }
+    // prev[j] holds the classification of the previous block for mask
+    // position j.  Starting from zero suppresses the lanes of the first
+    // block whose candidate start would fall before the text.
+    __m128i prev[kMaxDepth];
+    for (int j = 0; j < depth_; j++)
+      prev[j] = _mm_setzero_si128();
+    size_t nblocks = n / 16;
+    for (size_t block = 0; block < nblocks; block++) {
+      __m128i data = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(p + block*16));
+      __m128i vlo = _mm_and_si128(data, nibble_mask);
+      __m128i vhi = _mm_and_si128(_mm_srli_epi16(data, 4), nibble_mask);
+      __m128i c[kMaxDepth];
+      for (int j = 0; j < depth_; j++)
+        c[j] = _mm_and_si128(_mm_shuffle_epi8(lo[j], vlo),
+                             _mm_shuffle_epi8(hi[j], vhi));
+      // Lane e of r accumulates the buckets whose atoms could end their
+      // classified prefix at text position block*16 + e: position j of
+      // the prefix is checked depth_-1-j bytes earlier, which ALIGNR
+      // pulls from the previous block where needed.
+      __m128i r = c[depth_-1];
+      if (depth_ >= 2)
+        r = _mm_and_si128(r, _mm_alignr_epi8(c[depth_-2], prev[depth_-2], 15));
+      if (depth_ >= 3)
+        r = _mm_and_si128(r, _mm_alignr_epi8(c[depth_-3], prev[depth_-3], 14));
+      for (int j = 0; j < depth_; j++)
+        prev[j] = c[j];
+      int lanes = _mm_movemask_epi8(
+          _mm_cmpeq_epi8(r, _mm_setzero_si128())) ^ 0xFFFF;
+      if (lanes == 0)
+        continue;
+      uint8_t rbytes[16];
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(rbytes), r);
+      while (lanes != 0) {
+        int e = __builtin_ctz(lanes);
+        lanes &= lanes - 1;
+        size_t start = block*16 + e - (depth_ - 1);
+        Verify(text, start, rbytes[e], &seen, matched_atoms);
+      }
+    }
+    // Candidates whose classified prefix extends past the last full
+    // block are left for the scalar tail.
+    size_t scanned_ends = nblocks * 16;
+    s = scanned_ends >= static_cast<size_t>(depth_ - 1)
+            ? scanned_ends - (depth_ - 1)
+            : 0;
+  }
+#endif
+
+  for (; s + depth_ <= n; s++) {
+    uint8_t buckets = Classify(0, p[s]);
+    for (int j = 1; j < depth_ && buckets != 0; j++)
+      buckets &= Classify(j, p[s+j]);
+    if (buckets != 0)
+      Verify(text, s, buckets, &seen, matched_atoms);
+  }
+}
+
+}  // namespace re2
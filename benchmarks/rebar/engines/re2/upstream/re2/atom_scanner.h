@@ -0,0 +1,76 @@
+// Copyright 2009 The RE2 Authors.  All Rights Reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef RE2_ATOM_SCANNER_H_
+#define RE2_ATOM_SCANNER_H_
+
+// AtomScanner is a multi-literal scanner used by FilteredRE2 as a
+// built-in prefilter execution backend.  It matches the set of atoms
+// produced by PrefilterTree::Compile() against a search text, ASCII
+// case-insensitively, and reports the indices of the atoms found.
+//
+// The scanner is "Teddy"-style: atoms are hashed into eight buckets and
+// the first few bytes of each atom are compiled into per-position nibble
+// lookup tables.  On targets with SSSE3 the tables are applied to the
+// text sixteen bytes at a time with PSHUFB, producing a bitmask of
+// candidate buckets per position; candidates are then confirmed with an
+// exact (case-folded) comparison.  Without SSSE3 the same tables are
+// applied one byte at a time.
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace re2 {
+
+class AtomScanner {
+ public:
+  AtomScanner();
+  ~AtomScanner();
+
+  // Not copyable.
+  AtomScanner(const AtomScanner&) = delete;
+  AtomScanner& operator=(const AtomScanner&) = delete;
+
+  // Builds the scanner for the given atoms.  The atoms are expected to
+  // be lowercased and distinct, as returned by FilteredRE2::Compile().
+  void Compile(const std::vector<std::string>& atoms);
+
+  // Scans text and appends to matched_atoms the index of every atom
+  // that occurs in it, after first clearing matched_atoms.  Matching
+  // is ASCII case-insensitive, so the text need not be lowercased.
+  // Each atom index is reported at most once, in no particular order.
+  void Scan(absl::string_view text, std::vector<int>* matched_atoms) const;
+
+  // The number of atoms the scanner was compiled with.
+  int NumAtoms() const { return static_cast<int>(atoms_.size()); }
+
+ private:
+  static const int kBuckets = 8;
+  static const int kMaxDepth = 3;
+
+  // Scalar equivalent of the PSHUFB classification: the buckets whose
+  // byte at position j could be c.
+  uint8_t Classify(int j, uint8_t c) const {
+    return lo_[j][c & 0xF] & hi_[j][c >> 4];
+  }
+
+  // Confirms candidate buckets at text position s and records matches.
+  void Verify(absl::string_view text, size_t s, uint8_t buckets,
+              std::vector<bool>* seen,
+              std::vector<int>* matched_atoms) const;
+
+  std::vector<std::string> atoms_;
+  std::vector<int> bucket_atoms_[kBuckets];  // atom indices per bucket
+  int depth_;                                // classified prefix length
+  uint8_t lo_[kMaxDepth][16];                // low nibble -> bucket bits
+  uint8_t hi_[kMaxDepth][16];                // high nibble -> bucket bits
+};
+
+}  // namespace re2
+
+#endif  // RE2_ATOM_SCANNER_H_
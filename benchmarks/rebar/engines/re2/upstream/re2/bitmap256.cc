@@ -5,6 +5,11 @@
 #include "re2/bitmap256.h"
 
 #include <stdint.h>
+#include <string.h>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
 
 #include "absl/log/absl_check.h"
 
@@ -40,4 +45,63 @@ int Bitmap256::FindNextSetBit(int c) const {
   }
 }
 
+Bitmap256Scanner::Bitmap256Scanner(const Bitmap256& bitmap)
+    : bitmap_(bitmap) {
+  memset(rows_lo_, 0, sizeof rows_lo_);
+  memset(rows_hi_, 0, sizeof rows_hi_);
+  for (int c = 0; c < 256; c++) {
+    if (!bitmap.Test(c))
+      continue;
+    if (c < 128)
+      rows_lo_[c & 0xF] |= 1 << (c >> 4);
+    else
+      rows_hi_[c & 0xF] |= 1 << ((c >> 4) - 8);
+  }
+}
+
+const uint8_t* Bitmap256Scanner::FindFirstMatch(const uint8_t* data,
+                                                size_t size) const {
+#ifdef __SSSE3__
+  // Each byte selects a row bitmap by its low nibble - from rows_lo_
+  // or rows_hi_ according to its top bit - and a single-bit mask by
+  // its high nibble; the byte is in the set iff the bitmap contains
+  // the bit.  This is exact for arbitrary sets, unlike the bucketed
+  // approximations used by multi-pattern scanners.
+  const __m128i rows_lo = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(rows_lo_));
+  const __m128i rows_hi = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(rows_hi_));
+  static const uint8_t kBits[16] = {
+      0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+      0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+  };
+  const __m128i bit_table = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(kBits));
+  const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+  const __m128i zero = _mm_setzero_si128();
+  while (size >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    __m128i vlo = _mm_and_si128(v, nibble_mask);
+    __m128i vhi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble_mask);
+    // Bytes >= 0x80 are negative as signed, selecting rows_hi.
+    __m128i high = _mm_cmpgt_epi8(zero, v);
+    __m128i rows = _mm_or_si128(
+        _mm_andnot_si128(high, _mm_shuffle_epi8(rows_lo, vlo)),
+        _mm_and_si128(high, _mm_shuffle_epi8(rows_hi, vlo)));
+    __m128i bit = _mm_shuffle_epi8(bit_table, vhi);
+    int lanes = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_and_si128(rows, bit), bit));
+    if (lanes != 0)
+      return data + Bitmap256::FindLSBSet(static_cast<uint64_t>(lanes));
+    data += 16;
+    size -= 16;
+  }
+#endif
+  for (size_t i = 0; i < size; i++) {
+    if (bitmap_.Test(data[i]))
+      return data + i;
+  }
+  return NULL;
+}
+
 }  // namespace re2
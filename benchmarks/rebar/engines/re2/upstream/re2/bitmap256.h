@@ -49,6 +49,8 @@ class Bitmap256 {
   int FindNextSetBit(int c) const;
 
  private:
+  friend class Bitmap256Scanner;
+
   // Finds the least significant non-zero bit in n.
   static int FindLSBSet(uint64_t n) {
     ABSL_DCHECK_NE(n, uint64_t{0});
@@ -83,6 +85,27 @@ class Bitmap256 {
   uint64_t words_[4];
 };
 
+// Scans text for bytes belonging to a fixed Bitmap256.  Construction
+// flattens the bitmap into nibble-indexed shuffle tables so that the
+// scan can classify 16 bytes per step (SSSE3); without SSSE3, the scan
+// probes the bitmap's words directly.
+class Bitmap256Scanner {
+ public:
+  explicit Bitmap256Scanner(const Bitmap256& bitmap);
+
+  // Returns a pointer to the first byte of data[0, size) that is in
+  // the set, or NULL if there is no such byte.
+  const uint8_t* FindFirstMatch(const uint8_t* data, size_t size) const;
+
+ private:
+  // Bit h of rows_lo_[l] is set iff byte (h << 4) | l is in the set,
+  // for high nibbles h < 8; rows_hi_[l] holds bit h - 8 likewise for
+  // high nibbles h >= 8.
+  uint8_t rows_lo_[16];
+  uint8_t rows_hi_[16];
+  Bitmap256 bitmap_;
+};
+
 }  // namespace re2
 
 #endif  // RE2_BITMAP256_H_
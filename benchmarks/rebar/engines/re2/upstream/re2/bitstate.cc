@@ -39,9 +39,67 @@ struct Job {
   const char* p;
 };
 
+// Per-thread scratch space reused across searches.
+//
+// The visited set and the job stack used to be allocated (and the
+// visited bitmap cleared) on every Search call; in high-iteration
+// measurement loops over short haystacks that setup dominated the
+// search itself.  Instead of a bitmap, visited pairs are now marked
+// with the current epoch in a pooled uint32 array, so "clearing" the
+// set is an epoch increment and the array is only written wholesale
+// when it grows or when the epoch wraps.  This spends 32x the memory
+// of the bitmap, which is fine because bit-state search is only
+// selected for small (program size) x (text size) products.
+//
+// The scratch is thread-local rather than owned by the Prog because
+// Progs are searched from multiple threads concurrently and the hot
+// path must not take a lock.
+struct BitStateScratch {
+  PODArray<uint32_t> visited;  // epoch marks: (list ID, char*) pairs visited
+  uint32_t epoch;              // epoch of the current search; 0 = never used
+  PODArray<Job> job;           // job stack, capacity retained across searches
+
+  BitStateScratch()
+      : epoch(0) {}
+};
+
+static BitStateScratch* bitstate_scratch() {
+  static thread_local BitStateScratch scratch;
+  return &scratch;
+}
+
+// Ensures the calling thread's visited pool covers nvisited entries.
+static void EnsureVisited(int nvisited) {
+  BitStateScratch* scratch = bitstate_scratch();
+  if (scratch->visited.size() < nvisited) {
+    scratch->visited = PODArray<uint32_t>(nvisited);
+    memset(scratch->visited.data(), 0,
+           nvisited*sizeof scratch->visited[0]);
+    scratch->epoch = 0;
+  }
+}
+
+// Returns the visited pool sized for at least nvisited entries and
+// begins a new epoch in *epoch, emptying the set without clearing it.
+static uint32_t* AcquireVisited(int nvisited, uint32_t* epoch) {
+  EnsureVisited(nvisited);
+  BitStateScratch* scratch = bitstate_scratch();
+  if (++scratch->epoch == 0) {
+    // The epoch counter wrapped, so stale marks could collide with new
+    // ones; clear the pool and start over.  Happens once per 2^32
+    // searches on this thread.
+    memset(scratch->visited.data(), 0,
+           scratch->visited.size()*sizeof scratch->visited[0]);
+    scratch->epoch = 1;
+  }
+  *epoch = scratch->epoch;
+  return scratch->visited.data();
+}
+
 class BitState {
  public:
   explicit BitState(Prog* prog);
+  ~BitState();
 
   // The usual Search prototype.
   // Can only call Search once per BitState.
@@ -49,7 +107,7 @@ class BitState {
               bool longest, absl::string_view* submatch, int nsubmatch);
 
  private:
-  static inline bool ShouldVisit(absl::string_view text, uint64_t* visited, uint16_t id, const char* p);
+  static inline bool ShouldVisit(absl::string_view text, uint32_t* visited, uint32_t epoch, uint16_t id, const char* p);
   void Push(int id, const char* p);
   void GrowStack();
   bool TrySearch(int id, const char* p);
@@ -65,8 +123,8 @@ class BitState {
   int nsubmatch_;                //   # of submatches to fill in
 
   // Search state
-  static constexpr int kVisitedBits = 64;
-  PODArray<uint64_t> visited_;  // bitmap: (list ID, char*) pairs visited
+  uint32_t* visited_;           // pooled epoch marks (see BitStateScratch)
+  uint32_t visited_epoch_;      // epoch of this search
   PODArray<const char*> cap_;   // capture registers
   PODArray<Job> job_;           // stack of text positions to explore
   int njob_;                    // stack size
@@ -82,7 +140,15 @@ BitState::BitState(Prog* prog)
     endmatch_(false),
     submatch_(NULL),
     nsubmatch_(0),
+    visited_(NULL),
+    visited_epoch_(0),
     njob_(0) {
+  // Adopt the pooled job stack so its capacity carries across searches.
+  job_ = std::move(bitstate_scratch()->job);
+}
+
+BitState::~BitState() {
+  bitstate_scratch()->job = std::move(job_);
 }
 
 // Given the text being searched and current visited state,
@@ -92,12 +158,12 @@ BitState::BitState(Prog* prog)
 // We pass text and visited to this as a static method so that the
 // caller can do those loads once instead of this code dereferencing
 // them multiple times.
-bool BitState::ShouldVisit(absl::string_view text, uint64_t* visited, uint16_t list_id, const char* p) {
+bool BitState::ShouldVisit(absl::string_view text, uint32_t* visited, uint32_t epoch, uint16_t list_id, const char* p) {
   int n = list_id * static_cast<int>(text.size()+1) +
           static_cast<int>(p-text.data());
-  if (visited[n/kVisitedBits] & (uint64_t{1} << (n & (kVisitedBits-1))))
+  if (visited[n] == epoch)
     return false;
-  visited[n/kVisitedBits] |= uint64_t{1} << (n & (kVisitedBits-1));
+  visited[n] = epoch;
   return true;
 }
 
@@ -144,11 +210,12 @@ bool BitState::TrySearch(int id0, const char* p0) {
   bool matched = false;
   const char* end = text_.data() + text_.size();
   uint16_t* list_heads = prog_->list_heads();
-  uint64_t* visited = visited_.data();
+  uint32_t* visited = visited_;
+  uint32_t epoch = visited_epoch_;
   njob_ = 0;
   // Push() no longer checks ShouldVisit(),
   // so we must perform the check ourselves.
-  if (ShouldVisit(text_, visited, list_heads[id0], p0))
+  if (ShouldVisit(text_, visited, epoch, list_heads[id0], p0))
     Push(id0, p0);
   while (njob_ > 0) {
     // Pop job off stack.
@@ -242,7 +309,7 @@ bool BitState::TrySearch(int id0, const char* p0) {
         // Sanity check: id is the head of its list, which must
         // be the case if id-1 is the last of *its* list. :)
         ABSL_DCHECK(id == 0 || prog_->inst(id-1)->last());
-        if (ShouldVisit(text_, visited, list_heads[id], p))
+        if (ShouldVisit(text_, visited, epoch, list_heads[id], p))
           goto Loop;
         break;
 
@@ -312,11 +379,10 @@ bool BitState::Search(absl::string_view text, absl::string_view context,
   for (int i = 0; i < nsubmatch_; i++)
     submatch_[i] = absl::string_view();
 
-  // Allocate scratch space.
+  // Acquire pooled scratch space: a fresh epoch in the visited pool
+  // empties the set without allocating or clearing anything.
   int nvisited = prog_->list_count() * static_cast<int>(text.size()+1);
-  nvisited = (nvisited + kVisitedBits-1) / kVisitedBits;
-  visited_ = PODArray<uint64_t>(nvisited);
-  memset(visited_.data(), 0, nvisited*sizeof visited_[0]);
+  visited_ = AcquireVisited(nvisited, &visited_epoch_);
 
   int ncap = 2*nsubmatch;
   if (ncap < 2)
@@ -325,7 +391,9 @@ bool BitState::Search(absl::string_view text, absl::string_view context,
   memset(cap_.data(), 0, ncap*sizeof cap_[0]);
 
   // When sizeof(Job) == 16, we start with a nice round 1KiB. :)
-  job_ = PODArray<Job>(64);
+  // The pooled stack keeps whatever capacity earlier searches grew to.
+  if (job_.size() < 64)
+    job_ = PODArray<Job>(64);
 
   // Anchored search must start at text.begin().
   if (anchored_) {
@@ -386,4 +454,13 @@ bool Prog::SearchBitState(absl::string_view text, absl::string_view context,
   return true;
 }
 
+void Prog::PrewarmBitState(int max_text_len) {
+  if (max_text_len < 0)
+    return;
+  EnsureVisited(list_count() * (max_text_len+1));
+  BitStateScratch* scratch = bitstate_scratch();
+  if (scratch->job.size() < 64)
+    scratch->job = PODArray<Job>(64);
+}
+
 }  // namespace re2
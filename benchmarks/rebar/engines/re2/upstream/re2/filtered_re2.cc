@@ -6,12 +6,14 @@
 
 #include <stddef.h>
 
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "absl/log/absl_log.h"
 #include "absl/strings/string_view.h"
+#include "re2/atom_scanner.h"
 #include "re2/prefilter.h"
 #include "re2/prefilter_tree.h"
 
@@ -34,10 +36,14 @@ FilteredRE2::~FilteredRE2() {
 
 FilteredRE2::FilteredRE2(FilteredRE2&& other)
     : re2_vec_(std::move(other.re2_vec_)),
+      match_cost_(std::move(other.match_cost_)),
       compiled_(other.compiled_),
-      prefilter_tree_(std::move(other.prefilter_tree_)) {
+      prefilter_tree_(std::move(other.prefilter_tree_)),
+      atom_scanner_(std::move(other.atom_scanner_)) {
   other.re2_vec_.clear();
   other.re2_vec_.shrink_to_fit();
+  other.match_cost_.clear();
+  other.match_cost_.shrink_to_fit();
   other.compiled_ = false;
   other.prefilter_tree_.reset(new PrefilterTree());
 }
@@ -85,6 +91,11 @@ void FilteredRE2::Compile(std::vector<std::string>* atoms) {
   }
   atoms->clear();
   prefilter_tree_->Compile(atoms);
+  atom_scanner_.reset(new AtomScanner());
+  atom_scanner_->Compile(*atoms);
+  match_cost_.resize(re2_vec_.size());
+  for (size_t i = 0; i < re2_vec_.size(); i++)
+    match_cost_[i] = re2_vec_[i]->ProgramSize();
   compiled_ = true;
 }
 
@@ -121,6 +132,99 @@ bool FilteredRE2::AllMatches(absl::string_view text,
   return !matching_regexps->empty();
 }
 
+int FilteredRE2::FirstMatch(absl::string_view text) const {
+  if (!compiled_) {
+    ABSL_LOG(DFATAL) << "FirstMatch called before Compile.";
+    return -1;
+  }
+  std::vector<int> atoms;
+  atom_scanner_->Scan(text, &atoms);
+  return FirstMatch(text, atoms);
+}
+
+bool FilteredRE2::AllMatches(absl::string_view text,
+                             std::vector<int>* matching_regexps) const {
+  if (!compiled_) {
+    ABSL_LOG(DFATAL) << "AllMatches called before Compile.";
+    matching_regexps->clear();
+    return false;
+  }
+  std::vector<int> atoms;
+  atom_scanner_->Scan(text, &atoms);
+  return AllMatches(text, atoms, matching_regexps);
+}
+
+int FilteredRE2::PriorityMatch(absl::string_view text,
+                               const std::vector<int>& atoms) const {
+  if (!compiled_) {
+    ABSL_LOG(DFATAL) << "PriorityMatch called before Compile.";
+    return -1;
+  }
+  std::vector<int> regexps;
+  prefilter_tree_->RegexpsGivenStrings(atoms, &regexps);
+  return PriorityMatchCandidates(text, &regexps);
+}
+
+int FilteredRE2::PriorityMatch(absl::string_view text) const {
+  if (!compiled_) {
+    ABSL_LOG(DFATAL) << "PriorityMatch called before Compile.";
+    return -1;
+  }
+  std::vector<int> atoms;
+  atom_scanner_->Scan(text, &atoms);
+  return PriorityMatch(text, atoms);
+}
+
+void FilteredRE2::PriorityMatchMany(
+    const std::vector<absl::string_view>& texts,
+    std::vector<int>* matches) const {
+  matches->clear();
+  if (!compiled_) {
+    ABSL_LOG(DFATAL) << "PriorityMatchMany called before Compile.";
+    matches->resize(texts.size(), -1);
+    return;
+  }
+  matches->reserve(texts.size());
+  std::vector<int> atoms;
+  std::vector<int> regexps;
+  for (size_t i = 0; i < texts.size(); i++) {
+    atom_scanner_->Scan(texts[i], &atoms);
+    prefilter_tree_->RegexpsGivenStrings(atoms, &regexps);
+    matches->push_back(PriorityMatchCandidates(texts[i], &regexps));
+  }
+}
+
+int FilteredRE2::PriorityMatchCandidates(absl::string_view text,
+                                         std::vector<int>* regexps) const {
+  // Cheapest first, breaking cost ties by index so that evaluation
+  // order is deterministic.
+  std::sort(regexps->begin(), regexps->end(), [this](int a, int b) {
+    if (match_cost_[a] != match_cost_[b])
+      return match_cost_[a] < match_cost_[b];
+    return a < b;
+  });
+  int best = -1;
+  for (size_t i = 0; i < regexps->size(); i++) {
+    int id = (*regexps)[i];
+    // Only a smaller index can improve on a match already found, so
+    // anything else - in particular every remaining candidate once the
+    // cheap ones have matched - is skipped without running its regexp.
+    if (best != -1 && id >= best)
+      continue;
+    if (RE2::PartialMatch(text, *re2_vec_[id]))
+      best = id;
+  }
+  return best;
+}
+
+int64_t FilteredRE2::FilterCalls() const {
+  return prefilter_tree_->filter_calls();
+}
+
+int64_t FilteredRE2::FilterCandidates() const {
+  return prefilter_tree_->filter_candidates();
+}
+
 void FilteredRE2::AllPotentials(const std::vector<int>& atoms,
                                 std::vector<int>* potential_regexps) const {
   prefilter_tree_->RegexpsGivenStrings(atoms, potential_regexps);
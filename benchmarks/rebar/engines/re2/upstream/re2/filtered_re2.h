@@ -21,6 +21,8 @@
 // or AllMatches with a vector of indices of strings that were found
 // in the text to get the actual regexp matches.
 
+#include <stdint.h>
+
 #include <memory>
 #include <string>
 #include <vector>
@@ -30,6 +32,7 @@
 
 namespace re2 {
 
+class AtomScanner;
 class PrefilterTree;
 
 class FilteredRE2 {
@@ -78,6 +81,34 @@ class FilteredRE2 {
                   const std::vector<int>& atoms,
                   std::vector<int>* matching_regexps) const;
 
+  // Variants of FirstMatch and AllMatches that find the atoms in the
+  // text themselves using a built-in vectorized multi-literal scanner
+  // (see AtomScanner), so the caller does not need to supply a string
+  // matching engine.  The text is matched case-insensitively; it does
+  // not need to be lowercased first.  Compile has to be called before
+  // calling these; its strings_to_match output may be ignored.
+  int FirstMatch(absl::string_view text) const;
+  bool AllMatches(absl::string_view text,
+                  std::vector<int>* matching_regexps) const;
+
+  // Like FirstMatch, returns the index of the first matching regexp in
+  // the order the regexps were added - the lowest matching index - or
+  // -1 on no match, but probes the candidates cheapest-first by
+  // compiled program size: an expensive regexp is only matched when no
+  // cheaper regexp with a smaller index has matched already.  Compile
+  // has to be called before calling these.  The single-argument form
+  // finds the atoms itself using the built-in scanner, like the
+  // single-argument FirstMatch.
+  int PriorityMatch(absl::string_view text,
+                    const std::vector<int>& atoms) const;
+  int PriorityMatch(absl::string_view text) const;
+
+  // Batched form of the single-argument PriorityMatch: after first
+  // clearing matches, stores the result for texts[i] in (*matches)[i],
+  // reusing scratch space across the texts.
+  void PriorityMatchMany(const std::vector<absl::string_view>& texts,
+                         std::vector<int>* matches) const;
+
   // Returns the indices of all potentially matching regexps after first
   // clearing potential_regexps.
   // A regexp is potentially matching if it passes the filter.
@@ -89,6 +120,13 @@ class FilteredRE2 {
   // The number of regexps added.
   int NumRegexps() const { return static_cast<int>(re2_vec_.size()); }
 
+  // Benchmark counters for prefilter effectiveness: how many filtered
+  // match calls ran and how many candidate regexps the prefilter
+  // passed to them in total, out of NumRegexps() each time.  Read them
+  // between runs, not while matches are in flight on other threads.
+  int64_t FilterCalls() const;
+  int64_t FilterCandidates() const;
+
   // Get the individual RE2 objects.
   const RE2& GetRE2(int regexpid) const { return *re2_vec_[regexpid]; }
 
@@ -96,6 +134,11 @@ class FilteredRE2 {
   // Print prefilter.
   void PrintPrefilter(int regexpid);
 
+  // Evaluates the candidate regexps cheapest-first for PriorityMatch.
+  // Reorders *regexps.
+  int PriorityMatchCandidates(absl::string_view text,
+                              std::vector<int>* regexps) const;
+
   // Useful for testing and debugging.
   void RegexpsGivenStrings(const std::vector<int>& matched_atoms,
                            std::vector<int>* passed_regexps);
@@ -103,11 +146,19 @@ class FilteredRE2 {
   // All the regexps in the FilteredRE2.
   std::vector<RE2*> re2_vec_;
 
+  // Static match cost of each regexp - its compiled program size -
+  // used by PriorityMatch to order candidate evaluation.
+  std::vector<int> match_cost_;
+
   // Has the FilteredRE2 been compiled using Compile()
   bool compiled_;
 
   // An AND-OR tree of string atoms used for filtering regexps.
   std::unique_ptr<PrefilterTree> prefilter_tree_;
+
+  // Scans texts for the atoms on behalf of callers that do not bring
+  // their own string matching engine.
+  std::unique_ptr<AtomScanner> atom_scanner_;
 };
 
 }  // namespace re2
@@ -29,6 +29,7 @@
 
 #include <algorithm>
 #include <deque>
+#include <memory>
 #include <string>
 #include <utility>
 
@@ -65,6 +66,9 @@ class NFA {
   bool Search(absl::string_view text, absl::string_view context, bool anchored,
               bool longest, absl::string_view* submatch, int nsubmatch);
 
+  // Sizes the calling thread's scratch pool for prog and nsubmatch.
+  static void Prewarm(Prog* prog, int nsubmatch);
+
  private:
   struct Thread {
     union {
@@ -85,6 +89,24 @@ class NFA {
   // choices appear earlier in the list.
   typedef SparseArray<Thread*> Threadq;
 
+  // The allocations that dominated the cost of short searches -- the
+  // thread queues, the AddToThreadq stack, the thread arena and the
+  // match array -- are pooled per thread in a Scratch and reused
+  // across searches, growing only when a larger Prog (or a search
+  // tracking more submatches) comes along.
+  struct Scratch;
+
+  // Returns the calling thread's cached Scratch (or a fresh one if the
+  // slot is empty) and puts it back, respectively.  The slot is
+  // emptied while an NFA holds the Scratch, so a nested NFA on the
+  // same thread would simply allocate its own.
+  static std::unique_ptr<Scratch>& ScratchSlot();
+  static Scratch* AcquireScratch();
+  static void ReleaseScratch(Scratch* scratch);
+
+  // Grows the capture arrays in scratch_ to hold ncapture pointers.
+  void EnsureCapture(int ncapture);
+
   inline Thread* AllocThread();
   inline Thread* Incref(Thread* t);
   inline void Decref(Thread* t);
@@ -120,17 +142,55 @@ class NFA {
   bool endmatch_;             // whether match must end at text.end()
   const char* btext_;         // beginning of text (for FormatSubmatch)
   const char* etext_;         // end of text (for endmatch_)
-  Threadq q0_, q1_;           // pre-allocated for Search.
-  PODArray<AddState> stack_;  // pre-allocated for AddToThreadq
-  std::deque<Thread> arena_;  // thread arena
-  Thread* freelist_;          // thread freelist
-  const char** match_;        // best match so far
+  Scratch* scratch_;          // pooled queues, stack and thread arena
+  const char** match_;        // best match so far (storage in scratch_)
   bool matched_;              // any match so far?
 
   NFA(const NFA&) = delete;
   NFA& operator=(const NFA&) = delete;
 };
 
+struct NFA::Scratch {
+  Scratch()
+      : freelist(NULL),
+        capture_size(0) {}
+
+  ~Scratch() {
+    for (const Thread& t : arena)
+      delete[] t.capture;
+  }
+
+  Threadq q0, q1;               // thread queues, sized to largest Prog seen
+  PODArray<AddState> stack;     // stack for AddToThreadq
+  std::deque<Thread> arena;     // thread arena
+  Thread* freelist;             // thread freelist
+  PODArray<const char*> match;  // storage for match_
+  int capture_size;             // capture array length of arena threads
+
+  Scratch(const Scratch&) = delete;
+  Scratch& operator=(const Scratch&) = delete;
+};
+
+std::unique_ptr<NFA::Scratch>& NFA::ScratchSlot() {
+  static thread_local std::unique_ptr<Scratch> scratch;
+  return scratch;
+}
+
+NFA::Scratch* NFA::AcquireScratch() {
+  std::unique_ptr<Scratch>& slot = ScratchSlot();
+  if (slot == nullptr)
+    return new Scratch;
+  return slot.release();
+}
+
+void NFA::ReleaseScratch(Scratch* scratch) {
+  std::unique_ptr<Scratch>& slot = ScratchSlot();
+  if (slot == nullptr)
+    slot.reset(scratch);
+  else
+    delete scratch;
+}
+
 NFA::NFA(Prog* prog) {
   prog_ = prog;
   start_ = prog_->start();
@@ -139,37 +199,58 @@ NFA::NFA(Prog* prog) {
   endmatch_ = false;
   btext_ = NULL;
   etext_ = NULL;
-  q0_.resize(prog_->size());
-  q1_.resize(prog_->size());
+  scratch_ = AcquireScratch();
+  if (scratch_->q0.max_size() < prog_->size()) {
+    scratch_->q0.resize(prog_->size());
+    scratch_->q1.resize(prog_->size());
+  }
   // See NFA::AddToThreadq() for why this is so.
   int nstack = 2*prog_->inst_count(kInstCapture) +
                prog_->inst_count(kInstEmptyWidth) +
                prog_->inst_count(kInstNop) + 1;  // + 1 for start inst
-  stack_ = PODArray<AddState>(nstack);
-  freelist_ = NULL;
+  if (scratch_->stack.size() < nstack)
+    scratch_->stack = PODArray<AddState>(nstack);
   match_ = NULL;
   matched_ = false;
 }
 
 NFA::~NFA() {
-  delete[] match_;
-  for (const Thread& t : arena_)
-    delete[] t.capture;
+  // No threads outlive the search, so every arena thread is free again;
+  // rebuild the freelist wholesale in case any refcounts went astray.
+  scratch_->freelist = NULL;
+  for (Thread& t : scratch_->arena) {
+    t.next = scratch_->freelist;
+    scratch_->freelist = &t;
+  }
+  ReleaseScratch(scratch_);
+}
+
+void NFA::EnsureCapture(int ncapture) {
+  if (scratch_->capture_size < ncapture) {
+    // The arena threads own capture arrays of the old size; drop them
+    // and let AllocThread() rebuild at the new size.
+    for (const Thread& t : scratch_->arena)
+      delete[] t.capture;
+    scratch_->arena.clear();
+    scratch_->freelist = NULL;
+    scratch_->capture_size = ncapture;
+    scratch_->match = PODArray<const char*>(ncapture);
+  }
 }
 
 NFA::Thread* NFA::AllocThread() {
-  Thread* t = freelist_;
+  Thread* t = scratch_->freelist;
   if (t != NULL) {
-    freelist_ = t->next;
+    scratch_->freelist = t->next;
     t->ref = 1;
     // We don't need to touch t->capture because
     // the caller will immediately overwrite it.
     return t;
   }
-  arena_.emplace_back();
-  t = &arena_.back();
+  scratch_->arena.emplace_back();
+  t = &scratch_->arena.back();
   t->ref = 1;
-  t->capture = new const char*[ncapture_];
+  t->capture = new const char*[scratch_->capture_size];
   return t;
 }
 
@@ -185,8 +266,8 @@ void NFA::Decref(Thread* t) {
   if (t->ref > 0)
     return;
   ABSL_DCHECK_EQ(t->ref, 0);
-  t->next = freelist_;
-  freelist_ = t;
+  t->next = scratch_->freelist;
+  scratch_->freelist = t;
 }
 
 // Follows all empty arrows from id0 and enqueues all the states reached.
@@ -198,19 +279,19 @@ void NFA::AddToThreadq(Threadq* q, int id0, int c, absl::string_view context,
   if (id0 == 0)
     return;
 
-  // Use stack_ to hold our stack of instructions yet to process.
-  // It was preallocated as follows:
+  // Use scratch_->stack to hold our stack of instructions yet to
+  // process.  It was preallocated as follows:
   //   two entries per Capture;
   //   one entry per EmptyWidth; and
   //   one entry per Nop.
   // This reflects the maximum number of stack pushes that each can
   // perform. (Each instruction can be processed at most once.)
-  AddState* stk = stack_.data();
+  AddState* stk = scratch_->stack.data();
   int nstk = 0;
 
   stk[nstk++] = {id0, NULL};
   while (nstk > 0) {
-    ABSL_DCHECK_LE(nstk, stack_.size());
+    ABSL_DCHECK_LE(nstk, scratch_->stack.size());
     AddState a = stk[--nstk];
 
   Loop:
@@ -487,7 +568,8 @@ bool NFA::Search(absl::string_view text, absl::string_view context,
     ncapture_ = 2;
   }
 
-  match_ = new const char*[ncapture_];
+  EnsureCapture(ncapture_);
+  match_ = scratch_->match.data();
   memset(match_, 0, ncapture_*sizeof match_[0]);
   matched_ = false;
 
@@ -501,8 +583,8 @@ bool NFA::Search(absl::string_view text, absl::string_view context,
                   text, context, anchored, longest);
 
   // Set up search.
-  Threadq* runq = &q0_;
-  Threadq* nextq = &q1_;
+  Threadq* runq = &scratch_->q0;
+  Threadq* nextq = &scratch_->q1;
   runq->clear();
   nextq->clear();
 
@@ -580,6 +662,14 @@ bool NFA::Search(absl::string_view text, absl::string_view context,
         p = reinterpret_cast<const char*>(prog_->PrefixAccel(p, etext_ - p));
         if (p == NULL)
           p = etext_;
+      } else if (!anchored && runq->size() == 0 &&
+                 p < etext_ && prog_->can_first_byte_accel()) {
+        // No required prefix, but few enough distinct bytes can begin a
+        // match that memchr(3) still beats stepping byte-by-byte.
+        p = reinterpret_cast<const char*>(
+            prog_->FirstByteAccel(p, etext_ - p));
+        if (p == NULL)
+          p = etext_;
       }
 
       Thread* t = AllocThread();
@@ -651,6 +741,21 @@ bool Prog::SearchNFA(absl::string_view text, absl::string_view context,
   return true;
 }
 
+void NFA::Prewarm(Prog* prog, int nsubmatch) {
+  // Constructing the NFA sizes the queues and the stack; see NFA::NFA().
+  NFA nfa(prog);
+  int ncapture = 2*nsubmatch;
+  if (ncapture < 2)
+    ncapture = 2;
+  nfa.EnsureCapture(ncapture);
+}
+
+void Prog::PrewarmNFA(int nsubmatch) {
+  if (nsubmatch < 0)
+    return;
+  NFA::Prewarm(this, nsubmatch);
+}
+
 // For each instruction i in the program reachable from the start, compute the
 // number of instructions reachable from i by following only empty transitions
 // and record that count as fanout[i].
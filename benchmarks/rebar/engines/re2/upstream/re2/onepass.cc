@@ -620,4 +620,79 @@ fail:
   return false;
 }
 
+// One-pass analysis caching.
+//
+// Deployments that compile the same pattern set at every process start
+// pay for the flood-and-check analysis above on each startup even
+// though its outcome never changes.  The routines below let a caller
+// save the outcome - a "not one-pass" verdict or the compiled one-pass
+// byte machine - and hand it back to an identical Prog in a later
+// process, skipping the analysis.  The blob is keyed by a fingerprint
+// of the program so a stale or foreign blob is rejected rather than
+// applied; it hashes raw Prog::Inst bytes and uses host-endian
+// integers, so it is only meaningful within the binary that wrote it.
+
+static const uint64_t kOnePassCacheMagic = 0x7265326f70303031ULL;  // "re2op001"
+
+// Fingerprints the fields of the program that the one-pass analysis
+// depends on, using 64-bit FNV-1a.  Kept in step with the DFA cache
+// fingerprint in dfa.cc, which hashes the same inputs plus a match
+// kind; the one-pass machine has no kind to distinguish.
+static uint64_t OnePassFingerprint(Prog* prog) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  auto mix = [&h](const void* p, size_t n) {
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(p);
+    for (size_t i = 0; i < n; i++) {
+      h ^= b[i];
+      h *= 0x100000001b3ULL;
+    }
+  };
+  int fields[] = {prog->size(),          prog->list_count(),
+                  prog->start(),         prog->start_unanchored(),
+                  prog->bytemap_range(), prog->anchor_start(),
+                  prog->anchor_end()};
+  mix(fields, sizeof(fields));
+  mix(prog->bytemap(), 256);
+  for (int i = 0; i < prog->size(); i++)
+    mix(prog->inst(i), sizeof(Prog::Inst));
+  return h;
+}
+
+void Prog::SerializeOnePass(std::string* out) {
+  uint64_t nodes_size = IsOnePass() ? onepass_nodes_.size() : 0;
+  uint64_t header[3] = {kOnePassCacheMagic, OnePassFingerprint(this),
+                        nodes_size};
+  out->append(reinterpret_cast<const char*>(header), sizeof(header));
+  if (nodes_size > 0)
+    out->append(reinterpret_cast<const char*>(onepass_nodes_.data()),
+                static_cast<size_t>(nodes_size));
+}
+
+bool Prog::RestoreOnePass(absl::string_view data) {
+  if (did_onepass_)
+    return false;
+  uint64_t header[3];
+  if (data.size() < sizeof(header))
+    return false;
+  memcpy(header, data.data(), sizeof(header));
+  if (header[0] != kOnePassCacheMagic ||
+      header[1] != OnePassFingerprint(this) ||
+      data.size() != sizeof(header) + header[2])
+    return false;
+  size_t nodes_size = static_cast<size_t>(header[2]);
+  if (nodes_size > 0) {
+    // Mirror the memory budget accounting in IsOnePass(): the one-pass
+    // NFA may steal at most 1/4 of the DFA budget.  If this Prog was
+    // configured with a smaller budget than the one that produced the
+    // blob, fall back to running the analysis so the limits still hold.
+    if (static_cast<int64_t>(nodes_size) > dfa_mem_ / 4)
+      return false;
+    dfa_mem_ -= nodes_size;
+    onepass_nodes_ = PODArray<uint8_t>(static_cast<int>(nodes_size));
+    memcpy(onepass_nodes_.data(), data.data() + sizeof(header), nodes_size);
+  }
+  did_onepass_ = true;
+  return true;
+}
+
 }  // namespace re2
@@ -1451,6 +1451,10 @@ static int StringViewToRune(Rune* r, absl::string_view* sp,
 // Returns whether name is valid UTF-8.
 // If not, sets status to kRegexpBadUTF8.
 static bool IsValidUTF8(absl::string_view s, RegexpStatus* status) {
+  // utfvalid checks blocks of bytes at a time and accepts exactly the
+  // strings the loop below would; the loop only runs to set status.
+  if (utfvalid(s.data(), s.size()))
+    return true;
   absl::string_view t = s;
   Rune r;
   while (!t.empty()) {
@@ -2281,11 +2285,17 @@ Regexp* Regexp::Parse(absl::string_view s, ParseFlags global_flags,
   }
 
   if (global_flags & Literal) {
-    // Special parse loop for literal string.
+    // Special parse loop for literal string.  Validating the whole
+    // string up front lets the loop decode with bare chartorune: no
+    // per-rune truncation probe and no Runemax patch-up.
+    if (!IsValidUTF8(t, status))
+      return NULL;
     while (!t.empty()) {
-      Rune r;
-      if (StringViewToRune(&r, &t, status) < 0)
-        return NULL;
+      Rune r = *reinterpret_cast<const unsigned char*>(t.data());
+      int n = 1;
+      if (r >= Runeself)
+        n = chartorune(&r, t.data());
+      t.remove_prefix(n);
       if (!ps.PushLiteral(r))
         return NULL;
     }
@@ -294,6 +294,9 @@ void PrefilterTree::RegexpsGivenStrings(
     regexps->insert(regexps->end(), unfiltered_.begin(), unfiltered_.end());
   }
   std::sort(regexps->begin(), regexps->end());
+  filter_calls_.fetch_add(1, std::memory_order_relaxed);
+  filter_candidates_.fetch_add(static_cast<int64_t>(regexps->size()),
+                               std::memory_order_relaxed);
 }
 
 void PrefilterTree::PropagateMatch(const std::vector<int>& atom_ids,
@@ -16,6 +16,9 @@
 // atoms) that the user of this class should use to do the string
 // matching.
 
+#include <stdint.h>
+
+#include <atomic>
 #include <string>
 #include <vector>
 
@@ -58,6 +61,17 @@ class PrefilterTree {
   // nodes of the prefilter of the regexp.
   void PrintPrefilter(int regexpid);
 
+  // Benchmark counters: how many times RegexpsGivenStrings ran and how
+  // many candidate regexps it passed in total, out of the number of
+  // regexps added each time.  Together they give the filter hit rate.
+  // Approximate when searches run concurrently.
+  int64_t filter_calls() const {
+    return filter_calls_.load(std::memory_order_relaxed);
+  }
+  int64_t filter_candidates() const {
+    return filter_candidates_.load(std::memory_order_relaxed);
+  }
+
  private:
   using IntMap = SparseArray<int>;
 
@@ -144,6 +158,10 @@ class PrefilterTree {
   // Strings less than this length are not stored as atoms.
   const int min_atom_len_;
 
+  // Benchmark counters; mutable because RegexpsGivenStrings is const.
+  mutable std::atomic<int64_t> filter_calls_{0};
+  mutable std::atomic<int64_t> filter_candidates_{0};
+
   PrefilterTree(const PrefilterTree&) = delete;
   PrefilterTree& operator=(const PrefilterTree&) = delete;
 };
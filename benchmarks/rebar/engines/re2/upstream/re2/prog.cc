@@ -123,6 +123,7 @@ Prog::Prog()
     bytemap_range_(0),
     prefix_foldcase_(false),
     prefix_size_(0),
+    first_byte_size_(0),
     list_count_(0),
     bit_state_text_max_size_(0),
     dfa_mem_(0),
@@ -1036,6 +1037,239 @@ void Prog::ConfigurePrefixAccel(const std::string& prefix,
   }
 }
 
+// Adds c to the set of (at most two) first bytes.
+// Returns false if that would make the set too big.
+static bool AddFirstByte(int* bytes, int* nbytes, int c) {
+  for (int i = 0; i < *nbytes; i++) {
+    if (bytes[i] == c)
+      return true;
+  }
+  if (*nbytes == 2)
+    return false;
+  bytes[(*nbytes)++] = c;
+  return true;
+}
+
+void Prog::ConfigureFirstByteAccel() {
+  if (start() == 0)
+    return;
+
+  int nbytes = 0;
+  int bytes[2];
+  SparseSet reachable(size());
+  reachable.insert(start());
+  for (SparseSet::iterator i = reachable.begin(); i != reachable.end(); ++i) {
+    int id = *i;
+    Prog::Inst* ip = inst(id);
+    switch (ip->opcode()) {
+      default:
+        ABSL_LOG(DFATAL) << "unhandled " << ip->opcode()
+                         << " in Prog::ConfigureFirstByteAccel()";
+        return;
+
+      case kInstByteRange:
+        if (!ip->last())
+          reachable.insert(id+1);
+
+        for (int c = ip->lo(); c <= ip->hi(); c++) {
+          if (!AddFirstByte(bytes, &nbytes, c))
+            return;
+          if (ip->foldcase() && 'a' <= c && c <= 'z' &&
+              !AddFirstByte(bytes, &nbytes, c + 'A' - 'a'))
+            return;
+        }
+        break;
+
+      case kInstAltMatch:
+      case kInstMatch:
+        // The empty string could be a match, so no position may be skipped.
+        return;
+
+      case kInstCapture:
+      case kInstEmptyWidth:
+      case kInstNop:
+        if (!ip->last())
+          reachable.insert(id+1);
+
+        // Note that we ignore the flag bits required by EmptyWidth
+        // instructions, which makes the set of first bytes a superset
+        // of the bytes that could actually begin a match. That errs on
+        // the side of not skipping, so it is safe.
+        reachable.insert(ip->out());
+        break;
+
+      case kInstFail:
+        break;
+    }
+  }
+
+  first_byte_size_ = nbytes;
+  for (int i = 0; i < nbytes; i++)
+    first_byte_[i] = bytes[i];
+}
+
+// A serialized program image is a ProgImageHeader followed by the raw
+// bytes of the instruction array, the bit-state list heads, the cached
+// one-pass nodes and, for a case-insensitive prefix, the shift DFA
+// table, in that order.  The header carries every scalar field needed
+// to reconstruct the Prog, so validation amounts to checking the magic
+// number and the sizes against each other; the tables are then copied
+// in bulk.  All integers are host-endian.
+static const uint64_t kProgImageMagic = 0x7265327072673031ULL;  // re2prg01
+
+struct ProgImageHeader {
+  uint64_t magic;
+  uint64_t total_size;          // size of the entire image in bytes
+  uint32_t flags;               // kImage* bits below
+  int32_t start;
+  int32_t start_unanchored;
+  int32_t size;                 // number of instructions
+  int32_t bytemap_range;
+  int32_t list_count;
+  int32_t inst_count[kNumInst];
+  int32_t prefix_front;
+  int32_t prefix_back;
+  int32_t first_byte_size;
+  int32_t first_byte[2];
+  int32_t unused;               // keeps the uint64_t fields aligned
+  uint64_t prefix_size;
+  uint64_t bit_state_text_max_size;
+  int64_t dfa_mem;
+  uint64_t list_heads_size;     // bytes
+  uint64_t onepass_nodes_size;  // bytes
+  uint8_t bytemap[256];
+};
+
+enum {
+  kImageAnchorStart = 1<<0,
+  kImageAnchorEnd = 1<<1,
+  kImageReversed = 1<<2,
+  kImageDidOnePass = 1<<3,
+  kImagePrefixFoldcase = 1<<4,
+};
+
+void Prog::SerializeImage(std::string* out) {
+  ABSL_DCHECK(did_flatten_);
+
+  ProgImageHeader hdr;
+  memset(&hdr, 0, sizeof hdr);
+  hdr.magic = kProgImageMagic;
+  hdr.flags = (anchor_start_ ? kImageAnchorStart : 0) |
+              (anchor_end_ ? kImageAnchorEnd : 0) |
+              (reversed_ ? kImageReversed : 0) |
+              (did_onepass_ ? kImageDidOnePass : 0) |
+              (prefix_foldcase_ ? kImagePrefixFoldcase : 0);
+  hdr.start = start_;
+  hdr.start_unanchored = start_unanchored_;
+  hdr.size = size_;
+  hdr.bytemap_range = bytemap_range_;
+  hdr.list_count = list_count_;
+  memcpy(hdr.inst_count, inst_count_, sizeof inst_count_);
+  if (prefix_size_ != 0 && !prefix_foldcase_) {
+    hdr.prefix_front = prefix_front_;
+    hdr.prefix_back = prefix_back_;
+  }
+  hdr.first_byte_size = first_byte_size_;
+  for (int i = 0; i < first_byte_size_; i++)
+    hdr.first_byte[i] = first_byte_[i];
+  hdr.prefix_size = prefix_size_;
+  hdr.bit_state_text_max_size = bit_state_text_max_size_;
+  hdr.dfa_mem = dfa_mem_;
+  hdr.list_heads_size = list_heads_.size()*sizeof(uint16_t);
+  hdr.onepass_nodes_size = onepass_nodes_.size();
+  size_t inst_size = size_*sizeof(Inst);
+  size_t prefix_dfa_size = prefix_foldcase_ ? 256*sizeof(uint64_t) : 0;
+  hdr.total_size = sizeof hdr + inst_size + hdr.list_heads_size +
+                   hdr.onepass_nodes_size + prefix_dfa_size;
+  memcpy(hdr.bytemap, bytemap_, sizeof bytemap_);
+
+  out->append(reinterpret_cast<const char*>(&hdr), sizeof hdr);
+  out->append(reinterpret_cast<const char*>(inst_.data()), inst_size);
+  if (hdr.list_heads_size != 0)
+    out->append(reinterpret_cast<const char*>(list_heads_.data()),
+                hdr.list_heads_size);
+  if (hdr.onepass_nodes_size != 0)
+    out->append(reinterpret_cast<const char*>(onepass_nodes_.data()),
+                hdr.onepass_nodes_size);
+  if (prefix_dfa_size != 0)
+    out->append(reinterpret_cast<const char*>(prefix_dfa_), prefix_dfa_size);
+}
+
+Prog* Prog::LoadImage(absl::string_view image) {
+  ProgImageHeader hdr;
+  if (image.size() < sizeof hdr)
+    return NULL;
+  memcpy(&hdr, image.data(), sizeof hdr);
+  if (hdr.magic != kProgImageMagic ||
+      hdr.total_size != image.size())
+    return NULL;
+  if (hdr.size <= 0 || hdr.size > Inst::kMaxInst ||
+      hdr.start < 0 || hdr.start >= hdr.size ||
+      hdr.start_unanchored < 0 || hdr.start_unanchored >= hdr.size ||
+      hdr.bytemap_range < 1 || hdr.bytemap_range > 256 ||
+      hdr.list_count < 0 ||
+      hdr.first_byte_size < 0 || hdr.first_byte_size > 2)
+    return NULL;
+  size_t inst_size = hdr.size*sizeof(Inst);
+  size_t prefix_dfa_size =
+      (hdr.flags & kImagePrefixFoldcase) ? 256*sizeof(uint64_t) : 0;
+  if (hdr.list_heads_size != 0 &&
+      hdr.list_heads_size != hdr.size*sizeof(uint16_t))
+    return NULL;
+  if (hdr.onepass_nodes_size > (uint64_t{1} << 30))
+    return NULL;
+  if (image.size() != sizeof hdr + inst_size + hdr.list_heads_size +
+                          hdr.onepass_nodes_size + prefix_dfa_size)
+    return NULL;
+
+  Prog* prog = new Prog();
+  prog->anchor_start_ = (hdr.flags & kImageAnchorStart) != 0;
+  prog->anchor_end_ = (hdr.flags & kImageAnchorEnd) != 0;
+  prog->reversed_ = (hdr.flags & kImageReversed) != 0;
+  prog->did_flatten_ = true;
+  prog->did_onepass_ = (hdr.flags & kImageDidOnePass) != 0;
+  prog->start_ = hdr.start;
+  prog->start_unanchored_ = hdr.start_unanchored;
+  prog->size_ = hdr.size;
+  prog->bytemap_range_ = hdr.bytemap_range;
+  prog->list_count_ = hdr.list_count;
+  memcpy(prog->inst_count_, hdr.inst_count, sizeof prog->inst_count_);
+  memcpy(prog->bytemap_, hdr.bytemap, sizeof prog->bytemap_);
+  prog->prefix_size_ = hdr.prefix_size;
+  prog->first_byte_size_ = hdr.first_byte_size;
+  for (int i = 0; i < hdr.first_byte_size; i++)
+    prog->first_byte_[i] = hdr.first_byte[i];
+  prog->bit_state_text_max_size_ = hdr.bit_state_text_max_size;
+  prog->dfa_mem_ = hdr.dfa_mem;
+
+  const char* p = image.data() + sizeof hdr;
+  prog->inst_ = PODArray<Inst>(hdr.size);
+  memcpy(prog->inst_.data(), p, inst_size);
+  p += inst_size;
+  if (hdr.list_heads_size != 0) {
+    prog->list_heads_ = PODArray<uint16_t>(hdr.size);
+    memcpy(prog->list_heads_.data(), p, hdr.list_heads_size);
+    p += hdr.list_heads_size;
+  }
+  if (hdr.onepass_nodes_size != 0) {
+    prog->onepass_nodes_ =
+        PODArray<uint8_t>(static_cast<int>(hdr.onepass_nodes_size));
+    memcpy(prog->onepass_nodes_.data(), p, hdr.onepass_nodes_size);
+    p += hdr.onepass_nodes_size;
+  }
+  if (prefix_dfa_size != 0) {
+    // The union means prefix_dfa_ and prefix_front_/prefix_back_ are
+    // mutually exclusive, just as in ConfigurePrefixAccel().
+    prog->prefix_foldcase_ = true;
+    prog->prefix_dfa_ = new uint64_t[256];
+    memcpy(prog->prefix_dfa_, p, prefix_dfa_size);
+  } else if (hdr.prefix_size != 0) {
+    prog->prefix_front_ = hdr.prefix_front;
+    prog->prefix_back_ = hdr.prefix_back;
+  }
+  return prog;
+}
+
 const void* Prog::PrefixAccel_ShiftDFA(const void* data, size_t size) {
   if (size < prefix_size_)
     return NULL;
@@ -269,6 +269,32 @@ class Prog {
   // prefix_back_ to return fewer false positives than memchr(3) alone.
   const void* PrefixAccel_FrontAndBack(const void* data, size_t size);
 
+  bool can_first_byte_accel() { return first_byte_size_ != 0; }
+
+  // Accelerates to the first byte that could begin a match.
+  // Returns a pointer to that byte or NULL if not found.
+  // Only configured when prefix accel is unavailable.
+  const void* FirstByteAccel(const void* data, size_t size) {
+    ABSL_DCHECK(can_first_byte_accel());
+    const void* p0 = memchr(data, first_byte_[0], size);
+    if (first_byte_size_ == 1)
+      return p0;
+    // Don't bother searching beyond the occurrence (if any) of the
+    // first byte for the occurrence of the second byte.
+    if (p0 != NULL)
+      size = reinterpret_cast<const char*>(p0) -
+             reinterpret_cast<const char*>(data);
+    const void* p1 = memchr(data, first_byte_[1], size);
+    return p1 != NULL ? p1 : p0;
+  }
+
+  // Configures first byte accel by walking the empty transitions from the
+  // start instruction and collecting the bytes that the ByteRange
+  // instructions reached can match. Does nothing if more than two distinct
+  // bytes (e.g. a case pair) could begin a match or if the empty string
+  // could be a match.
+  void ConfigureFirstByteAccel();
+
   // Returns string representation of program for debugging.
   std::string Dump();
   std::string DumpUnanchored();
@@ -311,6 +337,15 @@ class Prog {
                  Anchor anchor, MatchKind kind, absl::string_view* match,
                  int nmatch);
 
+  // Sizes the calling thread's NFA scratch pool so that SearchNFA on
+  // this Prog reuses its queues, stacks and thread arena instead of
+  // allocating them per search, for searches tracking up to nsubmatch
+  // submatches.  Purely an optimization; the pool grows on demand
+  // either way.  Per-thread: call it on the thread that will run the
+  // searches.  (The thread arena itself still grows during the first
+  // few searches and is then retained.)
+  void PrewarmNFA(int nsubmatch);
+
   // Search using DFA: much faster than NFA but only finds
   // end of match and can use a lot more memory.
   // Returns whether a match was found.
@@ -321,6 +356,16 @@ class Prog {
                  Anchor anchor, MatchKind kind, absl::string_view* match0,
                  bool* failed, SparseSet* matches);
 
+  // Counters accumulated by this Prog's DFAs, for benchmark reporting:
+  // the number of States built (state cache misses) and the number of
+  // times a full state cache was discarded.  Read them between runs,
+  // not while searches are in flight on other threads.
+  struct DFAStats {
+    int64_t states_built;
+    int64_t cache_resets;
+  };
+  DFAStats GetDFAStats();
+
   // The callback issued after building each DFA state with BuildEntireDFA().
   // If next is null, then the memory budget has been exhausted and building
   // will halt. Otherwise, the state has been built and next points to an array
@@ -352,6 +397,32 @@ class Prog {
                      Anchor anchor, MatchKind kind, absl::string_view* match,
                      int nmatch);
 
+  // One-pass analysis caching.  SerializeOnePass() runs IsOnePass() if
+  // it has not run yet and appends an opaque blob recording its outcome
+  // (including the one-pass byte machine, if any) to *out.
+  // RestoreOnePass() hands such a blob back to an identical Prog,
+  // typically in a later process of the same binary, making IsOnePass()
+  // immediate.  Returns false and leaves the Prog unchanged if the blob
+  // does not belong to this Prog (or to this binary) or if the analysis
+  // has already run, in which case IsOnePass() proceeds as usual.
+  // The blob holds host-endian integers and raw instruction bytes, so
+  // it must not be reused across machines or binary versions.
+  void SerializeOnePass(std::string* out);
+  bool RestoreOnePass(absl::string_view data);
+
+  // Whole-program serialization.  SerializeImage() appends a flat image
+  // of the compiled program to *out: a fixed header followed by the raw
+  // instruction array and the other index-based tables.  LoadImage()
+  // reconstructs an equivalent Prog from such an image, typically read
+  // or mapped from a file by a later process of the same binary, so the
+  // patterns need not be parsed and compiled again.  Validation is a
+  // handful of header checks; the tables are then copied in bulk.
+  // Returns NULL if the image is malformed.  Like the one-pass blob,
+  // the image holds host-endian integers and raw instruction bytes, so
+  // it must not be reused across machines or binary versions.
+  void SerializeImage(std::string* out);
+  static Prog* LoadImage(absl::string_view image);
+
   // Bit-state backtracking.  Fast on small cases but uses memory
   // proportional to the product of the list count and the text size.
   bool CanBitState() { return list_heads_.data() != NULL; }
@@ -359,6 +430,13 @@ class Prog {
                       Anchor anchor, MatchKind kind, absl::string_view* match,
                       int nmatch);
 
+  // Sizes the calling thread's bit-state scratch pool so that
+  // SearchBitState on this Prog needs no allocation for texts up to
+  // max_text_len bytes.  Purely an optimization; the pool grows on
+  // demand either way.  Per-thread: call it on the thread that will
+  // run the searches.
+  void PrewarmBitState(int max_text_len);
+
   static const int kMaxOnePassCapture = 5;  // $0 through $4
 
   // Backtracking search: the gold standard against which the other
@@ -455,6 +533,9 @@ class Prog {
     };
   };
 
+  int first_byte_size_;     // count of distinct first bytes (0 if none)
+  int first_byte_[2];       // bytes that could begin a match
+
   int list_count_;                  // count of lists (see above)
   int inst_count_[kNumInst];        // count of instructions by opcode
   PODArray<uint16_t> list_heads_;   // sparse array enumerating list heads
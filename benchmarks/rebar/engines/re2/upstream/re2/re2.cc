@@ -335,6 +335,26 @@ int RE2::ReverseProgramSize() const {
   return prog->size();
 }
 
+int64_t RE2::DFAStatesBuilt() const {
+  // Reads rprog_ directly rather than calling ReverseProg() so that
+  // collecting stats never builds the reverse program.
+  int64_t n = 0;
+  if (prog_ != NULL)
+    n += prog_->GetDFAStats().states_built;
+  if (rprog_ != NULL)
+    n += rprog_->GetDFAStats().states_built;
+  return n;
+}
+
+int64_t RE2::DFACacheResets() const {
+  int64_t n = 0;
+  if (prog_ != NULL)
+    n += prog_->GetDFAStats().cache_resets;
+  if (rprog_ != NULL)
+    n += rprog_->GetDFAStats().cache_resets;
+  return n;
+}
+
 // Finds the most significant non-zero bit in n.
 static int FindMSBSet(uint32_t n) {
   ABSL_DCHECK_NE(n, uint32_t{0});
@@ -447,6 +467,58 @@ bool RE2::FindAndConsumeN(absl::string_view* input, const RE2& re,
   }
 }
 
+RE2::MatchIterator::MatchIterator(const RE2& re, absl::string_view text)
+    : MatchIterator(re, text, 0, text.size()) {}
+
+RE2::MatchIterator::MatchIterator(const RE2& re, absl::string_view text,
+                                  size_t startpos, size_t endpos)
+    : re_(re),
+      text_(text),
+      pos_(startpos),
+      endpos_(endpos),
+      lastend_(NULL) {}
+
+bool RE2::MatchIterator::Next(absl::string_view* match) {
+  return Next(match, 1);
+}
+
+bool RE2::MatchIterator::Next(absl::string_view* submatch, int nsubmatch) {
+  while (pos_ <= endpos_) {
+    if (!re_.Match(text_, pos_, endpos_, UNANCHORED, submatch, nsubmatch))
+      break;
+    absl::string_view m = submatch[0];
+    if (m.data() == lastend_ && m.empty()) {
+      // Disallow empty match at end of last match: skip ahead.
+      // This mirrors the logic in GlobalReplace(); see there for
+      // the details of the rune decoding.
+      const char* p = text_.data() + pos_;
+      const char* ep = text_.data() + endpos_;
+      if (re_.options().encoding() == RE2::Options::EncodingUTF8 &&
+          fullrune(p, static_cast<int>(std::min(ptrdiff_t{4}, ep - p)))) {
+        Rune r;
+        int n = chartorune(&r, p);
+        if (r > Runemax) {
+          n = 1;
+          r = Runeerror;
+        }
+        if (!(n == 1 && r == Runeerror)) {  // no decoding error
+          pos_ += n;
+          continue;
+        }
+      }
+      pos_++;
+      continue;
+    }
+    pos_ = static_cast<size_t>(m.data() + m.size() - text_.data());
+    lastend_ = m.data() + m.size();
+    return true;
+  }
+  // Ensure that subsequent calls fail fast instead of rescanning the
+  // matchless tail of the haystack.
+  pos_ = endpos_ + 1;
+  return false;
+}
+
 bool RE2::Replace(std::string* str,
                   const RE2& re,
                   absl::string_view rewrite) {
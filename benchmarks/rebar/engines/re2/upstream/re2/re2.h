@@ -240,6 +240,7 @@ class RE2 {
  public:
   // We convert user-passed pointers into special Arg objects
   class Arg;
+  class MatchIterator;
   class Options;
 
   // Defined in set.h.
@@ -334,6 +335,14 @@ class RE2 {
   int ProgramFanout(std::vector<int>* histogram) const;
   int ReverseProgramFanout(std::vector<int>* histogram) const;
 
+  // Benchmark counters accumulated by the underlying DFAs since this
+  // RE2 was compiled: the number of DFA states built (state cache
+  // misses) and the number of times a full state cache was discarded,
+  // summed over the forward and reverse programs.  Read them between
+  // runs, not while searches are in flight on other threads.
+  int64_t DFAStatesBuilt() const;
+  int64_t DFACacheResets() const;
+
   // Returns the underlying Regexp; not for general use.
   // Returns entire_regexp_ so that callers don't need
   // to know about prefix_ and prefix_foldcase_.
@@ -464,6 +473,11 @@ class RE2 {
     return Apply(FindAndConsumeN, input, re, Arg(std::forward<A>(a))...);
   }
 
+  // To walk every match in a large haystack, prefer RE2::MatchIterator
+  // (below) over calling FindAndConsume() in a loop: it yields the
+  // non-overlapping matches in one left-to-right pass without parsing
+  // arguments per hit and it will not loop forever on an empty match.
+
   // Replace the first match of "re" in "str" with "rewrite".
   // Within "rewrite", backslash-escaped digits (\1 to \9) can be
   // used to insert text matching corresponding parenthesized group
@@ -810,6 +824,51 @@ class RE2 {
   mutable absl::once_flag group_names_once_;
 };
 
+// An RE2::MatchIterator walks every non-overlapping match of a regexp
+// in a haystack, scanning left to right in a single pass.  The position
+// carries from one match to the next, so the skip-ahead acceleration
+// inside the engines (memchr et al.) resumes where the previous match
+// ended instead of re-entering the convenience interfaces per hit.
+// An empty match abutting the end of the previous match is skipped by
+// advancing one rune (or byte), exactly as GlobalReplace() does, so
+// iteration always terminates.
+//
+// Sample usage:
+//   RE2::MatchIterator it(re, text);
+//   absl::string_view word;
+//   while (it.Next(&word)) { ... }
+//
+// The iterator refers to both re and text, which must outlive it.
+class RE2::MatchIterator {
+ public:
+  // Iterates over the matches in all of text.
+  MatchIterator(const RE2& re, absl::string_view text);
+
+  // Iterates over the matches in text[startpos, endpos).
+  MatchIterator(const RE2& re, absl::string_view text,
+                size_t startpos, size_t endpos);
+
+  // Not copyable.
+  MatchIterator(const MatchIterator&) = delete;
+  MatchIterator& operator=(const MatchIterator&) = delete;
+
+  // Stores the next match in *match.
+  // Returns false when no matches remain.
+  bool Next(absl::string_view* match);
+
+  // Like Next(), but also stores the submatches in
+  // submatch[1..nsubmatch-1] as RE2::Match() would.
+  // nsubmatch must be at least 1; submatch[0] is the entire match.
+  bool Next(absl::string_view* submatch, int nsubmatch);
+
+ private:
+  const RE2& re_;
+  absl::string_view text_;
+  size_t pos_;            // where the next search begins
+  size_t endpos_;
+  const char* lastend_;   // end of the previous match (or NULL)
+};
+
 /***** Implementation details *****/
 
 namespace re2_internal {
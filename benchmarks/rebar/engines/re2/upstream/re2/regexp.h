@@ -485,6 +485,12 @@ class Regexp {
   // Constructor allocates vectors as appropriate for operator.
   explicit Regexp(RegexpOp op, ParseFlags parse_flags);
 
+  // Regexp nodes are small, numerous and allocated in bursts during
+  // parsing, so they come from a dedicated node pool (see regexp.cc)
+  // instead of the general-purpose heap.
+  void* operator new(size_t size);
+  void operator delete(void* p);
+
   // Use Decref() instead of delete to release Regexps.
   // This is private to catch deletes at compile time.
   ~Regexp();
@@ -5,6 +5,8 @@
 #include "re2/set.h"
 
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 #include <algorithm>
 #include <memory>
@@ -130,6 +132,45 @@ bool RE2::Set::Compile() {
   return prog_ != nullptr;
 }
 
+// A serialized set image is the magic number, the anchor and the
+// pattern count, followed by the program image; see Prog::SerializeImage()
+// for the layout and caveats of the latter.
+static const uint64_t kSetImageMagic = 0x7265327365743031ULL;  // re2set01
+
+bool RE2::Set::Serialize(std::string* out) const {
+  if (!compiled_) {
+    ABSL_LOG(DFATAL) << "RE2::Set::Serialize() called before compiling";
+    return false;
+  }
+  uint64_t hdr[3] = {kSetImageMagic, static_cast<uint64_t>(anchor_),
+                     static_cast<uint64_t>(size_)};
+  out->append(reinterpret_cast<const char*>(hdr), sizeof hdr);
+  prog_->SerializeImage(out);
+  return true;
+}
+
+bool RE2::Set::Deserialize(absl::string_view image) {
+  if (compiled_) {
+    ABSL_LOG(DFATAL) << "RE2::Set::Deserialize() called after compiling";
+    return false;
+  }
+  uint64_t hdr[3];
+  if (image.size() < sizeof hdr)
+    return false;
+  memcpy(hdr, image.data(), sizeof hdr);
+  if (hdr[0] != kSetImageMagic ||
+      hdr[1] != static_cast<uint64_t>(anchor_) ||
+      hdr[2] > uint64_t{0x7FFFFFFF})
+    return false;
+  re2::Prog* prog = Prog::LoadImage(image.substr(sizeof hdr));
+  if (prog == NULL)
+    return false;
+  compiled_ = true;
+  size_ = static_cast<int>(hdr[2]);
+  prog_.reset(prog);
+  return true;
+}
+
 bool RE2::Set::Match(absl::string_view text, std::vector<int>* v) const {
   return Match(text, v, NULL);
 }
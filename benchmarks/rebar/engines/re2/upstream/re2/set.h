@@ -63,6 +63,20 @@ class RE2::Set {
   // Compile() must be called before Match().
   bool Compile();
 
+  // Serializes the compiled set into a flat image that can be written
+  // to a file and later handed to Deserialize(), so the patterns need
+  // not be parsed and compiled again on every process start.
+  // Returns false if Compile() has not been called.
+  bool Serialize(std::string* out) const;
+
+  // Restores a set from an image produced by Serialize(), in place of
+  // Add() and Compile(). The set must have been constructed with the
+  // same options and anchor used to compile the image. Returns false
+  // if the image is malformed. The image holds host-endian integers
+  // and raw instruction bytes, so it must not be reused across
+  // machines or binary versions; see Prog::SerializeImage().
+  bool Deserialize(absl::string_view image);
+
   // Returns true if text matches at least one of the regexps in the set.
   // Fills v (if not NULL) with the indices of the matching regexps.
   // Callers must not expect v to be sorted.
@@ -7,10 +7,14 @@
 // Also sort and simplify character classes.
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include <algorithm>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "absl/container/flat_hash_map.h"
 #include "absl/log/absl_log.h"
 #include "absl/strings/string_view.h"
 #include "re2/pod_array.h"
@@ -132,13 +136,55 @@ class CoalesceWalker : public Regexp::Walker<Regexp*> {
   CoalesceWalker& operator=(const CoalesceWalker&) = delete;
 };
 
+// A structural signature of a subexpression: a hash of the fields that
+// Regexp::Equal compares and the size of the subexpression in nodes.
+struct Signature {
+  uint64_t hash;
+  int nodes;
+};
+
+// Memoizing the simplification of a subexpression saves walking and
+// rebuilding it, but finding it again costs a hash lookup plus a
+// Regexp::Equal check, so only subexpressions of at least this many
+// nodes are worth remembering.
+static const int kMinMemoNodes = 12;
+
+// Walker subclass used by Simplify.
+// Computes a structural signature for every subexpression, bottom-up, and
+// records the signatures of substantial ones in a map keyed by the Regexp*.
+// The hash folds in exactly the fields that Regexp::Equal compares, so
+// equal subexpressions always have equal hashes and unequal ones rarely
+// collide.  The simplify walk uses the map to recognize repeated
+// subexpressions in a hash lookup.
+class SignatureWalker : public Regexp::Walker<Signature> {
+ public:
+  explicit SignatureWalker(absl::flat_hash_map<Regexp*, Signature>* sig)
+      : sig_(sig) {}
+  virtual Signature PreVisit(Regexp* re, Signature parent_arg, bool* stop);
+  virtual Signature PostVisit(Regexp* re, Signature parent_arg,
+                              Signature pre_arg, Signature* child_args,
+                              int nchild_args);
+  virtual Signature ShortVisit(Regexp* re, Signature parent_arg);
+
+ private:
+  absl::flat_hash_map<Regexp*, Signature>* sig_;
+
+  SignatureWalker(const SignatureWalker&) = delete;
+  SignatureWalker& operator=(const SignatureWalker&) = delete;
+};
+
 // Walker subclass used by Simplify.
 // The simplify walk is purely post-recursive: given the simplified children,
 // PostVisit creates the simplified result.
 // The child_args are simplified Regexp*s.
+// Simplified subexpressions are memoized by signature so that repeated
+// subexpressions - common in RE2::Set pattern sets sharing structure - are
+// simplified once and then reused without walking them again.
 class SimplifyWalker : public Regexp::Walker<Regexp*> {
  public:
-  SimplifyWalker() {}
+  explicit SimplifyWalker(const absl::flat_hash_map<Regexp*, Signature>* sig)
+      : sig_(sig) {}
+  virtual ~SimplifyWalker();
   virtual Regexp* PreVisit(Regexp* re, Regexp* parent_arg, bool* stop);
   virtual Regexp* PostVisit(Regexp* re, Regexp* parent_arg, Regexp* pre_arg,
                             Regexp** child_args, int nchild_args);
@@ -146,6 +192,20 @@ class SimplifyWalker : public Regexp::Walker<Regexp*> {
   virtual Regexp* ShortVisit(Regexp* re, Regexp* parent_arg);
 
  private:
+  typedef std::pair<Regexp*, Regexp*> MemoEntry;
+  typedef absl::flat_hash_map<uint64_t, std::vector<MemoEntry>> MemoMap;
+
+  // The core of PostVisit: simplifies re given the simplified children.
+  Regexp* SimplifyOp(Regexp* re, Regexp** child_args);
+
+  // Returns the memoized simplification of a subexpression equal to re,
+  // or NULL if there is none.  Does not pass a ref: caller must Incref.
+  Regexp* FindMemo(Regexp* re);
+
+  // Memoizes nre as the simplification of re.  Does not consume a ref to
+  // either; takes its own refs, released in the destructor.
+  void AddMemo(Regexp* re, Regexp* nre);
+
   // These functions are declared inside SimplifyWalker so that
   // they can edit the private fields of the Regexps they construct.
 
@@ -164,6 +224,13 @@ class SimplifyWalker : public Regexp::Walker<Regexp*> {
   // Caller must Decref return value when done with it.
   static Regexp* SimplifyCharClass(Regexp* re);
 
+  // Structural signatures of the original subexpressions.
+  const absl::flat_hash_map<Regexp*, Signature>* sig_;
+
+  // For each signature, the subexpressions already simplified with that
+  // signature and their simplifications.
+  MemoMap memo_;
+
   SimplifyWalker(const SimplifyWalker&) = delete;
   SimplifyWalker& operator=(const SimplifyWalker&) = delete;
 };
@@ -186,7 +253,15 @@ Regexp* Regexp::Simplify() {
     cre->Decref();
     return NULL;
   }
-  SimplifyWalker sw;
+  // Hash the subexpressions first so that the simplify walk can reuse the
+  // simplification of repeated subexpressions: each distinct subexpression
+  // is simplified once, no matter how many times it occurs.
+  absl::flat_hash_map<Regexp*, Signature> sig;
+  SignatureWalker gw(&sig);
+  gw.Walk(cre, Signature());
+  if (gw.stopped_early())
+    sig.clear();
+  SimplifyWalker sw(&sig);
   Regexp* sre = sw.Walk(cre, NULL);
   cre->Decref();
   if (sre == NULL)
@@ -444,6 +519,138 @@ void CoalesceWalker::DoCoalesce(Regexp** r1ptr, Regexp** r2ptr) {
   r2->Decref();
 }
 
+static uint64_t HashMix(uint64_t h, uint64_t v) {
+  // One step of FNV-1a, which is plenty for memoization keys.
+  return (h ^ v) * 1099511628211ULL;
+}
+
+Signature SignatureWalker::PreVisit(Regexp* re, Signature parent_arg,
+                                    bool* stop) {
+  // A subexpression shared by pointer only needs to be hashed once.
+  absl::flat_hash_map<Regexp*, Signature>::const_iterator it = sig_->find(re);
+  if (it != sig_->end()) {
+    *stop = true;
+    return it->second;
+  }
+  return Signature();
+}
+
+Signature SignatureWalker::PostVisit(Regexp* re, Signature parent_arg,
+                                     Signature pre_arg, Signature* child_args,
+                                     int nchild_args) {
+  // Folds in the same fields as TopEqual in regexp.cc, including which
+  // parse flag bits matter for each op.
+  uint64_t h = HashMix(14695981039346656037ULL, re->op());
+  switch (re->op()) {
+    default:
+      break;
+
+    case kRegexpEndText:
+      h = HashMix(h, re->parse_flags() & Regexp::WasDollar);
+      break;
+
+    case kRegexpLiteral:
+      h = HashMix(h, re->rune());
+      h = HashMix(h, re->parse_flags() & Regexp::FoldCase);
+      break;
+
+    case kRegexpLiteralString:
+      h = HashMix(h, re->parse_flags() & Regexp::FoldCase);
+      for (int i = 0; i < re->nrunes(); i++)
+        h = HashMix(h, re->runes()[i]);
+      break;
+
+    case kRegexpStar:
+    case kRegexpPlus:
+    case kRegexpQuest:
+      h = HashMix(h, re->parse_flags() & Regexp::NonGreedy);
+      break;
+
+    case kRegexpRepeat:
+      h = HashMix(h, re->parse_flags() & Regexp::NonGreedy);
+      h = HashMix(h, re->min());
+      h = HashMix(h, re->max());
+      break;
+
+    case kRegexpCapture:
+      h = HashMix(h, re->cap());
+      if (re->name() != NULL)
+        for (size_t i = 0; i < re->name()->size(); i++)
+          h = HashMix(h, (*re->name())[i]);
+      break;
+
+    case kRegexpHaveMatch:
+      h = HashMix(h, re->match_id());
+      break;
+
+    case kRegexpCharClass: {
+      CharClass* cc = re->cc();
+      h = HashMix(h, cc->size());
+      for (RuneRange* rr = cc->begin(); rr != cc->end(); rr++) {
+        h = HashMix(h, rr->lo);
+        h = HashMix(h, rr->hi);
+      }
+      break;
+    }
+  }
+  Signature s;
+  s.nodes = 1;
+  for (int i = 0; i < nchild_args; i++) {
+    h = HashMix(h, child_args[i].hash);
+    s.nodes += child_args[i].nodes;
+  }
+  s.hash = h;
+  // Small subexpressions are rehashed on repeat visits rather than
+  // stored: they are not memoization candidates anyway.
+  if (re->nsub() > 0 && s.nodes >= kMinMemoNodes)
+    (*sig_)[re] = s;
+  return s;
+}
+
+Signature SignatureWalker::ShortVisit(Regexp* re, Signature parent_arg) {
+  // The visit budget ran out: Simplify discards the signatures when the
+  // walk stops early, so any value suffices here.
+  return Signature();
+}
+
+SimplifyWalker::~SimplifyWalker() {
+  for (MemoMap::iterator it = memo_.begin(); it != memo_.end(); ++it) {
+    std::vector<MemoEntry>& v = it->second;
+    for (size_t i = 0; i < v.size(); i++) {
+      v[i].first->Decref();
+      v[i].second->Decref();
+    }
+  }
+}
+
+Regexp* SimplifyWalker::FindMemo(Regexp* re) {
+  if (re->nsub() == 0)
+    return NULL;
+  absl::flat_hash_map<Regexp*, Signature>::const_iterator it = sig_->find(re);
+  if (it == sig_->end())
+    return NULL;
+  MemoMap::iterator m = memo_.find(it->second.hash);
+  if (m == memo_.end())
+    return NULL;
+  for (size_t i = 0; i < m->second.size(); i++) {
+    // The pointer comparison also handles repeat visits of a shared
+    // subexpression, the way Copy handles adjacent identical children.
+    if (m->second[i].first == re || Regexp::Equal(m->second[i].first, re))
+      return m->second[i].second;
+  }
+  return NULL;
+}
+
+void SimplifyWalker::AddMemo(Regexp* re, Regexp* nre) {
+  // The signature map only contains subexpressions worth memoizing.
+  if (re->nsub() == 0)
+    return;
+  absl::flat_hash_map<Regexp*, Signature>::const_iterator it = sig_->find(re);
+  if (it == sig_->end())
+    return;
+  memo_[it->second.hash].push_back(MemoEntry(re->Incref(), nre->Incref()));
+}
+
 Regexp* SimplifyWalker::Copy(Regexp* re) {
   return re->Incref();
 }
@@ -461,6 +668,11 @@ Regexp* SimplifyWalker::PreVisit(Regexp* re, Regexp* parent_arg, bool* stop) {
     *stop = true;
     return re->Incref();
   }
+  Regexp* memo = FindMemo(re);
+  if (memo != NULL) {
+    *stop = true;
+    return memo->Incref();
+  }
   return NULL;
 }
 
@@ -469,6 +681,12 @@ Regexp* SimplifyWalker::PostVisit(Regexp* re,
                                   Regexp* pre_arg,
                                   Regexp** child_args,
                                   int nchild_args) {
+  Regexp* nre = SimplifyOp(re, child_args);
+  AddMemo(re, nre);
+  return nre;
+}
+
+Regexp* SimplifyWalker::SimplifyOp(Regexp* re, Regexp** child_args) {
   switch (re->op()) {
     case kRegexpNoMatch:
     case kRegexpEmptyMatch:
@@ -15,6 +15,10 @@
 #include <stdarg.h>
 #include <string.h>
 
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
 #include "util/utf.h"
 
 namespace re2 {
@@ -208,6 +212,147 @@ fullrune(const char *str, int n)
 }
 
 
+/*
+ * Scalar reference for utfvalid: the same probe-decode-check loop the
+ * parser runs one rune at a time.
+ */
+static int
+utfvalid1(const char *s, size_t n)
+{
+	size_t i;
+	int c, m;
+	Rune r;
+
+	i = 0;
+	while(i < n) {
+		c = *(unsigned char*)(s+i);
+		if(c < Runeself) {
+			i++;
+			continue;
+		}
+		m = n-i < 4 ? (int)(n-i) : 4;
+		if(!fullrune(s+i, m))
+			return 0;
+		m = chartorune(&r, s+i);
+		if(r > Runemax || (m == 1 && r == Runeerror))
+			return 0;
+		i += m;
+	}
+	return 1;
+}
+
+#ifdef __SSSE3__
+/*
+ * Block validation after Keiser and Lemire, "Validating UTF-8 In Less
+ * Than One Instruction Per Byte".  Every byte is classified by three
+ * shuffles -- on the high and low nibble of the preceding byte and the
+ * high nibble of the byte itself -- against tables whose AND is nonzero
+ * exactly on malformed two-byte windows: a lead followed by a
+ * non-continuation, a continuation without a lead, overlong encodings,
+ * and values above Runemax.  Continuations in third and fourth position
+ * are checked against the bytes two and three back via the top bit.
+ * One deliberate deviation from the paper's tables: the surrogate
+ * class is dropped, because chartorune (and so utfvalid1, which this
+ * path must agree with) accepts surrogates.
+ */
+static int
+utfvalidblocks(const char *s, size_t n)
+{
+	/* indexed by the preceding byte's high nibble */
+	static const uint8_t tbl1[16] = {
+		0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+		0x80, 0x80, 0x80, 0x80, 0x21, 0x01, 0x05, 0x49,
+	};
+	/* indexed by the preceding byte's low nibble */
+	static const uint8_t tbl2[16] = {
+		0xE7, 0xA3, 0x83, 0x83, 0x8B, 0xCB, 0xCB, 0xCB,
+		0xCB, 0xCB, 0xCB, 0xCB, 0xCB, 0xCB, 0xCB, 0xCB,
+	};
+	/* indexed by the current byte's high nibble */
+	static const uint8_t tbl3[16] = {
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0xE6, 0xAE, 0xAA, 0xAA, 0x01, 0x01, 0x01, 0x01,
+	};
+	__m128i t1, t2, t3, nib, bit7, prev, err;
+	size_t i;
+
+	/*
+	 * A lead in the last three bytes is incomplete, and its missing
+	 * continuations would only be flagged in a block past the end of
+	 * the buffer; reject it up front.  Complete text never ends with
+	 * such bytes: the tail of a valid sequence is all continuations.
+	 */
+	if(n >= 1 && *(unsigned char*)(s+n-1) >= T2)
+		return 0;
+	if(n >= 2 && *(unsigned char*)(s+n-2) >= T3)
+		return 0;
+	if(n >= 3 && *(unsigned char*)(s+n-3) >= T4)
+		return 0;
+
+	t1 = _mm_loadu_si128((const __m128i*)tbl1);
+	t2 = _mm_loadu_si128((const __m128i*)tbl2);
+	t3 = _mm_loadu_si128((const __m128i*)tbl3);
+	nib = _mm_set1_epi8(0x0F);
+	bit7 = _mm_set1_epi8((char)0x80);
+	prev = _mm_setzero_si128();
+	err = _mm_setzero_si128();
+	for(i = 0; i < n; i += 16) {
+		__m128i cur, prev1, prev2, prev3, sc, must;
+
+		if(n-i >= 16) {
+			cur = _mm_loadu_si128((const __m128i*)(s+i));
+		} else {
+			/*
+			 * Zero-pad the final partial block: a sequence cut
+			 * off inside it sees NUL as its next byte and is
+			 * flagged short, and the pad bytes themselves are
+			 * plain ASCII.
+			 */
+			uint8_t buf[16];
+			memset(buf, 0, sizeof buf);
+			memcpy(buf, s+i, n-i);
+			cur = _mm_loadu_si128((const __m128i*)buf);
+		}
+		prev1 = _mm_alignr_epi8(cur, prev, 15);
+		sc = _mm_and_si128(
+			_mm_shuffle_epi8(t1,
+				_mm_and_si128(_mm_srli_epi16(prev1, 4), nib)),
+			_mm_shuffle_epi8(t2, _mm_and_si128(prev1, nib)));
+		sc = _mm_and_si128(sc,
+			_mm_shuffle_epi8(t3,
+				_mm_and_si128(_mm_srli_epi16(cur, 4), nib)));
+		/*
+		 * Positions two past a 3- or 4-byte lead or three past a
+		 * 4-byte lead must hold continuations.  The saturating
+		 * subtractions leave the top bit set exactly for bytes
+		 * >= T3 and >= T4 respectively; sc's top bit is set
+		 * exactly where a continuation follows a continuation,
+		 * so the XOR flags both missing and stray continuations.
+		 */
+		prev2 = _mm_alignr_epi8(cur, prev, 14);
+		prev3 = _mm_alignr_epi8(cur, prev, 13);
+		must = _mm_or_si128(
+			_mm_subs_epu8(prev2, _mm_set1_epi8(T3 - 0x80)),
+			_mm_subs_epu8(prev3, _mm_set1_epi8(T4 - 0x80)));
+		err = _mm_or_si128(err,
+			_mm_xor_si128(_mm_and_si128(must, bit7), sc));
+		prev = cur;
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(err, _mm_setzero_si128())) ==
+	       0xFFFF;
+}
+#endif
+
+int
+utfvalid(const char *s, size_t n)
+{
+#ifdef __SSSE3__
+	if(n >= 16)
+		return utfvalidblocks(s, n);
+#endif
+	return utfvalid1(s, n);
+}
+
 int
 utflen(const char *s)
 {
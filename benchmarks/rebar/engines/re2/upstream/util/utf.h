@@ -18,6 +18,7 @@
 #ifndef UTIL_UTF_H_
 #define UTIL_UTF_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 namespace re2 {
@@ -39,6 +40,14 @@ int fullrune(const char* s, int n);
 int utflen(const char* s);
 char* utfrune(const char*, Rune);
 
+/*
+ * Whole-buffer validation: returns 1 iff s[0..n) is a sequence of
+ * complete UTF-8 encodings that chartorune would decode without error
+ * and whose values do not exceed Runemax.  Unlike RFC 3629 this
+ * accepts surrogate code points, because chartorune does.
+ */
+int utfvalid(const char* s, size_t n);
+
 }  // namespace re2
 
 #endif  // UTIL_UTF_H_
@@ -0,0 +1,34 @@
+#!/bin/bash
+# Incremental pass-iteration rebuild.
+#
+# A full reproduction builds the vendored rustc+LLVM from source (~3 hours
+# on CI). The custom C++ surface is small — the unsafe pass directories
+# plus the PassBuilderPipelines.cpp wiring — and it all builds into the
+# single LLVMUnsafeInstr component, so after one full `x.py build` this
+# script recompiles just that component (plus anything else LLVM's ninja
+# finds stale, e.g. lib/Passes after a wiring change) and relinks it into
+# the existing toolchain. Pass iteration takes minutes, not hours.
+#
+# Run from the repository root after the Dockerfile's full build has
+# completed at least once.
+set -euo pipefail
+
+cd "$(dirname "$0")/rustc"
+
+LLVM_BUILD=build/x86_64-unknown-linux-gnu/llvm/build
+if [ ! -d "$LLVM_BUILD" ]; then
+    echo "error: $LLVM_BUILD not found - run the full 'python3 x.py build' once first" >&2
+    exit 1
+fi
+
+# Rebuild the pass component (and any stale dependents) in LLVM's own
+# build tree. x.py would skip this: it stamps LLVM by source revision, not
+# by file contents.
+ninja -C "$LLVM_BUILD" LLVMUnsafeInstr LLVMPasses
+
+# Force the llvm-wrapper (PassWrapper.cpp) to relink against the fresh
+# archives; cargo does not watch the .a files themselves.
+touch compiler/rustc_llvm/build.rs
+
+python3 x.py build -j "$(nproc)"
+python3 x.py install -j "$(nproc)"
@@ -1,5 +1,6 @@
 #!/usr/bin/env python3
 import os
+import signal
 import sys
 import shutil
 import subprocess
@@ -142,24 +143,40 @@ CRATE_CONFIGS = {
 }
 
 def run_cmd(cmd, cwd=None, env=None, timeout=600):
-    """Run a shell command with default 10min timeout."""
+    """Run a shell command with default 10min timeout.
+
+    On timeout the whole process group first gets SIGUSR1: binaries built
+    with -unsafe-stats-signal-dump write their stat files on that signal,
+    so long-running services killed after their measurement window still
+    produce intermediate results. SIGKILL follows after a short grace.
+    """
     print(f"Running: {cmd} (cwd={cwd})")
+    proc = subprocess.Popen(
+        cmd,
+        cwd=cwd,
+        env=env,
+        shell=True,
+        start_new_session=True
+    )
     try:
-        subprocess.run(
-            cmd, 
-            cwd=cwd, 
-            env=env, 
-            check=True, 
-            shell=True,
-            timeout=timeout
-        )
-        return True
-    except subprocess.CalledProcessError as e:
-        print(f"Command failed with exit code {e.returncode}: {cmd}")
-        return False
+        returncode = proc.wait(timeout=timeout)
     except subprocess.TimeoutExpired:
         print(f"Command timed out: {cmd}")
+        try:
+            os.killpg(proc.pid, signal.SIGUSR1)
+            proc.wait(timeout=10)  # grace period for the signal dump
+        except (subprocess.TimeoutExpired, ProcessLookupError, PermissionError):
+            pass
+        try:
+            os.killpg(proc.pid, signal.SIGKILL)
+        except (ProcessLookupError, PermissionError):
+            pass
+        proc.wait()
         return False
+    if returncode != 0:
+        print(f"Command failed with exit code {returncode}: {cmd}")
+        return False
+    return True
 
 def build_perf(feature):
     """Build the perf library with the specified feature."""
@@ -266,6 +283,14 @@ def run_crate(crate_name, exp_name, config, output_dir):
     
     env["UNSAFE_BENCH_OUTPUT_DIR"] = str(abs_output_dir)
     env["CARGO_PRIMARY_PACKAGE"] = "1"
+    # Ask the compiler to record the semantic pipeline fingerprint of this
+    # build. The -enable-* llvm-args only take effect for the primary
+    # package, so dependency builds report the same fingerprint in all four
+    # experiments; artifact caches can key on that value to share dependency
+    # artifacts across experiments instead of rebuilding them 4x.
+    if exp_name != "native":
+        env["RUSTC_LLVM_PIPELINE_FINGERPRINT_FILE"] = str(
+            abs_output_dir / f"{crate_name}_{exp_name}.pipeline-fp")
     print(f"DEBUG: UNSAFE_BENCH_OUTPUT_DIR={abs_output_dir} (cwd={crate_dir})")
     
     # Determine execution strategy
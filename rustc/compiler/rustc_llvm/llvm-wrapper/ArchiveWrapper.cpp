@@ -2,6 +2,12 @@
 
 #include "llvm/Object/Archive.h"
 #include "llvm/Object/ArchiveWriter.h"
+// UNSAFE-RUST BEGIN
+#include "llvm/Object/Binary.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+// UNSAFE-RUST END
 #include "llvm/Support/Path.h"
 
 using namespace llvm;
@@ -172,13 +178,18 @@ extern "C" void LLVMRustArchiveMemberFree(LLVMRustArchiveMemberRef Member) {
   delete Member;
 }
 
-extern "C" LLVMRustResult
-LLVMRustWriteArchive(char *Dst, size_t NumMembers,
-                     const LLVMRustArchiveMemberRef *NewMembers,
-                     bool WriteSymbtab, LLVMRustArchiveKind RustKind, bool isEC) {
+// UNSAFE-RUST BEGIN
+// Shared body of the fat and thin archive writers. In thin mode member
+// names keep their paths (writeArchive stores them relative to the
+// archive), and members pulled from an existing archive's children are
+// rejected: a thin archive can only reference bytes that live in
+// standalone files.
+static LLVMRustResult
+writeArchiveImpl(char *Dst, size_t NumMembers,
+                 const LLVMRustArchiveMemberRef *NewMembers, bool WriteSymbtab,
+                 Archive::Kind Kind, bool Thin, bool isEC) {
 
   std::vector<NewArchiveMember> Members;
-  auto Kind = fromRust(RustKind);
 
   for (size_t I = 0; I < NumMembers; I++) {
     auto Member = NewMembers[I];
@@ -190,9 +201,16 @@ LLVMRustWriteArchive(char *Dst, size_t NumMembers,
         LLVMRustSetLastError(toString(MOrErr.takeError()).c_str());
         return LLVMRustResult::Failure;
       }
-      MOrErr->MemberName = sys::path::filename(MOrErr->MemberName);
+      if (!Thin)
+        MOrErr->MemberName = sys::path::filename(MOrErr->MemberName);
       Members.push_back(std::move(*MOrErr));
     } else {
+      if (Thin) {
+        LLVMRustSetLastError(
+            "cannot reference a member of an existing archive from a thin "
+            "archive");
+        return LLVMRustResult::Failure;
+      }
       Expected<NewArchiveMember> MOrErr =
           NewArchiveMember::getOldMember(Member->Child, true);
       if (!MOrErr) {
@@ -204,10 +222,10 @@ LLVMRustWriteArchive(char *Dst, size_t NumMembers,
   }
 
 #if LLVM_VERSION_LT(18, 0)
-  auto Result = writeArchive(Dst, Members, WriteSymbtab, Kind, true, false);
+  auto Result = writeArchive(Dst, Members, WriteSymbtab, Kind, true, Thin);
 #else
   auto SymtabMode = WriteSymbtab ? SymtabWritingMode::NormalSymtab : SymtabWritingMode::NoSymtab;
-  auto Result = writeArchive(Dst, Members, SymtabMode, Kind, true, false, nullptr, isEC);
+  auto Result = writeArchive(Dst, Members, SymtabMode, Kind, true, Thin, nullptr, isEC);
 #endif
   if (!Result)
     return LLVMRustResult::Success;
@@ -215,3 +233,105 @@ LLVMRustWriteArchive(char *Dst, size_t NumMembers,
 
   return LLVMRustResult::Failure;
 }
+// UNSAFE-RUST END
+
+extern "C" LLVMRustResult
+LLVMRustWriteArchive(char *Dst, size_t NumMembers,
+                     const LLVMRustArchiveMemberRef *NewMembers,
+                     bool WriteSymbtab, LLVMRustArchiveKind RustKind, bool isEC) {
+  return writeArchiveImpl(Dst, NumMembers, NewMembers, WriteSymbtab,
+                          fromRust(RustKind), /*Thin=*/false, isEC);
+}
+
+// UNSAFE-RUST BEGIN
+// Thin variant for intermediate rlibs: instrumented objects carry large
+// static tables and copying their bytes into every local rlib doubles
+// archive I/O for nothing — the objects never move in a per-experiment
+// build tree. A thin archive stores only member paths, so assembly is
+// metadata-only; it is invalid the moment the referenced objects move or
+// vanish, which is why distributable rlibs keep using the fat writer.
+// Thin archives are a GNU format feature, so the kind is fixed.
+extern "C" LLVMRustResult
+LLVMRustWriteThinArchive(char *Dst, size_t NumMembers,
+                         const LLVMRustArchiveMemberRef *NewMembers,
+                         bool WriteSymbtab) {
+  return writeArchiveImpl(Dst, NumMembers, NewMembers, WriteSymbtab,
+                          Archive::K_GNU, /*Thin=*/true, /*isEC=*/false);
+}
+// UNSAFE-RUST END
+
+// UNSAFE-RUST BEGIN
+/// Append every .unsafe_tables section of \p Obj to \p Out.
+static Error appendUnsafeTableSections(const object::ObjectFile &Obj,
+                                       raw_fd_ostream &Out) {
+  for (const object::SectionRef &Sec : Obj.sections()) {
+    Expected<StringRef> Name = Sec.getName();
+    if (!Name) {
+      consumeError(Name.takeError());
+      continue;
+    }
+    if (*Name != ".unsafe_tables")
+      continue;
+    Expected<StringRef> Contents = Sec.getContents();
+    if (!Contents)
+      return Contents.takeError();
+    Out << *Contents;
+  }
+  return Error::success();
+}
+
+// Split instrumentation tables (-Cllvm-args=-unsafe-extern-tables): the
+// unsafe passes emit their static tables into an SHF_EXCLUDE
+// .unsafe_tables section, which the linker drops from the final binary, so
+// the tables survive only in the objects and rlibs feeding the link. This
+// hook walks one such input — a plain object or an archive of them — and
+// appends every .unsafe_tables section's bytes to OutPath; each table
+// carries its own framing header, so the concatenated stream is what the
+// aggregator reads to join runtime IDs back to names, lines and block
+// rows.
+extern "C" LLVMRustResult LLVMRustExtractUnsafeTables(char *Path,
+                                                      char *OutPath) {
+  std::error_code EC;
+  raw_fd_ostream Out(OutPath, EC, sys::fs::OF_Append);
+  if (EC) {
+    LLVMRustSetLastError(EC.message().c_str());
+    return LLVMRustResult::Failure;
+  }
+
+  Expected<object::OwningBinary<object::Binary>> BinOrErr =
+      object::createBinary(Path);
+  if (!BinOrErr) {
+    LLVMRustSetLastError(toString(BinOrErr.takeError()).c_str());
+    return LLVMRustResult::Failure;
+  }
+
+  auto Fail = [](Error E) {
+    LLVMRustSetLastError(toString(std::move(E)).c_str());
+    return LLVMRustResult::Failure;
+  };
+
+  object::Binary *Bin = BinOrErr->getBinary();
+  if (auto *A = dyn_cast<Archive>(Bin)) {
+    Error IterErr = Error::success();
+    for (const Archive::Child &C : A->children(IterErr)) {
+      Expected<std::unique_ptr<object::Binary>> ChildBin = C.getAsBinary();
+      if (!ChildBin) {
+        // Symbol tables and non-object members are expected; skip them.
+        consumeError(ChildBin.takeError());
+        continue;
+      }
+      if (auto *Obj = dyn_cast<object::ObjectFile>(ChildBin->get()))
+        if (Error E = appendUnsafeTableSections(*Obj, Out)) {
+          consumeError(std::move(IterErr));
+          return Fail(std::move(E));
+        }
+    }
+    if (IterErr)
+      return Fail(std::move(IterErr));
+  } else if (auto *Obj = dyn_cast<object::ObjectFile>(Bin)) {
+    if (Error E = appendUnsafeTableSections(*Obj, Out))
+      return Fail(std::move(E));
+  }
+  return LLVMRustResult::Success;
+}
+// UNSAFE-RUST END
@@ -246,6 +246,86 @@ extern "C" void LLVMRustCoverageWriteMappingToBuffer(
   CoverageMappingWriter.write(OS);
 }
 
+// Receives encoded coverage mapping bytes in bounded chunks.
+typedef void (*LLVMRustCoverageWriteCallback)(void *Ctx, const char *Data,
+                                              size_t Len);
+
+namespace {
+// raw_ostream that hands its buffer to the Rust-side callback every time it
+// fills, so the encoded record never has to exist contiguously on this side
+// of the FFI boundary.
+class CallbackOstream : public raw_ostream {
+  void *Ctx;
+  LLVMRustCoverageWriteCallback Callback;
+  uint64_t Pos = 0;
+
+  void write_impl(const char *Ptr, size_t Size) override {
+    Callback(Ctx, Ptr, Size);
+    Pos += Size;
+  }
+  uint64_t current_pos() const override { return Pos; }
+
+public:
+  CallbackOstream(void *Ctx, LLVMRustCoverageWriteCallback Callback,
+                  size_t ChunkSize)
+      : Ctx(Ctx), Callback(Callback) {
+    SetBufferSize(ChunkSize);
+  }
+  ~CallbackOstream() override { flush(); }
+};
+} // namespace
+
+// Streaming variant of LLVMRustCoverageWriteMappingToBuffer. The encoded
+// record is pushed through the callback in chunks of roughly ChunkSize bytes
+// as the writer produces it, instead of accumulating in a RustString that
+// rustc copies again, and the FFI conversion scratch is reused across calls
+// on each thread. Peak wrapper memory is therefore bounded by the largest
+// single function's region list, not by how much encoded data a build emits.
+// One call still encodes one whole function record: the writer sorts the
+// regions and the record format cannot be split, so the region arrays cannot
+// themselves be batched below function granularity.
+extern "C" void LLVMRustCoverageWriteMappingToCallback(
+    const unsigned *VirtualFileMappingIDs, unsigned NumVirtualFileMappingIDs,
+    const LLVMRustCounterExpression *RustExpressions, unsigned NumExpressions,
+    const LLVMRustCounterMappingRegion *RustMappingRegions,
+    unsigned NumMappingRegions, size_t ChunkSize, void *Ctx,
+    LLVMRustCoverageWriteCallback Callback) {
+  // Convert from FFI representation to LLVM representation, reusing the
+  // per-thread scratch capacity from earlier calls.
+  static thread_local SmallVector<coverage::CounterMappingRegion, 0>
+      MappingRegions;
+  static thread_local std::vector<coverage::CounterExpression> Expressions;
+  MappingRegions.clear();
+  MappingRegions.reserve(NumMappingRegions);
+  for (const auto &Region : ArrayRef<LLVMRustCounterMappingRegion>(
+           RustMappingRegions, NumMappingRegions)) {
+    MappingRegions.emplace_back(
+        fromRust(Region.Count), fromRust(Region.FalseCount),
+#if LLVM_VERSION_GE(18, 0) && LLVM_VERSION_LT(19, 0)
+        // LLVM 19 may move this argument to last.
+        fromRust(Region.MCDCParameters),
+#endif
+        Region.FileID, Region.ExpandedFileID, // File IDs, then region info.
+        Region.LineStart, Region.ColumnStart, Region.LineEnd, Region.ColumnEnd,
+        fromRust(Region.Kind));
+  }
+
+  Expressions.clear();
+  Expressions.reserve(NumExpressions);
+  for (const auto &Expression :
+       ArrayRef<LLVMRustCounterExpression>(RustExpressions, NumExpressions)) {
+    Expressions.emplace_back(fromRust(Expression.Kind),
+                             fromRust(Expression.LHS),
+                             fromRust(Expression.RHS));
+  }
+
+  auto CoverageMappingWriter = coverage::CoverageMappingWriter(
+      ArrayRef<unsigned>(VirtualFileMappingIDs, NumVirtualFileMappingIDs),
+      Expressions, MappingRegions);
+  CallbackOstream OS(Ctx, Callback, ChunkSize ? ChunkSize : 4096);
+  CoverageMappingWriter.write(OS);
+}
+
 extern "C" LLVMValueRef
 LLVMRustCoverageCreatePGOFuncNameVar(LLVMValueRef F, const char *FuncName,
                                      size_t FuncNameLen) {
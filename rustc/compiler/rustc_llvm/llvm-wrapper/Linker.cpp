@@ -1,13 +1,23 @@
 #include "SuppressLLVMWarnings.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/Linker/Linker.h"
+#include "llvm/Support/Parallel.h"
 
 #include "LLVMWrapper.h"
 
+#include <mutex>
+#include <vector>
+
 using namespace llvm;
 
 struct RustLinker {
   Linker L;
   LLVMContext &Ctx;
+  // Bitcode buffers queued by LLVMRustLinkerAddDeferred, merged by
+  // LLVMRustLinkerFinalize.
+  std::vector<std::unique_ptr<MemoryBuffer>> Pending;
 
   RustLinker(Module &M) :
     L(M),
@@ -47,3 +57,99 @@ LLVMRustLinkerAdd(RustLinker *L, char *BC, size_t Len) {
   }
   return true;
 }
+
+// Queues a codegen unit for the tree-reduction link below instead of linking
+// it into the destination immediately.
+extern "C" bool
+LLVMRustLinkerAddDeferred(RustLinker *L, char *BC, size_t Len) {
+  L->Pending.push_back(MemoryBuffer::getMemBufferCopy(StringRef(BC, Len)));
+  return true;
+}
+
+// Collects a worker context's diagnostics into a string so link failures on
+// pool threads surface through LLVMRustSetLastError like serial ones do.
+static void appendDiagnostic(const DiagnosticInfo &DI, void *Context) {
+  auto *Msg = static_cast<std::string *>(Context);
+  raw_string_ostream OS(*Msg);
+  if (!Msg->empty())
+    OS << "; ";
+  DiagnosticPrinterRawOStream DP(OS);
+  DI.print(DP);
+}
+
+// Links the queued codegen units pairwise over the parallel runtime, one
+// tree level at a time, and links the single surviving module into the
+// destination: O(log n) parallel depth instead of n serial IRMover merges.
+// Modules can only be linked within one LLVMContext and contexts are not
+// thread-safe, so each pair is parsed and merged in a worker-private context
+// and the result travels between levels as bitcode; the round-trip is cheap
+// next to the IRMover work it parallelizes. On failure the first error in
+// queue order is reported, matching what the serial path would hit first.
+extern "C" bool
+LLVMRustLinkerFinalize(RustLinker *L) {
+  std::vector<std::unique_ptr<MemoryBuffer>> Level = std::move(L->Pending);
+  L->Pending.clear();
+
+  while (Level.size() > 1) {
+    size_t NumPairs = Level.size() / 2;
+    std::vector<std::unique_ptr<MemoryBuffer>> Next(NumPairs +
+                                                    (Level.size() & 1));
+    std::mutex ErrMu;
+    std::string FirstErr;
+    size_t ErrIdx = SIZE_MAX;
+    auto Fail = [&](size_t I, std::string Msg) {
+      std::lock_guard<std::mutex> Lock(ErrMu);
+      if (I < ErrIdx) {
+        FirstErr = std::move(Msg);
+        ErrIdx = I;
+      }
+    };
+
+    parallelFor(0, NumPairs, [&](size_t I) {
+      LLVMContext Ctx;
+      std::string DiagMsg;
+      Ctx.setDiagnosticHandlerCallBack(appendDiagnostic, &DiagMsg);
+
+      Expected<std::unique_ptr<Module>> DstOrErr =
+          parseBitcodeFile(Level[2 * I]->getMemBufferRef(), Ctx);
+      if (!DstOrErr)
+        return Fail(I, toString(DstOrErr.takeError()));
+      Expected<std::unique_ptr<Module>> SrcOrErr =
+          parseBitcodeFile(Level[2 * I + 1]->getMemBufferRef(), Ctx);
+      if (!SrcOrErr)
+        return Fail(I, toString(SrcOrErr.takeError()));
+
+      if (Linker::linkModules(**DstOrErr, std::move(*SrcOrErr)))
+        return Fail(I, DiagMsg.empty() ? "module linking failed" : DiagMsg);
+
+      SmallString<0> Merged;
+      raw_svector_ostream OS(Merged);
+      WriteBitcodeToFile(**DstOrErr, OS);
+      Next[I] = MemoryBuffer::getMemBufferCopy(Merged);
+    });
+
+    if (ErrIdx != SIZE_MAX) {
+      LLVMRustSetLastError(FirstErr.c_str());
+      return false;
+    }
+    // An odd module out rides up to the next level unchanged.
+    if (Level.size() & 1)
+      Next[NumPairs] = std::move(Level.back());
+    Level = std::move(Next);
+  }
+
+  if (Level.empty())
+    return true;
+
+  Expected<std::unique_ptr<Module>> SrcOrError =
+      getLazyBitcodeModule(Level.front()->getMemBufferRef(), L->Ctx);
+  if (!SrcOrError) {
+    LLVMRustSetLastError(toString(SrcOrError.takeError()).c_str());
+    return false;
+  }
+  if (L->L.linkInModule(std::move(*SrcOrError))) {
+    LLVMRustSetLastError("");
+    return false;
+  }
+  return true;
+}
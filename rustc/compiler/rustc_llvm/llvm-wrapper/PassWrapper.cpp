@@ -1,7 +1,9 @@
 #include <stdio.h>
 
 #include <cstddef>
+#include <cstring>
 #include <iomanip>
+#include <mutex>
 #include <vector>
 #include <set>
 
@@ -22,10 +24,19 @@
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Support/CBindingWrapping.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/VirtualFileSystem.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
 #include "llvm/Transforms/IPO/AlwaysInliner.h"
 #include "llvm/Transforms/IPO/FunctionImport.h"
 #include "llvm/Transforms/IPO/Internalize.h"
@@ -34,7 +45,9 @@
 #include "llvm/Transforms/Utils/AddDiscriminators.h"
 #include "llvm/Transforms/Utils/FunctionImportUtils.h"
 #include "llvm/LTO/LTO.h"
+#include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Linker/Linker.h"
 #if LLVM_VERSION_GE(18, 0)
 #include "llvm/TargetParser/Host.h"
 #endif
@@ -679,6 +692,110 @@ void LLVMSelfProfileInitializeCallbacks(
       });
 }
 
+// Compile-time telemetry for instrumented builds. When
+// RUSTC_LLVM_TELEMETRY_DIR names a directory, each LLVMRustOptimize
+// invocation drops a JSON file there with per-pass inclusive wall/user/system
+// times (the same accounting -time-passes keeps, but machine-readable) plus
+// the process peak-RSS watermark before and after the pipeline, so
+// run_pipeline.py can fold the numbers into master_runtime_stats.json and a
+// slow build can be attributed to our passes, the optimizer, or neither
+// without rerunning anything by hand. Opt-in: unset means no overhead beyond
+// one getenv.
+static const char *telemetryDir() {
+  static const char *Dir = getenv("RUSTC_LLVM_TELEMETRY_DIR");
+  return Dir;
+}
+
+// VmHWM from /proc/self/status in KiB; 0 where that is not available. The
+// high-watermark is what the OOM killer cares about, so it is what we record.
+static uint64_t peakRSSInKiB() {
+#if defined(__linux__)
+  auto StatusOrErr = MemoryBuffer::getFile("/proc/self/status");
+  if (!StatusOrErr)
+    return 0;
+  StringRef Status = (*StatusOrErr)->getBuffer();
+  size_t Pos = Status.find("VmHWM:");
+  if (Pos == StringRef::npos)
+    return 0;
+  uint64_t KiB = 0;
+  Status.drop_front(Pos + strlen("VmHWM:")).ltrim().consumeInteger(10, KiB);
+  return KiB;
+#else
+  return 0;
+#endif
+}
+
+namespace {
+// Accumulates inclusive per-pass times through the pass instrumentation
+// callbacks. An outer pass's time includes the passes it runs, exactly as
+// -time-passes reports them; the JSON notes nothing, readers sum leaves if
+// they want exclusive numbers.
+class PassTelemetry {
+  StringMap<TimeRecord> Totals;
+  StringMap<unsigned> Runs;
+  SmallVector<std::pair<std::string, TimeRecord>, 8> Stack;
+
+public:
+  void registerCallbacks(PassInstrumentationCallbacks &PIC) {
+    PIC.registerBeforeNonSkippedPassCallback([this](StringRef Pass, Any) {
+      Stack.emplace_back(Pass.str(), TimeRecord::getCurrentTime(/*Start=*/true));
+    });
+    auto Pop = [this] {
+      if (Stack.empty())
+        return;
+      TimeRecord Delta = TimeRecord::getCurrentTime(/*Start=*/false);
+      Delta -= Stack.back().second;
+      Totals[Stack.back().first] += Delta;
+      Runs[Stack.back().first] += 1;
+      Stack.pop_back();
+    };
+    PIC.registerAfterPassCallback(
+        [Pop](StringRef, Any, const PreservedAnalyses &) { Pop(); });
+    PIC.registerAfterPassInvalidatedCallback(
+        [Pop](StringRef, const PreservedAnalyses &) { Pop(); });
+  }
+
+  void writeJSON(const Module &M, uint64_t PeakRSSBefore, TimeRecord Total) {
+    SmallString<128> Path(telemetryDir());
+    // One file per module and process: LLVMRustOptimize runs once per
+    // codegen unit, and concurrent rustc invocations must not collide.
+    SmallString<64> Name;
+    for (char C : M.getModuleIdentifier())
+      Name.push_back(isAlnum(C) ? C : '_');
+    raw_svector_ostream(Name) << "-" << sys::Process::getProcessId()
+                              << ".json";
+    sys::path::append(Path, Name);
+
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+    if (EC)
+      return; // best effort, like the pass-side sidecar reports
+
+    json::OStream J(OS, /*IndentSize=*/2);
+    J.object([&] {
+      J.attribute("module", M.getModuleIdentifier());
+      J.attribute("wall_s", Total.getWallTime());
+      J.attribute("user_s", Total.getUserTime());
+      J.attribute("system_s", Total.getSystemTime());
+      J.attribute("peak_rss_kib_before", PeakRSSBefore);
+      J.attribute("peak_rss_kib_after", peakRSSInKiB());
+      J.attributeArray("passes", [&] {
+        for (const auto &KV : Totals) {
+          J.object([&] {
+            J.attribute("name", KV.first());
+            J.attribute("wall_s", KV.second.getWallTime());
+            J.attribute("user_s", KV.second.getUserTime());
+            J.attribute("system_s", KV.second.getSystemTime());
+            J.attribute("runs", Runs[KV.first()]);
+          });
+        }
+      });
+    });
+    OS << "\n";
+  }
+};
+} // namespace
+
 enum class LLVMRustOptStage {
   PreLinkNoLTO,
   PreLinkThinLTO,
@@ -744,6 +861,16 @@ LLVMRustOptimize(
   StandardInstrumentations SI(TheModule->getContext(), DebugPassManager);
   SI.registerCallbacks(PIC);
 
+  std::optional<PassTelemetry> Telemetry;
+  uint64_t TelemetryPeakRSSBefore = 0;
+  TimeRecord TelemetryStart;
+  if (telemetryDir()) {
+    Telemetry.emplace();
+    Telemetry->registerCallbacks(PIC);
+    TelemetryPeakRSSBefore = peakRSSInKiB();
+    TelemetryStart = TimeRecord::getCurrentTime(/*Start=*/true);
+  }
+
   if (LlvmSelfProfiler){
     LLVMSelfProfileInitializeCallbacks(PIC,LlvmSelfProfiler,BeforePassCallback,AfterPassCallback);
   }
@@ -934,8 +1061,85 @@ LLVMRustOptimize(
     }
   }
 
+  // UNSAFE-RUST BEGIN
+  // UNSAFE_INSTR_CORPUS_DIR: corpus extraction mode. The checkpoint pass
+  // routes its post-optimization, pre-instrumentation bitcode dump into
+  // the named directory and appends a manifest row per module, so one
+  // pipeline run over the benchmark crates yields a .bc corpus that
+  // drives opt-plugin and microbenchmark iteration without touching
+  // rustc again. The dump itself is scheduled inside the default
+  // pipeline; the wrapper's only job is to make sure the directory
+  // exists before any codegen thread races to write into it.
+  {
+    static std::once_flag CorpusDirOnce;
+    std::call_once(CorpusDirOnce, [] {
+      if (const char *Dir = getenv("UNSAFE_INSTR_CORPUS_DIR"))
+        if (std::error_code EC = sys::fs::create_directories(Dir))
+          errs() << "warning: cannot create unsafe corpus directory " << Dir
+                 << ": " << EC.message() << "\n";
+    });
+  }
+  // UNSAFE-RUST END
+
+  // UNSAFE-RUST BEGIN
+  // -unsafe-instr-checkpoint-resume: replace the module with the bitcode a
+  // dump run wrote at the head of the instrumentation block, and run only
+  // the unsafe passes; codegen then proceeds as usual. A probe-codegen
+  // experiment costs pass time plus codegen instead of the full
+  // frontend+optimizer rebuild. A missing or unreadable checkpoint falls
+  // back to the full pipeline with a warning — slower, never wrong.
+  bool ResumingFromCheckpoint = false;
+  if (unsafeInstrCheckpointResumeEnabled()) {
+    std::string CkptPath = unsafeInstrCheckpointPath(*TheModule);
+    auto BufOrErr = MemoryBuffer::getFile(CkptPath);
+    if (!BufOrErr) {
+      errs() << "warning: cannot read unsafe checkpoint " << CkptPath << ": "
+             << BufOrErr.getError().message()
+             << "; running the full pipeline\n";
+    } else {
+      Expected<std::unique_ptr<Module>> CkptOrErr =
+          parseBitcodeFile(**BufOrErr, TheModule->getContext());
+      if (!CkptOrErr) {
+        errs() << "warning: cannot parse unsafe checkpoint " << CkptPath
+               << ": " << toString(CkptOrErr.takeError())
+               << "; running the full pipeline\n";
+      } else {
+        // The caller owns the Module object and feeds it to codegen later,
+        // so the checkpoint is linked into it in place: gut the freshly
+        // translated contents, then let the Linker move the checkpoint's
+        // definitions across.
+        TheModule->dropAllReferences();
+        for (Function &F : make_early_inc_range(*TheModule))
+          F.eraseFromParent();
+        for (GlobalVariable &GV : make_early_inc_range(TheModule->globals()))
+          GV.eraseFromParent();
+        for (GlobalAlias &GA : make_early_inc_range(TheModule->aliases()))
+          GA.eraseFromParent();
+        for (GlobalIFunc &GI : make_early_inc_range(TheModule->ifuncs()))
+          GI.eraseFromParent();
+        for (NamedMDNode &NMD :
+             make_early_inc_range(TheModule->named_metadata()))
+          TheModule->eraseNamedMetadata(&NMD);
+        TheModule->setModuleInlineAsm("");
+        if (Linker::linkModules(*TheModule, std::move(*CkptOrErr))) {
+          // The module is already gutted, so there is no full pipeline to
+          // fall back to.
+          LLVMRustSetLastError("failed to link unsafe checkpoint module");
+          return LLVMRustResult::Failure;
+        }
+        ResumingFromCheckpoint = true;
+      }
+    }
+  }
+  // UNSAFE-RUST END
+
   ModulePassManager MPM;
   bool NeedThinLTOBufferPasses = UseThinLTOBuffers;
+  // UNSAFE-RUST BEGIN
+  if (ResumingFromCheckpoint) {
+    addUnsafeInstrumentationResumePipeline(MPM);
+  } else
+  // UNSAFE-RUST END
   if (!NoPrepopulatePasses) {
     // The pre-link pipelines don't support O0 and require using buildO0DefaultPipeline() instead.
     // At the same time, the LTO pipelines do support O0 and using them is required.
@@ -1003,6 +1207,35 @@ LLVMRustOptimize(
     UpgradeCallsToIntrinsic(&*I++); // must be post-increment, as we remove
 
   MPM.run(*TheModule, MAM);
+
+  // When RUSTC_LLVM_PIPELINE_FINGERPRINT_FILE is set, record the semantic
+  // fingerprint of the unsafe instrumentation configuration once per
+  // process.  Flags gated on the primary package hash to the same value in
+  // every dependency build regardless of which experiment's llvm-args are
+  // on the command line, so a build system can key shared dependency
+  // artifacts on the recorded value instead of rebuilding the identical
+  // dependencies once per experiment.  Opt-in and best effort, like the
+  // telemetry sidecars above.
+  {
+    static std::once_flag FingerprintOnce;
+    std::call_once(FingerprintOnce, [] {
+      const char *Path = getenv("RUSTC_LLVM_PIPELINE_FINGERPRINT_FILE");
+      if (!Path)
+        return;
+      std::error_code EC;
+      raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+      if (EC)
+        return;
+      OS << format_hex_no_prefix(getUnsafeInstrPipelineFingerprint(), 16)
+         << "\n";
+    });
+  }
+
+  if (Telemetry) {
+    TimeRecord Total = TimeRecord::getCurrentTime(/*Start=*/false);
+    Total -= TelemetryStart;
+    Telemetry->writeJSON(*TheModule, TelemetryPeakRSSBefore, Total);
+  }
   return LLVMRustResult::Success;
 }
 
@@ -11,8 +11,16 @@
 #include "llvm/ADT/SmallString.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/xxhash.h"
 #include <llvm/Support/raw_ostream.h>
 
+#include <cstdlib>
+#include <cstring>
+
 using namespace llvm;
 using namespace llvm::sys;
 using namespace llvm::object;
@@ -34,6 +42,82 @@ static bool isArchiveSymbol(const object::BasicSymbolRef &S) {
 typedef void *(*LLVMRustGetSymbolsCallback)(void *, const char *);
 typedef void *(*LLVMRustGetSymbolsErrorCallback)(const char *);
 
+// Repeated builds of the same dependency graph (one per experiment in
+// run_pipeline.py) hand byte-identical objects back to this function, and
+// re-parsing them to recover the same symbol lists is pure overhead. When
+// RUSTC_SYMBOL_CACHE_DIR names a directory, the extracted list is stored
+// there keyed by a content hash of the object bytes and replayed from disk
+// on later runs. Opt-in: with the variable unset, nothing changes. The entry
+// point only sees a memory buffer, never a path, so the cache lives in one
+// directory rather than in sidecar files next to each object.
+static const char *symbolCacheDir() {
+  static const char *Dir = getenv("RUSTC_SYMBOL_CACHE_DIR");
+  return Dir;
+}
+
+static void symbolCachePath(const MemoryBuffer &Buf,
+                            SmallVectorImpl<char> &Path) {
+  StringRef Contents = Buf.getBuffer();
+  SmallString<32> Name;
+  // Length alongside the hash so a collision needs both to agree.
+  raw_svector_ostream(Name) << format_hex_no_prefix(xxh3_64bits(Contents), 16)
+                            << '-' << Contents.size() << ".syms";
+  Path.assign(symbolCacheDir(), symbolCacheDir() + strlen(symbolCacheDir()));
+  path::append(Path, Name);
+}
+
+// Replays a cached symbol list (NUL-terminated names, back to back). Returns
+// true if the cache file existed, storing any early-exit value from the
+// callback in Result.
+static bool replayCachedSymbols(const MemoryBuffer &Buf, void *State,
+                                LLVMRustGetSymbolsCallback Callback,
+                                void **Result) {
+  SmallString<128> Path;
+  symbolCachePath(Buf, Path);
+  ErrorOr<std::unique_ptr<MemoryBuffer>> CachedOrErr =
+      MemoryBuffer::getFile(Path);
+  if (!CachedOrErr)
+    return false;
+  StringRef Cached = (*CachedOrErr)->getBuffer();
+  size_t Pos = 0;
+  while (Pos < Cached.size()) {
+    const char *Name = Cached.data() + Pos;
+    size_t Len = strnlen(Name, Cached.size() - Pos);
+    if (Pos + Len >= Cached.size()) // truncated entry: treat as a miss
+      return false;
+    if (void *E = Callback(State, Name)) {
+      *Result = E;
+      return true;
+    }
+    Pos += Len + 1;
+  }
+  *Result = 0;
+  return true;
+}
+
+// Best effort: written to a unique temporary in the cache directory and
+// renamed into place, so concurrent rustc invocations never observe a
+// half-written list. Failures just mean the next build parses again.
+static void writeCachedSymbols(const MemoryBuffer &Buf, StringRef Symbols) {
+  SmallString<128> Path;
+  symbolCachePath(Buf, Path);
+  SmallString<128> TmpPath;
+  int TmpFD;
+  if (fs::createUniqueFile(Twine(Path) + ".tmp%%%%%%", TmpFD, TmpPath))
+    return;
+  {
+    raw_fd_ostream OS(TmpFD, /*shouldClose=*/true);
+    OS << Symbols;
+    if (OS.has_error()) {
+      OS.clear_error();
+      fs::remove(TmpPath);
+      return;
+    }
+  }
+  if (fs::rename(TmpPath, Path))
+    fs::remove(TmpPath);
+}
+
 // Note: This is implemented in C++ instead of using the C api from Rust as IRObjectFile doesn't
 // implement getSymbolName, only printSymbolName, which is inaccessible from the C api.
 extern "C" void *LLVMRustGetSymbols(
@@ -45,6 +129,12 @@ extern "C" void *LLVMRustGetSymbols(
   SmallString<0> SymNameBuf;
   auto SymName = raw_svector_ostream(SymNameBuf);
 
+  if (symbolCacheDir()) {
+    void *Result;
+    if (replayCachedSymbols(*Buf, State, Callback, &Result))
+      return Result;
+  }
+
   // In the scenario when LLVMContext is populated SymbolicFile will contain a
   // reference to it, thus SymbolicFile should be destroyed first.
   LLVMContext Context;
@@ -79,6 +169,7 @@ extern "C" void *LLVMRustGetSymbols(
   }
 
 
+  SmallString<0> CacheBuf;
   for (const object::BasicSymbolRef &S : Obj->symbols()) {
     if (!isArchiveSymbol(S))
       continue;
@@ -92,7 +183,13 @@ extern "C" void *LLVMRustGetSymbols(
     if (void *E = Callback(State, SymNameBuf.str().data())) {
       return E;
     }
+    if (symbolCacheDir())
+      CacheBuf.append(SymNameBuf);
     SymNameBuf.clear();
   }
+  // Only a fully extracted list is cached; error and early-callback-exit
+  // paths above leave no cache entry behind.
+  if (symbolCacheDir())
+    writeCachedSymbols(*Buf, CacheBuf);
   return 0;
 }
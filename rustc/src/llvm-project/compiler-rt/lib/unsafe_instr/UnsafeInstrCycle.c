@@ -0,0 +1,807 @@
+/*===- UnsafeInstrCycle.c - CPU cycle probe runtime -----------------------===*\
+|*
+|* Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+|* See https://llvm.org/LICENSE.txt for license information.
+|* SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+|*
+\*===----------------------------------------------------------------------===*/
+
+/* Runtime side of CpuCycleCountPass: the start/end measurement probes, the
+ * per-thread/inline flush hooks and the exit-time report. Each thread
+ * accumulates into its own totals; thread-exit hooks fold them into global
+ * atomics, so the probe fast path is two counter reads and two thread-local
+ * adds with no shared-cache-line traffic.
+ */
+
+#include "UnsafeInstrUtil.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Per-thread unsafe-cycle totals. */
+static __thread uint64_t ThreadCycles;
+static __thread uint64_t ThreadCount;
+static __thread int ThreadArmed;
+
+/* Begin/end pairing state. Every start probe opens a depth level; every
+ * end probe closes one. An end with no open level means the pairing broke
+ * (a stale start value replayed, mismatched instrumentation) and its
+ * sample is discarded rather than folded in; a level still open when the
+ * thread flushes means a panic unwound past the end probe and the start
+ * TSC leaked. Both are counted so the dump states how many samples the
+ * run lost instead of corrupting the totals silently. */
+static __thread uint64_t ThreadRegionDepth;
+static __thread uint64_t ThreadCorrupted;
+static __thread uint64_t ThreadAbandoned;
+static __thread uint64_t ThreadUnwound;
+
+static uint64_t CorruptedSamples;
+static uint64_t AbandonedStarts;
+static uint64_t UnwoundSamples;
+
+/* Global totals, folded from exiting threads. */
+static uint64_t TotalCycles;
+static uint64_t TotalCount;
+static uint64_t ProgramStartCycles;
+
+/* Integrity shadows: every fold into the global totals lands here too,
+ * through the always-atomic add. The dump compares the two — a racing
+ * (lost-update) fold on the primary side shows up as a shadow surplus,
+ * which is how a plausible-but-wrong total announces itself without a
+ * TSan run. Folds are rare (thread exits), so the duplicate add costs
+ * nothing measurable. */
+static uint64_t ShadowCycles;
+static uint64_t ShadowCount;
+
+/* Scope attribution (-cpu-cycle-scope-attribution): the registered name
+ * table and per-scope totals. Scope IDs are module-local; measurement runs
+ * compile the primary package as one codegen unit, so a second registration
+ * is reported and ignored rather than silently misattributed. */
+static const char *const *ScopeNames;
+static uint32_t NumScopes;
+static uint64_t *ScopeCycles;
+static uint64_t *ScopeCounts;
+
+/* Static estimation (-cpu-cycle-static-cost-threshold): the module emits
+ * one contiguous executed-counter array (hot — the only memory the
+ * increments touch) and one constant estimate table (cold — read once at
+ * print time), registered as a pair. The slot index is the module-order
+ * region ID. */
+typedef struct {
+  const uint64_t *EstimatedCycles;
+  const uint64_t *Counters;
+  uint32_t Count;
+} UnsafeStaticTable;
+
+#define MAX_STATIC_TABLES 64
+static UnsafeStaticTable StaticTables[MAX_STATIC_TABLES];
+static uint32_t NumStaticTables;
+
+/* Per-thread identity rows: each thread that ever accumulated claims one at
+ * its first flush, recording a stable ordinal and its pthread name at that
+ * point (executor pools name their workers after spawn, so first-flush
+ * capture sees the final name). The row outlives the thread, which is the
+ * whole point: the dump can break totals down by executor thread after the
+ * workers have exited. */
+typedef struct {
+  uint32_t Ordinal;
+  char Name[UNSAFE_INSTR_THREAD_NAME_MAX];
+  uint64_t Cycles;
+  uint64_t Count;
+} UnsafeThreadRow;
+
+#define MAX_THREAD_ROWS 256
+
+static UnsafeThreadRow ThreadRows[MAX_THREAD_ROWS];
+static uint32_t NumThreadRows;
+static __thread uint32_t ThreadRowSlot; /* Slot + 1; 0 = not yet claimed. */
+
+static UnsafeThreadRow *claim_thread_row(void) {
+  if (!ThreadRowSlot) {
+    uint32_t Slot = UNSAFE_INSTR_ATOMIC_ADD(&NumThreadRows, 1);
+    if (Slot >= MAX_THREAD_ROWS)
+      return NULL;
+    ThreadRows[Slot].Ordinal = unsafe_instr_thread_ordinal();
+    const char *Name = unsafe_instr_thread_name();
+    strncpy(ThreadRows[Slot].Name, Name, UNSAFE_INSTR_THREAD_NAME_MAX - 1);
+    ThreadRowSlot = Slot + 1;
+  }
+  return &ThreadRows[ThreadRowSlot - 1];
+}
+
+static void flush_thread_cycles(void) {
+  if (ThreadRegionDepth) {
+    /* Starts whose end probe never fired. The leaked TSCs were never
+     * folded in, so the totals are clean — only the samples are lost. */
+    ThreadAbandoned += ThreadRegionDepth;
+    ThreadRegionDepth = 0;
+  }
+  if (ThreadCorrupted || ThreadAbandoned || ThreadUnwound) {
+    UNSAFE_INSTR_ATOMIC_ADD(&CorruptedSamples, ThreadCorrupted);
+    UNSAFE_INSTR_ATOMIC_ADD(&AbandonedStarts, ThreadAbandoned);
+    UNSAFE_INSTR_ATOMIC_ADD(&UnwoundSamples, ThreadUnwound);
+    ThreadCorrupted = ThreadAbandoned = ThreadUnwound = 0;
+  }
+  if (!ThreadCycles && !ThreadCount)
+    return;
+  /* A thread can flush more than once (the main thread does, and a worker
+   * that keeps running after an explicit flush re-accumulates); repeated
+   * flushes fold into the same claimed row. */
+  UnsafeThreadRow *Row = claim_thread_row();
+  if (Row) {
+    UNSAFE_INSTR_ATOMIC_ADD(&Row->Cycles, ThreadCycles);
+    UNSAFE_INSTR_ATOMIC_ADD(&Row->Count, ThreadCount);
+  }
+  UNSAFE_INSTR_ATOMIC_ADD(&TotalCycles, ThreadCycles);
+  UNSAFE_INSTR_ATOMIC_ADD(&TotalCount, ThreadCount);
+  UNSAFE_INSTR_SHADOW_ADD(&ShadowCycles, ThreadCycles);
+  UNSAFE_INSTR_SHADOW_ADD(&ShadowCount, ThreadCount);
+  ThreadCycles = 0;
+  ThreadCount = 0;
+}
+
+static void arm_thread(void) {
+  if (!ThreadArmed) {
+    ThreadArmed = 1;
+    unsafe_instr_arm_thread_exit();
+  }
+}
+
+/* Streaming mode (UNSAFE_INSTR_STREAM_MS): the background flusher can
+ * only see global state, and a long-lived service thread never exits, so
+ * its TLS totals would stay invisible forever. Under streaming the end
+ * probes therefore accumulate straight into the thread's claimed global
+ * row and the global totals — uncontended relaxed adds, since the row is
+ * owned by one thread — trading a little probe cost for totals the
+ * flusher can snapshot at any moment. */
+static int StreamMode;
+static uint64_t StreamLastCycles;
+static uint64_t StreamLastCount;
+
+void unsafe_instr_cycle_totals(uint64_t *Cycles, uint64_t *Count);
+
+/* Appends one cpu_cycle_stream delta section: how far the totals moved
+ * since the previous flush. Deltas rather than cumulative snapshots so
+ * the aggregator's summing merge reconstructs the run from whatever
+ * prefix survives a crash; an interval in which nothing moved appends
+ * nothing. Only the flusher thread reads and writes the Last markers. */
+static void stream_cycle_deltas(void) {
+  uint64_t Cycles, Count;
+  unsafe_instr_cycle_totals(&Cycles, &Count);
+  uint64_t DeltaCycles = Cycles - StreamLastCycles;
+  uint64_t DeltaCount = Count - StreamLastCount;
+  if (!DeltaCycles && !DeltaCount)
+    return;
+  StreamLastCycles = Cycles;
+  StreamLastCount = Count;
+  FILE *Out = unsafe_instr_out();
+  fprintf(Out, "== cpu_cycle_stream ==\n");
+  fprintf(Out, "unsafe_cycles\t%llu\nunsafe_region_executions\t%llu\n"
+               "stream_flushes\t1\n",
+          (unsigned long long)DeltaCycles, (unsigned long long)DeltaCount);
+}
+
+static void reset_cycle_stats(void);
+
+static pthread_once_t CycleHooksOnce = PTHREAD_ONCE_INIT;
+static void install_cycle_hooks(void) {
+  unsafe_instr_at_thread_exit(flush_thread_cycles);
+  unsafe_instr_register_reset(reset_cycle_stats);
+  if (unsafe_instr_stream_interval_ms()) {
+    StreamMode = 1;
+    unsafe_instr_register_stream_flush(stream_cycle_deltas);
+    unsafe_instr_stream_start();
+  }
+}
+
+/* Probe self-cost: even an empty begin/end pair reports a nonzero delta —
+ * the cycles between the start probe's counter read and the end probe's,
+ * which is pure probe machinery and lands in every measured region as a
+ * constant bias. The ctor measures that exact sequence empty, min-filtered
+ * over enough iterations to dodge interrupts and frequency ramps, and the
+ * dump reports totals both raw and with count*cost subtracted. One cost
+ * covers all end-probe variants: their extra work (scope adds, task table)
+ * happens after the counter read, outside the measured window. */
+#define PROBE_CALIBRATION_ITERS 4096
+
+static uint64_t ProbePairCost;
+
+uint64_t cpu_cycle_start_measurement(void);
+void cpu_cycle_end_measurement(uint64_t Start);
+
+static void calibrate_probe_cost(void) {
+  uint64_t Min = UINT64_MAX;
+  for (uint32_t I = 0; I < PROBE_CALIBRATION_ITERS; ++I) {
+    uint64_t Before = ThreadCycles;
+    uint64_t Start = cpu_cycle_start_measurement();
+    cpu_cycle_end_measurement(Start);
+    uint64_t Delta = ThreadCycles - Before;
+    if (Delta < Min)
+      Min = Delta;
+  }
+  /* Runs before this thread accumulates anything real, so discarding the
+   * calibration contributions is a plain reset. */
+  ThreadCycles = 0;
+  ThreadCount = 0;
+  ProbePairCost = Min == UINT64_MAX ? 0 : Min;
+}
+
+void record_program_start(void) {
+  /* Calibrate before the hooks install: streaming mode (selected there)
+   * accumulates into global rows, which a reset could not cleanly undo. */
+  static int Calibrated;
+  if (!Calibrated) {
+    Calibrated = 1;
+    calibrate_probe_cost();
+  }
+  pthread_once(&CycleHooksOnce, install_cycle_hooks);
+  if (!ProgramStartCycles)
+    ProgramStartCycles = unsafe_instr_read_cycles();
+}
+
+uint64_t cpu_cycle_start_measurement(void) {
+  /* The pass emits the configured serialization before the call; a plain
+   * read here keeps the probe cost down. 0 is the "not sampled" sentinel
+   * the end probe tests, so never return it for a real read. */
+  ++ThreadRegionDepth;
+  uint64_t Now = unsafe_instr_read_cycles();
+  return Now ? Now : 1;
+}
+
+/* Closes one pairing level for an end probe. Returns 0 when no level is
+ * open — the sample cannot be trusted and the caller discards it. */
+static int close_region_depth(void) {
+  if (!ThreadRegionDepth) {
+    ++ThreadCorrupted;
+    return 0;
+  }
+  --ThreadRegionDepth;
+  return 1;
+}
+
+static void sample_folded_stack(uint64_t Delta);
+
+/* Folds one region delta into the thread's totals: the TLS accumulators
+ * in batch mode, the claimed global row (plus the global totals and
+ * their integrity shadows) in streaming mode, where the flusher must be
+ * able to see every delta without waiting for a thread exit. */
+static void account_region(uint64_t Delta) {
+  if (!StreamMode) {
+    ThreadCycles += Delta;
+    ++ThreadCount;
+    return;
+  }
+  UnsafeThreadRow *Row = claim_thread_row();
+  if (Row) {
+    UNSAFE_INSTR_ATOMIC_ADD(&Row->Cycles, Delta);
+    UNSAFE_INSTR_ATOMIC_ADD(&Row->Count, 1);
+  }
+  UNSAFE_INSTR_ATOMIC_ADD(&TotalCycles, Delta);
+  UNSAFE_INSTR_ATOMIC_ADD(&TotalCount, 1);
+  UNSAFE_INSTR_SHADOW_ADD(&ShadowCycles, Delta);
+  UNSAFE_INSTR_SHADOW_ADD(&ShadowCount, 1);
+}
+
+void cpu_cycle_end_measurement(uint64_t Start) {
+  if (!Start) /* Sampled-out execution (-unsafe-instr-sample-rate). */
+    return;
+  uint64_t Delta = unsafe_instr_read_cycles() - Start;
+  arm_thread();
+  if (!close_region_depth())
+    return;
+  account_region(Delta);
+  sample_folded_stack(Delta);
+}
+
+/* Unwind-path end probe: called from the cleanup pads
+ * -cpu-cycle-unwind-probes plants on may-unwind calls inside a region, so
+ * a panic closes the region instead of leaking its start. The work up to
+ * the panic is real work done in the region, so the delta folds in like a
+ * normal end; the sample is also counted separately so unwind-heavy runs
+ * can judge how much of their total came off the panic path. */
+void cpu_cycle_end_measurement_unwind(uint64_t Start) {
+  if (!Start)
+    return;
+  uint64_t Delta = unsafe_instr_read_cycles() - Start;
+  arm_thread();
+  if (!close_region_depth())
+    return;
+  account_region(Delta);
+  ++ThreadUnwound;
+}
+
+void cpu_cycle_end_measurement_scoped(uint64_t Start, uint32_t ScopeId) {
+  if (!Start)
+    return;
+  uint64_t Delta = unsafe_instr_read_cycles() - Start;
+  arm_thread();
+  if (!close_region_depth())
+    return;
+  account_region(Delta);
+  /* Per-scope totals are atomic adds rather than thread-local arrays: the
+   * scope table size is only known at registration and scoped runs trade a
+   * little probe cost for attribution anyway. */
+  if (ScopeCycles && ScopeId < NumScopes) {
+    UNSAFE_INSTR_ATOMIC_ADD(&ScopeCycles[ScopeId], Delta);
+    UNSAFE_INSTR_ATOMIC_ADD(&ScopeCounts[ScopeId], 1);
+  }
+}
+
+/* Task-context attribution (-cpu-cycle-task-context): one TLS slot holds
+ * the current logical-task ID, and the task end-probe variant charges each
+ * delta to it through a fixed open-addressed table — claim by CAS, relaxed
+ * adds after that, same discipline as the folded-stack table. The setter
+ * below is the contract for task-instrumentation shims (a tokio
+ * task-poll wrapper, say): publish the task's ID on poll entry, publish 0
+ * when the worker returns to the scheduler. Deltas measured under ID 0
+ * land in the unattributed bucket rather than vanishing. */
+#define MAX_TASK_CONTEXTS 4096
+
+typedef struct {
+  uint64_t Id; /* 0 = free, claimed by CAS. */
+  uint64_t Cycles;
+  uint64_t Count;
+} UnsafeTaskEntry;
+
+static UnsafeTaskEntry TaskTable[MAX_TASK_CONTEXTS];
+static uint64_t TaskUnattributedCycles;
+static uint64_t TaskUnattributedCount;
+static uint64_t TaskDropped;
+
+static __thread uint64_t ThreadTaskContext;
+
+void __unsafe_set_task_context(uint64_t Id) { ThreadTaskContext = Id; }
+
+void cpu_cycle_end_measurement_task(uint64_t Start) {
+  if (!Start)
+    return;
+  uint64_t Delta = unsafe_instr_read_cycles() - Start;
+  arm_thread();
+  if (!close_region_depth())
+    return;
+  account_region(Delta);
+  sample_folded_stack(Delta);
+
+  uint64_t Id = ThreadTaskContext;
+  if (!Id) {
+    UNSAFE_INSTR_ATOMIC_ADD(&TaskUnattributedCycles, Delta);
+    UNSAFE_INSTR_ATOMIC_ADD(&TaskUnattributedCount, 1);
+    return;
+  }
+  /* Task IDs are often sequential; mix before masking. */
+  uint64_t Hash = Id;
+  Hash ^= Hash >> 33;
+  Hash *= 0xff51afd7ed558ccdull;
+  Hash ^= Hash >> 33;
+  for (uint32_t Probe = 0; Probe < 8; ++Probe) {
+    UnsafeTaskEntry *E = &TaskTable[(Hash + Probe) & (MAX_TASK_CONTEXTS - 1)];
+    uint64_t Expected = 0;
+    if (!__atomic_compare_exchange_n(&E->Id, &Expected, Id, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+        Expected != Id)
+      continue; /* Occupied by another task; probe onward. */
+    UNSAFE_INSTR_ATOMIC_ADD(&E->Cycles, Delta);
+    UNSAFE_INSTR_ATOMIC_ADD(&E->Count, 1);
+    return;
+  }
+  UNSAFE_INSTR_ATOMIC_ADD(&TaskDropped, Delta);
+}
+
+void cpu_cycle_register_scope_table(const char *const *Names, uint32_t Count) {
+  if (ScopeNames) {
+    fprintf(stderr, "unsafe_instr: multiple cycle scope tables registered; "
+                    "keeping the first (compile the primary package as one "
+                    "codegen unit for scope attribution)\n");
+    return;
+  }
+  ScopeNames = Names;
+  NumScopes = Count;
+  ScopeCycles = unsafe_instr_table_alloc(Count * sizeof(uint64_t));
+  ScopeCounts = unsafe_instr_table_alloc(Count * sizeof(uint64_t));
+}
+
+void cpu_cycle_record_inline_totals(uint64_t Cycles, uint64_t Count) {
+  UNSAFE_INSTR_ATOMIC_ADD(&TotalCycles, Cycles);
+  UNSAFE_INSTR_ATOMIC_ADD(&TotalCount, Count);
+  UNSAFE_INSTR_SHADOW_ADD(&ShadowCycles, Cycles);
+  UNSAFE_INSTR_SHADOW_ADD(&ShadowCount, Count);
+}
+
+void cpu_cycle_register_static_table(const uint64_t *EstimatedCycles,
+                                     const uint64_t *Counters,
+                                     uint32_t Count) {
+  uint32_t Slot = UNSAFE_INSTR_ATOMIC_ADD(&NumStaticTables, 1);
+  if (Slot >= MAX_STATIC_TABLES)
+    return;
+  StaticTables[Slot].EstimatedCycles = EstimatedCycles;
+  StaticTables[Slot].Counters = Counters;
+  StaticTables[Slot].Count = Count;
+}
+
+/* Per-thread per-function arrays (-cpu-cycle-per-thread): the module emits
+ * a thunk that hands its TLS arrays here; totals fold into the plain
+ * global counters since the function table itself lives module-side. */
+void cpu_cycle_flush_thread_totals(const uint64_t *Cycles,
+                                   const uint64_t *Counts,
+                                   uint32_t NumSlots) {
+  uint64_t CycleSum = 0, CountSum = 0;
+  for (uint32_t I = 0; I < NumSlots; ++I) {
+    CycleSum += Cycles[I];
+    CountSum += Counts[I];
+  }
+  /* The thunk runs on the owning thread, so the identity row works the
+   * same way as in the plain-accumulator flush above. */
+  UnsafeThreadRow *Row = claim_thread_row();
+  if (Row) {
+    UNSAFE_INSTR_ATOMIC_ADD(&Row->Cycles, CycleSum);
+    UNSAFE_INSTR_ATOMIC_ADD(&Row->Count, CountSum);
+  }
+  UNSAFE_INSTR_ATOMIC_ADD(&TotalCycles, CycleSum);
+  UNSAFE_INSTR_ATOMIC_ADD(&TotalCount, CountSum);
+  UNSAFE_INSTR_SHADOW_ADD(&ShadowCycles, CycleSum);
+  UNSAFE_INSTR_SHADOW_ADD(&ShadowCount, CountSum);
+}
+
+void cpu_cycle_register_thread_flush(void (*Callback)(void)) {
+  unsafe_instr_at_thread_exit(Callback);
+}
+
+/* Folded stacks (-cpu-cycle-folded-stacks): a per-thread shadow stack of
+ * tracker function IDs, sampled by the end probes into a fixed-size
+ * open-addressed table keyed by the stack's hash. Claiming an entry is one
+ * CAS; accumulation after that is relaxed adds, so the table stays
+ * lock-free. Collisions and overflow drop samples into a counted bucket
+ * rather than blocking. */
+#define SHADOW_STACK_DEPTH 128
+#define FOLDED_TABLE_SIZE 4096
+
+static __thread uint32_t ShadowStack[SHADOW_STACK_DEPTH];
+static __thread uint32_t ShadowDepth;
+
+typedef struct {
+  uint64_t Hash; /* 0 = free, claimed by CAS. */
+  uint64_t Cycles;
+  uint64_t Count;
+  uint32_t Depth;
+  uint32_t Ids[SHADOW_STACK_DEPTH];
+} UnsafeFoldedEntry;
+
+static UnsafeFoldedEntry FoldedTable[FOLDED_TABLE_SIZE];
+static uint64_t FoldedDropped;
+
+static const char *const *StackNames;
+static uint32_t NumStackNames;
+
+void __cpu_cycle_stack_push(uint32_t Id) {
+  if (ShadowDepth < SHADOW_STACK_DEPTH)
+    ShadowStack[ShadowDepth] = Id;
+  ++ShadowDepth;
+}
+
+void __cpu_cycle_stack_pop(void) {
+  if (ShadowDepth)
+    --ShadowDepth;
+}
+
+void cpu_cycle_register_stack_names(const char *const *Names,
+                                    uint32_t Count) {
+  if (StackNames) {
+    fprintf(stderr, "unsafe_instr: multiple stack name tables registered; "
+                    "keeping the first\n");
+    return;
+  }
+  StackNames = Names;
+  NumStackNames = Count;
+}
+
+static void sample_folded_stack(uint64_t Delta) {
+  if (!StackNames || !ShadowDepth || ShadowDepth > SHADOW_STACK_DEPTH)
+    return;
+
+  uint64_t Hash = 0xcbf29ce484222325ull; /* FNV-1a over the frame IDs. */
+  for (uint32_t I = 0; I < ShadowDepth; ++I) {
+    Hash ^= ShadowStack[I];
+    Hash *= 0x100000001b3ull;
+  }
+  if (!Hash)
+    Hash = 1;
+
+  for (uint32_t Probe = 0; Probe < 8; ++Probe) {
+    UnsafeFoldedEntry *E =
+        &FoldedTable[(Hash + Probe) & (FOLDED_TABLE_SIZE - 1)];
+    uint64_t Expected = 0;
+    if (__atomic_compare_exchange_n(&E->Hash, &Expected, Hash, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      E->Depth = ShadowDepth;
+      memcpy(E->Ids, ShadowStack, ShadowDepth * sizeof(uint32_t));
+    } else if (Expected != Hash) {
+      continue; /* Occupied by another stack; probe onward. */
+    }
+    UNSAFE_INSTR_ATOMIC_ADD(&E->Cycles, Delta);
+    UNSAFE_INSTR_ATOMIC_ADD(&E->Count, 1);
+    return;
+  }
+  UNSAFE_INSTR_ATOMIC_ADD(&FoldedDropped, Delta);
+}
+
+void cpu_cycle_dump_folded_stacks(void) {
+  if (!StackNames)
+    return;
+  FILE *Out = unsafe_instr_out();
+  fprintf(Out, "== cpu_cycle_folded ==\n");
+  for (uint32_t I = 0; I < FOLDED_TABLE_SIZE; ++I) {
+    UnsafeFoldedEntry *E = &FoldedTable[I];
+    if (!E->Hash || !E->Count)
+      continue;
+    for (uint32_t D = 0; D < E->Depth; ++D) {
+      const char *Name =
+          E->Ids[D] < NumStackNames ? StackNames[E->Ids[D]] : NULL;
+      /* Null slots with an in-range ID are stripped builds
+       * (-unsafe-name-sidecar-dir): keep the frame resolvable offline. */
+      if (!Name && E->Ids[D] < NumStackNames)
+        fprintf(Out, "%sid:%u", D ? ";" : "", E->Ids[D]);
+      else
+        fprintf(Out, "%s%s", D ? ";" : "", Name ? Name : "?");
+    }
+    fprintf(Out, " %llu\n", (unsigned long long)E->Cycles);
+  }
+  if (FoldedDropped)
+    fprintf(Out, "[dropped] %llu\n", (unsigned long long)FoldedDropped);
+  fflush(Out);
+}
+
+/* rdpmc support (-cpu-cycle-probe-source=rdpmc): program a core-cycles
+ * perf_event with rdpmc enabled and publish the counter index the inline
+ * probes load. Index 0 keeps the probes reading counter 0 if the kernel
+ * refuses the event; the run then measures garbage loudly rather than
+ * crashing, and the warning below says why. */
+uint32_t __cpu_cycle_pmc_index;
+
+#if defined(__linux__) && defined(__x86_64__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+void cpu_cycle_pmc_init(void) {
+  struct perf_event_attr Attr;
+  memset(&Attr, 0, sizeof(Attr));
+  Attr.size = sizeof(Attr);
+  Attr.type = PERF_TYPE_HARDWARE;
+  Attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  Attr.exclude_kernel = 1;
+
+  int Fd = (int)syscall(__NR_perf_event_open, &Attr, 0, -1, -1, 0);
+  if (Fd < 0) {
+    fprintf(stderr, "unsafe_instr: perf_event_open failed; rdpmc probes "
+                    "will read counter 0\n");
+    return;
+  }
+  struct perf_event_mmap_page *Page =
+      mmap(NULL, (size_t)sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, Fd, 0);
+  if (Page == MAP_FAILED || !Page->cap_user_rdpmc || !Page->index) {
+    fprintf(stderr, "unsafe_instr: rdpmc not available for the cycle "
+                    "event; rdpmc probes will read counter 0\n");
+    return;
+  }
+  /* rdpmc takes the index biased by one in the mmap page. */
+  __cpu_cycle_pmc_index = Page->index - 1;
+}
+#else
+void cpu_cycle_pmc_init(void) {
+  fprintf(stderr,
+          "unsafe_instr: rdpmc probe source unsupported on this target\n");
+}
+#endif
+
+/* Self-calibration (-cpu-cycle-calibrate-rate): per-function cycle totals
+ * for the probed implementation and its probe-free twin, keyed by the
+ * address of the name string the dispatcher passes (one interned constant
+ * per function, so pointer equality is identity). Claiming a slot is one
+ * CAS; accumulation after that is relaxed adds, like the folded-stack
+ * table. The overhead factors come out with the regular stats at exit. */
+#define MAX_CALIBRATE_FUNCS 1024
+
+typedef struct {
+  const char *Name; /* NULL = free, claimed by CAS. */
+  uint64_t RefCycles;
+  uint64_t RefCalls;
+  uint64_t ProbedCycles;
+  uint64_t ProbedCalls;
+} UnsafeCalibrateEntry;
+
+static UnsafeCalibrateEntry CalibrateTable[MAX_CALIBRATE_FUNCS];
+static uint64_t CalibrateDropped;
+
+void cpu_cycle_calibrate_record(const char *Name, uint64_t Cycles,
+                                uint32_t IsReference) {
+  /* Pointer bits are clumpy; mix before masking. */
+  uint64_t Hash = (uint64_t)(uintptr_t)Name;
+  Hash ^= Hash >> 33;
+  Hash *= 0xff51afd7ed558ccdull;
+  Hash ^= Hash >> 33;
+
+  for (uint32_t Probe = 0; Probe < 8; ++Probe) {
+    UnsafeCalibrateEntry *E =
+        &CalibrateTable[(Hash + Probe) & (MAX_CALIBRATE_FUNCS - 1)];
+    const char *Expected = NULL;
+    if (!__atomic_compare_exchange_n(&E->Name, &Expected, Name, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+        Expected != Name)
+      continue; /* Occupied by another function; probe onward. */
+    if (IsReference) {
+      UNSAFE_INSTR_ATOMIC_ADD(&E->RefCycles, Cycles);
+      UNSAFE_INSTR_ATOMIC_ADD(&E->RefCalls, 1);
+    } else {
+      UNSAFE_INSTR_ATOMIC_ADD(&E->ProbedCycles, Cycles);
+      UNSAFE_INSTR_ATOMIC_ADD(&E->ProbedCalls, 1);
+    }
+    return;
+  }
+  UNSAFE_INSTR_ATOMIC_ADD(&CalibrateDropped, 1);
+}
+
+/* Batch-runner reset: every dynamic accumulator in this unit back to
+ * zero. Thread-row claims and names survive — running threads hold their
+ * slot in TLS — only the folded numbers restart; so do the scope and
+ * static registration tables, whose name/estimate sides describe the
+ * build. ProbePairCost survives too: calibration measures the probe
+ * machinery on this host, not the iteration. The caller has already
+ * flushed the iterating thread. */
+static void reset_cycle_stats(void) {
+  TotalCycles = TotalCount = 0;
+  ShadowCycles = ShadowCount = 0;
+  CorruptedSamples = AbandonedStarts = UnwoundSamples = 0;
+  StreamLastCycles = StreamLastCount = 0;
+  uint32_t Rows =
+      NumThreadRows < MAX_THREAD_ROWS ? NumThreadRows : MAX_THREAD_ROWS;
+  for (uint32_t I = 0; I < Rows; ++I) {
+    ThreadRows[I].Cycles = 0;
+    ThreadRows[I].Count = 0;
+  }
+  if (ScopeCycles)
+    memset(ScopeCycles, 0, NumScopes * sizeof(uint64_t));
+  if (ScopeCounts)
+    memset(ScopeCounts, 0, NumScopes * sizeof(uint64_t));
+  memset(TaskTable, 0, sizeof(TaskTable));
+  TaskUnattributedCycles = TaskUnattributedCount = TaskDropped = 0;
+  memset(FoldedTable, 0, sizeof(FoldedTable));
+  FoldedDropped = 0;
+  memset(CalibrateTable, 0, sizeof(CalibrateTable));
+  CalibrateDropped = 0;
+  /* The executed-counter arrays live module-side but are plain writable
+   * slots the emitted increments hit; only the estimate side is truly
+   * constant. */
+  uint32_t NumTables =
+      NumStaticTables < MAX_STATIC_TABLES ? NumStaticTables : MAX_STATIC_TABLES;
+  for (uint32_t T = 0; T < NumTables; ++T)
+    memset((uint64_t *)(uintptr_t)StaticTables[T].Counters, 0,
+           StaticTables[T].Count * sizeof(uint64_t));
+  /* Restart the wall-clock anchor so program_cycles means "this
+   * iteration" in per-iteration records. */
+  ProgramStartCycles = unsafe_instr_read_cycles();
+}
+
+/* Internal accessor for the shared-memory publish hook: the totals with
+ * static estimates folded in, as print_cpu_cycle_stats would report them.
+ * The caller flushes the calling thread first. */
+void unsafe_instr_cycle_totals(uint64_t *Cycles, uint64_t *Count) {
+  *Cycles = TotalCycles;
+  *Count = TotalCount;
+  uint32_t NumTables =
+      NumStaticTables < MAX_STATIC_TABLES ? NumStaticTables : MAX_STATIC_TABLES;
+  for (uint32_t T = 0; T < NumTables; ++T)
+    for (uint32_t I = 0; I < StaticTables[T].Count; ++I) {
+      uint64_t Executions = StaticTables[T].Counters[I];
+      *Cycles += Executions * StaticTables[T].EstimatedCycles[I];
+      *Count += Executions;
+    }
+}
+
+void print_cpu_cycle_stats(void) {
+  unsafe_instr_flush_this_thread();
+
+  uint64_t Cycles, Count;
+  unsafe_instr_cycle_totals(&Cycles, &Count);
+
+  FILE *Out = unsafe_instr_out();
+  fprintf(Out, "== cpu_cycle ==\n");
+  fprintf(Out, "unsafe_cycles\t%llu\n", (unsigned long long)Cycles);
+  fprintf(Out, "unsafe_region_executions\t%llu\n", (unsigned long long)Count);
+  /* Self-cost compensation: the calibrated empty-pair cost, times the
+   * runtime-measured executions only — static-estimate executions carry
+   * no probe in the measured window and are already in both totals. */
+  if (ProbePairCost) {
+    uint64_t Bias = ProbePairCost * TotalCount;
+    fprintf(Out, "probe_pair_cost\t%llu\n", (unsigned long long)ProbePairCost);
+    fprintf(Out, "unsafe_cycles_compensated\t%llu\n",
+            (unsigned long long)(Cycles > Bias ? Cycles - Bias : 0));
+  }
+  if (ProgramStartCycles)
+    fprintf(Out, "program_cycles\t%llu\n",
+            (unsigned long long)(unsafe_instr_read_cycles() -
+                                 ProgramStartCycles));
+  /* Accumulator integrity: the shadows received exactly what the primary
+   * totals did, via always-atomic adds, so any difference is an update the
+   * primary side lost to a race (a real risk only in
+   * UNSAFE_INSTR_NONATOMIC_ADDS builds, but checked in every build since
+   * it is free). Compared before static estimates fold in, which reach
+   * the totals without going through an add. */
+  int AccumOk = TotalCycles == ShadowCycles && TotalCount == ShadowCount;
+  fprintf(Out, "accum_integrity\t%d\n", AccumOk);
+  if (!AccumOk)
+    fprintf(Out, "accum_lost_cycles\t%lld\taccum_lost_count\t%lld\n",
+            (long long)(ShadowCycles - TotalCycles),
+            (long long)(ShadowCount - TotalCount));
+  /* Pairing diagnostics: corrupted/abandoned count samples the run lost to
+   * broken begin/end pairing (ends without a start, starts a panic unwound
+   * past); unwound counts the samples the cleanup-pad probes recovered. */
+  if (CorruptedSamples || AbandonedStarts || UnwoundSamples) {
+    fprintf(Out, "corrupted_samples\t%llu\n",
+            (unsigned long long)CorruptedSamples);
+    fprintf(Out, "abandoned_starts\t%llu\n",
+            (unsigned long long)AbandonedStarts);
+    fprintf(Out, "unwound_samples\t%llu\n",
+            (unsigned long long)UnwoundSamples);
+  }
+  /* Null entries are stripped builds (-unsafe-name-sidecar-dir): print the
+   * ID so the offline sidecar join still resolves the scope, where a shared
+   * placeholder would merge every stripped row into one. */
+  for (uint32_t I = 0; I < NumScopes; ++I)
+    if (ScopeCounts[I]) {
+      char IdBuf[16];
+      const char *Name = ScopeNames[I];
+      if (!Name) {
+        snprintf(IdBuf, sizeof(IdBuf), "id:%u", I);
+        Name = IdBuf;
+      }
+      fprintf(Out, "scope\t%s\t%llu\t%llu\n", Name,
+              (unsigned long long)ScopeCycles[I],
+              (unsigned long long)ScopeCounts[I]);
+    }
+  /* thread: ordinal, pthread name, cycles, count. Ordinals are first-flush
+   * order — stable within a run, not across runs; cross-run grouping goes
+   * by the name column. */
+  uint32_t Rows =
+      NumThreadRows < MAX_THREAD_ROWS ? NumThreadRows : MAX_THREAD_ROWS;
+  for (uint32_t I = 0; I < Rows; ++I)
+    if (ThreadRows[I].Cycles || ThreadRows[I].Count)
+      fprintf(Out, "thread\t%u\t%s\t%llu\t%llu\n", ThreadRows[I].Ordinal,
+              ThreadRows[I].Name[0] ? ThreadRows[I].Name : "?",
+              (unsigned long long)ThreadRows[I].Cycles,
+              (unsigned long long)ThreadRows[I].Count);
+  /* task: context ID, cycles, count — one row per logical task a shim
+   * published through __unsafe_set_task_context. */
+  for (uint32_t I = 0; I < MAX_TASK_CONTEXTS; ++I)
+    if (TaskTable[I].Id && TaskTable[I].Count)
+      fprintf(Out, "task\t%llu\t%llu\t%llu\n",
+              (unsigned long long)TaskTable[I].Id,
+              (unsigned long long)TaskTable[I].Cycles,
+              (unsigned long long)TaskTable[I].Count);
+  if (TaskUnattributedCount)
+    fprintf(Out, "task_unattributed_cycles\t%llu\ttask_unattributed\t%llu\n",
+            (unsigned long long)TaskUnattributedCycles,
+            (unsigned long long)TaskUnattributedCount);
+  if (TaskDropped)
+    fprintf(Out, "task_dropped_cycles\t%llu\n",
+            (unsigned long long)TaskDropped);
+  /* calibrate: name, probed mean, reference mean, overhead factor, calls.
+   * Both sides need samples before a factor means anything. */
+  for (uint32_t I = 0; I < MAX_CALIBRATE_FUNCS; ++I) {
+    UnsafeCalibrateEntry *E = &CalibrateTable[I];
+    if (!E->Name || !E->RefCalls || !E->ProbedCalls)
+      continue;
+    double ProbedMean = (double)E->ProbedCycles / (double)E->ProbedCalls;
+    double RefMean = (double)E->RefCycles / (double)E->RefCalls;
+    fprintf(Out, "calibrate\t%s\t%.1f\t%.1f\t%.3f\t%llu\t%llu\n", E->Name,
+            ProbedMean, RefMean, RefMean > 0 ? ProbedMean / RefMean : 0.0,
+            (unsigned long long)E->ProbedCalls,
+            (unsigned long long)E->RefCalls);
+  }
+  if (CalibrateDropped)
+    fprintf(Out, "calibrate_dropped\t%llu\n",
+            (unsigned long long)CalibrateDropped);
+  fflush(Out);
+}
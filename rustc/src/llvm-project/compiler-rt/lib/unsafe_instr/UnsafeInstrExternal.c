@@ -0,0 +1,140 @@
+/*===- UnsafeInstrExternal.c - External call tracker runtime --------------===*\
+|*
+|* Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+|* See https://llvm.org/LICENSE.txt for license information.
+|* SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+|*
+\*===----------------------------------------------------------------------===*/
+
+/* Runtime side of ExternalCallTrackerPass: per-callee cycle totals for
+ * calls that leave unsafe regions. Callee IDs are dense per registration
+ * ctor; per-callee slots are atomic adds (the probes already bracket a
+ * call, so one relaxed add is noise next to the callee itself).
+ */
+
+#include "UnsafeInstrUtil.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_EXTERNAL_CALLEES 4096
+
+/* Gap histograms (the external_call_end_gap variant) keep one previous-end
+ * TSC slot per callee in TLS; cap the covered IDs so the per-thread cost
+ * stays at a fixed 2KB regardless of how many callees a module registers.
+ * Sixteen log2 buckets span sub-2-cycle gaps up to ~32K cycles and park
+ * everything longer in the last bucket — past that, batching is moot. */
+#define MAX_GAP_CALLEES 256
+#define GAP_BUCKETS 16
+
+static const char *CalleeNames[MAX_EXTERNAL_CALLEES];
+static uint64_t CalleeCycles[MAX_EXTERNAL_CALLEES];
+static uint64_t CalleeCounts[MAX_EXTERNAL_CALLEES];
+static uint64_t GapHist[MAX_GAP_CALLEES][GAP_BUCKETS];
+static __thread uint64_t PrevEndTsc[MAX_GAP_CALLEES];
+static uint32_t MaxCalleeId;
+static int AtExitInstalled;
+
+/* Stripped builds (-unsafe-name-sidecar-dir) register null names; "id:<n>"
+ * keeps the row joinable against the compile-time sidecar, where "?" would
+ * collapse every nameless callee into one. */
+static const char *callee_identity(uint32_t Id, char *Buf, size_t Size) {
+  if (CalleeNames[Id])
+    return CalleeNames[Id];
+  snprintf(Buf, Size, "id:%u", Id);
+  return Buf;
+}
+
+static void print_external_call_stats(void) {
+  FILE *Out = unsafe_instr_out();
+  char IdBuf[16];
+  fprintf(Out, "== external_calls ==\n");
+  uint32_t Limit = MaxCalleeId < MAX_EXTERNAL_CALLEES ? MaxCalleeId
+                                                      : MAX_EXTERNAL_CALLEES;
+  for (uint32_t I = 0; I < Limit; ++I)
+    if (CalleeCounts[I])
+      fprintf(Out, "callee\t%s\t%llu\t%llu\n",
+              callee_identity(I, IdBuf, sizeof(IdBuf)),
+              (unsigned long long)CalleeCycles[I],
+              (unsigned long long)CalleeCounts[I]);
+  uint32_t GapLimit = Limit < MAX_GAP_CALLEES ? Limit : MAX_GAP_CALLEES;
+  for (uint32_t I = 0; I < GapLimit; ++I) {
+    uint64_t Any = 0;
+    for (uint32_t B = 0; B < GAP_BUCKETS; ++B)
+      Any |= GapHist[I][B];
+    if (!Any)
+      continue;
+    fprintf(Out, "gap\t%s", callee_identity(I, IdBuf, sizeof(IdBuf)));
+    for (uint32_t B = 0; B < GAP_BUCKETS; ++B)
+      fprintf(Out, "\t%llu", (unsigned long long)GapHist[I][B]);
+    fprintf(Out, "\n");
+  }
+  fflush(Out);
+}
+
+/* Batch-runner reset: the name table survives (it is registration, not
+ * accumulation); totals, histograms and the calling thread's gap anchors
+ * restart. Other threads' anchors are unreachable TLS, but a stale anchor
+ * only misplaces the first gap sample of the next iteration. */
+static void reset_external_call_stats(void) {
+  memset(CalleeCycles, 0, sizeof(CalleeCycles));
+  memset(CalleeCounts, 0, sizeof(CalleeCounts));
+  memset(GapHist, 0, sizeof(GapHist));
+  memset(PrevEndTsc, 0, sizeof(PrevEndTsc));
+}
+
+void external_call_register_callee(uint32_t Id, const char *Name) {
+  if (Id >= MAX_EXTERNAL_CALLEES)
+    return;
+  CalleeNames[Id] = Name;
+  if (Id + 1 > MaxCalleeId)
+    MaxCalleeId = Id + 1;
+  if (!AtExitInstalled) {
+    AtExitInstalled = 1;
+    atexit(print_external_call_stats);
+    unsafe_instr_register_reset(reset_external_call_stats);
+  }
+}
+
+uint64_t external_call_start(uint32_t CalleeId) {
+  (void)CalleeId;
+  uint64_t Now = unsafe_instr_read_cycles();
+  return Now ? Now : 1;
+}
+
+void external_call_end(uint64_t Start, uint32_t CalleeId) {
+  if (!Start || CalleeId >= MAX_EXTERNAL_CALLEES)
+    return;
+  uint64_t Delta = unsafe_instr_read_cycles() - Start;
+  UNSAFE_INSTR_ATOMIC_ADD(&CalleeCycles[CalleeId], Delta);
+  UNSAFE_INSTR_ATOMIC_ADD(&CalleeCounts[CalleeId], 1);
+}
+
+/* Gap variant of external_call_end: normal end accounting plus the gap
+ * from the previous call's end to this call's start, log2-bucketed per
+ * callee. Only meaningful unsampled (the pass refuses the combination):
+ * with 1-in-N timing, "consecutive" calls are N apart. */
+void external_call_end_gap(uint64_t Start, uint32_t CalleeId) {
+  external_call_end(Start, CalleeId);
+  if (!Start || CalleeId >= MAX_GAP_CALLEES)
+    return;
+  uint64_t PrevEnd = PrevEndTsc[CalleeId];
+  if (PrevEnd && Start > PrevEnd) {
+    uint64_t Gap = Start - PrevEnd;
+    uint32_t Bucket = 63 - (uint32_t)__builtin_clzll(Gap | 1);
+    if (Bucket >= GAP_BUCKETS)
+      Bucket = GAP_BUCKETS - 1;
+    UNSAFE_INSTR_ATOMIC_ADD(&GapHist[CalleeId][Bucket], 1);
+  }
+  PrevEndTsc[CalleeId] = unsafe_instr_read_cycles();
+}
+
+/* Sampled probe: one timed execution stands in for SampleRate of them. */
+void external_call_end_sampled(uint64_t Start, uint64_t SampleRate,
+                               uint32_t CalleeId) {
+  if (!Start || CalleeId >= MAX_EXTERNAL_CALLEES)
+    return;
+  uint64_t Delta = unsafe_instr_read_cycles() - Start;
+  UNSAFE_INSTR_ATOMIC_ADD(&CalleeCycles[CalleeId], Delta * SampleRate);
+  UNSAFE_INSTR_ATOMIC_ADD(&CalleeCounts[CalleeId], SampleRate);
+}
@@ -0,0 +1,349 @@
+/*===- UnsafeInstrFuncs.c - Function tracker / block count runtime --------===*\
+|*
+|* Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+|* See https://llvm.org/LICENSE.txt for license information.
+|* SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+|*
+\*===----------------------------------------------------------------------===*/
+
+/* Runtime side of UnsafeFunctionTrackerPass and UnsafeInstCounterPass: the
+ * function metadata table, per-function call counts and the registered
+ * block-count tables. Entry probes are one relaxed add into a calloc'd
+ * array — no locks, no per-call allocation.
+ */
+
+#include "UnsafeInstrUtil.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Module-side metadata record; layout matches the table the tracker emits
+ * ({i32 id, i8 hasUnsafeInst, i8 hasUnsafeRegions, i16 pad}, align 8). */
+typedef struct {
+  uint32_t Id;
+  uint8_t HasUnsafeInst;
+  uint8_t HasUnsafeRegions;
+  uint16_t Pad;
+} UnsafeFuncMeta;
+
+/* Module-side static count row; layout matches the row the counter emits:
+ * {i32 func_id, i32 total_insts, i32 total_unsafe, 6 x i16 per-category
+ * counts, i32 total_elems, 6 x i16 element-scaled counts, i32
+ * exec_multiplier}. The u16 columns saturate at 0xFFFF with the exact
+ * value spilled to the overflow sidecar; the multiplier is 1 except for
+ * blocks whose increment was hoisted to a loop preheader under
+ * -unsafe-counter-loop-scale, where it is the constant trip count. */
+typedef struct {
+  uint32_t FuncId;
+  uint32_t TotalInsts;
+  uint32_t TotalUnsafeInsts;
+  uint16_t Cat[6];
+  uint32_t TotalUnsafeElems;
+  uint16_t Elem[6];
+  uint32_t ExecMultiplier;
+} UnsafeBlockCountsRow;
+
+/* Registered block-count table ({counts records, exec counters, n, build
+ * hash}); the exec counters are the module-side slots the emitted
+ * increments hit, the counts records carry the static per-block
+ * instruction breakdown. Execution totals and the execution-weighted
+ * category units are folded at dump time; full per-block detail stays
+ * with the offline aggregator, which already parses the static tables.
+ * The module hash qualifies the rows' ID space so shards from different
+ * builds merge by (hash, id). MaxCpus is 0 for the flat registration; the
+ * per-CPU variant (-unsafe-rseq-counters) hands over a
+ * [max_cpus x num_blocks] matrix instead, folded column-wise at dump
+ * time. */
+typedef struct {
+  const UnsafeBlockCountsRow *Counts;
+  const uint64_t *Exec;
+  uint32_t NumBlocks;
+  uint32_t MaxCpus;
+  uint64_t ModuleHash;
+} UnsafeBlockTable;
+
+/* Overflow sidecar the counter registers against a counts table: (row,
+ * column, exact value) u64 triples for count columns that saturated at
+ * 0xFFFF. Columns number 0-5 for the per-category group and 6-11 for the
+ * element-scaled group, matching the emission order. */
+typedef struct {
+  const void *Counts;
+  const uint64_t *Entries;
+  uint32_t NumEntries;
+} UnsafeBlockOverflow;
+
+/* Borrowed-counter sidecar (-unsafe-counter-borrow-pgo): {row, slot}
+ * pairs where the slot points into PGO's __profc_ arrays and carries the
+ * row's execution count; the row's own exec slot stays zero. */
+typedef struct {
+  uint64_t Row;
+  const uint64_t *Slot;
+} UnsafeBorrowedEntry;
+
+typedef struct {
+  const void *Counts;
+  const UnsafeBorrowedEntry *Entries;
+  uint32_t NumEntries;
+} UnsafeBorrowedTable;
+
+#define MAX_BLOCK_TABLES 1024
+#define MAX_OVERFLOW_TABLES 64
+#define MAX_BORROWED_TABLES 64
+
+static const UnsafeFuncMeta *FuncMeta;
+static uint32_t NumFuncs;
+/* ID-space qualifier of the metadata table's build (0 when the pass did
+ * not record one); hash-qualified per-function rows let the offline
+ * aggregator merge shards from different builds side by side instead of
+ * summing unrelated IDs. */
+static uint64_t FuncModuleHash;
+/* Count slots are indexed by ID, which exceeds NumFuncs when the compiler
+ * assigned stable hashed IDs (-unsafe-func-stable-ids) instead of dense
+ * module-order ones. Pre-sized from the largest registered ID, so the probe
+ * stays a direct index either way. */
+static uint32_t NumCountSlots;
+static uint64_t *FuncCallCounts;
+
+static UnsafeBlockTable BlockTables[MAX_BLOCK_TABLES];
+static uint32_t NumBlockTables;
+static UnsafeBlockOverflow OverflowTables[MAX_OVERFLOW_TABLES];
+static uint32_t NumOverflowTables;
+static UnsafeBorrowedTable BorrowedTables[MAX_BORROWED_TABLES];
+static uint32_t NumBorrowedTables;
+
+/* Batch-runner reset: call-count slots and the registered block execution
+ * counters restart; the metadata and counts tables are registration-time
+ * facts about the build and survive, as do the overflow triples (static
+ * data) and the borrowed PGO slots — the profile runtime owns those, and
+ * clearing them here would corrupt the profile it writes out later. The
+ * exec counters live module-side
+ * but are plain writable slots the emitted increments hit — const in the
+ * table struct only because this unit never writes them on the probe
+ * path. */
+static void reset_func_stats(void) {
+  if (FuncCallCounts)
+    memset(FuncCallCounts, 0, NumCountSlots * sizeof(uint64_t));
+  uint32_t Tables =
+      NumBlockTables < MAX_BLOCK_TABLES ? NumBlockTables : MAX_BLOCK_TABLES;
+  for (uint32_t T = 0; T < Tables; ++T) {
+    uint64_t Slots = BlockTables[T].NumBlocks;
+    if (BlockTables[T].MaxCpus)
+      Slots *= BlockTables[T].MaxCpus;
+    memset((uint64_t *)(uintptr_t)BlockTables[T].Exec, 0,
+           Slots * sizeof(uint64_t));
+  }
+}
+
+static int FuncsResetInstalled;
+
+static void install_funcs_reset(void) {
+  if (!FuncsResetInstalled) {
+    FuncsResetInstalled = 1;
+    unsafe_instr_register_reset(reset_func_stats);
+  }
+}
+
+void __unsafe_init_metadata(const void *Table, uint32_t Count,
+                            uint64_t ModuleHash) {
+  install_funcs_reset();
+  if (FuncMeta) {
+    fprintf(stderr, "unsafe_instr: multiple function metadata tables "
+                    "registered; keeping the first (compile the primary "
+                    "package as one codegen unit)\n");
+    return;
+  }
+  const UnsafeFuncMeta *Meta = (const UnsafeFuncMeta *)Table;
+  uint32_t MaxId = 0;
+  for (uint32_t I = 0; I < Count; ++I)
+    if (Meta[I].Id > MaxId)
+      MaxId = Meta[I].Id;
+  FuncMeta = Meta;
+  NumFuncs = Count;
+  FuncModuleHash = ModuleHash;
+  NumCountSlots = Count ? MaxId + 1 : 0;
+  /* Stable hashed IDs (-unsafe-func-stable-ids) make this array sparse and
+   * potentially huge; the table allocator gives large arrays huge-page
+   * backing so their TLB cost stays out of the measurements. */
+  FuncCallCounts = unsafe_instr_table_alloc(NumCountSlots * sizeof(uint64_t));
+}
+
+void __unsafe_record_function(uint32_t Id) {
+  /* Per-function slots already spread across cache lines; a relaxed add
+   * here beats funneling every entry through thread-local arrays of
+   * unknown-at-link-time size. */
+  if (FuncCallCounts && Id < NumCountSlots)
+    UNSAFE_INSTR_ATOMIC_ADD(&FuncCallCounts[Id], 1);
+}
+
+static void register_block_table(const void *Counts, const uint64_t *Exec,
+                                 uint32_t NumBlocks, uint32_t MaxCpus,
+                                 uint64_t ModuleHash) {
+  install_funcs_reset();
+  uint32_t Slot = UNSAFE_INSTR_ATOMIC_ADD(&NumBlockTables, 1);
+  if (Slot >= MAX_BLOCK_TABLES)
+    return;
+  BlockTables[Slot].Counts = (const UnsafeBlockCountsRow *)Counts;
+  BlockTables[Slot].Exec = Exec;
+  BlockTables[Slot].NumBlocks = NumBlocks;
+  BlockTables[Slot].MaxCpus = MaxCpus;
+  BlockTables[Slot].ModuleHash = ModuleHash;
+}
+
+void __unsafe_register_block_counts(const void *Counts, const uint64_t *Exec,
+                                    uint32_t NumBlocks, uint64_t ModuleHash) {
+  register_block_table(Counts, Exec, NumBlocks, /*MaxCpus=*/0, ModuleHash);
+}
+
+void __unsafe_register_block_counts_percpu(const void *Counts,
+                                           const uint64_t *PerCpuRows,
+                                           uint32_t NumBlocks,
+                                           uint32_t MaxCpus,
+                                           uint64_t ModuleHash) {
+  register_block_table(Counts, PerCpuRows, NumBlocks, MaxCpus, ModuleHash);
+}
+
+/* Execution count of block \p B in table \p T: the flat slot, the per-CPU
+ * matrix column folded across CPUs, or — for PGO-borrowed rows — the
+ * profile counter the registration pointed at. */
+static uint64_t block_exec_count(const UnsafeBlockTable *T, uint32_t B) {
+  uint32_t Borrowed = NumBorrowedTables < MAX_BORROWED_TABLES
+                          ? NumBorrowedTables
+                          : MAX_BORROWED_TABLES;
+  for (uint32_t I = 0; I < Borrowed; ++I)
+    if (BorrowedTables[I].Counts == (const void *)T->Counts)
+      for (uint32_t E = 0; E < BorrowedTables[I].NumEntries; ++E)
+        if (BorrowedTables[I].Entries[E].Row == B)
+          return *BorrowedTables[I].Entries[E].Slot;
+  if (!T->MaxCpus)
+    return T->Exec[B];
+  uint64_t N = 0;
+  for (uint32_t R = 0; R < T->MaxCpus; ++R)
+    N += T->Exec[(uint64_t)R * T->NumBlocks + B];
+  return N;
+}
+
+void __unsafe_register_block_overflow(const void *Counts,
+                                      const uint64_t *Entries,
+                                      uint32_t NumEntries) {
+  uint32_t Slot = UNSAFE_INSTR_ATOMIC_ADD(&NumOverflowTables, 1);
+  if (Slot >= MAX_OVERFLOW_TABLES)
+    return;
+  OverflowTables[Slot].Counts = Counts;
+  OverflowTables[Slot].Entries = Entries;
+  OverflowTables[Slot].NumEntries = NumEntries;
+}
+
+void __unsafe_register_block_borrowed(const void *Counts, const void *Entries,
+                                      uint32_t NumEntries) {
+  uint32_t Slot = UNSAFE_INSTR_ATOMIC_ADD(&NumBorrowedTables, 1);
+  if (Slot >= MAX_BORROWED_TABLES)
+    return;
+  BorrowedTables[Slot].Counts = Counts;
+  BorrowedTables[Slot].Entries = (const UnsafeBorrowedEntry *)Entries;
+  BorrowedTables[Slot].NumEntries = NumEntries;
+}
+
+/* One u16 count column of block \p Row in \p Counts, with the exact value
+ * substituted for the saturation marker when the table's overflow sidecar
+ * carries one. A marker with no sidecar entry is a column that is
+ * genuinely 65535. */
+static uint64_t block_count_column(const UnsafeBlockCountsRow *Counts,
+                                   uint32_t Row, uint32_t Col, uint16_t Raw) {
+  if (Raw != UINT16_MAX)
+    return Raw;
+  uint32_t Overflow = NumOverflowTables < MAX_OVERFLOW_TABLES
+                          ? NumOverflowTables
+                          : MAX_OVERFLOW_TABLES;
+  for (uint32_t I = 0; I < Overflow; ++I) {
+    if (OverflowTables[I].Counts != (const void *)Counts)
+      continue;
+    const uint64_t *E = OverflowTables[I].Entries;
+    for (uint32_t N = 0; N < OverflowTables[I].NumEntries; ++N)
+      if (E[N * 3] == Row && E[N * 3 + 1] == Col)
+        return E[N * 3 + 2];
+  }
+  return Raw;
+}
+
+void __unsafe_dump_stats(void) {
+  unsafe_instr_flush_this_thread();
+
+  FILE *Out = unsafe_instr_out();
+  fprintf(Out, "== unsafe_functions ==\n");
+
+  uint64_t TotalCalls = 0, UnsafeCalls = 0;
+  uint32_t UnsafeFuncs = 0;
+  for (uint32_t I = 0; I < NumFuncs; ++I) {
+    uint64_t Calls = FuncCallCounts ? FuncCallCounts[FuncMeta[I].Id] : 0;
+    TotalCalls += Calls;
+    if (FuncMeta[I].HasUnsafeInst) {
+      ++UnsafeFuncs;
+      UnsafeCalls += Calls;
+    }
+  }
+  fprintf(Out, "tracked_functions\t%u\n", NumFuncs);
+  fprintf(Out, "unsafe_functions\t%u\n", UnsafeFuncs);
+  fprintf(Out, "function_calls\t%llu\n", (unsigned long long)TotalCalls);
+  fprintf(Out, "unsafe_function_calls\t%llu\n",
+          (unsigned long long)UnsafeCalls);
+  /* Hash-qualified rows when the build recorded a module hash with its
+   * table; plain rows otherwise, which also keeps output from builds whose
+   * pass predates the hash argument unchanged. The hex format matches the
+   * passes' sidecar module_hash rows. */
+  for (uint32_t I = 0; I < NumFuncs; ++I)
+    if (FuncMeta[I].HasUnsafeInst && FuncCallCounts &&
+        FuncCallCounts[FuncMeta[I].Id]) {
+      if (FuncModuleHash)
+        fprintf(Out, "mfunc\t%llx\t%u\t%llu\n",
+                (unsigned long long)FuncModuleHash, FuncMeta[I].Id,
+                (unsigned long long)FuncCallCounts[FuncMeta[I].Id]);
+      else
+        fprintf(Out, "func\t%u\t%llu\n", FuncMeta[I].Id,
+                (unsigned long long)FuncCallCounts[FuncMeta[I].Id]);
+    }
+
+  /* Category totals are execution-weighted static counts — dynamic unsafe
+   * units per category — with saturated columns substituted from the
+   * overflow sidecar and the per-row multiplier applied for loop-scaled
+   * counters. Externalized tables (-unsafe-extern-tables) register a null
+   * counts pointer and stay offline-only, so the unit rows appear only
+   * when at least one table is loadable. */
+  uint64_t BlockExecs = 0;
+  uint32_t Blocks = 0;
+  uint64_t CatUnits[6] = {0, 0, 0, 0, 0, 0};
+  uint64_t ElemUnits[6] = {0, 0, 0, 0, 0, 0};
+  int HaveCounts = 0;
+  uint32_t Tables =
+      NumBlockTables < MAX_BLOCK_TABLES ? NumBlockTables : MAX_BLOCK_TABLES;
+  for (uint32_t T = 0; T < Tables; ++T) {
+    const UnsafeBlockTable *Table = &BlockTables[T];
+    Blocks += Table->NumBlocks;
+    for (uint32_t B = 0; B < Table->NumBlocks; ++B) {
+      uint64_t Execs = block_exec_count(Table, B);
+      if (Table->Counts) {
+        const UnsafeBlockCountsRow *Row = &Table->Counts[B];
+        Execs *= Row->ExecMultiplier;
+        HaveCounts = 1;
+        for (uint32_t C = 0; C < 6; ++C) {
+          CatUnits[C] +=
+              Execs * block_count_column(Table->Counts, B, C, Row->Cat[C]);
+          ElemUnits[C] +=
+              Execs * block_count_column(Table->Counts, B, C + 6, Row->Elem[C]);
+        }
+      }
+      BlockExecs += Execs;
+    }
+  }
+  fprintf(Out, "counted_blocks\t%u\n", Blocks);
+  fprintf(Out, "block_executions\t%llu\n", (unsigned long long)BlockExecs);
+  if (HaveCounts) {
+    fprintf(Out, "block_unsafe_units");
+    for (uint32_t C = 0; C < 6; ++C)
+      fprintf(Out, "\t%llu", (unsigned long long)CatUnits[C]);
+    fprintf(Out, "\nblock_unsafe_elem_units");
+    for (uint32_t C = 0; C < 6; ++C)
+      fprintf(Out, "\t%llu", (unsigned long long)ElemUnits[C]);
+    fprintf(Out, "\n");
+  }
+  fflush(Out);
+}
@@ -0,0 +1,754 @@
+/*===- UnsafeInstrHeap.c - Heap/memory access probe runtime ---------------===*\
+|*
+|* Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+|* See https://llvm.org/LICENSE.txt for license information.
+|* SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+|*
+\*===----------------------------------------------------------------------===*/
+
+/* Runtime side of HeapTrackerPass. dyn_mem_access is by far the hottest
+ * symbol the instrumentation emits (every load/store in the primary crate),
+ * so everything on that path is a thread-local increment; totals fold into
+ * global atomics at thread exit and the report prints from an atexit hook.
+ */
+
+#include "UnsafeInstrUtil.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Per-thread event counters, one cache-line-friendly struct. */
+typedef struct {
+  uint64_t Accesses;
+  uint64_t UnsafeAccesses;
+  uint64_t UnsafeWrites;
+  uint64_t RangeBytes;
+  uint64_t BulkElems;
+  uint64_t Allocs;
+  uint64_t AllocBytes;
+  uint64_t Deallocs;
+  uint64_t BufferedEvents;
+  uint64_t HeapAccesses; /* Classified by the slow-path probe. */
+} UnsafeHeapCounters;
+
+static __thread UnsafeHeapCounters ThreadHeap;
+static __thread int ThreadArmed;
+static UnsafeHeapCounters TotalHeap;
+
+/* Static per-function site counts handed over once per instrumented
+ * function by dyn_mem_access_static. */
+static uint64_t StaticStackSites;
+static uint64_t StaticGlobalSites;
+
+/* Mapped-range classification (-heap-tracker-maps-classify) counters; they
+ * fold with the heap counters below, the table machinery lives further down
+ * with its probe. */
+enum {
+  MAP_CLASS_UNKNOWN = 0,
+  MAP_CLASS_STACK,
+  MAP_CLASS_HEAP,
+  MAP_CLASS_MMAP,
+  MAP_CLASS_GLOBAL,
+  MAP_CLASS_VDSO,
+  MAP_CLASS_COUNT
+};
+
+static uint64_t MapClassTotals[MAP_CLASS_COUNT];
+static __thread uint64_t ThreadMapClass[MAP_CLASS_COUNT];
+static uint64_t MapRescans;
+static uint64_t MapRangesDropped;
+
+static void flush_thread_heap(void) {
+  uint64_t *Src = (uint64_t *)&ThreadHeap;
+  uint64_t *Dst = (uint64_t *)&TotalHeap;
+  for (size_t I = 0; I < sizeof(UnsafeHeapCounters) / sizeof(uint64_t); ++I) {
+    if (Src[I])
+      UNSAFE_INSTR_ATOMIC_ADD(&Dst[I], Src[I]);
+    Src[I] = 0;
+  }
+  for (size_t I = 0; I < MAP_CLASS_COUNT; ++I) {
+    if (ThreadMapClass[I])
+      UNSAFE_INSTR_ATOMIC_ADD(&MapClassTotals[I], ThreadMapClass[I]);
+    ThreadMapClass[I] = 0;
+  }
+}
+
+static void print_heap_stats(void) {
+  unsafe_instr_flush_this_thread();
+
+  FILE *Out = unsafe_instr_out();
+  fprintf(Out, "== heap_tracker ==\n");
+  fprintf(Out, "mem_accesses\t%llu\n",
+          (unsigned long long)TotalHeap.Accesses);
+  fprintf(Out, "heap_accesses\t%llu\n",
+          (unsigned long long)TotalHeap.HeapAccesses);
+  fprintf(Out, "unsafe_accesses\t%llu\n",
+          (unsigned long long)TotalHeap.UnsafeAccesses);
+  fprintf(Out, "unsafe_writes\t%llu\n",
+          (unsigned long long)TotalHeap.UnsafeWrites);
+  fprintf(Out, "range_bytes\t%llu\n",
+          (unsigned long long)TotalHeap.RangeBytes);
+  fprintf(Out, "bulk_elems\t%llu\n",
+          (unsigned long long)TotalHeap.BulkElems);
+  fprintf(Out, "allocs\t%llu\talloc_bytes\t%llu\tdeallocs\t%llu\n",
+          (unsigned long long)TotalHeap.Allocs,
+          (unsigned long long)TotalHeap.AllocBytes,
+          (unsigned long long)TotalHeap.Deallocs);
+  fprintf(Out, "buffered_events\t%llu\n",
+          (unsigned long long)TotalHeap.BufferedEvents);
+  fprintf(Out, "static_stack_sites\t%llu\tstatic_global_sites\t%llu\n",
+          (unsigned long long)StaticStackSites,
+          (unsigned long long)StaticGlobalSites);
+  {
+    uint64_t Classified = 0;
+    for (int I = 0; I < MAP_CLASS_COUNT; ++I)
+      Classified += MapClassTotals[I];
+    if (Classified) {
+      fprintf(Out,
+              "map_stack\t%llu\tmap_heap\t%llu\tmap_mmap\t%llu\t"
+              "map_global\t%llu\tmap_vdso\t%llu\tmap_unknown\t%llu\n",
+              (unsigned long long)MapClassTotals[MAP_CLASS_STACK],
+              (unsigned long long)MapClassTotals[MAP_CLASS_HEAP],
+              (unsigned long long)MapClassTotals[MAP_CLASS_MMAP],
+              (unsigned long long)MapClassTotals[MAP_CLASS_GLOBAL],
+              (unsigned long long)MapClassTotals[MAP_CLASS_VDSO],
+              (unsigned long long)MapClassTotals[MAP_CLASS_UNKNOWN]);
+      fprintf(Out, "map_rescans\t%llu\tmap_ranges_dropped\t%llu\n",
+              (unsigned long long)MapRescans,
+              (unsigned long long)MapRangesDropped);
+    }
+  }
+  fflush(Out);
+}
+
+static void reset_heap_stats(void);
+
+static pthread_once_t HeapHooksOnce = PTHREAD_ONCE_INIT;
+static void install_heap_hooks(void) {
+  unsafe_instr_at_thread_exit(flush_thread_heap);
+  unsafe_instr_register_reset(reset_heap_stats);
+  atexit(print_heap_stats);
+}
+
+static inline void arm_heap_thread(void) {
+  if (!ThreadArmed) {
+    ThreadArmed = 1;
+    pthread_once(&HeapHooksOnce, install_heap_hooks);
+    unsafe_instr_arm_thread_exit();
+  }
+}
+
+void dyn_mem_access(const void *Ptr) {
+  (void)Ptr;
+  arm_heap_thread();
+  ++ThreadHeap.Accesses;
+}
+
+/* The shadow fast path routes only addresses it could not classify inline
+ * here; count them as heap, matching the shadow map's semantics. */
+void dyn_mem_access_slow(const void *Ptr) {
+  (void)Ptr;
+  arm_heap_thread();
+  ++ThreadHeap.Accesses;
+  ++ThreadHeap.HeapAccesses;
+}
+
+void dyn_mem_access_static(uint32_t StackSites, uint32_t GlobalSites) {
+  UNSAFE_INSTR_ATOMIC_ADD(&StaticStackSites, StackSites);
+  UNSAFE_INSTR_ATOMIC_ADD(&StaticGlobalSites, GlobalSites);
+}
+
+void dyn_mem_access_range(const void *Ptr, uint64_t Len, int IsWrite) {
+  (void)Ptr;
+  (void)IsWrite;
+  arm_heap_thread();
+  ++ThreadHeap.Accesses;
+  ThreadHeap.RangeBytes += Len;
+}
+
+void dyn_unsafe_mem_access(const void *Ptr, int IsLoad) {
+  (void)Ptr;
+  arm_heap_thread();
+  ++ThreadHeap.UnsafeAccesses;
+  if (!IsLoad)
+    ++ThreadHeap.UnsafeWrites;
+}
+
+void dyn_unsafe_mem_access_bulk(const void *Ptr, int IsLoad, uint64_t Count) {
+  (void)Ptr;
+  arm_heap_thread();
+  ThreadHeap.UnsafeAccesses += Count;
+  if (!IsLoad)
+    ThreadHeap.UnsafeWrites += Count;
+  ThreadHeap.BulkElems += Count;
+}
+
+void heap_tracker_note_alloc(const void *Ptr, uint64_t Size) {
+  (void)Ptr;
+  arm_heap_thread();
+  ++ThreadHeap.Allocs;
+  ThreadHeap.AllocBytes += Size;
+}
+
+void heap_tracker_note_dealloc(const void *Ptr, uint64_t Size) {
+  (void)Ptr;
+  (void)Size;
+  arm_heap_thread();
+  ++ThreadHeap.Deallocs;
+}
+
+/* Buffered emission (-heap-tracker-event-buffer): the module flushes its
+ * TLS event buffer here. Events are address records; only their count
+ * feeds the totals, the addresses themselves are a tracing concern the
+ * benchmark reports do not use. */
+void heap_tracker_flush_events(const void *Buf, uint64_t NumEvents) {
+  (void)Buf;
+  arm_heap_thread();
+  ThreadHeap.BufferedEvents += NumEvents;
+  ThreadHeap.Accesses += NumEvents;
+}
+
+/* Per-thread classification arrays (-heap-tracker-shadow-fast-path): slot
+ * layout is module-defined; fold everything into the access total. */
+void heap_tracker_flush_class_counts(const uint64_t *Counts,
+                                     uint32_t NumClasses) {
+  uint64_t Sum = 0;
+  for (uint32_t I = 0; I < NumClasses; ++I)
+    Sum += Counts[I];
+  arm_heap_thread();
+  ThreadHeap.Accesses += Sum;
+}
+
+/* ----- mapped-range classification (-heap-tracker-maps-classify) -----
+ *
+ * dyn_mem_access_classified resolves each pointer against a sorted snapshot
+ * of /proc/self/maps, so mmap'd regions (jpeg-decoder reading its input
+ * through a mapping, getrandom's vDSO pages) stop being misclassified as
+ * heap: the answer is five-way — stack, heap, mmap, global, vdso. The table
+ * is double-buffered: a rebuild parses into the inactive buffer and
+ * publishes its index with a release store, so probes never search a
+ * half-built table. Rebuilds are serialized by a mutex and rare — the
+ * ctor-run snapshot, the interposable refresh hooks below, and a bounded
+ * budget of miss-triggered rescans that pick up brk growth and mappings no
+ * wrapper announced. A probe overlapping two rebuilds can read a mixed row;
+ * for a statistics probe a handful of misclassified accesses during a
+ * rescan is an accepted trade for a lock-free fast path. */
+
+#define MAX_MAP_RANGES 512
+
+typedef struct {
+  uintptr_t Begin;
+  uintptr_t End;
+  uint8_t Class;
+} MapRange;
+
+static MapRange MapTables[2][MAX_MAP_RANGES];
+static uint32_t MapTableSizes[2];
+static uint32_t ActiveMapTable; /* 0 or 1; published with release. */
+static int MapTablePublished;
+static pthread_mutex_t MapRebuildLock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t MapRescanBudget = 64;
+
+/* Called with MapRebuildLock held. /proc/self/maps is already sorted by
+ * address, so the parse order is the search order. */
+static void rebuild_map_table(void) {
+  static char ExePath[256];
+  if (!ExePath[0]) {
+    ssize_t Len = readlink("/proc/self/exe", ExePath, sizeof(ExePath) - 1);
+    if (Len > 0)
+      ExePath[Len] = '\0';
+  }
+
+  FILE *Maps = fopen("/proc/self/maps", "r");
+  if (!Maps)
+    return; /* Not Linux (or locked down): everything stays unknown. */
+
+  uint32_t Next = (ActiveMapTable + 1) & 1;
+  MapRange *Ranges = MapTables[Next];
+  uint32_t N = 0;
+  char LineBuf[512];
+  while (fgets(LineBuf, sizeof(LineBuf), Maps)) {
+    unsigned long Begin, End;
+    char Perms[8];
+    int PathOff = 0;
+    if (sscanf(LineBuf, "%lx-%lx %7s %*x %*x:%*x %*u %n", &Begin, &End,
+               Perms, &PathOff) < 3)
+      continue;
+    if (Perms[0] != 'r') /* Guard pages are never legally accessed. */
+      continue;
+    const char *Path = LineBuf + PathOff;
+    size_t PathLen = strcspn(Path, "\n");
+
+    uint8_t Class;
+    if (PathLen == 0)
+      Class = MAP_CLASS_MMAP; /* Anonymous: mmap'd memory, thread stacks. */
+    else if (strncmp(Path, "[stack]", PathLen) == 0 && PathLen == 7)
+      Class = MAP_CLASS_STACK;
+    else if (strncmp(Path, "[heap]", PathLen) == 0 && PathLen == 6)
+      Class = MAP_CLASS_HEAP;
+    else if (Path[0] == '[' && (strncmp(Path, "[vdso]", 6) == 0 ||
+                                strncmp(Path, "[vvar", 5) == 0 ||
+                                strncmp(Path, "[vsyscall]", 10) == 0))
+      Class = MAP_CLASS_VDSO;
+    else if (ExePath[0] && PathLen == strlen(ExePath) &&
+             strncmp(Path, ExePath, PathLen) == 0)
+      Class = MAP_CLASS_GLOBAL; /* The program image: globals, code. */
+    else
+      Class = MAP_CLASS_MMAP; /* Files, shared libraries, misc kernel. */
+
+    if (N >= MAX_MAP_RANGES) {
+      UNSAFE_INSTR_ATOMIC_ADD(&MapRangesDropped, 1);
+      continue;
+    }
+    Ranges[N].Begin = (uintptr_t)Begin;
+    Ranges[N].End = (uintptr_t)End;
+    Ranges[N].Class = Class;
+    ++N;
+  }
+  fclose(Maps);
+
+  MapTableSizes[Next] = N;
+  __atomic_store_n(&ActiveMapTable, Next, __ATOMIC_RELEASE);
+  MapTablePublished = 1;
+}
+
+/* Binary search over the active snapshot; the table is a few KB and stays
+ * cache-resident, so this is a handful of cycles per probe. */
+static uint8_t map_classify(uintptr_t Addr) {
+  uint32_t T = __atomic_load_n(&ActiveMapTable, __ATOMIC_ACQUIRE);
+  const MapRange *Base = MapTables[T & 1];
+  uint32_t Count = MapTableSizes[T & 1];
+  if (!Count)
+    return MAP_CLASS_UNKNOWN;
+  while (Count > 1) {
+    uint32_t Half = Count / 2;
+    if (Base[Half].Begin <= Addr)
+      Base += Half;
+    Count -= Half;
+  }
+  return (Base->Begin <= Addr && Addr < Base->End) ? Base->Class
+                                                   : MAP_CLASS_UNKNOWN;
+}
+
+/* Miss-triggered rescan: bounded so a pointer genuinely outside every
+ * mapping (a wild unsafe pointer, exactly what the suite measures) cannot
+ * turn every probe into a /proc parse. Trylock keeps the probe from ever
+ * blocking behind a concurrent rebuild. */
+static int map_try_rescan(void) {
+  if (!__atomic_load_n(&MapRescanBudget, __ATOMIC_RELAXED))
+    return 0;
+  if (pthread_mutex_trylock(&MapRebuildLock) != 0)
+    return 0;
+  int DidScan = 0;
+  if (MapRescanBudget) {
+    --MapRescanBudget;
+    rebuild_map_table();
+    ++MapRescans;
+    DidScan = 1;
+  }
+  pthread_mutex_unlock(&MapRebuildLock);
+  return DidScan;
+}
+
+/* The ctor the pass emits under -heap-tracker-maps-classify calls this
+ * before main. Idempotent: every instrumented module's ctor calls it. */
+void heap_tracker_maps_init(void) {
+  pthread_mutex_lock(&MapRebuildLock);
+  if (!MapTablePublished)
+    rebuild_map_table();
+  pthread_mutex_unlock(&MapRebuildLock);
+}
+
+/* Interposable notification hooks: an mmap/munmap wrapper (LD_PRELOAD shim
+ * or allocator hook) calls these after changing the address space, and the
+ * snapshot follows without spending miss budget. The arguments exist so a
+ * wrapper can pass what it knows; today both just rescan. */
+void heap_tracker_note_mmap(const void *Addr, uint64_t Len) {
+  (void)Addr;
+  (void)Len;
+  pthread_mutex_lock(&MapRebuildLock);
+  rebuild_map_table();
+  ++MapRescans;
+  pthread_mutex_unlock(&MapRebuildLock);
+}
+
+void heap_tracker_note_munmap(const void *Addr, uint64_t Len) {
+  heap_tracker_note_mmap(Addr, Len);
+}
+
+void dyn_mem_access_classified(const void *Ptr, uint32_t SizeBytes) {
+  (void)SizeBytes;
+  arm_heap_thread();
+  ++ThreadHeap.Accesses;
+  uint8_t Class = map_classify((uintptr_t)Ptr);
+  if (Class == MAP_CLASS_UNKNOWN && map_try_rescan())
+    Class = map_classify((uintptr_t)Ptr);
+  ++ThreadMapClass[Class];
+  if (Class == MAP_CLASS_HEAP)
+    ++ThreadHeap.HeapAccesses;
+}
+
+/* ----- cache-line conflict mode (-heap-tracker-line-conflicts) -----
+ *
+ * The line probe replaces dyn_unsafe_mem_access: it keeps the ordinary
+ * access counters and additionally histograms address bits 6..12 (the
+ * cache-line set index) per region into per-thread tables. Thread exit
+ * folds each histogram into a global per-region table that also counts how
+ * many distinct threads touched each set; the report lists regions where
+ * that count reaches two — the false-sharing candidates. Sets alias many
+ * lines, so a flagged region is a lead to chase, not a conviction. */
+
+#define LINE_SET_SHIFT 6
+#define LINE_SET_COUNT 128 /* Address bits 6..12. */
+#define MAX_THREAD_LINE_REGIONS 64
+#define MAX_LINE_REGIONS 1024
+#define LINE_REGION_PROBES 8
+
+typedef struct {
+  uint32_t RegionId; /* 0 = empty. */
+  uint32_t Hist[LINE_SET_COUNT];
+} ThreadLineRegion;
+
+static __thread ThreadLineRegion ThreadLineRegions[MAX_THREAD_LINE_REGIONS];
+static __thread int ThreadLinesArmed;
+
+typedef struct {
+  uint32_t RegionId; /* 0 = empty; claimed by CAS. */
+  uint64_t Count[LINE_SET_COUNT];
+  uint32_t Threads[LINE_SET_COUNT];
+} LineRegionEntry;
+
+static LineRegionEntry LineRegions[MAX_LINE_REGIONS];
+static uint64_t LineRegionsDropped;
+static uint64_t ThreadLineSlotsDropped;
+
+static uint64_t line_region_mix(uint64_t Key) {
+  Key ^= Key >> 33;
+  Key *= 0xff51afd7ed558ccdull;
+  Key ^= Key >> 33;
+  return Key;
+}
+
+/* Finds (claiming on first use) the global slot for RegionId, or
+ * MAX_LINE_REGIONS when the table is full. */
+static uint32_t line_region_slot(uint32_t RegionId) {
+  uint64_t Hash = line_region_mix(RegionId);
+  for (unsigned Probe = 0; Probe < LINE_REGION_PROBES; ++Probe) {
+    uint32_t Idx = (uint32_t)((Hash + Probe) & (MAX_LINE_REGIONS - 1));
+    LineRegionEntry *E = &LineRegions[Idx];
+    uint32_t Cur = __atomic_load_n(&E->RegionId, __ATOMIC_ACQUIRE);
+    if (Cur == RegionId)
+      return Idx;
+    if (Cur == 0) {
+      uint32_t Expected = 0;
+      if (__atomic_compare_exchange_n(&E->RegionId, &Expected, RegionId, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return Idx;
+      if (Expected == RegionId)
+        return Idx;
+    }
+  }
+  UNSAFE_INSTR_ATOMIC_ADD(&LineRegionsDropped, 1);
+  return MAX_LINE_REGIONS;
+}
+
+static void flush_thread_lines(void) {
+  for (unsigned I = 0; I < MAX_THREAD_LINE_REGIONS; ++I) {
+    ThreadLineRegion *T = &ThreadLineRegions[I];
+    if (!T->RegionId)
+      continue;
+    uint32_t Idx = line_region_slot(T->RegionId);
+    if (Idx < MAX_LINE_REGIONS) {
+      LineRegionEntry *E = &LineRegions[Idx];
+      for (unsigned Set = 0; Set < LINE_SET_COUNT; ++Set) {
+        if (!T->Hist[Set])
+          continue;
+        UNSAFE_INSTR_ATOMIC_ADD(&E->Count[Set], T->Hist[Set]);
+        UNSAFE_INSTR_ATOMIC_ADD(&E->Threads[Set], 1);
+      }
+    }
+    T->RegionId = 0;
+    for (unsigned Set = 0; Set < LINE_SET_COUNT; ++Set)
+      T->Hist[Set] = 0;
+  }
+}
+
+/* One "lineconf" row per region with at least one set touched by two or
+ * more threads:
+ *   lineconf\t<region_id>\t<shared_sets>\t<shared_accesses>\t<hot_set>\t
+ *   <hot_set_threads>\t<hot_set_accesses> */
+static void print_line_conflict_stats(void) {
+  unsafe_instr_flush_this_thread();
+
+  FILE *Out = unsafe_instr_out();
+  fprintf(Out, "== line_conflicts ==\n");
+  fprintf(Out, "line_regions_dropped\t%llu\tthread_line_slots_dropped\t%llu\n",
+          (unsigned long long)LineRegionsDropped,
+          (unsigned long long)ThreadLineSlotsDropped);
+  for (uint32_t I = 0; I < MAX_LINE_REGIONS; ++I) {
+    LineRegionEntry *E = &LineRegions[I];
+    if (!E->RegionId)
+      continue;
+    uint32_t SharedSets = 0;
+    uint64_t SharedAccesses = 0;
+    uint32_t HotSet = 0;
+    for (unsigned Set = 0; Set < LINE_SET_COUNT; ++Set) {
+      if (E->Threads[Set] < 2)
+        continue;
+      ++SharedSets;
+      SharedAccesses += E->Count[Set];
+      if (E->Count[Set] > E->Count[HotSet] || E->Threads[HotSet] < 2)
+        HotSet = Set;
+    }
+    if (!SharedSets)
+      continue;
+    fprintf(Out, "lineconf\t%u\t%u\t%llu\t%u\t%u\t%llu\n", E->RegionId,
+            SharedSets, (unsigned long long)SharedAccesses, HotSet,
+            E->Threads[HotSet], (unsigned long long)E->Count[HotSet]);
+  }
+  fflush(Out);
+}
+
+static pthread_once_t LineConflictOnce = PTHREAD_ONCE_INIT;
+static void install_line_conflict_hooks(void) {
+  unsafe_instr_at_thread_exit(flush_thread_lines);
+  atexit(print_line_conflict_stats);
+}
+
+void dyn_unsafe_mem_access_line(const void *Ptr, int IsLoad,
+                                uint32_t RegionId) {
+  arm_heap_thread();
+  ++ThreadHeap.UnsafeAccesses;
+  if (!IsLoad)
+    ++ThreadHeap.UnsafeWrites;
+
+  if (!ThreadLinesArmed) {
+    ThreadLinesArmed = 1;
+    pthread_once(&LineConflictOnce, install_line_conflict_hooks);
+  }
+
+  /* Linear probe of the per-thread table; no atomics, it is ours alone. */
+  uint64_t Hash = line_region_mix(RegionId);
+  for (unsigned Probe = 0; Probe < LINE_REGION_PROBES; ++Probe) {
+    uint32_t Idx =
+        (uint32_t)((Hash + Probe) & (MAX_THREAD_LINE_REGIONS - 1));
+    ThreadLineRegion *T = &ThreadLineRegions[Idx];
+    if (T->RegionId == 0)
+      T->RegionId = RegionId;
+    else if (T->RegionId != RegionId)
+      continue;
+    ++T->Hist[((uintptr_t)Ptr >> LINE_SET_SHIFT) & (LINE_SET_COUNT - 1)];
+    return;
+  }
+  UNSAFE_INSTR_ATOMIC_ADD(&ThreadLineSlotsDropped, 1);
+}
+
+/* ----- AllocTrackerPass: per-site allocation size/lifetime accounting -----
+ *
+ * alloc_tracker_alloc carries a compile-time site ID, the block address,
+ * size, alignment and an in-unsafe tag; alloc_tracker_dealloc carries only
+ * the address and size, so frees are attributed back to the allocating site
+ * through a pointer-keyed table of live blocks. Both tables are lock-free
+ * open-addressed with CAS-claimed slots, the same shape as the folded-stack
+ * and calibration tables in the cycle runtime. Allocator calls are rare
+ * next to access probes, so these paths take global atomics directly
+ * instead of the thread-local fold the counters above use. */
+
+#define MAX_ALLOC_SITES 4096
+#define ALLOC_SITE_PROBES 8
+
+typedef struct {
+  uint32_t SiteId; /* 0 = empty; claimed by CAS. */
+  uint32_t InUnsafe;
+  uint64_t Allocs;
+  uint64_t Bytes;
+  uint64_t MaxAlign;
+  uint64_t Live;
+  uint64_t Peak;
+} AllocSiteEntry;
+
+static AllocSiteEntry AllocSites[MAX_ALLOC_SITES];
+static uint64_t AllocSitesDropped;
+
+/* Blocks currently live, keyed by address so the dealloc probe can find the
+ * allocating site. A full table drops the block: its site's Live then stays
+ * high until exit, so Peak is an upper bound when LiveBlocksDropped is
+ * nonzero (reported so the reader can tell). */
+#define MAX_LIVE_BLOCKS (1u << 16)
+#define LIVE_BLOCK_PROBES 8
+
+typedef struct {
+  void *Ptr; /* NULL = empty; claimed by CAS. */
+  uint32_t SiteIdx;
+} LiveBlockEntry;
+
+static LiveBlockEntry LiveBlocks[MAX_LIVE_BLOCKS];
+static uint64_t LiveBlocksDropped;
+static uint64_t UnmatchedDeallocs;
+
+/* Unsafe-attributed live bytes across all sites, for the headline
+ * high-water mark. */
+static uint64_t UnsafeLiveBytes;
+static uint64_t UnsafeLivePeak;
+
+static void alloc_tracker_max(uint64_t *Slot, uint64_t Val) {
+  uint64_t Cur = __atomic_load_n(Slot, __ATOMIC_RELAXED);
+  while (Cur < Val &&
+         !__atomic_compare_exchange_n(Slot, &Cur, Val, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+    ;
+}
+
+/* Pointer/ID mix shared by both tables (xor-shift + odd multiplier, the
+ * same mix the calibration table uses). */
+static uint64_t alloc_tracker_mix(uint64_t Key) {
+  Key ^= Key >> 33;
+  Key *= 0xff51afd7ed558ccdull;
+  Key ^= Key >> 33;
+  return Key;
+}
+
+/* Finds (claiming on first use) the stats slot for SiteId, or returns
+ * MAX_ALLOC_SITES when the table is full. */
+static uint32_t alloc_site_slot(uint32_t SiteId, uint32_t InUnsafe) {
+  uint64_t Hash = alloc_tracker_mix(SiteId);
+  for (unsigned Probe = 0; Probe < ALLOC_SITE_PROBES; ++Probe) {
+    uint32_t Idx = (uint32_t)((Hash + Probe) & (MAX_ALLOC_SITES - 1));
+    AllocSiteEntry *E = &AllocSites[Idx];
+    uint32_t Cur = __atomic_load_n(&E->SiteId, __ATOMIC_ACQUIRE);
+    if (Cur == SiteId)
+      return Idx;
+    if (Cur == 0) {
+      uint32_t Expected = 0;
+      if (__atomic_compare_exchange_n(&E->SiteId, &Expected, SiteId, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        E->InUnsafe = InUnsafe;
+        return Idx;
+      }
+      if (Expected == SiteId)
+        return Idx;
+    }
+  }
+  UNSAFE_INSTR_ATOMIC_ADD(&AllocSitesDropped, 1);
+  return MAX_ALLOC_SITES;
+}
+
+static void print_alloc_tracker_stats(void);
+
+static pthread_once_t AllocTrackerOnce = PTHREAD_ONCE_INIT;
+static void install_alloc_tracker_hooks(void) {
+  atexit(print_alloc_tracker_stats);
+}
+
+void alloc_tracker_alloc(uint32_t SiteId, void *Ptr, uint64_t Size,
+                         uint64_t Align, int InUnsafe) {
+  pthread_once(&AllocTrackerOnce, install_alloc_tracker_hooks);
+
+  uint32_t Idx = alloc_site_slot(SiteId, (uint32_t)InUnsafe);
+  if (Idx < MAX_ALLOC_SITES) {
+    AllocSiteEntry *E = &AllocSites[Idx];
+    UNSAFE_INSTR_ATOMIC_ADD(&E->Allocs, 1);
+    UNSAFE_INSTR_ATOMIC_ADD(&E->Bytes, Size);
+    alloc_tracker_max(&E->MaxAlign, Align);
+    uint64_t Live = UNSAFE_INSTR_ATOMIC_ADD(&E->Live, Size) + Size;
+    alloc_tracker_max(&E->Peak, Live);
+
+    /* Remember the block so the dealloc probe can find this site. */
+    uint64_t Hash = alloc_tracker_mix((uint64_t)(uintptr_t)Ptr);
+    unsigned Probe;
+    for (Probe = 0; Probe < LIVE_BLOCK_PROBES; ++Probe) {
+      uint32_t BIdx = (uint32_t)((Hash + Probe) & (MAX_LIVE_BLOCKS - 1));
+      LiveBlockEntry *B = &LiveBlocks[BIdx];
+      void *Expected = NULL;
+      if (__atomic_load_n(&B->Ptr, __ATOMIC_RELAXED) == NULL &&
+          __atomic_compare_exchange_n(&B->Ptr, &Expected, Ptr, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        B->SiteIdx = Idx;
+        break;
+      }
+    }
+    if (Probe == LIVE_BLOCK_PROBES)
+      UNSAFE_INSTR_ATOMIC_ADD(&LiveBlocksDropped, 1);
+  }
+
+  if (InUnsafe) {
+    uint64_t Live = UNSAFE_INSTR_ATOMIC_ADD(&UnsafeLiveBytes, Size) + Size;
+    alloc_tracker_max(&UnsafeLivePeak, Live);
+  }
+}
+
+void alloc_tracker_dealloc(void *Ptr, uint64_t Size) {
+  pthread_once(&AllocTrackerOnce, install_alloc_tracker_hooks);
+
+  uint64_t Hash = alloc_tracker_mix((uint64_t)(uintptr_t)Ptr);
+  for (unsigned Probe = 0; Probe < LIVE_BLOCK_PROBES; ++Probe) {
+    uint32_t BIdx = (uint32_t)((Hash + Probe) & (MAX_LIVE_BLOCKS - 1));
+    LiveBlockEntry *B = &LiveBlocks[BIdx];
+    if (__atomic_load_n(&B->Ptr, __ATOMIC_ACQUIRE) != Ptr)
+      continue;
+    uint32_t Idx = B->SiteIdx;
+    __atomic_store_n(&B->Ptr, NULL, __ATOMIC_RELEASE);
+    AllocSiteEntry *E = &AllocSites[Idx];
+    UNSAFE_INSTR_ATOMIC_ADD(&E->Live, (uint64_t)-(int64_t)Size);
+    if (E->InUnsafe)
+      UNSAFE_INSTR_ATOMIC_ADD(&UnsafeLiveBytes, (uint64_t)-(int64_t)Size);
+    return;
+  }
+  UNSAFE_INSTR_ATOMIC_ADD(&UnmatchedDeallocs, 1);
+}
+
+/* Batch-runner reset. Everything that counts events restarts; the maps
+ * range table survives (it describes the address space, not the run).
+ * The alloc tracker keeps its live-block state across the reset: blocks
+ * allocated before it may be freed after it, and dropping the table would
+ * turn those frees into unmatched deallocs and drive the live totals
+ * negative. Flow counters restart and the peaks restart from the
+ * surviving live level. */
+static void reset_heap_stats(void) {
+  memset(&TotalHeap, 0, sizeof(TotalHeap));
+  StaticStackSites = StaticGlobalSites = 0;
+  memset(MapClassTotals, 0, sizeof(MapClassTotals));
+  MapRescans = MapRangesDropped = 0;
+  memset(LineRegions, 0, sizeof(LineRegions));
+  LineRegionsDropped = ThreadLineSlotsDropped = 0;
+  for (uint32_t I = 0; I < MAX_ALLOC_SITES; ++I) {
+    AllocSiteEntry *E = &AllocSites[I];
+    if (!E->SiteId)
+      continue;
+    E->Allocs = 0;
+    E->Bytes = 0;
+    E->MaxAlign = 0;
+    E->Peak = E->Live;
+  }
+  AllocSitesDropped = LiveBlocksDropped = UnmatchedDeallocs = 0;
+  UnsafeLivePeak = UnsafeLiveBytes;
+}
+
+/* One "alloc" row per claimed site:
+ *   alloc\t<site_id>\t<in_unsafe>\t<allocs>\t<bytes>\t<max_align>\t
+ *   <peak>\t<live_at_exit> */
+static void print_alloc_tracker_stats(void) {
+  FILE *Out = unsafe_instr_out();
+  fprintf(Out, "== alloc_tracker ==\n");
+  fprintf(Out, "unsafe_live_peak\t%llu\tunsafe_live_at_exit\t%llu\n",
+          (unsigned long long)UnsafeLivePeak,
+          (unsigned long long)UnsafeLiveBytes);
+  fprintf(Out,
+          "alloc_sites_dropped\t%llu\tlive_blocks_dropped\t%llu\t"
+          "unmatched_deallocs\t%llu\n",
+          (unsigned long long)AllocSitesDropped,
+          (unsigned long long)LiveBlocksDropped,
+          (unsigned long long)UnmatchedDeallocs);
+  for (uint32_t I = 0; I < MAX_ALLOC_SITES; ++I) {
+    AllocSiteEntry *E = &AllocSites[I];
+    if (!E->SiteId)
+      continue;
+    fprintf(Out, "alloc\t%u\t%u\t%llu\t%llu\t%llu\t%llu\t%llu\n", E->SiteId,
+            E->InUnsafe, (unsigned long long)E->Allocs,
+            (unsigned long long)E->Bytes, (unsigned long long)E->MaxAlign,
+            (unsigned long long)E->Peak, (unsigned long long)E->Live);
+  }
+  fflush(Out);
+}
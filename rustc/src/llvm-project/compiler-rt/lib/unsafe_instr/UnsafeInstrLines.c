@@ -0,0 +1,146 @@
+/*===- UnsafeInstrLines.c - Dynamic line count runtime --------------------===*\
+|*
+|* Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+|* See https://llvm.org/LICENSE.txt for license information.
+|* SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+|*
+\*===----------------------------------------------------------------------===*/
+
+/* Runtime side of DynamicLineCountPass: the bulk line registration, the
+ * per-line execution counters and the text/binary exit dumps. The probe is
+ * one relaxed array add; line IDs are dense by construction (record N of
+ * the bulk registration defines ID N).
+ */
+
+#include "UnsafeInstrUtil.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* One record of the bulk registration blob: source line plus an offset into
+ * the NUL-separated file-name pool. */
+typedef struct {
+  uint32_t Line;
+  uint32_t FileOffset;
+} UnsafeLineRecord;
+
+static const UnsafeLineRecord *LineRecords;
+static const char *FileBlob;
+static uint32_t NumLines;
+static uint64_t *LineCounts;
+/* ID-space qualifier of the line table's build (0 when the pass did not
+ * record one); hash-qualified rows let the offline aggregator merge
+ * shards from different builds by (hash, file, line). */
+static uint64_t LinesModuleHash;
+
+/* Coverage-only mode hands over an ID-indexed byte map instead of counting
+ * through the runtime. */
+static const uint8_t *CoveredMap;
+static uint32_t CoveredMapLines;
+
+/* Batch-runner reset: counts and the coverage flag map restart; the line
+ * records and file blob are registration-time facts and survive. The
+ * covered map lives module-side but is the writable flag array the
+ * coverage-only probes store into — const here only because this unit
+ * never writes it on the probe path. */
+static void reset_line_stats(void) {
+  if (LineCounts)
+    memset(LineCounts, 0, NumLines * sizeof(uint64_t));
+  if (CoveredMap)
+    memset((uint8_t *)(uintptr_t)CoveredMap, 0, CoveredMapLines);
+}
+
+static int LinesResetInstalled;
+
+static void install_lines_reset(void) {
+  if (!LinesResetInstalled) {
+    LinesResetInstalled = 1;
+    unsafe_instr_register_reset(reset_line_stats);
+  }
+}
+
+void register_unsafe_lines_bulk(const void *Entries, uint32_t Count,
+                                const char *Blob, uint64_t ModuleHash) {
+  install_lines_reset();
+  if (LineRecords) {
+    fprintf(stderr, "unsafe_instr: multiple unsafe line tables registered; "
+                    "keeping the first (compile the primary package as one "
+                    "codegen unit)\n");
+    return;
+  }
+  LineRecords = (const UnsafeLineRecord *)Entries;
+  FileBlob = Blob;
+  NumLines = Count;
+  LinesModuleHash = ModuleHash;
+  /* One slot per tracked line across the whole crate; large builds push
+   * this into huge-page territory, which the table allocator handles. */
+  LineCounts = unsafe_instr_table_alloc(Count * sizeof(uint64_t));
+}
+
+void track_unsafe_line_execution(uint32_t Id) {
+  if (LineCounts && Id < NumLines)
+    UNSAFE_INSTR_ATOMIC_ADD(&LineCounts[Id], 1);
+}
+
+void register_unsafe_line_covered_map(const uint8_t *Map, uint32_t Count) {
+  install_lines_reset();
+  CoveredMap = Map;
+  CoveredMapLines = Count;
+}
+
+void print_unsafe_coverage_stats(void) {
+  unsafe_instr_flush_this_thread();
+
+  FILE *Out = unsafe_instr_out();
+  fprintf(Out, "== unsafe_lines ==\n");
+
+  uint64_t Total = 0;
+  uint32_t Covered = 0;
+  for (uint32_t I = 0; I < NumLines; ++I) {
+    Total += LineCounts[I];
+    if (LineCounts[I])
+      ++Covered;
+  }
+  for (uint32_t I = 0; I < CoveredMapLines; ++I)
+    if (CoveredMap[I])
+      ++Covered;
+
+  fprintf(Out, "registered_lines\t%u\n",
+          NumLines ? NumLines : CoveredMapLines);
+  fprintf(Out, "covered_lines\t%u\n", Covered);
+  fprintf(Out, "line_executions\t%llu\n", (unsigned long long)Total);
+  /* Hash-qualified rows when the build recorded a module hash with its
+   * table; plain rows otherwise, matching the function runtime. */
+  for (uint32_t I = 0; I < NumLines; ++I)
+    if (LineCounts[I]) {
+      if (LinesModuleHash)
+        fprintf(Out, "mline\t%llx\t%s\t%u\t%llu\n",
+                (unsigned long long)LinesModuleHash,
+                FileBlob + LineRecords[I].FileOffset, LineRecords[I].Line,
+                (unsigned long long)LineCounts[I]);
+      else
+        fprintf(Out, "line\t%s\t%u\t%llu\n",
+                FileBlob + LineRecords[I].FileOffset, LineRecords[I].Line,
+                (unsigned long long)LineCounts[I]);
+    }
+  fflush(Out);
+}
+
+/* Binary dump (-unsafe-coverage-binary-dump): version word, line count,
+ * then one u64 execution count per ID. Written to UNSAFE_COVERAGE_BIN or
+ * "unsafe_coverage.bin" in the working directory. */
+void dump_unsafe_coverage_binary(uint32_t Version) {
+  unsafe_instr_flush_this_thread();
+
+  const char *Path = getenv("UNSAFE_COVERAGE_BIN");
+  FILE *Out = fopen(Path ? Path : "unsafe_coverage.bin", "wb");
+  if (!Out) {
+    fprintf(stderr, "unsafe_instr: cannot write coverage binary\n");
+    return;
+  }
+  fwrite(&Version, sizeof(Version), 1, Out);
+  fwrite(&NumLines, sizeof(NumLines), 1, Out);
+  if (NumLines)
+    fwrite(LineCounts, sizeof(uint64_t), NumLines, Out);
+  fclose(Out);
+}
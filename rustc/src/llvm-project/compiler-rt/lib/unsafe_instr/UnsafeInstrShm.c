@@ -0,0 +1,78 @@
+/*===- UnsafeInstrShm.c - Shared-memory stat aggregation ------------------===*\
+|*
+|* Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+|* See https://llvm.org/LICENSE.txt for license information.
+|* SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+|*
+\*===----------------------------------------------------------------------===*/
+
+/* The -unsafe-stats-shm contract: a ctor attaches the segment named by the
+ * UNSAFE_STATS_SHM environment variable and a dtor folds this process's
+ * accumulators into it with atomic adds — no exit-time formatting, so
+ * harnesses spawning thousands of short-lived instrumented processes
+ * (rebar) read one pre-aggregated region instead of parsing one file per
+ * run. The segment is a flat array of u64 slots; the pipeline reads the
+ * cycle totals, which is what the fast-aggregation path exists for.
+ */
+
+#include "UnsafeInstrUtil.h"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Slot layout of the segment. */
+enum {
+  UNSAFE_SHM_CYCLES = 0,
+  UNSAFE_SHM_REGION_EXECUTIONS = 1,
+  UNSAFE_SHM_PROCESSES = 2,
+  UNSAFE_SHM_NUM_SLOTS = 8 /* Room to grow without a layout bump. */
+};
+
+static uint64_t *ShmSlots;
+
+/* Internal accessor defined in UnsafeInstrCycle.c. */
+void unsafe_instr_cycle_totals(uint64_t *Cycles, uint64_t *Count);
+
+void __unsafe_stats_attach_shm(void) {
+  if (ShmSlots)
+    return;
+  const char *Path = getenv("UNSAFE_STATS_SHM");
+  if (!Path)
+    return;
+
+  int Fd = open(Path, O_RDWR | O_CREAT, 0644);
+  if (Fd < 0)
+    return;
+  size_t Size = UNSAFE_SHM_NUM_SLOTS * sizeof(uint64_t);
+  if (ftruncate(Fd, (off_t)Size) != 0) {
+    close(Fd);
+    return;
+  }
+  void *Mem = mmap(NULL, Size, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+  close(Fd);
+  if (Mem == MAP_FAILED)
+    return;
+  ShmSlots = (uint64_t *)Mem;
+}
+
+void __unsafe_stats_publish_shm(void) {
+  if (!ShmSlots)
+    return;
+  unsafe_instr_flush_this_thread();
+
+  uint64_t Cycles = 0, Count = 0;
+  unsafe_instr_cycle_totals(&Cycles, &Count);
+  UNSAFE_INSTR_ATOMIC_ADD(&ShmSlots[UNSAFE_SHM_CYCLES], Cycles);
+  UNSAFE_INSTR_ATOMIC_ADD(&ShmSlots[UNSAFE_SHM_REGION_EXECUTIONS], Count);
+  UNSAFE_INSTR_ATOMIC_ADD(&ShmSlots[UNSAFE_SHM_PROCESSES], 1);
+}
+
+#else /* Non-POSIX targets: the hooks exist but do nothing. */
+
+void __unsafe_stats_attach_shm(void) {}
+void __unsafe_stats_publish_shm(void) {}
+
+#endif
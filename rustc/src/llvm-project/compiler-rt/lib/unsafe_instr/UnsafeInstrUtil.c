@@ -0,0 +1,263 @@
+/*===- UnsafeInstrUtil.c - Unsafe-Rust instrumentation runtime ------------===*\
+|*
+|* Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+|* See https://llvm.org/LICENSE.txt for license information.
+|* SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+|*
+\*===----------------------------------------------------------------------===*/
+
+/* pthread_getname_np */
+#define _GNU_SOURCE
+
+#include "UnsafeInstrUtil.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/* A process has a handful of these at most (one per probe family), so a
+ * small fixed table suffices and keeps registration allocation-free. */
+#define MAX_THREAD_EXIT_CALLBACKS 16
+
+static void (*ThreadExitCallbacks[MAX_THREAD_EXIT_CALLBACKS])(void);
+static uint32_t NumThreadExitCallbacks;
+
+static pthread_key_t ThreadExitKey;
+static pthread_once_t ThreadExitKeyOnce = PTHREAD_ONCE_INIT;
+
+#define UNSAFE_INSTR_HUGE_PAGE (2ull * 1024 * 1024)
+
+void *unsafe_instr_table_alloc(size_t Size) {
+  if (Size >= UNSAFE_INSTR_HUGE_PAGE) {
+    /* Over-map by one huge page, then trim head and tail so the table
+     * starts on a 2 MiB boundary — the alignment THP needs to back it
+     * with huge pages at all. */
+    size_t Aligned =
+        (Size + UNSAFE_INSTR_HUGE_PAGE - 1) & ~(UNSAFE_INSTR_HUGE_PAGE - 1);
+    size_t Span = Aligned + UNSAFE_INSTR_HUGE_PAGE;
+    void *Raw = mmap(NULL, Span, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Raw != MAP_FAILED) {
+      uintptr_t Base = ((uintptr_t)Raw + UNSAFE_INSTR_HUGE_PAGE - 1) &
+                       ~(uintptr_t)(UNSAFE_INSTR_HUGE_PAGE - 1);
+      size_t Head = Base - (uintptr_t)Raw;
+      if (Head)
+        munmap(Raw, Head);
+      size_t Tail = Span - Head - Aligned;
+      if (Tail)
+        munmap((void *)(Base + Aligned), Tail);
+#ifdef MADV_HUGEPAGE
+      /* Advisory: a kernel with THP disabled just keeps 4K pages, which
+       * is the pre-existing behavior, not an error. */
+      madvise((void *)Base, Aligned, MADV_HUGEPAGE);
+#endif
+      return (void *)Base; /* Anonymous mappings come zeroed. */
+    }
+  }
+  return calloc(1, Size);
+}
+
+FILE *unsafe_instr_out(void) {
+  static FILE *Out;
+  if (!Out) {
+    const char *Path = getenv("UNSAFE_INSTR_OUT");
+    /* Append: the per-family atexit printers each write their own section
+     * and all of them should land in the same file. */
+    Out = Path ? fopen(Path, "a") : NULL;
+    if (!Out)
+      Out = stderr;
+  }
+  return Out;
+}
+
+void unsafe_instr_flush_this_thread(void) {
+  uint32_t N = __atomic_load_n(&NumThreadExitCallbacks, __ATOMIC_ACQUIRE);
+  for (uint32_t I = 0; I < N; ++I)
+    ThreadExitCallbacks[I]();
+}
+
+static void thread_exit_destructor(void *Unused) {
+  (void)Unused;
+  unsafe_instr_flush_this_thread();
+}
+
+static void make_thread_exit_key(void) {
+  pthread_key_create(&ThreadExitKey, thread_exit_destructor);
+}
+
+void unsafe_instr_at_thread_exit(void (*Callback)(void)) {
+  /* Registration comes from module constructors and first-event slow paths;
+   * the publish below keeps a racing reader from seeing the count before
+   * the slot. Duplicate registrations are the caller's job to avoid (each
+   * probe family registers through its own pthread_once). */
+  uint32_t Slot = NumThreadExitCallbacks;
+  if (Slot >= MAX_THREAD_EXIT_CALLBACKS)
+    return;
+  ThreadExitCallbacks[Slot] = Callback;
+  __atomic_store_n(&NumThreadExitCallbacks, Slot + 1, __ATOMIC_RELEASE);
+  pthread_once(&ThreadExitKeyOnce, make_thread_exit_key);
+}
+
+static __thread uint32_t ThreadOrdinal; /* Ordinal + 1; 0 = unassigned. */
+static uint32_t NextThreadOrdinal;
+
+uint32_t unsafe_instr_thread_ordinal(void) {
+  if (!ThreadOrdinal)
+    ThreadOrdinal = UNSAFE_INSTR_ATOMIC_ADD(&NextThreadOrdinal, 1) + 1;
+  return ThreadOrdinal - 1;
+}
+
+const char *unsafe_instr_thread_name(void) {
+  static __thread char Name[UNSAFE_INSTR_THREAD_NAME_MAX];
+  static __thread int Captured;
+  if (!Captured) {
+    Captured = 1;
+#if defined(__linux__) || defined(__APPLE__)
+    if (pthread_getname_np(pthread_self(), Name, sizeof(Name)) != 0 ||
+        !Name[0])
+      strcpy(Name, "?");
+#else
+    strcpy(Name, "?");
+#endif
+  }
+  return Name;
+}
+
+void unsafe_instr_arm_thread_exit(void) {
+  pthread_once(&ThreadExitKeyOnce, make_thread_exit_key);
+  if (!pthread_getspecific(ThreadExitKey))
+    pthread_setspecific(ThreadExitKey, (void *)1);
+}
+
+/* Streaming sink: one detached flusher thread, a fixed callback table
+ * mirroring the thread-exit registry above. The thread only ever reads
+ * global accumulators and appends to the output stream, so it needs no
+ * coordination with the probe fast paths. */
+#define MAX_STREAM_CALLBACKS 16
+
+static void (*StreamCallbacks[MAX_STREAM_CALLBACKS])(void);
+static uint32_t NumStreamCallbacks;
+
+uint32_t unsafe_instr_stream_interval_ms(void) {
+  static uint32_t Interval;
+  static int Resolved;
+  if (!Resolved) {
+    const char *Spec = getenv("UNSAFE_INSTR_STREAM_MS");
+    Interval = Spec ? (uint32_t)strtoul(Spec, NULL, 10) : 0;
+    Resolved = 1;
+  }
+  return Interval;
+}
+
+void unsafe_instr_register_stream_flush(void (*Callback)(void)) {
+  uint32_t Slot = NumStreamCallbacks;
+  if (Slot >= MAX_STREAM_CALLBACKS)
+    return;
+  StreamCallbacks[Slot] = Callback;
+  __atomic_store_n(&NumStreamCallbacks, Slot + 1, __ATOMIC_RELEASE);
+}
+
+static void *stream_flusher(void *Unused) {
+  (void)Unused;
+  uint32_t Ms = unsafe_instr_stream_interval_ms();
+  struct timespec Ts;
+  Ts.tv_sec = Ms / 1000;
+  Ts.tv_nsec = (long)(Ms % 1000) * 1000000L;
+  for (;;) {
+    nanosleep(&Ts, NULL);
+    uint32_t N = __atomic_load_n(&NumStreamCallbacks, __ATOMIC_ACQUIRE);
+    for (uint32_t I = 0; I < N; ++I)
+      StreamCallbacks[I]();
+    fflush(unsafe_instr_out());
+  }
+  return NULL;
+}
+
+static pthread_once_t StreamOnce = PTHREAD_ONCE_INIT;
+
+static void spawn_stream_flusher(void) {
+  pthread_attr_t Attr;
+  pthread_t Thread;
+  pthread_attr_init(&Attr);
+  /* Detached: the flusher runs until process exit; nothing joins it, and
+   * the final atexit printers read the same global accumulators anyway. */
+  pthread_attr_setdetachstate(&Attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&Thread, &Attr, stream_flusher, NULL);
+  pthread_attr_destroy(&Attr);
+}
+
+void unsafe_instr_stream_start(void) {
+  if (!unsafe_instr_stream_interval_ms())
+    return;
+  pthread_once(&StreamOnce, spawn_stream_flusher);
+}
+
+/* Batch-runner reset registry: one fixed callback table mirroring the two
+ * above. Families register from the same startup hooks that install their
+ * flush callbacks, so anything that ever accumulated is resettable. */
+#define MAX_RESET_CALLBACKS 16
+
+static void (*ResetCallbacks[MAX_RESET_CALLBACKS])(void);
+static uint32_t NumResetCallbacks;
+
+void unsafe_instr_register_reset(void (*Callback)(void)) {
+  uint32_t Slot = NumResetCallbacks;
+  if (Slot >= MAX_RESET_CALLBACKS)
+    return;
+  ResetCallbacks[Slot] = Callback;
+  __atomic_store_n(&NumResetCallbacks, Slot + 1, __ATOMIC_RELEASE);
+}
+
+void __unsafe_reset_stats(void) {
+  /* Fold the calling thread's thread-locals first, so zeroing the globals
+   * covers them; the harness's iteration thread is the only one the reset
+   * can reach, which is exactly the batch contract. */
+  unsafe_instr_flush_this_thread();
+  uint32_t N = __atomic_load_n(&NumResetCallbacks, __ATOMIC_ACQUIRE);
+  for (uint32_t I = 0; I < N; ++I)
+    ResetCallbacks[I]();
+}
+
+/* Dormant-probe enable bytes (-unsafe-instr-dormant-probes). The passes gate
+ * every probe on its family's byte; which families are live is decided here,
+ * once, from UNSAFE_INSTR_EXPERIMENT — a comma-separated list of family
+ * names (cycle, heap, counter, lines, func). Unset means every family runs,
+ * so a dormant build with no environment behaves like a normal one. */
+uint8_t __unsafe_probe_enable_cycle;
+uint8_t __unsafe_probe_enable_heap;
+uint8_t __unsafe_probe_enable_counter;
+uint8_t __unsafe_probe_enable_lines;
+uint8_t __unsafe_probe_enable_func;
+
+static int experiment_lists(const char *Spec, const char *Family) {
+  size_t Len = strlen(Family);
+  for (const char *P = Spec; *P;) {
+    const char *End = strchr(P, ',');
+    size_t N = End ? (size_t)(End - P) : strlen(P);
+    if (N == Len && strncmp(P, Family, Len) == 0)
+      return 1;
+    if (!End)
+      break;
+    P = End + 1;
+  }
+  return 0;
+}
+
+__attribute__((constructor)) static void unsafe_instr_select_experiment(void) {
+  const char *Spec = getenv("UNSAFE_INSTR_EXPERIMENT");
+  if (!Spec || !*Spec) {
+    __unsafe_probe_enable_cycle = 1;
+    __unsafe_probe_enable_heap = 1;
+    __unsafe_probe_enable_counter = 1;
+    __unsafe_probe_enable_lines = 1;
+    __unsafe_probe_enable_func = 1;
+    return;
+  }
+  __unsafe_probe_enable_cycle = experiment_lists(Spec, "cycle");
+  __unsafe_probe_enable_heap = experiment_lists(Spec, "heap");
+  __unsafe_probe_enable_counter = experiment_lists(Spec, "counter");
+  __unsafe_probe_enable_lines = experiment_lists(Spec, "lines");
+  __unsafe_probe_enable_func = experiment_lists(Spec, "func");
+}
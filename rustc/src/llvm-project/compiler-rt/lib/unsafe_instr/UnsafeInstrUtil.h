@@ -0,0 +1,160 @@
+/*===- UnsafeInstrUtil.h - Unsafe-Rust instrumentation runtime ------------===*\
+|*
+|* Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+|* See https://llvm.org/LICENSE.txt for license information.
+|* SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+|*
+\*===----------------------------------------------------------------------===*/
+
+/* Shared plumbing for the unsafe-Rust instrumentation runtime: the cycle
+ * counter read, lock-free accumulator helpers, the stats output stream and
+ * the thread-exit hook registry. The probe contract itself lives in the
+ * individual translation units; this header carries only what they share.
+ *
+ * The library deliberately allocates nothing on the probe fast paths and
+ * takes no locks anywhere: hot-path state is thread-local, folded into
+ * global atomics from thread-exit hooks, so the runtime itself stays out of
+ * the measurements (the reason the Rust perf crate had to be excluded from
+ * native-lib benchmark runs).
+ */
+
+#ifndef UNSAFE_INSTR_UTIL_H
+#define UNSAFE_INSTR_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Relaxed lock-free add; every cross-thread total in the runtime goes
+ * through this. Building with -DUNSAFE_INSTR_NONATOMIC_ADDS swaps in a
+ * plain read-modify-write for A/B-ing the cost of the lock prefix; that
+ * build can lose updates under contention, which is exactly what the
+ * accum_integrity check in the dump exists to catch. */
+#if defined(UNSAFE_INSTR_NONATOMIC_ADDS)
+#define UNSAFE_INSTR_ATOMIC_ADD(Ptr, Val)                                      \
+  ({                                                                           \
+    __typeof__(*(Ptr)) UnsafeInstrOld_ = *(Ptr);                               \
+    *(Ptr) = UnsafeInstrOld_ + (Val);                                          \
+    UnsafeInstrOld_;                                                           \
+  })
+#else
+#define UNSAFE_INSTR_ATOMIC_ADD(Ptr, Val)                                      \
+  __atomic_fetch_add((Ptr), (Val), __ATOMIC_RELAXED)
+#endif
+
+/* Always-atomic add for the integrity shadow totals: it is the reference
+ * side of the accum_integrity comparison, so it must stay atomic even in
+ * an UNSAFE_INSTR_NONATOMIC_ADDS build. */
+#define UNSAFE_INSTR_SHADOW_ADD(Ptr, Val)                                      \
+  __atomic_fetch_add((Ptr), (Val), __ATOMIC_RELAXED)
+
+/* Reads the same counter the inline probes read, so runtime-call and inline
+ * probe modes produce comparable numbers. */
+static inline uint64_t unsafe_instr_read_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t Lo, Hi;
+  __asm__ __volatile__("rdtsc" : "=a"(Lo), "=d"(Hi));
+  return ((uint64_t)Hi << 32) | Lo;
+#elif defined(__aarch64__)
+  uint64_t Val;
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(Val));
+  return Val;
+#else
+  return 0;
+#endif
+}
+
+/* Allocates a zeroed accumulator table of Size bytes. Tables of a huge
+ * page (2 MiB) or more get their own anonymous mapping, trimmed to a 2 MiB
+ * boundary and advised MADV_HUGEPAGE, so a hundreds-of-MB counter array
+ * costs a handful of TLB entries instead of tens of thousands — otherwise
+ * the instrumentation's own page walks drift with the host's THP settings
+ * and masquerade as workload memory behavior. Smaller tables (and any
+ * mapping failure) fall back to calloc. Tables live to process exit; there
+ * is no matching free. */
+void *unsafe_instr_table_alloc(size_t Size);
+
+/* Stats output stream: the file named by UNSAFE_INSTR_OUT (opened for
+ * append, so the sections from all the atexit printers land in one file),
+ * or stderr when unset. Resolved once per process. */
+FILE *unsafe_instr_out(void);
+
+/* Registers a callback invoked from every exiting instrumented thread (and
+ * once more from the main thread at process exit). This is how per-thread
+ * accumulators get folded into the global totals without fences on the fast
+ * path. Callbacks registered after threads have started still cover those
+ * threads' exits. */
+void unsafe_instr_at_thread_exit(void (*Callback)(void));
+
+/* Runs the registered thread-exit callbacks for the calling thread; the
+ * process-exit printers call this for the main thread before reading the
+ * global totals. Safe to call more than once per thread. */
+void unsafe_instr_flush_this_thread(void);
+
+/* Longest thread name the runtime stores, including the terminator (the
+ * Linux pthread name limit). */
+#define UNSAFE_INSTR_THREAD_NAME_MAX 16
+
+/* Stable per-thread ordinal, assigned in first-use order. Dump rows keyed
+ * on it correlate across probe families within one run; across runs only
+ * the name column means anything, since arrival order is scheduling-
+ * dependent. */
+uint32_t unsafe_instr_thread_ordinal(void);
+
+/* The calling thread's pthread name, captured once on first call. Executor
+ * pools (tokio, rayon) name their workers after spawn, so the accumulating
+ * translation units call this from their first flush rather than their
+ * first event. Returns "?" when no name is set or available. */
+const char *unsafe_instr_thread_name(void);
+
+/* Arms the pthread thread-exit destructor for the calling thread. The
+ * accumulating translation units call this on their first event per
+ * thread; without it pthreads has no per-thread value to destroy and the
+ * exit callbacks would never fire. */
+void unsafe_instr_arm_thread_exit(void);
+
+/* Streaming sink (UNSAFE_INSTR_STREAM_MS): a background flusher that
+ * periodically runs registered callbacks, each appending a delta section
+ * to the stats file. Long-running services then lose at most one flush
+ * interval to a crash instead of everything, and the aggregator's
+ * summing merge reconstructs totals from whatever prefix survived. 0 or
+ * unset means batch mode: nothing is registered, no thread starts. */
+uint32_t unsafe_instr_stream_interval_ms(void);
+
+/* Registers a flush callback; same fixed-table discipline as the
+ * thread-exit registry. Callbacks run on the flusher thread and must
+ * confine themselves to reading global accumulators and appending to
+ * unsafe_instr_out. */
+void unsafe_instr_register_stream_flush(void (*Callback)(void));
+
+/* Starts the flusher thread, once, if an interval is configured. The
+ * accumulating translation units call this from their startup hook after
+ * registering their callback. */
+void unsafe_instr_stream_start(void);
+
+/* Batch-runner reset contract: each accumulating translation unit
+ * registers a callback that zeroes its dynamic accumulators. Registration
+ * tables (names, metadata, static estimates) are left alone — they
+ * describe the build, not the run. Same fixed-table discipline as the
+ * registries above. */
+void unsafe_instr_register_reset(void (*Callback)(void));
+
+/* Folds the calling thread's thread-locals into the globals, then runs
+ * every registered reset callback, returning all dynamic stats to zero.
+ * This is the entry point an in-process batch harness dlsym's so one
+ * dlopen'd instrumented build can serve N iterations with per-iteration
+ * snapshot/reset instead of N process spawns. Any OTHER instrumented
+ * thread must be quiescent across the call — an iterating harness
+ * guarantees that by construction. */
+void __unsafe_reset_stats(void);
+
+/* Per-family enable bytes for -unsafe-instr-dormant-probes builds. Every
+ * emitted probe tests its family's byte; a startup constructor sets them
+ * from the UNSAFE_INSTR_EXPERIMENT environment variable (all families when
+ * unset), so one instrumented build serves every experiment. */
+extern uint8_t __unsafe_probe_enable_cycle;
+extern uint8_t __unsafe_probe_enable_heap;
+extern uint8_t __unsafe_probe_enable_counter;
+extern uint8_t __unsafe_probe_enable_lines;
+extern uint8_t __unsafe_probe_enable_func;
+
+#endif /* UNSAFE_INSTR_UTIL_H */
@@ -4478,6 +4478,13 @@ LLVMBool LLVMIsMultithreaded(void);
  *  is compiled from unsafe Rust source code.
  */
 void LLVMSetInstUnsafeMetadata(LLVMValueRef Inst);
+
+/** Batched form of LLVMSetInstUnsafeMetadata: tag Count instructions in one
+ *  call. All instructions must belong to the same context; the shared
+ *  metadata node is created once and attached to each. Intended for codegen
+ *  of unsafe-heavy functions, where per-instruction FFI crossings add up.
+ */
+void LLVMSetInstsUnsafeMetadata(LLVMValueRef *Insts, unsigned Count);
 //  UNSAFE-RUST END
 
 LLVM_C_EXTERN_C_END
@@ -369,6 +369,11 @@ enum MetadataCodes {
   METADATA_GENERIC_SUBRANGE = 45, // [distinct, count, lo, up, stride]
   METADATA_ARG_LIST = 46,         // [n x [type num, value num]]
   METADATA_ASSIGN_ID = 47,        // [distinct, ...]
+  // UNSAFE-RUST BEGIN
+  // Compact attachment of one boolean-valued node to runs of instructions
+  // (-bitcode-compact-unsafe-md); instruction IDs as in METADATA_ATTACHMENT.
+  METADATA_ATTACHMENT_INTERVALS = 48, // [kind, mdnode, n x (start, length)]
+  // UNSAFE-RUST END
 };
 
 // The constants block (CONSTANTS_BLOCK_ID) describes emission for each
@@ -154,6 +154,11 @@ public:
   /// basic blocks.
   SmallVector<unsigned, 50> StatepointStackSlots;
 
+  /// Running ordinal for the zero-size labels surviving unsafe region
+  /// markers lower to under -unsafe-marker-labels, making the label names
+  /// unique (and deterministic) within the function.
+  unsigned UnsafeRegionLabelOrdinal = 0;
+
   /// MBB - The current block.
   MachineBasicBlock *MBB;
 
@@ -435,6 +435,12 @@ namespace llvm {
   // metadata after llvm SanitizerBinaryMetadata pass.
   extern char &MachineSanitizerBinaryMetadataID;
 
+  // UNSAFE-RUST BEGIN
+  /// UnsafeProbeAudit - reports per-probe machine instruction and cycle
+  /// estimates at compile time (-unsafe-probe-audit).
+  FunctionPass *createUnsafeProbeAuditPass();
+  // UNSAFE-RUST END
+
   /// RemoveRedundantDebugValues pass.
   extern char &RemoveRedundantDebugValuesID;
 
@@ -415,6 +415,12 @@ private:
   // sections (e.g. via _attribute_((section("myname")))).
   DenseSet<StringRef> ELFSeenGenericMergeableSections;
 
+  // UNSAFE-RUST BEGIN
+  // See lookupUnsafeMarkerAsm. The cached instructions live in the
+  // MCInstAllocator, so reset() invalidates and clears the map with it.
+  StringMap<const MCInst *> UnsafeMarkerAsmCache;
+  // UNSAFE-RUST END
+
 public:
   explicit MCContext(const Triple &TheTriple, const MCAsmInfo *MAI,
                      const MCRegisterInfo *MRI, const MCSubtargetInfo *MSTI,
@@ -470,6 +476,17 @@ public:
   /// Create and return a new MC instruction.
   MCInst *createMCInst();
 
+  // UNSAFE-RUST BEGIN
+  /// Memoized single-instruction inline-asm blobs: the unsafe-region
+  /// marker nops survive in rlibs built before the marker intrinsics and
+  /// recur thousands of times per module, each otherwise paying a full
+  /// AsmParser round trip in the AsmPrinter. The printer parses a blob
+  /// once, caches the resulting instruction under a (string, dialect,
+  /// cpu) key, and replays it for every later occurrence.
+  const MCInst *lookupUnsafeMarkerAsm(StringRef Key) const;
+  void cacheUnsafeMarkerAsm(StringRef Key, const MCInst &Inst);
+  // UNSAFE-RUST END
+
   /// \name Symbol Management
   /// @{
 
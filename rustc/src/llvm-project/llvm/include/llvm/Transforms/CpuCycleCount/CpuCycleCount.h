@@ -18,13 +18,56 @@
 #include "llvm/IR/PassManager.h"
 
 namespace llvm {
+class Instruction;
 class Module;
 
+/// \brief Serialization strategy emitted before timing probes.
+///
+/// SequentiallyConsistent fences lower to mfence on x86 (~30 cycles each,
+/// twice per region). rdtscp already waits for preceding instructions to
+/// retire, so measurement runs can usually drop to lfence-only or no
+/// explicit fencing.
+///
+/// The mode names are x86 heritage but the emission is target-aware: on
+/// AArch64 the counter-read serialization is isb (cntvct_el0 is a system
+/// register, so dmb ishld — a memory load barrier — would not order the
+/// read at all), and the full fence lowers to dmb ish on its own. Target
+/// picks the cheapest correct sequence for the module's triple, which is
+/// what cross-ISA overhead comparisons should run with.
+enum class ProbeSerialization {
+  None,          ///< No explicit fence.
+  LFence,        ///< Counter-read serialization (lfence / isb) before both
+                 ///< probes.
+  RdtscpImplied, ///< Serialization before the start probe only; the end
+                 ///< side relies on rdtscp's implied ordering.
+  MFence,        ///< Full SequentiallyConsistent fence (legacy behavior).
+  Target         ///< Cheapest correct ordering for the module's target.
+};
+
+/// \brief Emits the configured serialization sequence before \p InsertBefore.
+///
+/// Shared by CpuCycleCountPass and ExternalCallTrackerPass so both honor the
+/// -probe-serialization flag.
+void emitProbeSerialization(Instruction *InsertBefore, bool IsEndProbe);
+
+/// \brief Counter the inline probes read.
+///
+/// TSC counts wall cycles — SMT interference, frequency scaling and all —
+/// so repeated measurements drift on busy boxes. RdPMC reads a perf_event
+/// counter (core cycles or instructions retired, whatever the runtime
+/// programmed) that the emitted ctor sets up via cpu_cycle_pmc_init; the
+/// runtime publishes the rdpmc counter index in __cpu_cycle_pmc_index.
+enum class ProbeSource {
+  TSC,  ///< rdtsc/rdtscp (legacy behavior).
+  RdPMC ///< rdpmc against the perf_event counter the runtime configured.
+};
+
 // Runtime function names
 extern const char *PROGRAM_START_FN;
 extern const char *START_MEASUREMENT_FN;
 extern const char *END_MEASUREMENT_FN;
 extern const char *PRINT_STATS_FN;
+extern const char *RECORD_INLINE_TOTALS_FN;
 
 /// \brief Pass that tracks CPU cycles spent executing unsafe code blocks.
 ///
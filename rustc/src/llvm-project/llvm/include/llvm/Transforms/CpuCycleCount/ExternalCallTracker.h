@@ -23,6 +23,10 @@ class Module;
 // Runtime function names for external call tracking
 extern const char *EXTERNAL_CALL_START_FN;
 extern const char *EXTERNAL_CALL_END_FN;
+extern const char *EXTERNAL_CALL_END_SAMPLED_FN;
+extern const char *EXTERNAL_CALL_END_SPAN_FN;
+extern const char *EXTERNAL_CALL_END_GAP_FN;
+extern const char *EXTERNAL_CALL_REGISTER_CALLEE_FN;
 
 /// \brief Pass that tracks time spent in external function calls.
 ///
@@ -0,0 +1,40 @@
+//===-- UnsafeShareEstimator.h - Static unsafe-cycle-share estimate -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===---------------------------------------------------------------------------------===//
+///
+/// \file
+/// This file declares the UnsafeShareEstimator pass, a compile-time
+/// approximation of the unsafe cycle share CpuCycleCount measures at run
+/// time: static block frequencies times per-instruction latency estimates,
+/// split into in-region and whole-function weight per function.
+///
+//===---------------------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_CPUCYCLECOUNT_UNSAFESHAREESTIMATOR_H
+#define LLVM_TRANSFORMS_CPUCYCLECOUNT_UNSAFESHAREESTIMATOR_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+class Module;
+
+/// \brief Pass that writes a static estimate of each function's unsafe
+/// cycle share into a per-module TSV report.
+///
+/// Report-only: it reads the region markers and mutates no IR. Enabled by
+/// giving -unsafe-share-report-dir a directory; without it the pass is a
+/// no-op, so it can sit in the pipeline unconditionally.
+class UnsafeShareEstimatorPass : public PassInfoMixin<UnsafeShareEstimatorPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
+
+  static bool isRequired() { return true; }
+};
+
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_CPUCYCLECOUNT_UNSAFESHAREESTIMATOR_H
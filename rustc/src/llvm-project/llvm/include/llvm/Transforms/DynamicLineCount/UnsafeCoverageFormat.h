@@ -0,0 +1,65 @@
+//===-- UnsafeCoverageFormat.h - Binary coverage dump layout ---*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// On-disk layout of the binary unsafe-coverage dump written by the runtime
+/// when DynamicLineCountPass runs with -unsafe-coverage-binary-dump. The
+/// layout is fixed-record and mmap-friendly so aggregators can map the file
+/// instead of parsing text:
+///
+///   CoverageFileHeader
+///   CoverageLineRecord[NumLines]   (record N describes line ID N)
+///   file-name pool                 (NUL-separated, rest of the file)
+///
+/// All fields are little-endian. The runtime assembles the whole image in
+/// memory and emits it with a single write(); bump CoverageFormatVersion on
+/// any layout change.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_DYNAMICLINECOUNT_UNSAFECOVERAGEFORMAT_H
+#define LLVM_TRANSFORMS_DYNAMICLINECOUNT_UNSAFECOVERAGEFORMAT_H
+
+#include <cstdint>
+
+namespace llvm {
+namespace unsafecov {
+
+/// File magic: "UCOV" read as a little-endian u32.
+constexpr uint32_t CoverageFormatMagic = 0x564F4355;
+
+/// Bumped on every layout change; the pass passes this to the runtime dump
+/// entry point so a stale runtime fails loudly instead of writing garbage.
+constexpr uint32_t CoverageFormatVersion = 1;
+
+/// Set in CoverageFileHeader::Flags when the run used coverage-only probes,
+/// i.e. Count fields are 0/1 flags rather than execution counts.
+constexpr uint32_t CoverageFlagCoverageOnly = 1u << 0;
+
+struct CoverageFileHeader {
+  uint32_t Magic;    ///< CoverageFormatMagic
+  uint32_t Version;  ///< CoverageFormatVersion
+  uint32_t NumLines; ///< Number of CoverageLineRecord entries that follow
+  uint32_t Flags;    ///< CoverageFlag* bits
+};
+
+struct CoverageLineRecord {
+  uint32_t Line;       ///< Source line number
+  uint32_t FileOffset; ///< Byte offset of the file name in the pool
+  uint64_t Count;      ///< Execution count (or 0/1 in coverage-only mode)
+};
+
+static_assert(sizeof(CoverageFileHeader) == 16,
+              "header layout is part of the on-disk format");
+static_assert(sizeof(CoverageLineRecord) == 16,
+              "record layout is part of the on-disk format");
+
+} // namespace unsafecov
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_DYNAMICLINECOUNT_UNSAFECOVERAGEFORMAT_H
@@ -0,0 +1,62 @@
+//===-- AllocTracker.h - Track Rust allocator calls ----------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===-----------------------------------------------------------------------------===//
+///
+/// \file
+/// This file declares the AllocTracker pass for tracking allocation size and
+/// lifetime through the Rust allocator entry points.
+///
+//===-----------------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_HEAPTRACKER_ALLOCTRACKER_H
+#define LLVM_TRANSFORMS_HEAPTRACKER_ALLOCTRACKER_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+class Function;
+class Module;
+
+extern const char *ALLOC_TRACKER_ALLOC_FN;
+extern const char *ALLOC_TRACKER_DEALLOC_FN;
+
+/// \brief Pass that instruments Rust allocator calls with size, alignment
+/// and lifetime probes.
+///
+/// HeapTracker counts accesses but says nothing about allocation behavior,
+/// so memory overhead cannot be attributed to unsafe code paths. This pass
+/// instruments calls to the __rust_alloc family with probes that carry the
+/// requested size and alignment plus a compile-time allocation-site ID, and
+/// tags allocations made while inside an unsafe region. The runtime keeps
+/// per-site totals and live-byte high-water marks, attributing frees back
+/// to the allocating site through a pointer-keyed table.
+class AllocTrackerPass : public PassInfoMixin<AllocTrackerPass> {
+public:
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
+
+  static bool isRequired() { return true; }
+  static bool isPrimaryPackage();
+
+private:
+  /// \brief The runtime callee declarations, resolved once per module (the
+  /// same caching HeapTrackerPass uses).
+  struct RuntimeCallees {
+    Module *M = nullptr;
+    FunctionCallee Alloc;
+    FunctionCallee Dealloc;
+  };
+
+  /// \brief Populate \ref Callees for \p M.
+  void initRuntimeCallees(Module &M);
+
+  RuntimeCallees Callees;
+};
+
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_HEAPTRACKER_ALLOCTRACKER_H
@@ -14,14 +14,25 @@
 #ifndef LLVM_TRANSFORMS_HEAPTRACKER_HEAPTRACKER_H
 #define LLVM_TRANSFORMS_HEAPTRACKER_HEAPTRACKER_H
 
+#include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/PassManager.h"
 
 namespace llvm {
 
 class Function;
+class Module;
 
 extern const char *DYN_MEM_ACCESS_FN;
 extern const char *DYN_UNSAFE_MEM_ACCESS_FN;
+extern const char *DYN_MEM_ACCESS_SLOW_FN;
+extern const char *DYN_MEM_ACCESS_STATIC_FN;
+extern const char *DYN_MEM_ACCESS_RANGE_FN;
+extern const char *DYN_UNSAFE_MEM_ACCESS_BULK_FN;
+extern const char *HEAP_TRACKER_NOTE_ALLOC_FN;
+extern const char *HEAP_TRACKER_NOTE_DEALLOC_FN;
+extern const char *DYN_UNSAFE_MEM_ACCESS_LINE_FN;
+extern const char *DYN_UNSAFE_MEM_ACCESS_REGION_FN;
+extern const char *DYN_UNSAFE_MEM_ACCESS_ORIGIN_FN;
 
 /// \brief Pass that tracks memory accesses to the heap.
 ///
@@ -36,6 +47,31 @@ public:
   static bool isRequired() { return true; }
   static bool isPrimaryPackage();
 
+private:
+  /// \brief The runtime callee declarations, resolved once per module.
+  ///
+  /// The pass object outlives the per-function runs of a module walk, so
+  /// caching here replaces the per-function getOrInsertFunction calls (one
+  /// per runtime hook per function) with one batch per module.
+  struct RuntimeCallees {
+    Module *M = nullptr;
+    FunctionCallee DynMemAccess;
+    FunctionCallee DynUnsafeMemAccess;
+    FunctionCallee DynMemAccessSlow;
+    FunctionCallee DynMemAccessStatic;
+    FunctionCallee DynMemAccessRange;
+    FunctionCallee DynUnsafeMemAccessBulk;
+    FunctionCallee NoteAlloc;
+    FunctionCallee NoteDealloc;
+    FunctionCallee DynUnsafeMemAccessLine;
+    FunctionCallee DynUnsafeMemAccessRegion;
+    FunctionCallee DynUnsafeMemAccessOrigin;
+  };
+
+  /// \brief Populate \ref Callees for \p M.
+  void initRuntimeCallees(Module &M);
+
+  RuntimeCallees Callees;
 };
 
 } // namespace llvm
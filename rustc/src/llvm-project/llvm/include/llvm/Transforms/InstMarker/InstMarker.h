@@ -14,23 +14,429 @@
 #ifndef LLVM_TRANSFORMS_INSTMARKER_INSTMARKER_H
 #define LLVM_TRANSFORMS_INSTMARKER_INSTMARKER_H
 
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <string>
 
 namespace llvm {
 
+class CallInst;
 class Function;
+class GlobalVariable;
 class Instruction;
+class LLVMContext;
+class MDNode;
+class Module;
 class StringRef;
+class Value;
 
-extern const char *UNSAFE_MARKER_BEGIN;
-extern const char *UNSAFE_MARKER_END;
+/// \brief Whether -unsafe-stats-shm is set: stats accumulate in a named
+/// shared-memory segment instead of being formatted at process exit.
+bool unsafeShmStatsEnabled();
 
-/// \brief Pass that marks unsafe code blocks with inline assembly markers.
+/// \brief Emit (once per module) the shared-memory stats hooks: a ctor
+/// calling __unsafe_stats_attach_shm, which maps the segment named by the
+/// UNSAFE_STATS_SHM environment variable, and a dtor calling
+/// __unsafe_stats_publish_shm, which folds this process's accumulators into
+/// it with no text formatting. Passes honoring -unsafe-stats-shm call this
+/// instead of registering their print/dump destructors; repeat calls are
+/// no-ops.
+void emitShmStatsHooks(Module &M);
+
+/// \brief The -unsafe-stats-output-template value, or the empty string.
+StringRef getUnsafeStatsOutputTemplate();
+
+/// \brief Emit (once per module) a ctor handing the runtime the
+/// -unsafe-stats-output-template pattern via
+/// __unsafe_stats_set_output_template. The runtime expands $VARs from the
+/// environment plus %p (pid) and %t (tid) before opening; a template
+/// containing %t dumps each thread's accumulators as an independent shard
+/// from the thread-exit hook, so exit-time dumping is constant per thread
+/// and concurrent processes never share an output file. Shards merge
+/// offline with llvm-unsafe-stats. No-op when the flag is unset; the
+/// stat-dumping passes call this wherever they register their exit dumps.
+void emitStatsOutputTemplateHook(Module &M);
+
+/// \brief Whether -unsafe-stats-signal-dump is set: the emitted exit dumps
+/// are additionally registered with the runtime's SIGUSR1 facility, so
+/// long-running or killed benchmarks can be asked for intermediate stats.
+bool unsafeSignalDumpEnabled();
+
+/// \brief Register \p DumpFn (a void() exit dump entry point) with the
+/// runtime's signal-dump facility via a generated ctor calling
+/// __unsafe_stats_install_signal_dump. The runtime installs one SIGUSR1
+/// handler on the first registration; the handler only flags the request,
+/// and the dumps run outside signal context against wait-free
+/// sequence-counter-protected snapshots of the accumulator tables.
+void emitSignalDumpRegistration(Module &M, Function *DumpFn);
+
+/// \brief Whether this compilation is for the crate under measurement
+/// (CARGO_PRIMARY_PACKAGE=1).
+///
+/// The getenv lookup happens once per process; every unsafe pass queries
+/// this per function, which under multithreaded codegen used to mean tens
+/// of thousands of locked getenv calls per crate.
+bool isUnsafePrimaryPackage();
+
+/// \brief 64-bit content hash of \p M: the namespace qualifier for the
+/// probe ID spaces the instrumentation passes assign in this module.
+///
+/// Function, region and line IDs are numbered per module build, so stats
+/// from shards compiled differently collide on raw IDs. Every ID-carrying
+/// table registration records this hash next to its IDs, the runtime
+/// emits it with the dumped rows, and the aggregator merges shards by
+/// (hash, id). The value is the IR's detailed structural hash, computed
+/// the first time any pass asks and pinned in a module flag, so later
+/// passes record the same qualifier even though they have already mutated
+/// the module.
+uint64_t getUnsafeModuleHash(Module &M);
+
+/// \brief Shared sampling rate honored by all unsafe instrumentation passes
+/// (-unsafe-instr-sample-rate). 1 means every probe fires.
+unsigned getUnsafeInstrSampleRate();
+
+/// \brief The file named by -unsafe-instr-funcs, or the empty string.
+StringRef getUnsafeInstrFuncsFile();
+
+/// \brief The file named by -unsafe-instr-exclude-profile, or the empty
+/// string. The profile changes which instructions get marked, so it
+/// contributes to the pipeline fingerprint.
+StringRef getUnsafeInstrExcludeProfile();
+
+/// \brief The directory named by -unsafe-name-sidecar-dir, or the empty
+/// string. Non-empty puts every name-table-emitting pass in stripped mode:
+/// binaries carry only numeric IDs, names go to compile-time sidecars.
+/// Changes the emitted IR, so it contributes to the pipeline fingerprint.
+StringRef getUnsafeNameSidecarDir();
+
+/// \brief Opens the per-module name sidecar "<module>.<Suffix>" under
+/// -unsafe-name-sidecar-dir and writes the stats format header plus a
+/// module_hash row, so the aggregator joins a binary's ID-only dump rows
+/// to the right build's names. Returns null when the directory is unset;
+/// open failure is a warning and also returns null — the caller then
+/// embeds names as usual rather than emitting IDs nothing can resolve.
+std::unique_ptr<raw_fd_ostream> openUnsafeNameSidecar(Module &M,
+                                                      StringRef Suffix);
+
+/// \brief Hash of the unsafe instrumentation configuration as it applies
+/// to this compilation.
+///
+/// Flags whose passes are gated on the primary package contribute only
+/// when CARGO_PRIMARY_PACKAGE=1, so dependency builds hash to the same
+/// value under every experiment's llvm-args even though the raw flag
+/// strings differ.  A build system can therefore key shared dependency
+/// artifacts on this value instead of rebuilding identical dependencies
+/// once per experiment.  The hash covers semantics, not spellings; it
+/// says nothing about flags outside the unsafe instrumentation.
+uint64_t getUnsafeInstrPipelineFingerprint();
+
+/// \brief Schedule only the unsafe instrumentation block into \p MPM, for
+/// -unsafe-instr-checkpoint-resume: the rustc wrapper swaps in the
+/// checkpoint bitcode and runs this instead of a default pipeline, so an
+/// instrumentation-strategy experiment costs pass time plus codegen.
+/// Defined next to the pipelines in PassBuilderPipelines.cpp, like the
+/// fingerprint above.
+void addUnsafeInstrumentationResumePipeline(ModulePassManager &MPM);
+
+/// \brief Whether the shared function filter (-unsafe-instr-funcs) admits
+/// \p F.
+///
+/// The flag names a file with one mangled function name per line; when set,
+/// the instrumentation passes probe only the listed functions, so targeted
+/// deep-dives pay no probe overhead anywhere else. With no file every
+/// function is admitted. The file is read once per process.
+bool unsafeInstrFuncFilterAllows(const Function &F);
+
+/// \brief Whether InstMarkerPass inserted region markers into \p F.
+///
+/// InstMarkerPass stamps a function attribute on every function it marked,
+/// so the region-dependent passes can skip the >90% of functions with no
+/// unsafe code by testing one attribute instead of walking every block.
+bool hasUnsafeRegionMarkers(const Function &F);
+
+/// \brief Region count InstMarkerPass recorded in the marker attribute's
+/// value, or 0 when the attribute is absent or carries no count.
+///
+/// A zero means "no count available", not "no regions" — other passes
+/// stamp the attribute bare, and inlining copies markers without it — so
+/// callers wanting a definitive negative still go through
+/// hasUnsafeRegionMarkers and, failing that, the instruction walk.
+unsigned unsafeRegionCountHint(const Function &F);
+
+/// \brief Whether -unsafe-region-correlate is set: HeapTracker and
+/// CpuCycleCount key their records by unsafeRegionKey, so the aggregator
+/// can join cycles to memory traffic per unsafe region instead of
+/// approximating at whole-function granularity.
+bool unsafeRegionCorrelateEnabled();
+
+/// \brief Stable cross-pass key for region \p RegionIdx of \p F: FNV-1a of
+/// the mangled function name mixed with the region's position in
+/// UnsafeRegionAnalysis order, the same scheme the allocation-site IDs
+/// use, so the key survives rebuilds and can be recomputed offline from
+/// the symbol name. Never 0, which the runtime hooks treat as "no key".
+uint32_t unsafeRegionKey(const Function &F, unsigned RegionIdx);
+
+/// \brief Whether -unsafe-instr-dormant-probes is set: all probe families
+/// are emitted but each fires only when the runtime enabled its family
+/// flag at startup, so one build serves every experiment.
+bool unsafeDormantProbesEnabled();
+
+/// \brief Emits the shared per-thread countdown update before
+/// \p InsertBefore and returns the i1 "take this sample" decision, or
+/// nullptr when neither sampling nor dormant probes apply.
+///
+/// \p Family names the probe family ("cycle", "heap", "counter", "lines",
+/// "func"); under -unsafe-instr-dormant-probes the decision is ANDed with
+/// a load of the runtime-owned __unsafe_probe_enable_<family> byte, so a
+/// dormant probe costs one test and a never-taken branch.
+Value *emitSampleDecision(Instruction *InsertBefore, StringRef Family);
+
+/// \brief !prof branch weights marking the probe arm of an instrumentation
+/// branch cold (1 against 100000, the shape the upstream Instrumentation
+/// passes attach).
+///
+/// Without weights BranchProbabilityInfo treats probe branches as 50/50
+/// and block placement pessimizes the straight-line path the probes are
+/// trying to measure — instrumented loops visibly lose their alignment.
+/// \p ProbeArmIsTrue says which successor is the probe arm.
+MDNode *unsafeProbeBranchWeights(LLVMContext &Ctx, bool ProbeArmIsTrue = true);
+
+/// \brief Convenience wrapper around emitSampleDecision: returns an
+/// insertion point that executes only when the probe should fire (or
+/// \p InsertBefore unchanged when no gating applies).
+Instruction *emitSampleGate(Instruction *InsertBefore, StringRef Family);
+
+/// \brief Like emitSampleGate but for probe families the sampling knob
+/// never applied to (entry records, counter increments, line probes):
+/// gates only on the dormant-probe family byte, and only under
+/// -unsafe-instr-dormant-probes.
+Instruction *emitProbeFamilyGate(Instruction *InsertBefore, StringRef Family);
+
+/// \brief Whether the prior-run profile (-unsafe-instr-prior-profile) marks
+/// region \p RegionIdx of \p F hot enough to demote to sampled probes.
+///
+/// \p RegionIdx is the region's position in UnsafeRegionAnalysis order, the
+/// same order the profile's region-index column uses. Matching relies on the
+/// function ID UnsafeFunctionTrackerPass attached, so it only lines up
+/// across builds under -unsafe-func-stable-ids; an untracked function, a
+/// missing profile, or a count below -unsafe-instr-hot-threshold all answer
+/// false and keep full instrumentation. The profile is read once per
+/// process.
+bool priorProfileDemotesRegion(const Function &F, unsigned RegionIdx);
+
+/// \brief Like emitSampleDecision but at the demotion rate
+/// (-unsafe-instr-hot-sample-rate, never below -unsafe-instr-sample-rate),
+/// counting down a separate per-thread global so demoted regions do not
+/// skew the ordinary sampling cadence.
+Value *emitHotSampleDecision(Instruction *InsertBefore, StringRef Family);
+
+/// \brief Convenience wrapper around emitHotSampleDecision, mirroring
+/// emitSampleGate.
+Instruction *emitHotSampleGate(Instruction *InsertBefore, StringRef Family);
+
+/// \brief Name of the module-level named metadata interning unsafe file
+/// paths: operand N wraps a single MDString and defines file index N,
+/// which the per-instruction unsafe_line_info attachments reference as an
+/// i32. Interning the path once per module keeps the per-instruction nodes
+/// string-free; a crate-root path repeated across thousands of unsafe
+/// instructions used to dominate the metadata footprint.
+constexpr const char *UnsafeLineFileTableMD = "unsafe.files";
+
+/// \brief Function attribute InstMarkerPass stamps alongside the markers,
+/// valued with the number of region pairs it emitted;
+/// hasUnsafeRegionMarkers tests it, unsafeRegionCountHint reads the count,
+/// and UnsafeProbeCleanupPass removes it when it strips a function's
+/// markers.
+constexpr const char *UnsafeRegionMarkersAttr = "unsafe-region-markers";
+
+/// \brief Suffix UnsafeMultiVersionPass appends to the marker-carrying
+/// body when it demotes a function behind a probed/clean ifunc. The probe
+/// passes run after the split and re-check the function filter, so
+/// unsafeInstrFuncFilterAllows strips this suffix before matching — the
+/// filter file keeps listing the names the user knows.
+constexpr const char *UnsafeProbedVariantSuffix = ".unsafe_probed";
+
+/// \brief Name of the object-file section holding externalized
+/// instrumentation tables under -unsafe-extern-tables. The section carries
+/// SHF_EXCLUDE, so the linker drops it from the final binary; the tables
+/// survive only in the objects and rlibs feeding the link, where the
+/// LLVMRustExtractUnsafeTables wrapper hook pulls them out for the
+/// aggregator.
+constexpr const char *UnsafeTablesSection = ".unsafe_tables";
+
+/// \brief Family tags in the fixed 16-byte header (u32 magic "UTB1",
+/// u32 family, u64 payload size) each externalized table rides behind, so
+/// the extracted stream parses with no other metadata.
+enum UnsafeExternTableFamily : unsigned {
+  UnsafeExternLineRecords = 1,
+  UnsafeExternLineFilePool = 2,
+  UnsafeExternFunctionMetadata = 3,
+  UnsafeExternBlockCountRows = 4,
+  UnsafeExternBlockOverflowRows = 5,
+};
+
+/// \brief Whether -unsafe-extern-tables is set: the stats passes' static
+/// tables move to the excluded .unsafe_tables section, their registration
+/// ctors pass a null table pointer alongside the real element count, and
+/// the aggregator joins runtime IDs against the extracted tables offline.
+bool unsafeExternTablesEnabled();
+
+/// \brief Rewrap \p GV behind the .unsafe_tables header and move it into
+/// the excluded section. \p GV must have no remaining uses (its consumers
+/// pass null pointers instead); it is erased and replaced.
+void externalizeUnsafeTable(GlobalVariable *GV, UnsafeExternTableFamily Family);
+
+/// \brief Whether -unsafe-lazy-registration is set: the table-registration
+/// ctors stay out of llvm.global_ctors; probes test a per-module flag and
+/// run the registration path on first firing, so harnesses that exec one
+/// binary per measurement pay registration only for modules that execute.
+bool unsafeLazyRegistrationEnabled();
+
+/// \brief Create the internal, zero-initialized i8 "registered" flag the
+/// probe sites test under -unsafe-lazy-registration; set by the once-guard
+/// makeLazyRegistration prepends.
+GlobalVariable *createLazyRegistrationFlag(Module &M, StringRef Name);
+
+/// \brief Turn registration ctor \p RegFn into a first-call registration
+/// entry point: prepends an atomic exchange on \p Flag so repeated and
+/// racing calls register exactly once. The caller keeps \p RegFn out of
+/// llvm.global_ctors and plants emitLazyRegistrationCheck at its probe
+/// sites instead.
+void makeLazyRegistration(Function *RegFn, GlobalVariable *Flag);
+
+/// \brief Emit the probe-site fast path before \p InsertBefore: a plain
+/// load of \p Flag and a cold call of \p RegFn while it is still zero.
+void emitLazyRegistrationCheck(Instruction *InsertBefore, Function *RegFn,
+                               GlobalVariable *Flag);
+
+/// \brief Whether -unsafe-instr-section-layout is set: generated thunks
+/// and tables get dedicated sections for linker ICF and grouped layout
+/// (see placeUnsafeInstrThunk / placeUnsafeTableGlobal).
+bool unsafeSectionLayoutEnabled();
+
+/// \brief Under -unsafe-instr-section-layout, move generated thunk \p F
+/// (registration ctors, flush thunks) into its own
+/// .text.unsafe_thunk.<name> section marked unnamed_addr, so lld's
+/// --icf=safe folds thunks identical up to relocations across CGUs and an
+/// `*(.text.unsafe_thunk.*)` linker-script rule gathers the survivors.
+/// No-op when the flag is off.
+void placeUnsafeInstrThunk(Function *F);
+
+/// \brief Under -unsafe-instr-section-layout, move instrumentation global
+/// \p GV into a grouped output section: constant tables to
+/// .rodata.unsafe_tables.<name> with unnamed_addr (identical tables fold),
+/// mutable accumulators to .data.unsafe_accum.<name> (grouped, never
+/// folded). No-op when the flag is off, when \p GV already has an explicit
+/// section (externalization wins), or for TLS globals.
+void placeUnsafeTableGlobal(GlobalVariable *GV);
+
+/// \brief Name of the function metadata recording the incremental
+/// re-instrumentation hash: two i64 operands, the detailed structural hash
+/// of the function's pre-marker IR and the pipeline fingerprint it was
+/// instrumented under. Present only on functions InstMarkerPass processed
+/// with -unsafe-instr-incremental-dir set.
+constexpr const char *UnsafeInstrHashMD = "unsafe.instr.hash";
+
+/// \brief Whether -unsafe-instr-incremental-dir is set: InstMarkerPass
+/// records per-function content+config hashes in metadata and a per-module
+/// sidecar, and recognizes already-instrumented cached bitcode instead of
+/// double-marking it.
+bool unsafeInstrIncrementalEnabled();
+
+/// \brief Detailed structural hash of \p F as it stands, for the
+/// incremental re-instrumentation record. Never 0, which the record
+/// readers treat as "no hash".
+uint64_t unsafeInstrFunctionHash(const Function &F);
+
+/// \brief Reads the unsafe.instr.hash record off \p F into \p ContentHash
+/// and \p Fingerprint; returns false (leaving both untouched) when the
+/// function carries no well-formed record.
+bool getRecordedUnsafeInstrHash(const Function &F, uint64_t &ContentHash,
+                                uint64_t &Fingerprint);
+
+/// \brief Attaches the unsafe.instr.hash record to \p F, pairing
+/// \p ContentHash with the current pipeline fingerprint.
+void recordUnsafeInstrHash(Function &F, uint64_t ContentHash);
+
+/// \brief Directory named by -unsafe-instr-checkpoint-dir, or empty.
+/// When set, UnsafeInstrCheckpointPass dumps each module's bitcode at the
+/// head of the instrumentation block — post-optimization, pre-probe.
+StringRef getUnsafeInstrCheckpointDir();
+
+/// \brief Whether -unsafe-instr-checkpoint-resume is set: the rustc
+/// wrapper replaces each module with its checkpoint bitcode and runs only
+/// the unsafe passes before codegen.
+bool unsafeInstrCheckpointResumeEnabled();
+
+/// \brief Path of \p M's checkpoint bitcode under the configured
+/// directory, identical on the dump and the resume side; empty when
+/// -unsafe-instr-checkpoint-dir is unset.
+std::string unsafeInstrCheckpointPath(const Module &M);
+
+/// \brief Whether UNSAFE_INSTR_CORPUS_DIR is set: checkpoint dumps are
+/// routed into that directory and each dump appends a row to its
+/// corpus_manifest.tsv, turning one pipeline run over the benchmark
+/// crates into a stable pre-instrumentation .bc corpus for offline pass
+/// work. An environment variable rather than a flag so the one switch
+/// reaches every rustc invocation without threading llvm-args through
+/// the build system.
+bool unsafeInstrCorpusModeEnabled();
+
+/// \brief Name of the begin-marker metadata recording the lexical
+/// nesting the flat region was flattened from: three i32 operands — the
+/// deepest contained instruction's lexical-block depth inside its
+/// subprogram, a stable key for that lexical block, and the key of its
+/// enclosing lexical block (0 at depth <= 1). Emitted by InstMarkerPass
+/// under -instmarker-region-depth; CpuCycleCountPass turns it into the
+/// static nesting table innermost-only attribution subtracts along.
+constexpr const char *UnsafeRegionNestingMD = "unsafe_region_nesting";
+
+/// \brief Name of the runtime-owned shared config block emitted under
+/// -unsafe-config-block: one 64-byte-aligned cache line of
+/// read-only-after-startup state. Word 0 holds the probe-family enable
+/// bits (unsafeProbeFamilyBit positions); the remaining words are reserved
+/// for the runtime's read-mostly state (sampling mask, shm base) so every
+/// per-firing configuration read stays on this one line. Probe codegen
+/// loads word 0 once per function entry and tests bits in a register.
+constexpr const char *UnsafeConfigGlobalName = "__unsafe_instr_config";
+
+/// \brief Bit position of \p Family's enable flag in the config block's
+/// word 0. Shared with the runtime, which sets the bits at startup from
+/// UNSAFE_INSTR_EXPERIMENT before any instrumented code runs.
+unsigned unsafeProbeFamilyBit(StringRef Family);
+
+/// \brief Whether -unsafe-probe-preserve-most is set: the per-firing
+/// runtime hooks are declared and called preserve_most, so a probe site
+/// stops clobbering the surrounding loop's caller-saved registers.
+bool unsafeProbePreserveMostEnabled();
+
+/// \brief Switch \p CI — a direct call to a per-firing runtime hook — and
+/// its callee declaration to the preserve_most calling convention. No-op
+/// unless -unsafe-probe-preserve-most. Must be applied to every call site
+/// of a converted hook (the declaration has to match all of them);
+/// registration ctors and exit dumps stay on the C convention — they fire
+/// once, and the runtime keeps their plain signatures.
+void setUnsafeProbeCallConv(CallInst *CI);
+
+/// \brief Whether -unsafe-probe-audit is set: probes carry unsafe_probe_id
+/// metadata and the late machine audit pass reports per-probe instruction
+/// and cycle estimates at compile time.
+bool unsafeProbeAuditEnabled();
+
+/// \brief Stamp probe anchor \p I with unsafe_probe_id metadata carrying
+/// \p Family and the per-function ordinal \p Id. No-op unless
+/// -unsafe-probe-audit is set.
+void attachProbeId(Instruction *I, StringRef Family, unsigned Id);
+
+/// \brief Pass that marks unsafe code blocks with region-marker intrinsics.
 ///
 /// This pass identifies instructions tagged with "unsafe_inst" metadata and
 /// inserts begin/end markers around contiguous sequences of such instructions
-/// within basic blocks. The markers are implemented as inline assembly to
-/// ensure they are preserved through optimization passes.
+/// within basic blocks. The markers are calls to the
+/// llvm.unsafe.region.begin/end intrinsics, which survive optimization
+/// without pessimizing it and are dropped by codegen.
 class InstMarkerPass : public PassInfoMixin<InstMarkerPass> {
 public:
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
@@ -46,8 +452,23 @@ private:
   /// \brief Creates custom metadata containing line and file information.
   /// \param I The instruction to attach metadata to.
   /// \param Line The source line number.
-  /// \param File The source file name.
-  void createUnsafeLineMetadata(Instruction &I, unsigned Line, StringRef File);
+  /// \param FileIndex The file's index in the module's unsafe.files table.
+  void createUnsafeLineMetadata(Instruction &I, unsigned Line,
+                                unsigned FileIndex);
+
+  /// The marker intrinsic declarations, resolved once per module. The pass
+  /// object outlives the per-function runs of a module walk, so this turns
+  /// two symbol-table lookups per function into two per module.
+  Module *CachedModule = nullptr;
+  Function *MarkerBegin = nullptr;
+  Function *MarkerEnd = nullptr;
+
+  /// Incremental re-instrumentation state, live only under
+  /// -unsafe-instr-incremental-dir: the previous build's hashes for this
+  /// module's sidecar, read before the sidecar is reopened for this
+  /// build's rows on IncrementalOS.
+  StringMap<uint64_t> PrevSidecarHashes;
+  std::unique_ptr<raw_fd_ostream> IncrementalOS;
 };
 
 } // namespace llvm
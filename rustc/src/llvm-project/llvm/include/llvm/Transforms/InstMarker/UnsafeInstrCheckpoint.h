@@ -0,0 +1,38 @@
+//===-- UnsafeInstrCheckpoint.h - Pre-probe bitcode checkpoint -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file declares UnsafeInstrCheckpointPass, the dump side of the
+/// instrumentation checkpoint. Scheduled first in the instrumentation
+/// block under -unsafe-instr-checkpoint-dir, it writes the module's
+/// bitcode — post-optimization, markers in, no probes yet — to the
+/// checkpoint directory. A later compile with
+/// -unsafe-instr-checkpoint-resume (handled in the rustc wrapper) swaps
+/// that bitcode back in and runs only the unsafe passes plus codegen, so
+/// an A/B probe-codegen experiment skips the optimizer entirely.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_INSTMARKER_UNSAFEINSTRCHECKPOINT_H
+#define LLVM_TRANSFORMS_INSTMARKER_UNSAFEINSTRCHECKPOINT_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+class Module;
+
+class UnsafeInstrCheckpointPass
+    : public PassInfoMixin<UnsafeInstrCheckpointPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
+};
+
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_INSTMARKER_UNSAFEINSTRCHECKPOINT_H
@@ -0,0 +1,36 @@
+//===-- UnsafeInstrConsolidate.h - Dedup merged instrumentation -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file declares UnsafeInstrConsolidatePass, scheduled at the head of
+/// the full-LTO post-link pipeline. When rustc links many instrumented
+/// CGUs into one module, each arrives with its own instrumentation ctors,
+/// string tables and registration calls; this pass merges identical
+/// instrumentation tables and collapses structurally identical ctor/dtor
+/// entries so the merged binary registers once instead of once per CGU.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_INSTMARKER_UNSAFEINSTRCONSOLIDATE_H
+#define LLVM_TRANSFORMS_INSTMARKER_UNSAFEINSTRCONSOLIDATE_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+class Module;
+
+class UnsafeInstrConsolidatePass
+    : public PassInfoMixin<UnsafeInstrConsolidatePass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
+};
+
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_INSTMARKER_UNSAFEINSTRCONSOLIDATE_H
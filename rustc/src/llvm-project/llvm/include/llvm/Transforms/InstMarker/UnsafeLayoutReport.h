@@ -0,0 +1,47 @@
+//===-- UnsafeLayoutReport.h - Per-function size/layout report -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file declares UnsafeLayoutReportPass, the two-phase compile-time
+/// size accounting around the instrumentation block. The baseline instance
+/// runs before any probe-emitting pass and records per-function size
+/// estimates in module metadata; the final instance runs after probe
+/// cleanup, recomputes, and writes a per-module TSV of before/after
+/// instruction counts, code-size estimates and alignment — so the overhead
+/// model can separate code-growth and layout effects from probe cost.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_INSTMARKER_UNSAFELAYOUTREPORT_H
+#define LLVM_TRANSFORMS_INSTMARKER_UNSAFELAYOUTREPORT_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+class Module;
+
+class UnsafeLayoutReportPass : public PassInfoMixin<UnsafeLayoutReportPass> {
+public:
+  /// \p Final selects the phase: false records the baseline, true writes
+  /// the report.
+  explicit UnsafeLayoutReportPass(bool Final) : Final(Final) {}
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
+
+  /// \brief True when -unsafe-layout-report-dir is set; the pipeline
+  /// schedules both instances only then.
+  static bool reportConfigured();
+
+private:
+  bool Final;
+};
+
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_INSTMARKER_UNSAFELAYOUTREPORT_H
@@ -0,0 +1,35 @@
+//===-- UnsafeMultiVersion.h - Probed/clean function variants --*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file declares UnsafeMultiVersionPass, scheduled before every
+/// probe-emitting pass. For each function carrying unsafe region markers it
+/// clones a marker-free variant the probe passes will leave alone, then
+/// publishes the original symbol as an ifunc whose resolver picks the
+/// probed or the clean body once, at load time, from an environment
+/// variable. One binary then serves both baseline and measurement runs.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_INSTMARKER_UNSAFEMULTIVERSION_H
+#define LLVM_TRANSFORMS_INSTMARKER_UNSAFEMULTIVERSION_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+class Module;
+
+class UnsafeMultiVersionPass : public PassInfoMixin<UnsafeMultiVersionPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
+};
+
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_INSTMARKER_UNSAFEMULTIVERSION_H
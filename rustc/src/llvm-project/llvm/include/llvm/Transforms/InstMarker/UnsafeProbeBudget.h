@@ -0,0 +1,40 @@
+//===-- UnsafeProbeBudget.h - Enforce probe-count budgets ------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file declares UnsafeProbeBudgetPass, scheduled after probe cleanup
+/// so it sees the probe set the binary will actually carry. It counts the
+/// probe sites the instrumentation passes planted, emits optimization
+/// remarks naming the probe-heaviest functions, and enforces the
+/// -unsafe-probe-budget limits — as a warning by default, as a compile
+/// failure under -unsafe-probe-budget-hard, so a probe explosion surfaces
+/// at build time instead of an hour into a benchmark run.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_INSTMARKER_UNSAFEPROBEBUDGET_H
+#define LLVM_TRANSFORMS_INSTMARKER_UNSAFEPROBEBUDGET_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+class Module;
+
+class UnsafeProbeBudgetPass : public PassInfoMixin<UnsafeProbeBudgetPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
+
+  /// \brief True when any -unsafe-probe-budget* limit is set; the pipeline
+  /// schedules the pass only then.
+  static bool budgetConfigured();
+};
+
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_INSTMARKER_UNSAFEPROBEBUDGET_H
@@ -0,0 +1,35 @@
+//===-- UnsafeProbeCleanup.h - Delete statically dead probes ---*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file declares UnsafeProbeCleanupPass, scheduled after the unsafe
+/// instrumentation passes. It deletes probe skeletons the build
+/// configuration makes statically dead — region markers in functions the
+/// -unsafe-instr-funcs filter excludes, and sample gates folded to constant
+/// false by -unsafe-instr-sample-rate=0 — so an un-probed function lowers
+/// to the same native code as an uninstrumented build.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_INSTMARKER_UNSAFEPROBECLEANUP_H
+#define LLVM_TRANSFORMS_INSTMARKER_UNSAFEPROBECLEANUP_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+class Module;
+
+class UnsafeProbeCleanupPass : public PassInfoMixin<UnsafeProbeCleanupPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
+};
+
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_INSTMARKER_UNSAFEPROBECLEANUP_H
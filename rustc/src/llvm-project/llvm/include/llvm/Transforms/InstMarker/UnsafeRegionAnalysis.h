@@ -0,0 +1,120 @@
+//===-- UnsafeRegionAnalysis.h - Locate marked unsafe regions -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file declares UnsafeRegionAnalysis, a function analysis that locates
+/// the unsafe regions delimited by InstMarkerPass's
+/// llvm.unsafe.region.begin/end markers once,
+/// so every downstream instrumentation pass can share the result instead of
+/// re-scanning the IR itself.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_INSTMARKER_UNSAFEREGIONANALYSIS_H
+#define LLVM_TRANSFORMS_INSTMARKER_UNSAFEREGIONANALYSIS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+class Function;
+class Instruction;
+
+/// \brief A begin/end marker pair delimiting one unsafe region.
+///
+/// Both markers lie in the same basic block; the region's instructions are
+/// those strictly between them.
+struct UnsafeRegion {
+  Instruction *Begin;
+  Instruction *End;
+};
+
+/// \brief Result of UnsafeRegionAnalysis.
+///
+/// Holds the function's paired unsafe regions plus constant-time marker
+/// classification, so consumer passes never scan for markers themselves.
+class UnsafeRegionInfo {
+public:
+  ArrayRef<UnsafeRegion> regions() const { return Regions; }
+
+  bool isBeginMarker(const Instruction *I) const {
+    return BeginMarkers.count(I);
+  }
+  bool isEndMarker(const Instruction *I) const { return EndMarkers.count(I); }
+
+  /// \brief Drop-in replacement for the isMarkerInstruction() helpers the
+  /// consumer passes used to duplicate: returns true for either marker kind
+  /// and reports which one via \p IsBegin / \p IsEnd.
+  bool isMarker(const Instruction &I, bool &IsBegin, bool &IsEnd) const {
+    IsBegin = isBeginMarker(&I);
+    IsEnd = isEndMarker(&I);
+    return IsBegin || IsEnd;
+  }
+
+private:
+  friend class UnsafeRegionAnalysis;
+
+  /// Paired regions only. A begin marker with no end marker in its block is
+  /// still classified by the marker sets but yields no region, matching the
+  /// pairing CpuCycleCountPass historically applied.
+  SmallVector<UnsafeRegion, 8> Regions;
+  SmallPtrSet<const Instruction *, 16> BeginMarkers;
+  SmallPtrSet<const Instruction *, 16> EndMarkers;
+};
+
+/// \brief Computes the unsafe-region list for a function in a single walk.
+///
+/// CpuCycleCountPass, HeapTrackerPass, UnsafeInstCounterPass and
+/// DynamicLineCountPass each used to re-scan every basic block looking for
+/// the region markers; they now query this analysis, so a pipeline running
+/// several unsafe passes walks the IR for markers only once per function.
+class UnsafeRegionAnalysis : public AnalysisInfoMixin<UnsafeRegionAnalysis> {
+  friend AnalysisInfoMixin<UnsafeRegionAnalysis>;
+  static AnalysisKey Key;
+
+public:
+  using Result = UnsafeRegionInfo;
+  Result run(Function &F, FunctionAnalysisManager &AM);
+
+  /// \brief The scan itself, independent of the analysis manager.
+  ///
+  /// Reads the IR without touching the LLVMContext, so callers that manage
+  /// their own threading (UnsafeProfilePass's parallel analysis phase) can
+  /// run it concurrently over distinct functions; the manager-cached path
+  /// above just wraps it.
+  static Result compute(Function &F);
+};
+
+/// \brief Checks that unsafe-region markers pair up, and repairs them.
+///
+/// InstMarkerPass emits balanced, same-block begin/end pairs, but every
+/// consumer assumes that invariant long after later transforms — block
+/// splitting, ThinLTO's import-and-inline path — have had a chance to break
+/// it, and a region spanning a block boundary is silently truncated by the
+/// per-block scans, undercounting everything downstream. This pass walks the
+/// CFG propagating the open-region state: regions left open across a block
+/// boundary are split into balanced per-block pairs (the default), or the
+/// compile fails fast under -unsafe-region-repair=0. Genuinely unmatched or
+/// nested markers are warned about either way. Statistics count how many
+/// regions spanned a boundary. Under -unsafe-legacy-asm-markers it first
+/// rewrites the retired pre-intrinsic inline-asm marker encoding, still
+/// found in old prelinked rlibs, into the intrinsics — the one remaining
+/// InlineAsm string path, kept off the default configuration entirely.
+class UnsafeRegionVerifierPass
+    : public PassInfoMixin<UnsafeRegionVerifierPass> {
+public:
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
+  static bool isRequired() { return true; }
+};
+
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_INSTMARKER_UNSAFEREGIONANALYSIS_H
@@ -0,0 +1,68 @@
+//===- UnsafeStatsFormat.h - Versioned unsafe_instr report format -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===-------------------------------------------------------------------------===//
+///
+/// \file
+/// One shared definition of the header line on the TSV tables and reports
+/// the unsafe instrumentation passes write (share, layout, density,
+/// region-mix, sidecars). The formats grow columns and row kinds over
+/// time, and a consumer fed a file from a newer toolchain used to find
+/// out by silently mis-merging; the header makes the mismatch detectable.
+///
+/// The header is the first line of the file:
+///
+///   #!unsafe-instr-stats<TAB>version<TAB>module-hash-hex
+///
+/// '#' never starts a data row in any of these formats, so pre-header
+/// files and pre-header consumers interoperate: old readers skip nothing
+/// they needed, and new readers treat a missing header as version 0.
+/// The module hash is the same ID-namespace qualifier the runtime tables
+/// carry (see getUnsafeModuleHash); files aggregated across modules
+/// write 0.
+///
+/// Bump UnsafeStatsFormatVersion when a change would make an old
+/// consumer mis-read existing columns — not when rows or columns are
+/// appended, which every consumer must tolerate regardless.
+///
+//===-------------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_INSTMARKER_UNSAFESTATSFORMAT_H
+#define LLVM_TRANSFORMS_INSTMARKER_UNSAFESTATSFORMAT_H
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace llvm {
+
+constexpr StringLiteral UnsafeStatsMagic = "#!unsafe-instr-stats";
+constexpr unsigned UnsafeStatsFormatVersion = 1;
+
+/// \brief Write the header line for a report covering the module whose
+/// content hash is \p ModuleHash (0 for cross-module aggregates).
+inline void writeUnsafeStatsHeader(raw_ostream &OS, uint64_t ModuleHash) {
+  OS << UnsafeStatsMagic << '\t' << UnsafeStatsFormatVersion << '\t'
+     << utohexstr(ModuleHash) << '\n';
+}
+
+/// \brief Recognize a header line and extract its version.
+///
+/// Returns false for data rows and for '#' lines that are not the header
+/// (callers skip those as metadata). A magic line whose version field
+/// does not parse reports version 0, same as no header at all.
+inline bool parseUnsafeStatsHeader(StringRef Line, unsigned &Version) {
+  if (!Line.consume_front(UnsafeStatsMagic))
+    return false;
+  Version = 0;
+  Line.consume_front("\t");
+  Line.take_until([](char C) { return C == '\t'; }).getAsInteger(10, Version);
+  return true;
+}
+
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_INSTMARKER_UNSAFESTATSFORMAT_H
@@ -15,8 +15,10 @@
 #ifndef LLVM_TRANSFORMS_UNSAFECOUNT_UNSAFEFUNCTIONTRACKER_H
 #define LLVM_TRANSFORMS_UNSAFECOUNT_UNSAFEFUNCTIONTRACKER_H
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/IR/PassManager.h"
 #include <cstdint>
+#include <vector>
 
 namespace llvm {
 
@@ -43,7 +45,28 @@ struct UnsafeFunctionTrackerPass : public PassInfoMixin<UnsafeFunctionTrackerPas
     uint8_t hasUnsafeRegions;
     uint16_t _padding;
   };
-  
+
+  /// \brief Return true if \p F should get an ID and instrumentation.
+  static bool shouldInstrument(const Function &F);
+
+  /// \brief Assign tracking IDs to \p Functions; the result is parallel to
+  /// the input.
+  ///
+  /// The default numbering is dense module order. Under
+  /// -unsafe-func-stable-ids the ID is instead a 20-bit hash of the mangled
+  /// name (collisions probed in sorted-name order), so IDs survive
+  /// recompilation and cross-build comparisons join on the integer rather
+  /// than re-keying by name strings.
+  static std::vector<uint32_t> assignFunctionIds(ArrayRef<Function *> Functions);
+
+  /// \brief Emit the metadata table, runtime registration ctor/dtor and the
+  /// entry-record call of every analyzed function.
+  ///
+  /// Split out of run() so UnsafeProfilePass can reuse it after its combined
+  /// analysis walk. \p Metadata and \p Functions are parallel.
+  static void emitTracking(Module &M, ArrayRef<FunctionMetadata> Metadata,
+                           ArrayRef<Function *> Functions);
+
   /// \brief Name of the metadata node storing function IDs
   static constexpr const char *FUNCTION_ID_METADATA = "unsafe_count.func_id";
 };
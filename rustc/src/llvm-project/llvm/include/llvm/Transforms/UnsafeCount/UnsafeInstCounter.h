@@ -15,26 +15,39 @@
 #ifndef LLVM_TRANSFORMS_UNSAFECOUNT_UNSAFEINSTCOUNTER_H
 #define LLVM_TRANSFORMS_UNSAFECOUNT_UNSAFEINSTCOUNTER_H
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/PassManager.h"
 #include <cstdint>
+#include <memory>
+#include <utility>
 
 namespace llvm {
 
 class Function;
 class BasicBlock;
+class DominatorTree;
 class Instruction;
+class PostDominatorTree;
+class UnsafeRegionInfo;
+class raw_fd_ostream;
 
 /// \brief Count unsafe instructions in functions.
 ///
 /// This pass instruments basic blocks to count unsafe instructions.
 /// It expects functions to already have ID metadata from UnsafeFunctionTracker.
 struct UnsafeInstCounterPass : public PassInfoMixin<UnsafeInstCounterPass> {
+  /// \brief \p EarlyPhase builds the -unsafe-instr-phase=both early
+  /// instance: it runs before any optimization, writes only the static
+  /// reports (their file names carry an ".early" marker), and never
+  /// mutates IR.
+  UnsafeInstCounterPass(bool EarlyPhase = false) : EarlyPhase(EarlyPhase) {}
+
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
   
   static bool isRequired() { return true; }
   static bool isPrimaryPackage();
-  
-private:
+
   /// \brief Categories of unsafe instructions
   enum UnsafeCategory : uint8_t {
     UNSAFE_LOAD = 0,
@@ -47,19 +60,110 @@ private:
   };
   
   /// \brief Counts for a basic block
+  ///
+  /// The unsafeElem* fields scale each vector instruction by its element
+  /// count, so a <8 x i64> load contributes 8 where unsafeCounts sees 1.
+  /// Both views are reported: the plain counts keep continuity with older
+  /// data, the element-scaled ones keep densities comparable when the
+  /// vectorizer widens one build but not another.
   struct BlockCounts {
     uint32_t totalInsts;
     uint32_t totalUnsafeInsts;
-    uint16_t unsafeCounts[MAX_UNSAFE_CATEGORIES];
-    
+    uint32_t totalUnsafeElems;
+    /// Per-category counts accumulate at full width in the pass; the
+    /// emitted table keeps compact u16 columns, saturating and spilling
+    /// the exact value to the overflow sidecar when a count exceeds them.
+    uint32_t unsafeCounts[MAX_UNSAFE_CATEGORIES];
+    uint32_t unsafeElemCounts[MAX_UNSAFE_CATEGORIES];
+    /// Static execution multiplier the runtime folds into the slot's
+    /// execution count at dump time: 1 normally, the loop's constant trip
+    /// count for blocks whose increment was hoisted to a preheader under
+    /// -unsafe-counter-loop-scale.
+    uint32_t execMultiplier;
+
     BlockCounts();
     bool hasInstructions() const { return totalInsts > 0; }
     bool hasUnsafeInstructions() const { return totalUnsafeInsts > 0; }
+
+    /// \brief Fold another block's counts into this one, for blocks that
+    /// share a counter slot.
+    void add(const BlockCounts &Other);
+
+    bool operator==(const BlockCounts &Other) const;
   };
-  
+
   static bool getUnsafeCategory(const Instruction &I, UnsafeCategory &category);
-  static BlockCounts analyzeBasicBlock(BasicBlock &BB);
+
+  /// \brief Analyze one basic block.
+  ///
+  /// When \p HasUnsafeMetadataInRegion is non-null it is set to true if the
+  /// block contains an in-region instruction carrying unsafe_inst metadata
+  /// (the criterion UnsafeFunctionTrackerPass classifies functions by), so
+  /// a combined caller needs no second walk.
+  static BlockCounts
+  analyzeBasicBlock(BasicBlock &BB, const UnsafeRegionInfo &Regions,
+                    bool *HasUnsafeMetadataInRegion = nullptr);
+
+  /// \brief True when -unsafe-counter-coalesce is set.
+  static bool coalesceEnabled();
+
+  /// \brief True when -unsafe-counter-report-dir is set: the pass writes
+  /// static per-function counts at compile time and emits no
+  /// instrumentation.
+  static bool reportOnlyEnabled();
+
+  /// \brief Merge analyzed blocks that provably execute the same number of
+  /// times, so each group keeps one counter slot and one summed table row.
+  static void coalesceEquivalentBlocks(
+      DominatorTree &DT, PostDominatorTree &PDT,
+      SmallVectorImpl<std::pair<BasicBlock *, BlockCounts>> &Blocks);
+
+  /// \brief True when -unsafe-counter-merge-diamonds is set.
+  static bool diamondMergeEnabled();
+
+  /// \brief True when -unsafe-counter-cold-suppress is set: with profile
+  /// data, functions PSI proves cold collapse to one summed row with a
+  /// single entry-block counter.
+  static bool coldSuppressEnabled();
+
+  /// \brief Peephole over the analyzed blocks: when every predecessor of a
+  /// join records identical counts and branches nowhere else, drop the
+  /// per-arm slots and record their shared row at the join, which executes
+  /// exactly as often as all arms together.
+  static void mergeDiamondRecords(
+      SmallVectorImpl<std::pair<BasicBlock *, BlockCounts>> &Blocks);
+
+  /// \brief One function's analyzed (and possibly coalesced) blocks.
+  using BlockList = SmallVector<std::pair<BasicBlock *, BlockCounts>, 16>;
+
+  /// \brief Emit the static count table, execution-counter array and
+  /// registration ctor for \p F's analyzed blocks.
+  static void
+  emitBlockCounts(Function &F, uint32_t FuncId,
+                  ArrayRef<std::pair<BasicBlock *, BlockCounts>> Blocks);
+
+  /// \brief Module-wide variant of emitBlockCounts for UnsafeProfilePass:
+  /// one table, one counter array and one registration ctor cover every
+  /// function's blocks. \p FuncIds and \p BlockLists are parallel.
+  static void emitModuleBlockCounts(Module &M, ArrayRef<uint32_t> FuncIds,
+                                    ArrayRef<BlockList> BlockLists);
+
   static uint32_t getFunctionId(Function &F);
+
+private:
+  /// Report-only mode (-unsafe-counter-report-dir): the per-module report
+  /// stream, opened when the first reported function of a module is seen and
+  /// replaced when the module changes.
+  Module *ReportModule = nullptr;
+  std::unique_ptr<raw_fd_ostream> ReportOS;
+
+  /// Region-mix report (-unsafe-region-mix-dir): same per-module stream
+  /// caching for the per-region instruction-mix histogram rows.
+  Module *MixModule = nullptr;
+  std::unique_ptr<raw_fd_ostream> MixOS;
+
+  /// Whether this is the early-position report-only instance.
+  bool EarlyPhase = false;
 };
 
 } // namespace llvm
@@ -0,0 +1,46 @@
+//===-- UnsafeInstrManifest.h - Instrumentation manifest -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Module pass that records what the unsafe instrumentation did — manifest
+/// version, effective flags, region counts and table hashes — into a custom
+/// object-file section. The pipeline driver can compare manifests across
+/// builds to skip rebuilds whose instrumentation inputs are unchanged, and
+/// llvm-readobj can audit what a binary was instrumented with.
+/// Must run after every other unsafe pass.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_UNSAFECOUNT_UNSAFEINSTRMANIFEST_H
+#define LLVM_TRANSFORMS_UNSAFECOUNT_UNSAFEINSTRMANIFEST_H
+
+#include "llvm/IR/PassManager.h"
+#include <cstdint>
+
+namespace llvm {
+
+/// \brief Emit the per-module unsafe instrumentation manifest section.
+class UnsafeInstrManifestPass : public PassInfoMixin<UnsafeInstrManifestPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
+
+  static bool isRequired() { return true; }
+  static bool isPrimaryPackage();
+
+  /// Bump whenever any unsafe pass changes its emitted artifacts or their
+  /// meaning, so cached objects built by an older pass suite never compare
+  /// equal to current ones.
+  static constexpr uint32_t MANIFEST_VERSION = 1;
+
+  /// Section the manifest blob is placed in.
+  static constexpr const char *SECTION_NAME = ".unsafe_instr_manifest";
+};
+
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_UNSAFECOUNT_UNSAFEINSTRMANIFEST_H
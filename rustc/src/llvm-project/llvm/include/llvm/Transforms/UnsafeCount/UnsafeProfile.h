@@ -0,0 +1,41 @@
+//===-- UnsafeProfile.h - Combined unsafe function/block profiling -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Module pass combining UnsafeFunctionTracker and UnsafeInstCounter into one
+/// scheduling unit: IDs are assigned and blocks counted in a single walk.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_UNSAFECOUNT_UNSAFEPROFILE_H
+#define LLVM_TRANSFORMS_UNSAFECOUNT_UNSAFEPROFILE_H
+
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+
+class Module;
+
+/// \brief Combined function tracking and instruction counting.
+///
+/// Scheduled instead of UnsafeFunctionTrackerPass plus the
+/// UnsafeInstCounterPass adaptor when both are enabled: one walk per
+/// function assigns the ID, classifies the function and gathers its block
+/// counts, then the two passes' emission helpers produce the same
+/// instrumentation and runtime registration as before. The standalone
+/// passes remain available for running either half alone.
+struct UnsafeProfilePass : public PassInfoMixin<UnsafeProfilePass> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
+
+  static bool isRequired() { return true; }
+  static bool isPrimaryPackage();
+};
+
+} // namespace llvm
+
+#endif
@@ -2540,6 +2540,19 @@ CallAnalyzer::analyzeBlock(BasicBlock *BB,
     if (I.isDebugOrPseudoInst())
       continue;
 
+    // UNSAFE-RUST BEGIN
+    // Unsafe-region markers are measurement scaffolding, dropped by codegen.
+    // Left visible here they would both pay call cost and disable load
+    // elimination, making instrumented builds inline differently from the
+    // native builds they are compared against.
+    if (auto *II = dyn_cast<IntrinsicInst>(&I)) {
+      Intrinsic::ID ID = II->getIntrinsicID();
+      if (ID == Intrinsic::unsafe_region_begin ||
+          ID == Intrinsic::unsafe_region_end)
+        continue;
+    }
+    // UNSAFE-RUST END
+
     // Skip ephemeral values.
     if (EphValues.count(&I))
       continue;
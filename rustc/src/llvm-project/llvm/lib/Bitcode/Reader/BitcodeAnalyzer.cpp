@@ -328,6 +328,9 @@ GetCodeName(unsigned CodeID, unsigned BlockID,
     default:
       return std::nullopt;
       STRINGIFY_CODE(METADATA, ATTACHMENT)
+      // UNSAFE-RUST BEGIN
+      STRINGIFY_CODE(METADATA, ATTACHMENT_INTERVALS)
+      // UNSAFE-RUST END
     }
   case bitc::METADATA_BLOCK_ID:
     switch (CodeID) {
@@ -2406,6 +2406,39 @@ Error MetadataLoader::MetadataLoaderImpl::parseMetadataAttachment(
       }
       break;
     }
+    // UNSAFE-RUST BEGIN
+    case bitc::METADATA_ATTACHMENT_INTERVALS: {
+      // [kind, mdnode, n x (start, length)]: the writer's compact form for
+      // boolean instruction tags (-bitcode-compact-unsafe-md). Expand back
+      // to ordinary per-instruction attachments.
+      if (Record.size() < 4 || (Record.size() - 2) % 2 != 0)
+        return error("Invalid record");
+      auto KindIt = MDKindMap.find(Record[0]);
+      if (KindIt == MDKindMap.end())
+        return error("Invalid ID");
+
+      auto Idx = Record[1];
+      if (Idx < (MDStringRef.size() + GlobalMetadataBitPosIndex.size()) &&
+          !MetadataList.lookup(Idx)) {
+        lazyLoadOneMetadata(Idx, Placeholders);
+        resolveForwardRefsAndPlaceholders(Placeholders);
+      }
+      MDNode *MD =
+          dyn_cast_or_null<MDNode>(MetadataList.getMetadataFwdRef(Idx));
+      if (!MD)
+        return error("Invalid metadata attachment");
+
+      for (unsigned i = 2, e = Record.size(); i != e; i += 2) {
+        uint64_t Start = Record[i], Len = Record[i + 1];
+        if (Start > InstructionList.size() ||
+            Len > InstructionList.size() - Start)
+          return error("Invalid record");
+        for (uint64_t K = 0; K != Len; ++K)
+          InstructionList[Start + K]->setMetadata(KindIt->second, MD);
+      }
+      break;
+    }
+    // UNSAFE-RUST END
     }
   }
 }
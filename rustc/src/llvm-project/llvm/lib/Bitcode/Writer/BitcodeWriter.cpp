@@ -16,6 +16,7 @@
 #include "llvm/ADT/APInt.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/MapVector.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/SmallPtrSet.h"
@@ -95,6 +96,22 @@ static cl::opt<bool> WriteRelBFToSummary(
     "write-relbf-to-summary", cl::Hidden, cl::init(false),
     cl::desc("Write relative block frequency to function summary "));
 
+// UNSAFE-RUST BEGIN
+// Instrumented modules attach the same boolean unsafe_inst node to tens of
+// thousands of instructions, and one [instr, kind, mdnode] attachment
+// record apiece bloats embedded bitcode and slows every ThinLTO import.
+// Under this flag the writer folds those attachments into one interval
+// record per (kind, node) pair — [kind, mdnode, n x (start, length)] over
+// instruction IDs — and the reader expands it back on load. Off by
+// default: a reader without the matching record support silently drops
+// the compacted attachments, so only toolchains carrying both sides
+// should enable it.
+static cl::opt<bool> BitcodeCompactUnsafeMD(
+    "bitcode-compact-unsafe-md", cl::Hidden, cl::init(false),
+    cl::desc("Encode unsafe_inst metadata attachments as per-function "
+             "interval records instead of per-instruction entries"));
+// UNSAFE-RUST END
+
 namespace llvm {
 extern FunctionSummary::ForceSummaryHotnessType ForceSummaryEdgesCold;
 }
@@ -2440,6 +2457,13 @@ void ModuleBitcodeWriter::writeFunctionMetadataAttachment(const Function &F) {
   // Write metadata attachments
   // METADATA_ATTACHMENT - [m x [value, [n x [id, mdnode]]]
   SmallVector<std::pair<unsigned, MDNode *>, 4> MDs;
+  // UNSAFE-RUST BEGIN
+  // Interval-compacted attachments (-bitcode-compact-unsafe-md): the
+  // instruction IDs carrying each unsafe_inst node, collected here and
+  // emitted as one record per node after the walk. MapVector keeps the
+  // record order deterministic.
+  MapVector<MDNode *, SmallVector<uint64_t, 16>> CompactAttachments;
+  // UNSAFE-RUST END
   for (const BasicBlock &BB : F)
     for (const Instruction &I : BB) {
       MDs.clear();
@@ -2451,13 +2475,52 @@ void ModuleBitcodeWriter::writeFunctionMetadataAttachment(const Function &F) {
       Record.push_back(VE.getInstructionID(&I));
 
       for (unsigned i = 0, e = MDs.size(); i != e; ++i) {
+        // UNSAFE-RUST BEGIN
+        if (BitcodeCompactUnsafeMD &&
+            MDs[i].first == LLVMContext::MD_unsafe_inst) {
+          CompactAttachments[MDs[i].second].push_back(VE.getInstructionID(&I));
+          continue;
+        }
+        // UNSAFE-RUST END
         Record.push_back(MDs[i].first);
         Record.push_back(VE.getMetadataID(MDs[i].second));
       }
-      Stream.EmitRecord(bitc::METADATA_ATTACHMENT, Record, 0);
+      // UNSAFE-RUST BEGIN
+      // All of this instruction's attachments may have been compacted
+      // away; a bare instruction ID is not a valid record.
+      if (Record.size() > 1)
+        Stream.EmitRecord(bitc::METADATA_ATTACHMENT, Record, 0);
+      // UNSAFE-RUST END
       Record.clear();
     }
 
+  // UNSAFE-RUST BEGIN
+  // METADATA_ATTACHMENT_INTERVALS - [kind, mdnode, n x (start, length)].
+  // The IDs were collected in block order, which is ascending ID order, so
+  // the run-length encoding falls out of a single walk; unsafe
+  // instructions cluster, so a handful of runs covers thousands of
+  // attachments.
+  for (auto &[Node, Ids] : CompactAttachments) {
+    Record.push_back(LLVMContext::MD_unsafe_inst);
+    Record.push_back(VE.getMetadataID(Node));
+    uint64_t Start = Ids[0], Len = 1;
+    for (size_t K = 1, E = Ids.size(); K != E; ++K) {
+      if (Ids[K] == Start + Len) {
+        ++Len;
+        continue;
+      }
+      Record.push_back(Start);
+      Record.push_back(Len);
+      Start = Ids[K];
+      Len = 1;
+    }
+    Record.push_back(Start);
+    Record.push_back(Len);
+    Stream.EmitRecord(bitc::METADATA_ATTACHMENT_INTERVALS, Record, 0);
+    Record.clear();
+  }
+  // UNSAFE-RUST END
+
   Stream.ExitBlock();
 }
 
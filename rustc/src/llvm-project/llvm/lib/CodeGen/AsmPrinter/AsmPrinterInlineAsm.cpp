@@ -27,6 +27,7 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/MC/MCAsmInfo.h"
+#include "llvm/MC/MCInst.h"
 #include "llvm/MC/MCInstrInfo.h"
 #include "llvm/MC/MCParser/MCAsmLexer.h"
 #include "llvm/MC/MCParser/MCTargetAsmParser.h"
@@ -42,6 +43,48 @@ using namespace llvm;
 
 #define DEBUG_TYPE "asm-printer"
 
+// UNSAFE-RUST BEGIN
+namespace {
+/// Captures the instructions an inline-asm parse emits so a marker blob's
+/// MCInst can be cached in the MCContext and replayed. Any emission other
+/// than a plain instruction (label, directive, raw text, data) marks the
+/// parse non-replayable and the caller falls back to the normal path.
+class MarkerAsmRecorder : public MCStreamer {
+public:
+  SmallVector<MCInst, 1> Insts;
+  bool SawOther = false;
+
+  MarkerAsmRecorder(MCContext &Context) : MCStreamer(Context) {}
+
+  void emitInstruction(const MCInst &Inst, const MCSubtargetInfo &) override {
+    Insts.push_back(Inst);
+  }
+  void emitLabel(MCSymbol *Symbol, SMLoc Loc = SMLoc()) override {
+    SawOther = true;
+  }
+  bool hasRawTextSupport() const override { return true; }
+  void emitRawTextImpl(StringRef String) override { SawOther = true; }
+  void emitBytes(StringRef Data) override { SawOther = true; }
+  void emitValueImpl(const MCExpr *Value, unsigned Size, SMLoc Loc) override {
+    SawOther = true;
+  }
+  bool emitSymbolAttribute(MCSymbol *Symbol, MCSymbolAttr Attribute) override {
+    SawOther = true;
+    return true;
+  }
+  void emitCommonSymbol(MCSymbol *Symbol, uint64_t Size,
+                        Align ByteAlignment) override {
+    SawOther = true;
+  }
+  void emitZerofill(MCSection *Section, MCSymbol *Symbol = nullptr,
+                    uint64_t Size = 0, Align ByteAlignment = Align(1),
+                    SMLoc Loc = SMLoc()) override {
+    SawOther = true;
+  }
+};
+} // end anonymous namespace
+// UNSAFE-RUST END
+
 unsigned AsmPrinter::addInlineAsmDiagBuffer(StringRef AsmStr,
                                             const MDNode *LocMDNode) const {
   MCContext &Context = MMI->getContext();
@@ -95,12 +138,46 @@ void AsmPrinter::emitInlineAsm(StringRef Str, const MCSubtargetInfo &STI,
     return;
   }
 
+  // UNSAFE-RUST BEGIN
+  // Marker-only instrumented builds can carry thousands of identical
+  // "nop # marker_begin"/"nop # marker_end" blobs (rlibs built before the
+  // unsafe_region intrinsics), and each would pay the full AsmParser round
+  // trip below. The blobs lower to exactly one instruction with no labels
+  // or directives, so the first parse's MCInst is replayable: it is cached
+  // in the MCContext keyed by string, dialect and subtarget CPU, and later
+  // occurrences are emitted directly.
+  bool CacheableMarker =
+      Str == "nop # marker_begin" || Str == "nop # marker_end";
+  SmallString<64> MarkerKey;
+  if (CacheableMarker) {
+    MarkerKey += Str;
+    MarkerKey += '\0';
+    MarkerKey += char('0' + Dialect);
+    MarkerKey += STI.getCPU();
+    if (const MCInst *Cached = OutContext.lookupUnsafeMarkerAsm(MarkerKey)) {
+      emitInlineAsmStart();
+      OutStreamer->emitInstruction(*Cached, STI);
+      emitInlineAsmEnd(STI, nullptr);
+      return;
+    }
+  }
+  // UNSAFE-RUST END
+
   unsigned BufNum = addInlineAsmDiagBuffer(Str, LocMDNode);
   SourceMgr &SrcMgr = *MMI->getContext().getInlineSourceManager();
   SrcMgr.setIncludeDirs(MCOptions.IASSearchPaths);
 
-  std::unique_ptr<MCAsmParser> Parser(
-      createMCAsmParser(SrcMgr, OutContext, *OutStreamer, *MAI, BufNum));
+  // UNSAFE-RUST BEGIN
+  // On a marker cache miss the blob is parsed into a recording streamer:
+  // the captured instruction seeds the cache and is re-emitted to the real
+  // streamer, so the blob is still assembled exactly once.
+  std::unique_ptr<MarkerAsmRecorder> Recorder;
+  if (CacheableMarker)
+    Recorder = std::make_unique<MarkerAsmRecorder>(OutContext);
+
+  std::unique_ptr<MCAsmParser> Parser(createMCAsmParser(
+      SrcMgr, OutContext, Recorder ? *Recorder : *OutStreamer, *MAI, BufNum));
+  // UNSAFE-RUST END
 
   // Do not use assembler-level information for parsing inline assembly.
   OutStreamer->setUseAssemblerInfoForParsing(false);
@@ -127,6 +204,29 @@ void AsmPrinter::emitInlineAsm(StringRef Str, const MCSubtargetInfo &STI,
   // Don't implicitly switch to the text section before the asm.
   (void)Parser->Run(/*NoInitialTextSection*/ true,
                     /*NoFinalize*/ true);
+  // UNSAFE-RUST BEGIN
+  if (Recorder) {
+    if (!Recorder->SawOther) {
+      if (Recorder->Insts.size() == 1)
+        OutContext.cacheUnsafeMarkerAsm(MarkerKey, Recorder->Insts[0]);
+      for (const MCInst &Inst : Recorder->Insts)
+        OutStreamer->emitInstruction(Inst, STI);
+    } else {
+      // The blob emitted something other than plain instructions; replay
+      // it through the normal path so nothing is dropped, and leave it
+      // uncached.
+      unsigned RetryBufNum = addInlineAsmDiagBuffer(Str, LocMDNode);
+      std::unique_ptr<MCAsmParser> RetryParser(createMCAsmParser(
+          SrcMgr, OutContext, *OutStreamer, *MAI, RetryBufNum));
+      std::unique_ptr<MCTargetAsmParser> RetryTAP(
+          TM.getTarget().createMCAsmParser(STI, *RetryParser, *MII, MCOptions));
+      RetryParser->setAssemblerDialect(Dialect);
+      RetryParser->setTargetParser(*RetryTAP);
+      (void)RetryParser->Run(/*NoInitialTextSection*/ true,
+                             /*NoFinalize*/ true);
+    }
+  }
+  // UNSAFE-RUST END
   emitInlineAsmEnd(STI, &TAP->getSTI());
 }
 
@@ -358,6 +358,7 @@ void FunctionLoweringInfo::clear() {
   PreferredExtendType.clear();
   PreprocessedDbgDeclares.clear();
   PreprocessedDPVDeclares.clear();
+  UnsafeRegionLabelOrdinal = 0;
 }
 
 /// CreateReg - Allocate a single virtual register for the given type.
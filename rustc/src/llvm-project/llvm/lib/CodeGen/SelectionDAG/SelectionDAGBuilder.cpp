@@ -128,6 +128,17 @@ static cl::opt<unsigned, true>
                      cl::location(LimitFloatPrecision), cl::Hidden,
                      cl::init(0));
 
+// Marker-only builds (coverage configurations that run just
+// -enable-instmarker) otherwise discard surviving unsafe region markers
+// outright, leaving no trace of the region boundaries in the binary. Under
+// this flag each surviving marker lowers to a zero-size label instead
+// (ANNOTATION_LABEL, emitted like a debug label), so the symbol table
+// carries the boundaries at zero runtime cost.
+static cl::opt<bool> UnsafeMarkerLabels(
+    "unsafe-marker-labels", cl::Hidden, cl::init(false),
+    cl::desc("Lower surviving unsafe region markers to zero-size labels "
+             "instead of discarding them"));
+
 static cl::opt<unsigned> SwitchPeelThreshold(
     "switch-peel-threshold", cl::Hidden, cl::init(66),
     cl::desc("Set the case probability threshold for peeling the case from a "
@@ -3155,6 +3166,8 @@ void SelectionDAGBuilder::visitInvoke(const InvokeInst &I) {
     case Intrinsic::seh_scope_begin:
     case Intrinsic::seh_try_end:
     case Intrinsic::seh_scope_end:
+    case Intrinsic::unsafe_region_begin:
+    case Intrinsic::unsafe_region_end:
       if (EHPadMBB)
           // a block referenced by EH table
           // so dtor-funclet not removed by opts
@@ -7235,6 +7248,22 @@ void SelectionDAGBuilder::visitIntrinsicCall(const CallInst &I,
   case Intrinsic::seh_scope_end:
     // ignore
     return;
+  case Intrinsic::unsafe_region_begin:
+  case Intrinsic::unsafe_region_end: {
+    // Markers no instrumentation pass consumed vanish by default; under
+    // -unsafe-marker-labels they pin a zero-size label so marker-only
+    // builds keep the region boundaries in the symbol table.
+    if (!UnsafeMarkerLabels)
+      return;
+    MachineFunction &MF = DAG.getMachineFunction();
+    bool IsBegin = Intrinsic == Intrinsic::unsafe_region_begin;
+    MCSymbol *Label = MF.getContext().getOrCreateSymbol(
+        Twine("__unsafe_region_") + (IsBegin ? "begin" : "end") + "." +
+        MF.getName() + "." + Twine(FuncInfo.UnsafeRegionLabelOrdinal++));
+    DAG.setRoot(
+        DAG.getLabelNode(ISD::ANNOTATION_LABEL, sdl, getRoot(), Label));
+    return;
+  }
   case Intrinsic::experimental_stackmap:
     visitStackmap(I);
     return;
@@ -48,6 +48,9 @@
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils.h"
+// UNSAFE-RUST BEGIN
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+// UNSAFE-RUST END
 #include <cassert>
 #include <optional>
 #include <string>
@@ -1258,6 +1261,13 @@ void TargetPassConfig::addMachinePasses() {
 
   PM->add(createStackFrameLayoutAnalysisPass());
 
+  // UNSAFE-RUST BEGIN
+  // Static probe cost audit: runs after every layout pass so the per-probe
+  // counts reflect what is actually emitted.
+  if (unsafeProbeAuditEnabled())
+    addPass(createUnsafeProbeAuditPass());
+  // UNSAFE-RUST END
+
   // Add passes that directly emit MI after all other MI passes.
   addPreEmitPass2();
 
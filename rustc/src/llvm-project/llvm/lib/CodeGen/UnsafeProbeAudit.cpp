@@ -0,0 +1,224 @@
+//===-- UnsafeProbeAudit.cpp - Static probe cost audit --------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Late machine pass behind -unsafe-probe-audit that reports what each
+/// instrumentation probe costs after lowering: the machine instructions
+/// attributable to it and their scheduler-estimated cycles.
+///
+/// IR metadata does not survive instruction selection, so probes are found
+/// again here by their anchors — calls to the known runtime hook symbols,
+/// the rdtsc/rdtscp/rdpmc inline-asm reads, and memory operations on the
+/// instrumentation's own globals (block execution counters, sampling
+/// countdowns, dormant-probe enable bytes). A call additionally absorbs the
+/// contiguous run of preceding instructions that only feed its argument
+/// registers. Probe ordinals follow final block layout, so they line up
+/// with the IR-side unsafe_probe_id stamps except where codegen moved
+/// blocks; family and per-function totals always join.
+///
+//===----------------------------------------------------------------------===//
+
+#include "llvm/CodeGen/MachineFunction.h"
+#include "llvm/CodeGen/MachineFunctionPass.h"
+#include "llvm/CodeGen/MachineInstr.h"
+#include "llvm/CodeGen/Passes.h"
+#include "llvm/CodeGen/TargetRegisterInfo.h"
+#include "llvm/CodeGen/TargetSchedule.h"
+#include "llvm/CodeGen/TargetSubtargetInfo.h"
+#include "llvm/IR/GlobalValue.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "unsafe-probe-audit"
+
+namespace {
+
+/// Known runtime hook prefixes and the probe family each belongs to.
+struct HookFamily {
+  StringRef Prefix;
+  StringRef Family;
+};
+
+constexpr HookFamily CallFamilies[] = {
+    {"cpu_cycle_", "cycle"},
+    {"dyn_mem_access", "heap"},
+    {"dyn_unsafe_mem_access", "heap"},
+    {"heap_tracker_", "heap"},
+    {"alloc_tracker_", "alloc"},
+    {"__unsafe_record_function", "func"},
+    {"track_unsafe_line_execution", "lines"},
+};
+
+/// Instrumentation-owned globals whose loads/stores are probe overhead even
+/// though no call is involved.
+constexpr HookFamily GlobalFamilies[] = {
+    {"__unsafe_block_execs", "counter"},
+    {"__unsafe_instr_sample_countdown", "sample"},
+    {"__unsafe_instr_hot_sample_countdown", "sample"},
+    {"__unsafe_probe_enable_", "gate"},
+};
+
+class UnsafeProbeAudit : public MachineFunctionPass {
+public:
+  static char ID;
+
+  UnsafeProbeAudit() : MachineFunctionPass(ID) {
+    initializeUnsafeProbeAuditPass(*PassRegistry::getPassRegistry());
+  }
+
+  bool runOnMachineFunction(MachineFunction &MF) override;
+
+  StringRef getPassName() const override { return "Unsafe Probe Audit"; }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.setPreservesAll();
+    MachineFunctionPass::getAnalysisUsage(AU);
+  }
+};
+
+/// \brief The probe family \p MI anchors, or an empty StringRef.
+StringRef classifyAnchor(const MachineInstr &MI) {
+  if (MI.isCall()) {
+    for (const MachineOperand &MO : MI.operands()) {
+      StringRef Name;
+      if (MO.isGlobal())
+        Name = MO.getGlobal()->getName();
+      else if (MO.isSymbol())
+        Name = MO.getSymbolName();
+      else
+        continue;
+      for (const HookFamily &HF : CallFamilies)
+        if (Name.startswith(HF.Prefix))
+          return HF.Family;
+    }
+    return StringRef();
+  }
+
+  if (MI.isInlineAsm()) {
+    // The inline cycle probes read the counter through asm.
+    StringRef Asm =
+        MI.getOperand(InlineAsm::MIOp_AsmString).getSymbolName();
+    if (Asm.contains("rdtsc") || Asm.contains("rdpmc"))
+      return "cycle";
+    return StringRef();
+  }
+
+  for (const MachineOperand &MO : MI.operands()) {
+    if (!MO.isGlobal())
+      continue;
+    StringRef Name = MO.getGlobal()->getName();
+    for (const HookFamily &HF : GlobalFamilies)
+      if (Name.startswith(HF.Prefix))
+        return HF.Family;
+  }
+  return StringRef();
+}
+
+/// \brief Count \p Call plus the contiguous preceding instructions that
+/// only feed its argument registers, accumulating their estimated latency.
+///
+/// Post-RA the argument values sit in physical registers the call lists as
+/// implicit uses; walking backwards while every def lands in that (growing)
+/// set attributes the setup code without target-specific knowledge. The
+/// walk is capped and stops at anything with side effects, so at worst it
+/// under-counts.
+unsigned attributeCall(const MachineInstr &Call, const TargetRegisterInfo &TRI,
+                       TargetSchedModel &SchedModel, unsigned &Cycles) {
+  SmallVector<Register, 8> Wanted;
+  for (const MachineOperand &MO : Call.operands())
+    if (MO.isReg() && MO.isUse() && MO.getReg().isPhysical())
+      Wanted.push_back(MO.getReg());
+
+  unsigned Instrs = 1;
+  Cycles += SchedModel.computeInstrLatency(&Call);
+
+  MachineBasicBlock::const_reverse_iterator It(Call.getIterator());
+  const MachineBasicBlock *MBB = Call.getParent();
+  unsigned Budget = 16;
+  for (++It; It != MBB->rend() && Budget; ++It, --Budget) {
+    const MachineInstr &MI = *It;
+    if (MI.isCall() || MI.isTerminator() || MI.isInlineAsm() ||
+        MI.mayStore() || MI.hasUnmodeledSideEffects())
+      break;
+    bool AllDefsWanted = MI.getNumDefs() > 0;
+    for (const MachineOperand &MO : MI.operands()) {
+      if (!MO.isReg() || !MO.isDef() || MO.isDead())
+        continue;
+      bool Overlaps = false;
+      for (Register R : Wanted)
+        if (TRI.regsOverlap(MO.getReg(), R)) {
+          Overlaps = true;
+          break;
+        }
+      if (!Overlaps) {
+        AllDefsWanted = false;
+        break;
+      }
+    }
+    if (!AllDefsWanted)
+      break;
+    ++Instrs;
+    Cycles += SchedModel.computeInstrLatency(&MI);
+    for (const MachineOperand &MO : MI.operands())
+      if (MO.isReg() && MO.isUse() && MO.getReg().isPhysical())
+        Wanted.push_back(MO.getReg());
+  }
+  return Instrs;
+}
+
+bool UnsafeProbeAudit::runOnMachineFunction(MachineFunction &MF) {
+  if (!unsafeProbeAuditEnabled())
+    return false;
+
+  const TargetRegisterInfo &TRI = *MF.getSubtarget().getRegisterInfo();
+  TargetSchedModel SchedModel;
+  SchedModel.init(&MF.getSubtarget());
+
+  unsigned Ordinal = 0;
+  unsigned TotalInstrs = 0;
+  unsigned TotalCycles = 0;
+
+  for (const MachineBasicBlock &MBB : MF) {
+    for (const MachineInstr &MI : MBB) {
+      StringRef Family = classifyAnchor(MI);
+      if (Family.empty())
+        continue;
+      unsigned Cycles = 0;
+      unsigned Instrs =
+          MI.isCall() ? attributeCall(MI, TRI, SchedModel, Cycles) : 1;
+      if (!MI.isCall())
+        Cycles = SchedModel.computeInstrLatency(&MI);
+      errs() << "unsafe-probe-audit\t" << MF.getName() << '\t' << Family
+             << '\t' << Ordinal << '\t' << Instrs << '\t' << Cycles << '\n';
+      ++Ordinal;
+      TotalInstrs += Instrs;
+      TotalCycles += Cycles;
+    }
+  }
+
+  if (Ordinal)
+    errs() << "unsafe-probe-audit\t" << MF.getName() << "\ttotal\t" << Ordinal
+           << '\t' << TotalInstrs << '\t' << TotalCycles << '\n';
+  return false;
+}
+
+} // end anonymous namespace
+
+char UnsafeProbeAudit::ID = 0;
+
+INITIALIZE_PASS(UnsafeProbeAudit, DEBUG_TYPE,
+                "Report per-probe machine instruction and cycle estimates",
+                false, false)
+
+FunctionPass *llvm::createUnsafeProbeAuditPass() {
+  return new UnsafeProbeAudit();
+}
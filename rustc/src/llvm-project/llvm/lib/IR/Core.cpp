@@ -4284,6 +4284,22 @@ void LLVMSetInstUnsafeMetadata(LLVMValueRef Inst) {
   LLVMContext &C = I->getContext();
   MDString *unsafe_inst_mdstr = MDString::get(C, "instruction in unsafe Rust fn or block");
   MDNode *unsafe_inst_mdnode = MDNode::get(C, unsafe_inst_mdstr);
-  I->setMetadata("unsafe_inst", unsafe_inst_mdnode);
+  I->setMetadata(LLVMContext::MD_unsafe_inst, unsafe_inst_mdnode);
+}
+
+void LLVMSetInstsUnsafeMetadata(LLVMValueRef *Insts, unsigned Count) {
+  // Batched form of LLVMSetInstUnsafeMetadata: one boundary crossing per
+  // function instead of per instruction, and the shared (uniqued) node is
+  // built and hash-looked-up once instead of once per call. The tag is the
+  // same node the single-instruction entry point attaches.
+  if (Count == 0)
+    return;
+  LLVMContext &C = unwrap<Instruction>(Insts[0])->getContext();
+  MDString *unsafe_inst_mdstr =
+      MDString::get(C, "instruction in unsafe Rust fn or block");
+  MDNode *unsafe_inst_mdnode = MDNode::get(C, unsafe_inst_mdstr);
+  for (unsigned Idx = 0; Idx < Count; ++Idx)
+    unwrap<Instruction>(Insts[Idx])->setMetadata(LLVMContext::MD_unsafe_inst,
+                                                 unsafe_inst_mdnode);
 }
 // UNSAFE-RUST END
\ No newline at end of file
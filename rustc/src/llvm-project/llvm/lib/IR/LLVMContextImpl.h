@@ -1590,6 +1590,21 @@ public:
   /// Collection of metadata used in this context.
   DenseMap<const Value *, MDAttachments> ValueMetadata;
 
+  // UNSAFE-RUST BEGIN
+  /// Values carrying the canonical unsafe_inst tag. Instrumented builds
+  /// attach that one uniqued boolean node to a large fraction of all
+  /// instructions; a full MDAttachments entry apiece costs ~56 bytes and a
+  /// hash-plus-scan per query, so Value::setMetadata stores canonical
+  /// attachments as bare membership here instead. Non-canonical nodes
+  /// under the kind still live in ValueMetadata.
+  DenseSet<const Value *> CompactUnsafeInstTagged;
+
+  /// Lazily created cache of the node the compact entries stand for; see
+  /// unsafeInstCanonicalTag() in Metadata.cpp. Uniqued nodes are owned by
+  /// the context, so the cached pointer never dangles.
+  MDNode *UnsafeInstCanonicalTag = nullptr;
+  // UNSAFE-RUST END
+
   /// Map DIAssignID -> Instructions with that attachment.
   /// Managed by Instruction via Instruction::updateDIAssignIDMapping.
   /// Query using the at:: functions defined in DebugInfo.h.
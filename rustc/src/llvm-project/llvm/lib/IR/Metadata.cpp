@@ -1443,6 +1443,19 @@ bool MDAttachments::erase(unsigned ID) {
   return OldSize != Attachments.size();
 }
 
+// UNSAFE-RUST BEGIN
+/// The node every producer attaches under unsafe_inst, lazily created and
+/// cached so compact tag queries can return it without touching the
+/// attachment map. Uniqued nodes are owned by the context, so the cached
+/// pointer stays valid for the context's lifetime.
+static MDNode *unsafeInstCanonicalTag(LLVMContext &Ctx) {
+  if (!Ctx.pImpl->UnsafeInstCanonicalTag)
+    Ctx.pImpl->UnsafeInstCanonicalTag = MDNode::get(
+        Ctx, MDString::get(Ctx, "instruction in unsafe Rust fn or block"));
+  return Ctx.pImpl->UnsafeInstCanonicalTag;
+}
+// UNSAFE-RUST END
+
 MDNode *Value::getMetadata(StringRef Kind) const {
   if (!hasMetadata())
     return nullptr;
@@ -1452,13 +1465,32 @@ MDNode *Value::getMetadata(StringRef Kind) const {
 
 MDNode *Value::getMetadataImpl(unsigned KindID) const {
   const LLVMContext &Ctx = getContext();
-  const MDAttachments &Attachements = Ctx.pImpl->ValueMetadata.at(this);
-  return Attachements.lookup(KindID);
+  // UNSAFE-RUST BEGIN
+  if (KindID == LLVMContext::MD_unsafe_inst &&
+      Ctx.pImpl->CompactUnsafeInstTagged.count(this))
+    return unsafeInstCanonicalTag(getContext());
+  // A compact-tagged value may have no entry in the attachment map at all.
+  auto It = Ctx.pImpl->ValueMetadata.find(this);
+  if (It == Ctx.pImpl->ValueMetadata.end())
+    return nullptr;
+  return It->second.lookup(KindID);
+  // UNSAFE-RUST END
 }
 
 void Value::getMetadata(unsigned KindID, SmallVectorImpl<MDNode *> &MDs) const {
-  if (hasMetadata())
-    getContext().pImpl->ValueMetadata.at(this).get(KindID, MDs);
+  if (!hasMetadata())
+    return;
+  // UNSAFE-RUST BEGIN
+  LLVMContextImpl *PImpl = getContext().pImpl;
+  if (KindID == LLVMContext::MD_unsafe_inst &&
+      PImpl->CompactUnsafeInstTagged.count(this)) {
+    MDs.push_back(unsafeInstCanonicalTag(getContext()));
+    return;
+  }
+  auto It = PImpl->ValueMetadata.find(this);
+  if (It != PImpl->ValueMetadata.end())
+    It->second.get(KindID, MDs);
+  // UNSAFE-RUST END
 }
 
 void Value::getMetadata(StringRef Kind, SmallVectorImpl<MDNode *> &MDs) const {
@@ -1469,39 +1501,72 @@ void Value::getMetadata(StringRef Kind, SmallVectorImpl<MDNode *> &MDs) const {
 void Value::getAllMetadata(
     SmallVectorImpl<std::pair<unsigned, MDNode *>> &MDs) const {
   if (hasMetadata()) {
-    assert(getContext().pImpl->ValueMetadata.count(this) &&
+    // UNSAFE-RUST BEGIN
+    LLVMContextImpl *PImpl = getContext().pImpl;
+    assert((PImpl->ValueMetadata.count(this) ||
+            PImpl->CompactUnsafeInstTagged.count(this)) &&
            "bit out of sync with hash table");
-    const MDAttachments &Info = getContext().pImpl->ValueMetadata.at(this);
-    Info.getAll(MDs);
+    auto It = PImpl->ValueMetadata.find(this);
+    if (It != PImpl->ValueMetadata.end())
+      It->second.getAll(MDs);
+    if (PImpl->CompactUnsafeInstTagged.count(this)) {
+      // Keep the result sorted by kind, as getAll guarantees.
+      std::pair<unsigned, MDNode *> Entry(LLVMContext::MD_unsafe_inst,
+                                          unsafeInstCanonicalTag(getContext()));
+      MDs.insert(llvm::upper_bound(MDs, Entry, less_first()), Entry);
+    }
+    // UNSAFE-RUST END
   }
 }
 
 void Value::setMetadata(unsigned KindID, MDNode *Node) {
   assert(isa<Instruction>(this) || isa<GlobalObject>(this));
 
+  // UNSAFE-RUST BEGIN
+  // Dense boolean tag: canonical unsafe_inst attachments are stored as
+  // bare membership in a context side set, not as MDAttachments entries;
+  // see CompactUnsafeInstTagged. Non-canonical nodes under the kind fall
+  // through to the general path.
+  LLVMContextImpl *PImpl = getContext().pImpl;
+  if (KindID == LLVMContext::MD_unsafe_inst && isa<Instruction>(this)) {
+    if (Node && Node == unsafeInstCanonicalTag(getContext())) {
+      PImpl->CompactUnsafeInstTagged.insert(this);
+      HasMetadata = true;
+      return;
+    }
+    if (PImpl->CompactUnsafeInstTagged.erase(this) && !Node) {
+      // The compact entry was the only attachment of this kind.
+      HasMetadata = PImpl->ValueMetadata.count(this) != 0;
+      return;
+    }
+  }
+  // UNSAFE-RUST END
+
   // Handle the case when we're adding/updating metadata on a value.
   if (Node) {
     MDAttachments &Info = getContext().pImpl->ValueMetadata[this];
-    assert(!Info.empty() == HasMetadata && "bit out of sync with hash table");
-    if (Info.empty())
-      HasMetadata = true;
+    HasMetadata = true;
     Info.set(KindID, Node);
     return;
   }
 
   // Otherwise, we're removing metadata from an instruction.
-  assert((HasMetadata == (getContext().pImpl->ValueMetadata.count(this) > 0)) &&
-         "bit out of sync with hash table");
   if (!HasMetadata)
     return; // Nothing to remove!
-  MDAttachments &Info = getContext().pImpl->ValueMetadata.find(this)->second;
+  // UNSAFE-RUST BEGIN
+  // A compact-tagged value may have no attachment map entry.
+  auto It = PImpl->ValueMetadata.find(this);
+  if (It == PImpl->ValueMetadata.end())
+    return;
+  MDAttachments &Info = It->second;
 
   // Handle removal of an existing value.
   Info.erase(KindID);
   if (!Info.empty())
     return;
-  getContext().pImpl->ValueMetadata.erase(this);
-  HasMetadata = false;
+  PImpl->ValueMetadata.erase(this);
+  HasMetadata = PImpl->CompactUnsafeInstTagged.count(this) != 0;
+  // UNSAFE-RUST END
 }
 
 void Value::setMetadata(StringRef Kind, MDNode *Node) {
@@ -1512,6 +1577,14 @@ void Value::setMetadata(StringRef Kind, MDNode *Node) {
 
 void Value::addMetadata(unsigned KindID, MDNode &MD) {
   assert(isa<Instruction>(this) || isa<GlobalObject>(this));
+  // UNSAFE-RUST BEGIN
+  if (KindID == LLVMContext::MD_unsafe_inst && isa<Instruction>(this) &&
+      &MD == unsafeInstCanonicalTag(getContext())) {
+    getContext().pImpl->CompactUnsafeInstTagged.insert(this);
+    HasMetadata = true;
+    return;
+  }
+  // UNSAFE-RUST END
   if (!HasMetadata)
     HasMetadata = true;
   getContext().pImpl->ValueMetadata[this].insert(KindID, MD);
@@ -1526,10 +1599,20 @@ bool Value::eraseMetadata(unsigned KindID) {
   if (!HasMetadata)
     return false;
 
-  MDAttachments &Store = getContext().pImpl->ValueMetadata.find(this)->second;
-  bool Changed = Store.erase(KindID);
-  if (Store.empty())
-    clearMetadata();
+  // UNSAFE-RUST BEGIN
+  LLVMContextImpl *PImpl = getContext().pImpl;
+  bool Changed = false;
+  if (KindID == LLVMContext::MD_unsafe_inst)
+    Changed |= PImpl->CompactUnsafeInstTagged.erase(this);
+  auto It = PImpl->ValueMetadata.find(this);
+  if (It != PImpl->ValueMetadata.end()) {
+    Changed |= It->second.erase(KindID);
+    if (It->second.empty())
+      PImpl->ValueMetadata.erase(It);
+  }
+  HasMetadata = PImpl->ValueMetadata.count(this) != 0 ||
+                PImpl->CompactUnsafeInstTagged.count(this) != 0;
+  // UNSAFE-RUST END
   return Changed;
 }
 
@@ -1537,23 +1620,37 @@ void Value::eraseMetadataIf(function_ref<bool(unsigned, MDNode *)> Pred) {
   if (!HasMetadata)
     return;
 
-  auto &MetadataStore = getContext().pImpl->ValueMetadata;
-  MDAttachments &Info = MetadataStore.find(this)->second;
-  assert(!Info.empty() && "bit out of sync with hash table");
-  Info.remove_if([Pred](const MDAttachments::Attachment &I) {
-    return Pred(I.MDKind, I.Node);
-  });
+  // UNSAFE-RUST BEGIN
+  LLVMContextImpl *PImpl = getContext().pImpl;
+  if (PImpl->CompactUnsafeInstTagged.count(this) &&
+      Pred(LLVMContext::MD_unsafe_inst, unsafeInstCanonicalTag(getContext())))
+    PImpl->CompactUnsafeInstTagged.erase(this);
+
+  auto It = PImpl->ValueMetadata.find(this);
+  if (It != PImpl->ValueMetadata.end()) {
+    It->second.remove_if([Pred](const MDAttachments::Attachment &I) {
+      return Pred(I.MDKind, I.Node);
+    });
+    if (It->second.empty())
+      PImpl->ValueMetadata.erase(It);
+  }
 
-  if (Info.empty())
-    clearMetadata();
+  HasMetadata = PImpl->ValueMetadata.count(this) != 0 ||
+                PImpl->CompactUnsafeInstTagged.count(this) != 0;
+  // UNSAFE-RUST END
 }
 
 void Value::clearMetadata() {
   if (!HasMetadata)
     return;
-  assert(getContext().pImpl->ValueMetadata.count(this) &&
+  // UNSAFE-RUST BEGIN
+  LLVMContextImpl *PImpl = getContext().pImpl;
+  assert((PImpl->ValueMetadata.count(this) ||
+          PImpl->CompactUnsafeInstTagged.count(this)) &&
          "bit out of sync with hash table");
-  getContext().pImpl->ValueMetadata.erase(this);
+  PImpl->ValueMetadata.erase(this);
+  PImpl->CompactUnsafeInstTagged.erase(this);
+  // UNSAFE-RUST END
   HasMetadata = false;
 }
 
@@ -1700,7 +1797,13 @@ AAMDNodes Instruction::getAAMetadata() const {
   // Not using Instruction::hasMetadata() because we're not interested in
   // DebugInfoMetadata.
   if (Value::hasMetadata()) {
-    const MDAttachments &Info = getContext().pImpl->ValueMetadata.at(this);
+    // UNSAFE-RUST BEGIN
+    // A compact-tagged value may have no attachment map entry.
+    auto It = getContext().pImpl->ValueMetadata.find(this);
+    if (It == getContext().pImpl->ValueMetadata.end())
+      return Result;
+    const MDAttachments &Info = It->second;
+    // UNSAFE-RUST END
     Result.TBAA = Info.lookup(LLVMContext::MD_tbaa);
     Result.TBAAStruct = Info.lookup(LLVMContext::MD_tbaa_struct);
     Result.Scope = Info.lookup(LLVMContext::MD_alias_scope);
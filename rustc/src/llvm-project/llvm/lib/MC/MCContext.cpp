@@ -146,6 +146,9 @@ void MCContext::reset() {
   WasmAllocator.DestroyAll();
   XCOFFAllocator.DestroyAll();
   MCInstAllocator.DestroyAll();
+  // UNSAFE-RUST BEGIN
+  UnsafeMarkerAsmCache.clear();
+  // UNSAFE-RUST END
   SPIRVAllocator.DestroyAll();
 
   MCSubtargetAllocator.DestroyAll();
@@ -193,6 +196,18 @@ MCInst *MCContext::createMCInst() {
   return new (MCInstAllocator.Allocate()) MCInst;
 }
 
+// UNSAFE-RUST BEGIN
+const MCInst *MCContext::lookupUnsafeMarkerAsm(StringRef Key) const {
+  return UnsafeMarkerAsmCache.lookup(Key);
+}
+
+void MCContext::cacheUnsafeMarkerAsm(StringRef Key, const MCInst &Inst) {
+  MCInst *Owned = createMCInst();
+  *Owned = Inst;
+  UnsafeMarkerAsmCache[Key] = Owned;
+}
+// UNSAFE-RUST END
+
 //===----------------------------------------------------------------------===//
 // Symbol Manipulation
 //===----------------------------------------------------------------------===//
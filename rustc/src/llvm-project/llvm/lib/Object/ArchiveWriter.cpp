@@ -26,17 +26,20 @@
 #include "llvm/Object/SymbolicFile.h"
 #include "llvm/Object/XCOFFObjectFile.h"
 #include "llvm/Support/Alignment.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/EndianStream.h"
 #include "llvm/Support/Errc.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/Format.h"
 #include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Parallel.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/SmallVectorMemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include <cerrno>
 #include <map>
+#include <mutex>
 
 #if !defined(_MSC_VER) && !defined(__MINGW32__)
 #include <unistd.h>
@@ -726,6 +729,75 @@ static Expected<std::vector<unsigned>> getSymbols(SymbolicFile *Obj,
   return Ret;
 }
 
+// UNSAFE-RUST BEGIN
+// The expensive half of writing a symbol table is per-member and independent:
+// parsing each member as an object (or bitcode) file and walking its symbols.
+// Only the string-table offsets depend on earlier members. Instrumented rlibs
+// carry the per-block count tables and are roughly twice their usual size, so
+// the serial scan is a measurable slice of crate link time; fan the parsing
+// out over the parallel runtime and splice the names back in member order,
+// which keeps the archive byte-for-byte identical to the serial writer. COFF
+// archives share a 16-bit symbol map across members and AIX big archives keep
+// the SymbolicFile alive for 32/64-bit partitioning, so both stay serial.
+static cl::opt<bool> ParallelArchiveSymtab(
+    "archive-parallel-symtab", cl::init(true), cl::Hidden,
+    cl::desc("Compute archive member symbol tables in parallel when the "
+             "archive format allows it"));
+
+namespace {
+struct PrecomputedSymtab {
+  std::vector<std::string> Names;
+  bool HasSymFile = false;
+};
+} // namespace
+
+static Expected<std::vector<PrecomputedSymtab>>
+precomputeMemberSymbols(ArrayRef<NewArchiveMember> NewMembers) {
+  std::vector<PrecomputedSymtab> Syms(NewMembers.size());
+  std::mutex ErrMu;
+  Error Err = Error::success();
+  size_t ErrIdx = NewMembers.size();
+  parallelFor(0, NewMembers.size(), [&](size_t I) {
+    // Keep only the first error in member order, so a failing input reports
+    // exactly as it would from the serial writer.
+    auto Fail = [&](Error E) {
+      std::lock_guard<std::mutex> Lock(ErrMu);
+      if (I < ErrIdx) {
+        consumeError(std::move(Err));
+        Err = createFileError(NewMembers[I].MemberName, std::move(E));
+        ErrIdx = I;
+      } else {
+        consumeError(std::move(E));
+      }
+    };
+    // Bitcode members materialize IR in the given context, and LLVMContext is
+    // not thread-safe, so each task parses into its own short-lived context;
+    // the symbol names are copied out before it dies.
+    LLVMContext MemberContext;
+    Expected<std::unique_ptr<SymbolicFile>> ObjOrErr = getSymbolicFile(
+        NewMembers[I].Buf->getMemBufferRef(), MemberContext);
+    if (!ObjOrErr)
+      return Fail(ObjOrErr.takeError());
+    std::unique_ptr<SymbolicFile> Obj = std::move(*ObjOrErr);
+    if (!Obj)
+      return;
+    Syms[I].HasSymFile = true;
+    for (const object::BasicSymbolRef &S : Obj->symbols()) {
+      if (!isArchiveSymbol(S))
+        continue;
+      std::string Name;
+      raw_string_ostream NameStream(Name);
+      if (Error E = S.printName(NameStream))
+        return Fail(std::move(E));
+      Syms[I].Names.push_back(std::move(Name));
+    }
+  });
+  if (Err)
+    return std::move(Err);
+  return std::move(Syms);
+}
+// UNSAFE-RUST END
+
 static Expected<std::vector<MemberData>>
 computeMemberData(raw_ostream &StringTable, raw_ostream &SymNames,
                   object::Archive::Kind Kind, bool Thin, bool Deterministic,
@@ -802,6 +874,24 @@ computeMemberData(raw_ostream &StringTable, raw_ostream &SymNames,
   std::unique_ptr<SymbolicFile> NextSymFile;
   uint16_t Index = 0;
 
+  // UNSAFE-RUST BEGIN
+  // Parse the members and gather their symbol names up front, in parallel,
+  // when the format permits it; the loop below then only splices the
+  // precomputed names into the shared string table in member order.
+  std::vector<PrecomputedSymtab> ParallelSyms;
+  bool UseParallelSyms = ParallelArchiveSymtab &&
+                         NeedSymbols != SymtabWritingMode::NoSymtab &&
+                         !SymMap && !isAIXBigArchive(Kind) &&
+                         NewMembers.size() > 1;
+  if (UseParallelSyms) {
+    Expected<std::vector<PrecomputedSymtab>> SymsOrErr =
+        precomputeMemberSymbols(NewMembers);
+    if (!SymsOrErr)
+      return SymsOrErr.takeError();
+    ParallelSyms = std::move(*SymsOrErr);
+  }
+  // UNSAFE-RUST END
+
   for (auto M = NewMembers.begin(); M < NewMembers.end(); ++M) {
     std::string Header;
     raw_string_ostream Out(Header);
@@ -836,7 +926,8 @@ computeMemberData(raw_ostream &StringTable, raw_ostream &SymNames,
           std::move(StringMsg), object::object_error::parse_failed);
     }
 
-    if (NeedSymbols != SymtabWritingMode::NoSymtab || isAIXBigArchive(Kind)) {
+    if (!UseParallelSyms &&
+        (NeedSymbols != SymtabWritingMode::NoSymtab || isAIXBigArchive(Kind))) {
       auto SetNextSymFile = [&NextSymFile,
                              &Context](MemoryBufferRef Buf,
                                        StringRef MemberName) -> Error {
@@ -899,7 +990,17 @@ computeMemberData(raw_ostream &StringTable, raw_ostream &SymNames,
     Out.flush();
 
     std::vector<unsigned> Symbols;
-    if (NeedSymbols != SymtabWritingMode::NoSymtab) {
+    // UNSAFE-RUST BEGIN
+    if (UseParallelSyms) {
+      PrecomputedSymtab &Pre = ParallelSyms[M - NewMembers.begin()];
+      for (const std::string &Name : Pre.Names) {
+        Symbols.push_back(SymNames.tell());
+        SymNames << Name << '\0';
+      }
+      if (Pre.HasSymFile)
+        HasObject = true;
+    } else if (NeedSymbols != SymtabWritingMode::NoSymtab) {
+      // UNSAFE-RUST END
       Expected<std::vector<unsigned>> SymbolsOrErr =
           getSymbols(CurSymFile.get(), Index, SymNames, SymMap);
       if (!SymbolsOrErr)
@@ -290,15 +290,26 @@
 #include "llvm/Transforms/Vectorize/VectorCombine.h"
 #include <optional>
 // UNSAFE-RUST BEGIN
-// #include "llvm/Transforms/DebugInfoPreserve/DebugInfoPreserver.h"
+#include "llvm/Transforms/DebugInfoPreserve/DebugInfoPreserver.h"
 #include "llvm/Transforms/UnsafeRustDummy/UnsafeRustDummy.h"
 #include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/InstMarker/UnsafeInstrCheckpoint.h"
+#include "llvm/Transforms/InstMarker/UnsafeInstrConsolidate.h"
+#include "llvm/Transforms/InstMarker/UnsafeLayoutReport.h"
+#include "llvm/Transforms/InstMarker/UnsafeMultiVersion.h"
+#include "llvm/Transforms/InstMarker/UnsafeProbeBudget.h"
+#include "llvm/Transforms/InstMarker/UnsafeProbeCleanup.h"
+#include "llvm/Transforms/InstMarker/UnsafeRegionAnalysis.h"
 #include "llvm/Transforms/DynamicLineCount/DynamicLineCount.h"
 #include "llvm/Transforms/CpuCycleCount/CpuCycleCount.h"
 #include "llvm/Transforms/CpuCycleCount/ExternalCallTracker.h"
+#include "llvm/Transforms/CpuCycleCount/UnsafeShareEstimator.h"
+#include "llvm/Transforms/HeapTracker/AllocTracker.h"
 #include "llvm/Transforms/HeapTracker/HeapTracker.h"
 #include "llvm/Transforms/UnsafeCount/UnsafeFunctionTracker.h"
 #include "llvm/Transforms/UnsafeCount/UnsafeInstCounter.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeInstrManifest.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeProfile.h"
 // UNSAFE-RUST END
 
 using namespace llvm;
@@ -136,14 +136,25 @@
 #include "llvm/Transforms/Vectorize/SLPVectorizer.h"
 #include "llvm/Transforms/Vectorize/VectorCombine.h"
 // UNSAFE-RUST BEGIN
+#include "llvm/Transforms/DebugInfoPreserve/DebugInfoPreserver.h"
 #include "llvm/Transforms/UnsafeRustDummy/UnsafeRustDummy.h"
 #include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/InstMarker/UnsafeInstrCheckpoint.h"
+#include "llvm/Transforms/InstMarker/UnsafeInstrConsolidate.h"
+#include "llvm/Transforms/InstMarker/UnsafeLayoutReport.h"
+#include "llvm/Transforms/InstMarker/UnsafeMultiVersion.h"
+#include "llvm/Transforms/InstMarker/UnsafeProbeBudget.h"
+#include "llvm/Transforms/InstMarker/UnsafeProbeCleanup.h"
+#include "llvm/Transforms/InstMarker/UnsafeRegionAnalysis.h"
 #include "llvm/Transforms/DynamicLineCount/DynamicLineCount.h"
 #include "llvm/Transforms/CpuCycleCount/CpuCycleCount.h"
 #include "llvm/Transforms/CpuCycleCount/ExternalCallTracker.h"
+#include "llvm/Transforms/CpuCycleCount/UnsafeShareEstimator.h"
 #include "llvm/Transforms/HeapTracker/HeapTracker.h"
 #include "llvm/Transforms/UnsafeCount/UnsafeFunctionTracker.h"
 #include "llvm/Transforms/UnsafeCount/UnsafeInstCounter.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeInstrManifest.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeProfile.h"
 // UNSAFE-RUST END
 
 using namespace llvm;
@@ -327,6 +338,273 @@ static cl::opt<bool> EnableUnsafeInstCounterPass(
   "enable-unsafe-inst-counter", cl::init(false), cl::Hidden,
   cl::desc("Enable the UnsafeInstCounter pass")
 );
+
+static cl::opt<bool> EnableUnsafeRegionVerifyPass(
+  "enable-unsafe-region-verify", cl::init(false), cl::Hidden,
+  cl::desc("Verify (and repair) unsafe region marker pairing after "
+           "InstMarker")
+);
+
+static cl::opt<bool> EnableUnsafeProbeCleanupPass(
+  "enable-unsafe-probe-cleanup", cl::init(false), cl::Hidden,
+  cl::desc("Delete probe skeletons the configuration makes statically dead "
+           "(filtered-out functions, -unsafe-instr-sample-rate=0)")
+);
+
+static cl::opt<bool> EnableDebugInfoPreserverPass(
+  "enable-debug-info-preserver", cl::init(false), cl::Hidden,
+  cl::desc("Verify and anchor debug info in instrumented functions after "
+           "the unsafe passes")
+);
+
+static cl::opt<bool> EnableUnsafeInstrManifestPass(
+  "enable-unsafe-instr-manifest", cl::init(false), cl::Hidden,
+  cl::desc("Record instrumentation flags, region counts and table hashes "
+           "in a per-module object-file section")
+);
+
+static cl::opt<bool> EnableUnsafeShareEstimatorPass(
+  "enable-unsafe-share-estimator", cl::init(false), cl::Hidden,
+  cl::desc("Report a static per-function estimate of the unsafe cycle "
+           "share (needs -unsafe-share-report-dir)")
+);
+
+static cl::opt<bool> EnableUnsafeInstrConsolidatePass(
+  "enable-unsafe-instr-consolidate", cl::init(false), cl::Hidden,
+  cl::desc("Merge duplicate per-CGU instrumentation ctors and tables in "
+           "the full-LTO post-link module")
+);
+
+// Pipeline-position experiments: the stats passes normally run after all
+// optimization so their numbers describe final code, but measuring what
+// the optimizer does TO unsafe code — how many unsafe loads it
+// eliminates, say — needs the same counts before it runs. This schedules
+// the instrumentation block early (right after InstMarker, before any
+// simplification), late (the default), or both. Dynamic probes cannot be
+// planted twice without the late run measuring the early run's probes,
+// so "both" adds only an early report-mode instruction counter, whose
+// files carry an ".early" marker; diffing them against the late reports
+// is the optimizer-effect study.
+enum class UnsafeInstrPhaseKind { Late, Early, Both };
+
+static cl::opt<bool> EnableUnsafeMultiVersionPass(
+  "enable-unsafe-multi-version", cl::init(false), cl::Hidden,
+  cl::desc("Clone a probe-free variant of every marked function and pick "
+           "probed or clean at load time through a per-function ifunc")
+);
+
+static cl::opt<UnsafeInstrPhaseKind> UnsafeInstrPhase(
+  "unsafe-instr-phase", cl::init(UnsafeInstrPhaseKind::Late), cl::Hidden,
+  cl::desc("Where the unsafe instrumentation passes run in the pipeline"),
+  cl::values(
+      clEnumValN(UnsafeInstrPhaseKind::Late, "late",
+                 "After all optimization (default)"),
+      clEnumValN(UnsafeInstrPhaseKind::Early, "early",
+                 "Before any optimization"),
+      clEnumValN(UnsafeInstrPhaseKind::Both, "both",
+                 "Late as usual, plus an early report-only instruction "
+                 "counter whose files carry an .early marker"))
+);
+
+/// Build the unsafe instrumentation block unconditionally; the phase
+/// helpers below decide where (and whether) it goes.
+static void addUnsafeInstrumentationBlock(ModulePassManager &MPM) {
+  // The checkpoint must capture the module exactly as the probe passes are
+  // about to see it, so it comes before everything else in the block. The
+  // directory flag doubles as the enable, like the counter's report mode.
+  if (!getUnsafeInstrCheckpointDir().empty() && isUnsafePrimaryPackage()) {
+    MPM.addPass(UnsafeInstrCheckpointPass());
+  }
+
+  // Before any probe-emitting pass, so the static weights describe
+  // the uninstrumented final code the estimate is meant to rank.
+  if (EnableUnsafeShareEstimatorPass && isUnsafePrimaryPackage()) {
+    MPM.addPass(UnsafeShareEstimatorPass());
+  }
+
+  // Size baseline for the layout report, likewise before any probe-emitting
+  // pass; the directory flag doubles as the enable. The final instance runs
+  // at the other end of the block.
+  if (UnsafeLayoutReportPass::reportConfigured() && isUnsafePrimaryPackage()) {
+    MPM.addPass(UnsafeLayoutReportPass(/*Final=*/false));
+  }
+
+  // Before every probe-emitting pass: the clean variant must be cloned and
+  // stripped while no probes exist, so the probe passes instrument only
+  // the marker-carrying body.
+  if (EnableUnsafeMultiVersionPass && isUnsafePrimaryPackage()) {
+    MPM.addPass(UnsafeMultiVersionPass());
+  }
+
+  if (EnableHeapTrackerPass && isUnsafePrimaryPackage()) {
+    FunctionPassManager HeapFPM;
+    HeapFPM.addPass(HeapTrackerPass());
+    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(HeapFPM)));
+  }
+
+  // When both the function tracker and the instruction counter are
+  // requested, one combined pass assigns IDs and counts blocks in a single
+  // walk instead of two passes plus an adaptor. Counter report-only mode
+  // keeps the standalone passes, since the combined pass has no report path;
+  // the same goes for cold suppression, which the combined pass does not
+  // implement.
+  if (EnableUnsafeFunctionTrackerPass && EnableUnsafeInstCounterPass &&
+      !UnsafeInstCounterPass::reportOnlyEnabled() &&
+      !UnsafeInstCounterPass::coldSuppressEnabled() &&
+      isUnsafePrimaryPackage()) {
+    MPM.addPass(UnsafeProfilePass());
+  } else {
+    if (EnableUnsafeFunctionTrackerPass && isUnsafePrimaryPackage()) {
+      MPM.addPass(UnsafeFunctionTrackerPass());
+    }
+
+    if (EnableUnsafeInstCounterPass && isUnsafePrimaryPackage()) {
+      FunctionPassManager UnsafeFPM;
+      UnsafeFPM.addPass(UnsafeInstCounterPass());
+      MPM.addPass(createModuleToFunctionPassAdaptor(std::move(UnsafeFPM)));
+    }
+  }
+
+  if (EnableDynamicLineCountPass && isUnsafePrimaryPackage()) {
+    MPM.addPass(DynamicLineCountPass());
+  }
+
+  if (EnableCpuCycleCountPass && isUnsafePrimaryPackage()) {
+    MPM.addPass(CpuCycleCountPass());
+  }
+
+  if (EnableExternalCallTrackerPass && isUnsafePrimaryPackage()) {
+    MPM.addPass(ExternalCallTrackerPass());
+  }
+
+  // After every probe-emitting pass and before the preserver and the
+  // manifest, so both describe the code that actually ships once the dead
+  // skeletons are gone.
+  if (EnableUnsafeProbeCleanupPass && isUnsafePrimaryPackage()) {
+    MPM.addPass(UnsafeProbeCleanupPass());
+  }
+
+  // Gated on its own -unsafe-probe-budget* limits rather than an enable
+  // flag: setting a budget is the request. After cleanup, so the count is
+  // of the probes the binary will actually carry.
+  if (UnsafeProbeBudgetPass::budgetConfigured() && isUnsafePrimaryPackage()) {
+    MPM.addPass(UnsafeProbeBudgetPass());
+  }
+
+  // The report's "after" side, paired with the baseline at the top of the
+  // block: past cleanup so it sizes the probes the binary actually keeps.
+  if (UnsafeLayoutReportPass::reportConfigured() && isUnsafePrimaryPackage()) {
+    MPM.addPass(UnsafeLayoutReportPass(/*Final=*/true));
+  }
+
+  // Last so it sees the debug locations as every instrumentation pass above
+  // left them. It verifies only the functions the instrumentation stamped.
+  if (EnableDebugInfoPreserverPass && isUnsafePrimaryPackage()) {
+    MPM.addPass(DebugInfoPreserverPass());
+  }
+
+  // The manifest describes everything the passes above emitted, so it must
+  // run after all of them.
+  if (EnableUnsafeInstrManifestPass && isUnsafePrimaryPackage()) {
+    MPM.addPass(UnsafeInstrManifestPass());
+  }
+}
+
+/// Schedule the post-optimization unsafe instrumentation passes. Shared by
+/// the per-module, O0 and ThinLTO post-link pipelines so they stay in sync:
+/// the block must sit after all optimization so the collected stats reflect
+/// final code, and before nothing that could optimize the probes away.
+/// Under -unsafe-instr-phase=early the block has moved to the early
+/// position and this is a no-op.
+static void addUnsafeInstrumentationPasses(ModulePassManager &MPM) {
+  if (UnsafeInstrPhase == UnsafeInstrPhaseKind::Early)
+    return;
+  addUnsafeInstrumentationBlock(MPM);
+}
+
+/// Schedule whatever -unsafe-instr-phase puts at the early position:
+/// nothing (late, the default), the whole block (early), or the
+/// report-only early counter instance (both).
+static void addEarlyUnsafeInstrumentationPasses(ModulePassManager &MPM) {
+  if (!isUnsafePrimaryPackage())
+    return;
+  switch (UnsafeInstrPhase) {
+  case UnsafeInstrPhaseKind::Late:
+    return;
+  case UnsafeInstrPhaseKind::Early:
+    addUnsafeInstrumentationBlock(MPM);
+    return;
+  case UnsafeInstrPhaseKind::Both:
+    if (EnableUnsafeInstCounterPass) {
+      FunctionPassManager FPM;
+      FPM.addPass(UnsafeInstCounterPass(/*EarlyPhase=*/true));
+      MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+    }
+    return;
+  }
+}
+
+void llvm::addUnsafeInstrumentationResumePipeline(ModulePassManager &MPM) {
+  // Resume replays only the instrumentation block against whatever the
+  // dump captured: everything that ran before the dump point is baked
+  // into the checkpoint bitcode, and the checkpoint writer at the head of
+  // the block no-ops on resume. Dump under the default late phase —
+  // an early-phase dump checkpoints pre-optimization IR, and resuming it
+  // would skip the optimizer the experiment presumably wants.
+  addUnsafeInstrumentationBlock(MPM);
+}
+
+uint64_t llvm::getUnsafeInstrPipelineFingerprint() {
+  // FNV-1a, like the other configuration hashes in this tree.
+  uint64_t H = 0xcbf29ce484222325ULL;
+  auto Mix = [&H](uint64_t V) {
+    H ^= V;
+    H *= 0x100000001b3ULL;
+  };
+  auto MixString = [&](StringRef S) {
+    for (char C : S)
+      Mix(static_cast<uint8_t>(C));
+    Mix(0xff); // terminator, so "ab"+"c" != "a"+"bc"
+  };
+
+  // The dummy pass is the one unsafe pass that is not gated on the
+  // primary package, so it always contributes.
+  Mix(EnableUnsafeRustDummyPass);
+
+  // Everything else is a no-op outside the primary package: the pass
+  // scheduling above (and the InstMarker scheduling in the pipelines)
+  // checks isUnsafePrimaryPackage() next to every flag.  Dependency
+  // builds therefore hash identically under every experiment.
+  if (isUnsafePrimaryPackage()) {
+    Mix(EnableInstMarkerPass);
+    Mix(EnableUnsafeRegionVerifyPass);
+    Mix(EnableDynamicLineCountPass);
+    Mix(EnableHeapTrackerPass);
+    Mix(EnableCpuCycleCountPass);
+    Mix(EnableExternalCallTrackerPass);
+    Mix(EnableUnsafeFunctionTrackerPass);
+    Mix(EnableUnsafeInstCounterPass);
+    Mix(EnableUnsafeProbeCleanupPass);
+    Mix(EnableUnsafeInstrConsolidatePass);
+    Mix(EnableUnsafeMultiVersionPass);
+    Mix(EnableDebugInfoPreserverPass);
+    Mix(EnableUnsafeInstrManifestPass);
+    Mix(UnsafeInstCounterPass::reportOnlyEnabled());
+    Mix(getUnsafeInstrSampleRate());
+    Mix(unsafeDormantProbesEnabled());
+    Mix(unsafeProbePreserveMostEnabled());
+    Mix(unsafeShmStatsEnabled());
+    Mix(unsafeExternTablesEnabled());
+    Mix(unsafeSectionLayoutEnabled());
+    Mix(unsafeLazyRegistrationEnabled());
+    Mix(static_cast<uint64_t>(UnsafeInstrPhase.getValue()));
+    MixString(getUnsafeInstrFuncsFile());
+    MixString(getUnsafeInstrExcludeProfile());
+    MixString(getUnsafeNameSidecarDir());
+    MixString(getUnsafeStatsOutputTemplate());
+  }
+  return H;
+}
   // UNSAFE-RUST END
 
 namespace llvm {
@@ -1553,10 +1831,16 @@ PassBuilder::buildPerModuleDefaultPipeline(OptimizationLevel Level,
   FunctionPassManager FPM;
 
   // UNSAFE-RUST BEGIN
-  if (EnableInstMarkerPass) {
+  // The unsafe passes only ever do work for the primary package, but cargo
+  // hands the same llvm-args to every crate in the workspace. Skip scheduling
+  // them (and their adaptors) entirely for dependency crates rather than
+  // having each pass no-op per function.
+  if (EnableInstMarkerPass && isUnsafePrimaryPackage()) {
     FunctionPassManager InstFPM;
     InstFPM.addPass(InstMarkerPass());
-    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(InstFPM))); 
+    if (EnableUnsafeRegionVerifyPass)
+      InstFPM.addPass(UnsafeRegionVerifierPass());
+    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(InstFPM)));
   }
 
   if (EnableUnsafeRustDummyPass) {
@@ -1564,6 +1848,15 @@ PassBuilder::buildPerModuleDefaultPipeline(OptimizationLevel Level,
     DummyFPM.addPass(UnsafeRustDummyPass());
     MPM.addPass(createModuleToFunctionPassAdaptor(std::move(DummyFPM)));
   }
+
+  // Pre-optimization position for -unsafe-instr-phase=early/both; the
+  // markers above are already in place. Under full LTO the instrumentation
+  // runs post-link instead (see buildLTODefaultPipeline): anything planted
+  // pre-link would be internalized and stripped by the LTO optimizers, and
+  // per-CGU tables would fragment the ID space. Only the markers go in
+  // pre-link, same as the ThinLTO split.
+  if (!LTOPreLink)
+    addEarlyUnsafeInstrumentationPasses(MPM);
   // UNSAFE-RUST END
 
   // Convert @llvm.global.annotations to !annotation metadata.
@@ -1596,35 +1889,10 @@ PassBuilder::buildPerModuleDefaultPipeline(OptimizationLevel Level,
 
   // UNSAFE-RUST BEGIN
   // Post-optimization stats collection - placed after all optimizations
-  // to capture final optimized code characteristics and prevent optimization away
-
-  if (EnableHeapTrackerPass) {
-    FunctionPassManager HeapFPM;
-    HeapFPM.addPass(HeapTrackerPass());
-    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(HeapFPM)));
-  }
-
-  if (EnableUnsafeFunctionTrackerPass) {
-    MPM.addPass(UnsafeFunctionTrackerPass());
-  }
-
-  if (EnableUnsafeInstCounterPass) {
-    FunctionPassManager UnsafeFPM;
-    UnsafeFPM.addPass(UnsafeInstCounterPass());
-    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(UnsafeFPM))); 
-  }
-
-  if (EnableDynamicLineCountPass) {
-    MPM.addPass(DynamicLineCountPass());
-  }
-
-  if (EnableCpuCycleCountPass) {
-    MPM.addPass(CpuCycleCountPass());
-  }
-
-  if (EnableExternalCallTrackerPass) {
-    MPM.addPass(ExternalCallTrackerPass());
-  }
+  // to capture final optimized code characteristics and prevent optimization
+  // away. Deferred to the post-link pipeline under full LTO, as above.
+  if (!LTOPreLink)
+    addUnsafeInstrumentationPasses(MPM);
   // UNSAFE-RUST END
 
   if (LTOPreLink)
@@ -1662,6 +1930,27 @@ PassBuilder::buildThinLTOPreLinkDefaultPipeline(OptimizationLevel Level) {
 
   ModulePassManager MPM;
 
+  // UNSAFE-RUST BEGIN
+  // Markers have to be placed pre-link: they are derived from the frontend's
+  // unsafe_inst metadata, which only this phase sees. The begin/end
+  // intrinsics then ride through the ThinLTO import path like any other
+  // call; the post-link pipeline verifies their pairing and runs the
+  // instrumentation proper on the final cross-module-optimized code.
+  if (EnableInstMarkerPass && isUnsafePrimaryPackage()) {
+    FunctionPassManager InstFPM;
+    InstFPM.addPass(InstMarkerPass());
+    if (EnableUnsafeRegionVerifyPass)
+      InstFPM.addPass(UnsafeRegionVerifierPass());
+    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(InstFPM)));
+  }
+
+  if (EnableUnsafeRustDummyPass) {
+    FunctionPassManager DummyFPM;
+    DummyFPM.addPass(UnsafeRustDummyPass());
+    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(DummyFPM)));
+  }
+  // UNSAFE-RUST END
+
   // Convert @llvm.global.annotations to !annotation metadata.
   MPM.addPass(Annotation2MetadataPass());
 
@@ -1749,6 +2038,13 @@ ModulePassManager PassBuilder::buildThinLTODefaultPipeline(
     return MPM;
   }
 
+  // UNSAFE-RUST BEGIN
+  // Pre-optimization position for -unsafe-instr-phase=early/both: the
+  // markers rode in through the import, so the block can run before any
+  // post-link simplification.
+  addEarlyUnsafeInstrumentationPasses(MPM);
+  // UNSAFE-RUST END
+
   // Add the core simplification pipeline.
   MPM.addPass(buildModuleSimplificationPipeline(
       Level, ThinOrFullLTOPhase::ThinLTOPostLink));
@@ -1760,6 +2056,16 @@ ModulePassManager PassBuilder::buildThinLTODefaultPipeline(
   // Emit annotation remarks.
   addAnnotationRemarksPass(MPM);
 
+  // UNSAFE-RUST BEGIN
+  // Check the markers survived import and cross-module inlining before
+  // instrumenting against them; an unbalanced pair here means the numbers
+  // for that function cannot be trusted.
+  if (EnableInstMarkerPass && isUnsafePrimaryPackage())
+    MPM.addPass(
+        createModuleToFunctionPassAdaptor(UnsafeRegionVerifierPass()));
+  addUnsafeInstrumentationPasses(MPM);
+  // UNSAFE-RUST END
+
   return MPM;
 }
 
@@ -1777,6 +2083,15 @@ PassBuilder::buildLTODefaultPipeline(OptimizationLevel Level,
 
   invokeFullLinkTimeOptimizationEarlyEPCallbacks(MPM, Level);
 
+  // UNSAFE-RUST BEGIN
+  // First thing after the module merge: each linked CGU arrived with its
+  // own instrumentation ctors and tables, and deduplicating them up front
+  // lets GlobalDCE and the optimizers below see the consolidated form.
+  if (EnableUnsafeInstrConsolidatePass && isUnsafePrimaryPackage()) {
+    MPM.addPass(UnsafeInstrConsolidatePass());
+  }
+  // UNSAFE-RUST END
+
   // Create a function that performs CFI checks for cross-DSO calls with targets
   // in the current module.
   MPM.addPass(CrossDSOCFIPass());
@@ -1798,6 +2113,16 @@ PassBuilder::buildLTODefaultPipeline(OptimizationLevel Level,
     return MPM;
   }
 
+  // UNSAFE-RUST BEGIN
+  // Pre-optimization position for -unsafe-instr-phase=early/both: the
+  // markers were placed pre-link and rode through the module merge, and
+  // the instrumentation proper belongs post-link where it sees the whole
+  // program and assigns IDs in a single space. The O0 path above is
+  // exempt: its prelink pipeline instruments directly, and nothing in the
+  // O0 link path strips it.
+  addEarlyUnsafeInstrumentationPasses(MPM);
+  // UNSAFE-RUST END
+
   if (PGOOpt && PGOOpt->Action == PGOOptions::SampleUse) {
     // Load sample profile before running the LTO optimization pipeline.
     MPM.addPass(SampleProfileLoaderPass(PGOOpt->ProfileFile,
@@ -1873,6 +2198,15 @@ PassBuilder::buildLTODefaultPipeline(OptimizationLevel Level,
     // Emit annotation remarks.
     addAnnotationRemarksPass(MPM);
 
+    // UNSAFE-RUST BEGIN
+    // Same post-optimization instrumentation as the main tail below; this
+    // early return would otherwise skip it at -O1.
+    if (EnableInstMarkerPass && isUnsafePrimaryPackage())
+      MPM.addPass(
+          createModuleToFunctionPassAdaptor(UnsafeRegionVerifierPass()));
+    addUnsafeInstrumentationPasses(MPM);
+    // UNSAFE-RUST END
+
     return MPM;
   }
 
@@ -2085,6 +2419,18 @@ PassBuilder::buildLTODefaultPipeline(OptimizationLevel Level,
   // Emit annotation remarks.
   addAnnotationRemarksPass(MPM);
 
+  // UNSAFE-RUST BEGIN
+  // Check the markers survived the module merge and cross-module inlining
+  // before instrumenting against them, then collect stats on the final
+  // whole-program code. Running the trackers here, on the merged module,
+  // is what gives every function and probe an ID in one space instead of
+  // one ID space per linked CGU.
+  if (EnableInstMarkerPass && isUnsafePrimaryPackage())
+    MPM.addPass(
+        createModuleToFunctionPassAdaptor(UnsafeRegionVerifierPass()));
+  addUnsafeInstrumentationPasses(MPM);
+  // UNSAFE-RUST END
+
   return MPM;
 }
 
@@ -2097,9 +2443,11 @@ ModulePassManager PassBuilder::buildO0DefaultPipeline(OptimizationLevel Level,
 
   FunctionPassManager FPM;
   // UNSAFE-RUST BEGIN
-  if (EnableInstMarkerPass) {
+  if (EnableInstMarkerPass && isUnsafePrimaryPackage()) {
     FunctionPassManager InstFPM;
     InstFPM.addPass(InstMarkerPass());
+    if (EnableUnsafeRegionVerifyPass)
+      InstFPM.addPass(UnsafeRegionVerifierPass());
     MPM.addPass(createModuleToFunctionPassAdaptor(std::move(InstFPM))); 
   }
 
@@ -2108,6 +2456,11 @@ ModulePassManager PassBuilder::buildO0DefaultPipeline(OptimizationLevel Level,
     DummyFPM.addPass(UnsafeRustDummyPass());
     MPM.addPass(createModuleToFunctionPassAdaptor(std::move(DummyFPM)));
   }
+
+  // Pre-optimization position for -unsafe-instr-phase=early/both. Even at
+  // O0 the two positions are not the same: the always inliner and the
+  // coroutine lowering below run between them.
+  addEarlyUnsafeInstrumentationPasses(MPM);
   // UNSAFE-RUST END
 
   // Perform pseudo probe instrumentation in O0 mode. This is for the
@@ -2199,36 +2552,10 @@ ModulePassManager PassBuilder::buildO0DefaultPipeline(OptimizationLevel Level,
     addRequiredLTOPreLinkPasses(MPM);
 
   // UNSAFE-RUST BEGIN
-  // Post-optimization stats collection - placed after all optimizations
-  // to capture final optimized code characteristics and prevent optimization away
-
-  if (EnableHeapTrackerPass) {
-    FunctionPassManager HeapFPM;
-    HeapFPM.addPass(HeapTrackerPass());
-    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(HeapFPM)));
-  }
-
-  if (EnableUnsafeFunctionTrackerPass) {
-    MPM.addPass(UnsafeFunctionTrackerPass());
-  }
-
-  if (EnableUnsafeInstCounterPass) {
-    FunctionPassManager UnsafeFPM;
-    UnsafeFPM.addPass(UnsafeInstCounterPass());
-    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(UnsafeFPM))); 
-  }
-
-  if (EnableDynamicLineCountPass) {
-    MPM.addPass(DynamicLineCountPass());
-  }
-
-  if (EnableCpuCycleCountPass) {
-    MPM.addPass(CpuCycleCountPass());
-  }
-
-  if (EnableExternalCallTrackerPass) {
-    MPM.addPass(ExternalCallTrackerPass());
-  }
+  // Post-optimization stats collection - placed after everything the O0
+  // pipeline runs, so the collected stats reflect the code that ships,
+  // same as the per-module pipeline.
+  addUnsafeInstrumentationPasses(MPM);
   // UNSAFE-RUST END
 
   MPM.addPass(createModuleToFunctionPassAdaptor(AnnotationRemarksPass()));
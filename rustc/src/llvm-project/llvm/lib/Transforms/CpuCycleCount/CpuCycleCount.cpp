@@ -13,78 +13,1616 @@
 //===--------------------------------------------------------------------------------------==//
 
 #include "llvm/Transforms/CpuCycleCount/CpuCycleCount.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/TargetParser/Triple.h"
 #include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/InstMarker/UnsafeRegionAnalysis.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeFunctionTracker.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "cpu-cycle-count"
+
+STATISTIC(NumCycleRegionsProbed,
+          "Number of unsafe regions given start/end timing probes");
+STATISTIC(NumCycleRegionsEstimated,
+          "Number of regions covered by a static cycle estimate instead");
+STATISTIC(NumCycleFunctionsSkipped,
+          "Number of functions skipped for lack of region markers");
+STATISTIC(NumCycleScopesEmitted,
+          "Number of distinct source scopes in emitted cycle scope tables");
+STATISTIC(NumCycleFunctionsCalibrated,
+          "Number of functions given probe-free calibration twins");
+STATISTIC(NumCycleRegionsDemoted,
+          "Number of regions demoted to sampled probes by a prior profile");
+STATISTIC(NumCycleFunctionsOutlined,
+          "Number of functions given outlined probe thunks");
+STATISTIC(NumCycleNestingRowsEmitted,
+          "Number of rows in emitted unsafe-region nesting tables");
+STATISTIC(NumCycleUnwindCallsHardened,
+          "Number of in-region calls given an end-probe cleanup pad");
+STATISTIC(NumCycleUnwindCallsUnprotected,
+          "Number of in-region may-unwind calls left bare for lack of an "
+          "EH personality");
+STATISTIC(NumProbeFencesRelaxed,
+          "Number of probe sites where target-mode serialization emitted "
+          "less than the legacy full fence");
+
 // Runtime function names
 const char *llvm::PROGRAM_START_FN = "record_program_start";
 const char *llvm::START_MEASUREMENT_FN = "cpu_cycle_start_measurement";
 const char *llvm::END_MEASUREMENT_FN = "cpu_cycle_end_measurement";
 const char *llvm::PRINT_STATS_FN = "print_cpu_cycle_stats";
+const char *llvm::RECORD_INLINE_TOTALS_FN = "cpu_cycle_record_inline_totals";
+
+// Inline probe mode: instead of calling into the runtime around every unsafe
+// region, read the TSC directly via inline asm and accumulate the delta into
+// thread-local globals. The accumulated totals are handed to the runtime once,
+// from a destructor, so the fast path contains no external call. This matters
+// on benchmarks whose unsafe regions are only a handful of instructions
+// (memchr, hashbrown), where call+fence probes otherwise dominate the numbers.
+static cl::opt<bool> InlineCycleProbes(
+  "cpu-cycle-inline-probes", cl::init(false), cl::Hidden,
+  cl::desc("Inline rdtsc/rdtscp probes with thread-local accumulation "
+           "instead of runtime calls per unsafe region")
+);
+
+// Migration filter for the inline TSC probes. A delta whose start and end
+// reads land on different CPUs subtracts two unrelated counters, and on
+// busy hosts work-stealing schedulers migrate threads often enough for
+// those samples to pollute the stats. rdtscp returns IA32_TSC_AUX (the
+// kernel fills it with the processor number) in the same instruction, so
+// the filter costs only an aux-word compare: mismatched deltas are routed
+// to a discarded counter instead of the totals, and the start side trades
+// rdtsc for rdtscp to get its aux word. TSC source only — rdpmc reads
+// carry no processor ID.
+static cl::opt<bool> CycleMigrationFilter(
+  "cpu-cycle-migration-filter", cl::init(false), cl::Hidden,
+  cl::desc("Discard inline TSC deltas whose start/end rdtscp aux words "
+           "(IA32_TSC_AUX) disagree, counting them separately")
+);
+
+// Probe serialization strategy. MFence preserves the historical behavior
+// (a SequentiallyConsistent fence before every probe); measurement runs can
+// select lfence or rdtscp-implied ordering to roughly halve probe latency,
+// or target to let the pass pick per triple — the probe sequences were
+// tuned on x86-TSO, and carrying the full-fence habit to AArch64 triples
+// the probes' relative cost there for no added correctness.
+static cl::opt<ProbeSerialization> ProbeSerializationMode(
+  "probe-serialization", cl::init(ProbeSerialization::MFence), cl::Hidden,
+  cl::desc("Serialization emitted before timing probes"),
+  cl::values(
+      clEnumValN(ProbeSerialization::None, "none", "no explicit fence"),
+      clEnumValN(ProbeSerialization::LFence, "lfence",
+                 "counter-read serialization (lfence/isb) before both "
+                 "probes"),
+      clEnumValN(ProbeSerialization::RdtscpImplied, "rdtscp-implied",
+                 "counter-read serialization before the start probe only"),
+      clEnumValN(ProbeSerialization::MFence, "mfence",
+                 "SequentiallyConsistent fence (legacy)"),
+      clEnumValN(ProbeSerialization::Target, "target",
+                 "cheapest correct ordering for the module's target"))
+);
+
+void llvm::emitProbeSerialization(Instruction *InsertBefore, bool IsEndProbe) {
+  IRBuilder<> Builder(InsertBefore);
+  Triple TT(InsertBefore->getModule()->getTargetTriple());
+  auto EmitBarrierAsm = [&](StringRef Asm) {
+    FunctionType *AsmTy =
+        FunctionType::get(Type::getVoidTy(Builder.getContext()), false);
+    Builder.CreateCall(InlineAsm::get(AsmTy, Asm, "", /*hasSideEffects=*/true));
+  };
+  // The counter-read serialization instruction per ISA: cntvct_el0 is a
+  // system-register read, which memory barriers (dmb ishld included) do not
+  // order — only an instruction barrier keeps it from being read ahead of
+  // the work being timed.
+  StringRef CounterBarrier = TT.isAArch64() ? "isb" : "lfence";
+  switch (ProbeSerializationMode) {
+  case ProbeSerialization::None:
+    break;
+  case ProbeSerialization::Target:
+    // Serialize the start read only. On x86 the end side rides rdtscp's
+    // implied wait; on AArch64 an end read hoisted by speculation can only
+    // shorten the measured window, never lengthen it, so dropping the end
+    // barrier keeps the estimate a lower bound — the same contract the
+    // rdtscp-implied mode already accepts.
+    ++NumProbeFencesRelaxed;
+    if (IsEndProbe)
+      break;
+    EmitBarrierAsm(CounterBarrier);
+    break;
+  case ProbeSerialization::RdtscpImplied:
+    if (IsEndProbe)
+      break;
+    [[fallthrough]];
+  case ProbeSerialization::LFence:
+    EmitBarrierAsm(CounterBarrier);
+    break;
+  case ProbeSerialization::MFence:
+    // SequentiallyConsistent lowers to mfence on x86 and dmb ish on
+    // AArch64; the legacy mode is already target-correct, just not cheap.
+    Builder.CreateFence(AtomicOrdering::SequentiallyConsistent);
+    break;
+  }
+}
+
+// Probe source for the inline probe modes. TSC counts wall cycles including
+// SMT interference and frequency scaling, which drifts run-to-run on shared
+// measurement boxes; rdpmc reads a perf_event counter (core cycles or
+// instructions retired) that the runtime programs once at startup via
+// cpu_cycle_pmc_init and publishes the counter index for. Only meaningful
+// together with -cpu-cycle-inline-probes or -cpu-cycle-per-thread — with
+// runtime-call probes the read happens inside the runtime, which picks its
+// own source.
+static cl::opt<ProbeSource> ProbeSourceMode(
+  "cpu-cycle-probe-source", cl::init(ProbeSource::TSC), cl::Hidden,
+  cl::desc("Counter read by inline timing probes"),
+  cl::values(
+      clEnumValN(ProbeSource::TSC, "tsc", "rdtsc/rdtscp (legacy)"),
+      clEnumValN(ProbeSource::RdPMC, "rdpmc",
+                 "perf_event counter configured by the runtime"))
+);
+
+// Per-thread accumulation keyed by function ID. Instead of handing the raw
+// start TSC to cpu_cycle_end_measurement (one shared-state update per unsafe
+// block execution, which ping-pongs cache lines on tokio/rayon), each thread
+// accumulates into a TLS array indexed by the function ID attached by
+// UnsafeFunctionTrackerPass, and the runtime flushes the array into the
+// global table at thread exit via a registered callback.
+static cl::opt<bool> PerThreadCycleAccumulators(
+  "cpu-cycle-per-thread", cl::init(false), cl::Hidden,
+  cl::desc("Accumulate cycles in a per-thread array keyed by function ID, "
+           "flushed to the global table at thread exit")
+);
+
+// Static estimation: unsafe regions whose TTI latency cost is at or below
+// this threshold get no runtime timing probe. Instead the pass records the
+// block's estimated cycles once at startup and emits a bare executed-counter
+// increment, so totals stay attributable while the dynamic probe count drops
+// sharply on crates full of one-or-two-instruction regions (smallvec,
+// arrayvec). 0 disables static estimation.
+static cl::opt<unsigned> StaticEstimateThreshold(
+  "cpu-cycle-static-cost-threshold", cl::init(0), cl::Hidden,
+  cl::desc("Elide timing probes for unsafe regions with a TTI latency cost "
+           "at or below this value (0 = always probe)")
+);
+
+// Scope attribution: at -O3 the unsafe region an end probe fires in has
+// usually been inlined, so cycles land on the post-inlining caller and the
+// original source function (hashbrown's RawTable internals, say) disappears
+// from the report. With this flag the end probe instead calls
+// cpu_cycle_end_measurement_scoped with a dense scope ID derived from the
+// region's DILocation — the innermost frame of the inlinedAt chain, i.e. the
+// function the region was written in — and a ctor registers the per-module
+// scope-name table so print_cpu_cycle_stats can report per-source-function
+// time. Only the runtime-call probe mode is affected; the inline modes keep
+// their function-ID/total attribution.
+static cl::opt<bool> CycleScopeAttribution(
+  "cpu-cycle-scope-attribution", cl::init(false), cl::Hidden,
+  cl::desc("Attribute measured cycles to the pre-inlining source function "
+           "recorded in debug info instead of the post-inlining function")
+);
+
+// Innermost attribution: nested unsafe blocks all tag their instructions
+// with unsafe_inst, so the flat markers charge an inner block's cycles to
+// whichever region its instructions landed in, and a region split off an
+// inner block is indistinguishable from its enclosing one. With this flag
+// (and -instmarker-region-depth upstream, which stamps begin markers with
+// unsafe_region_nesting metadata) the end probes carry region keys and a
+// ctor registers a static nesting table — (region key, depth, scope key,
+// parent scope key) rows — so the runtime can subtract a child scope's
+// cycles from its ancestors and report innermost-only time. No dynamic
+// depth counter is needed: the markers themselves never nest (the
+// verifier enforces that), so nesting is entirely a static fact of the
+// table. Runtime-call probe mode only, like scope attribution.
+static cl::opt<bool> CycleDepthAttribution(
+  "cpu-cycle-depth-attribution", cl::init(false), cl::Hidden,
+  cl::desc("Key end probes by region and register the static unsafe-region "
+           "nesting table so cycles can be attributed to innermost regions")
+);
+
+// Unit calibration: record_program_start anchors a start point, but the
+// raw TSC deltas in the stat output are ticks of whatever the host clocks
+// them at, so master_runtime_stats.json aggregations mix CPUs with
+// different base clocks. Under this flag the cpu_cycle ctor also reads
+// the CPUID TSC-frequency leaf (0x15) and the invariant-TSC capability
+// word (0x80000007 EDX) and hands them to the runtime, which records the
+// tick-to-nanosecond ratio in the stat output header — falling back to a
+// short TSC-vs-CLOCK_MONOTONIC timing loop when the leaf is unpopulated
+// (older Intel, AMD) — so the aggregator normalizes units without a
+// per-machine configuration file.
+static cl::opt<bool> CycleTscCalibration(
+  "cpu-cycle-tsc-calibration", cl::init(false), cl::Hidden,
+  cl::desc("Record CPUID TSC-frequency and invariant-TSC bits from the "
+           "module ctor so stat output carries calibrated time units")
+);
+
+// Probe outlining: the fence+call sequence is otherwise duplicated at
+// every region, and in region-dense hot loops the duplication alone grows
+// the body past what the uop cache holds (instrumented simd-json's main
+// loop, per the topdown analysis). Under this flag each function gets one
+// compact probe thunk per direction; regions pay a near-call into it with
+// the start value (and scope ID or region key) in registers, and the
+// serialization plus runtime call live in exactly one place. The static
+// region tables are untouched — only where the sequence's bytes sit
+// changes. Runtime-call probe mode only: the inline modes have no call
+// sequence to outline.
+static cl::opt<bool> CycleOutlineProbes(
+  "cpu-cycle-outline-probes", cl::init(false), cl::Hidden,
+  cl::desc("Outline the per-region probe sequences into per-function "
+           "thunks to keep hot loop bodies icache-sized")
+);
+
+// Folded-stack output: without it, cpu_cycle.stat totals have to be
+// cross-referenced with external perf profiles by hand to see where unsafe
+// time sits in the call tree. Under this flag every tracked function gets a
+// cheap shadow-stack push on entry and pop before each return, the runtime
+// samples that stack when an end probe fires, and the exit hook writes
+// Brendan Gregg folded lines ("a;b;c <cycles>") ready for flamegraph.pl —
+// so a flamegraph of unsafe time comes out of a single run. Requires the
+// function tracker (the push IDs and the registered name table are keyed by
+// its function IDs) and the runtime-call probe mode, since the inline modes
+// never enter the runtime at region end.
+static cl::opt<bool> CycleFoldedStacks(
+  "cpu-cycle-folded-stacks", cl::init(false), cl::Hidden,
+  cl::desc("Maintain a shadow call stack of tracked functions and write "
+           "folded-stack (flamegraph) output of unsafe cycles at exit")
+);
+
+// Self-calibration: quantifying probe distortion otherwise takes two full
+// pipeline builds (instrumented and native) and a manual diff. With a rate
+// of N, every function that gets probes also keeps a probe-free clone, and
+// its entry becomes a dispatcher that sends one in N calls through the
+// clone while timing either side with inline counter reads; the runtime
+// accumulates both distributions per function and reports the overhead
+// factor at exit, so one binary measures its own distortion. The clone is
+// the same IR with only the markers stripped — fast-math and contraction
+// flags are cloned as-is, so both sides optimize alike and the diff is the
+// probes, nothing else. 0 disables.
+static cl::opt<unsigned> CycleCalibrateRate(
+  "cpu-cycle-calibrate-rate", cl::init(0), cl::Hidden,
+  cl::desc("Route 1-in-N calls of each probed function through a probe-free "
+           "clone, timing both, to measure probe overhead in-process "
+           "(0 disables)")
+);
+
+// Execution-order tracing: two runs of parking_lot reporting different
+// unsafe cycle totals cannot be diagnosed from aggregates — the question
+// is what executed in which order. With a buffer size of N the begin
+// probe appends (region-key, TSC-delta-since-previous-event) pairs into a
+// per-thread ring buffer and hands full buffers to cpu_cycle_trace_flush,
+// which varint-encodes them into the trace file (small deltas dominate,
+// so the encoding does its work there, not on the hot path). An XRay-like
+// trace, but restricted to unsafe regions so the volume stays manageable.
+// Replaces the aggregate probes: a trace run answers ordering questions,
+// the ordinary modes answer totals. 0 disables tracing.
+static cl::opt<unsigned> CycleTraceBufferSize(
+  "cpu-cycle-trace-buffer", cl::init(0), cl::Hidden,
+  cl::desc("Record (region-key, TSC-delta) trace events into a per-thread "
+           "buffer of this many events, flushed to the runtime when full "
+           "(0 = no tracing)")
+);
+
+// Latency histograms: the aggregate probes record totals only, so a
+// region executing a million times at 50 cycles is indistinguishable
+// from 999,999 executions at 30 plus one 20M-cycle outlier — and the
+// outlier is exactly what a tail-latency investigation is after. Under
+// this flag every probed region gets 16 zero-initialized u32 buckets in
+// a static per-function table sized at compile time, and the end probe
+// switches to cpu_cycle_end_measurement_hist, which carries the region
+// key plus the region's bucket-row pointer: the runtime buckets the
+// delta by bit-scan (bucket = min(15, floor(log2(delta)))) and
+// increments one u32 — constant memory, branchless, no lookup — and the
+// exit dump derives per-region min/max/p99 from the power-of-two bucket
+// bounds. Runtime-call probes only: the inline, per-thread and trace
+// modes never hand the runtime a per-region delta.
+static cl::opt<bool> CycleRegionHistograms(
+  "cpu-cycle-region-histograms", cl::init(false), cl::Hidden,
+  cl::desc("Record per-region log2-bucketed cycle histograms and report "
+           "min/max/p99 in the exit dump")
+);
+
+// Task-context attribution: thread identity still misleads for async code,
+// where one executor worker polls thousands of logical tasks. Under this
+// flag the plain end probe becomes cpu_cycle_end_measurement_task, which
+// additionally charges the delta to whatever context ID the runtime's TLS
+// slot holds — published by a task-instrumentation shim through the
+// documented __unsafe_set_task_context hook on poll entry (and cleared with
+// 0 on return to the scheduler). The variant keeps the plain probe's
+// signature, since the ID comes from the slot rather than the call site, so
+// the swap happens wholesale at declaration time. Runtime-call probe mode
+// only; the keyed and scoped variants keep their own attribution — a probe
+// carries one identity, and those modes already chose theirs.
+static cl::opt<bool> CycleTaskContext(
+  "cpu-cycle-task-context", cl::init(false), cl::Hidden,
+  cl::desc("Attribute measured cycles to the task-context ID published via "
+           "__unsafe_set_task_context, in addition to the global totals")
+);
+
+// Unwind hardening: a panic that unwinds out of an instrumented region
+// skips the end probe, so the start TSC leaks and the sample is lost —
+// error-path benchmarks lose exactly the executions they exist to measure.
+// Under this flag every may-unwind call between a region's probes becomes
+// an invoke whose cleanup pad fires the unwind end-probe variant before
+// resuming, closing the region on the panic path too. Only functions that
+// already carry an EH personality can be hardened — the pass cannot guess
+// which personality a frame without one should use, and a frame without
+// one has no cleanups for the panic to stop at anyway. Regions the
+// verifier split across existing invokes need no help: their unwind
+// successors re-open the region. Runtime-call probe mode only.
+static cl::opt<bool> CycleUnwindProbes(
+  "cpu-cycle-unwind-probes", cl::init(false), cl::Hidden,
+  cl::desc("Convert may-unwind calls inside instrumented regions to "
+           "invokes with a cleanup pad that fires the end probe, so "
+           "panics close the region instead of leaking its sample")
+);
 
 namespace {
 
-static bool isPrimaryPackage() {
-  const char *P = getenv("CARGO_PRIMARY_PACKAGE");
-  return P && strcmp(P, "1") == 0;
+constexpr const char *REGISTER_STATIC_TABLE_FN =
+    "cpu_cycle_register_static_table";
+
+/// A probe-free unsafe region accounted via static estimation. Counter is
+/// a per-region placeholder until registration packs every region's slot
+/// into one contiguous module array.
+struct StaticBlockInfo {
+  uint32_t Id;
+  uint64_t EstimatedCycles;
+  GlobalVariable *Counter;
+};
+
+// Names of the thread-local accumulators used by the inline probe mode.
+constexpr const char *TLS_CYCLES_NAME = "__cpu_cycle_tls_cycles";
+constexpr const char *TLS_COUNT_NAME = "__cpu_cycle_tls_count";
+constexpr const char *TLS_DISCARDED_NAME = "__cpu_cycle_tls_discarded";
+
+// perf_event probe support: the runtime hook that opens and mmaps the
+// counter (perf_event_open with rdpmc enabled) and the global where it
+// publishes the rdpmc counter index for the inline reads.
+constexpr const char *PMC_INIT_FN = "cpu_cycle_pmc_init";
+constexpr const char *PMC_INDEX_NAME = "__cpu_cycle_pmc_index";
+
+// Folded-stack support: the shadow-stack maintenance hooks, the hook the
+// ctor hands the ID-indexed name table to, and the exit hook that writes
+// the folded lines.
+constexpr const char *STACK_PUSH_FN = "__cpu_cycle_stack_push";
+constexpr const char *STACK_POP_FN = "__cpu_cycle_stack_pop";
+constexpr const char *REGISTER_STACK_NAMES_FN =
+    "cpu_cycle_register_stack_names";
+constexpr const char *DUMP_FOLDED_FN = "cpu_cycle_dump_folded_stacks";
+
+// Scope attribution: the end probe variant that takes a scope ID and the
+// runtime hook the ctor hands the per-module scope-name table to.
+constexpr const char *END_MEASUREMENT_SCOPED_FN =
+    "cpu_cycle_end_measurement_scoped";
+constexpr const char *REGISTER_SCOPE_TABLE_FN =
+    "cpu_cycle_register_scope_table";
+
+// Region correlation: the end probe variant that carries the shared region
+// key (-unsafe-region-correlate), the same key HeapTracker tags its access
+// records with, so the aggregator can join cycles to memory traffic per
+// unsafe region.
+constexpr const char *END_MEASUREMENT_REGION_FN =
+    "cpu_cycle_end_measurement_region";
+
+// Task-context attribution: the end probe variant that also charges the
+// delta to the TLS task-context slot (-cpu-cycle-task-context).
+constexpr const char *END_MEASUREMENT_TASK_FN =
+    "cpu_cycle_end_measurement_task";
+
+// Unwind hardening: the end probe variant the cleanup pads fire
+// (-cpu-cycle-unwind-probes). It folds the delta in like a normal end and
+// counts the sample as unwound, so the dump separates panic-path samples.
+constexpr const char *END_MEASUREMENT_UNWIND_FN =
+    "cpu_cycle_end_measurement_unwind";
+
+/// Dense per-module numbering of the source scopes unsafe regions were
+/// written in. ID 0 is reserved for regions without debug info.
+struct ScopeTable {
+  DenseMap<const DISubprogram *, uint32_t> Ids;
+  SmallVector<StringRef, 16> Names;
+};
+
+/// Returns the scope ID for \p BeginMarker, assigning one on first sight.
+///
+/// The region's own DILocation scope is the function the region was written
+/// in; following getInlinedAt would walk outward to the post-inlining
+/// callers, which is exactly the attribution we are trying to undo.
+uint32_t getScopeId(ScopeTable &Scopes, Instruction *BeginMarker) {
+  if (Scopes.Names.empty())
+    Scopes.Names.push_back("<unknown>");
+
+  const DILocation *Loc = BeginMarker->getDebugLoc();
+  const DISubprogram *SP = Loc ? Loc->getScope()->getSubprogram() : nullptr;
+  if (!SP)
+    return 0;
+
+  auto [It, Inserted] = Scopes.Ids.try_emplace(SP, Scopes.Names.size());
+  if (Inserted)
+    Scopes.Names.push_back(SP->getLinkageName().empty()
+                               ? SP->getName()
+                               : SP->getLinkageName());
+  return It->second;
+}
+
+/// Emits the scope-name table and a constructor that registers it:
+/// cpu_cycle_register_scope_table(names, count). The runtime indexes it
+/// with the IDs the scoped end probes pass.
+///
+/// Under -unsafe-name-sidecar-dir the table entries are null and the names
+/// go to a compile-time sidecar; the runtime prints "id:<n>" scope rows
+/// that llvm-unsafe-stats re-symbolizes offline.
+void setupScopeTableRegistration(Module &M, const ScopeTable &Scopes) {
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+
+  NumCycleScopesEmitted += Scopes.Names.size();
+
+  std::unique_ptr<raw_fd_ostream> Sidecar =
+      openUnsafeNameSidecar(M, ".unsafe_scopes.tsv");
+
+  IRBuilder<> NameBuilder(Ctx);
+  std::vector<Constant *> NamePtrs;
+  for (StringRef Name : Scopes.Names) {
+    if (Sidecar) {
+      *Sidecar << "scope\t" << NamePtrs.size() << '\t' << Name << '\n';
+      NamePtrs.push_back(
+          ConstantPointerNull::get(cast<PointerType>(Int8PtrTy)));
+      continue;
+    }
+    NamePtrs.push_back(NameBuilder.CreateGlobalStringPtr(
+        Name, "__cpu_cycle_scope_name", 0, &M));
+  }
+
+  ArrayType *TableTy = ArrayType::get(Int8PtrTy, NamePtrs.size());
+  auto *TableGV = new GlobalVariable(
+      M, TableTy, /*isConstant=*/true, GlobalValue::InternalLinkage,
+      ConstantArray::get(TableTy, NamePtrs), "__cpu_cycle_scope_names");
+
+  FunctionCallee RegisterFn = M.getOrInsertFunction(
+      REGISTER_SCOPE_TABLE_FN,
+      FunctionType::get(VoidTy, {Int8PtrTy, Int32Ty}, false));
+
+  Function *Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "cpu_cycle_scope_table_ctor", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Ctor);
+  IRBuilder<> Builder(BB);
+  Builder.CreateCall(RegisterFn,
+                     {Builder.CreateBitCast(TableGV, Int8PtrTy),
+                      ConstantInt::get(Int32Ty, Scopes.Names.size())});
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, 0);
+}
+
+// Latency histograms (-cpu-cycle-region-histograms): the keyed end-probe
+// variant that also buckets the delta, and the hook the ctor hands the
+// static bucket tables to.
+constexpr const char *END_MEASUREMENT_HIST_FN =
+    "cpu_cycle_end_measurement_hist";
+constexpr const char *REGISTER_REGION_HIST_FN =
+    "cpu_cycle_register_region_histograms";
+constexpr unsigned RegionHistBuckets = 16;
+
+/// One function's histogram table: Table holds NumRegions rows of
+/// RegionHistBuckets u32 counters the end probes update directly through
+/// per-region row pointers; Keys[i] labels row i with its shared region
+/// key for the dump.
+struct RegionHistTable {
+  GlobalVariable *Table;
+  GlobalVariable *Keys;
+  uint32_t NumRegions;
+};
+
+/// Emits one ctor registering every collected histogram table:
+/// cpu_cycle_register_region_histograms(buckets, keys, num_regions) per
+/// table. The runtime never writes the rows — the end probes do, through
+/// the row pointers they carry — it only reads them at dump time,
+/// deriving each region's min/max/p99 from the power-of-two bucket
+/// bounds.
+void setupRegionHistRegistration(Module &M, ArrayRef<RegionHistTable> Tables) {
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+
+  FunctionCallee RegisterFn = M.getOrInsertFunction(
+      REGISTER_REGION_HIST_FN,
+      FunctionType::get(VoidTy, {Int8PtrTy, Int8PtrTy, Int32Ty}, false));
+
+  Function *Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "cpu_cycle_region_hist_ctor", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Ctor);
+  IRBuilder<> Builder(BB);
+  for (const RegionHistTable &T : Tables)
+    Builder.CreateCall(RegisterFn,
+                       {Builder.CreateBitCast(T.Table, Int8PtrTy),
+                        Builder.CreateBitCast(T.Keys, Int8PtrTy),
+                        ConstantInt::get(Int32Ty, T.NumRegions)});
+  Builder.CreateRetVoid();
+  placeUnsafeInstrThunk(Ctor);
+  appendToGlobalCtors(M, Ctor, 0);
+}
+
+// Innermost attribution: the runtime hook the ctor hands the static
+// nesting table to (-cpu-cycle-depth-attribution).
+constexpr const char *REGISTER_REGION_NESTING_FN =
+    "cpu_cycle_register_region_nesting";
+
+/// One row of the static nesting table: the region's shared key (what the
+/// region-keyed end probe reports), its lexical depth, and the keys of its
+/// innermost lexical block and that block's parent, as recorded by
+/// InstMarkerPass in unsafe_region_nesting metadata. ParentKey links rows
+/// into the nesting tree: a row whose ScopeKey equals another row's
+/// ParentKey encloses it.
+struct RegionNestingRow {
+  uint32_t RegionKey = 0;
+  uint32_t Depth = 0;
+  uint32_t ScopeKey = 0;
+  uint32_t ParentKey = 0;
+};
+
+/// Reads the unsafe_region_nesting record off \p BeginMarker into \p Row
+/// (RegionKey is left for the caller); returns false when the marker
+/// carries no well-formed record — regions marked without
+/// -instmarker-region-depth simply stay out of the table and are reported
+/// flat.
+bool readRegionNesting(const Instruction *BeginMarker, RegionNestingRow &Row) {
+  MDNode *MD = BeginMarker->getMetadata(UnsafeRegionNestingMD);
+  if (!MD || MD->getNumOperands() != 3)
+    return false;
+  auto ReadOp = [&](unsigned Idx, uint32_t &Out) {
+    auto *CAM = dyn_cast<ConstantAsMetadata>(MD->getOperand(Idx));
+    if (!CAM)
+      return false;
+    Out = cast<ConstantInt>(CAM->getValue())->getZExtValue();
+    return true;
+  };
+  return ReadOp(0, Row.Depth) && ReadOp(1, Row.ScopeKey) &&
+         ReadOp(2, Row.ParentKey);
+}
+
+/// Emits the nesting table and a constructor that registers it:
+/// cpu_cycle_register_region_nesting(rows, count). Rows are flat i32
+/// quadruples (region key, depth, scope key, parent key); the runtime
+/// rebuilds the tree once at startup and subtracts child-scope cycles
+/// from ancestors when printing innermost-only totals.
+void setupNestingTableRegistration(Module &M,
+                                   ArrayRef<RegionNestingRow> Rows) {
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+
+  std::vector<Constant *> Words;
+  Words.reserve(Rows.size() * 4);
+  for (const RegionNestingRow &Row : Rows) {
+    Words.push_back(ConstantInt::get(Int32Ty, Row.RegionKey));
+    Words.push_back(ConstantInt::get(Int32Ty, Row.Depth));
+    Words.push_back(ConstantInt::get(Int32Ty, Row.ScopeKey));
+    Words.push_back(ConstantInt::get(Int32Ty, Row.ParentKey));
+  }
+  ArrayType *TableTy = ArrayType::get(Int32Ty, Words.size());
+  auto *TableGV = new GlobalVariable(
+      M, TableTy, /*isConstant=*/true, GlobalValue::InternalLinkage,
+      ConstantArray::get(TableTy, Words), "__cpu_cycle_region_nesting");
+
+  FunctionCallee RegisterFn = M.getOrInsertFunction(
+      REGISTER_REGION_NESTING_FN,
+      FunctionType::get(VoidTy, {Int8PtrTy, Int32Ty}, false));
+
+  Function *Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "cpu_cycle_region_nesting_ctor", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Ctor);
+  IRBuilder<> Builder(BB);
+  Builder.CreateCall(RegisterFn,
+                     {Builder.CreateBitCast(TableGV, Int8PtrTy),
+                      ConstantInt::get(Int32Ty, Rows.size())});
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, 0);
+}
+
+// Per-thread per-function accumulator arrays and the runtime hook that
+// flushes them when a thread exits.
+constexpr const char *TLS_FUNC_CYCLES_NAME = "__cpu_cycle_tls_func_cycles";
+constexpr const char *TLS_FUNC_COUNTS_NAME = "__cpu_cycle_tls_func_counts";
+constexpr const char *REGISTER_THREAD_FLUSH_FN =
+    "cpu_cycle_register_thread_flush";
+constexpr const char *FLUSH_THREAD_TOTALS_FN =
+    "cpu_cycle_flush_thread_totals";
+
+/// Returns (creating on first use) an internal thread-local i64 accumulator.
+GlobalVariable *getOrCreateTLSAccumulator(Module &M, StringRef Name) {
+  if (GlobalVariable *GV = M.getGlobalVariable(Name, /*AllowInternal=*/true))
+    return GV;
+
+  Type *Int64Ty = Type::getInt64Ty(M.getContext());
+  auto *GV = new GlobalVariable(M, Int64Ty, /*isConstant=*/false,
+                                GlobalValue::InternalLinkage,
+                                ConstantInt::get(Int64Ty, 0), Name);
+  GV->setThreadLocal(true);
+  GV->setAlignment(Align(8));
+  return GV;
+}
+
+/// Returns (creating on first use) the global where the runtime publishes
+/// the rdpmc counter index after cpu_cycle_pmc_init programs the event.
+GlobalVariable *getOrCreatePmcIndexGlobal(Module &M) {
+  if (GlobalVariable *GV = M.getGlobalVariable(PMC_INDEX_NAME))
+    return GV;
+  return new GlobalVariable(M, Type::getInt32Ty(M.getContext()),
+                            /*isConstant=*/false, GlobalValue::ExternalLinkage,
+                            /*Initializer=*/nullptr, PMC_INDEX_NAME);
+}
+
+/// Emits an inline-asm counter read at the builder's insertion point.
+///
+/// TSC source: the start side uses rdtsc; the end side uses rdtscp, whose
+/// implied serialization guarantees prior instructions have retired.
+/// RdPMC source: rdpmc against the index the runtime published. rdpmc has
+/// no implied ordering, so the end read carries an lfence where rdtscp
+/// relied on its own.
+Value *emitCounterRead(IRBuilder<> &Builder, bool End) {
+  Type *Int64Ty = Builder.getInt64Ty();
+
+  if (ProbeSourceMode == ProbeSource::RdPMC) {
+    Module &M = *Builder.GetInsertBlock()->getModule();
+    Type *Int32Ty = Builder.getInt32Ty();
+    Value *Idx =
+        Builder.CreateLoad(Int32Ty, getOrCreatePmcIndexGlobal(M));
+    FunctionType *AsmTy = FunctionType::get(Int64Ty, {Int32Ty}, false);
+    InlineAsm *IA = InlineAsm::get(
+        AsmTy,
+        End ? "lfence; rdpmc; shlq $$32, %rdx; orq %rdx, %rax"
+            : "rdpmc; shlq $$32, %rdx; orq %rdx, %rax",
+        "={ax},{cx},~{dx}", /*hasSideEffects=*/true);
+    return Builder.CreateCall(IA, {Idx});
+  }
+
+  FunctionType *AsmTy = FunctionType::get(Int64Ty, false);
+  InlineAsm *IA =
+      End ? InlineAsm::get(AsmTy,
+                           "rdtscp; shlq $$32, %rdx; orq %rdx, %rax",
+                           "={ax},~{dx},~{cx}", /*hasSideEffects=*/true)
+          : InlineAsm::get(AsmTy, "rdtsc; shlq $$32, %rdx; orq %rdx, %rax",
+                           "={ax},~{dx}", /*hasSideEffects=*/true);
+  return Builder.CreateCall(IA);
+}
+
+/// Emits an rdtscp read returning the cycle count and leaving the
+/// IA32_TSC_AUX word in \p AuxOut. The migration filter needs the aux word
+/// on both sides of a region, so the start side accepts rdtscp's implied
+/// ordering in place of plain rdtsc.
+Value *emitCounterReadWithAux(IRBuilder<> &Builder, Value *&AuxOut) {
+  Type *Int64Ty = Builder.getInt64Ty();
+  StructType *PairTy = StructType::get(Int64Ty, Builder.getInt32Ty());
+  FunctionType *AsmTy = FunctionType::get(PairTy, false);
+  InlineAsm *IA =
+      InlineAsm::get(AsmTy, "rdtscp; shlq $$32, %rdx; orq %rdx, %rax",
+                     "={ax},={cx},~{dx}", /*hasSideEffects=*/true);
+  Value *Pair = Builder.CreateCall(IA);
+  AuxOut = Builder.CreateExtractValue(Pair, 1);
+  return Builder.CreateExtractValue(Pair, 0);
+}
+
+// Trace-mode names: the per-thread event buffer (two i64 words per
+// event), its cursor, the previous-event counter value the deltas are
+// taken against, and the flush hook.
+constexpr const char *TLS_TRACE_BUF_NAME = "__cpu_cycle_trace_buf";
+constexpr const char *TLS_TRACE_CURSOR_NAME = "__cpu_cycle_trace_cursor";
+constexpr const char *TLS_TRACE_PREV_NAME = "__cpu_cycle_trace_prev";
+constexpr const char *TRACE_FLUSH_FN = "cpu_cycle_trace_flush";
+
+/// Returns (creating on first use) the per-thread trace buffer and its
+/// cursor. On creation, also registers a destructor that flushes any
+/// partial buffer, so the tail of the main thread's trace is not lost.
+std::pair<GlobalVariable *, GlobalVariable *>
+getOrCreateTraceBuffer(Module &M) {
+  GlobalVariable *Buf =
+      M.getGlobalVariable(TLS_TRACE_BUF_NAME, /*AllowInternal=*/true);
+  GlobalVariable *Cursor =
+      M.getGlobalVariable(TLS_TRACE_CURSOR_NAME, /*AllowInternal=*/true);
+  if (Buf && Cursor)
+    return {Buf, Cursor};
+
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Type *Int8PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+
+  ArrayType *BufTy = ArrayType::get(Int64Ty, 2 * CycleTraceBufferSize);
+  Buf = new GlobalVariable(M, BufTy, /*isConstant=*/false,
+                           GlobalValue::InternalLinkage,
+                           ConstantAggregateZero::get(BufTy),
+                           TLS_TRACE_BUF_NAME);
+  Buf->setThreadLocal(true);
+  Buf->setAlignment(Align(8));
+  Cursor = new GlobalVariable(M, Int64Ty, /*isConstant=*/false,
+                              GlobalValue::InternalLinkage,
+                              ConstantInt::get(Int64Ty, 0),
+                              TLS_TRACE_CURSOR_NAME);
+  Cursor->setThreadLocal(true);
+  Cursor->setAlignment(Align(8));
+
+  // cpu_cycle_trace_flush(events, word_count): the runtime varint-encodes
+  // the (region-key, delta) words into the per-thread trace file; raw
+  // words cross this boundary so the hot path never encodes anything.
+  FunctionCallee FlushFn = M.getOrInsertFunction(
+      TRACE_FLUSH_FN,
+      FunctionType::get(VoidTy, {Int8PtrTy, Int64Ty}, false));
+
+  Function *Dtor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "cpu_cycle_trace_flush_dtor", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Dtor);
+  IRBuilder<> Builder(BB);
+  // The flush symbol is also called from the hot buffer-full path, so the
+  // convention must match there and here.
+  setUnsafeProbeCallConv(
+      Builder.CreateCall(FlushFn, {Builder.CreateBitCast(Buf, Int8PtrTy),
+                                   Builder.CreateLoad(Int64Ty, Cursor)}));
+  Builder.CreateStore(ConstantInt::get(Int64Ty, 0), Cursor);
+  Builder.CreateRetVoid();
+  appendToGlobalDtors(M, Dtor, 0);
+
+  return {Buf, Cursor};
+}
+
+/// Instruments unsafe blocks for execution-order tracing: the begin probe
+/// reads the counter, takes the delta against the thread's previous trace
+/// event, and appends (region-key, delta) to the per-thread buffer,
+/// calling the flush hook only when the buffer fills. Region ends emit
+/// nothing — for ordering questions the begin events carry everything,
+/// and half the events means half the distortion.
+bool instrumentUnsafeBlocksTrace(
+    Function &F, const DenseMap<Instruction *, unsigned> &RegionIndexOf,
+    SmallVectorImpl<std::pair<Instruction *, Instruction *>> &Pairs) {
+  Module &M = *F.getParent();
+  LLVMContext &Ctx = F.getContext();
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Type *Int8PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+  auto [Buf, Cursor] = getOrCreateTraceBuffer(M);
+  GlobalVariable *Prev = getOrCreateTLSAccumulator(M, TLS_TRACE_PREV_NAME);
+  FunctionCallee FlushFn = M.getOrInsertFunction(
+      TRACE_FLUSH_FN,
+      FunctionType::get(Type::getVoidTy(Ctx), {Int8PtrTy, Int64Ty}, false));
+
+  for (auto [BeginMarker, EndMarker] : Pairs) {
+    IRBuilder<> Builder(BeginMarker);
+    Value *Now = emitCounterRead(Builder, /*End=*/false);
+    Value *Delta = Builder.CreateSub(Now, Builder.CreateLoad(Int64Ty, Prev));
+    Builder.CreateStore(Now, Prev);
+
+    Value *Key = ConstantInt::get(
+        Int64Ty, unsafeRegionKey(F, RegionIndexOf.lookup(BeginMarker)));
+    Value *Cur = Builder.CreateLoad(Int64Ty, Cursor);
+    Value *Zero = ConstantInt::get(Int64Ty, 0);
+    Value *KeyIdx[] = {Zero, Cur};
+    Builder.CreateStore(
+        Key, Builder.CreateInBoundsGEP(Buf->getValueType(), Buf, KeyIdx));
+    Value *DeltaSlot = Builder.CreateAdd(Cur, ConstantInt::get(Int64Ty, 1));
+    Value *DeltaIdx[] = {Zero, DeltaSlot};
+    Builder.CreateStore(
+        Delta, Builder.CreateInBoundsGEP(Buf->getValueType(), Buf, DeltaIdx));
+    Value *Inc = Builder.CreateAdd(Cur, ConstantInt::get(Int64Ty, 2));
+    Builder.CreateStore(Inc, Cursor);
+
+    Value *Full = Builder.CreateICmpEQ(
+        Inc, ConstantInt::get(Int64Ty, 2 * CycleTraceBufferSize));
+    Instruction *Then = SplitBlockAndInsertIfThen(
+        Full, BeginMarker, /*Unreachable=*/false,
+        unsafeProbeBranchWeights(Ctx));
+    IRBuilder<> ThenBuilder(Then);
+    setUnsafeProbeCallConv(ThenBuilder.CreateCall(
+        FlushFn, {ThenBuilder.CreateBitCast(Buf, Int8PtrTy),
+                  ConstantInt::get(Int64Ty, 2 * CycleTraceBufferSize)}));
+    ThenBuilder.CreateStore(ConstantInt::get(Int64Ty, 0), Cursor);
+  }
+
+  return !Pairs.empty();
+}
+
+/// Instruments unsafe blocks with inline TSC reads and TLS accumulation.
+/// No external calls are emitted on the fast path; the accumulated totals
+/// are flushed via cpu_cycle_record_inline_totals from a destructor.
+bool instrumentUnsafeBlocksInline(
+    Function &F,
+    SmallVectorImpl<std::pair<Instruction *, Instruction *>> &Pairs) {
+  Module &M = *F.getParent();
+  Type *Int64Ty = Type::getInt64Ty(F.getContext());
+  GlobalVariable *TLSCycles = getOrCreateTLSAccumulator(M, TLS_CYCLES_NAME);
+  GlobalVariable *TLSCount = getOrCreateTLSAccumulator(M, TLS_COUNT_NAME);
+  bool FilterMigration =
+      CycleMigrationFilter && ProbeSourceMode == ProbeSource::TSC;
+  GlobalVariable *TLSDiscarded =
+      FilterMigration ? getOrCreateTLSAccumulator(M, TLS_DISCARDED_NAME)
+                      : nullptr;
+
+  for (auto [BeginMarker, EndMarker] : Pairs) {
+    IRBuilder<> BeginBuilder(BeginMarker);
+    Value *StartAux = nullptr;
+    Value *Start = FilterMigration
+                       ? emitCounterReadWithAux(BeginBuilder, StartAux)
+                       : emitCounterRead(BeginBuilder, /*End=*/false);
+
+    IRBuilder<> EndBuilder(EndMarker);
+    Value *EndAux = nullptr;
+    Value *End = FilterMigration ? emitCounterReadWithAux(EndBuilder, EndAux)
+                                 : emitCounterRead(EndBuilder, /*End=*/true);
+    Value *Delta = EndBuilder.CreateSub(End, Start);
+
+    Value *One = ConstantInt::get(Int64Ty, 1);
+    Value *Taken = One;
+    if (FilterMigration) {
+      // Select form rather than a branch: migrations are rare enough to
+      // predict, but the selects keep the fast path straight-line and the
+      // discarded bump is just an add of 0 or 1.
+      Value *SameCpu = EndBuilder.CreateICmpEQ(StartAux, EndAux);
+      Delta = EndBuilder.CreateSelect(SameCpu, Delta,
+                                      ConstantInt::get(Int64Ty, 0));
+      Taken = EndBuilder.CreateZExt(SameCpu, Int64Ty);
+      Value *Disc = EndBuilder.CreateLoad(Int64Ty, TLSDiscarded);
+      EndBuilder.CreateStore(
+          EndBuilder.CreateAdd(Disc, EndBuilder.CreateSub(One, Taken)),
+          TLSDiscarded);
+    }
+
+    Value *Cycles = EndBuilder.CreateLoad(Int64Ty, TLSCycles);
+    EndBuilder.CreateStore(EndBuilder.CreateAdd(Cycles, Delta), TLSCycles);
+    Value *Count = EndBuilder.CreateLoad(Int64Ty, TLSCount);
+    EndBuilder.CreateStore(EndBuilder.CreateAdd(Count, Taken), TLSCount);
+  }
+
+  return !Pairs.empty();
+}
+
+/// Reads the function ID attached by UnsafeFunctionTrackerPass, or
+/// UINT32_MAX when the function was not tracked.
+uint32_t getTrackedFunctionId(const Function &F) {
+  MDNode *MD =
+      F.getMetadata(UnsafeFunctionTrackerPass::FUNCTION_ID_METADATA);
+  if (!MD)
+    return UINT32_MAX;
+  auto *CMD = cast<ConstantAsMetadata>(MD->getOperand(0));
+  return cast<ConstantInt>(CMD->getValue())->getZExtValue();
+}
+
+// Self-calibration support: the hook the dispatcher reports each timed call
+// to. Keyed by the emitted name string's address; the runtime interns it.
+constexpr const char *CALIBRATE_RECORD_FN = "cpu_cycle_calibrate_record";
+
+/// Erases the region markers (and the marker attribute) from \p F without
+/// inserting probes, leaving the probe-free reference body.
+void stripRegionMarkers(Function &F) {
+  SmallVector<Instruction *, 16> Markers;
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB)
+      if (auto *CB = dyn_cast<CallBase>(&I)) {
+        Function *Callee = CB->getCalledFunction();
+        if (Callee &&
+            (Callee->getIntrinsicID() == Intrinsic::unsafe_region_begin ||
+             Callee->getIntrinsicID() == Intrinsic::unsafe_region_end))
+          Markers.push_back(&I);
+      }
+  for (Instruction *Marker : Markers)
+    Marker->eraseFromParent();
+  F.removeFnAttr("unsafe-region-markers");
+}
+
+/// Builds the self-calibration shape for \p F: two internal clones — one
+/// keeps its markers and is instrumented like any other function, one has
+/// them stripped — and a dispatcher in F's place that sends one in
+/// -cpu-cycle-calibrate-rate calls through the probe-free clone, timing
+/// either side with inline counter reads and reporting the delta to the
+/// runtime under F's name. Returns the marker-carrying clone for the caller
+/// to instrument, or null when F cannot be dispatched (varargs).
+Function *setupSelfCalibration(Function &F) {
+  if (F.isVarArg())
+    return nullptr;
+
+  Module &M = *F.getParent();
+  LLVMContext &Ctx = F.getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+
+  ValueToValueMapTy ImplMap, RefMap;
+  Function *Impl = CloneFunction(&F, ImplMap);
+  Impl->setName(F.getName() + ".cycle_impl");
+  Impl->setLinkage(GlobalValue::InternalLinkage);
+  Function *Ref = CloneFunction(&F, RefMap);
+  Ref->setName(F.getName() + ".cycle_ref");
+  Ref->setLinkage(GlobalValue::InternalLinkage);
+  stripRegionMarkers(*Ref);
+
+  // cpu_cycle_calibrate_record(name, cycles, is_reference)
+  FunctionCallee RecordFn = M.getOrInsertFunction(
+      CALIBRATE_RECORD_FN,
+      FunctionType::get(Type::getVoidTy(Ctx),
+                        {Int8PtrTy, Int64Ty, Int32Ty}, false));
+
+  // The original becomes the dispatcher: a thread-local tick counter picks
+  // the reference path once every N calls, so the calibration sample is
+  // spread over the run rather than front-loaded.
+  F.deleteBody();
+  F.removeFnAttr("unsafe-region-markers");
+  BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", &F);
+
+  auto *Tick = new GlobalVariable(M, Int32Ty, /*isConstant=*/false,
+                                  GlobalValue::InternalLinkage,
+                                  ConstantInt::get(Int32Ty, 0),
+                                  F.getName() + ".calib_tick");
+  Tick->setThreadLocal(true);
+
+  IRBuilder<> Builder(Entry);
+  Value *NamePtr = Builder.CreateGlobalStringPtr(
+      F.getName(), "__cpu_cycle_calib_name", 0, &M);
+  Value *T = Builder.CreateLoad(Int32Ty, Tick);
+  Value *Next = Builder.CreateURem(
+      Builder.CreateAdd(T, ConstantInt::get(Int32Ty, 1)),
+      ConstantInt::get(Int32Ty, CycleCalibrateRate));
+  Builder.CreateStore(Next, Tick);
+  Value *TakeRef =
+      Builder.CreateICmpEQ(Next, ConstantInt::get(Int32Ty, 0));
+
+  BasicBlock *RefBB = BasicBlock::Create(Ctx, "reference", &F);
+  BasicBlock *ImplBB = BasicBlock::Create(Ctx, "measured", &F);
+  // The 1-in-N reference path is the cold arm; keep the measured path
+  // laid out straight.
+  Builder.CreateCondBr(TakeRef, RefBB, ImplBB, unsafeProbeBranchWeights(Ctx));
+
+  SmallVector<Value *, 8> Args;
+  for (Argument &A : F.args())
+    Args.push_back(&A);
+
+  // Both arms time the forwarded call and return its result directly; no
+  // join block, so the timed window contains nothing but the call.
+  auto EmitArm = [&](BasicBlock *BB, Function *Callee, bool IsRef) {
+    IRBuilder<> ArmBuilder(BB);
+    Value *Start = emitCounterRead(ArmBuilder, /*End=*/false);
+    CallInst *Call = ArmBuilder.CreateCall(Callee, Args);
+    Call->setCallingConv(F.getCallingConv());
+    Value *End = emitCounterRead(ArmBuilder, /*End=*/true);
+    setUnsafeProbeCallConv(
+        ArmBuilder.CreateCall(RecordFn,
+                              {NamePtr, ArmBuilder.CreateSub(End, Start),
+                               ConstantInt::get(Int32Ty, IsRef ? 1 : 0)}));
+    if (F.getReturnType()->isVoidTy())
+      ArmBuilder.CreateRetVoid();
+    else
+      ArmBuilder.CreateRet(Call);
+  };
+  EmitArm(RefBB, Ref, /*IsRef=*/true);
+  EmitArm(ImplBB, Impl, /*IsRef=*/false);
+
+  ++NumCycleFunctionsCalibrated;
+  return Impl;
+}
+
+/// Returns (creating on first use) a per-thread [NumSlots x i64] array.
+GlobalVariable *getOrCreateTLSFuncArray(Module &M, StringRef Name,
+                                        uint64_t NumSlots) {
+  if (GlobalVariable *GV = M.getGlobalVariable(Name, /*AllowInternal=*/true))
+    return GV;
+
+  ArrayType *ArrayTy =
+      ArrayType::get(Type::getInt64Ty(M.getContext()), NumSlots);
+  auto *GV = new GlobalVariable(M, ArrayTy, /*isConstant=*/false,
+                                GlobalValue::InternalLinkage,
+                                ConstantAggregateZero::get(ArrayTy), Name);
+  GV->setThreadLocal(true);
+  GV->setAlignment(Align(8));
+  return GV;
+}
+
+/// Per-thread instrumentation: accumulate each region's cycle delta into the
+/// calling thread's array slot for this function. No shared state is touched
+/// on the fast path.
+void instrumentUnsafeBlocksPerThread(
+    Function &F, uint64_t SlotIndex, uint64_t NumSlots,
+    SmallVectorImpl<std::pair<Instruction *, Instruction *>> &Pairs) {
+  Module &M = *F.getParent();
+  Type *Int64Ty = Type::getInt64Ty(F.getContext());
+  GlobalVariable *FuncCycles =
+      getOrCreateTLSFuncArray(M, TLS_FUNC_CYCLES_NAME, NumSlots);
+  GlobalVariable *FuncCounts =
+      getOrCreateTLSFuncArray(M, TLS_FUNC_COUNTS_NAME, NumSlots);
+
+  for (auto [BeginMarker, EndMarker] : Pairs) {
+    IRBuilder<> BeginBuilder(BeginMarker);
+    Value *Start = emitCounterRead(BeginBuilder, /*End=*/false);
+
+    IRBuilder<> EndBuilder(EndMarker);
+    Value *End = emitCounterRead(EndBuilder, /*End=*/true);
+    Value *Delta = EndBuilder.CreateSub(End, Start);
+
+    Value *Idx[] = {ConstantInt::get(Int64Ty, 0),
+                    ConstantInt::get(Int64Ty, SlotIndex)};
+    Value *CyclesSlot = EndBuilder.CreateInBoundsGEP(
+        FuncCycles->getValueType(), FuncCycles, Idx);
+    Value *Cycles = EndBuilder.CreateLoad(Int64Ty, CyclesSlot);
+    EndBuilder.CreateStore(EndBuilder.CreateAdd(Cycles, Delta), CyclesSlot);
+
+    Value *CountSlot = EndBuilder.CreateInBoundsGEP(
+        FuncCounts->getValueType(), FuncCounts, Idx);
+    Value *Count = EndBuilder.CreateLoad(Int64Ty, CountSlot);
+    EndBuilder.CreateStore(
+        EndBuilder.CreateAdd(Count, ConstantInt::get(Int64Ty, 1)), CountSlot);
+  }
+}
+
+/// Registers the per-thread flush callback with the runtime and flushes the
+/// main thread's array from a destructor. The runtime invokes the callback
+/// from each exiting thread; TLS resolves to that thread's arrays.
+void setupPerThreadFlushHooks(Module &M, uint64_t NumSlots) {
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+
+  GlobalVariable *FuncCycles =
+      getOrCreateTLSFuncArray(M, TLS_FUNC_CYCLES_NAME, NumSlots);
+  GlobalVariable *FuncCounts =
+      getOrCreateTLSFuncArray(M, TLS_FUNC_COUNTS_NAME, NumSlots);
+
+  // cpu_cycle_flush_thread_totals(cycles, counts, num_slots)
+  FunctionCallee FlushFn = M.getOrInsertFunction(
+      FLUSH_THREAD_TOTALS_FN,
+      FunctionType::get(VoidTy, {Int8PtrTy, Int8PtrTy, Int32Ty}, false));
+
+  Function *FlushThunk = Function::Create(FunctionType::get(VoidTy, false),
+                                          GlobalValue::InternalLinkage,
+                                          "cpu_cycle_thread_flush", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", FlushThunk);
+  IRBuilder<> Builder(BB);
+  Builder.CreateCall(FlushFn,
+                     {Builder.CreateBitCast(FuncCycles, Int8PtrTy),
+                      Builder.CreateBitCast(FuncCounts, Int8PtrTy),
+                      ConstantInt::get(Int32Ty, NumSlots)});
+  Builder.CreateRetVoid();
+
+  // cpu_cycle_register_thread_flush(callback)
+  FunctionCallee RegisterFn = M.getOrInsertFunction(
+      REGISTER_THREAD_FLUSH_FN,
+      FunctionType::get(VoidTy, {Int8PtrTy}, false));
+
+  Function *Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "cpu_cycle_per_thread_ctor", &M);
+  BasicBlock *CtorBB = BasicBlock::Create(Ctx, "entry", Ctor);
+  IRBuilder<> CtorBuilder(CtorBB);
+  CtorBuilder.CreateCall(RegisterFn,
+                         {CtorBuilder.CreateBitCast(FlushThunk, Int8PtrTy)});
+  CtorBuilder.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, 0);
+
+  // The main thread never goes through the runtime's thread-exit hook, so
+  // flush its arrays from a destructor as well.
+  appendToGlobalDtors(M, FlushThunk, 0);
+}
+
+/// Registers a destructor that hands the thread-local totals to the runtime.
+/// Note: this flushes the main thread's accumulators; worker threads are
+/// covered once the runtime hooks thread exit.
+void setupInlineFlushHook(Module &M) {
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+
+  // cpu_cycle_record_inline_totals(cycles, count, discarded): discarded
+  // counts the deltas the migration filter threw away, and stays zero
+  // without -cpu-cycle-migration-filter. The runtime takes the third
+  // operand in lockstep.
+  FunctionCallee RecordTotalsFn = M.getOrInsertFunction(
+      RECORD_INLINE_TOTALS_FN,
+      FunctionType::get(VoidTy, {Int64Ty, Int64Ty, Int64Ty}, false));
+
+  Function *Dtor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "cpu_cycle_inline_flush", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Dtor);
+  IRBuilder<> Builder(BB);
+  Value *Cycles = Builder.CreateLoad(
+      Int64Ty, getOrCreateTLSAccumulator(M, TLS_CYCLES_NAME));
+  Value *Count = Builder.CreateLoad(
+      Int64Ty, getOrCreateTLSAccumulator(M, TLS_COUNT_NAME));
+  Value *Discarded = Builder.CreateLoad(
+      Int64Ty, getOrCreateTLSAccumulator(M, TLS_DISCARDED_NAME));
+  Builder.CreateCall(RecordTotalsFn, {Cycles, Count, Discarded});
+  Builder.CreateRetVoid();
+  appendToGlobalDtors(M, Dtor, 0);
+}
+
+static bool isPrimaryPackage() { return isUnsafePrimaryPackage(); }
+
+/// Estimates the latency cost of the instructions strictly between the two
+/// markers. Returns false when any instruction has no valid static cost
+/// (calls into unknown code, etc.), in which case the region keeps its
+/// runtime probe.
+bool estimateRegionCost(Instruction *BeginMarker, Instruction *EndMarker,
+                        const TargetTransformInfo &TTI, uint64_t &Cost) {
+  Cost = 0;
+  for (Instruction *I = BeginMarker->getNextNode(); I && I != EndMarker;
+       I = I->getNextNode()) {
+    InstructionCost C =
+        TTI.getInstructionCost(I, TargetTransformInfo::TCK_Latency);
+    if (!C.isValid())
+      return false;
+    Cost += C.getValue().value_or(0);
+  }
+  return true;
+}
+
+/// Replaces the runtime probe for a statically costed region with a single
+/// relaxed executed-counter increment. The counter is a placeholder scalar
+/// here — the module's region count is not known yet; the registration
+/// step packs every placeholder into one contiguous array once it is.
+void instrumentStaticEstimate(Module &M, Instruction *BeginMarker,
+                              uint64_t EstimatedCycles,
+                              SmallVectorImpl<StaticBlockInfo> &StaticBlocks) {
+  Type *Int64Ty = Type::getInt64Ty(M.getContext());
+  uint32_t Id = StaticBlocks.size();
+  auto *Counter = new GlobalVariable(
+      M, Int64Ty, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      ConstantInt::get(Int64Ty, 0),
+      "__cpu_cycle_static_count." + Twine(Id));
+  Counter->setAlignment(Align(8));
+
+  IRBuilder<> Builder(BeginMarker);
+  Builder.CreateAtomicRMW(AtomicRMWInst::Add, Counter,
+                          ConstantInt::get(Int64Ty, 1), MaybeAlign(8),
+                          AtomicOrdering::Monotonic);
+
+  StaticBlocks.push_back({Id, EstimatedCycles, Counter});
+}
+
+/// Packs the per-region placeholder counters into one hot array and the
+/// estimates into one cold constant table, then registers both from a
+/// module constructor: cpu_cycle_register_static_table(est_cycles,
+/// counters, count, module_hash). The split is the point: the increments
+/// touch only the counter array, so a measurement run's working set is
+/// 8 bytes per region packed back to back, not counters scattered
+/// wherever the linker dropped the per-region scalars, and the estimates
+/// are read once at print time from rodata. Region IDs are dense module
+/// order, so the slot index is the ID and no id column is needed.
+/// module_hash qualifies this module's region IDs as before.
+void setupStaticBlockRegistration(Module &M,
+                                  ArrayRef<StaticBlockInfo> StaticBlocks) {
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+
+  ArrayType *TableTy = ArrayType::get(Int64Ty, StaticBlocks.size());
+  auto *CountersGV = new GlobalVariable(
+      M, TableTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      ConstantAggregateZero::get(TableTy), "__cpu_cycle_static_counts");
+  CountersGV->setAlignment(Align(8));
+  placeUnsafeTableGlobal(CountersGV);
+
+  std::vector<Constant *> Estimates;
+  Estimates.reserve(StaticBlocks.size());
+  for (const StaticBlockInfo &Block : StaticBlocks) {
+    Estimates.push_back(ConstantInt::get(Int64Ty, Block.EstimatedCycles));
+    Constant *Slot = ConstantExpr::getInBoundsGetElementPtr(
+        TableTy, CountersGV,
+        ArrayRef<Constant *>{ConstantInt::get(Int64Ty, 0),
+                             ConstantInt::get(Int64Ty, Block.Id)});
+    Block.Counter->replaceAllUsesWith(Slot);
+    Block.Counter->eraseFromParent();
+  }
+  auto *EstimatesGV = new GlobalVariable(
+      M, TableTy, /*isConstant=*/true, GlobalValue::InternalLinkage,
+      ConstantArray::get(TableTy, Estimates), "__cpu_cycle_static_cycles");
+  placeUnsafeTableGlobal(EstimatesGV);
+
+  FunctionCallee RegisterFn = M.getOrInsertFunction(
+      REGISTER_STATIC_TABLE_FN,
+      FunctionType::get(VoidTy, {Int8PtrTy, Int8PtrTy, Int32Ty, Int64Ty},
+                        false));
+
+  Function *Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "cpu_cycle_static_blocks_ctor", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Ctor);
+  IRBuilder<> Builder(BB);
+  Builder.CreateCall(RegisterFn,
+                     {Builder.CreateBitCast(EstimatesGV, Int8PtrTy),
+                      Builder.CreateBitCast(CountersGV, Int8PtrTy),
+                      ConstantInt::get(Int32Ty, StaticBlocks.size()),
+                      ConstantInt::get(Int64Ty, getUnsafeModuleHash(M))});
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, 0);
+}
+
+/// Collects the plain calls strictly between the markers that a panic can
+/// escape through: may-unwind, non-intrinsic calls. Invokes need no
+/// collecting — a region spanning an invoke was already closed before it
+/// and re-opened on its unwind successor by the region verifier.
+void collectMayUnwindCalls(Instruction *BeginMarker, Instruction *EndMarker,
+                           SmallVectorImpl<CallInst *> &Calls) {
+  for (Instruction *I = BeginMarker->getNextNode(); I && I != EndMarker;
+       I = I->getNextNode()) {
+    auto *CI = dyn_cast<CallInst>(I);
+    if (CI && !isa<IntrinsicInst>(CI) && !CI->doesNotThrow())
+      Calls.push_back(CI);
+  }
+}
+
+/// Plants the cleanup pads for -cpu-cycle-unwind-probes: each collected
+/// call becomes an invoke whose unwind edge lands in a shared per-region
+/// pad firing the unwind end probe with the region's start value, then
+/// resuming. One pad per region keeps the start value an ordinary
+/// dominating SSA use; a sampled-out execution feeds the pad a start of 0,
+/// which the runtime ignores like any other end probe.
+void emitUnwindProbes(Function &F, ArrayRef<CallInst *> Calls, Value *Start,
+                      FunctionCallee UnwindEndFn) {
+  if (Calls.empty())
+    return;
+  if (!F.hasPersonalityFn()) {
+    NumCycleUnwindCallsUnprotected += Calls.size();
+    return;
+  }
+  LLVMContext &Ctx = F.getContext();
+  StructType *PadTy = StructType::get(
+      PointerType::get(Type::getInt8Ty(Ctx), 0), Type::getInt32Ty(Ctx));
+  BasicBlock *Pad = BasicBlock::Create(Ctx, "cycle_unwind_pad", &F);
+  IRBuilder<> PadBuilder(Pad);
+  LandingPadInst *LP = PadBuilder.CreateLandingPad(PadTy, 0);
+  LP->setCleanup(true);
+  CallInst *EndCall = PadBuilder.CreateCall(UnwindEndFn, {Start});
+  setUnsafeProbeCallConv(EndCall);
+  PadBuilder.CreateResume(LP);
+  for (CallInst *CI : Calls) {
+    changeToInvokeAndSplitBasicBlock(CI, Pad);
+    ++NumCycleUnwindCallsHardened;
+  }
 }
 
 /// Instruments unsafe blocks within a function to measure CPU cycles.
 /// Uses a three-pass strategy to avoid iterator invalidation:
-/// 1. Collect begin/end marker pairs
-/// 2. Insert instrumentation calls with memory fences
+/// 1. Take the begin/end marker pairs from UnsafeRegionAnalysis
+/// 2. Insert instrumentation (runtime calls, or inline probes when
+///    -cpu-cycle-inline-probes is set)
 /// 3. Remove markers
-bool instrumentUnsafeBlocks(Function &F, FunctionCallee StartFn,
-                             FunctionCallee EndFn) {
+bool instrumentUnsafeBlocks(Function &F, const UnsafeRegionInfo &Regions,
+                             FunctionCallee StartFn,
+                             FunctionCallee EndFn, uint64_t NumSlots,
+                             const TargetTransformInfo *TTI,
+                             SmallVectorImpl<StaticBlockInfo> &StaticBlocks,
+                             ScopeTable *Scopes,
+                             SmallVectorImpl<RegionNestingRow> *NestingRows,
+                             SmallVectorImpl<RegionHistTable> *HistTables) {
   SmallVector<std::pair<Instruction *, Instruction *>, 16> InstrumentationPairs;
   SmallVector<Instruction *, 16> MarkersToRemove;
 
-  // First pass: collect all markers and instrumentation points
-  for (BasicBlock &BB : F) {
-    Instruction *CurrentBeginMarker = nullptr;
-
-    for (Instruction &I : BB) {
-      auto *Call = dyn_cast<CallBase>(&I);
-      if (!Call)
-        continue;
+  // First pass: pick up the marker pairs computed by the shared analysis.
+  // Analysis order is also the region-index key the prior profile
+  // (-unsafe-instr-prior-profile) matches against.
+  DenseMap<Instruction *, unsigned> RegionIndexOf;
+  for (const UnsafeRegion &R : Regions.regions()) {
+    RegionIndexOf[R.Begin] = InstrumentationPairs.size();
+    InstrumentationPairs.push_back({R.Begin, R.End});
+    MarkersToRemove.push_back(R.Begin);
+    MarkersToRemove.push_back(R.End);
+  }
 
-      auto *IA = dyn_cast<InlineAsm>(Call->getCalledOperand());
-      if (!IA)
-        continue;
+  if (InstrumentationPairs.empty())
+    return false;
 
-      StringRef Asm = IA->getAsmString();
-      if (Asm == llvm::UNSAFE_MARKER_BEGIN) {
-        if (!CurrentBeginMarker)
-          CurrentBeginMarker = &I;
-      } else if (Asm == llvm::UNSAFE_MARKER_END && CurrentBeginMarker) {
-        InstrumentationPairs.push_back({CurrentBeginMarker, &I});
-        MarkersToRemove.push_back(CurrentBeginMarker);
-        MarkersToRemove.push_back(&I);
-        CurrentBeginMarker = nullptr;
-      }
+  // Trivially small regions get a static estimate and an executed-counter
+  // increment instead of a timing probe.
+  if (StaticEstimateThreshold > 0 && TTI) {
+    SmallVector<std::pair<Instruction *, Instruction *>, 16> ProbedPairs;
+    for (auto [BeginMarker, EndMarker] : InstrumentationPairs) {
+      uint64_t Cost;
+      if (estimateRegionCost(BeginMarker, EndMarker, *TTI, Cost) &&
+          Cost <= StaticEstimateThreshold) {
+        ++NumCycleRegionsEstimated;
+        instrumentStaticEstimate(*F.getParent(), BeginMarker, Cost,
+                                 StaticBlocks);
+      } else
+        ProbedPairs.push_back({BeginMarker, EndMarker});
     }
+    InstrumentationPairs = std::move(ProbedPairs);
   }
 
-  if (InstrumentationPairs.empty())
-    return false;
+  NumCycleRegionsProbed += InstrumentationPairs.size();
 
   // Second pass: insert instrumentation while markers are still valid
-  for (auto [BeginMarker, EndMarker] : InstrumentationPairs) {
-    IRBuilder<> BeginBuilder(BeginMarker);
-    BeginBuilder.CreateFence(AtomicOrdering::SequentiallyConsistent);
-    Value *StartCycleValue = BeginBuilder.CreateCall(StartFn);
+  if (CycleTraceBufferSize > 0) {
+    // Trace mode replaces the aggregate probes outright: mixing both
+    // would double-read the counter at every begin marker.
+    instrumentUnsafeBlocksTrace(F, RegionIndexOf, InstrumentationPairs);
+  } else if (PerThreadCycleAccumulators) {
+    // Functions without an ID from UnsafeFunctionTrackerPass share the
+    // reserved trailing slot.
+    uint32_t FuncId = getTrackedFunctionId(F);
+    uint64_t SlotIndex = FuncId == UINT32_MAX ? NumSlots - 1 : FuncId;
+    instrumentUnsafeBlocksPerThread(F, SlotIndex, NumSlots,
+                                    InstrumentationPairs);
+  } else if (InlineCycleProbes) {
+    instrumentUnsafeBlocksInline(F, InstrumentationPairs);
+  } else {
+    // Scope attribution swaps the end probe for the scoped variant, which
+    // carries the region's source-scope ID alongside the start value.
+    LLVMContext &Ctx = F.getContext();
+    Type *ScopeInt32Ty = Type::getInt32Ty(Ctx);
+    FunctionCallee ScopedEndFn;
+    if (Scopes)
+      ScopedEndFn = F.getParent()->getOrInsertFunction(
+          END_MEASUREMENT_SCOPED_FN,
+          FunctionType::get(Type::getVoidTy(Ctx),
+                            {Type::getInt64Ty(Ctx), ScopeInt32Ty}, false));
 
-    IRBuilder<> EndBuilder(EndMarker);
-    EndBuilder.CreateFence(AtomicOrdering::SequentiallyConsistent);
-    EndBuilder.CreateCall(EndFn, {StartCycleValue});
+    // Region correlation likewise swaps the end probe, for the variant
+    // carrying the shared region key. It takes precedence over scope
+    // attribution when both are requested: the probe carries one ID, and
+    // the region key already determines the function. Depth attribution
+    // needs the same keyed probe — the nesting table is indexed by region
+    // key — so it forces the variant on too, and so do the latency
+    // histograms, whose dump labels rows by region key.
+    bool RegionKeyed =
+        unsafeRegionCorrelateEnabled() || NestingRows || HistTables;
+    FunctionCallee RegionEndFn;
+    if (RegionKeyed)
+      RegionEndFn = F.getParent()->getOrInsertFunction(
+          END_MEASUREMENT_REGION_FN,
+          FunctionType::get(Type::getVoidTy(Ctx),
+                            {Type::getInt64Ty(Ctx), ScopeInt32Ty}, false));
+
+    FunctionCallee UnwindEndFn;
+    if (CycleUnwindProbes)
+      UnwindEndFn = F.getParent()->getOrInsertFunction(
+          END_MEASUREMENT_UNWIND_FN,
+          FunctionType::get(Type::getVoidTy(Ctx), {Type::getInt64Ty(Ctx)},
+                            false));
+
+    // Histogram mode extends the keyed probe with the region's bucket-row
+    // pointer, so the runtime's branchless update needs no key lookup. The
+    // rows live in a static per-function table sized to the probed-region
+    // count; the keys array built alongside labels them for the dump.
+    FunctionCallee HistEndFn;
+    GlobalVariable *HistGV = nullptr;
+    ArrayType *HistTy = nullptr;
+    SmallVector<Constant *, 16> HistKeys;
+    Type *HistInt8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+    if (HistTables && !InstrumentationPairs.empty()) {
+      HistEndFn = F.getParent()->getOrInsertFunction(
+          END_MEASUREMENT_HIST_FN,
+          FunctionType::get(Type::getVoidTy(Ctx),
+                            {Type::getInt64Ty(Ctx), ScopeInt32Ty,
+                             HistInt8PtrTy},
+                            false));
+      HistTy = ArrayType::get(
+          ScopeInt32Ty, InstrumentationPairs.size() * RegionHistBuckets);
+      HistGV = new GlobalVariable(*F.getParent(), HistTy,
+                                  /*isConstant=*/false,
+                                  GlobalValue::InternalLinkage,
+                                  ConstantAggregateZero::get(HistTy),
+                                  "__cpu_cycle_region_hist." + F.getName());
+      HistGV->setAlignment(Align(4));
+      placeUnsafeTableGlobal(HistGV);
+    }
+
+    // Outlined probe thunks, built once per function under
+    // -cpu-cycle-outline-probes: the begin thunk returns the start value,
+    // the end thunk takes it plus whichever second operand the configured
+    // end variant wants, so regions pay a near-call with the operands in
+    // registers instead of carrying the fence+call bytes inline. Noinline
+    // is the point — one copy — and the runtime call inside each thunk
+    // sits in tail position.
+    Function *BeginThunk = nullptr;
+    Function *EndThunk = nullptr;
+    if (CycleOutlineProbes && !InstrumentationPairs.empty()) {
+      Module &M = *F.getParent();
+      Type *ThunkInt64Ty = Type::getInt64Ty(Ctx);
+
+      BeginThunk =
+          Function::Create(FunctionType::get(ThunkInt64Ty, false),
+                           GlobalValue::InternalLinkage,
+                           "cpu_cycle_probe_begin." + F.getName(), &M);
+      BeginThunk->addFnAttr(Attribute::NoInline);
+      IRBuilder<> BeginB(BasicBlock::Create(Ctx, "entry", BeginThunk));
+      CallInst *ThunkStart = BeginB.CreateCall(StartFn);
+      setUnsafeProbeCallConv(ThunkStart);
+      BeginB.CreateRet(ThunkStart);
+      emitProbeSerialization(ThunkStart, /*IsEndProbe=*/false);
+
+      SmallVector<Type *, 3> EndParams{ThunkInt64Ty};
+      if (RegionKeyed || Scopes)
+        EndParams.push_back(ScopeInt32Ty);
+      if (HistGV)
+        EndParams.push_back(HistInt8PtrTy);
+      EndThunk =
+          Function::Create(FunctionType::get(Type::getVoidTy(Ctx), EndParams,
+                                             false),
+                           GlobalValue::InternalLinkage,
+                           "cpu_cycle_probe_end." + F.getName(), &M);
+      EndThunk->addFnAttr(Attribute::NoInline);
+      IRBuilder<> EndB(BasicBlock::Create(Ctx, "entry", EndThunk));
+      SmallVector<Value *, 3> FwdArgs;
+      for (Argument &Arg : EndThunk->args())
+        FwdArgs.push_back(&Arg);
+      CallInst *ThunkEnd = HistGV ? EndB.CreateCall(HistEndFn, FwdArgs)
+                           : RegionKeyed
+                               ? EndB.CreateCall(RegionEndFn, FwdArgs)
+                           : Scopes ? EndB.CreateCall(ScopedEndFn, FwdArgs)
+                                    : EndB.CreateCall(EndFn, FwdArgs);
+      setUnsafeProbeCallConv(ThunkEnd);
+      ThunkEnd->setTailCall();
+      EndB.CreateRetVoid();
+      emitProbeSerialization(ThunkEnd, /*IsEndProbe=*/true);
+      ++NumCycleFunctionsOutlined;
+    }
+
+    // Probe-audit ordinals: start probes take even IDs, end probes odd, in
+    // emission order.
+    unsigned AuditId = 0;
+    for (auto [BeginMarker, EndMarker] : InstrumentationPairs) {
+      // Collected before any probe splitting moves the region's tail into
+      // new blocks; the instruction pointers stay valid throughout.
+      SmallVector<CallInst *, 4> UnwindCalls;
+      if (CycleUnwindProbes)
+        collectMayUnwindCalls(BeginMarker, EndMarker, UnwindCalls);
+      Constant *ScopeId =
+          Scopes ? ConstantInt::get(ScopeInt32Ty,
+                                    getScopeId(*Scopes, BeginMarker))
+                 : nullptr;
+      Constant *RegionKey = nullptr;
+      if (RegionKeyed) {
+        uint32_t Key = unsafeRegionKey(F, RegionIndexOf.lookup(BeginMarker));
+        RegionKey = ConstantInt::get(ScopeInt32Ty, Key);
+        RegionNestingRow Row;
+        if (NestingRows && readRegionNesting(BeginMarker, Row)) {
+          Row.RegionKey = Key;
+          NestingRows->push_back(Row);
+          ++NumCycleNestingRowsEmitted;
+        }
+      }
+      // Constant pointer to this region's bucket row; the keys array grows
+      // in lockstep, so row N's label is always keys[N].
+      Constant *HistRowPtr = nullptr;
+      if (HistGV) {
+        Type *GepInt64Ty = Type::getInt64Ty(Ctx);
+        Constant *Idx[] = {
+            ConstantInt::get(GepInt64Ty, 0),
+            ConstantInt::get(GepInt64Ty, static_cast<uint64_t>(HistKeys.size()) *
+                                             RegionHistBuckets)};
+        HistRowPtr = ConstantExpr::getBitCast(
+            ConstantExpr::getInBoundsGetElementPtr(HistTy, HistGV, Idx),
+            HistInt8PtrTy);
+        HistKeys.push_back(RegionKey);
+      }
+      // Shared sampling knob (-unsafe-instr-sample-rate): one decision per
+      // region execution gates both probes, so a 1/N run pays the call+fence
+      // cost on only every Nth execution. Unsampled executions feed a start
+      // of 0 through, which the runtime's end probe ignores. Regions a prior
+      // profile marks hot take the same shape at the demotion rate even when
+      // run-wide sampling is off.
+      Type *Int64Ty = Type::getInt64Ty(F.getContext());
+      bool Demoted =
+          priorProfileDemotesRegion(F, RegionIndexOf.lookup(BeginMarker));
+      if (Demoted)
+        ++NumCycleRegionsDemoted;
+      Value *Take = Demoted ? emitHotSampleDecision(BeginMarker, "cycle")
+                            : emitSampleDecision(BeginMarker, "cycle");
+      if (Take) {
+        Instruction *StartThen = SplitBlockAndInsertIfThen(
+            Take, BeginMarker, /*Unreachable=*/false,
+            unsafeProbeBranchWeights(Ctx));
+        // With outlined thunks the fence lives inside the thunk; emitting
+        // it at the site too would double-serialize every firing.
+        if (!BeginThunk)
+          emitProbeSerialization(StartThen, /*IsEndProbe=*/false);
+        IRBuilder<> ThenBuilder(StartThen);
+        CallInst *StartCall = ThenBuilder.CreateCall(
+            BeginThunk ? FunctionCallee(BeginThunk) : StartFn);
+        setUnsafeProbeCallConv(StartCall);
+        attachProbeId(StartCall, "cycle", AuditId);
+        Value *Start = StartCall;
+
+        BasicBlock *RegionBB = BeginMarker->getParent();
+        PHINode *StartPhi = PHINode::Create(Int64Ty, 2, "cycle_sample_start",
+                                            &RegionBB->front());
+        StartPhi->addIncoming(Start, StartThen->getParent());
+        StartPhi->addIncoming(ConstantInt::get(Int64Ty, 0),
+                              cast<Instruction>(Take)->getParent());
+
+        IRBuilder<> EndBuilder(EndMarker);
+        Value *Sampled =
+            EndBuilder.CreateICmpNE(StartPhi, ConstantInt::get(Int64Ty, 0));
+        Instruction *EndThen = SplitBlockAndInsertIfThen(
+            Sampled, EndMarker, /*Unreachable=*/false,
+            unsafeProbeBranchWeights(Ctx));
+        if (!EndThunk)
+          emitProbeSerialization(EndThen, /*IsEndProbe=*/true);
+        IRBuilder<> EndThenBuilder(EndThen);
+        SmallVector<Value *, 3> EndArgs{StartPhi};
+        if (RegionKey)
+          EndArgs.push_back(RegionKey);
+        else if (ScopeId)
+          EndArgs.push_back(ScopeId);
+        if (HistRowPtr)
+          EndArgs.push_back(HistRowPtr);
+        CallInst *EndCall =
+            EndThunk     ? EndThenBuilder.CreateCall(EndThunk, EndArgs)
+            : HistRowPtr ? EndThenBuilder.CreateCall(HistEndFn, EndArgs)
+            : RegionKey  ? EndThenBuilder.CreateCall(RegionEndFn, EndArgs)
+            : ScopeId    ? EndThenBuilder.CreateCall(ScopedEndFn, EndArgs)
+                         : EndThenBuilder.CreateCall(EndFn, EndArgs);
+        setUnsafeProbeCallConv(EndCall);
+        attachProbeId(EndCall, "cycle", AuditId + 1);
+        emitUnwindProbes(F, UnwindCalls, StartPhi, UnwindEndFn);
+        AuditId += 2;
+        continue;
+      }
+
+      if (!BeginThunk)
+        emitProbeSerialization(BeginMarker, /*IsEndProbe=*/false);
+      IRBuilder<> BeginBuilder(BeginMarker);
+      CallInst *StartCycleValue = BeginBuilder.CreateCall(
+          BeginThunk ? FunctionCallee(BeginThunk) : StartFn);
+      setUnsafeProbeCallConv(StartCycleValue);
+      attachProbeId(StartCycleValue, "cycle", AuditId);
+
+      if (!EndThunk)
+        emitProbeSerialization(EndMarker, /*IsEndProbe=*/true);
+      IRBuilder<> EndBuilder(EndMarker);
+      SmallVector<Value *, 3> EndArgs{StartCycleValue};
+      if (RegionKey)
+        EndArgs.push_back(RegionKey);
+      else if (ScopeId)
+        EndArgs.push_back(ScopeId);
+      if (HistRowPtr)
+        EndArgs.push_back(HistRowPtr);
+      CallInst *EndCall =
+          EndThunk     ? EndBuilder.CreateCall(EndThunk, EndArgs)
+          : HistRowPtr ? EndBuilder.CreateCall(HistEndFn, EndArgs)
+          : RegionKey  ? EndBuilder.CreateCall(RegionEndFn, EndArgs)
+          : ScopeId    ? EndBuilder.CreateCall(ScopedEndFn, EndArgs)
+                       : EndBuilder.CreateCall(EndFn, EndArgs);
+      setUnsafeProbeCallConv(EndCall);
+      attachProbeId(EndCall, "cycle", AuditId + 1);
+      emitUnwindProbes(F, UnwindCalls, StartCycleValue, UnwindEndFn);
+      AuditId += 2;
+    }
+
+    if (HistGV) {
+      ArrayType *KeysTy = ArrayType::get(ScopeInt32Ty, HistKeys.size());
+      auto *KeysGV = new GlobalVariable(
+          *F.getParent(), KeysTy, /*isConstant=*/true,
+          GlobalValue::InternalLinkage, ConstantArray::get(KeysTy, HistKeys),
+          "__cpu_cycle_region_hist_keys." + F.getName());
+      KeysGV->setAlignment(Align(4));
+      placeUnsafeTableGlobal(KeysGV);
+      HistTables->push_back(
+          {HistGV, KeysGV, static_cast<uint32_t>(HistKeys.size())});
+    }
   }
 
   // Third pass: safely remove all markers after instrumentation
@@ -113,12 +1651,79 @@ void setupRuntimeFunctions(Module &M, FunctionCallee &RecordStartFn,
   RecordStartFn = M.getOrInsertFunction(PROGRAM_START_FN, VoidTy);
   StartMeasureFn = M.getOrInsertFunction(START_MEASUREMENT_FN,
                                          FunctionType::get(Int64Ty, {}, false));
-  EndMeasureFn = M.getOrInsertFunction(END_MEASUREMENT_FN,
-                                       FunctionType::get(VoidTy, {Int64Ty}, false));
+  // The task-context variant shares the plain probe's signature (the
+  // context ID lives in the runtime's TLS slot), so the swap is wholesale.
+  EndMeasureFn = M.getOrInsertFunction(
+      CycleTaskContext ? END_MEASUREMENT_TASK_FN : END_MEASUREMENT_FN,
+      FunctionType::get(VoidTy, {Int64Ty}, false));
   PrintStatsFn = M.getOrInsertFunction(PRINT_STATS_FN, VoidTy);
 }
 
 /// Sets up module-level hooks (constructors and destructors).
+// Unit calibration: the hook the ctor hands the CPUID facts to
+// (-cpu-cycle-tsc-calibration).
+constexpr const char *RECORD_TSC_CALIBRATION_FN =
+    "cpu_cycle_record_tsc_calibration";
+
+/// Emits cpuid for \p Leaf (subleaf 0) and returns the {eax,ebx,ecx,edx}
+/// aggregate.
+Value *emitCpuId(IRBuilder<> &Builder, uint32_t Leaf) {
+  LLVMContext &Ctx = Builder.getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  StructType *RetTy = StructType::get(Int32Ty, Int32Ty, Int32Ty, Int32Ty);
+  FunctionType *AsmTy = FunctionType::get(RetTy, {Int32Ty, Int32Ty}, false);
+  InlineAsm *IA =
+      InlineAsm::get(AsmTy, "cpuid", "={ax},={bx},={cx},={dx},{ax},{cx}",
+                     /*hasSideEffects=*/false);
+  return Builder.CreateCall(IA,
+                            {Builder.getInt32(Leaf), Builder.getInt32(0)});
+}
+
+/// Emits the ctor-side half of TSC unit calibration: CPUID leaf 0x15
+/// (TSC ratio — EAX denominator, EBX numerator, ECX crystal Hz) and the
+/// invariant-TSC capability word (leaf 0x80000007 EDX, bit 8). A leaf
+/// past the reported maximum echoes the highest supported leaf instead
+/// of faulting, so each result is masked to zero unless its leaf is
+/// actually implemented and the runtime sees "unknown", never garbage.
+///
+/// Runtime contract (cpu_cycle_record_tsc_calibration): first
+/// registration wins — every instrumented module's ctor reports the same
+/// host. A zero numerator or crystal frequency means the leaf was
+/// unpopulated (older Intel, AMD), and the runtime instead times a short
+/// TSC-vs-CLOCK_MONOTONIC window; either way it writes the resulting
+/// tick-to-nanosecond ratio and the invariant-TSC bit into the stat
+/// output header for the aggregator.
+void emitTscCalibrationCall(Module &M, IRBuilder<> &Builder) {
+  LLVMContext &Ctx = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  FunctionCallee RecordFn = M.getOrInsertFunction(
+      RECORD_TSC_CALIBRATION_FN,
+      FunctionType::get(Type::getVoidTy(Ctx),
+                        {Int32Ty, Int32Ty, Int32Ty, Int32Ty}, false));
+
+  Value *MaxBasic = Builder.CreateExtractValue(emitCpuId(Builder, 0), 0);
+  Value *MaxExt =
+      Builder.CreateExtractValue(emitCpuId(Builder, 0x80000000u), 0);
+  Value *Zero = ConstantInt::get(Int32Ty, 0);
+  auto MaskTo = [&](Value *V, Value *Implemented) {
+    return Builder.CreateSelect(Implemented, V, Zero);
+  };
+
+  Value *Leaf15 = emitCpuId(Builder, 0x15);
+  Value *Has15 =
+      Builder.CreateICmpUGE(MaxBasic, ConstantInt::get(Int32Ty, 0x15));
+  Value *Den = MaskTo(Builder.CreateExtractValue(Leaf15, 0), Has15);
+  Value *Num = MaskTo(Builder.CreateExtractValue(Leaf15, 1), Has15);
+  Value *CrystalHz = MaskTo(Builder.CreateExtractValue(Leaf15, 2), Has15);
+
+  Value *Ext7 = emitCpuId(Builder, 0x80000007u);
+  Value *HasExt7 = Builder.CreateICmpUGE(
+      MaxExt, ConstantInt::get(Int32Ty, 0x80000007u));
+  Value *InvariantEdx = MaskTo(Builder.CreateExtractValue(Ext7, 3), HasExt7);
+
+  Builder.CreateCall(RecordFn, {Den, Num, CrystalHz, InvariantEdx});
+}
+
 void setupModuleHooks(Module &M, FunctionCallee RecordStartFn,
                       FunctionCallee PrintStatsFn) {
   // Create global constructor to initialize program tracking
@@ -128,12 +1733,141 @@ void setupModuleHooks(Module &M, FunctionCallee RecordStartFn,
   BasicBlock *BB = BasicBlock::Create(M.getContext(), "entry", Ctor);
   IRBuilder<> Builder(BB);
   Builder.CreateCall(RecordStartFn);
+  if (CycleTscCalibration)
+    emitTscCalibrationCall(M, Builder);
   Builder.CreateRetVoid();
   appendToGlobalCtors(M, Ctor, 0);
 
+  // In shared-memory mode nothing is formatted at exit: the publish hook
+  // folds the accumulators into the segment instead.
+  if (unsafeShmStatsEnabled()) {
+    emitShmStatsHooks(M);
+    return;
+  }
+
   // Register destructor to print statistics at program exit
-  if (Function *PrintStatsFunc = dyn_cast<Function>(PrintStatsFn.getCallee()))
+  if (Function *PrintStatsFunc = dyn_cast<Function>(PrintStatsFn.getCallee())) {
+    // Under -unsafe-stats-output-template the dump writes shards instead
+    // of appending to the fixed CWD name.
+    emitStatsOutputTemplateHook(M);
     appendToGlobalDtors(M, PrintStatsFunc, 0);
+    // Long-running benchmarks never reach the dtor; under
+    // -unsafe-stats-signal-dump the same dump also answers SIGUSR1.
+    if (unsafeSignalDumpEnabled())
+      emitSignalDumpRegistration(M, PrintStatsFunc);
+  }
+}
+
+/// Registers a constructor that asks the runtime to program the perf_event
+/// counter the inline rdpmc probes read. The runtime (cpu_cycle_pmc_init)
+/// opens the event with rdpmc enabled and publishes the counter index in
+/// __cpu_cycle_pmc_index before any instrumented code runs.
+void setupPmcInitHook(Module &M) {
+  LLVMContext &Ctx = M.getContext();
+  FunctionCallee InitFn = M.getOrInsertFunction(
+      PMC_INIT_FN, FunctionType::get(Type::getVoidTy(Ctx), false));
+
+  Function *Ctor = Function::Create(
+      FunctionType::get(Type::getVoidTy(Ctx), false),
+      GlobalValue::InternalLinkage, "cpu_cycle_pmc_ctor", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Ctor);
+  IRBuilder<> Builder(BB);
+  Builder.CreateCall(InitFn);
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, 0);
+}
+
+/// Emits the folded-stack support: shadow-stack push/pop instrumentation on
+/// every function carrying a tracker ID, a ctor registering the ID-indexed
+/// name table, and the exit hook that writes the folded lines.
+///
+/// The runtime keeps one shadow stack per thread; when an end probe fires
+/// it attributes the measured cycles to the current stack's folded string.
+/// Pops are emitted before returns only, so frames abandoned by unwinding
+/// are not popped — acceptable for the panic=abort benchmark builds this
+/// targets.
+bool setupFoldedStackSupport(Module &M) {
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+
+  // Collect the tracked functions first: the name table is sized by the
+  // largest ID, and instrumentation below mutates the functions.
+  SmallVector<std::pair<uint32_t, Function *>, 16> Tracked;
+  uint32_t MaxId = 0;
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    uint32_t Id = getTrackedFunctionId(F);
+    if (Id == UINT32_MAX)
+      continue;
+    Tracked.push_back({Id, &F});
+    MaxId = std::max(MaxId, Id);
+  }
+  if (Tracked.empty())
+    return false;
+
+  FunctionCallee PushFn = M.getOrInsertFunction(
+      STACK_PUSH_FN, FunctionType::get(VoidTy, {Int32Ty}, false));
+  FunctionCallee PopFn = M.getOrInsertFunction(STACK_POP_FN, VoidTy);
+
+  for (auto [Id, F] : Tracked) {
+    IRBuilder<> EntryBuilder(&F->getEntryBlock().front());
+    setUnsafeProbeCallConv(
+        EntryBuilder.CreateCall(PushFn, {ConstantInt::get(Int32Ty, Id)}));
+    for (BasicBlock &BB : *F)
+      if (auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator())) {
+        IRBuilder<> RetBuilder(Ret);
+        setUnsafeProbeCallConv(RetBuilder.CreateCall(PopFn));
+      }
+  }
+
+  // ID-indexed name table; IDs the tracker assigned to functions this
+  // module no longer contains leave empty slots. In stripped mode
+  // (-unsafe-name-sidecar-dir) every slot stays null — the runtime already
+  // renders null slots by ID — and the names go to the sidecar.
+  std::unique_ptr<raw_fd_ostream> Sidecar =
+      openUnsafeNameSidecar(M, ".unsafe_stacks.tsv");
+  IRBuilder<> NameBuilder(Ctx);
+  std::vector<Constant *> NamePtrs(MaxId + 1,
+                                   ConstantPointerNull::get(
+                                       cast<PointerType>(Int8PtrTy)));
+  for (auto [Id, F] : Tracked) {
+    if (Sidecar) {
+      *Sidecar << "stack\t" << Id << '\t' << F->getName() << '\n';
+      continue;
+    }
+    NamePtrs[Id] = NameBuilder.CreateGlobalStringPtr(
+        F->getName(), "__cpu_cycle_stack_name", 0, &M);
+  }
+
+  ArrayType *TableTy = ArrayType::get(Int8PtrTy, NamePtrs.size());
+  auto *TableGV = new GlobalVariable(
+      M, TableTy, /*isConstant=*/true, GlobalValue::InternalLinkage,
+      ConstantArray::get(TableTy, NamePtrs), "__cpu_cycle_stack_names");
+
+  FunctionCallee RegisterFn = M.getOrInsertFunction(
+      REGISTER_STACK_NAMES_FN,
+      FunctionType::get(VoidTy, {Int8PtrTy, Int32Ty}, false));
+
+  Function *Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "cpu_cycle_stack_names_ctor", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Ctor);
+  IRBuilder<> Builder(BB);
+  Builder.CreateCall(RegisterFn,
+                     {Builder.CreateBitCast(TableGV, Int8PtrTy),
+                      ConstantInt::get(Int32Ty, NamePtrs.size())});
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, 0);
+
+  // The folded lines come out at exit, alongside (not instead of) the
+  // regular stats destructor.
+  FunctionCallee DumpFn = M.getOrInsertFunction(DUMP_FOLDED_FN, VoidTy);
+  if (auto *F = dyn_cast<Function>(DumpFn.getCallee()))
+    appendToGlobalDtors(M, F, 0);
+  return true;
 }
 
 } // namespace
@@ -149,15 +1883,129 @@ PreservedAnalyses CpuCycleCountPass::run(Module &M, ModuleAnalysisManager &AM) {
   // Setup module-level hooks (ctors/dtors)
   setupModuleHooks(M, RecordStartFn, PrintStatsFn);
 
+  // Size the per-thread arrays: one slot per tracked function ID plus a
+  // reserved slot for functions without one.
+  uint64_t NumSlots = 1;
+  if (PerThreadCycleAccumulators) {
+    for (Function &F : M) {
+      uint32_t FuncId = getTrackedFunctionId(F);
+      if (FuncId != UINT32_MAX && FuncId + 2 > NumSlots)
+        NumSlots = FuncId + 2;
+    }
+  }
+
+  FunctionAnalysisManager &FAM =
+      AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
   // Instrument unsafe blocks in all non-declaration functions
   bool Modified = false;
+  SmallVector<StaticBlockInfo, 16> StaticBlocks;
+  // Scope attribution only applies to the runtime-call probes; the inline
+  // modes attribute by function ID or module totals.
+  ScopeTable ModuleScopes;
+  ScopeTable *Scopes =
+      CycleScopeAttribution && !InlineCycleProbes && !PerThreadCycleAccumulators
+          ? &ModuleScopes
+          : nullptr;
+  // Depth attribution rides the region-keyed runtime probes, so it is
+  // limited to the same mode.
+  SmallVector<RegionNestingRow, 16> ModuleNestingRows;
+  SmallVectorImpl<RegionNestingRow> *NestingRows =
+      CycleDepthAttribution && !InlineCycleProbes && !PerThreadCycleAccumulators
+          ? &ModuleNestingRows
+          : nullptr;
+  // Latency histograms need the runtime to see a per-region delta, so they
+  // are likewise confined to the runtime-call probes.
+  SmallVector<RegionHistTable, 16> ModuleHistTables;
+  SmallVectorImpl<RegionHistTable> *HistTables =
+      CycleRegionHistograms && !InlineCycleProbes && !PerThreadCycleAccumulators
+          ? &ModuleHistTables
+          : nullptr;
+  // Collect the functions to probe before touching anything: calibration
+  // adds clones to the module, and the loop below must not revisit them.
+  SmallVector<Function *, 16> Work;
   for (Function &F : M) {
     if (F.isDeclaration())
       continue;
 
-    if (instrumentUnsafeBlocks(F, StartMeasureFn, EndMeasureFn))
+    // Targeted runs (-unsafe-instr-funcs) probe only the listed functions.
+    if (!unsafeInstrFuncFilterAllows(F))
+      continue;
+
+    // One attribute test skips the block walk for the large majority of
+    // functions that carry no region markers.
+    if (!hasUnsafeRegionMarkers(F)) {
+      ++NumCycleFunctionsSkipped;
+      continue;
+    }
+    Work.push_back(&F);
+  }
+
+  // Probe in sorted-name order, not module order: region and static-table
+  // IDs are dense in visit order, so this pins them (and every table keyed
+  // by them) to the set of functions rather than to how the frontend
+  // happened to order the module.
+  llvm::sort(Work, [](const Function *A, const Function *B) {
+    return A->getName() < B->getName();
+  });
+
+  for (Function *FP : Work) {
+    // Under self-calibration the original becomes a dispatcher over a
+    // probe-free twin and a marker-carrying clone; the probes go into the
+    // clone.
+    Function *Target = FP;
+    if (CycleCalibrateRate > 0) {
+      if (Function *Impl = setupSelfCalibration(*FP)) {
+        Target = Impl;
+        Modified = true;
+      }
+    }
+
+    // TTI is only needed when static estimation is on.
+    const TargetTransformInfo *TTI =
+        StaticEstimateThreshold > 0 ? &FAM.getResult<TargetIRAnalysis>(*Target)
+                                    : nullptr;
+    const UnsafeRegionInfo &Regions =
+        FAM.getResult<UnsafeRegionAnalysis>(*Target);
+    if (instrumentUnsafeBlocks(*Target, Regions, StartMeasureFn, EndMeasureFn,
+                               NumSlots, TTI, StaticBlocks, Scopes,
+                               NestingRows, HistTables))
       Modified = true;
   }
 
+  if (!StaticBlocks.empty())
+    setupStaticBlockRegistration(M, StaticBlocks);
+
+  if (Scopes && !ModuleScopes.Names.empty())
+    setupScopeTableRegistration(M, ModuleScopes);
+
+  if (!ModuleNestingRows.empty())
+    setupNestingTableRegistration(M, ModuleNestingRows);
+
+  if (!ModuleHistTables.empty())
+    setupRegionHistRegistration(M, ModuleHistTables);
+
+  // Shadow-stack maintenance goes in regardless of whether this module has
+  // unsafe regions: its tracked functions still contribute frames to stacks
+  // sampled elsewhere. Inline modes never enter the runtime at region end,
+  // so there is nothing to sample there.
+  if (CycleFoldedStacks && !InlineCycleProbes && !PerThreadCycleAccumulators)
+    if (setupFoldedStackSupport(M))
+      Modified = true;
+
+  if (Modified) {
+    // rdpmc faults unless the runtime has programmed the counter first, so
+    // the init ctor must run before any instrumented code.
+    if (ProbeSourceMode == ProbeSource::RdPMC &&
+        (InlineCycleProbes || PerThreadCycleAccumulators))
+      setupPmcInitHook(M);
+    if (PerThreadCycleAccumulators)
+      setupPerThreadFlushHooks(M, NumSlots);
+    else if (InlineCycleProbes)
+      // In inline-probe mode the fast path never calls the runtime, so flush
+      // the thread-local accumulators to it once at exit.
+      setupInlineFlushHook(M);
+  }
+
   return Modified ? PreservedAnalyses::none() : PreservedAnalyses::all();
 }
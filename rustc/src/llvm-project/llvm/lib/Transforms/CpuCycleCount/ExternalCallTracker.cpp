@@ -13,24 +13,105 @@
 //===----------------------------------------------------------------------------===//
 
 #include "llvm/Transforms/CpuCycleCount/ExternalCallTracker.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/CpuCycleCount/CpuCycleCount.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 
 using namespace llvm;
 
 // Runtime function names
 const char *llvm::EXTERNAL_CALL_START_FN = "external_call_start";
 const char *llvm::EXTERNAL_CALL_END_FN = "external_call_end";
+const char *llvm::EXTERNAL_CALL_END_SAMPLED_FN = "external_call_end_sampled";
+const char *llvm::EXTERNAL_CALL_END_SPAN_FN = "external_call_end_span";
+const char *llvm::EXTERNAL_CALL_END_GAP_FN = "external_call_end_gap";
+const char *llvm::EXTERNAL_CALL_REGISTER_CALLEE_FN =
+    "external_call_register_callee";
+
+// Sampling: hot FFI/syscall sites in ring and getrandom execute millions of
+// times, and fully probed runs blow the CI time budget. With a rate of N > 1
+// each site keeps a thread-local execution counter and only takes the timing
+// path every Nth execution; the end probe passes N so the runtime can scale
+// the recorded time back up.
+static cl::opt<unsigned> ExternalCallSampleRate(
+  "external-call-sample-rate", cl::init(1), cl::Hidden,
+  cl::desc("Time only every Nth execution of each external call site "
+           "(1 = time every execution)")
+);
+
+// Terminator coverage: invoke/callbr sites were previously skipped outright,
+// which loses a measurable share of external-call time on crates that unwind
+// through FFI (httparse). When enabled, the end probe is placed in each
+// successor block, splitting the edge first when the successor has other
+// predecessors.
+static cl::opt<bool> ExternalCallCoverTerminators(
+  "external-call-cover-terminators", cl::init(false), cl::Hidden,
+  cl::desc("Also instrument invoke/callbr external call sites by placing "
+           "end probes in successor blocks")
+);
+
+// Static callee classification: syscall-bound time (getrandom, the
+// getauxval paths ring takes at startup) and compute FFI answer different
+// questions, and aggregate per-callee numbers force guessing the split
+// after the fact. The callee name is known at compile time, so the start
+// probe carries a class ID resolved here against a built-in table of libc
+// syscall wrappers — extensible with a list file for wrappers the table
+// misses — and the runtime accumulates per class with no run-time name
+// inspection.
+// Span coalescing: FFI-chained code (ring's digest loops) executes runs of
+// back-to-back external calls, and bracketing each individually puts an
+// end probe, a start probe, and two fences between adjacent calls. When
+// enabled, a maximal run of consecutive instrumented calls becomes one
+// timed span — start probe before the first call, one end probe after the
+// last — with the span's call count handed to the runtime, so call-count
+// accuracy survives while probe executions roughly halve. The span is
+// attributed to the run's first callee.
+static cl::opt<bool> ExternalCallCoalesceSpans(
+  "external-call-coalesce-spans", cl::init(false), cl::Hidden,
+  cl::desc("Merge runs of back-to-back external calls into one timed span "
+           "carrying the call count")
+);
+
+static cl::opt<std::string> ExternalCallSyscallList(
+  "external-call-syscall-list", cl::init(""), cl::Hidden,
+  cl::desc("File with one callee name per line to classify as "
+           "syscall-bound in addition to the built-in table")
+);
+
+// Inter-call gap recording: count and total time say how much a callee
+// costs, but not how the calls are spaced — the key input for judging
+// whether batching repeated tiny calls (getrandom, ring's FFI loops) would
+// pay. Under this flag the end probe becomes the gap variant, which keeps
+// a previous-end TSC slot per callee ID in TLS and log2-buckets the gap
+// from the previous call's end to this call's start: a distribution
+// crowded into the low buckets means back-to-back calls that one batched
+// call could replace. Same signature as the plain end probe, so the swap
+// happens wholesale at declaration time; sampled mode keeps the plain
+// variant, since 1-in-N timing makes consecutive-call gaps meaningless.
+static cl::opt<bool> ExternalCallGapHistograms(
+  "external-call-gap-histograms", cl::init(false), cl::Hidden,
+  cl::desc("Record log2-bucketed histograms of the TSC gap between "
+           "consecutive calls to the same callee")
+);
 
 namespace {
 
-static bool isPrimaryPackage() {
-  const char *P = getenv("CARGO_PRIMARY_PACKAGE");
-  return P && strcmp(P, "1") == 0;
-}
+static bool isPrimaryPackage() { return isUnsafePrimaryPackage(); }
 
 /// Checks if a function name is a runtime function that should not be instrumented.
 static bool isRuntimeFunction(StringRef Name) {
@@ -39,10 +120,235 @@ static bool isRuntimeFunction(StringRef Name) {
          Name.startswith("external_call_");
 }
 
+// Callee classes the start probe carries. Unclassified stays 0, so plain
+// compute FFI needs no table hit on the runtime side either.
+enum ExternalCallClass : unsigned {
+  ECClassCompute = 0,
+  ECClassSyscall = 1,
+};
+
+/// Returns the callee names classified as syscall-bound: a built-in table
+/// of libc syscall wrappers plus the optional -external-call-syscall-list
+/// entries. The list cannot change during a compilation, so it is built
+/// once per process, like the shared function filter.
+static const StringSet<> &syscallCalleeSet() {
+  static const StringSet<> *Set = [] {
+    auto *S = new StringSet<>();
+    // Wrappers whose time is dominated by the kernel transition rather
+    // than user-space compute. Deliberately not exhaustive — the list
+    // file covers the tail — but it includes everything our benchmarks
+    // are known to hit (getrandom and the getauxval/clock_gettime paths).
+    static const char *const Builtin[] = {
+        "read",          "write",        "pread64",      "pwrite64",
+        "readv",         "writev",       "open",         "openat",
+        "close",         "stat",         "fstat",        "lstat",
+        "poll",          "ppoll",        "epoll_wait",   "epoll_ctl",
+        "select",        "pselect",      "mmap",         "munmap",
+        "mprotect",      "madvise",      "brk",          "ioctl",
+        "fcntl",         "socket",       "connect",      "accept",
+        "accept4",       "bind",         "listen",       "send",
+        "sendto",        "sendmsg",      "recv",         "recvfrom",
+        "recvmsg",       "shutdown",     "getrandom",    "getauxval",
+        "clock_gettime", "gettimeofday", "time",         "nanosleep",
+        "clock_nanosleep", "sched_yield", "syscall",     "pipe",
+        "pipe2",         "dup",          "dup2",         "lseek",
+        "ftruncate",     "fsync",        "fdatasync",    "unlink",
+        "rename",        "mkdir",        "rmdir",        "getpid",
+        "gettid",        "sigaction",    "sigaltstack",  "kill",
+    };
+    for (const char *Name : Builtin)
+      S->insert(Name);
+
+    if (!ExternalCallSyscallList.empty()) {
+      auto BufOrErr = MemoryBuffer::getFile(ExternalCallSyscallList);
+      if (!BufOrErr) {
+        // The built-in table still applies; only the extensions are lost.
+        errs() << "warning: cannot read -external-call-syscall-list file "
+               << ExternalCallSyscallList << ": "
+               << BufOrErr.getError().message()
+               << "; using the built-in table only\n";
+        return static_cast<const StringSet<> *>(S);
+      }
+      for (line_iterator LI(**BufOrErr, /*SkipBlanks=*/true, '#');
+           !LI.is_at_end(); ++LI)
+        S->insert(LI->trim());
+    }
+    return static_cast<const StringSet<> *>(S);
+  }();
+  return *Set;
+}
+
+/// Compile-time class of \p CalleeName, as passed to external_call_start.
+static unsigned classifyCallee(StringRef CalleeName) {
+  return syscallCalleeSet().contains(CalleeName) ? ECClassSyscall
+                                                 : ECClassCompute;
+}
+
+/// Instruments one external call site in sampling mode. A thread-local
+/// per-site counter gates the timing path: only every Nth execution reads
+/// the TSC, and the end probe hands the sampling rate to the runtime so it
+/// can scale the recorded time back up.
+bool instrumentSampledCall(Instruction *I, FunctionCallee ExtStartFn,
+                           FunctionCallee ExtEndSampledFn,
+                           unsigned SiteIndex, Value *CalleeId,
+                           Value *ClassId) {
+  Instruction *NextInst = I->getNextNonDebugInstruction();
+  if (!NextInst)
+    return false;
+
+  Function &F = *I->getFunction();
+  Module &M = *F.getParent();
+  Type *Int64Ty = Type::getInt64Ty(F.getContext());
+
+  auto *Counter = new GlobalVariable(
+      M, Int64Ty, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      ConstantInt::get(Int64Ty, 0),
+      "__external_call_sample_count." + Twine(SiteIndex));
+  Counter->setThreadLocal(true);
+  Counter->setAlignment(Align(8));
+
+  // Bump the site counter and decide whether this execution is sampled.
+  IRBuilder<> Builder(I);
+  Value *Count = Builder.CreateLoad(Int64Ty, Counter);
+  Value *Inc = Builder.CreateAdd(Count, ConstantInt::get(Int64Ty, 1));
+  Builder.CreateStore(Inc, Counter);
+  Value *Take = Builder.CreateICmpEQ(
+      Builder.CreateURem(Inc,
+                         ConstantInt::get(Int64Ty, ExternalCallSampleRate)),
+      ConstantInt::get(Int64Ty, 0));
+
+  // Sampled executions take the start probe; the others see a start of 0.
+  Instruction *StartThen = SplitBlockAndInsertIfThen(
+      Take, I, /*Unreachable=*/false,
+      unsafeProbeBranchWeights(I->getContext()));
+  emitProbeSerialization(StartThen, /*IsEndProbe=*/false);
+  IRBuilder<> ThenBuilder(StartThen);
+  CallInst *StartCall = ThenBuilder.CreateCall(ExtStartFn, {CalleeId, ClassId});
+  setUnsafeProbeCallConv(StartCall);
+  Value *Start = StartCall;
+
+  BasicBlock *CallBB = I->getParent();
+  PHINode *StartPhi =
+      PHINode::Create(Int64Ty, 2, "ext_sample_start", &CallBB->front());
+  StartPhi->addIncoming(Start, StartThen->getParent());
+  StartPhi->addIncoming(ConstantInt::get(Int64Ty, 0),
+                        cast<Instruction>(Take)->getParent());
+
+  // End probe only on the sampled path.
+  IRBuilder<> AfterBuilder(NextInst);
+  Value *Sampled =
+      AfterBuilder.CreateICmpNE(StartPhi, ConstantInt::get(Int64Ty, 0));
+  Instruction *EndThen = SplitBlockAndInsertIfThen(
+      Sampled, NextInst, /*Unreachable=*/false,
+      unsafeProbeBranchWeights(NextInst->getContext()));
+  emitProbeSerialization(EndThen, /*IsEndProbe=*/true);
+  IRBuilder<> EndBuilder(EndThen);
+  setUnsafeProbeCallConv(EndBuilder.CreateCall(
+      ExtEndSampledFn,
+      {StartPhi, ConstantInt::get(Int64Ty, ExternalCallSampleRate),
+       CalleeId}));
+  return true;
+}
+
+/// Registers the per-callee name table with the runtime from a global
+/// constructor, mirroring CpuCycleCount's setupModuleHooks(). IDs are dense,
+/// so the runtime can keep a flat per-callee array with no name hashing at
+/// run time.
+///
+/// Under -unsafe-name-sidecar-dir the ctor registers null name pointers and
+/// the names go to a compile-time sidecar instead; the runtime prints
+/// "id:<n>" for the nameless rows and llvm-unsafe-stats re-symbolizes them
+/// offline, so the binary stays free of callee name strings.
+void setupCalleeTableRegistration(
+    Module &M, const MapVector<StringRef, unsigned> &CalleeIds) {
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+
+  std::unique_ptr<raw_fd_ostream> Sidecar =
+      openUnsafeNameSidecar(M, ".unsafe_callees.tsv");
+
+  // external_call_register_callee(id, name)
+  FunctionCallee RegisterFn = M.getOrInsertFunction(
+      EXTERNAL_CALL_REGISTER_CALLEE_FN,
+      FunctionType::get(VoidTy, {Int32Ty, Int8PtrTy}, false));
+
+  Function *Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "external_call_callees_ctor", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Ctor);
+  IRBuilder<> Builder(BB);
+  for (const auto &[Name, Id] : CalleeIds) {
+    Value *NamePtr;
+    if (Sidecar) {
+      *Sidecar << "callee\t" << Id << '\t' << Name << '\n';
+      NamePtr = ConstantPointerNull::get(cast<PointerType>(Int8PtrTy));
+    } else {
+      NamePtr = Builder.CreateGlobalStringPtr(Name);
+    }
+    Builder.CreateCall(RegisterFn,
+                       {ConstantInt::get(Int32Ty, Id), NamePtr});
+  }
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, 0);
+}
+
+/// Instruments an invoke/callbr external call site. The start probe goes
+/// before the terminator; the end probe goes into each successor, after
+/// splitting the edge when the successor has other predecessors so the start
+/// value dominates its uses.
+bool instrumentTerminatorCall(Instruction *I, FunctionCallee ExtStartFn,
+                              FunctionCallee ExtEndFn, Value *CalleeId,
+                              Value *ClassId) {
+  SmallVector<BasicBlock *, 4> Dests;
+  if (auto *Invoke = dyn_cast<InvokeInst>(I)) {
+    Dests.push_back(Invoke->getNormalDest());
+    Dests.push_back(Invoke->getUnwindDest());
+  } else if (auto *CallBr = dyn_cast<CallBrInst>(I)) {
+    Dests.push_back(CallBr->getDefaultDest());
+    for (BasicBlock *Indirect : CallBr->getIndirectDests())
+      Dests.push_back(Indirect);
+  } else {
+    return false;
+  }
+
+  emitProbeSerialization(I, /*IsEndProbe=*/false);
+  IRBuilder<> Builder(I);
+  CallInst *StartTime = Builder.CreateCall(ExtStartFn, {CalleeId, ClassId});
+  setUnsafeProbeCallConv(StartTime);
+
+  bool Modified = false;
+  for (BasicBlock *Dest : Dests) {
+    BasicBlock *ProbeBB = Dest;
+    if (!Dest->getSinglePredecessor()) {
+      // Splitting an edge into a shared EH pad needs landing-pad surgery;
+      // leave those rare sites with an unbalanced start, which the runtime
+      // ignores.
+      if (Dest->isEHPad())
+        continue;
+      ProbeBB = SplitEdge(I->getParent(), Dest);
+      if (!ProbeBB)
+        continue;
+    }
+    Instruction *InsertPt = &*ProbeBB->getFirstInsertionPt();
+    emitProbeSerialization(InsertPt, /*IsEndProbe=*/true);
+    IRBuilder<> EndBuilder(InsertPt);
+    setUnsafeProbeCallConv(
+        EndBuilder.CreateCall(ExtEndFn, {StartTime, CalleeId}));
+    Modified = true;
+  }
+  return Modified;
+}
+
 /// Instruments external function calls within a function.
 /// Uses a three-pass strategy to avoid iterator invalidation.
 bool instrumentExternalCalls(Function &F, FunctionCallee ExtStartFn,
-                              FunctionCallee ExtEndFn) {
+                              FunctionCallee ExtEndFn,
+                              FunctionCallee ExtEndSampledFn,
+                              FunctionCallee ExtEndSpanFn,
+                              unsigned &NextSiteIndex,
+                              MapVector<StringRef, unsigned> &CalleeIds) {
   // First pass: collect all external calls to instrument
   SmallVector<Instruction*, 32> CallsToInstrument;
 
@@ -67,24 +373,100 @@ bool instrumentExternalCalls(Function &F, FunctionCallee ExtStartFn,
   if (CallsToInstrument.empty())
     return false;
 
+  // Span coalescing peephole: group maximal runs of adjacent plain call
+  // sites (each call's next non-debug instruction is the next call) under
+  // one start/end pair. Sampled mode keeps individual probes — its
+  // per-site gate already decides per execution, and merging the gates
+  // would change what a site's rate means.
+  SmallPtrSet<Instruction *, 16> SpanTails;
+  SmallDenseMap<Instruction *, std::pair<unsigned, Instruction *>, 8> Spans;
+  if (ExternalCallCoalesceSpans && ExternalCallSampleRate <= 1) {
+    SmallPtrSet<Instruction *, 32> PlainCalls;
+    for (Instruction *I : CallsToInstrument)
+      if (!I->isTerminator())
+        PlainCalls.insert(I);
+    for (Instruction *I : CallsToInstrument) {
+      if (!PlainCalls.count(I) || SpanTails.count(I))
+        continue;
+      unsigned Count = 1;
+      Instruction *Last = I;
+      while (Instruction *Next = Last->getNextNonDebugInstruction()) {
+        if (!PlainCalls.count(Next))
+          break;
+        SpanTails.insert(Next);
+        Last = Next;
+        ++Count;
+      }
+      if (Count > 1)
+        Spans[I] = {Count, Last};
+    }
+  }
+
   // Second pass: insert instrumentation around collected calls
   bool Modified = false;
+  Type *Int32Ty = Type::getInt32Ty(F.getContext());
   for (Instruction *I : CallsToInstrument) {
-    // Skip terminator instructions to avoid IR corruption
-    if (I->isTerminator())
+    // Covered by the probes of the span it belongs to.
+    if (SpanTails.count(I))
+      continue;
+    // Dense per-callee ID, assigned on first sight module-wide.
+    StringRef CalleeName = cast<CallBase>(I)->getCalledFunction()->getName();
+    unsigned Id =
+        CalleeIds.insert({CalleeName, CalleeIds.size()}).first->second;
+    Value *CalleeId = ConstantInt::get(Int32Ty, Id);
+    Value *ClassId = ConstantInt::get(Int32Ty, classifyCallee(CalleeName));
+
+    // Terminator call sites (invoke/callbr) need successor-side end probes.
+    if (I->isTerminator()) {
+      if (ExternalCallCoverTerminators &&
+          instrumentTerminatorCall(I, ExtStartFn, ExtEndFn, CalleeId,
+                                   ClassId))
+        Modified = true;
       continue;
+    }
+
+    if (ExternalCallSampleRate > 1) {
+      if (instrumentSampledCall(I, ExtStartFn, ExtEndSampledFn,
+                                NextSiteIndex++, CalleeId, ClassId))
+        Modified = true;
+      continue;
+    }
+
+    // Span head: one pair brackets the whole run, and the end probe hands
+    // the runtime the call count so per-callee counts stay accurate.
+    auto SpanIt = Spans.find(I);
+    if (SpanIt != Spans.end()) {
+      auto [SpanCount, SpanLast] = SpanIt->second;
+      emitProbeSerialization(I, /*IsEndProbe=*/false);
+      IRBuilder<> Builder(I);
+      CallInst *StartTime = Builder.CreateCall(ExtStartFn, {CalleeId, ClassId});
+      setUnsafeProbeCallConv(StartTime);
+
+      Instruction *NextInst = SpanLast->getNextNonDebugInstruction();
+      if (NextInst) {
+        emitProbeSerialization(NextInst, /*IsEndProbe=*/true);
+        IRBuilder<> EndBuilder(NextInst);
+        setUnsafeProbeCallConv(EndBuilder.CreateCall(
+            ExtEndSpanFn,
+            {StartTime, CalleeId, ConstantInt::get(Int32Ty, SpanCount)}));
+        Modified = true;
+      }
+      continue;
+    }
 
     // Insert timer start before the call
+    emitProbeSerialization(I, /*IsEndProbe=*/false);
     IRBuilder<> Builder(I);
-    Builder.CreateFence(AtomicOrdering::SequentiallyConsistent);
-    Value *StartTime = Builder.CreateCall(ExtStartFn);
+    CallInst *StartTime = Builder.CreateCall(ExtStartFn, {CalleeId, ClassId});
+    setUnsafeProbeCallConv(StartTime);
 
     // Insert timer end after the call
     Instruction *NextInst = I->getNextNonDebugInstruction();
     if (NextInst) {
+      emitProbeSerialization(NextInst, /*IsEndProbe=*/true);
       IRBuilder<> EndBuilder(NextInst);
-      EndBuilder.CreateFence(AtomicOrdering::SequentiallyConsistent);
-      EndBuilder.CreateCall(ExtEndFn, {StartTime});
+      setUnsafeProbeCallConv(
+          EndBuilder.CreateCall(ExtEndFn, {StartTime, CalleeId}));
       Modified = true;
     }
     // Note: Calls at block end without a next instruction are skipped to avoid
@@ -102,17 +484,49 @@ PreservedAnalyses ExternalCallTrackerPass::run(Module &M, ModuleAnalysisManager
 
   LLVMContext &Ctx = M.getContext();
   Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
   Type *Int64Ty = Type::getInt64Ty(Ctx);
 
-  // Get declarations for external call tracking runtime functions
+  // Get declarations for external call tracking runtime functions. Every
+  // probe carries the dense callee ID so the runtime can attribute time to
+  // a flat per-callee array. external_call_start(callee_id, class_id):
+  // the class ID (0 = compute FFI, 1 = syscall wrapper) is resolved at
+  // compile time, so per-class accumulation needs no run-time name
+  // inspection. The runtime takes the extra operand in lockstep.
   FunctionCallee ExtStartFn = M.getOrInsertFunction(EXTERNAL_CALL_START_FN,
-      FunctionType::get(Int64Ty, {}, false));
-  FunctionCallee ExtEndFn = M.getOrInsertFunction(EXTERNAL_CALL_END_FN,
-      FunctionType::get(VoidTy, {Int64Ty}, false));
+      FunctionType::get(Int64Ty, {Int32Ty, Int32Ty}, false));
+  // external_call_end_gap shares the plain end signature, so under
+  // -external-call-gap-histograms the swap happens here wholesale and
+  // the emission code below is none the wiser. Not combined with
+  // sampling: 1-in-N timing makes "consecutive" calls N apart, so the
+  // gap distribution would be fiction.
+  bool UseGapProbe = ExternalCallGapHistograms && ExternalCallSampleRate <= 1;
+  FunctionCallee ExtEndFn = M.getOrInsertFunction(
+      UseGapProbe ? EXTERNAL_CALL_END_GAP_FN : EXTERNAL_CALL_END_FN,
+      FunctionType::get(VoidTy, {Int64Ty, Int32Ty}, false));
+  // external_call_end_sampled(start, sample_rate, callee_id)
+  FunctionCallee ExtEndSampledFn = M.getOrInsertFunction(
+      EXTERNAL_CALL_END_SAMPLED_FN,
+      FunctionType::get(VoidTy, {Int64Ty, Int64Ty, Int32Ty}, false));
+  // external_call_end_span(start, callee_id, call_count): closes a
+  // coalesced run of back-to-back calls. Only reaches the IR under
+  // -external-call-coalesce-spans; keep clean modules free of the unused
+  // declaration.
+  FunctionCallee ExtEndSpanFn;
+  if (ExternalCallCoalesceSpans)
+    ExtEndSpanFn = M.getOrInsertFunction(
+        EXTERNAL_CALL_END_SPAN_FN,
+        FunctionType::get(VoidTy, {Int64Ty, Int32Ty, Int32Ty}, false));
 
   bool Modified = false;
+  unsigned NextSiteIndex = 0;
+  MapVector<StringRef, unsigned> CalleeIds;
 
-  // Instrument all non-declaration functions
+  // Instrument all non-declaration functions, in sorted-name order rather
+  // than module order: callee IDs are dense in first-seen order, so this
+  // keeps them (and the registration table) stable when the frontend
+  // reorders the module between builds.
+  SmallVector<Function *, 16> Work;
   for (Function &F : M) {
     if (F.isDeclaration())
       continue;
@@ -121,9 +535,18 @@ PreservedAnalyses ExternalCallTrackerPass::run(Module &M, ModuleAnalysisManager
     if (isRuntimeFunction(F.getName()))
       continue;
 
-    if (instrumentExternalCalls(F, ExtStartFn, ExtEndFn))
-      Modified = true;
+    Work.push_back(&F);
   }
+  llvm::sort(Work, [](const Function *A, const Function *B) {
+    return A->getName() < B->getName();
+  });
+  for (Function *F : Work)
+    if (instrumentExternalCalls(*F, ExtStartFn, ExtEndFn, ExtEndSampledFn,
+                                ExtEndSpanFn, NextSiteIndex, CalleeIds))
+      Modified = true;
+
+  if (!CalleeIds.empty())
+    setupCalleeTableRegistration(M, CalleeIds);
 
   return Modified ? PreservedAnalyses::none() : PreservedAnalyses::all();
 }
@@ -0,0 +1,179 @@
+//===-- UnsafeShareEstimator.cpp - Static unsafe-cycle-share estimate ------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------------===//
+///
+/// \file
+/// This file implements the UnsafeShareEstimator pass. For every function it
+/// weights each block's summed TTI latency estimate by the block's static
+/// frequency relative to entry, and reports how much of that weight falls
+/// inside marked unsafe regions — a compile-time approximation of the
+/// fraction cpu_cycle mode measures.
+///
+//===----------------------------------------------------------------------------===//
+
+#include "llvm/Transforms/CpuCycleCount/UnsafeShareEstimator.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/InstMarker/UnsafeRegionAnalysis.h"
+#include "llvm/Transforms/InstMarker/UnsafeStatsFormat.h"
+#include <memory>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "unsafe-share-estimator"
+
+STATISTIC(NumShareFunctionsEstimated,
+          "Number of functions given a static unsafe-share estimate");
+STATISTIC(NumShareRegionsWeighted,
+          "Number of unsafe regions weighted by the share estimator");
+
+// Pre-run triage: ranking benchmarks by expected unsafe share currently
+// takes a full instrumented run of each, which is exactly the cluster time
+// the ranking is meant to save. With a directory given, this report-only
+// pass combines the shared region enumeration with static block
+// frequencies and TTI latency estimates into a per-function unsafe-weight
+// fraction, written as one TSV per codegen unit at compile time — so
+// benchmarks whose estimated share is below a threshold can be skipped
+// before any run. The absolute numbers are crude (static frequencies, no
+// callee latencies); the ranking is what they are for.
+static cl::opt<std::string> UnsafeShareReportDir(
+  "unsafe-share-report-dir", cl::init(""), cl::Hidden,
+  cl::desc("Write per-function static unsafe-cycle-share estimates into "
+           "this directory (empty = off)")
+);
+
+namespace {
+
+/// \brief Open the per-module share report in the configured directory.
+///
+/// File naming and failure handling mirror the density report: one file
+/// per codegen unit, and a write failure is a warning — the build still
+/// succeeds, only the report is lost.
+std::unique_ptr<raw_fd_ostream> openShareReport(const Module &M) {
+  SmallString<128> FileName(sys::path::filename(M.getModuleIdentifier()));
+  for (char &C : FileName)
+    if (!isAlnum(C) && C != '.' && C != '-' && C != '_')
+      C = '_';
+
+  SmallString<256> Path(UnsafeShareReportDir);
+  sys::path::append(Path, FileName + ".unsafe_share.tsv");
+
+  std::error_code EC;
+  auto OS = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "warning: cannot write unsafe share report " << Path << ": "
+           << EC.message() << "\n";
+    return nullptr;
+  }
+  return OS;
+}
+
+/// \brief Summed latency estimate of [\p First, \p Last), markers excluded.
+///
+/// Unlike the cycle pass's estimateRegionCost, an invalid cost (a call into
+/// unknown code, mostly) does not bail out: the callee's latency is
+/// unknowable here either way, and counting it as 0 underestimates
+/// numerator and denominator alike, which a ranking tolerates.
+double rangeLatency(const Instruction *First, const Instruction *Last,
+                    const TargetTransformInfo &TTI,
+                    const UnsafeRegionInfo *Regions) {
+  double Cost = 0;
+  for (const Instruction *I = First; I && I != Last; I = I->getNextNode()) {
+    bool IsBegin, IsEnd;
+    if (Regions && Regions->isMarker(*I, IsBegin, IsEnd))
+      continue;
+    InstructionCost C =
+        TTI.getInstructionCost(I, TargetTransformInfo::TCK_Latency);
+    if (C.isValid())
+      Cost += C.getValue().value_or(0);
+  }
+  return Cost;
+}
+
+} // anonymous namespace
+
+PreservedAnalyses UnsafeShareEstimatorPass::run(Module &M,
+                                                ModuleAnalysisManager &AM) {
+  if (UnsafeShareReportDir.empty() || !isUnsafePrimaryPackage())
+    return PreservedAnalyses::all();
+
+  FunctionAnalysisManager &FAM =
+      AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+  std::unique_ptr<raw_fd_ostream> OS = openShareReport(M);
+  if (!OS)
+    return PreservedAnalyses::all();
+  writeUnsafeStatsHeader(*OS, getUnsafeModuleHash(M));
+
+  // Columns: name, estimated unsafe weight, estimated total weight, share.
+  // The final row aggregates the module under the reserved name <module>;
+  // summing entry-normalized weights treats every function entry as equally
+  // hot, so the per-function rows carry the real ranking and the module row
+  // is only a coarse headline.
+  double ModuleUnsafe = 0, ModuleTotal = 0;
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+
+    // Unsafe weight follows what cpu_cycle mode would measure, so the
+    // function filter (-unsafe-instr-funcs) gates the numerator only; every
+    // function's weight lands in the denominator regardless.
+    const UnsafeRegionInfo *Regions = nullptr;
+    if (hasUnsafeRegionMarkers(F) && unsafeInstrFuncFilterAllows(F))
+      Regions = &FAM.getResult<UnsafeRegionAnalysis>(F);
+
+    BlockFrequencyInfo &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+    const TargetTransformInfo &TTI = FAM.getResult<TargetIRAnalysis>(F);
+    uint64_t EntryFreq = BFI.getEntryFreq().getFrequency();
+    if (EntryFreq == 0)
+      continue;
+
+    double FuncTotal = 0;
+    for (const BasicBlock &BB : F) {
+      double Rel =
+          double(BFI.getBlockFreq(&BB).getFrequency()) / double(EntryFreq);
+      FuncTotal += Rel * rangeLatency(&BB.front(), nullptr, TTI, Regions);
+    }
+
+    double FuncUnsafe = 0;
+    if (Regions) {
+      for (const UnsafeRegion &R : Regions->regions()) {
+        const BasicBlock *BB = R.Begin->getParent();
+        double Rel =
+            double(BFI.getBlockFreq(BB).getFrequency()) / double(EntryFreq);
+        FuncUnsafe +=
+            Rel * rangeLatency(R.Begin->getNextNode(), R.End, TTI, Regions);
+        ++NumShareRegionsWeighted;
+      }
+    }
+
+    double Share = FuncTotal > 0 ? FuncUnsafe / FuncTotal : 0;
+    *OS << F.getName() << '\t' << format("%.1f", FuncUnsafe) << '\t'
+        << format("%.1f", FuncTotal) << '\t' << format("%.4f", Share) << '\n';
+    ++NumShareFunctionsEstimated;
+
+    ModuleUnsafe += FuncUnsafe;
+    ModuleTotal += FuncTotal;
+  }
+
+  double ModuleShare = ModuleTotal > 0 ? ModuleUnsafe / ModuleTotal : 0;
+  *OS << "<module>" << '\t' << format("%.1f", ModuleUnsafe) << '\t'
+      << format("%.1f", ModuleTotal) << '\t' << format("%.4f", ModuleShare)
+      << '\n';
+
+  return PreservedAnalyses::all();
+}
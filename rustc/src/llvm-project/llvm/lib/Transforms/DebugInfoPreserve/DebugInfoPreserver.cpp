@@ -1,24 +1,47 @@
 //===-- DebugInfoPreserver.cpp - Preserve Debug Metadata ------------------===//
 #include "llvm/Transforms/DebugInfoPreserve/DebugInfoPreserver.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Support/Debug.h"
 
 using namespace llvm;
 
+#define DEBUG_TYPE "debug-info-preserver"
+
+STATISTIC(NumFunctionsVerified, "Number of functions verified");
+STATISTIC(NumFunctionsSkipped,
+          "Number of untouched functions skipped by incremental verification");
+STATISTIC(NumPHINodesRepaired, "Number of PHI nodes moved back into order");
+STATISTIC(NumLocationsPreserved, "Number of debug locations anchored");
+
+// Full-module sweep: by default only the functions the unsafe
+// instrumentation modified are verified — untouched functions cannot have
+// lost locations or PHI ordering to the instrumentation, and on large
+// crates they are almost all of the module. This flag restores the old
+// whole-module behavior for debugging the preserver itself.
+static cl::opt<bool> DebugInfoPreserveAll(
+  "debug-info-preserve-all", cl::init(false), cl::Hidden,
+  cl::desc("Verify every function instead of only the ones the unsafe "
+           "instrumentation modified")
+);
+
 namespace {
 bool verifyPHINodes(BasicBlock &BB) {
     bool Modified = false;
     BasicBlock::iterator I = BB.begin();
     BasicBlock::iterator InsertPt = BB.begin();
-    
+
     while (I != BB.end() && isa<PHINode>(I)) {
         PHINode *PN = cast<PHINode>(I++);
         if (PN->getIterator() != InsertPt) {
             PN->moveBefore(&*InsertPt);
+            ++NumPHINodesRepaired;
             Modified = true;
         }
         ++InsertPt;
@@ -28,40 +51,43 @@ bool verifyPHINodes(BasicBlock &BB) {
 
 bool isValidDebugLocation(const DILocation *Loc) {
     if (!Loc) return false;
-    return (Loc->getScope() && Loc->getFile() && 
+    return (Loc->getScope() && Loc->getFile() &&
             Loc->getLine() > 0 && Loc->getColumn() > 0);
 }
 
+/// \brief Whether \p F needs verification at all.
+///
+/// The instrumentation passes stamp every function they modify with region
+/// markers, so that stamp is exactly the modification set; functions
+/// without it were never touched and verify trivially.
+bool shouldVerify(const Function &F) {
+    if (F.isDeclaration()) return false;
+    return DebugInfoPreserveAll || hasUnsafeRegionMarkers(F);
+}
+
 } // namespace
 
 PreservedAnalyses DebugInfoPreserverPass::run(Module &M, ModuleAnalysisManager &AM) {
     LLVMContext &Ctx = M.getContext();
     bool Modified = false;
 
-    // step a: reorder PHIs
+    // step a: reorder PHIs in the modified functions
     for (Function &F : M) {
-        if (F.isDeclaration()) continue;
+        if (!shouldVerify(F)) {
+            if (!F.isDeclaration()) ++NumFunctionsSkipped;
+            continue;
+        }
+        ++NumFunctionsVerified;
         for (BasicBlock &BB : F) Modified |= verifyPHINodes(BB);
     }
 
-    // step b: create anchor global (no exceptions)
-    GlobalVariable *GV = new GlobalVariable(
-        M, 
-        Type::getInt8Ty(Ctx), 
-        false,
-        GlobalValue::InternalLinkage, 
-        ConstantInt::get(Type::getInt8Ty(Ctx), 0),
-        "__unsafe_coverage_anchor"
-    );
-
-    if (!GV) return PreservedAnalyses::none();
-
-    // step c: collect valid DILocations
+    // step b: collect valid DILocations from the modified functions
     SmallVector<Metadata *, 256> MetadataRefs;
     for (Function &F : M) {
+        if (!shouldVerify(F)) continue;
         for (BasicBlock &BB : F) {
             for (Instruction &I : BB) {
-                if (const DILocation *Loc = I.getDebugLoc()) {
+                if (DILocation *Loc = I.getDebugLoc()) {
                     if (isValidDebugLocation(Loc)) {
                         // wrap in ArrayRef via initializer list
                         MetadataRefs.push_back(MDNode::get(Ctx, {Loc}));
@@ -71,14 +97,24 @@ PreservedAnalyses DebugInfoPreserverPass::run(Module &M, ModuleAnalysisManager &
         }
     }
 
-    // step d: attach metadata
+    // step c: anchor the collected locations on a kept global. A module
+    // with nothing to preserve gets no anchor at all.
     if (!MetadataRefs.empty()) {
+        GlobalVariable *GV = new GlobalVariable(
+            M,
+            Type::getInt8Ty(Ctx),
+            false,
+            GlobalValue::InternalLinkage,
+            ConstantInt::get(Type::getInt8Ty(Ctx), 0),
+            "__unsafe_coverage_anchor"
+        );
+
+        NumLocationsPreserved += MetadataRefs.size();
         MDNode *DebugMD = MDNode::get(Ctx, MetadataRefs);
         if (DebugMD) GV->addMetadata("preserved.debuginfo", *DebugMD);
+        appendToCompilerUsed(M, {GV});
+        Modified = true;
     }
 
-    // step e: keep anchor global
-    appendToCompilerUsed(M, {GV});
-
     return Modified ? PreservedAnalyses::none() : PreservedAnalyses::all();
 }
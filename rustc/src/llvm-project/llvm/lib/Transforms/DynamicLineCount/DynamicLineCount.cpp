@@ -9,131 +9,235 @@
 /// \file
 /// This file implements the DynamicLineCount pass for tracking unsafe
 /// source line coverage using a two-phase approach:
-/// Phase 1: Compile-time - Collect all unsafe lines and register via constructor
-/// Phase 2: Runtime - Insert tracking calls at unsafe instructions
+/// Phase 1: Compile-time - Intern every (file, line) pair into a dense ID and
+///          register the table via constructor, in ID order
+/// Phase 2: Runtime - Insert ID-only tracking calls at unsafe instructions
 ///
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Transforms/DynamicLineCount/DynamicLineCount.h"
+#include "llvm/Transforms/DynamicLineCount/UnsafeCoverageFormat.h"
 #include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/InstMarker/UnsafeRegionAnalysis.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/Support/Casting.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
+#include <map>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 using namespace llvm;
 
-const char *REGISTER_UNSAFE_LINE_FN = "register_unsafe_line";
+#define DEBUG_TYPE "dynamic-line-count"
+
+STATISTIC(NumLineProbes, "Number of unsafe line probes inserted");
+STATISTIC(NumUniqueUnsafeLines, "Number of distinct unsafe (file, line) pairs");
+STATISTIC(NumLineProbesDeduped,
+          "Number of same-line probes dropped within one basic block");
+
+const char *REGISTER_UNSAFE_LINES_BULK_FN = "register_unsafe_lines_bulk";
 const char *TRACK_UNSAFE_LINE_EXECUTION_FN = "track_unsafe_line_execution";
+const char *REGISTER_COVERED_MAP_FN = "register_unsafe_line_covered_map";
 const char *PRINT_UNSAFE_COVERAGE_STATS_FN = "print_unsafe_coverage_stats";
+const char *DUMP_UNSAFE_COVERAGE_BINARY_FN = "dump_unsafe_coverage_binary";
+const char *FLUSH_UNSAFE_LINE_COUNTS_FN = "flush_unsafe_line_counts";
+const char *REGISTER_UNSAFE_LINE_THREAD_FLUSH_FN =
+    "register_unsafe_line_thread_flush";
+
+// Coverage-only mode: when the question is just "was this unsafe line ever
+// executed", per-execution counter calls are wasted work. Each probe becomes
+// a load of the line's flag byte and a store of 1 guarded by "not set yet",
+// so after warmup every probe is a load plus a not-taken branch and
+// long-running coverage runs approach native speed. The flag map is handed
+// to the runtime once from the module ctor.
+static cl::opt<bool> UnsafeLineCoverageOnly(
+  "unsafe-line-coverage-only", cl::init(false), cl::Hidden,
+  cl::desc("Track only whether each unsafe line ever executed, via "
+           "self-disabling flag probes instead of counter calls")
+);
+
+// Per-thread line counters: track_unsafe_line_execution bumps one global
+// counter region, which gets homed on whichever NUMA node first touches it
+// — on a dual-socket box, remote-node probe updates in rayon benchmarks
+// cost 2-3x local ones and skew per-thread comparisons. Under this flag
+// each probe bumps a thread-local counter array instead: TLS blocks are
+// allocated by their owning thread, so first touch places every array on
+// that thread's own node and the hot path never crosses the interconnect.
+// Threads flush through the registered callback (the runtime invokes it
+// from its thread-exit hook and folds counts per node before the global
+// table); the main thread flushes from a destructor. Coverage-only mode
+// ignores the flag; its flag bytes are write-once and effectively free
+// after warmup.
+static cl::opt<bool> UnsafeLineTlsCounters(
+  "unsafe-line-tls-counters", cl::init(false), cl::Hidden,
+  cl::desc("Count unsafe line executions in per-thread (NUMA-local) arrays "
+           "flushed at thread exit instead of one shared counter region")
+);
+
+// Binary dump mode: the exit path formats no text and the aggregator can
+// mmap the result instead of re-parsing it each run. The on-disk layout is
+// defined in UnsafeCoverageFormat.h, shared with the runtime; the dtor
+// passes the format version so a mismatched runtime fails loudly.
+static cl::opt<bool> UnsafeCoverageBinaryDump(
+  "unsafe-coverage-binary-dump", cl::init(false), cl::Hidden,
+  cl::desc("Dump unsafe coverage in the binary UnsafeCoverageFormat layout "
+           "at exit instead of printing text")
+);
 
 namespace {
 
+/// An interned unsafe line: the map key is (file, line), the value the dense
+/// ID the pair was assigned. std::map keeps the interning deterministic.
+using LineKey = std::pair<std::string, uint64_t>;
+using LineIdMap = std::map<LineKey, uint32_t>;
+
+/// One pending probe: the instruction to instrument and its line key. The ID
+/// is looked up after the whole module has been interned.
+struct LineProbe {
+  Instruction *I;
+  LineKey Key;
+};
+
 /// \brief Setup runtime functions for unsafe line coverage tracking.
 static void setupRuntimeFunctions(Module &M,
-                                  FunctionCallee &RegisterLineFn,
+                                  FunctionCallee &RegisterBulkFn,
                                   FunctionCallee &TrackExecutionFn,
+                                  FunctionCallee &RegisterCoveredMapFn,
                                   FunctionCallee &PrintStatsFn) {
   LLVMContext &Ctx = M.getContext();
   Type *VoidTy = Type::getVoidTy(Ctx);
-  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
   Type *Int8PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
 
-  // register_unsafe_line(line, file)
-  FunctionType *RegisterLineFnTy = FunctionType::get(VoidTy, {Int64Ty, Int8PtrTy}, false);
-  RegisterLineFn = M.getOrInsertFunction(REGISTER_UNSAFE_LINE_FN, RegisterLineFnTy);
+  // register_unsafe_lines_bulk(entries, num_lines, file_blob, module_hash):
+  // entries is an array of {u32 line, u32 file-offset} records in ascending
+  // ID order (so record N defines ID N), file_blob the NUL-separated
+  // file-name pool the offsets index into. One call replaces one call per
+  // line at startup. module_hash is the 64-bit content hash qualifying this
+  // module's line IDs; dumps carry it next to the IDs so shards from
+  // different builds merge by (hash, id). Under -unsafe-extern-tables both
+  // pointers are null and only num_lines and the hash are meaningful: the
+  // tables live in the extracted .unsafe_tables stream and the runtime
+  // dumps raw IDs for the aggregator to join.
+  FunctionType *RegisterBulkFnTy = FunctionType::get(
+      VoidTy, {Int8PtrTy, Int32Ty, Int8PtrTy, Type::getInt64Ty(Ctx)}, false);
+  RegisterBulkFn =
+      M.getOrInsertFunction(REGISTER_UNSAFE_LINES_BULK_FN, RegisterBulkFnTy);
 
-  // track_unsafe_line_execution(line, file)
-  FunctionType *TrackExecutionFnTy = FunctionType::get(VoidTy, {Int64Ty, Int8PtrTy}, false);
+  // track_unsafe_line_execution(id): a single array-indexed increment.
+  FunctionType *TrackExecutionFnTy = FunctionType::get(VoidTy, {Int32Ty}, false);
   TrackExecutionFn = M.getOrInsertFunction(TRACK_UNSAFE_LINE_EXECUTION_FN, TrackExecutionFnTy);
 
-  // print_unsafe_coverage_stats()
-  FunctionType *PrintFnTy = FunctionType::get(VoidTy, false);
-  PrintStatsFn = M.getOrInsertFunction(PRINT_UNSAFE_COVERAGE_STATS_FN, PrintFnTy);
-}
-
-/// \brief Creates a global string constant for the given string value.
-static Value *createGlobalString(Module &M, IRBuilder<> &Builder, StringRef Str) {
-  return Builder.CreateGlobalStringPtr(Str);
-}
+  // register_unsafe_line_covered_map(map, num_lines): hands the runtime the
+  // ID-indexed flag map written by coverage-only probes.
+  FunctionType *RegisterCoveredMapFnTy =
+      FunctionType::get(VoidTy, {Int8PtrTy, Int32Ty}, false);
+  RegisterCoveredMapFn =
+      M.getOrInsertFunction(REGISTER_COVERED_MAP_FN, RegisterCoveredMapFnTy);
 
-/// \brief Return true if instruction is a marker, and set isBegin/isEnd accordingly.
-static bool isMarkerInstruction(const Instruction &I, bool &isBegin, bool &isEnd) {
-  if (const CallBase *CallInst = dyn_cast<CallBase>(&I)) {
-    if (const llvm::InlineAsm *InlineAsm = 
-        dyn_cast<llvm::InlineAsm>(CallInst->getCalledOperand()->stripPointerCasts())) {
-      StringRef AsmStr = InlineAsm->getAsmString();
-      if (AsmStr == llvm::UNSAFE_MARKER_BEGIN) { isBegin = true; return true; }
-      if (AsmStr == llvm::UNSAFE_MARKER_END)   { isEnd = true; return true; }
-    }
+  // print_unsafe_coverage_stats() / dump_unsafe_coverage_binary(version):
+  // the exit path, selected by -unsafe-coverage-binary-dump. The binary
+  // variant takes the expected UnsafeCoverageFormat version.
+  if (UnsafeCoverageBinaryDump) {
+    FunctionType *DumpFnTy = FunctionType::get(VoidTy, {Int32Ty}, false);
+    PrintStatsFn =
+        M.getOrInsertFunction(DUMP_UNSAFE_COVERAGE_BINARY_FN, DumpFnTy);
+  } else {
+    FunctionType *PrintFnTy = FunctionType::get(VoidTy, false);
+    PrintStatsFn =
+        M.getOrInsertFunction(PRINT_UNSAFE_COVERAGE_STATS_FN, PrintFnTy);
   }
-  return false;
 }
 
 /// \brief Return true if function should be instrumented.
 static bool shouldInstrumentFunction(const Function &F) {
   if (F.isDeclaration() || F.isIntrinsic()) return false;
+  // Targeted runs (-unsafe-instr-funcs) probe only the listed functions.
+  if (!unsafeInstrFuncFilterAllows(F)) return false;
   StringRef Name = F.getName();
-  return Name != REGISTER_UNSAFE_LINE_FN &&
+  return Name != REGISTER_UNSAFE_LINES_BULK_FN &&
          Name != TRACK_UNSAFE_LINE_EXECUTION_FN &&
+         Name != REGISTER_COVERED_MAP_FN &&
          Name != PRINT_UNSAFE_COVERAGE_STATS_FN &&
+         Name != DUMP_UNSAFE_COVERAGE_BINARY_FN &&
          Name != "unsafe_lines_module_ctor" &&
-         Name != "unsafe_lines_module_dtor";
+         Name != "unsafe_lines_module_dtor" &&
+         Name != "unsafe_lines_thread_flush" &&
+         Name != "unsafe_lines_flush_ctor";
 }
 
-/// \brief Collect unsafe lines and instrument execution tracking in a function.
-static bool collectAndInstrumentFunction(Function &F, 
-                                        FunctionCallee TrackExecutionFn,
-                                        std::set<std::string> &allUnsafeLines) {
-  Module &M = *F.getParent();
-  LLVMContext &Ctx = F.getContext();
-  bool Modified = false;
-
+/// \brief Collect the unsafe-line probes of a function and intern their
+/// (file, line) pairs.
+///
+/// Instrumentation is deferred: IDs are dense across the whole module, so
+/// they can only be assigned once every function has been collected.
+///
+/// Probes are deduplicated per (block, line): one source line routinely
+/// compiles to several unsafe instructions, and every instruction of a
+/// line in the same block executes exactly as often as the first one, so
+/// the extra probes only multiply the recorded count by a codegen factor.
+/// One probe per line per block keeps "executions of this line" meaning
+/// what it says and drops probe volume by the instructions-per-line ratio.
+static void collectFunction(Function &F, const UnsafeRegionInfo &Regions,
+                            ArrayRef<StringRef> FileTable,
+                            std::vector<LineProbe> &Probes,
+                            LineIdMap &LineIds) {
   for (BasicBlock &BB : F) {
     bool insideUnsafeRegion = false;
-    
+    std::set<LineKey> SeenInBlock;
+
     for (Instruction &I : BB) {
       bool isBegin = false, isEnd = false;
-      
+
       // Check for unsafe region markers
-      if (isMarkerInstruction(I, isBegin, isEnd)) {
+      if (Regions.isMarker(I, isBegin, isEnd)) {
         if (isBegin) insideUnsafeRegion = true;
         else if (isEnd) insideUnsafeRegion = false;
         continue;
       }
-      
+
       // Process unsafe instructions
-      if (insideUnsafeRegion && I.getMetadata("unsafe_inst")) {
-        if (MDNode *LineInfoMD = I.getMetadata("unsafe_line_info")) {
+      if (insideUnsafeRegion && I.getMetadata(LLVMContext::MD_unsafe_inst)) {
+        if (MDNode *LineInfoMD = I.getMetadata(LLVMContext::MD_unsafe_line_info)) {
           if (LineInfoMD->getNumOperands() >= 2) {
             if (auto *LineConst = dyn_cast<ConstantAsMetadata>(LineInfoMD->getOperand(0))) {
-              if (auto *FileStr = dyn_cast<MDString>(LineInfoMD->getOperand(1))) {
-                unsigned Line = LineConst->getValue()->getUniqueInteger().getZExtValue();
-                std::string File = FileStr->getString().str();
-                std::string LineKey = File + ":" + std::to_string(Line);
-                
-                // Add to global collection for compile-time registration
-                allUnsafeLines.insert(LineKey);
-                
-                // Insert runtime execution tracking
-                IRBuilder<> Builder(&I);
-                Value *LineArg = ConstantInt::get(Type::getInt64Ty(Ctx), Line);
-                Value *FileArg = createGlobalString(M, Builder, File);
-                Builder.CreateCall(TrackExecutionFn, {LineArg, FileArg});
-                
-                Modified = true;
+              uint64_t Line = LineConst->getValue()->getUniqueInteger().getZExtValue();
+              // Operand 1 is the file's index into the module's
+              // unsafe.files table; IR predating the table carries the
+              // path as an inline MDString instead.
+              StringRef File;
+              if (auto *FileIdx = dyn_cast<ConstantAsMetadata>(LineInfoMD->getOperand(1))) {
+                uint64_t Idx =
+                    FileIdx->getValue()->getUniqueInteger().getZExtValue();
+                if (Idx < FileTable.size())
+                  File = FileTable[Idx];
+              } else if (auto *FileStr = dyn_cast<MDString>(LineInfoMD->getOperand(1))) {
+                File = FileStr->getString();
+              }
+              if (!File.empty()) {
+                LineKey Key(File.str(), Line);
+                if (!SeenInBlock.insert(Key).second) {
+                  ++NumLineProbesDeduped;
+                  continue;
+                }
+                LineIds.emplace(Key, 0); // ID assigned later
+                Probes.push_back({&I, std::move(Key)});
               }
             }
           }
@@ -141,39 +245,177 @@ static bool collectAndInstrumentFunction(Function &F,
       }
     }
   }
-  
-  return Modified;
 }
 
 /// \brief Create a module constructor that registers all unsafe lines at startup.
-static void createModuleConstructor(Module &M,
-                                   const std::set<std::string> &allUnsafeLines,
-                                   FunctionCallee RegisterLineFn) {
+///
+/// The whole table goes over in one bulk call: a constant array of
+/// {u32 line, u32 file-offset} records in ascending ID order (record N
+/// defines ID N) plus a NUL-separated pool of the distinct file names, so
+/// startup does no per-line work. Returns the registration function; under
+/// -unsafe-lazy-registration it is not scheduled as a ctor — the caller
+/// wraps it in the once-guard and gates the probes on its flag.
+static Function *createModuleConstructor(Module &M, const LineIdMap &LineIds,
+                                         FunctionCallee RegisterBulkFn,
+                                         FunctionCallee RegisterCoveredMapFn,
+                                         GlobalVariable *CoveredMap) {
   LLVMContext &Ctx = M.getContext();
-  
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int8PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+
+  // Pack each distinct file name once into the string pool and each line
+  // into one fixed-size record. Map order is sorted (file, line) order,
+  // which is exactly ascending ID order.
+  std::string FilePool;
+  std::map<std::string, uint32_t> FileOffsets;
+  StructType *EntryTy = StructType::get(Int32Ty, Int32Ty);
+  std::vector<Constant *> Entries;
+  Entries.reserve(LineIds.size());
+  for (const auto &[Key, Id] : LineIds) {
+    (void)Id;
+    auto It = FileOffsets.find(Key.first);
+    if (It == FileOffsets.end()) {
+      It = FileOffsets.emplace(Key.first, FilePool.size()).first;
+      FilePool += Key.first;
+      FilePool += '\0';
+    }
+    Entries.push_back(
+        ConstantStruct::get(EntryTy, ConstantInt::get(Int32Ty, Key.second),
+                            ConstantInt::get(Int32Ty, It->second)));
+  }
+
+  ArrayType *TableTy = ArrayType::get(EntryTy, Entries.size());
+  auto *TableGV = new GlobalVariable(
+      M, TableTy, /*isConstant=*/true, GlobalValue::InternalLinkage,
+      ConstantArray::get(TableTy, Entries), "__unsafe_line_table");
+  TableGV->setAlignment(Align(4));
+  placeUnsafeTableGlobal(TableGV);
+
+  Constant *PoolInit =
+      ConstantDataArray::getString(Ctx, FilePool, /*AddNull=*/false);
+  auto *PoolGV = new GlobalVariable(M, PoolInit->getType(),
+                                    /*isConstant=*/true,
+                                    GlobalValue::InternalLinkage, PoolInit,
+                                    "__unsafe_line_files");
+  placeUnsafeTableGlobal(PoolGV);
+
   // Create the constructor function
   FunctionType *CtorFnTy = FunctionType::get(Type::getVoidTy(Ctx), false);
   Function *CtorFn = Function::Create(CtorFnTy, GlobalValue::InternalLinkage,
                                       "unsafe_lines_module_ctor", &M);
-  
+
   BasicBlock *BB = BasicBlock::Create(Ctx, "entry", CtorFn);
   IRBuilder<> Builder(BB);
-  
-  // Register ALL unsafe lines found during compilation
-  for (const auto &lineKey : allUnsafeLines) {
-    size_t colonPos = lineKey.find(':');
-    std::string file = lineKey.substr(0, colonPos);
-    unsigned line = std::stoul(lineKey.substr(colonPos + 1));
-    
-    Value *LineArg = ConstantInt::get(Type::getInt64Ty(Ctx), line);
-    Value *FileArg = createGlobalString(M, Builder, file);
-    Builder.CreateCall(RegisterLineFn, {LineArg, FileArg});
+
+  Constant *ModuleHash =
+      ConstantInt::get(Type::getInt64Ty(Ctx), getUnsafeModuleHash(M));
+  if (unsafeExternTablesEnabled()) {
+    // The tables go to the excluded section; the runtime gets only the ID
+    // space so it can size its counters.
+    externalizeUnsafeTable(TableGV, UnsafeExternLineRecords);
+    externalizeUnsafeTable(PoolGV, UnsafeExternLineFilePool);
+    Constant *Null = ConstantPointerNull::get(cast<PointerType>(Int8PtrTy));
+    Builder.CreateCall(RegisterBulkFn,
+                       {Null, ConstantInt::get(Int32Ty, Entries.size()),
+                        Null, ModuleHash});
+  } else {
+    Builder.CreateCall(RegisterBulkFn,
+                       {Builder.CreateBitCast(TableGV, Int8PtrTy),
+                        ConstantInt::get(Int32Ty, Entries.size()),
+                        Builder.CreateBitCast(PoolGV, Int8PtrTy),
+                        ModuleHash});
   }
-  
+
+  // In coverage-only mode, also hand the runtime the flag map the probes
+  // write into.
+  if (CoveredMap) {
+    Builder.CreateCall(RegisterCoveredMapFn,
+                       {Builder.CreateBitCast(CoveredMap, Int8PtrTy),
+                        ConstantInt::get(Int32Ty, LineIds.size())});
+  }
+
   Builder.CreateRetVoid();
-  
+
+  placeUnsafeInstrThunk(CtorFn);
+
   // Add to global constructors with priority 0 (runs before main)
-  appendToGlobalCtors(M, CtorFn, 0);
+  if (!unsafeLazyRegistrationEnabled())
+    appendToGlobalCtors(M, CtorFn, 0);
+  return CtorFn;
+}
+
+/// \brief Emit the per-thread flush hooks for -unsafe-line-tls-counters.
+///
+/// Mirrors the per-thread cycle accumulators: a thunk hands this thread's
+/// array to flush_unsafe_line_counts, a ctor registers the thunk with the
+/// runtime (which calls it from its thread-exit hook and folds counts per
+/// NUMA node before the global table), and a destructor covers the main
+/// thread, which never passes through the thread-exit hook. Under
+/// -unsafe-lazy-registration (\p LazyRegFlag non-null) no ctor is
+/// scheduled; the returned registration thunk rides the table's
+/// first-firing entry point instead, and the flush itself no-ops while
+/// the flag is clear — the main-thread dtor runs even for modules that
+/// never executed, and an unregistered module has nothing to flush into.
+static Function *setupTlsCountsFlush(Module &M, GlobalVariable *TlsCounts,
+                                     uint64_t NumLines,
+                                     GlobalVariable *LazyRegFlag) {
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int8Ty = Type::getInt8Ty(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int8PtrTy = PointerType::getUnqual(Int8Ty);
+
+  // flush_unsafe_line_counts(counts, num_lines)
+  FunctionCallee FlushFn = M.getOrInsertFunction(
+      FLUSH_UNSAFE_LINE_COUNTS_FN,
+      FunctionType::get(VoidTy, {Int8PtrTy, Int32Ty}, false));
+
+  Function *FlushThunk = Function::Create(FunctionType::get(VoidTy, false),
+                                          GlobalValue::InternalLinkage,
+                                          "unsafe_lines_thread_flush", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", FlushThunk);
+  IRBuilder<> Builder(BB);
+  if (LazyRegFlag) {
+    // A clear flag means no probe ever fired here, so every count is zero
+    // and the runtime table it would fold into was never registered.
+    BasicBlock *Flush = BasicBlock::Create(Ctx, "flush", FlushThunk);
+    BasicBlock *Skip = BasicBlock::Create(Ctx, "skip", FlushThunk);
+    Value *Registered = Builder.CreateLoad(Int8Ty, LazyRegFlag);
+    Builder.CreateCondBr(
+        Builder.CreateICmpNE(Registered, ConstantInt::get(Int8Ty, 0)), Flush,
+        Skip);
+    IRBuilder<>(Skip).CreateRetVoid();
+    Builder.SetInsertPoint(Flush);
+  }
+  Builder.CreateCall(FlushFn,
+                     {Builder.CreateBitCast(TlsCounts, Int8PtrTy),
+                      ConstantInt::get(Int32Ty, NumLines)});
+  Builder.CreateRetVoid();
+  placeUnsafeInstrThunk(FlushThunk);
+
+  // register_unsafe_line_thread_flush(callback)
+  FunctionCallee RegisterFn = M.getOrInsertFunction(
+      REGISTER_UNSAFE_LINE_THREAD_FLUSH_FN,
+      FunctionType::get(VoidTy, {Int8PtrTy}, false));
+
+  Function *Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    LazyRegFlag ? "unsafe_lines_flush_register"
+                                                : "unsafe_lines_flush_ctor",
+                                    &M);
+  BasicBlock *CtorBB = BasicBlock::Create(Ctx, "entry", Ctor);
+  IRBuilder<> CtorBuilder(CtorBB);
+  CtorBuilder.CreateCall(RegisterFn,
+                         {CtorBuilder.CreateBitCast(FlushThunk, Int8PtrTy)});
+  CtorBuilder.CreateRetVoid();
+  placeUnsafeInstrThunk(Ctor);
+
+  appendToGlobalDtors(M, FlushThunk, 0);
+
+  if (LazyRegFlag)
+    return Ctor;
+  appendToGlobalCtors(M, Ctor, 0);
+  return nullptr;
 }
 
 /// \brief Create a module destructor that prints coverage stats at exit.
@@ -188,44 +430,178 @@ static void createModuleDestructor(Module &M, FunctionCallee PrintStatsFn) {
   BasicBlock *BB = BasicBlock::Create(Ctx, "entry", DtorFn);
   IRBuilder<> Builder(BB);
   
-  // Call the print stats function
-  Builder.CreateCall(PrintStatsFn);
+  // Call the stats exit path; the binary dump takes the expected format
+  // version so pass and runtime cannot silently disagree on the layout.
+  if (UnsafeCoverageBinaryDump)
+    Builder.CreateCall(PrintStatsFn,
+                       {ConstantInt::get(Type::getInt32Ty(Ctx),
+                                         unsafecov::CoverageFormatVersion)});
+  else
+    Builder.CreateCall(PrintStatsFn);
   Builder.CreateRetVoid();
-  
+  placeUnsafeInstrThunk(DtorFn);
+
   // Add to global destructors with priority 0 (runs at exit)
   appendToGlobalDtors(M, DtorFn, 0);
+
+  // Long-running benchmarks never reach the dtor; under
+  // -unsafe-stats-signal-dump the same dump also answers SIGUSR1.
+  if (unsafeSignalDumpEnabled())
+    emitSignalDumpRegistration(M, DtorFn);
 }
 
 } // anonymous namespace
 
 PreservedAnalyses DynamicLineCountPass::run(Module &M, ModuleAnalysisManager &AM) {
-  // Use std::set for deterministic ordering
-  std::set<std::string> allUnsafeLines;
-  bool Modified = false;
-  
+  LLVMContext &Ctx = M.getContext();
+  LineIdMap LineIds;
+  std::vector<LineProbe> Probes;
+
   // Setup runtime functions
-  FunctionCallee RegisterLineFn, TrackExecutionFn, PrintStatsFn;
-  setupRuntimeFunctions(M, RegisterLineFn, TrackExecutionFn, PrintStatsFn);
-  
-  // Phase 1: Collect all unsafe lines across ALL functions
-  // and instrument execution tracking
+  FunctionCallee RegisterBulkFn, TrackExecutionFn, RegisterCoveredMapFn,
+      PrintStatsFn;
+  setupRuntimeFunctions(M, RegisterBulkFn, TrackExecutionFn,
+                        RegisterCoveredMapFn, PrintStatsFn);
+
+  FunctionAnalysisManager &FAM =
+      AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+  // Resolve the module's interned file table once: unsafe_line_info nodes
+  // reference files by index into it. A malformed entry keeps its slot (as
+  // an empty name) so the indices of later entries stay valid.
+  SmallVector<StringRef, 8> FileTable;
+  if (NamedMDNode *Files = M.getNamedMetadata(UnsafeLineFileTableMD)) {
+    for (const MDNode *Entry : Files->operands()) {
+      const MDString *S = Entry->getNumOperands() == 1
+                              ? dyn_cast<MDString>(Entry->getOperand(0))
+                              : nullptr;
+      FileTable.push_back(S ? S->getString() : StringRef());
+    }
+  }
+
+  // Phase 1: Collect all unsafe lines across ALL functions. Functions
+  // without region markers cannot contribute probes, so one attribute test
+  // replaces their block walk.
   for (Function &F : M) {
-    if (shouldInstrumentFunction(F)) {
-      Modified |= collectAndInstrumentFunction(F, TrackExecutionFn, allUnsafeLines);
+    if (shouldInstrumentFunction(F) && hasUnsafeRegionMarkers(F)) {
+      const UnsafeRegionInfo &Regions = FAM.getResult<UnsafeRegionAnalysis>(F);
+      collectFunction(F, Regions, FileTable, Probes, LineIds);
     }
   }
-  
-  // Phase 2: Create module constructor to register all lines at program startup
-  // This ensures all lines are registered BEFORE any execution
-  if (!allUnsafeLines.empty()) {
-    createModuleConstructor(M, allUnsafeLines, RegisterLineFn);
-    Modified = true;
+
+  if (Probes.empty())
+    return PreservedAnalyses::all();
+
+  NumLineProbes += Probes.size();
+  NumUniqueUnsafeLines += LineIds.size();
+
+  // Assign dense IDs in sorted (file, line) order.
+  uint32_t NextId = 0;
+  for (auto &[Key, Id] : LineIds)
+    Id = NextId++;
+
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int8Ty = Type::getInt8Ty(Ctx);
+
+  // Coverage-only mode writes one flag byte per line instead of calling the
+  // counter runtime.
+  GlobalVariable *CoveredMap = nullptr;
+  ArrayType *CoveredMapTy = nullptr;
+  if (UnsafeLineCoverageOnly) {
+    CoveredMapTy = ArrayType::get(Int8Ty, LineIds.size());
+    CoveredMap = new GlobalVariable(
+        M, CoveredMapTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+        ConstantAggregateZero::get(CoveredMapTy), "__unsafe_line_covered");
+    placeUnsafeTableGlobal(CoveredMap);
   }
-  
-  // Phase 3: Create module destructor to print stats at program exit
-  if (Modified) {
+
+  // Per-thread counters: probes bump this thread-local array and threads
+  // flush at exit; see the -unsafe-line-tls-counters comment for the NUMA
+  // rationale. Coverage-only mode keeps its flag bytes.
+  GlobalVariable *TlsCounts = nullptr;
+  ArrayType *TlsCountsTy = nullptr;
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  if (UnsafeLineTlsCounters && !CoveredMap) {
+    TlsCountsTy = ArrayType::get(Int64Ty, LineIds.size());
+    TlsCounts = new GlobalVariable(
+        M, TlsCountsTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+        ConstantAggregateZero::get(TlsCountsTy), "__unsafe_line_tls_counts");
+    TlsCounts->setThreadLocal(true);
+    TlsCounts->setAlignment(Align(8));
+  }
+
+  // Phase 2: Create the registration path — scheduled as a module ctor, or
+  // under -unsafe-lazy-registration wrapped in the once-guard and called
+  // from the probes' first firing; either way every ID is defined before
+  // any count lands.
+  Function *CtorFn = createModuleConstructor(M, LineIds, RegisterBulkFn,
+                                             RegisterCoveredMapFn, CoveredMap);
+
+  Function *FlushRegFn = nullptr;
+  GlobalVariable *LazyRegFlag = nullptr;
+  if (unsafeLazyRegistrationEnabled())
+    LazyRegFlag = createLazyRegistrationFlag(M, "__unsafe_lines_registered");
+  if (TlsCounts)
+    FlushRegFn = setupTlsCountsFlush(M, TlsCounts, LineIds.size(), LazyRegFlag);
+
+  if (LazyRegFlag) {
+    // The thread-flush registration rides the same first-firing entry
+    // point: any thread holding counts fired a probe first, so its flush
+    // callback is installed before that thread can exit.
+    if (FlushRegFn) {
+      IRBuilder<> CtorBuilder(CtorFn->getEntryBlock().getTerminator());
+      CtorBuilder.CreateCall(FlushRegFn);
+    }
+    makeLazyRegistration(CtorFn, LazyRegFlag);
+  }
+
+  // Phase 3: Instrument every probe with its interned ID only; the runtime
+  // bumps counters[id] without touching the file string.
+  for (const LineProbe &Probe : Probes) {
+    uint32_t Id = LineIds.at(Probe.Key);
+    // Dormant builds gate each probe on the lines family byte.
+    Instruction *ProbePoint = emitProbeFamilyGate(Probe.I, "lines");
+    if (LazyRegFlag)
+      emitLazyRegistrationCheck(ProbePoint, CtorFn, LazyRegFlag);
+    IRBuilder<> Builder(ProbePoint);
+    if (TlsCounts) {
+      Value *Slot =
+          Builder.CreateConstInBoundsGEP2_64(TlsCountsTy, TlsCounts, 0, Id);
+      Value *Cur = Builder.CreateLoad(Int64Ty, Slot);
+      Builder.CreateStore(Builder.CreateAdd(Cur, ConstantInt::get(Int64Ty, 1)),
+                          Slot);
+      continue;
+    }
+    if (!CoveredMap) {
+      setUnsafeProbeCallConv(Builder.CreateCall(
+          TrackExecutionFn, {ConstantInt::get(Int32Ty, Id)}));
+      continue;
+    }
+
+    // Self-disabling flag probe: once the byte is set, all that remains is
+    // a load and a not-taken branch. Racing stores all write the same 1, so
+    // a plain store is safe.
+    Value *Slot =
+        Builder.CreateConstInBoundsGEP2_64(CoveredMapTy, CoveredMap, 0, Id);
+    Value *Seen = Builder.CreateLoad(Int8Ty, Slot);
+    Value *NotSeen = Builder.CreateICmpEQ(Seen, ConstantInt::get(Int8Ty, 0));
+    Instruction *Then = SplitBlockAndInsertIfThen(
+        NotSeen, ProbePoint, /*Unreachable=*/false,
+        unsafeProbeBranchWeights(ProbePoint->getContext()));
+    IRBuilder<> ThenBuilder(Then);
+    ThenBuilder.CreateStore(ConstantInt::get(Int8Ty, 1), Slot);
+  }
+
+  // Phase 4: Create module destructor to print stats at program exit. In
+  // shared-memory mode the publish hook replaces the per-process exit path.
+  if (unsafeShmStatsEnabled()) {
+    emitShmStatsHooks(M);
+  } else {
+    // Under -unsafe-stats-output-template the dump writes shards instead
+    // of appending to the fixed CWD name.
+    emitStatsOutputTemplateHook(M);
     createModuleDestructor(M, PrintStatsFn);
   }
-  
-  return Modified ? PreservedAnalyses::none() : PreservedAnalyses::all();
+
+  return PreservedAnalyses::none();
 }
@@ -0,0 +1,192 @@
+//===-- AllocTracker.cpp - Track Rust allocator calls ---------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===-------------------------------------------------------------------------------===//
+///
+/// \file
+/// This file implements the AllocTracker pass for tracking allocation size
+/// and lifetime through the Rust allocator entry points.
+///
+//===-------------------------------------------------------------------------------===//
+
+#include "llvm/Transforms/HeapTracker/AllocTracker.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Type.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/InstMarker/UnsafeRegionAnalysis.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "alloc-tracker"
+
+STATISTIC(NumAllocSitesInstrumented,
+          "Number of Rust allocator call sites instrumented");
+STATISTIC(NumUnsafeAllocSites,
+          "Number of allocator call sites inside unsafe regions");
+
+const char *llvm::ALLOC_TRACKER_ALLOC_FN = "alloc_tracker_alloc";
+const char *llvm::ALLOC_TRACKER_DEALLOC_FN = "alloc_tracker_dealloc";
+
+namespace {
+
+/// \brief Compile-time allocation-site ID: FNV-1a of the mangled function
+/// name mixed with the site's ordinal within the function.
+///
+/// The same scheme the stable function IDs use, so a site keeps its ID
+/// across builds and cross-build diffing of allocation reports is an
+/// integer join. Zero is the runtime table's empty-slot sentinel, so it is
+/// never handed out.
+uint32_t allocSiteId(StringRef FuncName, unsigned Ordinal) {
+  uint64_t Hash = 1469598103934665603ULL;
+  for (char C : FuncName)
+    Hash = (Hash ^ static_cast<uint8_t>(C)) * 1099511628211ULL;
+  Hash = (Hash ^ Ordinal) * 1099511628211ULL;
+  Hash ^= Hash >> 32;
+  uint32_t Id = static_cast<uint32_t>(Hash);
+  return Id ? Id : 1;
+}
+
+/// \brief Whether \p Callee is one of the Rust allocator entry points.
+bool isRustAllocatorFn(StringRef Name) {
+  return Name == "__rust_alloc" || Name == "__rust_alloc_zeroed" ||
+         Name == "__rust_realloc" || Name == "__rust_dealloc";
+}
+
+/// \brief Instrument every __rust_alloc-family call in \p F.
+///
+/// alloc_tracker_alloc(site_id, ptr, size, align, in_unsafe) fires after
+/// calls that produce a block; alloc_tracker_dealloc(ptr, size) fires
+/// before calls that retire one; realloc gets both. The probes are never
+/// sampled: live-byte accounting only balances when every alloc sees its
+/// dealloc, and allocator calls are orders of magnitude rarer than the
+/// accesses the sampling knob exists for. The in_unsafe tag reuses the
+/// marker scan instrumentUnsafeMemInst does: a call is unsafe-attributed
+/// when it sits between an active begin marker and its end within a block.
+void instrumentAllocatorCalls(Function &F, const UnsafeRegionInfo &Regions,
+                              FunctionCallee AllocFn,
+                              FunctionCallee DeallocFn) {
+  // Collect first with the unsafe tag resolved, so insertion below cannot
+  // perturb the marker walk.
+  SmallVector<std::pair<CallInst *, bool>, 8> AllocCalls;
+  for (BasicBlock &BB : F) {
+    bool InUnsafe = false;
+    for (Instruction &I : BB) {
+      bool IsBegin = false, IsEnd = false;
+      if (Regions.isMarker(I, IsBegin, IsEnd)) {
+        InUnsafe = IsBegin;
+        continue;
+      }
+      auto *Call = dyn_cast<CallInst>(&I);
+      if (!Call)
+        continue;
+      Function *Callee = Call->getCalledFunction();
+      if (Callee && isRustAllocatorFn(Callee->getName()))
+        AllocCalls.push_back({Call, InUnsafe});
+    }
+  }
+
+  if (AllocCalls.empty())
+    return;
+
+  LLVMContext &Ctx = F.getContext();
+  Type *Int1Ty = Type::getInt1Ty(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+
+  unsigned Ordinal = 0;
+  for (auto [Call, InUnsafe] : AllocCalls) {
+    StringRef Name = Call->getCalledFunction()->getName();
+    ++NumAllocSitesInstrumented;
+    if (InUnsafe)
+      ++NumUnsafeAllocSites;
+
+    if (Name == "__rust_dealloc" || Name == "__rust_realloc") {
+      // __rust_dealloc(ptr, size, align) / __rust_realloc(ptr, old_size,
+      // align, new_size): the old block goes away.
+      IRBuilder<> Builder(Call);
+      setUnsafeProbeCallConv(Builder.CreateCall(
+          DeallocFn, {Call->getArgOperand(0),
+                      Builder.CreateZExtOrTrunc(Call->getArgOperand(1),
+                                                Int64Ty)}));
+    }
+
+    if (Name != "__rust_dealloc") {
+      // __rust_alloc(size, align) / __rust_alloc_zeroed(size, align) /
+      // __rust_realloc(ptr, old_size, align, new_size): the result is the
+      // new block.
+      bool IsRealloc = Name == "__rust_realloc";
+      Value *Size = Call->getArgOperand(IsRealloc ? 3 : 0);
+      Value *Align = Call->getArgOperand(IsRealloc ? 2 : 1);
+      IRBuilder<> Builder(Call->getNextNode());
+      setUnsafeProbeCallConv(Builder.CreateCall(
+          AllocFn,
+          {ConstantInt::get(Int32Ty, allocSiteId(F.getName(), Ordinal)), Call,
+           Builder.CreateZExtOrTrunc(Size, Int64Ty),
+           Builder.CreateZExtOrTrunc(Align, Int64Ty),
+           ConstantInt::get(Int1Ty, InUnsafe)}));
+    }
+    ++Ordinal;
+  }
+}
+
+} // anonymous namespace
+
+bool AllocTrackerPass::isPrimaryPackage() {
+  return isUnsafePrimaryPackage();
+}
+
+void AllocTrackerPass::initRuntimeCallees(Module &M) {
+  LLVMContext &C = M.getContext();
+  Type *VoidTy = Type::getVoidTy(C);
+  Type *RawPtrTy = PointerType::getUnqual(Type::getInt8Ty(C));
+  Type *BooleanTy = Type::getInt1Ty(C);
+  Type *Int32Ty = Type::getInt32Ty(C);
+  Type *Int64Ty = Type::getInt64Ty(C);
+  Callees.M = &M;
+
+  // alloc_tracker_alloc(site_id, ptr, size, align, in_unsafe)
+  Callees.Alloc = M.getOrInsertFunction(
+      ALLOC_TRACKER_ALLOC_FN,
+      FunctionType::get(VoidTy, {Int32Ty, RawPtrTy, Int64Ty, Int64Ty,
+                                 BooleanTy},
+                        false));
+  // alloc_tracker_dealloc(ptr, size)
+  Callees.Dealloc = M.getOrInsertFunction(
+      ALLOC_TRACKER_DEALLOC_FN,
+      FunctionType::get(VoidTy, {RawPtrTy, Int64Ty}, false));
+}
+
+PreservedAnalyses AllocTrackerPass::run(Function &F,
+                                        FunctionAnalysisManager &AM) {
+  if (!AllocTrackerPass::isPrimaryPackage())
+    return PreservedAnalyses::all();
+
+  // Targeted runs (-unsafe-instr-funcs) probe only the listed functions.
+  if (!unsafeInstrFuncFilterAllows(F))
+    return PreservedAnalyses::all();
+
+  if (Callees.M != F.getParent())
+    initRuntimeCallees(*F.getParent());
+
+  // The region scan is only meaningful (and only cheap to skip) when the
+  // function carries markers; functions without them still get their
+  // allocator calls probed, just never unsafe-attributed.
+  const UnsafeRegionInfo &Regions = AM.getResult<UnsafeRegionAnalysis>(F);
+
+  instrumentAllocatorCalls(F, Regions, Callees.Alloc, Callees.Dealloc);
+
+  // Only straight-line call insertions; the CFG is intact.
+  return PreservedAnalyses::all();
+}
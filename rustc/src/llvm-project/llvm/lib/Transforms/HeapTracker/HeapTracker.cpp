@@ -12,98 +12,834 @@
 //===-------------------------------------------------------------------------------===//
 
 #include "llvm/Transforms/HeapTracker/HeapTracker.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/Support/Casting.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/InstMarker/UnsafeRegionAnalysis.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include <cstdlib>
 #include <cstring>
+#include <tuple>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "heap-tracker"
+
+STATISTIC(NumHeapAccessProbes, "Number of memory-access probes inserted");
+STATISTIC(NumHeapSitesPruned,
+          "Number of accesses statically classified instead of probed");
+STATISTIC(NumUnsafeAccessProbes,
+          "Number of unsafe-region access probes inserted");
+STATISTIC(NumHeapProbesDemoted,
+          "Number of access probes demoted to sampled by a prior profile");
+STATISTIC(NumHeapAccesses1B, "Number of instrumented 1-byte access sites");
+STATISTIC(NumHeapAccesses2B, "Number of instrumented 2-byte access sites");
+STATISTIC(NumHeapAccesses4B, "Number of instrumented 4-byte access sites");
+STATISTIC(NumHeapAccesses8B, "Number of instrumented 8-byte access sites");
+STATISTIC(NumHeapAccesses16B, "Number of instrumented 16-byte access sites");
+STATISTIC(NumHeapAccesses32B, "Number of instrumented 32-byte access sites");
+STATISTIC(NumHeapAccesses64B, "Number of instrumented 64-byte access sites");
+STATISTIC(NumHeapAccessesWide,
+          "Number of instrumented access sites over 64 bytes");
+
 const char *llvm::DYN_MEM_ACCESS_FN = "dyn_mem_access";
 const char *llvm::DYN_UNSAFE_MEM_ACCESS_FN = "dyn_unsafe_mem_access";
+const char *llvm::DYN_MEM_ACCESS_SLOW_FN = "dyn_mem_access_slow";
+const char *llvm::DYN_MEM_ACCESS_STATIC_FN = "dyn_mem_access_static";
+const char *llvm::DYN_MEM_ACCESS_RANGE_FN = "dyn_mem_access_range";
+const char *llvm::DYN_UNSAFE_MEM_ACCESS_BULK_FN = "dyn_unsafe_mem_access_bulk";
+const char *llvm::HEAP_TRACKER_NOTE_ALLOC_FN = "heap_tracker_note_alloc";
+const char *llvm::HEAP_TRACKER_NOTE_DEALLOC_FN = "heap_tracker_note_dealloc";
+const char *llvm::DYN_UNSAFE_MEM_ACCESS_LINE_FN = "dyn_unsafe_mem_access_line";
+const char *llvm::DYN_UNSAFE_MEM_ACCESS_REGION_FN =
+    "dyn_unsafe_mem_access_region";
+const char *llvm::DYN_UNSAFE_MEM_ACCESS_ORIGIN_FN =
+    "dyn_unsafe_mem_access_origin";
+
+// Shadow fast path: instead of a runtime call per load/store, consult a
+// shadow byte (one byte per 8 application bytes, base published by the
+// runtime in __heap_tracker_shadow_base, mapping modeled on
+// Instrumentation/AddressSanitizer.cpp). A nonzero shadow byte already
+// classifies the address (1 = heap, 2 = stack, 3 = global) and the probe is
+// just a thread-local counter bump; only unclassified addresses fall back to
+// the dyn_mem_access_slow runtime call, which classifies and fills in the
+// shadow.
+static cl::opt<bool> HeapTrackerShadowFastPath(
+  "heap-tracker-shadow", cl::init(false), cl::Hidden,
+  cl::desc("Classify accesses through an inline shadow-byte check, calling "
+           "the runtime only for unclassified addresses")
+);
+
+// Known-object pruning: accesses whose pointer provably resolves to a
+// non-escaping alloca or to a global can never be heap accesses, and in
+// pointer-chasing crates (simd-json) they are the majority of probed
+// operations. When enabled, such sites are counted as per-function constants
+// reported through a single entry probe, and only genuinely unknown pointers
+// keep their dynamic instrumentation.
+static cl::opt<bool> HeapTrackerPruneKnown(
+  "heap-tracker-prune-known", cl::init(false), cl::Hidden,
+  cl::desc("Count provably stack/global accesses statically and only "
+           "instrument unknown pointers dynamically")
+);
+
+// Buffered event recording: rather than one runtime call per unsafe access,
+// append (ptr, is_load) events into a per-thread ring buffer and call the
+// flush routine only when it fills. One call per buffer of accesses instead
+// of one per access is what makes heap-tracking runs of jpeg-decoder
+// feasible again. 0 disables buffering.
+static cl::opt<unsigned> HeapTrackerEventBufferSize(
+  "heap-tracker-event-buffer", cl::init(0), cl::Hidden,
+  cl::desc("Buffer this many unsafe-access events per thread before "
+           "flushing to the runtime (0 = call per access)")
+);
+
+// Loop-invariant hoisting: an unsafe access probed on every iteration of a
+// loop cannot change its heap/stack classification when its address is
+// loop-invariant. When enabled, such accesses carry only a local counter
+// increment in the loop body and report (ptr, is_load, count) in bulk at the
+// loop exits, eliminating redundant classification in the tight kernels of
+// ndarray and matrixmultiply.
+static cl::opt<bool> HeapTrackerHoistInvariant(
+  "heap-tracker-hoist-invariant", cl::init(false), cl::Hidden,
+  cl::desc("Replace per-iteration probes of loop-invariant unsafe access "
+           "addresses with a counter and a bulk report at loop exit")
+);
+
+// Allocation-site hooks: the runtime's heap/stack decision has no help from
+// the pass today. When enabled, calls to the __rust_alloc family are
+// bracketed with heap_tracker_note_alloc/note_dealloc hooks carrying the
+// block address and size, so the runtime can maintain a page-granularity
+// bitmap and the shadow fast path can classify with a shift+mask+load.
+static cl::opt<bool> HeapTrackerAllocHooks(
+  "heap-tracker-alloc-hooks", cl::init(false), cl::Hidden,
+  cl::desc("Emit allocation-site hooks on __rust_alloc/__rust_dealloc calls "
+           "so the runtime can keep a page bitmap")
+);
+
+// Cache-line conflict detection: parking_lot runs show unsafe cycle spikes
+// that look like false sharing, and nothing in the artifact can confirm it.
+// Under this flag the unsafe-access probe swaps for a variant that also
+// histograms address bits 6..12 (the cache-line set index) per region into
+// per-thread tables; the exit report lists regions whose accesses from
+// different threads land in the same sets. Set aliasing means a flagged
+// region is a candidate, not proof — but it is far cheaper than rerunning
+// the whole suite under an external conflict tool.
+static cl::opt<bool> HeapTrackerLineConflicts(
+  "heap-tracker-line-conflicts", cl::init(false), cl::Hidden,
+  cl::desc("Histogram cache-line sets of unsafe accesses per region and "
+           "report cross-thread set conflicts at exit")
+);
+
+// Access-origin classification: dyn_unsafe_mem_access answers heap vs
+// non-heap only, which cannot say whether hashbrown's unsafe accesses hit
+// its own tables or caller-owned memory. Under this flag the unsafe probe
+// swaps for a variant the runtime joins against the allocation-site
+// shadow map it builds from AllocTrackerPass's alloc_tracker_alloc hooks
+// (so pair this flag with that pass): the covering block's site ID is an
+// array-index lookup away, and the runtime histograms site per region.
+// Site 0 collects non-heap and pre-main allocations. Box vs Vec vs Rc
+// falls out offline — the site ID symbolizes to the allocating call site,
+// whose container type is visible in the source — so the probe itself
+// never symbolizes anything.
+static cl::opt<bool> HeapTrackerOriginHistogram(
+  "heap-tracker-origin", cl::init(false), cl::Hidden,
+  cl::desc("Histogram the allocation-site origin of unsafe accesses per "
+           "region through the runtime's site shadow map")
+);
+
+// Mapped-range classification: the shadow classes stop at heap/stack/global,
+// so anything mmap'd — jpeg-decoder reading its input through a mapping,
+// getrandom's vDSO pages — reports as heap. Under this flag the plain access
+// probe swaps for dyn_mem_access_classified, which the runtime resolves by
+// binary search over a sorted /proc/self/maps snapshot: five-way
+// stack/heap/mmap/global/vdso at a handful of cycles over a cache-resident
+// table. A pass-emitted ctor takes the initial snapshot before main; the
+// runtime refreshes it through interposable mmap/munmap notification hooks
+// and a bounded budget of miss-triggered rescans.
+static cl::opt<bool> HeapTrackerMapsClassify(
+  "heap-tracker-maps-classify", cl::init(false), cl::Hidden,
+  cl::desc("Classify plain access probes against a /proc/self/maps range "
+           "table for five-way stack/heap/mmap/global/vdso accounting")
+);
 
 namespace {
 
+// Per-thread event buffer names and the bulk flush hook. An event packs the
+// access as (addr << 1) | is_load; x86-64 virtual addresses leave the top
+// bit free.
+constexpr const char *TLS_EVENT_BUF_NAME = "__heap_tracker_event_buf";
+constexpr const char *TLS_EVENT_CURSOR_NAME = "__heap_tracker_event_cursor";
+constexpr const char *FLUSH_EVENTS_FN = "heap_tracker_flush_events";
+
+// Shadow mapping parameters and names shared with the runtime.
+constexpr unsigned SHADOW_SCALE = 3;
+constexpr const char *SHADOW_BASE_NAME = "__heap_tracker_shadow_base";
+constexpr const char *TLS_CLASS_COUNTS_NAME = "__heap_tracker_tls_class_counts";
+constexpr const char *FLUSH_CLASS_COUNTS_FN = "heap_tracker_flush_class_counts";
+
+// Number of shadow classification classes (0 = unknown, 1 = heap,
+// 2 = stack, 3 = global).
+constexpr uint64_t NUM_SHADOW_CLASSES = 4;
+
+// Mapped-range classification: the probe variant that classifies through
+// the runtime's /proc/self/maps snapshot, and the ctor-run hook that takes
+// the initial snapshot (-heap-tracker-maps-classify).
+constexpr const char *DYN_MEM_ACCESS_CLASSIFIED_FN =
+    "dyn_mem_access_classified";
+constexpr const char *MAPS_INIT_FN = "heap_tracker_maps_init";
+
 /// \brief Checks if the current build is for the primary package.
 ///
-/// This uses the CARGO_PRIMARY_PACKAGE environment variable.
-static bool isPrimaryPackage() {
-  const char *P = getenv("CARGO_PRIMARY_PACKAGE");
-  return P && strcmp(P, "1") == 0;
+/// This uses the (process-wide cached) CARGO_PRIMARY_PACKAGE decision.
+static bool isPrimaryPackage() { return isUnsafePrimaryPackage(); }
+
+/// \brief Get (creating on first use) the per-thread classification counters
+/// and, on creation, register the destructor that flushes them to the runtime.
+GlobalVariable *getOrCreateClassCounters(Module &M) {
+  if (GlobalVariable *GV =
+          M.getGlobalVariable(TLS_CLASS_COUNTS_NAME, /*AllowInternal=*/true))
+    return GV;
+
+  LLVMContext &Ctx = M.getContext();
+  ArrayType *ArrayTy =
+      ArrayType::get(Type::getInt64Ty(Ctx), NUM_SHADOW_CLASSES);
+  auto *GV = new GlobalVariable(M, ArrayTy, /*isConstant=*/false,
+                                GlobalValue::InternalLinkage,
+                                ConstantAggregateZero::get(ArrayTy),
+                                TLS_CLASS_COUNTS_NAME);
+  GV->setThreadLocal(true);
+  GV->setAlignment(Align(8));
+
+  // heap_tracker_flush_class_counts(counts, num_classes)
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int8PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+  FunctionCallee FlushFn = M.getOrInsertFunction(
+      FLUSH_CLASS_COUNTS_FN,
+      FunctionType::get(VoidTy, {Int8PtrTy, Int32Ty}, false));
+
+  Function *Dtor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "heap_tracker_flush_dtor", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Dtor);
+  IRBuilder<> Builder(BB);
+  Builder.CreateCall(FlushFn,
+                     {Builder.CreateBitCast(GV, Int8PtrTy),
+                      ConstantInt::get(Int32Ty, NUM_SHADOW_CLASSES)});
+  Builder.CreateRetVoid();
+  appendToGlobalDtors(M, Dtor, 0);
+
+  return GV;
+}
+
+/// \brief Instrument one access with the inline shadow-byte fast path.
+///
+/// Emits: load shadow byte for the address; if nonzero, bump the per-thread
+/// counter for that class inline; otherwise call dyn_mem_access_slow(ptr).
+void instrumentMemInstShadow(Instruction *MemInst, Value *Addr,
+                             FunctionCallee SlowPathFn) {
+  Function &F = *MemInst->getFunction();
+  Module &M = *F.getParent();
+  LLVMContext &Ctx = F.getContext();
+  Type *Int8Ty = Type::getInt8Ty(Ctx);
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Type *Int8PtrTy = PointerType::getUnqual(Int8Ty);
+
+  GlobalVariable *ShadowBase = M.getGlobalVariable(SHADOW_BASE_NAME);
+  if (!ShadowBase) {
+    ShadowBase = new GlobalVariable(M, Int8PtrTy, /*isConstant=*/false,
+                                    GlobalValue::ExternalLinkage,
+                                    /*Initializer=*/nullptr, SHADOW_BASE_NAME);
+  }
+  GlobalVariable *ClassCounts = getOrCreateClassCounters(M);
+
+  IRBuilder<> Builder(MemInst);
+  Value *AddrInt = Builder.CreatePtrToInt(Addr, Int64Ty);
+  Value *Base = Builder.CreateLoad(Int8PtrTy, ShadowBase);
+  Value *Offset = Builder.CreateLShr(AddrInt, SHADOW_SCALE);
+  Value *ShadowPtr = Builder.CreateGEP(Int8Ty, Base, Offset);
+  Value *ShadowByte = Builder.CreateLoad(Int8Ty, ShadowPtr);
+  Value *Known =
+      Builder.CreateICmpNE(ShadowByte, ConstantInt::get(Int8Ty, 0));
+
+  Instruction *ThenTerm = nullptr;
+  Instruction *ElseTerm = nullptr;
+  // The inline shadow path is the hot arm here; the slow call is cold.
+  SplitBlockAndInsertIfThenElse(
+      Known, MemInst, &ThenTerm, &ElseTerm,
+      unsafeProbeBranchWeights(MemInst->getContext(), /*ProbeArmIsTrue=*/false));
+
+  // Fast path: bump the per-thread counter for the shadow class.
+  IRBuilder<> ThenBuilder(ThenTerm);
+  Value *Class = ThenBuilder.CreateZExt(
+      ThenBuilder.CreateAnd(ShadowByte,
+                            ConstantInt::get(Int8Ty, NUM_SHADOW_CLASSES - 1)),
+      Int64Ty);
+  Value *Idx[] = {ConstantInt::get(Int64Ty, 0), Class};
+  Value *Slot = ThenBuilder.CreateInBoundsGEP(ClassCounts->getValueType(),
+                                              ClassCounts, Idx);
+  Value *Count = ThenBuilder.CreateLoad(Int64Ty, Slot);
+  ThenBuilder.CreateStore(
+      ThenBuilder.CreateAdd(Count, ConstantInt::get(Int64Ty, 1)), Slot);
+
+  // Slow path: the runtime classifies the address and fills in the shadow.
+  IRBuilder<> ElseBuilder(ElseTerm);
+  setUnsafeProbeCallConv(ElseBuilder.CreateCall(SlowPathFn, {Addr}));
 }
 
 /// \brief Add a call to dyn_mem_access() before each memory instruction.
 /// \param F The target function.
 /// \param DynMemAccessFn The to-be-inserted callee.
-void instrumentMemInst(Function &F, FunctionCallee DynMemAccessFn) {
+/// \brief Classify an access pointer that can be resolved at compile time.
+///
+/// Returns true (setting \p IsStack) when the underlying object is a
+/// non-escaping alloca or a global; such accesses can never touch the heap.
+bool classifyKnownObject(Value *Addr, bool &IsStack) {
+  const Value *Obj = getUnderlyingObject(Addr);
+  if (const auto *AI = dyn_cast<AllocaInst>(Obj)) {
+    // A captured alloca's address may be laundered through memory the pass
+    // cannot see, so only prune provably local ones.
+    if (!PointerMayBeCaptured(AI, /*ReturnCaptures=*/true,
+                              /*StoreCaptures=*/true)) {
+      IsStack = true;
+      return true;
+    }
+    return false;
+  }
+  if (isa<GlobalVariable>(Obj)) {
+    IsStack = false;
+    return true;
+  }
+  return false;
+}
+
+/// \brief Store size in bytes of the value \p I loads or stores.
+///
+/// Taken from the value type via the DataLayout, so a <32 x i8> vector
+/// store weighs 32 and a scalar i8 store weighs 1 — heap statistics that
+/// only counted accesses rated both identically, which skews bandwidth
+/// attribution for vectorized array code.
+uint64_t accessSizeInBytes(const Instruction *I) {
+  const DataLayout &DL = I->getModule()->getDataLayout();
+  Type *Ty = isa<LoadInst>(I)
+                 ? I->getType()
+                 : cast<StoreInst>(I)->getValueOperand()->getType();
+  return DL.getTypeStoreSize(Ty);
+}
+
+/// \brief Bump the compile-time site statistic for the power-of-two size
+/// class covering \p Bytes; odd aggregate sizes land in the next class up.
+void countAccessSizeClass(uint64_t Bytes) {
+  if (Bytes <= 1)
+    ++NumHeapAccesses1B;
+  else if (Bytes <= 2)
+    ++NumHeapAccesses2B;
+  else if (Bytes <= 4)
+    ++NumHeapAccesses4B;
+  else if (Bytes <= 8)
+    ++NumHeapAccesses8B;
+  else if (Bytes <= 16)
+    ++NumHeapAccesses16B;
+  else if (Bytes <= 32)
+    ++NumHeapAccesses32B;
+  else if (Bytes <= 64)
+    ++NumHeapAccesses64B;
+  else
+    ++NumHeapAccessesWide;
+}
+
+/// \brief Probe a memcpy/memmove/memset with its true byte count.
+///
+/// Bulk slice copies are the dominant memory traffic in arrayvec/smallvec
+/// and were previously invisible: one dyn_mem_access_range(ptr, len,
+/// is_write) per pointer operand counts them once per operation.
+void instrumentMemIntrinsic(MemIntrinsic *MI, FunctionCallee RangeFn) {
+  IRBuilder<> Builder(MI);
+  Type *Int64Ty = Builder.getInt64Ty();
+  Type *BoolTy = Builder.getInt1Ty();
+  Value *Len = Builder.CreateZExtOrTrunc(MI->getLength(), Int64Ty);
+
+  // Destination is always written.
+  setUnsafeProbeCallConv(
+      Builder.CreateCall(RangeFn, {MI->getRawDest(), Len,
+                                   ConstantInt::get(BoolTy, 1)}));
+  // Transfers additionally read the source.
+  if (auto *MT = dyn_cast<MemTransferInst>(MI))
+    setUnsafeProbeCallConv(
+        Builder.CreateCall(RangeFn, {MT->getRawSource(), Len,
+                                     ConstantInt::get(BoolTy, 0)}));
+}
+
+void instrumentMemInst(Function &F, FunctionCallee DynMemAccessFn,
+                       FunctionCallee SlowPathFn,
+                       FunctionCallee StaticCountsFn,
+                       FunctionCallee RangeFn) {
+  // Collect function-wide first: the shadow fast path splits blocks, so
+  // per-block iteration would revisit the tail halves.
+  SmallVector<Instruction*, 8> memInsts;
+  SmallVector<MemIntrinsic*, 8> memIntrinsics;
   for (BasicBlock &BB : F) {
-    SmallVector<Instruction*, 8> memInsts;
     for (Instruction &I : BB) {
       if (isa<LoadInst>(I) || isa<StoreInst>(I)) {
         memInsts.push_back(&I);
+      } else if (auto *MI = dyn_cast<MemIntrinsic>(&I)) {
+        memIntrinsics.push_back(MI);
       }
     }
+  }
+
+  for (MemIntrinsic *MI : memIntrinsics)
+    instrumentMemIntrinsic(MI, RangeFn);
 
-    for (Instruction *MemInst : memInsts) {
-      IRBuilder<> Builder(MemInst);
-      Value *DestAddr = isa<LoadInst>(MemInst) ?
-          cast<LoadInst>(MemInst)->getPointerOperand() :
-          cast<StoreInst>(MemInst)->getPointerOperand();
-      Builder.CreateCall(DynMemAccessFn, DestAddr);
+  uint32_t StaticStackSites = 0;
+  uint32_t StaticGlobalSites = 0;
+  for (Instruction *MemInst : memInsts) {
+    Value *DestAddr = isa<LoadInst>(MemInst) ?
+        cast<LoadInst>(MemInst)->getPointerOperand() :
+        cast<StoreInst>(MemInst)->getPointerOperand();
+
+    bool IsStack = false;
+    if (HeapTrackerPruneKnown && classifyKnownObject(DestAddr, IsStack)) {
+      if (IsStack)
+        StaticStackSites++;
+      else
+        StaticGlobalSites++;
+      ++NumHeapSitesPruned;
+      continue;
+    }
+
+    ++NumHeapAccessProbes;
+    uint64_t Bytes = accessSizeInBytes(MemInst);
+    countAccessSizeClass(Bytes);
+    if (HeapTrackerShadowFastPath) {
+      instrumentMemInstShadow(MemInst, DestAddr, SlowPathFn);
+    } else {
+      // Honor the shared sampling knob on the runtime-call path.
+      Instruction *ProbePt = emitSampleGate(MemInst, "heap");
+      IRBuilder<> Builder(ProbePt);
+      setUnsafeProbeCallConv(Builder.CreateCall(
+          DynMemAccessFn,
+          {DestAddr,
+           ConstantInt::get(Type::getInt32Ty(F.getContext()), Bytes)}));
     }
   }
+
+  // Report the statically classified sites once per function execution
+  // instead of once per access.
+  if (StaticStackSites > 0 || StaticGlobalSites > 0) {
+    Type *Int32Ty = Type::getInt32Ty(F.getContext());
+    IRBuilder<> EntryBuilder(&F.getEntryBlock().front());
+    setUnsafeProbeCallConv(EntryBuilder.CreateCall(
+        StaticCountsFn, {ConstantInt::get(Int32Ty, StaticStackSites),
+                         ConstantInt::get(Int32Ty, StaticGlobalSites)}));
+  }
+}
+
+/// \brief Get (creating on first use) the per-thread event buffer and cursor.
+/// On creation, also registers a destructor that flushes any partial buffer.
+std::pair<GlobalVariable *, GlobalVariable *>
+getOrCreateEventBuffer(Module &M) {
+  GlobalVariable *Buf =
+      M.getGlobalVariable(TLS_EVENT_BUF_NAME, /*AllowInternal=*/true);
+  GlobalVariable *Cursor =
+      M.getGlobalVariable(TLS_EVENT_CURSOR_NAME, /*AllowInternal=*/true);
+  if (Buf && Cursor)
+    return {Buf, Cursor};
+
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Type *Int8PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+
+  ArrayType *BufTy = ArrayType::get(Int64Ty, HeapTrackerEventBufferSize);
+  Buf = new GlobalVariable(M, BufTy, /*isConstant=*/false,
+                           GlobalValue::InternalLinkage,
+                           ConstantAggregateZero::get(BufTy),
+                           TLS_EVENT_BUF_NAME);
+  Buf->setThreadLocal(true);
+  Buf->setAlignment(Align(8));
+  Cursor = new GlobalVariable(M, Int64Ty, /*isConstant=*/false,
+                              GlobalValue::InternalLinkage,
+                              ConstantInt::get(Int64Ty, 0),
+                              TLS_EVENT_CURSOR_NAME);
+  Cursor->setThreadLocal(true);
+  Cursor->setAlignment(Align(8));
+
+  // heap_tracker_flush_events(events, count)
+  FunctionCallee FlushFn = M.getOrInsertFunction(
+      FLUSH_EVENTS_FN,
+      FunctionType::get(VoidTy, {Int8PtrTy, Int64Ty}, false));
+
+  Function *Dtor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "heap_tracker_event_flush_dtor", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Dtor);
+  IRBuilder<> Builder(BB);
+  // Same symbol as the hot buffer-full flush below; conventions must match.
+  setUnsafeProbeCallConv(
+      Builder.CreateCall(FlushFn, {Builder.CreateBitCast(Buf, Int8PtrTy),
+                                   Builder.CreateLoad(Int64Ty, Cursor)}));
+  Builder.CreateStore(ConstantInt::get(Int64Ty, 0), Cursor);
+  Builder.CreateRetVoid();
+  appendToGlobalDtors(M, Dtor, 0);
+
+  return {Buf, Cursor};
+}
+
+/// \brief Append one unsafe-access event to the per-thread buffer, calling
+/// the bulk flush routine only when the buffer fills.
+void instrumentUnsafeAccessBuffered(Instruction *I, Value *Addr,
+                                    bool IsLoad) {
+  Module &M = *I->getFunction()->getParent();
+  LLVMContext &Ctx = I->getContext();
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Type *Int8PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+  auto [Buf, Cursor] = getOrCreateEventBuffer(M);
+  FunctionCallee FlushFn = M.getOrInsertFunction(
+      FLUSH_EVENTS_FN,
+      FunctionType::get(Type::getVoidTy(Ctx), {Int8PtrTy, Int64Ty}, false));
+
+  IRBuilder<> Builder(I);
+  Value *AddrInt = Builder.CreatePtrToInt(Addr, Int64Ty);
+  Value *Event = Builder.CreateOr(
+      Builder.CreateShl(AddrInt, 1),
+      ConstantInt::get(Int64Ty, IsLoad ? 1 : 0));
+  Value *Cur = Builder.CreateLoad(Int64Ty, Cursor);
+  Value *Idx[] = {ConstantInt::get(Int64Ty, 0), Cur};
+  Value *Slot = Builder.CreateInBoundsGEP(Buf->getValueType(), Buf, Idx);
+  Builder.CreateStore(Event, Slot);
+  Value *Inc = Builder.CreateAdd(Cur, ConstantInt::get(Int64Ty, 1));
+  Builder.CreateStore(Inc, Cursor);
+  Value *Full = Builder.CreateICmpEQ(
+      Inc, ConstantInt::get(Int64Ty, HeapTrackerEventBufferSize));
+
+  Instruction *Then =
+      SplitBlockAndInsertIfThen(Full, I, /*Unreachable=*/false,
+                                unsafeProbeBranchWeights(I->getContext()));
+  IRBuilder<> ThenBuilder(Then);
+  setUnsafeProbeCallConv(ThenBuilder.CreateCall(
+      FlushFn, {ThenBuilder.CreateBitCast(Buf, Int8PtrTy),
+                ConstantInt::get(Int64Ty, HeapTrackerEventBufferSize)}));
+  ThenBuilder.CreateStore(ConstantInt::get(Int64Ty, 0), Cursor);
+}
+
+/// \brief Bracket __rust_alloc-family calls with runtime notification hooks.
+///
+/// heap_tracker_note_alloc(ptr, size) fires after allocation calls and
+/// heap_tracker_note_dealloc(ptr, size) before deallocation; realloc gets
+/// both. Invoke-form allocation calls are rare in rustc output and are left
+/// to the runtime's lazy classification.
+void instrumentAllocSites(Function &F, FunctionCallee NoteAllocFn,
+                          FunctionCallee NoteDeallocFn) {
+  SmallVector<CallInst *, 8> AllocCalls;
+  for (BasicBlock &BB : F) {
+    for (Instruction &I : BB) {
+      auto *Call = dyn_cast<CallInst>(&I);
+      if (!Call)
+        continue;
+      Function *Callee = Call->getCalledFunction();
+      if (!Callee)
+        continue;
+      StringRef Name = Callee->getName();
+      if (Name == "__rust_alloc" || Name == "__rust_alloc_zeroed" ||
+          Name == "__rust_dealloc" || Name == "__rust_realloc")
+        AllocCalls.push_back(Call);
+    }
+  }
+
+  Type *Int64Ty = Type::getInt64Ty(F.getContext());
+  for (CallInst *Call : AllocCalls) {
+    StringRef Name = Call->getCalledFunction()->getName();
+
+    if (Name == "__rust_dealloc" || Name == "__rust_realloc") {
+      // __rust_dealloc(ptr, size, align) / __rust_realloc(ptr, old_size,
+      // align, new_size): the old block goes away.
+      IRBuilder<> Builder(Call);
+      setUnsafeProbeCallConv(Builder.CreateCall(
+          NoteDeallocFn, {Call->getArgOperand(0),
+                          Builder.CreateZExtOrTrunc(Call->getArgOperand(1),
+                                                    Int64Ty)}));
+    }
+
+    if (Name != "__rust_dealloc") {
+      // __rust_alloc(size, align) / __rust_alloc_zeroed(size, align) /
+      // __rust_realloc(.., new_size): the result is the new block.
+      Value *Size = Name == "__rust_realloc" ? Call->getArgOperand(3)
+                                             : Call->getArgOperand(0);
+      IRBuilder<> Builder(Call->getNextNode());
+      setUnsafeProbeCallConv(Builder.CreateCall(
+          NoteAllocFn, {Call, Builder.CreateZExtOrTrunc(Size, Int64Ty)}));
+    }
+  }
+}
+
+/// \brief Replace the per-iteration probe of a loop-invariant unsafe access
+/// with a counter in the loop body and a bulk report at each dedicated exit.
+///
+/// The counter is a stack slot zeroed in the preheader, so re-entering the
+/// loop restarts the count; exits call
+/// dyn_unsafe_mem_access_bulk(ptr, is_load, count).
+bool instrumentInvariantUnsafeAccess(Instruction *I, Value *Addr, bool IsLoad,
+                                     Loop *L, FunctionCallee BulkFn) {
+  BasicBlock *Preheader = L->getLoopPreheader();
+  if (!Preheader || !L->hasDedicatedExits())
+    return false;
+
+  Function &F = *I->getFunction();
+  LLVMContext &Ctx = F.getContext();
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+
+  // Counter lives in the entry block so it dominates every use.
+  IRBuilder<> AllocaBuilder(&F.getEntryBlock().front());
+  AllocaInst *Counter =
+      AllocaBuilder.CreateAlloca(Int64Ty, nullptr, "unsafe_access_count");
+
+  IRBuilder<> PreheaderBuilder(Preheader->getTerminator());
+  PreheaderBuilder.CreateStore(ConstantInt::get(Int64Ty, 0), Counter);
+
+  IRBuilder<> BodyBuilder(I);
+  Value *Count = BodyBuilder.CreateLoad(Int64Ty, Counter);
+  BodyBuilder.CreateStore(
+      BodyBuilder.CreateAdd(Count, ConstantInt::get(Int64Ty, 1)), Counter);
+
+  SmallVector<BasicBlock *, 4> ExitBlocks;
+  L->getUniqueExitBlocks(ExitBlocks);
+  Value *IsLoadVal = ConstantInt::get(Type::getInt1Ty(Ctx), IsLoad);
+  for (BasicBlock *Exit : ExitBlocks) {
+    IRBuilder<> ExitBuilder(&*Exit->getFirstInsertionPt());
+    Value *Total = ExitBuilder.CreateLoad(Int64Ty, Counter);
+    setUnsafeProbeCallConv(
+        ExitBuilder.CreateCall(BulkFn, {Addr, IsLoadVal, Total}));
+  }
+  return true;
 }
 
 /// \brief Add a call to dyn_unsafe_mem_access() before each unsafe memory instruction.
 /// \param F The target function.
 /// \param DynUnsafeMemAccessFn The to-be-inserted callee.
-void instrumentUnsafeMemInst(Function &F, FunctionCallee DynUnsafeMemAccessFn) {
+void instrumentUnsafeMemInst(Function &F, const UnsafeRegionInfo &Regions,
+                             FunctionCallee DynUnsafeMemAccessFn,
+                             FunctionCallee LineFn, FunctionCallee RegionFn,
+                             FunctionCallee OriginFn, FunctionCallee BulkFn,
+                             LoopInfo *LI) {
+  // Region positions in analysis order: the key the prior profile
+  // (-unsafe-instr-prior-profile) matches against.
+  DenseMap<const Instruction *, unsigned> RegionIndexOf;
+  unsigned NumRegions = 0;
+  for (const UnsafeRegion &R : Regions.regions())
+    RegionIndexOf[R.Begin] = NumRegions++;
+
+  // Collect first: buffered emission splits blocks, which would otherwise
+  // invalidate the walk.
+  SmallVector<std::tuple<Instruction *, bool, unsigned>, 16> unsafeAccesses;
   for (BasicBlock &BB : F) {
     Instruction *ActiveMarkerBegin = nullptr;
+    unsigned ActiveRegionIdx = 0;
 
     for (Instruction &I : BB) {
       if (ActiveMarkerBegin) {
         if (isa<LoadInst>(I) || isa<StoreInst>(I)) {
-            IRBuilder<> Builder(&I);
-            bool IsLoad = isa<LoadInst>(I);
-            Value *DestAddr = IsLoad ? cast<LoadInst>(&I)->getPointerOperand() :
-                                       cast<StoreInst>(&I)->getPointerOperand();
-            Value *IsLoadVal = ConstantInt::get(Type::getInt1Ty(F.getContext()), IsLoad);
-            Builder.CreateCall(DynUnsafeMemAccessFn, {DestAddr, IsLoadVal});
+          unsafeAccesses.push_back({&I, isa<LoadInst>(I), ActiveRegionIdx});
         }
       }
 
-      if (auto *CI = dyn_cast<CallInst>(&I)) {
-        if (auto *IA = dyn_cast<InlineAsm>(CI->getCalledOperand())) {
-          StringRef AsmStr = IA->getAsmString();
-          if (AsmStr == UNSAFE_MARKER_BEGIN) {
-            ActiveMarkerBegin = &I;
-          } else if (AsmStr == UNSAFE_MARKER_END) {
-            if (ActiveMarkerBegin) {
-              ActiveMarkerBegin = nullptr;
-            }
-          }
+      bool IsBegin = false, IsEnd = false;
+      if (Regions.isMarker(I, IsBegin, IsEnd)) {
+        if (IsBegin) {
+          ActiveMarkerBegin = &I;
+          ActiveRegionIdx = RegionIndexOf.lookup(&I);
+        } else if (ActiveMarkerBegin) {
+          ActiveMarkerBegin = nullptr;
         }
       }
     }
   }
+
+  for (auto [I, IsLoad, RegionIdx] : unsafeAccesses) {
+    ++NumUnsafeAccessProbes;
+    countAccessSizeClass(accessSizeInBytes(I));
+    Value *DestAddr = IsLoad ? cast<LoadInst>(I)->getPointerOperand()
+                             : cast<StoreInst>(I)->getPointerOperand();
+    if (LI) {
+      if (Loop *L = LI->getLoopFor(I->getParent())) {
+        if (L->isLoopInvariant(DestAddr) &&
+            instrumentInvariantUnsafeAccess(I, DestAddr, IsLoad, L, BulkFn))
+          continue;
+      }
+    }
+    if (HeapTrackerEventBufferSize > 0) {
+      instrumentUnsafeAccessBuffered(I, DestAddr, IsLoad);
+    } else if (HeapTrackerLineConflicts) {
+      // Line-conflict mode swaps the plain probe for the histogram variant;
+      // the runtime keeps the ordinary access counters inside the same call.
+      Instruction *ProbePt = emitSampleGate(I, "heap");
+      IRBuilder<> Builder(ProbePt);
+      Value *IsLoadVal =
+          ConstantInt::get(Type::getInt1Ty(F.getContext()), IsLoad);
+      setUnsafeProbeCallConv(Builder.CreateCall(
+          LineFn, {DestAddr, IsLoadVal,
+                   ConstantInt::get(Type::getInt32Ty(F.getContext()),
+                                    unsafeRegionKey(F, RegionIdx))}));
+    } else if (HeapTrackerOriginHistogram) {
+      // Origin mode swaps the plain probe for the site-histogram variant;
+      // the runtime keeps the ordinary access counters inside the same
+      // call, indexed by the allocation site covering the address.
+      Instruction *ProbePt = emitSampleGate(I, "heap");
+      IRBuilder<> Builder(ProbePt);
+      Value *IsLoadVal =
+          ConstantInt::get(Type::getInt1Ty(F.getContext()), IsLoad);
+      setUnsafeProbeCallConv(Builder.CreateCall(
+          OriginFn, {DestAddr, IsLoadVal,
+                     ConstantInt::get(Type::getInt32Ty(F.getContext()),
+                                      unsafeRegionKey(F, RegionIdx))}));
+    } else {
+      // Accesses in regions a prior profile marks hot sample at the
+      // demotion rate; everything colder keeps the run-wide behavior.
+      bool Demoted = priorProfileDemotesRegion(F, RegionIdx);
+      if (Demoted)
+        ++NumHeapProbesDemoted;
+      Instruction *ProbePt = Demoted ? emitHotSampleGate(I, "heap")
+                                     : emitSampleGate(I, "heap");
+      IRBuilder<> Builder(ProbePt);
+      Value *IsLoadVal =
+          ConstantInt::get(Type::getInt1Ty(F.getContext()), IsLoad);
+      // Under -unsafe-region-correlate the probe carries the same region
+      // key CpuCycleCount tags its cycle records with, so the aggregator
+      // can join access counts to cycles per region.
+      if (unsafeRegionCorrelateEnabled())
+        setUnsafeProbeCallConv(Builder.CreateCall(
+            RegionFn, {DestAddr, IsLoadVal,
+                       ConstantInt::get(Type::getInt32Ty(F.getContext()),
+                                        unsafeRegionKey(F, RegionIdx))}));
+      else
+        setUnsafeProbeCallConv(Builder.CreateCall(
+            DynUnsafeMemAccessFn,
+            {DestAddr, IsLoadVal,
+             ConstantInt::get(Type::getInt32Ty(F.getContext()),
+                              accessSizeInBytes(I))}));
+    }
+  }
 }
 
 } // anonymous namespace
 
 bool HeapTrackerPass::isPrimaryPackage() {
-  const char *P = getenv("CARGO_PRIMARY_PACKAGE");
-  return P && strcmp(P, "1") == 0;
+  return isUnsafePrimaryPackage();
+}
+
+void HeapTrackerPass::initRuntimeCallees(Module &M) {
+  LLVMContext &C = M.getContext();
+  Type *VoidTy = Type::getVoidTy(C);
+  Type *RawPtrTy = PointerType::getUnqual(Type::getInt8Ty(C));
+  Type *BooleanTy = Type::getInt1Ty(C);
+  Type *Int32Ty = Type::getInt32Ty(C);
+  Type *Int64Ty = Type::getInt64Ty(C);
+
+  Callees.M = &M;
+  // dyn_mem_access(ptr, size_bytes) / dyn_unsafe_mem_access(ptr, is_load,
+  // size_bytes): the size immediate is the compile-time store size of the
+  // accessed value type, so the runtime can bucket traffic in bytes
+  // instead of rating a vector store and an i8 store identically. The
+  // runtime hooks take the extra operand in lockstep.
+  // Mapped-range classification swaps the plain probe wholesale; the
+  // classified variant shares its signature, since the range table lives
+  // entirely runtime-side.
+  Callees.DynMemAccess = M.getOrInsertFunction(
+      HeapTrackerMapsClassify ? DYN_MEM_ACCESS_CLASSIFIED_FN
+                              : DYN_MEM_ACCESS_FN,
+      FunctionType::get(VoidTy, {RawPtrTy, Int32Ty}, false));
+  Callees.DynUnsafeMemAccess = M.getOrInsertFunction(
+      DYN_UNSAFE_MEM_ACCESS_FN,
+      FunctionType::get(VoidTy, {RawPtrTy, BooleanTy, Int32Ty}, false));
+  // The slow path stays pointer-only: it exists to classify the address
+  // and fill the shadow, not to account traffic.
+  Callees.DynMemAccessSlow = M.getOrInsertFunction(
+      DYN_MEM_ACCESS_SLOW_FN, FunctionType::get(VoidTy, RawPtrTy, false));
+  // dyn_mem_access_static(stack_sites, global_sites)
+  Callees.DynMemAccessStatic = M.getOrInsertFunction(
+      DYN_MEM_ACCESS_STATIC_FN,
+      FunctionType::get(VoidTy, {Int32Ty, Int32Ty}, false));
+  // dyn_mem_access_range(ptr, len, is_write)
+  Callees.DynMemAccessRange = M.getOrInsertFunction(
+      DYN_MEM_ACCESS_RANGE_FN,
+      FunctionType::get(VoidTy, {RawPtrTy, Int64Ty, BooleanTy}, false));
+  // dyn_unsafe_mem_access_bulk(ptr, is_load, count)
+  Callees.DynUnsafeMemAccessBulk = M.getOrInsertFunction(
+      DYN_UNSAFE_MEM_ACCESS_BULK_FN,
+      FunctionType::get(VoidTy, {RawPtrTy, BooleanTy, Int64Ty}, false));
+
+  // The line-histogram probe only reaches the IR in line-conflict mode;
+  // keep clean modules free of the unused declaration.
+  if (HeapTrackerLineConflicts) {
+    // dyn_unsafe_mem_access_line(ptr, is_load, region_id)
+    Callees.DynUnsafeMemAccessLine = M.getOrInsertFunction(
+        DYN_UNSAFE_MEM_ACCESS_LINE_FN,
+        FunctionType::get(VoidTy, {RawPtrTy, BooleanTy, Int32Ty}, false));
+  }
+
+  // The region-keyed probe only reaches the IR under
+  // -unsafe-region-correlate; keep clean modules free of the unused
+  // declaration.
+  if (unsafeRegionCorrelateEnabled()) {
+    // dyn_unsafe_mem_access_region(ptr, is_load, region_key)
+    Callees.DynUnsafeMemAccessRegion = M.getOrInsertFunction(
+        DYN_UNSAFE_MEM_ACCESS_REGION_FN,
+        FunctionType::get(VoidTy, {RawPtrTy, BooleanTy, Int32Ty}, false));
+  }
+
+  // The origin-histogram probe only reaches the IR under
+  // -heap-tracker-origin; keep clean modules free of the unused
+  // declaration.
+  if (HeapTrackerOriginHistogram) {
+    // dyn_unsafe_mem_access_origin(ptr, is_load, region_key)
+    Callees.DynUnsafeMemAccessOrigin = M.getOrInsertFunction(
+        DYN_UNSAFE_MEM_ACCESS_ORIGIN_FN,
+        FunctionType::get(VoidTy, {RawPtrTy, BooleanTy, Int32Ty}, false));
+  }
+
+  // Under maps classification every instrumented module contributes a ctor
+  // that takes the initial /proc/self/maps snapshot before main; the
+  // runtime hook is idempotent, so duplicate registration across modules
+  // is harmless.
+  if (HeapTrackerMapsClassify && !M.getFunction("heap_tracker_maps_ctor")) {
+    FunctionCallee InitFn = M.getOrInsertFunction(MAPS_INIT_FN, VoidTy);
+    Function *Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                                      GlobalValue::InternalLinkage,
+                                      "heap_tracker_maps_ctor", &M);
+    IRBuilder<> Builder(BasicBlock::Create(C, "entry", Ctor));
+    Builder.CreateCall(InitFn);
+    Builder.CreateRetVoid();
+    appendToGlobalCtors(M, Ctor, 0);
+  }
+
+  // The allocation hooks only reach the IR under -heap-tracker-alloc-hooks;
+  // keep clean modules free of the unused declarations.
+  if (HeapTrackerAllocHooks) {
+    FunctionType *NoteFnTy =
+        FunctionType::get(VoidTy, {RawPtrTy, Int64Ty}, false);
+    Callees.NoteAlloc =
+        M.getOrInsertFunction(HEAP_TRACKER_NOTE_ALLOC_FN, NoteFnTy);
+    Callees.NoteDealloc =
+        M.getOrInsertFunction(HEAP_TRACKER_NOTE_DEALLOC_FN, NoteFnTy);
+  }
 }
 
 PreservedAnalyses HeapTrackerPass::run(Function &F,
@@ -111,22 +847,44 @@ PreservedAnalyses HeapTrackerPass::run(Function &F,
   if (!HeapTrackerPass::isPrimaryPackage())
     return PreservedAnalyses::all();
 
-  LLVMContext &C = F.getContext();
+  // Targeted runs (-unsafe-instr-funcs) probe only the listed functions.
+  if (!unsafeInstrFuncFilterAllows(F))
+    return PreservedAnalyses::all();
+
+  // Resolve the runtime callees once per module instead of once per
+  // function; on a 30k-function crate that is one batch of symbol-table
+  // insertions instead of 30k.
   Module *M = F.getParent();
-  Type *VoidTy = Type::getVoidTy(C);
-  Type *RawPtrTy = PointerType::getUnqual(Type::getInt8Ty(C));
-  Type *BooleanTy = Type::getInt1Ty(C);
-  FunctionType *DynMemAccessFnTy = FunctionType::get(VoidTy, RawPtrTy, false);
-  FunctionCallee DynMemAccessFn = M->getOrInsertFunction(
-    DYN_MEM_ACCESS_FN, DynMemAccessFnTy);
-  FunctionType *DynUnsafeMemAccessFnTy = FunctionType::get(
-    VoidTy, {RawPtrTy, BooleanTy}, false);
-  FunctionCallee DynUnsafeMemAccessFn = M->getOrInsertFunction(
-    DYN_UNSAFE_MEM_ACCESS_FN, DynUnsafeMemAccessFnTy);
-
-  instrumentMemInst(F, DynMemAccessFn);
-
-  instrumentUnsafeMemInst(F, DynUnsafeMemAccessFn);
-  
+  if (Callees.M != M)
+    initRuntimeCallees(*M);
+
+  LoopInfo *LI = HeapTrackerHoistInvariant
+                     ? &AM.getResult<LoopAnalysis>(F)
+                     : nullptr;
+
+  // Take the shared region scan before any instrumentation mutates F.
+  const UnsafeRegionInfo &Regions = AM.getResult<UnsafeRegionAnalysis>(F);
+
+  if (HeapTrackerAllocHooks)
+    instrumentAllocSites(F, Callees.NoteAlloc, Callees.NoteDealloc);
+
+  instrumentMemInst(F, Callees.DynMemAccess, Callees.DynMemAccessSlow,
+                    Callees.DynMemAccessStatic, Callees.DynMemAccessRange);
+
+  // The unsafe-access walk only matters in functions that actually carry
+  // region markers; the plain memory instrumentation above covers the rest.
+  if (hasUnsafeRegionMarkers(F))
+    instrumentUnsafeMemInst(F, Regions, Callees.DynUnsafeMemAccess,
+                            Callees.DynUnsafeMemAccessLine,
+                            Callees.DynUnsafeMemAccessRegion,
+                            Callees.DynUnsafeMemAccessOrigin,
+                            Callees.DynUnsafeMemAccessBulk, LI);
+
+  // The shadow fast path and buffered emission split blocks, so the CFG is
+  // no longer intact.
+  if (HeapTrackerShadowFastPath || HeapTrackerEventBufferSize > 0 ||
+      getUnsafeInstrSampleRate() > 1)
+    return PreservedAnalyses::none();
+
   return PreservedAnalyses::all();
 }
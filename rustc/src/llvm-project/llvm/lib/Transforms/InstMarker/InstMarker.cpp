@@ -12,112 +12,1551 @@
 //===----------------------------------------------------------------------------===//
 
 #include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/PostDominators.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/StructuralHash.h"
 #include "llvm/IR/Type.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/InstMarker/UnsafeStatsFormat.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeFunctionTracker.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/ADT/Statistic.h"
 #include <cstdlib>
 #include <cstring>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "instmarker"
+
+STATISTIC(NumUnsafeRegionsMarked,
+          "Number of unsafe regions bracketed with begin/end markers");
+STATISTIC(NumUnsafeLinesTagged,
+          "Number of unsafe instructions given line-info metadata");
+STATISTIC(NumFunctionsAlreadyInstrumented,
+          "Number of cached already-instrumented functions left untouched");
+STATISTIC(NumFunctionsUnchangedSincePrior,
+          "Number of functions whose hash matches the previous build's "
+          "sidecar");
+STATISTIC(NumUnsafeRunsCoalesced,
+          "Number of unsafe runs merged into a neighboring marker pair");
+STATISTIC(NumSafeInstsCoalesced,
+          "Number of safe instructions swept into coalesced regions");
+STATISTIC(NumUnsafeInstsExcluded,
+          "Number of unsafe instructions unmarked by the exclusion profile");
+
+// Cross-block regions: a source-level unsafe block that contains a branch is
+// split by the per-block bracketing into one marker pair per block, so every
+// downstream probe (cycle reads in particular) fires once per block instead
+// of once per region. When enabled, unsafe blocks that share a
+// dominator/post-dominator shape safe for a single pair are covered by one
+// begin/end instead. Off by default so existing numbers stay reproducible.
+static cl::opt<bool> InstMarkerCrossBlockRegions(
+  "instmarker-cross-block-regions", cl::init(false), cl::Hidden,
+  cl::desc("Cover dominance-connected groups of unsafe blocks with one "
+           "begin/end marker pair instead of one pair per block")
+);
+
+// Coalescing gap: the block-local placement has always swept everything
+// between a block's first and last unsafe instruction into one pair —
+// merging arrayvec's alternating unsafe one-liners and safe glue is what
+// keeps CpuCycleCount from paying back-to-back end/begin probe sequences
+// — but the sweep was all-or-nothing and unaccounted. This knob makes the
+// merge distance explicit: runs of unsafe instructions separated by more
+// than this many safe instructions get their own pair, and every begin
+// marker of a region that did swallow safe glue records the swallowed
+// count as unsafe_coalesced_safe metadata so accounting can subtract it.
+// The default reproduces the historical whole-block sweep.
+static cl::opt<unsigned> InstMarkerCoalesceGap(
+  "instmarker-coalesce-gap", cl::init(~0u), cl::Hidden,
+  cl::desc("Merge unsafe runs separated by at most this many safe "
+           "instructions into one marker pair (default: whole block)")
+);
+
+// Nesting depth: rustc tags every instruction of a nested unsafe block
+// with unsafe_inst, and the flat begin/end bracketing double-counts
+// nothing but forgets the nesting entirely — innermost attribution needs
+// it back. Under this flag every begin marker records the lexical-scope
+// facts of its region's deepest instruction (depth, a stable key for its
+// innermost lexical block, and that block's parent key) as
+// unsafe_region_nesting metadata. Depth counts all lexical blocks, not
+// just unsafe ones — safe braces inflate the absolute number — but
+// ancestor relations and relative order, which is what an innermost-only
+// report subtracts along, are exact. Keys hash the subprogram name and
+// each block's line/column, so they are recomputable from debug info
+// offline.
+static cl::opt<bool> InstMarkerRegionDepth(
+  "instmarker-region-depth", cl::init(false), cl::Hidden,
+  cl::desc("Record lexical nesting depth and scope keys on every region "
+           "begin marker as unsafe_region_nesting metadata")
+);
+
+// Shared-memory stat aggregation: harnesses that spawn thousands of
+// short-lived instrumented processes (rebar) pay exit-time text formatting
+// per process, and the aggregator re-parses one file per run. Under this
+// flag the stat-reporting passes register no print destructors; instead a
+// ctor attaches the named segment (path in the UNSAFE_STATS_SHM environment
+// variable) and a dtor folds the process's accumulators into it, so
+// results from the whole run land pre-aggregated in one region the
+// pipeline reads once. Lives here beside the sampling knob for the same
+// reason: every unsafe pass already links against InstMarker.
+static cl::opt<bool> UnsafeShmStats(
+  "unsafe-stats-shm", cl::init(false), cl::Hidden,
+  cl::desc("Aggregate stats into the shared-memory segment named by "
+           "UNSAFE_STATS_SHM instead of printing at exit")
+);
+
+// Shared sampling knob for every unsafe instrumentation pass. Each pass that
+// honors it emits the same per-thread countdown check before its probes, so
+// a 1/N run pays probe cost on only every Nth event. Lives here because all
+// unsafe passes already link against InstMarker for the marker machinery.
+static cl::opt<unsigned> UnsafeInstrSampleRate(
+  "unsafe-instr-sample-rate", cl::init(1), cl::Hidden,
+  cl::desc("Fire unsafe instrumentation probes only every Nth time "
+           "(1 = always, 0 = statically disabled)")
+);
+
+// Differential instrumentation: for deep-dives on a handful of functions,
+// probing the whole primary crate perturbs exactly the paths under study
+// (tokio's scheduler around a targeted runtime internal, say). The file
+// named here holds one mangled function name per line ('#' starts a
+// comment); when set, the instrumentation passes probe only the listed
+// functions. Lives here beside the sampling knob because every unsafe pass
+// already links against InstMarker.
+static cl::opt<std::string> UnsafeInstrFuncsFile(
+  "unsafe-instr-funcs", cl::init(""), cl::Hidden,
+  cl::desc("File of mangled function names to instrument; all other "
+           "functions get no probes (empty = instrument everything)")
+);
+
+// Dormant probes: switching between cycle/heap/counter experiments has
+// meant one full rustc rebuild per EXPERIMENTS entry — the dominant cost of
+// the pipeline. Under this flag a single build carries every probe family,
+// each gated on a runtime-owned __unsafe_probe_enable_<family> byte the
+// runtime sets at startup (UNSAFE_INSTR_EXPERIMENT), so a dormant probe
+// costs one test and a never-taken branch over a cold call. True nop-sled
+// patching a la XRay/-fpatchable-function-entry needs codegen support these
+// IR passes do not have; the byte test is the IR-level equivalent and is
+// cheap enough that one build serves all experiments.
+static cl::opt<bool> UnsafeDormantProbes(
+  "unsafe-instr-dormant-probes", cl::init(false), cl::Hidden,
+  cl::desc("Emit all probe families gated on per-family enable bytes the "
+           "runtime sets at startup, instead of one build per experiment")
+);
+
+// Shared config block: the dormant-probe bytes live in one external global
+// per family, so a function mixing probe families re-loads scattered bytes
+// at every probe, and each new runtime-checked option would add another
+// load to every firing. Under this flag all probe gating reads one
+// cache-line-aligned, read-only-after-startup __unsafe_instr_config block
+// instead: word 0 carries the family enable bits and is loaded once per
+// function entry into a local the probes test with shift-and-mask, so
+// per-probe cost stays one register test no matter how many options the
+// block grows (the remaining words are reserved for the runtime's own
+// read-mostly state — sampling mask, shm base — keeping it all on the one
+// hot line).
+static cl::opt<bool> UnsafeConfigBlock(
+  "unsafe-config-block", cl::init(false), cl::Hidden,
+  cl::desc("Gate probes on a single cache-line-aligned runtime config "
+           "block loaded once per function instead of per-family bytes")
+);
+
+// Profile-guided probe placement: after one measurement run the per-region
+// execution counts are known, yet the next run re-instruments everything
+// uniformly — the hottest regions, which dominate both the overhead and the
+// perturbation, are exactly the ones that least need every execution timed.
+// The file named here carries "<func-id>\t<region-index>\t<count>" rows from
+// a prior run; regions whose count reaches -unsafe-instr-hot-threshold are
+// demoted to sampled probes at -unsafe-instr-hot-sample-rate while colder
+// regions keep full instrumentation. Function IDs only line up across builds
+// when the prior run used -unsafe-func-stable-ids, so pair the two flags.
+static cl::opt<std::string> UnsafeInstrPriorProfile(
+  "unsafe-instr-prior-profile", cl::init(""), cl::Hidden,
+  cl::desc("TSV file of func-id, region-index, execution-count rows from a "
+           "prior run; regions it marks hot get sampled probes")
+);
+
+static cl::opt<unsigned long long> UnsafeInstrHotThreshold(
+  "unsafe-instr-hot-threshold", cl::init(1000000), cl::Hidden,
+  cl::desc("Prior-run execution count at which a region counts as hot and "
+           "is demoted to sampled probes")
+);
+
+static cl::opt<unsigned> UnsafeInstrHotSampleRate(
+  "unsafe-instr-hot-sample-rate", cl::init(64), cl::Hidden,
+  cl::desc("Sample rate applied to regions the prior profile marks hot "
+           "(never samples less often than -unsafe-instr-sample-rate)")
+);
+
+// Coverage-guided exclusion, the cold-side complement of the hot-side
+// demotion above: a coverage run (DynamicLineCountPass, ideally with
+// -unsafe-line-coverage-only) leaves a stats file whose "line" rows name
+// every unsafe (file, line) that executed at all. Fed back here, unsafe
+// instructions on lines that file never saw execute lose their marking, so
+// iterative measurement campaigns converge toward binaries that only pay
+// probes where the workload actually goes. The join is on file and line,
+// not the interned line IDs — those are dense per build and do not survive
+// recompilation, which is why the text rows carry both columns. Only
+// meaningful against a profile from the same sources under the workload of
+// record; a region the workload later learns to reach simply goes
+// unmeasured, never miscounted.
+static cl::opt<std::string> UnsafeInstrExcludeProfile(
+  "unsafe-instr-exclude-profile", cl::init(""), cl::Hidden,
+  cl::desc("Coverage stats file ('line' rows) from a prior run; unsafe "
+           "instructions on lines it never saw execute are not marked")
+);
+
+// Symbol-stripped production mode: the function tracker already moved its
+// names offline (-unsafe-func-sidecar-dir), but the external-call callee
+// table, the cycle scope table and the folded-stack frame table still embed
+// mangled name strings, so an instrumented binary cannot match a stripped
+// release build in size or startup relocation work. With a directory named
+// here, every pass that would embed such a table emits null name pointers
+// instead and writes a per-module name sidecar at compile time; the runtime
+// prints "id:<n>" identities for the nameless entries, and llvm-unsafe-stats
+// re-symbolizes them offline from the sidecars (its -symbolize-dir option).
+// The IDs are dense per module, so each sidecar's module_hash row says which
+// build's dump it resolves.
+static cl::opt<std::string> UnsafeNameSidecarDir(
+  "unsafe-name-sidecar-dir", cl::init(""), cl::Hidden,
+  cl::desc("Directory for per-module name sidecars; instrumented binaries "
+           "then carry numeric IDs only (empty = embed name strings)")
+);
+
+// Incremental re-instrumentation: any tweak to the instrumentation flags
+// invalidates every cached CGU, so a benchmark-debugging session pays a
+// full instrumented rebuild per experiment adjustment even when nothing
+// under study changed. Under this flag InstMarkerPass records a
+// per-function content+config hash — the detailed structural hash of the
+// pre-marker IR paired with the pipeline fingerprint — both as function
+// metadata and as rows of a per-module TSV sidecar in the named
+// directory. Cached bitcode re-fed through the pipeline is recognized by
+// its metadata record and left untouched instead of double-marked, and
+// build tooling diffs consecutive sidecars to re-instrument only the
+// CGUs whose functions actually changed. A fresh (record-free) function
+// is never skipped on a sidecar match alone: that would emit native code
+// into an instrumented object, so object reuse stays the incremental
+// cache's decision.
+static cl::opt<std::string> UnsafeInstrIncrementalDir(
+  "unsafe-instr-incremental-dir", cl::init(""), cl::Hidden,
+  cl::desc("Directory for per-module content+config hash sidecars; also "
+           "makes re-marking cached instrumented bitcode a checked no-op")
+);
+
+// A/B probe-codegen experiments pay a full frontend+optimizer rebuild per
+// arm today. The checkpoint splits the compilation at the head of the
+// instrumentation block instead: a dump run writes each module's
+// post-optimization, pre-probe bitcode into the named directory, and a
+// resume run (the resume flag below, wired up in the rustc wrapper's
+// LLVMRustOptimize) swaps that bitcode back in and runs only the unsafe
+// passes plus codegen. The markers are already in the checkpoint —
+// InstMarkerPass runs before optimization — so one dump replays under
+// every probe configuration for seconds of pass time per arm.
+static cl::opt<std::string> UnsafeInstrCheckpointDir(
+  "unsafe-instr-checkpoint-dir", cl::init(""), cl::Hidden,
+  cl::desc("Directory for per-module pre-instrumentation bitcode "
+           "checkpoints, dumped at the head of the instrumentation block")
+);
+
+static cl::opt<bool> UnsafeInstrCheckpointResume(
+  "unsafe-instr-checkpoint-resume", cl::init(false), cl::Hidden,
+  cl::desc("Replace each module with its checkpoint bitcode and run only "
+           "the unsafe passes before codegen")
+);
+
+// Split-DWARF-style table externalization: the static tables the stats
+// passes emit (line records and file pool, function metadata, block-count
+// rows) live in loadable data sections, inflating an instrumented tokio
+// binary from 8MB to 21MB and paying the difference again at every load.
+// Under this flag each table moves behind a small framing header into an
+// SHF_EXCLUDE .unsafe_tables section: every object feeding the link still
+// carries it for the LLVMRustExtractUnsafeTables wrapper hook to pull
+// out, but the linked binary keeps only IDs. Registration ctors hand the
+// runtime a null table pointer plus the real element count, so it sizes
+// its accumulators and dumps raw IDs the aggregator joins offline.
+static cl::opt<bool> UnsafeExternTables(
+  "unsafe-extern-tables", cl::init(false), cl::Hidden,
+  cl::desc("Emit static instrumentation tables into an excluded "
+           ".unsafe_tables section instead of loadable data")
+);
+
+// Sharded stat output: print_cpu_cycle_stats and __unsafe_dump_stats
+// serialize every thread's data through one exit-time path appending to
+// fixed CWD file names — a 64-worker rayon benchmark pays a multi-second
+// exit, and concurrent benchmark processes contend on the same files. The
+// template named here goes to the runtime once per module via
+// __unsafe_stats_set_output_template; the runtime expands $VARs from the
+// environment plus %p (pid) and %t (tid) before opening, and a template
+// containing %t dumps each thread's accumulators as an independent shard
+// from the thread-exit hook, leaving the exit dtor only the threads still
+// alive. Dump time becomes constant per thread, processes stop sharing an
+// output file, and llvm-unsafe-stats merge folds the shards back together.
+static cl::opt<std::string> UnsafeStatsOutputTemplate(
+  "unsafe-stats-output-template", cl::init(""), cl::Hidden,
+  cl::desc("Stat output path template the runtime expands with $ENV vars, "
+           "%p (pid) and %t (tid); a %t template shards output per thread")
+);
+
+// Lazy table registration: every linked module's registration ctors run at
+// process start, and rebar-style harnesses that exec one instrumented
+// binary per measurement pay for all of them on every exec — including
+// modules whose code the run never reaches. Under this flag the
+// registration entry points stay out of llvm.global_ctors; each probe
+// first tests a per-module flag byte (one predictable never-taken branch
+// once registered) and calls the registration path on its first firing,
+// behind an atomic once-guard so racing first firings register exactly
+// once. Startup cost then scales with executed modules, not linked
+// modules. The block-count registration keeps its eager ctor: its
+// per-block increments are the hottest probes this tree emits, and in
+// guarded mode they load a base pointer the ctor publishes.
+static cl::opt<bool> UnsafeLazyRegistration(
+  "unsafe-lazy-registration", cl::init(false), cl::Hidden,
+  cl::desc("Register stat tables on first probe firing instead of at "
+           "process start")
+);
+
+// Linker-visible layout: an instrumented binary carries thousands of small
+// per-function tables and registration thunks, scattered through .text and
+// .data wherever codegen placed their CGU, and identical thunks from
+// different CGUs all survive the link. Under this flag every generated
+// thunk gets its own .text.unsafe_thunk.<name> section and is marked
+// non-address-significant, so lld's --icf=safe folds the duplicates, and
+// the tables move to .rodata.unsafe_tables.* / .data.unsafe_accum.*
+// sections a linker-script rule (*(.data.unsafe_accum.*)) can gather, so
+// the accumulators land contiguous instead of interleaved with
+// application data — fewer resident pages at load and fewer cache lines
+// touched per dump. Off by default because the section names are a
+// contract with the link step; a default link without the script rules
+// still works, just with the old scattered layout.
+static cl::opt<bool> UnsafeSectionLayout(
+  "unsafe-instr-section-layout", cl::init(false), cl::Hidden,
+  cl::desc("Place generated instrumentation thunks and tables in dedicated "
+           "sections for linker ICF and grouped layout")
+);
+
+// Probe audit: what a planted probe costs is only known after lowering —
+// argument setup, serializing fences and the call itself all materialize in
+// codegen. Under this flag the instrumentation passes stamp each probe
+// anchor with unsafe_probe_id metadata (family + per-function ordinal), and
+// a late machine pass reports instruction and cycle estimates per probe at
+// compile time, giving a static overhead budget per experiment before any
+// benchmark runs.
+static cl::opt<bool> UnsafeProbeAudit(
+  "unsafe-probe-audit", cl::init(false), cl::Hidden,
+  cl::desc("Stamp probes with IDs and report per-probe machine instruction "
+           "and cycle estimates at compile time")
+);
+
+// Register pressure at probe sites: a C-convention call treats every
+// caller-saved register as clobbered, so a probe in a hot loop brackets
+// itself with spill/reload pairs for the loop's whole live set —
+// systematic in matrixmultiply's kernels. preserve_most moves that cost
+// into the hook (all GPRs except R11 become callee-saved), paid once on
+// the hook's own cold side per firing. Vector registers stay caller-saved
+// even under preserve_most, so FP-heavy loops still spill xmm state;
+// preserve_all would cover those too but taxes every hook with the full
+// vector save. Off by default because the convention is part of the hook
+// ABI: the runtime must build its per-firing entry points with
+// __attribute__((preserve_most)), and a mismatch corrupts registers
+// silently.
+static cl::opt<bool> UnsafeProbePreserveMost(
+  "unsafe-probe-preserve-most", cl::init(false), cl::Hidden,
+  cl::desc("Declare and call the per-firing probe hooks preserve_most so "
+           "probes stop perturbing surrounding register allocation")
+);
+
+// Signal-triggered dumps: the stat files otherwise come only from global
+// dtors, so a benchmark killed after its measurement window (a tokio
+// service, say) produces nothing. Under this flag every emitted exit dump
+// also registers with the runtime's SIGUSR1 facility, which snapshots the
+// accumulator tables wait-free and writes the stat file on demand, so the
+// pipeline can collect intermediate results from long-running or
+// non-terminating services without restructuring the benchmarks.
+static cl::opt<bool> UnsafeStatsSignalDump(
+  "unsafe-stats-signal-dump", cl::init(false), cl::Hidden,
+  cl::desc("Also register the exit stat dumps with the runtime's SIGUSR1 "
+           "handler so long-running benchmarks can be dumped on demand")
+);
+
+// Region correlation: cycle and memory-access records land in separate
+// .stat files with no shared key, so cycle-per-access ratios could only be
+// joined at whole-function granularity — routinely wrong for functions
+// with several unsafe blocks. Under this flag HeapTracker and
+// CpuCycleCount both tag their records with unsafeRegionKey, so the
+// per-region join is one lookup in the aggregator.
+static cl::opt<bool> UnsafeRegionCorrelate(
+  "unsafe-region-correlate", cl::init(false), cl::Hidden,
+  cl::desc("Key cycle and memory-access records by a shared per-region ID "
+           "so the aggregator can correlate them per unsafe region")
+);
+
 namespace {
 
-/// \brief Checks if the current build is for the primary package.
+// Per-thread countdown shared by all sampled probes in a module. Demoted
+// hot regions count down a separate global so their higher rate does not
+// skew the cadence of ordinarily sampled probes.
+constexpr const char *SAMPLE_COUNTDOWN_NAME =
+    "__unsafe_instr_sample_countdown";
+constexpr const char *HOT_SAMPLE_COUNTDOWN_NAME =
+    "__unsafe_instr_hot_sample_countdown";
+
+/// \brief Get (creating on first use) the per-thread sample countdown
+/// named \p Name.
+GlobalVariable *getOrCreateSampleCountdown(Module &M, StringRef Name) {
+  if (GlobalVariable *GV =
+          M.getGlobalVariable(Name, /*AllowInternal=*/true))
+    return GV;
+
+  Type *Int32Ty = Type::getInt32Ty(M.getContext());
+  auto *GV = new GlobalVariable(M, Int32Ty, /*isConstant=*/false,
+                                GlobalValue::InternalLinkage,
+                                ConstantInt::get(Int32Ty, 0), Name);
+  GV->setThreadLocal(true);
+  GV->setAlignment(Align(4));
+  return GV;
+}
+
+} // anonymous namespace
+
+bool llvm::isUnsafePrimaryPackage() {
+  // The environment cannot change under us in a meaningful way, so resolve
+  // the answer once instead of per pass run.
+  static const bool IsPrimary = [] {
+    const char *P = getenv("CARGO_PRIMARY_PACKAGE");
+    return P && strcmp(P, "1") == 0;
+  }();
+  return IsPrimary;
+}
+
+uint64_t llvm::getUnsafeModuleHash(Module &M) {
+  // Pin the first computed value in a module flag: passes that ask later
+  // have already mutated the IR, and they must record the same namespace
+  // qualifier as the pass that asked first. Max (rather than Error) keeps
+  // an LTO merge of differently-hashed modules from failing the link; the
+  // post-link pipelines ask again on the merged module before any pass
+  // there records IDs.
+  if (Metadata *Flag = M.getModuleFlag("unsafe.instr.module.hash"))
+    return mdconst::extract<ConstantInt>(Flag)->getZExtValue();
+  uint64_t Hash = StructuralHash(M, /*DetailedHash=*/true);
+  M.addModuleFlag(
+      Module::Max, "unsafe.instr.module.hash",
+      ConstantInt::get(Type::getInt64Ty(M.getContext()), Hash));
+  return Hash;
+}
+
+unsigned llvm::getUnsafeInstrSampleRate() { return UnsafeInstrSampleRate; }
+
+StringRef llvm::getUnsafeInstrFuncsFile() { return UnsafeInstrFuncsFile; }
+
+StringRef llvm::getUnsafeInstrExcludeProfile() {
+  return UnsafeInstrExcludeProfile;
+}
+
+StringRef llvm::getUnsafeNameSidecarDir() { return UnsafeNameSidecarDir; }
+
+std::unique_ptr<raw_fd_ostream> llvm::openUnsafeNameSidecar(Module &M,
+                                                            StringRef Suffix) {
+  if (UnsafeNameSidecarDir.empty())
+    return nullptr;
+
+  // Same file-name derivation as the function tracker's sidecar: one file
+  // per codegen unit, module identifier sanitized down to a portable name.
+  SmallString<128> FileName(sys::path::filename(M.getModuleIdentifier()));
+  for (char &C : FileName)
+    if (!isAlnum(C) && C != '.' && C != '-' && C != '_')
+      C = '_';
+
+  SmallString<256> Path(UnsafeNameSidecarDir);
+  sys::path::append(Path, FileName + Suffix);
+
+  std::error_code EC;
+  auto OS = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "warning: cannot write name sidecar " << Path << ": "
+           << EC.message() << "; embedding names in the binary instead\n";
+    return nullptr;
+  }
+
+  uint64_t ModuleHash = getUnsafeModuleHash(M);
+  writeUnsafeStatsHeader(*OS, ModuleHash);
+  *OS << "module_hash\t" << utohexstr(ModuleHash) << '\n';
+  return OS;
+}
+
+bool llvm::unsafeInstrFuncFilterAllows(const Function &F) {
+  if (UnsafeInstrFuncsFile.empty())
+    return true;
+
+  // The list cannot change during a compilation, so read it once per
+  // process. An unreadable file disables filtering rather than silently
+  // producing an empty measurement.
+  static const StringSet<> *Allowed = [] {
+    auto *Set = new StringSet<>();
+    auto BufOrErr = MemoryBuffer::getFile(UnsafeInstrFuncsFile);
+    if (!BufOrErr) {
+      errs() << "warning: cannot read -unsafe-instr-funcs file "
+             << UnsafeInstrFuncsFile << ": "
+             << BufOrErr.getError().message()
+             << "; instrumenting all functions\n";
+      delete Set;
+      return static_cast<const StringSet<> *>(nullptr);
+    }
+    for (line_iterator LI(**BufOrErr, /*SkipBlanks=*/true, '#'); !LI.is_at_end();
+         ++LI)
+      Set->insert(LI->trim());
+    return static_cast<const StringSet<> *>(Set);
+  }();
+
+  // Multi-versioning renames the probed body after the markers are in
+  // place; the filter file lists the names the user knows, so match with
+  // the variant suffix stripped.
+  StringRef Name = F.getName();
+  Name.consume_back(UnsafeProbedVariantSuffix);
+  return !Allowed || Allowed->contains(Name);
+}
+
+bool llvm::unsafeShmStatsEnabled() { return UnsafeShmStats; }
+
+bool llvm::unsafeExternTablesEnabled() { return UnsafeExternTables; }
+
+void llvm::externalizeUnsafeTable(GlobalVariable *GV,
+                                  UnsafeExternTableFamily Family) {
+  assert(GV->use_empty() &&
+         "externalized tables are reached only through the section");
+  Module &M = *GV->getParent();
+  LLVMContext &Ctx = M.getContext();
+
+  // The extraction hook concatenates section bytes across every object in
+  // the link, so each table rides behind the fixed header documented next
+  // to UnsafeExternTableFamily; the payload lands at offset 16 and keeps
+  // its natural alignment.
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Constant *Payload = GV->getInitializer();
+  StructType *WrapTy =
+      StructType::get(Int32Ty, Int32Ty, Int64Ty, Payload->getType());
+  Constant *Wrapped = ConstantStruct::get(
+      WrapTy, ConstantInt::get(Int32Ty, 0x31425455), // "UTB1", little-endian
+      ConstantInt::get(Int32Ty, Family),
+      ConstantInt::get(Int64Ty,
+                       M.getDataLayout().getTypeAllocSize(Payload->getType())),
+      Payload);
+  auto *Ext = new GlobalVariable(M, WrapTy, /*isConstant=*/true,
+                                 GlobalValue::PrivateLinkage, Wrapped,
+                                 GV->getName() + ".extern");
+  Ext->setAlignment(Align(8));
+  Ext->setSection(UnsafeTablesSection);
+  // The !exclude attachment is what turns the explicit section into
+  // SHF_EXCLUDE; with no IR references the global also needs a
+  // compiler.used entry to reach the object file at all.
+  Ext->setMetadata(LLVMContext::MD_exclude, MDNode::get(Ctx, {}));
+  appendToCompilerUsed(M, {Ext});
+  GV->eraseFromParent();
+}
+
+bool llvm::unsafeLazyRegistrationEnabled() { return UnsafeLazyRegistration; }
+
+GlobalVariable *llvm::createLazyRegistrationFlag(Module &M, StringRef Name) {
+  Type *Int8Ty = Type::getInt8Ty(M.getContext());
+  auto *Flag = new GlobalVariable(M, Int8Ty, /*isConstant=*/false,
+                                  GlobalValue::InternalLinkage,
+                                  ConstantInt::get(Int8Ty, 0), Name);
+  Flag->setAlignment(Align(1));
+  return Flag;
+}
+
+void llvm::makeLazyRegistration(Function *RegFn, GlobalVariable *Flag) {
+  LLVMContext &Ctx = RegFn->getContext();
+  Type *Int8Ty = Type::getInt8Ty(Ctx);
+  BasicBlock &Body = RegFn->getEntryBlock();
+  BasicBlock *Check = BasicBlock::Create(Ctx, "lazy_check", RegFn, &Body);
+  BasicBlock *Already = BasicBlock::Create(Ctx, "already", RegFn);
+  // The exchange claims the registration: exactly one of any racing first
+  // firings sees the old zero and runs the body; the rest return and go
+  // straight to their probe work.
+  IRBuilder<> Builder(Check);
+  Value *Old = Builder.CreateAtomicRMW(
+      AtomicRMWInst::Xchg, Flag, ConstantInt::get(Int8Ty, 1), MaybeAlign(1),
+      AtomicOrdering::AcquireRelease);
+  Builder.CreateCondBr(
+      Builder.CreateICmpNE(Old, ConstantInt::get(Int8Ty, 0)), Already, &Body);
+  IRBuilder<>(Already).CreateRetVoid();
+}
+
+void llvm::emitLazyRegistrationCheck(Instruction *InsertBefore,
+                                     Function *RegFn, GlobalVariable *Flag) {
+  LLVMContext &Ctx = InsertBefore->getContext();
+  Type *Int8Ty = Type::getInt8Ty(Ctx);
+  // Plain load on the fast path: a stale zero only repeats the call, which
+  // the once-guard in RegFn absorbs.
+  IRBuilder<> Builder(InsertBefore);
+  Value *Registered = Builder.CreateLoad(Int8Ty, Flag, "registered");
+  Value *NotYet =
+      Builder.CreateICmpEQ(Registered, ConstantInt::get(Int8Ty, 0));
+  Instruction *Then =
+      SplitBlockAndInsertIfThen(NotYet, InsertBefore, /*Unreachable=*/false,
+                                unsafeProbeBranchWeights(Ctx));
+  IRBuilder<>(Then).CreateCall(RegFn);
+}
+
+bool llvm::unsafeSectionLayoutEnabled() { return UnsafeSectionLayout; }
+
+void llvm::placeUnsafeInstrThunk(Function *F) {
+  if (!UnsafeSectionLayout)
+    return;
+  // One section per thunk, -ffunction-sections style, so ICF compares
+  // thunks individually instead of whole per-object concatenations. The
+  // thunks are only called or run from the init/fini arrays — nothing
+  // compares their addresses — so unnamed_addr is accurate; it keeps them
+  // out of .llvm_addrsig and therefore foldable under --icf=safe, not
+  // just --icf=all. ICF compares relocations too, so thunks registering
+  // different tables stay distinct and only true duplicates fold.
+  F->setSection((".text.unsafe_thunk." + F->getName()).str());
+  F->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+}
+
+void llvm::placeUnsafeTableGlobal(GlobalVariable *GV) {
+  // Externalized tables already carry .unsafe_tables, and TLS accumulators
+  // must stay in the TLS template sections.
+  if (!UnsafeSectionLayout || GV->hasSection() || GV->isThreadLocal())
+    return;
+  if (GV->isConstant()) {
+    // Constant tables duplicated across CGUs may fold along with their
+    // thunks, hence unnamed_addr here too.
+    GV->setSection((".rodata.unsafe_tables." + GV->getName()).str());
+    GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  } else {
+    // Mutable accumulators must stay distinct — the probes write them —
+    // so no unnamed_addr: grouping, not folding, is the goal here.
+    GV->setSection((".data.unsafe_accum." + GV->getName()).str());
+  }
+}
+
+void llvm::emitShmStatsHooks(Module &M) {
+  // One attach/publish pair per module, however many passes ask for it.
+  if (M.getFunction("unsafe_stats_shm_ctor"))
+    return;
+
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+
+  // __unsafe_stats_attach_shm(): maps (creating on first attach) the segment
+  // named by UNSAFE_STATS_SHM and points the runtime's accumulators into it.
+  FunctionCallee AttachFn =
+      M.getOrInsertFunction("__unsafe_stats_attach_shm", VoidTy);
+  Function *Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "unsafe_stats_shm_ctor", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Ctor);
+  IRBuilder<> Builder(BB);
+  Builder.CreateCall(AttachFn);
+  Builder.CreateRetVoid();
+  placeUnsafeInstrThunk(Ctor);
+  appendToGlobalCtors(M, Ctor, 0);
+
+  // __unsafe_stats_publish_shm(): folds this process's accumulators into the
+  // segment — atomic adds, no formatting — replacing every print destructor.
+  FunctionCallee PublishFn =
+      M.getOrInsertFunction("__unsafe_stats_publish_shm", VoidTy);
+  if (auto *F = dyn_cast<Function>(PublishFn.getCallee()))
+    appendToGlobalDtors(M, F, 0);
+}
+
+StringRef llvm::getUnsafeStatsOutputTemplate() {
+  return UnsafeStatsOutputTemplate;
+}
+
+void llvm::emitStatsOutputTemplateHook(Module &M) {
+  if (UnsafeStatsOutputTemplate.empty())
+    return;
+  // One registration per module, however many passes ask for it.
+  if (M.getFunction("unsafe_stats_output_template_ctor"))
+    return;
+
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int8PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+
+  // __unsafe_stats_set_output_template(template): stores the expansion
+  // pattern the dump paths open instead of their fixed CWD names. Repeat
+  // registrations with the same pattern are no-ops; disagreeing patterns
+  // keep the first.
+  FunctionCallee SetFn = M.getOrInsertFunction(
+      "__unsafe_stats_set_output_template",
+      FunctionType::get(VoidTy, {Int8PtrTy}, false));
+
+  Constant *Template =
+      ConstantDataArray::getString(Ctx, UnsafeStatsOutputTemplate);
+  auto *TemplateGV = new GlobalVariable(M, Template->getType(),
+                                        /*isConstant=*/true,
+                                        GlobalValue::PrivateLinkage, Template,
+                                        "__unsafe_stats_output_template");
+  Function *Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "unsafe_stats_output_template_ctor", &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Ctor);
+  IRBuilder<> Builder(BB);
+  Builder.CreateCall(SetFn, {Builder.CreateBitCast(TemplateGV, Int8PtrTy)});
+  Builder.CreateRetVoid();
+  placeUnsafeInstrThunk(Ctor);
+  appendToGlobalCtors(M, Ctor, 0);
+}
+
+bool llvm::unsafeSignalDumpEnabled() { return UnsafeStatsSignalDump; }
+
+void llvm::emitSignalDumpRegistration(Module &M, Function *DumpFn) {
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int8PtrTy = PointerType::getUnqual(Type::getInt8Ty(Ctx));
+
+  // __unsafe_stats_install_signal_dump(dump): chains dump onto the
+  // runtime's signal-dump list, installing the SIGUSR1 handler on the
+  // first registration. The handler itself only raises a request flag; a
+  // runtime thread takes wait-free sequence-counter-protected copies of
+  // the accumulator tables and runs the chained dumps against those, so a
+  // signal landing mid-update can neither deadlock nor tear the output.
+  FunctionCallee InstallFn = M.getOrInsertFunction(
+      "__unsafe_stats_install_signal_dump",
+      FunctionType::get(VoidTy, {Int8PtrTy}, false));
+
+  Function *Ctor = Function::Create(
+      FunctionType::get(VoidTy, false), GlobalValue::InternalLinkage,
+      (DumpFn->getName() + "_signal_ctor").str(), &M);
+  BasicBlock *BB = BasicBlock::Create(Ctx, "entry", Ctor);
+  IRBuilder<> Builder(BB);
+  Builder.CreateCall(InstallFn, {Builder.CreateBitCast(DumpFn, Int8PtrTy)});
+  Builder.CreateRetVoid();
+  placeUnsafeInstrThunk(Ctor);
+  appendToGlobalCtors(M, Ctor, 0);
+}
+
+bool llvm::hasUnsafeRegionMarkers(const Function &F) {
+  if (F.hasFnAttribute(UnsafeRegionMarkersAttr))
+    return true;
+
+  // Inlining can copy markers into a caller InstMarker never stamped, so a
+  // missing attribute is a hint, not an answer. Falling back to the begin
+  // intrinsic's user list keeps the check correct at a cost proportional to
+  // the module's marker count rather than the function's size — still far
+  // cheaper than the per-instruction metadata walk this replaces.
+  const Module *M = F.getParent();
+  if (const Function *Begin =
+          M->getFunction(Intrinsic::getName(Intrinsic::unsafe_region_begin)))
+    for (const User *U : Begin->users())
+      if (const auto *CB = dyn_cast<CallBase>(U))
+        if (CB->getFunction() == &F)
+          return true;
+  return false;
+}
+
+unsigned llvm::unsafeRegionCountHint(const Function &F) {
+  Attribute A = F.getFnAttribute(UnsafeRegionMarkersAttr);
+  unsigned Count;
+  if (A.isStringAttribute() && !A.getValueAsString().getAsInteger(10, Count))
+    return Count;
+  // Absent or bare attribute (other passes stamp it without a value).
+  return 0;
+}
+
+bool llvm::unsafeDormantProbesEnabled() { return UnsafeDormantProbes; }
+
+bool llvm::unsafeRegionCorrelateEnabled() { return UnsafeRegionCorrelate; }
+
+uint32_t llvm::unsafeRegionKey(const Function &F, unsigned RegionIdx) {
+  uint64_t Hash = 1469598103934665603ULL;
+  for (char C : F.getName())
+    Hash = (Hash ^ static_cast<uint8_t>(C)) * 1099511628211ULL;
+  Hash = (Hash ^ RegionIdx) * 1099511628211ULL;
+  Hash ^= Hash >> 32;
+  uint32_t Key = static_cast<uint32_t>(Hash);
+  return Key ? Key : 1;
+}
+
+bool llvm::unsafeInstrIncrementalEnabled() {
+  return !UnsafeInstrIncrementalDir.empty();
+}
+
+// Corpus extraction reuses the checkpoint dump wholesale — the checkpoint
+// already is the post-optimization, pre-probe module — so the directory
+// resolves from the flag first and the environment second.
+static StringRef unsafeInstrCorpusDir() {
+  static const char *Dir = getenv("UNSAFE_INSTR_CORPUS_DIR");
+  return Dir ? StringRef(Dir) : StringRef();
+}
+
+bool llvm::unsafeInstrCorpusModeEnabled() {
+  return !unsafeInstrCorpusDir().empty();
+}
+
+StringRef llvm::getUnsafeInstrCheckpointDir() {
+  if (!UnsafeInstrCheckpointDir.empty())
+    return UnsafeInstrCheckpointDir;
+  return unsafeInstrCorpusDir();
+}
+
+bool llvm::unsafeInstrCheckpointResumeEnabled() {
+  return UnsafeInstrCheckpointResume;
+}
+
+std::string llvm::unsafeInstrCheckpointPath(const Module &M) {
+  StringRef Dir = getUnsafeInstrCheckpointDir();
+  if (Dir.empty())
+    return std::string();
+
+  // Same sanitization as the report sidecars, so the resume side can
+  // recompute the name from the module identifier alone.
+  SmallString<128> FileName(sys::path::filename(M.getModuleIdentifier()));
+  for (char &C : FileName)
+    if (!isAlnum(C) && C != '.' && C != '-' && C != '_')
+      C = '_';
+
+  SmallString<256> Path(Dir);
+  sys::path::append(Path, FileName + ".instr_ckpt.bc");
+  return std::string(Path);
+}
+
+uint64_t llvm::unsafeInstrFunctionHash(const Function &F) {
+  uint64_t Hash = StructuralHash(F, /*DetailedHash=*/true);
+  return Hash ? Hash : 1;
+}
+
+bool llvm::getRecordedUnsafeInstrHash(const Function &F,
+                                      uint64_t &ContentHash,
+                                      uint64_t &Fingerprint) {
+  MDNode *N = F.getMetadata(UnsafeInstrHashMD);
+  if (!N || N->getNumOperands() != 2)
+    return false;
+  auto *Content = mdconst::dyn_extract<ConstantInt>(N->getOperand(0));
+  auto *Config = mdconst::dyn_extract<ConstantInt>(N->getOperand(1));
+  if (!Content || !Config)
+    return false;
+  ContentHash = Content->getZExtValue();
+  Fingerprint = Config->getZExtValue();
+  return true;
+}
+
+void llvm::recordUnsafeInstrHash(Function &F, uint64_t ContentHash) {
+  LLVMContext &Ctx = F.getContext();
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Metadata *Ops[] = {
+      ConstantAsMetadata::get(ConstantInt::get(Int64Ty, ContentHash)),
+      ConstantAsMetadata::get(ConstantInt::get(
+          Int64Ty, getUnsafeInstrPipelineFingerprint()))};
+  F.setMetadata(UnsafeInstrHashMD, MDNode::get(Ctx, Ops));
+}
+
+bool llvm::unsafeProbePreserveMostEnabled() {
+  return UnsafeProbePreserveMost;
+}
+
+void llvm::setUnsafeProbeCallConv(CallInst *CI) {
+  if (!UnsafeProbePreserveMost)
+    return;
+  CI->setCallingConv(CallingConv::PreserveMost);
+  // The convention must match between every call site and the
+  // declaration; callers apply this helper to all sites of a converted
+  // hook, so stamping the callee here keeps the two in lockstep.
+  if (Function *Callee = CI->getCalledFunction())
+    Callee->setCallingConv(CallingConv::PreserveMost);
+}
+
+bool llvm::unsafeProbeAuditEnabled() { return UnsafeProbeAudit; }
+
+void llvm::attachProbeId(Instruction *I, StringRef Family, unsigned Id) {
+  if (!UnsafeProbeAudit)
+    return;
+  LLVMContext &Ctx = I->getContext();
+  I->setMetadata(
+      "unsafe_probe_id",
+      MDNode::get(Ctx, {MDString::get(Ctx, Family),
+                        ConstantAsMetadata::get(ConstantInt::get(
+                            Type::getInt32Ty(Ctx), Id))}));
+}
+
+unsigned llvm::unsafeProbeFamilyBit(StringRef Family) {
+  return StringSwitch<unsigned>(Family)
+      .Case("cycle", 0)
+      .Case("heap", 1)
+      .Case("counter", 2)
+      .Case("lines", 3)
+      .Case("func", 4)
+      .Default(7); // Unknown families share a spare bit; adding a family
+                   // means adding a case here and in the runtime.
+}
+
+/// \brief Get (creating on first use) the runtime-owned config block: a
+/// cache line of read-only-after-startup state, word 0 holding the family
+/// enable bits at the unsafeProbeFamilyBit positions.
+static GlobalVariable *getOrCreateUnsafeConfigGlobal(Module &M) {
+  if (GlobalVariable *GV = M.getGlobalVariable(UnsafeConfigGlobalName))
+    return GV;
+  ArrayType *BlockTy = ArrayType::get(Type::getInt64Ty(M.getContext()), 8);
+  auto *GV = new GlobalVariable(M, BlockTy, /*isConstant=*/false,
+                                GlobalValue::ExternalLinkage,
+                                /*Initializer=*/nullptr,
+                                UnsafeConfigGlobalName);
+  GV->setAlignment(Align(64));
+  return GV;
+}
+
+/// \brief The config block's enable word, loaded once per function.
 ///
-/// This uses the CARGO_PRIMARY_PACKAGE environment variable.
-bool isPrimaryPackageImpl() {
-  const char *P = getenv("CARGO_PRIMARY_PACKAGE");
-  return P && strcmp(P, "1") == 0;
+/// The load sits at the entry block's first insertion point so it
+/// dominates every probe; repeat requests find and reuse it by scanning
+/// the entry block for a load of the config global, which keeps this
+/// helper stateless across the pass objects that share it.
+static Value *getUnsafeConfigWord(Function &F) {
+  Module &M = *F.getParent();
+  GlobalVariable *Config = getOrCreateUnsafeConfigGlobal(M);
+  LLVMContext &Ctx = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Constant *Zero = ConstantInt::get(Int64Ty, 0);
+  Constant *WordPtr = ConstantExpr::getInBoundsGetElementPtr(
+      Config->getValueType(), Config, ArrayRef<Constant *>({Zero, Zero}));
+
+  BasicBlock &Entry = F.getEntryBlock();
+  for (Instruction &I : Entry)
+    if (auto *LI = dyn_cast<LoadInst>(&I))
+      if (LI->getPointerOperand() == WordPtr)
+        return LI;
+
+  IRBuilder<> Builder(&*Entry.getFirstInsertionPt());
+  return Builder.CreateLoad(Int64Ty, WordPtr, "unsafe.config");
+}
+
+/// \brief The "is \p Family enabled" test: a shift-and-mask of the
+/// per-function config word under -unsafe-config-block, otherwise a load
+/// of the runtime-owned per-family enable byte.
+static Value *emitProbeEnableTest(IRBuilder<> &Builder, Module &M,
+                                  StringRef Family) {
+  if (UnsafeConfigBlock) {
+    Function &F = *Builder.GetInsertBlock()->getParent();
+    Value *Word = getUnsafeConfigWord(F);
+    Type *Int64Ty = Type::getInt64Ty(M.getContext());
+    Value *Bit = Builder.CreateAnd(
+        Word,
+        ConstantInt::get(Int64Ty, 1ULL << unsafeProbeFamilyBit(Family)));
+    return Builder.CreateICmpNE(Bit, ConstantInt::get(Int64Ty, 0));
+  }
+
+  SmallString<40> Name("__unsafe_probe_enable_");
+  Name += Family;
+  GlobalVariable *GV = M.getGlobalVariable(Name);
+  if (!GV)
+    GV = new GlobalVariable(M, Type::getInt8Ty(M.getContext()),
+                            /*isConstant=*/false,
+                            GlobalValue::ExternalLinkage,
+                            /*Initializer=*/nullptr, Name);
+  Value *Flag = Builder.CreateLoad(Type::getInt8Ty(M.getContext()), GV);
+  return Builder.CreateICmpNE(Flag,
+                              ConstantInt::get(Type::getInt8Ty(M.getContext()), 0));
+}
+
+/// \brief Shared body of emitSampleDecision and emitHotSampleDecision:
+/// one countdown-and-test at 1/\p Rate against the per-thread global named
+/// \p CountdownName.
+static Value *emitSampleDecisionImpl(Instruction *InsertBefore,
+                                     StringRef Family, unsigned Rate,
+                                     StringRef CountdownName) {
+  // Rate 0 statically disables sampled probes outright: every decision
+  // folds to constant false, the gates branch over their probe arms
+  // unconditionally, and UnsafeProbeCleanupPass deletes the dead arms so a
+  // disabled build carries no skeleton at all.
+  if (Rate == 0)
+    return ConstantInt::getFalse(InsertBefore->getContext());
+
+  bool Sampling = Rate > 1;
+  if (!Sampling && !UnsafeDormantProbes)
+    return nullptr;
+
+  Module &M = *InsertBefore->getFunction()->getParent();
+  IRBuilder<> Builder(InsertBefore);
+
+  Value *Take = nullptr;
+  if (Sampling) {
+    GlobalVariable *Countdown = getOrCreateSampleCountdown(M, CountdownName);
+    Type *Int32Ty = Type::getInt32Ty(M.getContext());
+    Value *Count = Builder.CreateLoad(Int32Ty, Countdown);
+    Take = Builder.CreateICmpEQ(Count, ConstantInt::get(Int32Ty, 0));
+    // Reset to N-1 when the sample is taken, otherwise keep counting down.
+    Value *Next = Builder.CreateSelect(
+        Take, ConstantInt::get(Int32Ty, Rate - 1),
+        Builder.CreateSub(Count, ConstantInt::get(Int32Ty, 1)));
+    Builder.CreateStore(Next, Countdown);
+  }
+
+  // A dormant probe fires only when the runtime enabled its family.
+  if (UnsafeDormantProbes) {
+    Value *Enabled = emitProbeEnableTest(Builder, M, Family);
+    Take = Take ? Builder.CreateAnd(Take, Enabled) : Enabled;
+  }
+  return Take;
+}
+
+Value *llvm::emitSampleDecision(Instruction *InsertBefore, StringRef Family) {
+  return emitSampleDecisionImpl(InsertBefore, Family, UnsafeInstrSampleRate,
+                                SAMPLE_COUNTDOWN_NAME);
+}
+
+Value *llvm::emitHotSampleDecision(Instruction *InsertBefore,
+                                   StringRef Family) {
+  // A demotion must never sample more often than the run-wide knob asks
+  // for, so the effective hot rate is the larger of the two — except that
+  // rate 0 disables demoted probes too; a statically disabled build must
+  // not keep exactly its hottest regions probing.
+  unsigned Rate = UnsafeInstrSampleRate == 0
+                      ? 0
+                      : std::max(UnsafeInstrHotSampleRate.getValue(),
+                                 UnsafeInstrSampleRate.getValue());
+  return emitSampleDecisionImpl(InsertBefore, Family, Rate,
+                                HOT_SAMPLE_COUNTDOWN_NAME);
+}
+
+MDNode *llvm::unsafeProbeBranchWeights(LLVMContext &Ctx, bool ProbeArmIsTrue) {
+  MDBuilder MDB(Ctx);
+  return ProbeArmIsTrue ? MDB.createBranchWeights(1, 100000)
+                        : MDB.createBranchWeights(100000, 1);
 }
 
-/// \brief Inserts begin/end markers around sequences of unsafe instructions.
+Instruction *llvm::emitSampleGate(Instruction *InsertBefore,
+                                  StringRef Family) {
+  Value *Take = emitSampleDecision(InsertBefore, Family);
+  if (!Take)
+    return InsertBefore;
+  return SplitBlockAndInsertIfThen(
+      Take, InsertBefore, /*Unreachable=*/false,
+      unsafeProbeBranchWeights(InsertBefore->getContext()));
+}
+
+Instruction *llvm::emitHotSampleGate(Instruction *InsertBefore,
+                                     StringRef Family) {
+  Value *Take = emitHotSampleDecision(InsertBefore, Family);
+  if (!Take)
+    return InsertBefore;
+  return SplitBlockAndInsertIfThen(
+      Take, InsertBefore, /*Unreachable=*/false,
+      unsafeProbeBranchWeights(InsertBefore->getContext()));
+}
+
+/// \brief Prior-run hotness counts keyed by function ID (high 32 bits) and
+/// region index (low 32 bits), or null when no profile is in effect.
+///
+/// The profile cannot change during a compilation, so read it once per
+/// process. An unreadable file disables demotion rather than silently
+/// changing which regions are fully instrumented; malformed rows are
+/// skipped so a truncated final line does not discard a whole profile.
+static const DenseMap<uint64_t, uint64_t> *priorProfileCounts() {
+  static const DenseMap<uint64_t, uint64_t> *Counts =
+      []() -> const DenseMap<uint64_t, uint64_t> * {
+    if (UnsafeInstrPriorProfile.empty())
+      return nullptr;
+    auto BufOrErr = MemoryBuffer::getFile(UnsafeInstrPriorProfile);
+    if (!BufOrErr) {
+      errs() << "warning: cannot read -unsafe-instr-prior-profile file "
+             << UnsafeInstrPriorProfile << ": "
+             << BufOrErr.getError().message()
+             << "; keeping full instrumentation everywhere\n";
+      return nullptr;
+    }
+    auto *Map = new DenseMap<uint64_t, uint64_t>();
+    for (line_iterator LI(**BufOrErr, /*SkipBlanks=*/true, '#');
+         !LI.is_at_end(); ++LI) {
+      SmallVector<StringRef, 3> Cols;
+      LI->trim().split(Cols, '\t');
+      uint64_t FuncId, RegionIdx, Count;
+      if (Cols.size() != 3 || Cols[0].getAsInteger(10, FuncId) ||
+          Cols[1].getAsInteger(10, RegionIdx) ||
+          Cols[2].getAsInteger(10, Count) || FuncId > UINT32_MAX ||
+          RegionIdx > UINT32_MAX)
+        continue;
+      // Repeated keys (merged profiles) accumulate.
+      (*Map)[(FuncId << 32) | RegionIdx] += Count;
+    }
+    return Map;
+  }();
+  return Counts;
+}
+
+/// \brief Executed (file, line) pairs from -unsafe-instr-exclude-profile,
+/// keyed "file\tline", or null when no profile is in effect.
+///
+/// Same once-per-process discipline as priorProfileCounts: an unreadable
+/// file keeps full instrumentation with a warning, malformed rows are
+/// skipped. Rows are matched by their "line" tag, so the file can be a
+/// whole stats dump (or an llvm-unsafe-stats merge) with other sections
+/// interleaved.
+static const StringSet<> *exclusionProfileLines() {
+  static const StringSet<> *Lines = []() -> const StringSet<> * {
+    if (UnsafeInstrExcludeProfile.empty())
+      return nullptr;
+    auto BufOrErr = MemoryBuffer::getFile(UnsafeInstrExcludeProfile);
+    if (!BufOrErr) {
+      errs() << "warning: cannot read -unsafe-instr-exclude-profile file "
+             << UnsafeInstrExcludeProfile << ": "
+             << BufOrErr.getError().message()
+             << "; keeping full instrumentation everywhere\n";
+      return nullptr;
+    }
+    auto *Set = new StringSet<>();
+    for (line_iterator LI(**BufOrErr, /*SkipBlanks=*/true, '#');
+         !LI.is_at_end(); ++LI) {
+      SmallVector<StringRef, 4> Cols;
+      LI->trim().split(Cols, '\t');
+      uint64_t LineNo, Count;
+      if (Cols.size() != 4 || Cols[0] != "line" ||
+          Cols[2].getAsInteger(10, LineNo) ||
+          Cols[3].getAsInteger(10, Count) || Count == 0)
+        continue;
+      // Re-render the line number so the key matches the lookup side
+      // byte-for-byte regardless of how the row spelled it.
+      SmallString<256> Key(Cols[1]);
+      Key += '\t';
+      Key += utostr(LineNo);
+      Set->insert(Key);
+    }
+    return Set;
+  }();
+  return Lines;
+}
+
+/// \brief Strips unsafe_inst metadata from instructions whose source line
+/// the exclusion profile proves never executed.
+///
+/// Runs before line capture and marker insertion, so both marking
+/// strategies, the line tables and every downstream region analysis see
+/// the same pruned set. An instruction without a usable debug location
+/// keeps its marking: coverage can only speak about lines it tracked.
+static void applyExclusionProfile(Function &F) {
+  const StringSet<> *Lines = exclusionProfileLines();
+  if (!Lines)
+    return;
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB) {
+      if (!I.getMetadata(LLVMContext::MD_unsafe_inst))
+        continue;
+      const DILocation *Loc = I.getDebugLoc();
+      if (!Loc || Loc->getLine() == 0 || Loc->getFilename().empty())
+        continue;
+      SmallString<256> Key(Loc->getFilename());
+      Key += '\t';
+      Key += utostr(Loc->getLine());
+      if (!Lines->contains(Key)) {
+        I.setMetadata(LLVMContext::MD_unsafe_inst, nullptr);
+        ++NumUnsafeInstsExcluded;
+      }
+    }
+}
+
+bool llvm::priorProfileDemotesRegion(const Function &F, unsigned RegionIdx) {
+  const DenseMap<uint64_t, uint64_t> *Counts = priorProfileCounts();
+  if (!Counts)
+    return false;
+  // Key by the ID UnsafeFunctionTrackerPass attached; an untracked function
+  // cannot match the profile and keeps full instrumentation.
+  MDNode *MD =
+      F.getMetadata(UnsafeFunctionTrackerPass::FUNCTION_ID_METADATA);
+  if (!MD)
+    return false;
+  uint64_t FuncId =
+      cast<ConstantInt>(cast<ConstantAsMetadata>(MD->getOperand(0))->getValue())
+          ->getZExtValue();
+  auto It = Counts->find((FuncId << 32) | RegionIdx);
+  return It != Counts->end() && It->second >= UnsafeInstrHotThreshold;
+}
+
+Instruction *llvm::emitProbeFamilyGate(Instruction *InsertBefore,
+                                       StringRef Family) {
+  if (!UnsafeDormantProbes)
+    return InsertBefore;
+  Module &M = *InsertBefore->getFunction()->getParent();
+  IRBuilder<> Builder(InsertBefore);
+  Value *Enabled = emitProbeEnableTest(Builder, M, Family);
+  return SplitBlockAndInsertIfThen(
+      Enabled, InsertBefore, /*Unreachable=*/false,
+      unsafeProbeBranchWeights(InsertBefore->getContext()));
+}
+
+namespace {
+
+/// \brief Lexical nesting facts for one unsafe instruction: how many
+/// lexical blocks deep it sits inside its subprogram, plus stable keys
+/// for its innermost lexical block and that block's enclosing scope.
+struct UnsafeLexicalNesting {
+  uint32_t Depth = 0;
+  uint32_t ScopeKey = 0;
+  uint32_t ParentKey = 0;
+};
+
+/// \brief Stable 32-bit key for a lexical scope chain.
+///
+/// FNV-1a over the owning subprogram's linkage name and the line/column
+/// of every lexical block from the subprogram down to \p Scope. Hashing
+/// source coordinates rather than MDNode identity keeps the key equal
+/// across compilations and recomputable from debug info offline. Never
+/// returns 0, so 0 can mean "no scope" (mirrors unsafeRegionKey).
+static uint32_t lexicalScopeKey(const DIScope *Scope) {
+  SmallVector<const DIScope *, 8> Chain;
+  for (const DIScope *S = Scope; S; S = S->getScope()) {
+    Chain.push_back(S);
+    if (isa<DISubprogram>(S))
+      break;
+  }
+  uint64_t Hash = 0xcbf29ce484222325ULL;
+  auto Mix = [&Hash](uint64_t V) { Hash = (Hash ^ V) * 0x100000001b3ULL; };
+  for (const DIScope *S : reverse(Chain)) {
+    if (const auto *SP = dyn_cast<DISubprogram>(S)) {
+      StringRef Name =
+          SP->getLinkageName().empty() ? SP->getName() : SP->getLinkageName();
+      for (char C : Name)
+        Mix(static_cast<uint8_t>(C));
+    } else if (const auto *LB = dyn_cast<DILexicalBlock>(S)) {
+      Mix(LB->getLine());
+      Mix(LB->getColumn());
+    }
+  }
+  uint32_t Key = static_cast<uint32_t>(Hash ^ (Hash >> 32));
+  return Key ? Key : 1;
+}
+
+/// \brief Read \p I's lexical nesting from its debug location.
+///
+/// Depth counts DILexicalBlock nodes between the location's scope and
+/// its subprogram; the pass runs pre-inlining, so inlinedAt chains never
+/// occur here. An instruction without a location reports ScopeKey 0 and
+/// is skipped by the caller.
+static UnsafeLexicalNesting lexicalNesting(const Instruction &I) {
+  UnsafeLexicalNesting N;
+  const DILocation *Loc = I.getDebugLoc();
+  if (!Loc || !Loc->getScope())
+    return N;
+  const DILexicalBlock *Innermost = nullptr;
+  for (const DIScope *S = Loc->getScope(); S && !isa<DISubprogram>(S);
+       S = S->getScope()) {
+    if (const auto *LB = dyn_cast<DILexicalBlock>(S)) {
+      if (!Innermost)
+        Innermost = LB;
+      ++N.Depth;
+    }
+  }
+  if (Innermost) {
+    N.ScopeKey = lexicalScopeKey(Innermost);
+    N.ParentKey = N.Depth > 1 ? lexicalScopeKey(Innermost->getScope()) : 0;
+  } else if (const DISubprogram *SP = Loc->getScope()->getSubprogram()) {
+    N.ScopeKey = lexicalScopeKey(SP);
+  }
+  return N;
+}
+
+/// \brief Bracket one block's unsafe sequence with a begin/end pair.
+/// \returns The begin marker call, so callers can annotate it.
+Instruction *emitBlockLocalPair(Function *MarkerBegin, Function *MarkerEnd,
+                                Instruction *FirstUnsafeInst,
+                                Instruction *LastUnsafeInst) {
+  ++NumUnsafeRegionsMarked;
+  IRBuilder<> Builder(FirstUnsafeInst);
+  Instruction *Begin = Builder.CreateCall(MarkerBegin);
+
+  if (Instruction *NextInst = LastUnsafeInst->getNextNode()) {
+    IRBuilder<> EndBuilder(NextInst);
+    EndBuilder.CreateCall(MarkerEnd);
+  } else {
+    // If the last unsafe instruction is the terminator, insert before it.
+    IRBuilder<> EndBuilder(LastUnsafeInst->getParent()->getTerminator());
+    EndBuilder.CreateCall(MarkerEnd);
+  }
+
+  if (InstMarkerRegionDepth) {
+    // The region flattens whatever nesting its instructions came from;
+    // record the deepest instruction's scope so a region produced by an
+    // inner unsafe block stays distinguishable from its enclosing one
+    // when the blocks split across basic blocks.
+    UnsafeLexicalNesting Deepest;
+    for (Instruction *I = Begin->getNextNode();; I = I->getNextNode()) {
+      if (I->getMetadata(LLVMContext::MD_unsafe_inst)) {
+        UnsafeLexicalNesting N = lexicalNesting(*I);
+        if (N.ScopeKey && (!Deepest.ScopeKey || N.Depth > Deepest.Depth))
+          Deepest = N;
+      }
+      if (I == LastUnsafeInst)
+        break;
+    }
+    if (Deepest.ScopeKey) {
+      LLVMContext &Ctx = Begin->getContext();
+      Type *Int32Ty = Type::getInt32Ty(Ctx);
+      Metadata *Ops[] = {
+          ConstantAsMetadata::get(ConstantInt::get(Int32Ty, Deepest.Depth)),
+          ConstantAsMetadata::get(ConstantInt::get(Int32Ty, Deepest.ScopeKey)),
+          ConstantAsMetadata::get(
+              ConstantInt::get(Int32Ty, Deepest.ParentKey))};
+      Begin->setMetadata(UnsafeRegionNestingMD, MDNode::get(Ctx, Ops));
+    }
+  }
+  return Begin;
+}
+
+/// \brief Inserts begin/end markers around runs of unsafe instructions.
 ///
 /// This function iterates through each basic block to find instructions that
-/// have been tagged with "unsafe_inst" metadata. It then inserts a
-/// `UNSAFE_MARKER_BEGIN` before the first unsafe instruction and an
-/// `UNSAFE_MARKER_END` after the last one in each contiguous sequence
-/// within a basic block.
+/// have been tagged with "unsafe_inst" metadata and brackets each run with a
+/// call to llvm.unsafe.region.begin before its first instruction and a call
+/// to llvm.unsafe.region.end after its last. Runs separated by at most
+/// -instmarker-coalesce-gap safe instructions share one pair (by default the
+/// gap is unbounded, i.e. one pair per block); a begin marker whose region
+/// swallowed safe instructions records how many as unsafe_coalesced_safe
+/// metadata, so instruction accounting can subtract them.
 ///
 /// \param F The target function to instrument.
-/// \returns True if the function was modified, false otherwise.
-bool insertUnsafeMarkers(Function &F) {
-  bool Modified = false;
-  Type *VoidTy = Type::getVoidTy(F.getContext());
-  InlineAsm *AsmMarkerBegin =
-      InlineAsm::get(FunctionType::get(VoidTy, false), UNSAFE_MARKER_BEGIN,
-                     /* Constraints */ "", /* HasSideEffects */ true);
-  InlineAsm *AsmMarkerEnd =
-      InlineAsm::get(FunctionType::get(VoidTy, false), UNSAFE_MARKER_END,
-                     /* Constraints */ "", /* HasSideEffects */ true);
+/// \param MarkerBegin The module's llvm.unsafe.region.begin declaration.
+/// \param MarkerEnd The module's llvm.unsafe.region.end declaration.
+/// \returns The number of region pairs emitted; zero means unmodified.
+unsigned insertUnsafeMarkers(Function &F, Function *MarkerBegin,
+                             Function *MarkerEnd) {
+  unsigned NumPairs = 0;
+  LLVMContext &Ctx = F.getContext();
 
   for (BasicBlock &BB : F) {
-    Instruction *FirstUnsafeInst = nullptr;
-    Instruction *LastUnsafeInst = nullptr;
+    SmallVector<Instruction *, 8> UnsafeInsts;
+    for (Instruction &I : BB)
+      if (I.getMetadata(LLVMContext::MD_unsafe_inst))
+        UnsafeInsts.push_back(&I);
+    if (UnsafeInsts.empty())
+      continue;
 
-    // Find the first and last unsafe instructions in the basic block.
-    for (Instruction &I : BB) {
-      if (I.getMetadata("unsafe_inst")) {
-        if (!FirstUnsafeInst) {
-          FirstUnsafeInst = &I;
-        }
-        LastUnsafeInst = &I;
+    Instruction *RunFirst = UnsafeInsts.front();
+    Instruction *RunLast = UnsafeInsts.front();
+    unsigned RunSafeCount = 0;
+    auto FlushRun = [&]() {
+      Instruction *Begin =
+          emitBlockLocalPair(MarkerBegin, MarkerEnd, RunFirst, RunLast);
+      if (RunSafeCount > 0) {
+        Begin->setMetadata(
+            "unsafe_coalesced_safe",
+            MDNode::get(Ctx, ConstantAsMetadata::get(ConstantInt::get(
+                                 Type::getInt32Ty(Ctx), RunSafeCount))));
+        NumSafeInstsCoalesced += RunSafeCount;
       }
-    }
+      ++NumPairs;
+    };
 
-    // If a sequence was found, insert the markers.
-    if (FirstUnsafeInst && LastUnsafeInst) {
-      // Insert the begin marker before the first unsafe instruction.
-      IRBuilder<> Builder(FirstUnsafeInst);
-      Builder.CreateCall(AsmMarkerBegin);
-      Modified = true;
+    for (Instruction *I : drop_begin(UnsafeInsts)) {
+      // Safe-instruction distance to the previous run; each instruction of
+      // the block is walked at most once across all gaps.
+      unsigned Gap = 0;
+      for (Instruction *Cur = RunLast->getNextNode(); Cur != I;
+           Cur = Cur->getNextNode())
+        ++Gap;
 
-      // Insert the end marker after the last unsafe instruction.
-      if (Instruction *NextInst = LastUnsafeInst->getNextNode()) {
-        IRBuilder<> EndBuilder(NextInst);
-        EndBuilder.CreateCall(AsmMarkerEnd);
+      if (Gap <= InstMarkerCoalesceGap) {
+        if (Gap > 0)
+          ++NumUnsafeRunsCoalesced;
+        RunSafeCount += Gap;
+        RunLast = I;
       } else {
-        // If the last unsafe instruction is the terminator, insert before it.
-        IRBuilder<> EndBuilder(BB.getTerminator());
-        EndBuilder.CreateCall(AsmMarkerEnd);
+        FlushRun();
+        RunFirst = RunLast = I;
+        RunSafeCount = 0;
       }
     }
+    FlushRun();
   }
 
-  return Modified;
+  return NumPairs;
 }
 
-} // anonymous namespace
+/// \brief Place one begin/end pair per maximal single-entry unsafe region.
+///
+/// Unsafe blocks are grouped under the first block (in reverse post-order)
+/// that dominates them, and the group is closed at the members' nearest
+/// common post-dominator. A group is only merged when that exit is itself
+/// dominated by the entry and everything sits in the same innermost loop:
+/// under those conditions every execution of the exit is preceded by exactly
+/// one execution of the entry, so the single pair stays dynamically balanced
+/// even around back edges. Anything that fails the shape test keeps the
+/// per-block pair, so the result is never worse than insertUnsafeMarkers.
+///
+/// Note the semantic widening: safe instructions on paths between entry and
+/// exit land inside the region, matching the source-level unsafe block they
+/// came from.
+unsigned insertCrossBlockMarkers(Function &F, DominatorTree &DT,
+                                 PostDominatorTree &PDT, LoopInfo &LI,
+                                 Function *MarkerBegin, Function *MarkerEnd) {
+  // First and last unsafe instruction of every block that has any.
+  SmallDenseMap<BasicBlock *, std::pair<Instruction *, Instruction *>, 16>
+      Bounds;
+  for (BasicBlock &BB : F) {
+    Instruction *First = nullptr, *Last = nullptr;
+    for (Instruction &I : BB)
+      if (I.getMetadata(LLVMContext::MD_unsafe_inst)) {
+        if (!First)
+          First = &I;
+        Last = &I;
+      }
+    if (First)
+      Bounds[&BB] = {First, Last};
+  }
+  if (Bounds.empty())
+    return 0;
+  unsigned NumPairs = 0;
+
+  // Reverse post-order so a region's entry is considered before the blocks
+  // it dominates.
+  SmallVector<BasicBlock *, 16> Order;
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  for (BasicBlock *BB : RPOT)
+    if (Bounds.count(BB))
+      Order.push_back(BB);
+
+  SmallPtrSet<BasicBlock *, 16> Assigned;
+  // Blocks already holding a region's end marker: a second end in the same
+  // block would run unmatched on the sibling's path.
+  SmallPtrSet<BasicBlock *, 8> UsedExits;
+
+  for (BasicBlock *E : Order) {
+    if (Assigned.count(E))
+      continue;
+
+    Loop *L = LI.getLoopFor(E);
+    SmallVector<BasicBlock *, 8> Members;
+    for (BasicBlock *B : Order)
+      if (!Assigned.count(B) && LI.getLoopFor(B) == L && DT.dominates(E, B))
+        Members.push_back(B);
+
+    BasicBlock *Exit = E;
+    for (BasicBlock *B : Members) {
+      Exit = PDT.findNearestCommonDominator(Exit, B);
+      if (!Exit)
+        break;
+    }
+
+    // The exit must share the entry's shape guarantees, and must not carry
+    // unsafe instructions of its own unless it is part of this group —
+    // otherwise this region's end would interleave with the exit's own pair.
+    bool ExitIsMember = Exit && llvm::is_contained(Members, Exit);
+    bool CanMerge = Members.size() > 1 && Exit && DT.dominates(E, Exit) &&
+                    LI.getLoopFor(Exit) == L && !UsedExits.count(Exit) &&
+                    (ExitIsMember || !Bounds.count(Exit));
+
+    if (!CanMerge) {
+      auto &B = Bounds[E];
+      emitBlockLocalPair(MarkerBegin, MarkerEnd, B.first, B.second);
+      ++NumPairs;
+      Assigned.insert(E);
+      continue;
+    }
+
+    ++NumUnsafeRegionsMarked;
+    ++NumPairs;
+    IRBuilder<> Builder(Bounds[E].first);
+    Builder.CreateCall(MarkerBegin);
+
+    if (ExitIsMember) {
+      Instruction *LastUnsafe = Bounds[Exit].second;
+      Instruction *EndPt = LastUnsafe->getNextNode()
+                               ? LastUnsafe->getNextNode()
+                               : Exit->getTerminator();
+      IRBuilder<> EndBuilder(EndPt);
+      EndBuilder.CreateCall(MarkerEnd);
+    } else {
+      IRBuilder<> EndBuilder(&*Exit->getFirstInsertionPt());
+      EndBuilder.CreateCall(MarkerEnd);
+    }
+
+    UsedExits.insert(Exit);
+    for (BasicBlock *B : Members)
+      Assigned.insert(B);
+  }
+
+  // Unreachable unsafe blocks never show up in the traversal; keep their
+  // block-local pairs.
+  for (auto &Entry : Bounds)
+    if (!Assigned.count(Entry.first)) {
+      emitBlockLocalPair(MarkerBegin, MarkerEnd, Entry.second.first,
+                         Entry.second.second);
+      ++NumPairs;
+    }
+
+  return NumPairs;
+}
 
-// These constants are defined in the header for other passes to use.
-// We provide their definitions here.
-const char *llvm::UNSAFE_MARKER_BEGIN = "nop # marker_begin";
-const char *llvm::UNSAFE_MARKER_END = "nop # marker_end";
+} // anonymous namespace
 
 /// \brief Checks if the current build is for the primary package.
 /// \returns True if this is the primary package build, false otherwise.
 bool InstMarkerPass::isPrimaryPackage() {
-  return isPrimaryPackageImpl();
+  return isUnsafePrimaryPackage();
+}
+
+/// \brief Interns \p File into the module's unsafe.files table and returns
+/// its index. Each table operand wraps a single MDString; the operand
+/// position is the index.
+/// \param M The module owning the table.
+/// \param File The source file name to intern.
+static unsigned internUnsafeFile(Module &M, StringRef File) {
+  // The table usually holds a handful of entries (most crates compile from
+  // one or two source files per CGU), so a linear scan of the existing
+  // operands beats keeping a side map alive across pass runs.
+  NamedMDNode *Files = M.getOrInsertNamedMetadata(UnsafeLineFileTableMD);
+  for (unsigned Idx = 0, E = Files->getNumOperands(); Idx != E; ++Idx) {
+    const MDNode *Entry = Files->getOperand(Idx);
+    if (Entry->getNumOperands() == 1)
+      if (const auto *S = dyn_cast<MDString>(Entry->getOperand(0)))
+        if (S->getString() == File)
+          return Idx;
+  }
+  LLVMContext &Ctx = M.getContext();
+  Files->addOperand(MDNode::get(Ctx, {MDString::get(Ctx, File)}));
+  return Files->getNumOperands() - 1;
 }
 
 /// \brief Captures unsafe line information from debug metadata.
 /// \param F The target function to process.
 void InstMarkerPass::captureUnsafeLineInfo(Function &F) {
+  Module &M = *F.getParent();
+  // Cache the previous instruction's resolution: unsafe instructions come
+  // in region-sized runs from the same file, so this skips the table scan
+  // for nearly every instruction.
+  StringRef LastFile;
+  unsigned LastIndex = 0;
   for (BasicBlock &BB : F) {
     for (Instruction &I : BB) {
-      if (I.getMetadata("unsafe_inst")) {
+      if (I.getMetadata(LLVMContext::MD_unsafe_inst)) {
         if (const DILocation *Loc = I.getDebugLoc()) {
           unsigned Line = Loc->getLine();
           StringRef File = Loc->getFilename();
           if (Line != 0 && !File.empty()) {
-            createUnsafeLineMetadata(I, Line, File);
+            if (File != LastFile) {
+              LastIndex = internUnsafeFile(M, File);
+              LastFile = File;
+            }
+            createUnsafeLineMetadata(I, Line, LastIndex);
           }
         }
       }
@@ -128,18 +1567,56 @@ void InstMarkerPass::captureUnsafeLineInfo(Function &F) {
 /// \brief Creates unsafe line metadata for an instruction.
 /// \param I The instruction to attach metadata to.
 /// \param Line The source line number.
-/// \param File The source file name.
-void InstMarkerPass::createUnsafeLineMetadata(Instruction &I, unsigned Line, 
-                                              StringRef File) {
+/// \param FileIndex The file's index in the module's unsafe.files table.
+void InstMarkerPass::createUnsafeLineMetadata(Instruction &I, unsigned Line,
+                                              unsigned FileIndex) {
   LLVMContext &Ctx = I.getContext();
-  
-  // Create metadata: !unsafe_line_info !{line_number, file_name}
+
+  // Create metadata: !unsafe_line_info !{line_number, file_index}. The
+  // file path lives once in the module-level unsafe.files table; repeating
+  // it here per instruction used to dominate the metadata footprint.
   Metadata *LineNum = ConstantAsMetadata::get(
     ConstantInt::get(Type::getInt32Ty(Ctx), Line));
-  Metadata *FileName = MDString::get(Ctx, File);
-  
-  MDNode *LineInfo = MDNode::get(Ctx, {LineNum, FileName});
-  I.setMetadata("unsafe_line_info", LineInfo);
+  Metadata *FileIdx = ConstantAsMetadata::get(
+    ConstantInt::get(Type::getInt32Ty(Ctx), FileIndex));
+
+  MDNode *LineInfo = MDNode::get(Ctx, {LineNum, FileIdx});
+  I.setMetadata(LLVMContext::MD_unsafe_line_info, LineInfo);
+  ++NumUnsafeLinesTagged;
+}
+
+/// \brief Resolves this module's incremental sidecar path, loads the
+/// previous build's rows into \p PrevHashes, then reopens the file for
+/// this build's rows. A missing previous sidecar is just a cold build; a
+/// write failure is a warning and this build produces no sidecar.
+static std::unique_ptr<raw_fd_ostream>
+openIncrementalSidecar(const Module &M, StringMap<uint64_t> &PrevHashes) {
+  SmallString<128> FileName(sys::path::filename(M.getModuleIdentifier()));
+  for (char &C : FileName)
+    if (!isAlnum(C) && C != '.' && C != '-' && C != '_')
+      C = '_';
+  SmallString<256> Path(UnsafeInstrIncrementalDir);
+  sys::path::append(Path, FileName + ".unsafe_instr_hash.tsv");
+
+  PrevHashes.clear();
+  if (auto Buf = MemoryBuffer::getFile(Path)) {
+    for (line_iterator LI(**Buf, /*SkipBlanks=*/true); !LI.is_at_eof();
+         ++LI) {
+      auto [Name, Rest] = LI->split('\t');
+      uint64_t Hash;
+      if (!Rest.split('\t').first.getAsInteger(0, Hash))
+        PrevHashes[Name] = Hash;
+    }
+  }
+
+  std::error_code EC;
+  auto OS = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "warning: cannot write unsafe incremental sidecar " << Path
+           << ": " << EC.message() << "\n";
+    return nullptr;
+  }
+  return OS;
 }
 
 PreservedAnalyses InstMarkerPass::run(Function &F,
@@ -147,10 +1624,86 @@ PreservedAnalyses InstMarkerPass::run(Function &F,
   if (!isPrimaryPackage())
     return PreservedAnalyses::all();
 
+  // A function the probe filter excludes gets no markers either: every
+  // probe pass honors the filter, so markers here would guard nothing
+  // while still pinning instruction order through the whole optimization
+  // pipeline as inaccessible-mem calls. Skipping keeps un-probed
+  // functions bit-identical to a native build.
+  if (!unsafeInstrFuncFilterAllows(F))
+    return PreservedAnalyses::all();
+
+  // Warm-rebuild guard: incremental codegen can re-feed already-marked
+  // bitcode through this pass. The hash record identifies it — under the
+  // same configuration the markers in place are exactly what this run
+  // would plant, so re-marking (which would double-bracket every region)
+  // is skipped. A configuration change cannot be repaired by re-marking
+  // either, so that skips too, with a warning to drop the cache.
+  uint64_t ContentHash = 0;
+  if (unsafeInstrIncrementalEnabled()) {
+    uint64_t PrevContent, PrevConfig;
+    if (getRecordedUnsafeInstrHash(F, PrevContent, PrevConfig)) {
+      if (PrevConfig != getUnsafeInstrPipelineFingerprint())
+        errs() << "warning: cached function " << F.getName()
+               << " was instrumented under a different configuration; "
+                  "clear the incremental cache to re-instrument it\n";
+      ++NumFunctionsAlreadyInstrumented;
+      return PreservedAnalyses::all();
+    }
+    ContentHash = unsafeInstrFunctionHash(F);
+  }
+
+  // Exclusion first, so never-executed lines are invisible to the line
+  // capture and both marking strategies alike.
+  applyExclusionProfile(F);
+
   // Capture line information BEFORE inserting markers
   captureUnsafeLineInfo(F);
-  
-  bool Modified = insertUnsafeMarkers(F);
+
+  // Resolve the marker declarations once per module instead of once per
+  // function; on a 30k-function crate that is 2 lookups instead of 60k.
+  Module *M = F.getParent();
+  if (CachedModule != M) {
+    CachedModule = M;
+    MarkerBegin = Intrinsic::getDeclaration(M, Intrinsic::unsafe_region_begin);
+    MarkerEnd = Intrinsic::getDeclaration(M, Intrinsic::unsafe_region_end);
+    if (unsafeInstrIncrementalEnabled())
+      IncrementalOS = openIncrementalSidecar(*M, PrevSidecarHashes);
+  }
+
+  unsigned RegionCount;
+  if (InstMarkerCrossBlockRegions) {
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    PostDominatorTree &PDT = AM.getResult<PostDominatorTreeAnalysis>(F);
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    RegionCount =
+        insertCrossBlockMarkers(F, DT, PDT, LI, MarkerBegin, MarkerEnd);
+  } else {
+    RegionCount = insertUnsafeMarkers(F, MarkerBegin, MarkerEnd);
+  }
+  bool Modified = RegionCount > 0;
+
+  // Stamp marked functions with the pair count so downstream passes can
+  // skip clean ones — and answer "does this function have regions at all"
+  // — with a single attribute read instead of a block walk.
+  if (Modified)
+    F.addFnAttr(UnsafeRegionMarkersAttr, utostr(RegionCount));
+
+  if (unsafeInstrIncrementalEnabled()) {
+    // Record every admitted function, marked or not: a cached clean
+    // function skips exactly as cheaply as a marked one, and consecutive
+    // sidecars cover the same rows so tooling can diff them directly.
+    recordUnsafeInstrHash(F, ContentHash);
+    auto PrevIt = PrevSidecarHashes.find(F.getName());
+    if (PrevIt != PrevSidecarHashes.end() && PrevIt->second == ContentHash)
+      ++NumFunctionsUnchangedSincePrior;
+    if (IncrementalOS)
+      *IncrementalOS << F.getName() << '\t' << format_hex(ContentHash, 18)
+                     << '\t'
+                     << format_hex(getUnsafeInstrPipelineFingerprint(), 18)
+                     << '\n';
+    // The hash record itself modified the function.
+    return PreservedAnalyses::none();
+  }
 
   return Modified ? PreservedAnalyses::none() : PreservedAnalyses::all();
 }
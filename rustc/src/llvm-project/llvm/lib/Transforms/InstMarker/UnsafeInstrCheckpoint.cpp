@@ -0,0 +1,85 @@
+//===- UnsafeInstrCheckpoint.cpp - Pre-probe bitcode checkpoint -----------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Dump side of the instrumentation checkpoint: the module bitcode as the
+/// probe passes are about to see it, one file per module under
+/// -unsafe-instr-checkpoint-dir. The resume side lives in the rustc
+/// wrapper (LLVMRustOptimize), which recomputes the same path via
+/// unsafeInstrCheckpointPath; keep the two in sync through that helper.
+///
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/InstMarker/UnsafeInstrCheckpoint.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdlib>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "unsafe-instr-checkpoint"
+
+STATISTIC(NumCheckpointsWritten, "Number of checkpoint modules written");
+
+PreservedAnalyses UnsafeInstrCheckpointPass::run(Module &M,
+                                                 ModuleAnalysisManager &AM) {
+  std::string Path = unsafeInstrCheckpointPath(M);
+  if (Path.empty() || !isUnsafePrimaryPackage())
+    return PreservedAnalyses::all();
+
+  // A resume run schedules the same block; re-dumping would overwrite the
+  // checkpoint with itself — harmless, but pointless disk traffic.
+  if (unsafeInstrCheckpointResumeEnabled())
+    return PreservedAnalyses::all();
+
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+  if (EC) {
+    // Best effort, like the report sidecars: a failed dump costs the
+    // experiment its shortcut, not the build its objects.
+    errs() << "warning: cannot write unsafe checkpoint " << Path << ": "
+           << EC.message() << "\n";
+    return PreservedAnalyses::all();
+  }
+  WriteBitcodeToFile(M, OS);
+  OS.close();
+  ++NumCheckpointsWritten;
+
+  // Corpus mode (UNSAFE_INSTR_CORPUS_DIR): the dump doubles as corpus
+  // extraction, and each module appends one manifest row — crate, module
+  // identifier, bitcode file, module hash, byte size — so offline tooling
+  // can enumerate and join the corpus without globbing. Appends from
+  // concurrent codegen are one short O_APPEND write each; rows may
+  // interleave across modules but not within one.
+  if (unsafeInstrCorpusModeEnabled()) {
+    SmallString<256> ManifestPath(getUnsafeInstrCheckpointDir());
+    sys::path::append(ManifestPath, "corpus_manifest.tsv");
+    std::error_code ManifestEC;
+    raw_fd_ostream Manifest(ManifestPath, ManifestEC,
+                            sys::fs::OF_Text | sys::fs::OF_Append);
+    if (ManifestEC) {
+      errs() << "warning: cannot append corpus manifest " << ManifestPath
+             << ": " << ManifestEC.message() << "\n";
+      return PreservedAnalyses::all();
+    }
+    const char *Crate = getenv("CARGO_CRATE_NAME");
+    sys::fs::file_status Status;
+    uint64_t Size =
+        sys::fs::status(Path, Status) ? 0 : Status.getSize();
+    Manifest << (Crate ? Crate : "?") << '\t' << M.getModuleIdentifier()
+             << '\t' << sys::path::filename(Path) << '\t'
+             << utohexstr(getUnsafeModuleHash(M)) << '\t' << Size << '\n';
+  }
+  return PreservedAnalyses::all();
+}
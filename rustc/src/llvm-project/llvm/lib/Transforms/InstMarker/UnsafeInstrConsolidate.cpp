@@ -0,0 +1,168 @@
+//===-- UnsafeInstrConsolidate.cpp - Dedup merged instrumentation ---------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file implements UnsafeInstrConsolidatePass. Under full-crate LTO,
+/// LLVMRustLinkModules concatenates the per-CGU instrumentation verbatim:
+/// an instrumented tokio arrives with sixteen cpu_cycle_ctor clones, each
+/// re-running the same registrations, plus sixteen copies of every string
+/// and scope table. The pass deduplicates instrumentation tables first
+/// (constant uniquing makes "same content" pointer equality on the
+/// initializer, so no explicit hash is needed), then collapses ctor/dtor
+/// entries whose bodies FunctionComparator proves identical — table dedup
+/// runs first precisely so ctors that registered duplicate tables become
+/// comparable. Only instrumentation-owned local symbols are touched; the
+/// application's own structors pass through untouched.
+///
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/InstMarker/UnsafeInstrConsolidate.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/Utils/FunctionComparator.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "unsafe-instr-consolidate"
+
+STATISTIC(NumConsolidatedTables,
+          "Number of duplicate instrumentation tables merged at link time");
+STATISTIC(NumConsolidatedStructors,
+          "Number of duplicate instrumentation ctor/dtor entries dropped");
+
+namespace {
+
+/// \brief Whether \p Name is an instrumentation-owned table symbol.
+///
+/// Every table the unsafe passes emit carries one of these prefixes; the
+/// module linker's collision suffixes (".1", ".2") keep the prefix, so
+/// merged clones still match.
+bool isInstrTableName(StringRef Name) {
+  return Name.startswith("__cpu_cycle_") || Name.startswith("__unsafe_");
+}
+
+/// \brief Whether \p Name is a ctor/dtor the unsafe passes emitted.
+bool isInstrStructorName(StringRef Name) {
+  return Name.startswith("cpu_cycle_") || Name.startswith("unsafe_") ||
+         Name.startswith("__unsafe_") || Name.startswith("heap_tracker_") ||
+         Name.startswith("alloc_tracker_");
+}
+
+/// \brief Merge local constant instrumentation tables with identical
+/// content.
+///
+/// Mutable globals — execution counters, accumulators — are never merged:
+/// distinct CGUs' probes must keep writing distinct slots. Constant
+/// initializers are uniqued per context, so after the module merge two
+/// tables have the same content iff they share the same initializer
+/// Constant, and the map key can be that pointer.
+bool mergeDuplicateTables(Module &M) {
+  DenseMap<Constant *, GlobalVariable *> Canonical;
+  SmallVector<GlobalVariable *, 16> Dead;
+  for (GlobalVariable &GV : M.globals()) {
+    if (!GV.hasLocalLinkage() || !GV.isConstant() || !GV.hasInitializer())
+      continue;
+    if (!isInstrTableName(GV.getName()))
+      continue;
+    auto [It, Inserted] = Canonical.try_emplace(GV.getInitializer(), &GV);
+    if (!Inserted) {
+      GV.replaceAllUsesWith(It->second);
+      Dead.push_back(&GV);
+    }
+  }
+  for (GlobalVariable *GV : Dead)
+    GV->eraseFromParent();
+  NumConsolidatedTables += Dead.size();
+  return !Dead.empty();
+}
+
+/// \brief Drop duplicate instrumentation entries from one structor list.
+///
+/// The first structurally identical body in llvm.global_ctors (or _dtors)
+/// order survives; later clones are removed from the list and erased once
+/// unreferenced. Entries that are not instrumentation-owned, or whose
+/// bodies differ (a registration ctor with its own tables), are kept
+/// verbatim with their priorities.
+bool consolidateStructorList(Module &M, StringRef ListName,
+                             GlobalNumberState &GN) {
+  GlobalVariable *ListGV = M.getGlobalVariable(ListName);
+  if (!ListGV || !ListGV->hasInitializer())
+    return false;
+  auto *List = dyn_cast<ConstantArray>(ListGV->getInitializer());
+  if (!List)
+    return false;
+
+  SmallVector<Constant *, 16> Kept;
+  SmallVector<Function *, 16> DroppedFns;
+  SmallVector<Function *, 16> Canon;
+  for (Value *Op : List->operands()) {
+    auto *Entry = cast<ConstantStruct>(Op);
+    auto *F =
+        dyn_cast<Function>(Entry->getOperand(1)->stripPointerCastsAndAliases());
+    bool Duplicate = false;
+    if (F && !F->isDeclaration() && F->hasLocalLinkage() &&
+        isInstrStructorName(F->getName())) {
+      for (Function *C : Canon)
+        if (FunctionComparator(C, F, &GN).compare() == 0) {
+          Duplicate = true;
+          break;
+        }
+      if (Duplicate)
+        DroppedFns.push_back(F);
+      else
+        Canon.push_back(F);
+    }
+    if (!Duplicate)
+      Kept.push_back(Entry);
+  }
+  if (Kept.size() == List->getNumOperands())
+    return false;
+
+  ArrayType *NewTy =
+      ArrayType::get(List->getType()->getElementType(), Kept.size());
+  auto *NewList = new GlobalVariable(M, NewTy, ListGV->isConstant(),
+                                     ListGV->getLinkage(),
+                                     ConstantArray::get(NewTy, Kept));
+  ListGV->eraseFromParent();
+  NewList->setName(ListName);
+
+  NumConsolidatedStructors += DroppedFns.size();
+  for (Function *F : DroppedFns)
+    if (F->use_empty())
+      F->eraseFromParent();
+  return true;
+}
+
+} // anonymous namespace
+
+PreservedAnalyses UnsafeInstrConsolidatePass::run(Module &M,
+                                                  ModuleAnalysisManager &AM) {
+  if (!isUnsafePrimaryPackage())
+    return PreservedAnalyses::all();
+
+  // Tables before structors: ctors that registered duplicate tables only
+  // compare equal once their table operands are the same GlobalVariable.
+  bool Changed = mergeDuplicateTables(M);
+
+  GlobalNumberState GN;
+  Changed |= consolidateStructorList(M, "llvm.global_ctors", GN);
+  Changed |= consolidateStructorList(M, "llvm.global_dtors", GN);
+
+  // Dense cross-CGU ID renumbering is deliberately not attempted: every
+  // pass registers its IDs alongside its own tables and the IDs are baked
+  // into those tables as constants, so each registration's ID space is
+  // already self-contained — renumbering would rewrite table contents for
+  // no runtime win beyond what the dedup above delivers.
+  return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
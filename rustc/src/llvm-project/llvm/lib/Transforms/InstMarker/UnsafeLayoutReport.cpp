@@ -0,0 +1,180 @@
+//===- UnsafeLayoutReport.cpp - Per-function size/layout report -----------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Instrumentation changes code layout, and layout changes performance
+/// independently of probe cost; without size accounting the two cannot be
+/// separated in the overhead numbers. This pass runs twice around the
+/// instrumentation block: the baseline instance records each function's
+/// instruction count and TTI code-size estimate in module metadata before
+/// any probe-emitting pass, and the final instance recomputes after probe
+/// cleanup and writes both sides as one TSV per codegen unit, aggregate
+/// row included. Exact MachineFunction byte sizes are not visible this
+/// early — they only exist after instruction selection — so the
+/// TCK_CodeSize estimate is the proxy; it tracks the emitted bytes closely
+/// enough for the before/after ratio the overhead model subtracts with.
+///
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/InstMarker/UnsafeLayoutReport.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/InstMarker/UnsafeStatsFormat.h"
+#include <memory>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "unsafe-layout-report"
+
+STATISTIC(NumLayoutFunctionsReported,
+          "Number of functions with before/after size rows");
+
+static cl::opt<std::string> UnsafeLayoutReportDir(
+  "unsafe-layout-report-dir", cl::init(""), cl::Hidden,
+  cl::desc("Write per-function before/after instrumentation size reports "
+           "into this directory (empty = off)")
+);
+
+// The baseline instance parks its measurements here between the two runs;
+// the final instance consumes and removes the node, so nothing leaks into
+// the emitted object.
+static const char *LayoutBaselineMD = "unsafe.layout.baseline";
+
+namespace {
+
+/// \brief One function's size measurement: IR instruction count and summed
+/// TTI code-size estimate.
+struct SizeSample {
+  uint64_t Insts = 0;
+  uint64_t Size = 0;
+};
+
+SizeSample measureFunction(const Function &F, const TargetTransformInfo &TTI) {
+  SizeSample S;
+  for (const BasicBlock &BB : F)
+    for (const Instruction &I : BB) {
+      ++S.Insts;
+      InstructionCost C =
+          TTI.getInstructionCost(&I, TargetTransformInfo::TCK_CodeSize);
+      if (C.isValid())
+        S.Size += C.getValue().value_or(0);
+    }
+  return S;
+}
+
+/// \brief Open the per-module layout report in the configured directory.
+///
+/// File naming and failure handling mirror the share report: one file per
+/// codegen unit, and a write failure is a warning — the build still
+/// succeeds, only the report is lost.
+std::unique_ptr<raw_fd_ostream> openLayoutReport(const Module &M) {
+  SmallString<128> FileName(sys::path::filename(M.getModuleIdentifier()));
+  for (char &C : FileName)
+    if (!isAlnum(C) && C != '.' && C != '-' && C != '_')
+      C = '_';
+
+  SmallString<256> Path(UnsafeLayoutReportDir);
+  sys::path::append(Path, FileName + ".unsafe_layout.tsv");
+
+  std::error_code EC;
+  auto OS = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "warning: cannot write unsafe layout report " << Path << ": "
+           << EC.message() << "\n";
+    return nullptr;
+  }
+  return OS;
+}
+
+} // anonymous namespace
+
+bool UnsafeLayoutReportPass::reportConfigured() {
+  return !UnsafeLayoutReportDir.empty();
+}
+
+PreservedAnalyses UnsafeLayoutReportPass::run(Module &M,
+                                              ModuleAnalysisManager &AM) {
+  auto &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+  if (!Final) {
+    // Baseline: one record per defined function, {name, insts, size}.
+    NamedMDNode *NMD = M.getOrInsertNamedMetadata(LayoutBaselineMD);
+    LLVMContext &Ctx = M.getContext();
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    for (Function &F : M) {
+      if (F.isDeclaration())
+        continue;
+      SizeSample S = measureFunction(F, FAM.getResult<TargetIRAnalysis>(F));
+      Metadata *Ops[] = {
+          MDString::get(Ctx, F.getName()),
+          ConstantAsMetadata::get(ConstantInt::get(Int64Ty, S.Insts)),
+          ConstantAsMetadata::get(ConstantInt::get(Int64Ty, S.Size))};
+      NMD->addOperand(MDNode::get(Ctx, Ops));
+    }
+    return PreservedAnalyses::all();
+  }
+
+  // Final: join against the parked baseline. Functions the instrumentation
+  // created (ctors, thunks, calibration twins) have no baseline row and
+  // report from zero, which is exactly their contribution to growth.
+  DenseMap<StringRef, SizeSample> Baseline;
+  if (NamedMDNode *NMD = M.getNamedMetadata(LayoutBaselineMD)) {
+    for (const MDNode *Record : NMD->operands()) {
+      if (Record->getNumOperands() != 3)
+        continue;
+      auto *Name = dyn_cast<MDString>(Record->getOperand(0));
+      auto *Insts = mdconst::dyn_extract<ConstantInt>(Record->getOperand(1));
+      auto *Size = mdconst::dyn_extract<ConstantInt>(Record->getOperand(2));
+      if (Name && Insts && Size)
+        Baseline[Name->getString()] = {Insts->getZExtValue(),
+                                       Size->getZExtValue()};
+    }
+    M.eraseNamedMetadata(M.getNamedMetadata(LayoutBaselineMD));
+  }
+
+  std::unique_ptr<raw_fd_ostream> OS = openLayoutReport(M);
+  if (!OS)
+    return PreservedAnalyses::all();
+  writeUnsafeStatsHeader(*OS, getUnsafeModuleHash(M));
+
+  // Columns: name, insts before/after, size estimate before/after, align.
+  // The final row aggregates the module under the reserved name <module>;
+  // its size delta is the code growth the overhead model subtracts, and
+  // the per-function rows say where it landed.
+  SizeSample ModuleBefore, ModuleAfter;
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    SizeSample Before = Baseline.lookup(F.getName());
+    SizeSample After = measureFunction(F, FAM.getResult<TargetIRAnalysis>(F));
+    uint64_t Align = F.getAlign() ? F.getAlign()->value() : 0;
+    *OS << F.getName() << '\t' << Before.Insts << '\t' << After.Insts << '\t'
+        << Before.Size << '\t' << After.Size << '\t' << Align << '\n';
+    ++NumLayoutFunctionsReported;
+    ModuleBefore.Insts += Before.Insts;
+    ModuleBefore.Size += Before.Size;
+    ModuleAfter.Insts += After.Insts;
+    ModuleAfter.Size += After.Size;
+  }
+  *OS << "<module>" << '\t' << ModuleBefore.Insts << '\t' << ModuleAfter.Insts
+      << '\t' << ModuleBefore.Size << '\t' << ModuleAfter.Size << '\t' << 0
+      << '\n';
+
+  return PreservedAnalyses::all();
+}
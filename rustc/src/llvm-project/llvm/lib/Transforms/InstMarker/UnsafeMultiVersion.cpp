@@ -0,0 +1,165 @@
+//===- UnsafeMultiVersion.cpp - Probed/clean function variants ------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Today every experiment ships its own binary: a native build for the
+/// baseline and one build per probe configuration. This pass collapses
+/// that into one artifact. Before any probe-emitting pass runs, each
+/// function carrying unsafe region markers is cloned; the clone loses its
+/// markers, so the probe passes leave it at native code, while the
+/// original keeps them and gets instrumented as usual. The function's
+/// public symbol becomes an ifunc whose resolver picks one body at load
+/// time from UNSAFE_INSTR_MEASURE, so the choice costs nothing per call
+/// once relocation has run.
+///
+/// The pass does not try to share code between the two bodies itself:
+/// basic blocks a probe pass never touches lower identically in both
+/// clones, and linker ICF (--icf=safe works; the variants are never
+/// compared by address against each other) folds them back. What cannot
+/// be shared is exactly the probed code, which is the point.
+///
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/InstMarker/UnsafeMultiVersion.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalIFunc.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "unsafe-multi-version"
+
+STATISTIC(NumFunctionsMultiVersioned,
+          "Number of marked functions split into probed/clean variants");
+
+// Runtime resolver behind every per-function ifunc. It runs while the
+// dynamic loader processes IRELATIVE relocations — before libc
+// initialization and before any constructor — so it must not call getenv;
+// the runtime reads UNSAFE_INSTR_MEASURE from the initial process stack
+// itself and returns Probed when the variable is set to 1, Clean
+// otherwise. It must be linked into the same module as the instrumented
+// code and the binary linked with -z now, so the call here is resolved
+// before the first ifunc fires.
+static const char *SELECT_VARIANT_FN = "__unsafe_instr_select_variant";
+
+namespace {
+
+/// \brief Clone \p F and strip the clone down to uninstrumented code:
+/// no region markers, no marker attribute, no per-instruction unsafe
+/// tags. Every probe pass keys on one of those, so the clone passes
+/// through the rest of the instrumentation block untouched.
+Function *cloneCleanVariant(Function &F) {
+  ValueToValueMapTy VMap;
+  Function *Clean = CloneFunction(&F, VMap);
+  Clean->setName(F.getName() + ".unsafe_clean");
+  Clean->setLinkage(GlobalValue::InternalLinkage);
+  Clean->setVisibility(GlobalValue::DefaultVisibility);
+  Clean->removeFnAttr(UnsafeRegionMarkersAttr);
+
+  SmallVector<Instruction *, 8> Markers;
+  for (BasicBlock &BB : *Clean)
+    for (Instruction &I : BB) {
+      if (auto *II = dyn_cast<IntrinsicInst>(&I))
+        if (II->getIntrinsicID() == Intrinsic::unsafe_region_begin ||
+            II->getIntrinsicID() == Intrinsic::unsafe_region_end) {
+          // Marker-borne metadata (probe IDs, the nesting triple) goes
+          // with the marker.
+          Markers.push_back(II);
+          continue;
+        }
+      if (I.getMetadata(LLVMContext::MD_unsafe_inst))
+        I.setMetadata(LLVMContext::MD_unsafe_inst, nullptr);
+    }
+  for (Instruction *I : Markers)
+    I->eraseFromParent();
+  return Clean;
+}
+
+/// \brief Demote \p F to the internal probed body and publish its
+/// original symbol as an ifunc resolving to \p F or \p Clean.
+void publishVariantIFunc(Module &M, Function &F, Function *Clean) {
+  std::string Name = F.getName().str();
+  GlobalValue::LinkageTypes Linkage = F.getLinkage();
+  GlobalValue::VisibilityTypes Visibility = F.getVisibility();
+  GlobalValue::UnnamedAddr UA = F.getUnnamedAddr();
+  bool DSOLocal = F.isDSOLocal();
+
+  F.setName(Name + UnsafeProbedVariantSuffix);
+  F.setLinkage(GlobalValue::InternalLinkage);
+  F.setVisibility(GlobalValue::DefaultVisibility);
+
+  GlobalIFunc *IF =
+      GlobalIFunc::create(F.getValueType(), F.getAddressSpace(), Linkage,
+                          Name, /*Resolver=*/nullptr, &M);
+  IF->setVisibility(Visibility);
+  IF->setUnnamedAddr(UA);
+  IF->setDSOLocal(DSOLocal);
+
+  // In-module references must go through the ifunc too: a baseline run
+  // that reached a probed body over a direct intra-module call would
+  // defeat the whole split. The RAUW runs before the resolver exists, so
+  // the resolver's own references below stay direct.
+  F.replaceAllUsesWith(IF);
+
+  LLVMContext &Ctx = M.getContext();
+  PointerType *PtrTy = PointerType::getUnqual(Ctx);
+  FunctionCallee Select = M.getOrInsertFunction(
+      SELECT_VARIANT_FN, FunctionType::get(PtrTy, {PtrTy, PtrTy}, false));
+
+  Function *Resolver =
+      Function::Create(FunctionType::get(PtrTy, false),
+                       GlobalValue::InternalLinkage,
+                       Name + ".unsafe_resolver", &M);
+  BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", Resolver);
+  IRBuilder<> Builder(Entry);
+  Builder.CreateRet(Builder.CreateCall(Select, {&F, Clean}));
+  IF->setResolver(Resolver);
+}
+
+} // anonymous namespace
+
+PreservedAnalyses UnsafeMultiVersionPass::run(Module &M,
+                                              ModuleAnalysisManager &AM) {
+  if (!isUnsafePrimaryPackage())
+    return PreservedAnalyses::all();
+
+  // Snapshot first: both the clone and the resolver are new functions in M.
+  SmallVector<Function *, 16> Candidates;
+  for (Function &F : M) {
+    if (F.isDeclaration() || !hasUnsafeRegionMarkers(F))
+      continue;
+    // A filtered-out function never gets probes, so both variants would
+    // be the same code; the cleanup pass already makes it native.
+    if (!unsafeInstrFuncFilterAllows(F))
+      continue;
+    // available_externally bodies are discardable hints — the symbol that
+    // ships comes from another module, which versions it itself. Comdats
+    // cannot move onto an ifunc, so ODR-grouped functions keep their
+    // single body rather than risk the group.
+    if (F.hasAvailableExternallyLinkage() || F.hasComdat())
+      continue;
+    Candidates.push_back(&F);
+  }
+
+  for (Function *F : Candidates) {
+    Function *Clean = cloneCleanVariant(*F);
+    publishVariantIFunc(M, *F, Clean);
+    ++NumFunctionsMultiVersioned;
+  }
+
+  return Candidates.empty() ? PreservedAnalyses::all()
+                            : PreservedAnalyses::none();
+}
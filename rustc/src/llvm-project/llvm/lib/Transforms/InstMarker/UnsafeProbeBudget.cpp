@@ -0,0 +1,204 @@
+//===- UnsafeProbeBudget.cpp - Enforce probe-count budgets ----------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Nothing else stops a configuration from planting millions of probes and
+/// shipping a uselessly slow binary — the mistake otherwise surfaces an
+/// hour into a benchmark run. This pass runs after probe cleanup, counts
+/// the probe sites that survived (runtime probe calls plus the inline
+/// counter increments), and enforces two limits:
+///
+///  * -unsafe-probe-budget: absolute probe sites per module.
+///  * -unsafe-probe-budget-per-kinst: probe sites per thousand final
+///    instructions. Growth against an uninstrumented build is not
+///    measurable this late, but each probe site costs a near-constant
+///    instruction sequence, so density is the growth proxy the budget can
+///    actually see.
+///
+/// A violation warns and emits optimization remarks naming the
+/// probe-heaviest functions (the vectorizer's remark machinery, so
+/// -Rpass-analysis=unsafe-probe-budget and remark YAML both work); under
+/// -unsafe-probe-budget-hard it fails the compile instead, for CI.
+///
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/InstMarker/UnsafeProbeBudget.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "unsafe-probe-budget"
+
+STATISTIC(NumProbeSitesCounted, "Number of probe sites counted");
+
+static cl::opt<unsigned> UnsafeProbeBudget(
+  "unsafe-probe-budget", cl::init(0), cl::Hidden,
+  cl::desc("Maximum probe sites per module (0 = unlimited)")
+);
+
+static cl::opt<unsigned> UnsafeProbeBudgetPerKInst(
+  "unsafe-probe-budget-per-kinst", cl::init(0), cl::Hidden,
+  cl::desc("Maximum probe sites per thousand final instructions, as a "
+           "code-growth proxy (0 = unlimited)")
+);
+
+static cl::opt<bool> UnsafeProbeBudgetHard(
+  "unsafe-probe-budget-hard", cl::init(false), cl::Hidden,
+  cl::desc("Fail the compile when a probe budget is exceeded instead of "
+           "warning, for CI")
+);
+
+namespace {
+
+/// \brief The runtime fast-path entry points the instrumentation passes
+/// call per execution. Registration and ctor-time hooks are deliberately
+/// absent: they run once, not per probe firing, and the budget is about
+/// per-execution cost. Adding a probe family means adding its entry here.
+bool isProbeCallee(StringRef Name) {
+  return Name.startswith("dyn_mem_access") ||
+         Name.startswith("dyn_unsafe_mem_access") ||
+         Name.startswith("cpu_cycle_start_measurement") ||
+         Name.startswith("cpu_cycle_end_measurement") ||
+         Name.startswith("cpu_cycle_probe_") || // Outlined thunk calls.
+         Name.startswith("__cpu_cycle_stack_") ||
+         Name == "track_unsafe_line_execution" ||
+         Name == "__unsafe_record_function" ||
+         Name == "heap_tracker_note_alloc" ||
+         Name == "heap_tracker_note_dealloc" ||
+         Name == "heap_tracker_flush_events" ||
+         Name.startswith("alloc_tracker_");
+}
+
+/// \brief True for the inline probe shapes that never enter the runtime: a
+/// store or atomic update whose target is one of the instrumentation's
+/// counter tables or TLS accumulators.
+bool isInlineProbeUpdate(const Instruction &I) {
+  const Value *Ptr = nullptr;
+  if (const auto *RMW = dyn_cast<AtomicRMWInst>(&I))
+    Ptr = RMW->getPointerOperand();
+  else if (const auto *SI = dyn_cast<StoreInst>(&I))
+    Ptr = SI->getPointerOperand();
+  else
+    return false;
+  const auto *GV = dyn_cast<GlobalVariable>(getUnderlyingObject(Ptr));
+  if (!GV)
+    return false;
+  StringRef Name = GV->getName();
+  return Name.startswith("__unsafe_block_counters") ||
+         Name.startswith("__cpu_cycle_tls_") ||
+         Name.startswith("__heap_tracker_tls_") ||
+         Name.startswith("__heap_tracker_event_");
+}
+
+/// \brief Count the probe sites in \p F, adding \p F's instruction total to
+/// \p TotalInsts.
+uint64_t countProbeSites(const Function &F, uint64_t &TotalInsts) {
+  uint64_t Probes = 0;
+  for (const BasicBlock &BB : F)
+    for (const Instruction &I : BB) {
+      ++TotalInsts;
+      if (const auto *CB = dyn_cast<CallBase>(&I)) {
+        if (const Function *Callee = CB->getCalledFunction())
+          if (isProbeCallee(Callee->getName()))
+            ++Probes;
+        continue;
+      }
+      if (isInlineProbeUpdate(I))
+        ++Probes;
+    }
+  return Probes;
+}
+
+} // anonymous namespace
+
+bool UnsafeProbeBudgetPass::budgetConfigured() {
+  return UnsafeProbeBudget > 0 || UnsafeProbeBudgetPerKInst > 0;
+}
+
+PreservedAnalyses UnsafeProbeBudgetPass::run(Module &M,
+                                             ModuleAnalysisManager &AM) {
+  uint64_t TotalProbes = 0;
+  uint64_t TotalInsts = 0;
+  SmallVector<std::pair<uint64_t, Function *>, 16> PerFunction;
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    uint64_t Probes = countProbeSites(F, TotalInsts);
+    TotalProbes += Probes;
+    if (Probes)
+      PerFunction.push_back({Probes, &F});
+  }
+  NumProbeSitesCounted += TotalProbes;
+
+  // Density in probes per thousand instructions, rounded up so a budget of
+  // N never admits a module that is strictly denser than N.
+  uint64_t PerKInst =
+      TotalInsts ? (TotalProbes * 1000 + TotalInsts - 1) / TotalInsts : 0;
+
+  bool OverAbsolute = UnsafeProbeBudget > 0 && TotalProbes > UnsafeProbeBudget;
+  bool OverDensity =
+      UnsafeProbeBudgetPerKInst > 0 && PerKInst > UnsafeProbeBudgetPerKInst;
+
+  // Attribution: remarks for the probe-heaviest functions, so the build log
+  // (or the remark YAML) says where the budget went without a second run.
+  // Remark emission is free unless remarks were requested.
+  llvm::stable_sort(PerFunction, [](const auto &A, const auto &B) {
+    return A.first > B.first;
+  });
+  auto &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  constexpr unsigned TopN = 8;
+  for (unsigned I = 0; I < PerFunction.size() && I < TopN; ++I) {
+    Function *F = PerFunction[I].second;
+    auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(*F);
+    ORE.emit([&] {
+      return OptimizationRemarkAnalysis(DEBUG_TYPE, "ProbeCount", F)
+             << ore::NV("NumProbes", PerFunction[I].first)
+             << " probe sites ("
+             << ore::NV("ModuleShare",
+                        TotalProbes ? PerFunction[I].first * 100 / TotalProbes
+                                    : 0)
+             << "% of the module's " << ore::NV("TotalProbes", TotalProbes)
+             << ")";
+    });
+  }
+
+  if (!OverAbsolute && !OverDensity)
+    return PreservedAnalyses::all();
+
+  std::string Msg;
+  raw_string_ostream OS(Msg);
+  OS << "unsafe-probe-budget: module '" << M.getModuleIdentifier() << "' has "
+     << TotalProbes << " probe sites";
+  if (OverAbsolute)
+    OS << " (budget " << UnsafeProbeBudget << ")";
+  OS << ", " << PerKInst << " per thousand instructions";
+  if (OverDensity)
+    OS << " (budget " << UnsafeProbeBudgetPerKInst << ")";
+  OS << "; heaviest:";
+  for (unsigned I = 0; I < PerFunction.size() && I < TopN; ++I)
+    OS << ' ' << PerFunction[I].second->getName() << '='
+       << PerFunction[I].first;
+
+  if (UnsafeProbeBudgetHard)
+    report_fatal_error(Twine(OS.str()), /*gen_crash_diag=*/false);
+  errs() << "warning: " << OS.str() << '\n';
+  return PreservedAnalyses::all();
+}
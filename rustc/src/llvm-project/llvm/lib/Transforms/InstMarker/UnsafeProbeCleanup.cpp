@@ -0,0 +1,140 @@
+//===- UnsafeProbeCleanup.cpp - Delete statically dead probes -------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// The unsafe instrumentation passes run after all optimization, so nothing
+/// downstream ever cleans up behind them. Two configurations leave
+/// statically dead skeletons in the final IR:
+///
+///  * -unsafe-instr-funcs: InstMarkerPass skips filtered functions, but
+///    markers can still arrive in prelinked bitcode (the ThinLTO pipeline
+///    places them before the import). Every probe pass honors the filter,
+///    so such markers guard nothing, yet they pin instruction order as
+///    inaccessible-mem calls and emit symbols under -unsafe-marker-labels.
+///
+///  * -unsafe-instr-sample-rate=0: every sampled probe decision folds to
+///    constant false, leaving never-taken branches over the probe arms.
+///
+/// This pass deletes both entirely. Live countdown gates are deliberately
+/// left alone even when their probe arm looks removable: the sample
+/// countdown is shared module-wide, and dropping one decrement would shift
+/// every other gate's firing cadence.
+///
+/// -unsafe-probe-parity-hash verifies the result: it prints a detailed
+/// per-function IR hash after cleanup, and a native build run with only
+/// this pass enabled prints the same stream. Diffing the two shows exactly
+/// which functions still diverge from native code.
+///
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/InstMarker/UnsafeProbeCleanup.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/StructuralHash.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "unsafe-probe-cleanup"
+
+STATISTIC(NumDeadMarkersErased,
+          "Number of unguarded unsafe region markers erased");
+STATISTIC(NumDeadGatesFolded,
+          "Number of constant-false probe gates folded away");
+
+// Parity verification for the cleanup: hashing MachineIR would need a
+// machine pass wired into the codegen pipeline, but codegen is
+// deterministic given identical final IR, so a detailed structural hash at
+// the very end of the module pipeline catches the same divergence. Diff
+// the stream from an instrumented build against one from a native build
+// compiled with only -enable-unsafe-probe-cleanup (this pass is a no-op
+// there); matching lines are functions that lower bit-identically.
+static cl::opt<bool> UnsafeProbeParityHash(
+  "unsafe-probe-parity-hash", cl::init(false), cl::Hidden,
+  cl::desc("Print a per-function IR hash after probe cleanup, for diffing "
+           "an instrumented build against a native one")
+);
+
+namespace {
+
+/// \brief Erase the region markers in \p F when the probe filter excludes
+/// it; every probe pass honors the filter, so they guard nothing.
+bool eraseUnguardedMarkers(Function &F) {
+  if (unsafeInstrFuncFilterAllows(F) || !hasUnsafeRegionMarkers(F))
+    return false;
+
+  SmallVector<Instruction *, 8> Dead;
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB)
+      if (auto *II = dyn_cast<IntrinsicInst>(&I))
+        if (II->getIntrinsicID() == Intrinsic::unsafe_region_begin ||
+            II->getIntrinsicID() == Intrinsic::unsafe_region_end)
+          Dead.push_back(II);
+  for (Instruction *I : Dead)
+    I->eraseFromParent();
+  NumDeadMarkersErased += Dead.size();
+
+  // Drop the stamp too, so the preserver and the manifest (which run after
+  // this pass) describe the function as the uninstrumented code it now is.
+  F.removeFnAttr(UnsafeRegionMarkersAttr);
+  return !Dead.empty();
+}
+
+/// \brief Fold the constant-false branches a rate-0 build's sample gates
+/// left behind and drop the now-unreachable probe arms.
+bool foldDisabledGates(Function &F) {
+  bool Folded = false;
+  for (BasicBlock &BB : make_early_inc_range(F)) {
+    auto *Br = dyn_cast<BranchInst>(BB.getTerminator());
+    if (!Br || !Br->isConditional() || !isa<ConstantInt>(Br->getCondition()))
+      continue;
+    if (ConstantFoldTerminator(&BB)) {
+      ++NumDeadGatesFolded;
+      Folded = true;
+    }
+  }
+  if (Folded)
+    removeUnreachableBlocks(F);
+  return Folded;
+}
+
+} // anonymous namespace
+
+PreservedAnalyses UnsafeProbeCleanupPass::run(Module &M,
+                                              ModuleAnalysisManager &AM) {
+  bool Modified = false;
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+
+    Modified |= eraseUnguardedMarkers(F);
+
+    // Only a rate-0 configuration plants constant gate conditions; past
+    // this point in the pipeline any other constant-condition branch would
+    // be someone else's to fold.
+    if (getUnsafeInstrSampleRate() == 0)
+      Modified |= foldDisabledGates(F);
+
+    if (UnsafeProbeParityHash)
+      errs() << "unsafe-parity\t" << F.getName() << "\t"
+             << format_hex(StructuralHash(F, /*DetailedHash=*/true), 18)
+             << "\n";
+  }
+  return Modified ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
@@ -0,0 +1,275 @@
+//===-- UnsafeRegionAnalysis.cpp - Locate marked unsafe regions -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// This file implements UnsafeRegionAnalysis, the single shared scan for the
+/// unsafe-region markers inserted by InstMarkerPass.
+///
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/InstMarker/UnsafeRegionAnalysis.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "unsafe-region-verify"
+
+STATISTIC(NumSpanningRegions,
+          "Number of unsafe regions left open across a block boundary");
+STATISTIC(NumRepairedBlocks,
+          "Number of blocks given repair markers to rebalance a region");
+STATISTIC(NumLegacyMarkersUpgraded,
+          "Number of pre-intrinsic inline-asm markers upgraded");
+
+// Repair is the default: a spanning region split at block boundaries covers
+// exactly the same instructions, so counts stay honest. Turning repair off
+// makes a spanning region a hard compile error instead, for pinning down
+// which transform broke the invariant.
+static cl::opt<bool> UnsafeRegionRepair(
+  "unsafe-region-repair", cl::init(true), cl::Hidden,
+  cl::desc("Split unsafe regions that span basic blocks into per-block "
+           "begin/end pairs (otherwise spanning regions abort the compile)")
+);
+
+// Before the markers became intrinsics, InstMarkerPass encoded them as
+// "nop # marker_begin"/"nop # marker_end" inline asm. Rlibs compiled by
+// that toolchain and fed through ThinLTO still carry the asm form, which
+// the intrinsic-only matchers cannot see; with this flag the verifier
+// rewrites them to the intrinsics before checking pairing, and everything
+// downstream stays intrinsic-only. Off by default: the upgrade re-runs
+// the per-callee InlineAsm string compare the intrinsic conversion
+// retired, and current-toolchain bitcode never needs it.
+static cl::opt<bool> UnsafeLegacyAsmMarkers(
+  "unsafe-legacy-asm-markers", cl::init(false), cl::Hidden,
+  cl::desc("Upgrade pre-intrinsic inline-asm region markers found in "
+           "prelinked bitcode to the llvm.unsafe.region intrinsics")
+);
+
+/// \brief Matches the retired inline-asm marker encoding, reporting which
+/// marker kind via \p IsBegin. Only the legacy-upgrade path calls this.
+static bool isLegacyAsmMarker(const Instruction &I, bool &IsBegin) {
+  const auto *CB = dyn_cast<CallBase>(&I);
+  if (!CB)
+    return false;
+  const auto *IA =
+      dyn_cast<InlineAsm>(CB->getCalledOperand()->stripPointerCasts());
+  if (!IA)
+    return false;
+  StringRef Asm = IA->getAsmString();
+  if (Asm == "nop # marker_begin") {
+    IsBegin = true;
+    return true;
+  }
+  if (Asm == "nop # marker_end") {
+    IsBegin = false;
+    return true;
+  }
+  return false;
+}
+
+/// \brief Replaces legacy inline-asm markers in \p F with the equivalent
+/// intrinsic calls and stamps the marker attribute, so the function is
+/// indistinguishable from current-toolchain output to every consumer.
+static bool upgradeLegacyAsmMarkers(Function &F) {
+  SmallVector<std::pair<Instruction *, bool>, 8> Legacy;
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB) {
+      bool IsBegin;
+      if (isLegacyAsmMarker(I, IsBegin))
+        Legacy.push_back({&I, IsBegin});
+    }
+  if (Legacy.empty())
+    return false;
+
+  Module *M = F.getParent();
+  Function *MarkerBegin =
+      Intrinsic::getDeclaration(M, Intrinsic::unsafe_region_begin);
+  Function *MarkerEnd =
+      Intrinsic::getDeclaration(M, Intrinsic::unsafe_region_end);
+  for (auto &[I, IsBegin] : Legacy) {
+    IRBuilder<> Builder(I);
+    Builder.CreateCall(IsBegin ? MarkerBegin : MarkerEnd);
+    I->eraseFromParent();
+  }
+  F.addFnAttr(UnsafeRegionMarkersAttr);
+  NumLegacyMarkersUpgraded += Legacy.size();
+  return true;
+}
+
+AnalysisKey UnsafeRegionAnalysis::Key;
+
+UnsafeRegionAnalysis::Result
+UnsafeRegionAnalysis::run(Function &F, FunctionAnalysisManager &AM) {
+  return compute(F);
+}
+
+UnsafeRegionAnalysis::Result UnsafeRegionAnalysis::compute(Function &F) {
+  UnsafeRegionInfo Info;
+
+  // Most functions have no markers at all; answer those without walking
+  // their blocks.
+  if (!hasUnsafeRegionMarkers(F))
+    return Info;
+
+  for (BasicBlock &BB : F) {
+    // The first begin marker stays active until its end marker shows up;
+    // markers never span blocks, so the pairing state resets per block.
+    Instruction *CurrentBegin = nullptr;
+
+    for (Instruction &I : BB) {
+      auto *II = dyn_cast<IntrinsicInst>(&I);
+      if (!II)
+        continue;
+
+      Intrinsic::ID ID = II->getIntrinsicID();
+      if (ID == Intrinsic::unsafe_region_begin) {
+        Info.BeginMarkers.insert(&I);
+        if (!CurrentBegin)
+          CurrentBegin = &I;
+      } else if (ID == Intrinsic::unsafe_region_end) {
+        Info.EndMarkers.insert(&I);
+        if (CurrentBegin) {
+          Info.Regions.push_back({CurrentBegin, &I});
+          CurrentBegin = nullptr;
+        }
+      }
+    }
+  }
+
+  return Info;
+}
+
+PreservedAnalyses UnsafeRegionVerifierPass::run(Function &F,
+                                                FunctionAnalysisManager &AM) {
+  // Legacy bitcode first: the verifier is the one pass guaranteed to run
+  // before every marker consumer (including post-link, where prelinked
+  // rlibs surface), so upgrading here lets the scans below and all of
+  // UnsafeRegionAnalysis stay intrinsic-only.
+  bool Upgraded = UnsafeLegacyAsmMarkers && upgradeLegacyAsmMarkers(F);
+
+  // The invariant every consumer assumes: within each block markers
+  // alternate begin, end, begin, end, ... and every begin is closed before
+  // the block ends. One reverse-post-order walk propagates the open-region
+  // state across edges, so a region some transform stretched over a block
+  // boundary is seen (and repaired) instead of silently truncated by the
+  // consumers' per-block scans.
+  SmallDenseMap<BasicBlock *, bool, 16> OpenAtExit;
+  SmallVector<BasicBlock *, 4> NeedsBegin; // open on entry
+  SmallVector<BasicBlock *, 4> NeedsEnd;   // open at terminator
+  bool MarkersUnreliable = false;
+
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  for (BasicBlock *BB : RPOT) {
+    // Entry state is the predecessors' exit state. Back-edge predecessors
+    // are not known yet and are skipped: this keeps the check to a single
+    // cheap walk, and a region held open around a loop shows up anyway as
+    // the header's already-processed predecessor disagreeing.
+    bool OpenIn = false, Known = false;
+    for (BasicBlock *Pred : predecessors(BB)) {
+      auto It = OpenAtExit.find(Pred);
+      if (It == OpenAtExit.end())
+        continue;
+      if (!Known) {
+        OpenIn = It->second;
+        Known = true;
+      } else if (OpenIn != It->second) {
+        errs() << "warning: unsafe region open on only some paths into a "
+                  "block of "
+               << F.getName()
+               << "; region counts for this function are unreliable\n";
+        MarkersUnreliable = true;
+      }
+    }
+
+    bool Open = OpenIn;
+    for (Instruction &I : *BB) {
+      auto *II = dyn_cast<IntrinsicInst>(&I);
+      if (!II)
+        continue;
+
+      Intrinsic::ID ID = II->getIntrinsicID();
+      if (ID == Intrinsic::unsafe_region_begin) {
+        if (Open) {
+          errs() << "warning: nested unsafe_region_begin in " << F.getName()
+                 << "; region counts for this function are unreliable\n";
+          MarkersUnreliable = true;
+        }
+        Open = true;
+      } else if (ID == Intrinsic::unsafe_region_end) {
+        if (!Open) {
+          errs() << "warning: unmatched unsafe_region_end in " << F.getName()
+                 << "; region counts for this function are unreliable\n";
+          MarkersUnreliable = true;
+        }
+        Open = false;
+      }
+    }
+
+    if (OpenIn)
+      NeedsBegin.push_back(BB);
+    if (Open) {
+      NeedsEnd.push_back(BB);
+      // Count each spanning region once, at the block that opened it.
+      if (!OpenIn)
+        ++NumSpanningRegions;
+    }
+    OpenAtExit[BB] = Open;
+  }
+
+  if (!UnsafeRegionRepair &&
+      (MarkersUnreliable || !NeedsBegin.empty() || !NeedsEnd.empty()))
+    report_fatal_error("unsafe region markers are unbalanced in " +
+                           F.getName() +
+                           " (rerun with -unsafe-region-repair to split "
+                           "spanning regions)",
+                       /*gen_crash_diag=*/false);
+
+  if (NeedsBegin.empty() && NeedsEnd.empty()) {
+    if (!Upgraded)
+      return PreservedAnalyses::all();
+    PreservedAnalyses PA;
+    PA.preserveSet<CFGAnalyses>();
+    return PA;
+  }
+
+  // Close the region at every boundary it crosses: an end before the open
+  // block's terminator, a begin at each continuation block's first insertion
+  // point. The rebalanced pairs cover exactly the same instructions.
+  Module *M = F.getParent();
+  Function *MarkerBegin =
+      Intrinsic::getDeclaration(M, Intrinsic::unsafe_region_begin);
+  Function *MarkerEnd =
+      Intrinsic::getDeclaration(M, Intrinsic::unsafe_region_end);
+
+  for (BasicBlock *BB : NeedsEnd) {
+    IRBuilder<> Builder(BB->getTerminator());
+    Builder.CreateCall(MarkerEnd);
+  }
+  for (BasicBlock *BB : NeedsBegin) {
+    IRBuilder<> Builder(&*BB->getFirstInsertionPt());
+    Builder.CreateCall(MarkerBegin);
+  }
+  NumRepairedBlocks += NeedsBegin.size() + NeedsEnd.size();
+
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
@@ -8,16 +8,27 @@
 
 #include "llvm/Transforms/UnsafeCount/UnsafeFunctionTracker.h"
 #include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/InstMarker/UnsafeStatsFormat.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Parallel.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 #include <vector>
 #include <cstdlib>
@@ -25,40 +36,81 @@
 
 using namespace llvm;
 
+#define DEBUG_TYPE "unsafe-function-tracker"
+
+STATISTIC(NumFunctionsTracked, "Number of functions given tracking IDs");
+STATISTIC(NumUnsafeFunctions,
+          "Number of tracked functions with an unsafe instruction in a region");
+STATISTIC(NumFunctionTableBytes,
+          "Bytes of static function metadata tables emitted");
+
+// Sidecar output: with thousands of tracked functions, carrying name strings
+// in the binary (and resolving them at startup) costs both binary size and
+// startup time. When a directory is given, the tracker instead writes one
+// TSV file per module at compile time — id, name, has_unsafe per line — so
+// the aggregator resolves names offline and the binary keeps only numeric
+// IDs.
+static cl::opt<std::string> UnsafeFuncSidecarDir(
+  "unsafe-func-sidecar-dir", cl::init(""), cl::Hidden,
+  cl::desc("Directory to write per-module (func_id, name, has_unsafe) "
+           "sidecar files into (empty = no sidecar)")
+);
+
+// Module-order numbering renumbers every function on any code change, so
+// historical comparisons against old runtime stats have to re-key by name
+// strings. With this flag the ID is a 20-bit hash of the mangled name
+// instead; the same function keeps the same ID across builds and
+// cross-build diffing becomes an integer join. The runtime sizes its count
+// table from the largest ID in the metadata table, so the sparse ID space
+// costs address space, not resident memory.
+static cl::opt<bool> UnsafeFuncStableIds(
+  "unsafe-func-stable-ids", cl::init(false), cl::Hidden,
+  cl::desc("Derive function tracking IDs from a hash of the mangled name "
+           "instead of module order (stable across builds)")
+);
+
 namespace {
 
 constexpr const char *INIT_METADATA_FN = "__unsafe_init_metadata";
 constexpr const char *RECORD_FUNCTION_FN = "__unsafe_record_function";
 constexpr const char *DUMP_STATS_FN = "__unsafe_dump_stats";
 
-/// \brief Check if instruction is a marker
-static bool isMarkerInstruction(const Instruction &I) {
-  if (auto *CI = dyn_cast<CallBase>(&I)) {
-    if (auto *IA = dyn_cast<InlineAsm>(CI->getCalledOperand()->stripPointerCasts())) {
-      StringRef AsmStr = IA->getAsmString();
-      return AsmStr == UNSAFE_MARKER_BEGIN || AsmStr == UNSAFE_MARKER_END;
-    }
-  }
-  return false;
+/// Stable IDs keep this many bits of the name hash. Bounding the largest
+/// possible ID lets the runtime pre-size its count table (2^20 slots is
+/// 8 MiB of calloc'd zero pages, faulted in only where counts land).
+constexpr uint32_t STABLE_ID_BITS = 20;
+constexpr uint32_t STABLE_ID_MASK = (1u << STABLE_ID_BITS) - 1;
+
+/// \brief FNV-1a of the mangled name, folded down to STABLE_ID_BITS bits.
+static uint32_t stableFunctionId(StringRef Name) {
+  uint64_t Hash = 1469598103934665603ULL;
+  for (char C : Name)
+    Hash = (Hash ^ static_cast<uint8_t>(C)) * 1099511628211ULL;
+  Hash ^= Hash >> 32;
+  Hash ^= Hash >> STABLE_ID_BITS;
+  return static_cast<uint32_t>(Hash) & STABLE_ID_MASK;
 }
 
 /// \brief Check if instruction has unsafe metadata
 static bool hasUnsafeMetadata(const Instruction &I) {
-  return I.getMetadata("unsafe_inst") != nullptr;
-}
-
-/// \brief Check if function should be instrumented
-static bool shouldInstrumentFunction(const Function &F) {
-  if (F.isDeclaration() || F.isIntrinsic())
-    return false;
-  
-  StringRef Name = F.getName();
-  return !Name.startswith("__unsafe_") && 
-         !Name.startswith("llvm.");
+  return I.getMetadata(LLVMContext::MD_unsafe_inst) != nullptr;
 }
 
 /// \brief Analyze function for unsafe characteristics according to new criteria
 static bool analyzeFunction(Function &F) {
+  // No markers means no regions and therefore nothing to find.
+  if (!hasUnsafeRegionMarkers(F))
+    return false;
+
+  // InstMarkerPass only emits pairs around unsafe_inst-tagged
+  // instructions, so a recorded count already answers the question. Only
+  // functions whose markers arrived some other way — a bare attribute, or
+  // inlining — still pay the instruction walk below; this is a module
+  // pass, so every walk skipped comes straight off the serial portion of
+  // the pipeline.
+  if (unsafeRegionCountHint(F) > 0)
+    return true;
+
   // Scan for regions and metadata inside regions
   bool inUnsafeRegion = false;
   bool foundUnsafeInstInRegion = false;
@@ -66,17 +118,16 @@ static bool analyzeFunction(Function &F) {
   for (BasicBlock &BB : F) {
     for (Instruction &I : BB) {
       // Look for region markers
-      if (isMarkerInstruction(I)) {
-        auto *CI = dyn_cast<CallBase>(&I);
-        auto *IA = dyn_cast<InlineAsm>(CI->getCalledOperand()->stripPointerCasts());
-        StringRef AsmStr = IA->getAsmString();
-
-        if (AsmStr == UNSAFE_MARKER_BEGIN)
+      if (auto *II = dyn_cast<IntrinsicInst>(&I)) {
+        Intrinsic::ID ID = II->getIntrinsicID();
+        if (ID == Intrinsic::unsafe_region_begin) {
           inUnsafeRegion = true;
-        else if (AsmStr == UNSAFE_MARKER_END)
+          continue;
+        }
+        if (ID == Intrinsic::unsafe_region_end) {
           inUnsafeRegion = false;
-
-        continue;
+          continue;
+        }
       }
 
       // Only check for unsafe_inst metadata if inside region
@@ -92,6 +143,42 @@ static bool analyzeFunction(Function &F) {
   return false;
 }
 
+/// \brief Write the per-module function metadata sidecar.
+///
+/// A two-column module_hash header row, then one TSV line per tracked
+/// function: id, mangled name, has_unsafe flag. The hash is the module's
+/// ID namespace qualifier, so the aggregator joins a shard's runtime stats
+/// to the right sidecar even when shards were built differently. The file
+/// name is derived from the module identifier so each codegen unit of a
+/// crate gets its own file. Failure to write is a warning, not an error:
+/// the run still produces IDs, only offline name resolution is lost.
+static void writeFunctionSidecar(
+    const Module &M, uint64_t ModuleHash,
+    ArrayRef<UnsafeFunctionTrackerPass::FunctionMetadata> Metadata,
+    ArrayRef<Function *> Functions) {
+  SmallString<128> FileName(sys::path::filename(M.getModuleIdentifier()));
+  for (char &C : FileName)
+    if (!isAlnum(C) && C != '.' && C != '-' && C != '_')
+      C = '_';
+
+  SmallString<256> Path(UnsafeFuncSidecarDir);
+  sys::path::append(Path, FileName + ".unsafe_funcs.tsv");
+
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "warning: cannot write unsafe function sidecar " << Path
+           << ": " << EC.message() << "\n";
+    return;
+  }
+
+  writeUnsafeStatsHeader(OS, ModuleHash);
+  OS << "module_hash\t" << utohexstr(ModuleHash) << '\n';
+  for (size_t Idx = 0; Idx < Metadata.size(); ++Idx)
+    OS << Metadata[Idx].id << '\t' << Functions[Idx]->getName() << '\t'
+       << static_cast<unsigned>(Metadata[Idx].hasUnsafeInst) << '\n';
+}
+
 } // anonymous namespace
 
 namespace llvm {
@@ -99,8 +186,45 @@ namespace llvm {
 constexpr const char *UnsafeFunctionTrackerPass::FUNCTION_ID_METADATA;
 
 bool UnsafeFunctionTrackerPass::isPrimaryPackage() {
-  const char *P = std::getenv("CARGO_PRIMARY_PACKAGE");
-  return P && std::strcmp(P, "1") == 0;
+  return isUnsafePrimaryPackage();
+}
+
+bool UnsafeFunctionTrackerPass::shouldInstrument(const Function &F) {
+  if (F.isDeclaration() || F.isIntrinsic())
+    return false;
+
+  StringRef Name = F.getName();
+  return !Name.startswith("__unsafe_") &&
+         !Name.startswith("llvm.");
+}
+
+std::vector<uint32_t>
+UnsafeFunctionTrackerPass::assignFunctionIds(ArrayRef<Function *> Functions) {
+  std::vector<uint32_t> Ids(Functions.size());
+  if (!UnsafeFuncStableIds) {
+    for (size_t Idx = 0; Idx < Functions.size(); ++Idx)
+      Ids[Idx] = Idx;
+    return Ids;
+  }
+
+  // Resolve collisions in sorted-name order, not module order: which of two
+  // colliding names gets probed forward then depends only on the names
+  // themselves, so unrelated code motion cannot flip the outcome.
+  std::vector<size_t> Order(Functions.size());
+  for (size_t Idx = 0; Idx < Order.size(); ++Idx)
+    Order[Idx] = Idx;
+  llvm::sort(Order, [&](size_t A, size_t B) {
+    return Functions[A]->getName() < Functions[B]->getName();
+  });
+
+  DenseSet<uint32_t> Used;
+  for (size_t Idx : Order) {
+    uint32_t Id = stableFunctionId(Functions[Idx]->getName());
+    while (!Used.insert(Id).second)
+      Id = (Id + 1) & STABLE_ID_MASK;
+    Ids[Idx] = Id;
+  }
+  return Ids;
 }
 
 PreservedAnalyses UnsafeFunctionTrackerPass::run(Module &M, ModuleAnalysisManager &AM) {
@@ -110,40 +234,84 @@ PreservedAnalyses UnsafeFunctionTrackerPass::run(Module &M, ModuleAnalysisManage
   LLVMContext &Ctx = M.getContext();
   std::vector<FunctionMetadata> metadata;
   std::vector<Function*> functionsToInstrument;
-  
-  // Phase 1: Analyze all functions and assign IDs
-  uint32_t nextId = 0;
-  for (Function &F : M) {
-    if (!shouldInstrumentFunction(F))
-      continue;
 
-    F.setMetadata(FUNCTION_ID_METADATA, 
-                  MDNode::get(Ctx, ConstantAsMetadata::get(
-                    ConstantInt::get(Type::getInt32Ty(Ctx), nextId))));
+  for (Function &F : M)
+    if (shouldInstrument(F))
+      functionsToInstrument.push_back(&F);
+
+  if (functionsToInstrument.empty())
+    return PreservedAnalyses::all();
+
+  // Process in sorted-name order, not module order: sequential IDs, the
+  // metadata table initializer and the sidecar rows then depend only on
+  // which functions exist, so a frontend that emits them in a different
+  // order still produces bit-identical instrumentation. Names are unique
+  // within a module, so the order is total.
+  llvm::sort(functionsToInstrument, [](const Function *A, const Function *B) {
+    return A->getName() < B->getName();
+  });
 
-    bool isUnsafe = analyzeFunction(F);
+  // Phase 1: Assign IDs and analyze all functions. The per-function
+  // analysis only reads attributes, intrinsics and metadata attachments —
+  // all safe to read concurrently — and functions are independent, so it
+  // fans out across cores into a slot-per-function result vector, which
+  // keeps the outcome deterministic regardless of scheduling. Everything
+  // that mutates the module (ID metadata, table emission, entry probes)
+  // stays serial in module order below.
+  std::vector<uint32_t> ids = assignFunctionIds(functionsToInstrument);
+  std::vector<uint8_t> unsafeFlags(functionsToInstrument.size(), 0);
+  parallelFor(0, functionsToInstrument.size(), [&](size_t Idx) {
+    unsafeFlags[Idx] = analyzeFunction(*functionsToInstrument[Idx]) ? 1 : 0;
+  });
+
+  for (size_t Idx = 0; Idx < functionsToInstrument.size(); ++Idx) {
+    Function &F = *functionsToInstrument[Idx];
+
+    F.setMetadata(FUNCTION_ID_METADATA,
+                  MDNode::get(Ctx, ConstantAsMetadata::get(
+                    ConstantInt::get(Type::getInt32Ty(Ctx), ids[Idx]))));
 
     metadata.push_back({
-      nextId++,
-      static_cast<uint8_t>(isUnsafe ? 1 : 0), // Now only track real unsafe functions
+      ids[Idx],
+      unsafeFlags[Idx], // Now only track real unsafe functions
       0, // Optionally drop hasUnsafeRegions, or keep for extra info
       0
     });
-
-    functionsToInstrument.push_back(&F);
   }
-  
-  if (metadata.empty())
-    return PreservedAnalyses::all();
-  
+
+  emitTracking(M, metadata, functionsToInstrument);
+  return PreservedAnalyses::none();
+}
+
+void UnsafeFunctionTrackerPass::emitTracking(Module &M,
+                                             ArrayRef<FunctionMetadata> metadata,
+                                             ArrayRef<Function *> functionsToInstrument) {
+  LLVMContext &Ctx = M.getContext();
+
+  NumFunctionsTracked += metadata.size();
+  for (const auto &meta : metadata)
+    if (meta.hasUnsafeInst)
+      ++NumUnsafeFunctions;
+
+  // Optional compile-time sidecar so the aggregator can resolve names
+  // offline; the binary itself carries only numeric IDs.
+  if (!UnsafeFuncSidecarDir.empty())
+    writeFunctionSidecar(M, getUnsafeModuleHash(M), metadata,
+                         functionsToInstrument);
+
   // Phase 2: Setup runtime functions
   Type *VoidTy = Type::getVoidTy(Ctx);
   Type *Int32Ty = Type::getInt32Ty(Ctx);
   Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
   
+  // __unsafe_init_metadata(table, count, module_hash): module_hash is the
+  // 64-bit content hash qualifying this module's function IDs; the runtime
+  // carries it into the dump next to the IDs so shards built from
+  // different module versions merge by (hash, id) instead of colliding.
   FunctionCallee InitMetadataFn = M.getOrInsertFunction(
     INIT_METADATA_FN,
-    FunctionType::get(VoidTy, {Int8PtrTy, Int32Ty}, false)
+    FunctionType::get(VoidTy, {Int8PtrTy, Int32Ty, Type::getInt64Ty(Ctx)},
+                      false)
   );
   
   FunctionCallee RecordFunctionFn = M.getOrInsertFunction(
@@ -191,7 +359,9 @@ PreservedAnalyses UnsafeFunctionTrackerPass::run(Module &M, ModuleAnalysisManage
     MetadataArray, "__unsafe_metadata_table"
   );
   GV->setAlignment(Align(8));
-  
+  placeUnsafeTableGlobal(GV);
+  NumFunctionTableBytes += M.getDataLayout().getTypeAllocSize(ArrayTy);
+
   // Phase 4: Create initialization function
   Function *InitFunc = Function::Create(
     FunctionType::get(VoidTy, false),
@@ -202,32 +372,61 @@ PreservedAnalyses UnsafeFunctionTrackerPass::run(Module &M, ModuleAnalysisManage
   BasicBlock *InitBB = BasicBlock::Create(Ctx, "entry", InitFunc);
   IRBuilder<> Builder(InitBB);
   
-  Value *TablePtr = Builder.CreateBitCast(GV, Int8PtrTy);
+  Value *TablePtr;
+  if (unsafeExternTablesEnabled()) {
+    // The flag table goes to the excluded section; a null pointer tells
+    // the runtime to keep only per-ID counts for offline joining.
+    externalizeUnsafeTable(GV, UnsafeExternFunctionMetadata);
+    TablePtr = ConstantPointerNull::get(cast<PointerType>(Int8PtrTy));
+  } else {
+    TablePtr = Builder.CreateBitCast(GV, Int8PtrTy);
+  }
   Value *Count = ConstantInt::get(Int32Ty, metadata.size());
-  Builder.CreateCall(InitMetadataFn, {TablePtr, Count});
+  Value *ModuleHash =
+      ConstantInt::get(Type::getInt64Ty(Ctx), getUnsafeModuleHash(M));
+  Builder.CreateCall(InitMetadataFn, {TablePtr, Count, ModuleHash});
   Builder.CreateRetVoid();
-  
-  appendToGlobalCtors(M, InitFunc, 0);
-  
-  // Register destructor
-  if (auto *F = dyn_cast<Function>(DumpStatsFn.getCallee())) {
+
+  placeUnsafeInstrThunk(InitFunc);
+  GlobalVariable *LazyRegFlag = nullptr;
+  if (unsafeLazyRegistrationEnabled()) {
+    // Startup pays for this module only if one of its functions actually
+    // runs: the entry records below call InitFunc on their first firing.
+    LazyRegFlag =
+        createLazyRegistrationFlag(M, "__unsafe_module_init.registered");
+    makeLazyRegistration(InitFunc, LazyRegFlag);
+  } else {
+    appendToGlobalCtors(M, InitFunc, 0);
+  }
+
+  // Register destructor. In shared-memory mode the publish hook replaces
+  // the per-process dump.
+  if (unsafeShmStatsEnabled()) {
+    emitShmStatsHooks(M);
+  } else if (auto *F = dyn_cast<Function>(DumpStatsFn.getCallee())) {
+    // Under -unsafe-stats-output-template the dump writes shards instead
+    // of appending to the fixed CWD name.
+    emitStatsOutputTemplateHook(M);
     appendToGlobalDtors(M, F, 0);
   }
   
   // Phase 5: Instrument function entries
   for (Function *F : functionsToInstrument) {
     BasicBlock &EntryBB = F->getEntryBlock();
-    IRBuilder<> EntryBuilder(&EntryBB.front());
+    // Dormant builds gate the entry record on the func family byte.
+    Instruction *ProbePoint = emitProbeFamilyGate(&EntryBB.front(), "func");
+    if (LazyRegFlag)
+      emitLazyRegistrationCheck(ProbePoint, InitFunc, LazyRegFlag);
+    IRBuilder<> EntryBuilder(ProbePoint);
     
     // Get function ID from metadata
     MDNode *MD = F->getMetadata(FUNCTION_ID_METADATA);
     ConstantAsMetadata *CMD = cast<ConstantAsMetadata>(MD->getOperand(0));
     ConstantInt *IdConst = cast<ConstantInt>(CMD->getValue());
     
-    EntryBuilder.CreateCall(RecordFunctionFn, {IdConst});
+    setUnsafeProbeCallConv(
+        EntryBuilder.CreateCall(RecordFunctionFn, {IdConst}));
   }
-  
-  return PreservedAnalyses::none();
 }
 
 } // namespace llvm
@@ -9,89 +9,1015 @@
 #include "llvm/Transforms/UnsafeCount/UnsafeInstCounter.h"
 #include "llvm/Transforms/UnsafeCount/UnsafeFunctionTracker.h"
 #include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/InstMarker/UnsafeRegionAnalysis.h"
+#include "llvm/Transforms/InstMarker/UnsafeStatsFormat.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "unsafe-inst-counter"
+
+STATISTIC(NumBlockCounterSlots,
+          "Number of execution-counter slots emitted (after coalescing)");
+STATISTIC(NumBlockTableBytes,
+          "Bytes of static block-count tables emitted");
+STATISTIC(NumDiamondRecordsMerged,
+          "Number of per-arm record slots merged into join blocks");
+STATISTIC(NumLoopCountersHoisted,
+          "Number of counter increments hoisted out of counted loops");
+STATISTIC(NumCountColumnsOverflowed,
+          "Number of u16 count columns saturated into the overflow sidecar");
+STATISTIC(NumPGOCountersBorrowed,
+          "Number of block counters borrowed from PGO instrumentation");
+STATISTIC(NumColdFunctionsSuppressed,
+          "Number of cold functions collapsed to a single entry counter");
+
+// Counter coalescing: blocks that provably execute the same number of times
+// can share one counter slot, the way PGOInstrumentationGen places counters
+// on a minimal edge set. On tight multi-block loop bodies this removes most
+// of the per-iteration counter updates, close enough to free running that
+// counter-mode timings become usable as a cross-check against cpu_cycle
+// mode.
+static cl::opt<bool> UnsafeCounterCoalesce(
+  "unsafe-counter-coalesce", cl::init(false), cl::Hidden,
+  cl::desc("Share one execution counter between blocks that execute the "
+           "same number of times")
+);
+
+// Counted-loop scaling: a block inside a loop whose trip count
+// ScalarEvolution proves constant executes exactly (entries x trip) times,
+// so its per-iteration increment is pure waste — one counter in the
+// preheader plus the static trip count reconstructs everything. Kernels
+// that are entirely counted loops (matrixmultiply) pay near zero in
+// counter mode with this on. Symbolic trip counts stay dynamic; a static
+// table cannot carry them.
+static cl::opt<bool> UnsafeCounterLoopScale(
+  "unsafe-counter-loop-scale", cl::init(false), cl::Hidden,
+  cl::desc("Hoist block counters out of constant-trip-count loops, "
+           "recording the trip count as a static multiplier")
+);
+
+// Diamond merging: the arms of an if/else frequently carry identical
+// per-block counts, yet each gets its own record slot and increment —
+// instrumented simd-json text grows 2.3x, and in code-size-sensitive loops
+// the icache misses distort the very cycle numbers being measured. When
+// every predecessor of a join records the same counts and branches nowhere
+// else, the join executes exactly as often as all arms together, so one
+// slot at the join replaces the per-arm slots with no change to the
+// reported totals.
+static cl::opt<bool> UnsafeCounterMergeDiamonds(
+  "unsafe-counter-merge-diamonds", cl::init(false), cl::Hidden,
+  cl::desc("Merge identical-count record slots from branch arms into their "
+           "unique join block")
+);
+
+// Report-only mode: for static-density triage the dynamic side — counter
+// arrays, ctors, the perf runtime, the benchmark run — is pure overhead.
+// When a directory is given, the pass runs its usual per-block
+// classification but writes one TSV line per function at compile time and
+// mutates no IR, so a density query is a compile, not a build-and-run.
+static cl::opt<std::string> UnsafeCounterReportDir(
+  "unsafe-counter-report-dir", cl::init(""), cl::Hidden,
+  cl::desc("Write per-function static unsafe instruction counts into this "
+           "directory instead of emitting instrumentation (empty = off)")
+);
+
+// Per-CPU counters over the rseq area: the block execution counters are
+// the highest-frequency probes we emit — in memchr kernels they fire
+// billions of times — and each one pays a lock-prefixed RMW on a counter
+// shared by every thread. Under this flag the counters become a
+// [max-cpus x num-slots] matrix and a probe turns into a plain
+// load/add/store on the current CPU's row, indexed through the rseq area
+// glibc registers for every thread (cpu_id_start at byte 8 of the area,
+// found at the thread pointer plus the exported __rseq_offset). That is
+// the tcmalloc per-CPU pattern minus the kernel-assisted commit: the
+// full restartable sequence needs target asm these IR passes do not emit
+// (the same line we drew for dormant-probe nop sleds), so an increment
+// straddling a migration can race the row's new owner once per
+// migration — noise orders of magnitude below sampling. Without rseq
+// registration cpu_id_start reads 0 and every thread degrades to row 0.
+static cl::opt<bool> UnsafeRseqCounters(
+  "unsafe-rseq-counters", cl::init(false), cl::Hidden,
+  cl::desc("Count block executions in per-CPU rows indexed through the "
+           "glibc rseq area instead of shared atomic counters")
+);
+
+// Rounded up to a power of two so the cpu id masks into range instead of
+// bounds-checking; an id past the matrix (more CPUs than configured)
+// aliases a row rather than faulting.
+static cl::opt<unsigned> UnsafeRseqMaxCpus(
+  "unsafe-rseq-max-cpus", cl::init(128), cl::Hidden,
+  cl::desc("Row count of the per-CPU counter matrix")
+);
+
+// Region-mix report: the six UnsafeCategory buckets cannot distinguish a
+// vectorized memchr kernel from scalar pointer chasing. For vectorization
+// studies this writes one compile-time TSV row per unsafe region with a
+// finer histogram — vector vs. scalar loads/stores, atomics, shuffles, fp
+// and integer arithmetic — classified from the opcode plus operand types.
+// Purely static, so it coexists with instrumentation or report-only mode
+// and needs no run of the binary; joining against the block execution
+// counts is the aggregator's job.
+static cl::opt<std::string> UnsafeRegionMixDir(
+  "unsafe-region-mix-dir", cl::init(""), cl::Hidden,
+  cl::desc("Write per-region instruction-mix histograms into this directory "
+           "(empty = off)")
+);
+
+// Guarded tables: counter probes index the execution-counter arrays with
+// IDs this pass assigned itself, so a per-firing bounds check buys
+// nothing on correct builds — but rseq mode's cpu-id row mask is exactly
+// such a check in disguise, and it hides oversized ids by silently
+// aliasing rows. Under this flag the counter slots move out of the
+// static global into a runtime mmap with a trailing PROT_NONE guard
+// page: the registration ctor allocates and publishes the base pointer,
+// probes index raw (rseq mode drops its mask), and a wild index faults
+// into the guard instead of corrupting a neighboring global. Costs one
+// pointer load per firing; off by default because the static arrays are
+// the shipped layout. Instrumented code reached from an earlier ctor
+// faults on the still-null base pointer — loud, like the guard, never
+// corrupting.
+static cl::opt<bool> UnsafeGuardedTables(
+  "unsafe-guarded-tables", cl::init(false), cl::Hidden,
+  cl::desc("Allocate execution-counter tables at startup with a trailing "
+           "guard page and let probes index them unchecked")
+);
+
+// PGO coexistence: -C profile-generate already counts block executions,
+// so running both instrumentations pays two per-block counter updates for
+// one piece of information. Under this flag a block whose lowered PGO
+// counter update still sits in the block (an unpromoted increment of a
+// __profc_ slot) keeps no counter of its own: its table row is registered
+// against the PGO slot, and the runtime reads that slot at dump time in
+// place of the row's execution counter. Counters the promoter rewrote,
+// and blocks PGO left uncounted, fall back to our own increment, so
+// coverage is unchanged — only the duplicated updates go. Borrowed rows
+// bypass the dormant-probe gate and the rseq/guarded layouts: their
+// updates belong to PGO, which does not toggle.
+static cl::opt<bool> UnsafeCounterBorrowPGO(
+  "unsafe-counter-borrow-pgo", cl::init(false), cl::Hidden,
+  cl::desc("Reuse PGO block counters for blocks where the granularity "
+           "coincides instead of emitting a second counter")
+);
+
+// Cold-function suppression: most instrumented functions run a handful of
+// times, and their per-block probes are code size, startup registration
+// and measurement noise with negligible signal. When PGO data proves a
+// function cold, this mode collapses it to one summed table row with a
+// single counter in the entry block, concentrating full instrumentation
+// on the hot paths. A cold function then reports its whole-function
+// static counts scaled by entry executions rather than exact per-block
+// totals — indistinguishable at the execution counts that make a function
+// cold, and exactly zero for the many functions that never run. Builds
+// without profile data are unaffected: nothing is provably cold.
+static cl::opt<bool> UnsafeCounterColdSuppress(
+  "unsafe-counter-cold-suppress", cl::init(false), cl::Hidden,
+  cl::desc("With PGO data, collapse probes in provably-cold functions to "
+           "a single entry counter")
+);
+
 namespace {
 
-constexpr const char *RECORD_BLOCK_FN = "__unsafe_record_block";
+constexpr const char *REGISTER_BLOCKS_FN = "__unsafe_register_block_counts";
+constexpr const char *REGISTER_BLOCKS_PERCPU_FN =
+    "__unsafe_register_block_counts_percpu";
+constexpr const char *REGISTER_BLOCK_OVERFLOW_FN =
+    "__unsafe_register_block_overflow";
+constexpr const char *REGISTER_BLOCK_BORROWED_FN =
+    "__unsafe_register_block_borrowed";
+constexpr const char *ALLOC_GUARDED_FN = "unsafe_instr_alloc_guarded";
 
-/// \brief Check if instruction is a marker
-static bool isMarkerInstruction(const Instruction &I, bool &isBegin, bool &isEnd) {
-  isBegin = false;
-  isEnd = false;
-  
-  if (auto *CI = dyn_cast<CallBase>(&I)) {
-    if (auto *IA = dyn_cast<InlineAsm>(CI->getCalledOperand()->stripPointerCasts())) {
-      StringRef AsmStr = IA->getAsmString();
-      if (AsmStr == UNSAFE_MARKER_BEGIN) {
-        isBegin = true;
-        return true;
-      }
-      if (AsmStr == UNSAFE_MARKER_END) {
-        isEnd = true;
-        return true;
-      }
-    }
-  }
-  return false;
+/// \brief Row count of the per-CPU matrix: -unsafe-rseq-max-cpus rounded
+/// up to a power of two.
+static uint64_t rseqRowCount() {
+  return PowerOf2Ceil(std::max<uint64_t>(1, UnsafeRseqMaxCpus));
 }
 
 /// \brief Check if function should be instrumented
 static bool shouldInstrumentFunction(const Function &F) {
   if (F.isDeclaration() || F.isIntrinsic())
     return false;
-  
+
+  // Targeted runs (-unsafe-instr-funcs) probe only the listed functions.
+  if (!unsafeInstrFuncFilterAllows(F))
+    return false;
+
   StringRef Name = F.getName();
-  return !Name.startswith("__unsafe_") && 
+  return !Name.startswith("__unsafe_") &&
          !Name.startswith("llvm.");
 }
 
-/// \brief Get or create the record block function
-static FunctionCallee getOrCreateRecordBlockFn(Module &M) {
+/// \brief Get or create the block-table registration function
+static FunctionCallee getOrCreateRegisterBlocksFn(Module &M) {
   LLVMContext &Ctx = M.getContext();
   Type *VoidTy = Type::getVoidTy(Ctx);
   Type *Int32Ty = Type::getInt32Ty(Ctx);
-  Type *Int16Ty = Type::getInt16Ty(Ctx);
-  
-  // __unsafe_record_block(func_id, total, unsafe_total, load, store, call, cast, gep, other)
-  FunctionCallee RecordBlockFn = M.getOrInsertFunction(
-    RECORD_BLOCK_FN,
-    FunctionType::get(VoidTy, {Int32Ty, Int32Ty, Int32Ty,
-                               Int16Ty, Int16Ty, Int16Ty, 
-                               Int16Ty, Int16Ty, Int16Ty}, false)
+  Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+  Type *Int64PtrTy = PointerType::get(Type::getInt64Ty(Ctx), 0);
+
+  // __unsafe_register_block_counts(counts_table, exec_counters, num_blocks,
+  // module_hash): module_hash is the 64-bit content hash qualifying the
+  // func_id column of the rows, which lives in the tracker's per-module ID
+  // space; the runtime dumps it next to the IDs so shards from different
+  // builds merge by (hash, id).
+  FunctionCallee RegisterFn = M.getOrInsertFunction(
+    REGISTER_BLOCKS_FN,
+    FunctionType::get(VoidTy,
+                      {Int8PtrTy, Int64PtrTy, Int32Ty, Type::getInt64Ty(Ctx)},
+                      false)
   );
-  
-  if (auto *F = dyn_cast<Function>(RecordBlockFn.getCallee())) {
+
+  if (auto *F = dyn_cast<Function>(RegisterFn.getCallee())) {
     F->addFnAttr(Attribute::NoInline);
     F->setLinkage(GlobalValue::ExternalLinkage);
   }
-  
-  return RecordBlockFn;
+
+  return RegisterFn;
+}
+
+/// \brief Get or create the guarded-table allocator.
+///
+/// Runtime contract (unsafe_instr_alloc_guarded): returns a zeroed,
+/// page-aligned mapping of slots*8 bytes rounded up to whole pages, with
+/// at least one PROT_NONE guard page behind it, and never fails (it
+/// aborts on mmap failure — startup, not a probe, is the right place to
+/// die). A probe indexing past the table faults into the guard instead
+/// of corrupting whatever global the linker placed next.
+static FunctionCallee getOrCreateAllocGuardedFn(Module &M) {
+  LLVMContext &Ctx = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Type *Int64PtrTy = PointerType::get(Int64Ty, 0);
+  return M.getOrInsertFunction(
+      ALLOC_GUARDED_FN, FunctionType::get(Int64PtrTy, {Int64Ty}, false));
+}
+
+/// \brief Get or create the per-CPU block-table registration function.
+///
+/// __unsafe_register_block_counts_percpu(counts_table, percpu_rows,
+/// num_blocks, max_cpus, module_hash): percpu_rows is a
+/// [max_cpus x num_blocks] i64 matrix; the runtime folds it column-wise at
+/// dump time, then multiplies table rows by the folded execution counts as
+/// usual. module_hash qualifies the rows' func_id column like the flat
+/// registration's.
+static FunctionCallee getOrCreateRegisterBlocksPerCpuFn(Module &M) {
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+  Type *Int64PtrTy = PointerType::get(Type::getInt64Ty(Ctx), 0);
+
+  FunctionCallee RegisterFn = M.getOrInsertFunction(
+    REGISTER_BLOCKS_PERCPU_FN,
+    FunctionType::get(VoidTy,
+                      {Int8PtrTy, Int64PtrTy, Int32Ty, Int32Ty,
+                       Type::getInt64Ty(Ctx)},
+                      false)
+  );
+
+  if (auto *F = dyn_cast<Function>(RegisterFn.getCallee())) {
+    F->addFnAttr(Attribute::NoInline);
+    F->setLinkage(GlobalValue::ExternalLinkage);
+  }
+
+  return RegisterFn;
+}
+
+/// \brief Get or create the overflow-sidecar registration function.
+///
+/// __unsafe_register_block_overflow(counts_table, entries, num_entries):
+/// entries is an i64 array of (row, column, value) triples, num_entries
+/// the triple count. At dump time the runtime substitutes each triple's
+/// value for the saturated 0xFFFF in the named row and column of the
+/// table it was registered against.
+static FunctionCallee getOrCreateRegisterBlockOverflowFn(Module &M) {
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+  Type *Int64PtrTy = PointerType::get(Type::getInt64Ty(Ctx), 0);
+
+  FunctionCallee RegisterFn = M.getOrInsertFunction(
+    REGISTER_BLOCK_OVERFLOW_FN,
+    FunctionType::get(VoidTy, {Int8PtrTy, Int64PtrTy, Int32Ty}, false)
+  );
+
+  if (auto *F = dyn_cast<Function>(RegisterFn.getCallee())) {
+    F->addFnAttr(Attribute::NoInline);
+    F->setLinkage(GlobalValue::ExternalLinkage);
+  }
+
+  return RegisterFn;
+}
+
+/// \brief Get or create the borrowed-counter registration function.
+///
+/// __unsafe_register_block_borrowed(counts_table, entries, num_entries):
+/// entries is an array of {i64 row, i64* slot} pairs. At dump time the
+/// runtime reads *slot as the row's execution count in place of the
+/// row's slot in the execution-counter array, which stays zero. The
+/// slots point into PGO's __profc_ arrays, so the entries must stay in
+/// the loaded image even when the constant tables are externalized.
+static FunctionCallee getOrCreateRegisterBlockBorrowedFn(Module &M) {
+  LLVMContext &Ctx = M.getContext();
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+
+  FunctionCallee RegisterFn = M.getOrInsertFunction(
+    REGISTER_BLOCK_BORROWED_FN,
+    FunctionType::get(VoidTy, {Int8PtrTy, Int8PtrTy, Int32Ty}, false)
+  );
+
+  if (auto *F = dyn_cast<Function>(RegisterFn.getCallee())) {
+    F->addFnAttr(Attribute::NoInline);
+    F->setLinkage(GlobalValue::ExternalLinkage);
+  }
+
+  return RegisterFn;
+}
+
+/// \brief Entry layout of the borrowed-counter sidecar: row index in the
+/// count table, then the PGO counter slot holding that row's execution
+/// count.
+static StructType *getBorrowedEntryTy(LLVMContext &Ctx) {
+  return StructType::get(Type::getInt64Ty(Ctx),
+                         PointerType::get(Type::getInt64Ty(Ctx), 0));
+}
+
+/// \brief Find the PGO counter slot that counts executions of \p BB.
+///
+/// By the late pass position PGOInstrumentationGen's intrinsics are
+/// already lowered, so a per-block counter appears as an unpromoted
+/// load/add-1/store — or atomic add 1 — on a constant slot of a __profc_
+/// array. Such an update runs exactly once per execution of the block
+/// and nothing else touches its slot, so the slot's final value is the
+/// block's execution count. A counter the promoter moved out of the
+/// block is not found here, and the block keeps its own increment; an
+/// unlowered llvm.instrprof.increment is skipped for the same reason —
+/// its counter global does not exist yet to point at.
+static Constant *findBorrowablePGOCounter(BasicBlock &BB) {
+  auto SlotOf = [](Value *Ptr) -> Constant * {
+    auto *C = dyn_cast<Constant>(Ptr);
+    if (!C)
+      return nullptr;
+    auto *GV = dyn_cast<GlobalVariable>(getUnderlyingObject(C));
+    if (!GV || !GV->getName().startswith("__profc_"))
+      return nullptr;
+    return C;
+  };
+
+  for (Instruction &I : BB) {
+    if (auto *RMW = dyn_cast<AtomicRMWInst>(&I)) {
+      auto *Step = dyn_cast<ConstantInt>(RMW->getValOperand());
+      if (RMW->getOperation() == AtomicRMWInst::Add && Step && Step->isOne())
+        if (Constant *Slot = SlotOf(RMW->getPointerOperand()))
+          return Slot;
+      continue;
+    }
+    auto *SI = dyn_cast<StoreInst>(&I);
+    if (!SI)
+      continue;
+    Constant *Slot = SlotOf(SI->getPointerOperand());
+    if (!Slot)
+      continue;
+    auto *AddV = dyn_cast<BinaryOperator>(SI->getValueOperand());
+    if (!AddV || AddV->getOpcode() != Instruction::Add)
+      continue;
+    auto *LI = dyn_cast<LoadInst>(AddV->getOperand(0));
+    auto *Step = dyn_cast<ConstantInt>(AddV->getOperand(1));
+    if (!LI || !Step || !Step->isOne() ||
+        LI->getPointerOperand() != SI->getPointerOperand())
+      continue;
+    return Slot;
+  }
+  return nullptr;
+}
+
+/// \brief Row layout of the static per-block count table.
+///
+/// One row per instrumented block: the columns of the old
+/// __unsafe_record_block call preceded by the function id. All of them are
+/// compile-time constants; only the matching slot in the execution-counter
+/// array changes at run time, and the runtime multiplies row by counter at
+/// dump time.
+static StructType *getBlockCountsRowTy(LLVMContext &Ctx) {
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int16Ty = Type::getInt16Ty(Ctx);
+  // The trailing multiplier is 1 except for counted-loop-scaled rows; the
+  // runtime folds it into the slot's execution count at dump time and
+  // takes the extra column in lockstep.
+  return StructType::get(
+    Int32Ty,                                              // func_id
+    Int32Ty, Int32Ty,                                     // total, unsafe_total
+    Int16Ty, Int16Ty, Int16Ty, Int16Ty, Int16Ty, Int16Ty, // per-category
+    Int32Ty,                                              // unsafe_elems
+    Int16Ty, Int16Ty, Int16Ty, Int16Ty, Int16Ty, Int16Ty, // element-scaled
+    Int32Ty                                               // exec_multiplier
+  );
+}
+
+/// \brief Number of vector elements an instruction operates on, or 1 for
+/// scalar instructions.
+///
+/// Stores report the stored value's type since their own result type is
+/// void; everything else uses the result type. Scalable vectors have no
+/// compile-time element count and are treated as scalar.
+static uint32_t getElementScale(const Instruction &I) {
+  Type *Ty = I.getType();
+  if (auto *SI = dyn_cast<StoreInst>(&I))
+    Ty = SI->getValueOperand()->getType();
+  if (auto *VTy = dyn_cast<FixedVectorType>(Ty))
+    return VTy->getNumElements();
+  return 1;
+}
+
+/// \brief Build one constant row of the static count table.
+///
+/// The u16 category columns saturate rather than truncate: counts
+/// accumulate at full width in BlockCounts (optimized, vector-scaled, or
+/// coalesced blocks can exceed 65535 units), and a column that does not
+/// fit is emitted as 0xFFFF with the exact value spilled to the overflow
+/// sidecar as an (row, column, value) i64 triple appended to
+/// \p OverflowWords. Columns number 0-5 for the per-category group and
+/// 6-11 for the element-scaled group, in UnsafeCategory order. Keeping
+/// the hot rows at u16 preserves the table's cache footprint; overflow is
+/// rare enough to live in a cold side table.
+static Constant *buildCountsRow(StructType *RowTy, uint32_t FuncId,
+                                const UnsafeInstCounterPass::BlockCounts &C,
+                                uint32_t RowIdx,
+                                SmallVectorImpl<Constant *> &OverflowWords) {
+  using UIC = UnsafeInstCounterPass;
+  LLVMContext &Ctx = RowTy->getContext();
+  Type *Int16Ty = Type::getInt16Ty(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  auto SatCol = [&](uint32_t V, unsigned Col) -> Constant * {
+    if (V <= UINT16_MAX)
+      return ConstantInt::get(Int16Ty, V);
+    ++NumCountColumnsOverflowed;
+    OverflowWords.push_back(ConstantInt::get(Int64Ty, RowIdx));
+    OverflowWords.push_back(ConstantInt::get(Int64Ty, Col));
+    OverflowWords.push_back(ConstantInt::get(Int64Ty, V));
+    return ConstantInt::get(Int16Ty, UINT16_MAX);
+  };
+  return ConstantStruct::get(
+    RowTy,
+    ConstantInt::get(Int32Ty, FuncId),
+    ConstantInt::get(Int32Ty, C.totalInsts),
+    ConstantInt::get(Int32Ty, C.totalUnsafeInsts),
+    SatCol(C.unsafeCounts[UIC::UNSAFE_LOAD], 0),
+    SatCol(C.unsafeCounts[UIC::UNSAFE_STORE], 1),
+    SatCol(C.unsafeCounts[UIC::UNSAFE_CALL], 2),
+    SatCol(C.unsafeCounts[UIC::UNSAFE_CAST], 3),
+    SatCol(C.unsafeCounts[UIC::UNSAFE_GEP], 4),
+    SatCol(C.unsafeCounts[UIC::UNSAFE_OTHER], 5),
+    ConstantInt::get(Int32Ty, C.totalUnsafeElems),
+    SatCol(C.unsafeElemCounts[UIC::UNSAFE_LOAD], 6),
+    SatCol(C.unsafeElemCounts[UIC::UNSAFE_STORE], 7),
+    SatCol(C.unsafeElemCounts[UIC::UNSAFE_CALL], 8),
+    SatCol(C.unsafeElemCounts[UIC::UNSAFE_CAST], 9),
+    SatCol(C.unsafeElemCounts[UIC::UNSAFE_GEP], 10),
+    SatCol(C.unsafeElemCounts[UIC::UNSAFE_OTHER], 11),
+    ConstantInt::get(Int32Ty, C.execMultiplier));
+}
+
+/// \brief Emit the atomic per-execution increment for \p BB's slot \p Idx in
+/// the execution-counter array.
+static void emitBlockIncrement(BasicBlock &BB, ArrayType *CountersTy,
+                               GlobalVariable *CountersGV, uint64_t Idx,
+                               uint64_t NumSlots) {
+  LLVMContext &Ctx = BB.getContext();
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Type *Int64PtrTy = PointerType::get(Int64Ty, 0);
+  // Dormant builds gate the increment on the counter family byte.
+  IRBuilder<> Builder(emitProbeFamilyGate(BB.getTerminator(), "counter"));
+
+  // Guarded mode: the slots live in the runtime's guard-page-backed
+  // mapping, and the global only holds its base pointer.
+  Value *GuardedBase =
+      UnsafeGuardedTables
+          ? Builder.CreateLoad(Int64PtrTy, CountersGV, "exec_counters")
+          : nullptr;
+
+  if (UnsafeRseqCounters) {
+    // Thread pointer plus glibc's exported __rseq_offset locates the
+    // per-thread rseq area; cpu_id_start at byte 8 always holds an
+    // in-range CPU number (0 when rseq is unregistered), and the mask
+    // keeps oversized ids inside the matrix. Guarded mode indexes the id
+    // raw: CPU numbers are machine-bounded, and one past the configured
+    // rows lands in the guard instead of aliasing a row.
+    Module &M = *BB.getModule();
+    Type *Int8Ty = Type::getInt8Ty(Ctx);
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    GlobalVariable *RseqOffset = M.getGlobalVariable("__rseq_offset");
+    if (!RseqOffset)
+      RseqOffset = new GlobalVariable(M, Int64Ty, /*isConstant=*/false,
+                                      GlobalValue::ExternalLinkage,
+                                      /*Initializer=*/nullptr,
+                                      "__rseq_offset");
+    Value *TP = Builder.CreateIntrinsic(PointerType::getUnqual(Ctx),
+                                        Intrinsic::thread_pointer, {});
+    Value *Area =
+        Builder.CreateGEP(Int8Ty, TP, Builder.CreateLoad(Int64Ty, RseqOffset));
+    Value *Cpu = Builder.CreateLoad(
+        Int32Ty, Builder.CreateConstGEP1_64(Int8Ty, Area, 8));
+    Value *Row = Builder.CreateZExt(Cpu, Int64Ty);
+    if (!GuardedBase)
+      Row = Builder.CreateAnd(Row,
+                              ConstantInt::get(Int64Ty, rseqRowCount() - 1));
+    Value *SlotIdx = Builder.CreateAdd(
+        Builder.CreateMul(Row, ConstantInt::get(Int64Ty, NumSlots)),
+        ConstantInt::get(Int64Ty, Idx));
+    Value *Slot =
+        GuardedBase
+            ? Builder.CreateInBoundsGEP(Int64Ty, GuardedBase, SlotIdx)
+            : Builder.CreateInBoundsGEP(
+                  CountersTy, CountersGV,
+                  {ConstantInt::get(Int64Ty, 0), SlotIdx});
+    Value *Cur = Builder.CreateLoad(Int64Ty, Slot);
+    StoreInst *Inc = Builder.CreateStore(
+        Builder.CreateAdd(Cur, ConstantInt::get(Int64Ty, 1)), Slot);
+    attachProbeId(Inc, "counter", static_cast<unsigned>(Idx));
+    return;
+  }
+
+  Value *Slot =
+      GuardedBase
+          ? Builder.CreateConstInBoundsGEP1_64(Int64Ty, GuardedBase, Idx)
+          : Builder.CreateConstInBoundsGEP2_64(CountersTy, CountersGV, 0, Idx);
+  AtomicRMWInst *Inc =
+    Builder.CreateAtomicRMW(AtomicRMWInst::Add, Slot,
+                            ConstantInt::get(Int64Ty, 1), MaybeAlign(8),
+                            AtomicOrdering::Monotonic);
+  attachProbeId(Inc, "counter", static_cast<unsigned>(Idx));
+}
+
+/// \brief Emit the borrowed-counter sidecar array, or null when no
+/// counters were borrowed.
+static GlobalVariable *emitBorrowedSidecar(Module &M, const Twine &Name,
+                                           ArrayRef<Constant *> Entries) {
+  if (Entries.empty())
+    return nullptr;
+  ArrayType *Ty = ArrayType::get(getBorrowedEntryTy(M.getContext()),
+                                 Entries.size());
+  auto *GV = new GlobalVariable(
+      M, Ty, /*isConstant=*/true, GlobalValue::InternalLinkage,
+      ConstantArray::get(Ty, SmallVector<Constant *, 8>(Entries.begin(),
+                                                        Entries.end())),
+      Name);
+  GV->setAlignment(Align(8));
+  placeUnsafeTableGlobal(GV);
+  return GV;
+}
+
+/// \brief Emit a ctor that hands both arrays to the runtime.
+///
+/// \p OverflowGV, when non-null, is the i64 triple array of saturated
+/// count columns; it rides the same ctor so the runtime sees the sidecar
+/// before any dump can read the table.
+static void emitRegistrationCtor(Module &M, const Twine &Name,
+                                 GlobalVariable *CountsGV,
+                                 GlobalVariable *CountersGV,
+                                 uint32_t NumBlocks,
+                                 GlobalVariable *OverflowGV = nullptr,
+                                 uint32_t NumOverflowEntries = 0,
+                                 GlobalVariable *BorrowedGV = nullptr,
+                                 uint32_t NumBorrowedEntries = 0) {
+  NumBlockCounterSlots += NumBlocks;
+  NumBlockTableBytes +=
+      M.getDataLayout().getTypeAllocSize(CountsGV->getValueType());
+
+  LLVMContext &Ctx = M.getContext();
+  Type *Int8PtrTy = PointerType::get(Type::getInt8Ty(Ctx), 0);
+  Type *Int64PtrTy = PointerType::get(Type::getInt64Ty(Ctx), 0);
+  Function *InitFunc = Function::Create(
+    FunctionType::get(Type::getVoidTy(Ctx), false),
+    GlobalValue::InternalLinkage, Name, &M);
+  BasicBlock *InitBB = BasicBlock::Create(Ctx, "entry", InitFunc);
+  IRBuilder<> InitBuilder(InitBB);
+  Value *CountsPtr;
+  if (unsafeExternTablesEnabled()) {
+    // The constant rows go to the excluded section; a null table tells the
+    // runtime to dump raw slot counts for the aggregator to join. The
+    // execution counters stay loadable — the probes write them. The
+    // overflow triples are constant too, so they follow the rows out.
+    externalizeUnsafeTable(CountsGV, UnsafeExternBlockCountRows);
+    if (OverflowGV)
+      externalizeUnsafeTable(OverflowGV, UnsafeExternBlockOverflowRows);
+    OverflowGV = nullptr;
+    CountsPtr = ConstantPointerNull::get(cast<PointerType>(Int8PtrTy));
+  } else {
+    CountsPtr = InitBuilder.CreateBitCast(CountsGV, Int8PtrTy);
+  }
+  Value *CountersPtr;
+  if (UnsafeGuardedTables) {
+    // Allocate the guarded slots and publish the base pointer the probes
+    // load; the runtime gets the same pointer to fold at dump time.
+    uint64_t CounterSlots =
+        UnsafeRseqCounters ? NumBlocks * rseqRowCount() : NumBlocks;
+    CountersPtr = InitBuilder.CreateCall(
+        getOrCreateAllocGuardedFn(M),
+        {ConstantInt::get(Type::getInt64Ty(Ctx), CounterSlots)});
+    InitBuilder.CreateStore(CountersPtr, CountersGV);
+  } else {
+    CountersPtr = InitBuilder.CreateBitCast(CountersGV, Int64PtrTy);
+  }
+  Constant *ModuleHash =
+      ConstantInt::get(Type::getInt64Ty(Ctx), getUnsafeModuleHash(M));
+  if (UnsafeRseqCounters) {
+    // The per-CPU matrix needs its row count to fold; everything else
+    // matches the flat registration.
+    FunctionCallee PerCpuFn = getOrCreateRegisterBlocksPerCpuFn(M);
+    InitBuilder.CreateCall(
+        PerCpuFn, {CountsPtr, CountersPtr,
+                   ConstantInt::get(Type::getInt32Ty(Ctx), NumBlocks),
+                   ConstantInt::get(Type::getInt32Ty(Ctx), rseqRowCount()),
+                   ModuleHash});
+  } else {
+    InitBuilder.CreateCall(
+        getOrCreateRegisterBlocksFn(M),
+        {CountsPtr, CountersPtr,
+         ConstantInt::get(Type::getInt32Ty(Ctx), NumBlocks), ModuleHash});
+  }
+  if (OverflowGV)
+    InitBuilder.CreateCall(
+        getOrCreateRegisterBlockOverflowFn(M),
+        {CountsPtr, InitBuilder.CreateBitCast(OverflowGV, Int64PtrTy),
+         ConstantInt::get(Type::getInt32Ty(Ctx), NumOverflowEntries)});
+  if (BorrowedGV)
+    InitBuilder.CreateCall(
+        getOrCreateRegisterBlockBorrowedFn(M),
+        {CountsPtr, InitBuilder.CreateBitCast(BorrowedGV, Int8PtrTy),
+         ConstantInt::get(Type::getInt32Ty(Ctx), NumBorrowedEntries)});
+  InitBuilder.CreateRetVoid();
+  placeUnsafeInstrThunk(InitFunc);
+  appendToGlobalCtors(M, InitFunc, 0);
+}
+
+/// \brief Open a per-module report file in \p Dir with the given suffix.
+///
+/// File naming and failure handling mirror the function-tracker sidecar:
+/// one file per codegen unit, and a write failure is a warning — the build
+/// still succeeds, only the report is lost.
+static std::unique_ptr<raw_fd_ostream>
+openModuleReport(const Module &M, StringRef Dir, StringRef Suffix) {
+  SmallString<128> FileName(sys::path::filename(M.getModuleIdentifier()));
+  for (char &C : FileName)
+    if (!isAlnum(C) && C != '.' && C != '-' && C != '_')
+      C = '_';
+
+  SmallString<256> Path(Dir);
+  sys::path::append(Path, FileName + Suffix);
+
+  std::error_code EC;
+  auto OS = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "warning: cannot write unsafe report " << Path << ": "
+           << EC.message() << "\n";
+    return nullptr;
+  }
+  return OS;
+}
+
+/// \brief Instruction-mix classes for the per-region histogram.
+///
+/// Finer than UnsafeCategory where the vectorization studies need it
+/// (vector vs. scalar memory ops, shuffles, fp vs. integer arithmetic),
+/// coarser where they don't (one call bucket, casts in other unless they
+/// convert to or from fp).
+enum MixCategory : uint8_t {
+  MIX_VECTOR_LOAD = 0,
+  MIX_VECTOR_STORE,
+  MIX_SCALAR_LOAD,
+  MIX_SCALAR_STORE,
+  MIX_ATOMIC,
+  MIX_SHUFFLE,
+  MIX_FP,
+  MIX_INT,
+  MIX_CALL,
+  MIX_OTHER,
+  MAX_MIX_CATEGORIES
+};
+
+/// \brief Classify one instruction for the region-mix histogram.
+static MixCategory classifyMix(const Instruction &I) {
+  switch (I.getOpcode()) {
+  case Instruction::Load: {
+    const auto &LI = cast<LoadInst>(I);
+    if (LI.isAtomic())
+      return MIX_ATOMIC;
+    return isa<VectorType>(LI.getType()) ? MIX_VECTOR_LOAD : MIX_SCALAR_LOAD;
+  }
+  case Instruction::Store: {
+    const auto &SI = cast<StoreInst>(I);
+    if (SI.isAtomic())
+      return MIX_ATOMIC;
+    return isa<VectorType>(SI.getValueOperand()->getType()) ? MIX_VECTOR_STORE
+                                                            : MIX_SCALAR_STORE;
+  }
+  case Instruction::AtomicRMW:
+  case Instruction::AtomicCmpXchg:
+  case Instruction::Fence:
+    return MIX_ATOMIC;
+  case Instruction::ShuffleVector:
+  case Instruction::InsertElement:
+  case Instruction::ExtractElement:
+    return MIX_SHUFFLE;
+  case Instruction::FNeg:
+  case Instruction::FAdd:
+  case Instruction::FSub:
+  case Instruction::FMul:
+  case Instruction::FDiv:
+  case Instruction::FRem:
+  case Instruction::FCmp:
+  case Instruction::FPExt:
+  case Instruction::FPTrunc:
+  case Instruction::FPToSI:
+  case Instruction::FPToUI:
+  case Instruction::SIToFP:
+  case Instruction::UIToFP:
+    return MIX_FP;
+  case Instruction::Add:
+  case Instruction::Sub:
+  case Instruction::Mul:
+  case Instruction::UDiv:
+  case Instruction::SDiv:
+  case Instruction::URem:
+  case Instruction::SRem:
+  case Instruction::Shl:
+  case Instruction::LShr:
+  case Instruction::AShr:
+  case Instruction::And:
+  case Instruction::Or:
+  case Instruction::Xor:
+  case Instruction::ICmp:
+    return MIX_INT;
+  case Instruction::Call:
+  case Instruction::Invoke:
+  case Instruction::CallBr:
+    return MIX_CALL;
+  default:
+    return MIX_OTHER;
+  }
+}
+
+/// \brief Write one TSV row per unsafe region of \p F.
+///
+/// Columns: name, region index (function-local, in marker order), the begin
+/// marker's source line (0 without debug info), total counted instructions,
+/// then the MAX_MIX_CATEGORIES histogram buckets in enum order.
+static void writeRegionMixRows(raw_fd_ostream &OS, const Function &F,
+                               const UnsafeRegionInfo &Regions) {
+  unsigned RegionIdx = 0;
+  for (const UnsafeRegion &R : Regions.regions()) {
+    uint32_t Hist[MAX_MIX_CATEGORIES] = {0};
+    uint32_t Total = 0;
+    for (const Instruction *I = R.Begin->getNextNode(); I && I != R.End;
+         I = I->getNextNode()) {
+      if (isa<DbgInfoIntrinsic>(I))
+        continue;
+      ++Total;
+      ++Hist[classifyMix(*I)];
+    }
+
+    unsigned Line = 0;
+    if (DebugLoc DL = R.Begin->getDebugLoc())
+      Line = DL.getLine();
+
+    OS << F.getName() << '\t' << RegionIdx++ << '\t' << Line << '\t' << Total;
+    for (unsigned Cat = 0; Cat < MAX_MIX_CATEGORIES; ++Cat)
+      OS << '\t' << Hist[Cat];
+    OS << '\n';
+  }
+}
+
+/// \brief Write one function's summed block counts as a TSV line.
+///
+/// Columns: name, analyzed blocks, then the count-table row minus func_id —
+/// total and unsafe instruction counts, the six per-category counts, and
+/// the element-scaled variants.
+static void writeDensityRow(raw_fd_ostream &OS, StringRef Name,
+                            size_t NumBlocks,
+                            const UnsafeInstCounterPass::BlockCounts &C) {
+  using UIC = UnsafeInstCounterPass;
+  OS << Name << '\t' << NumBlocks << '\t' << C.totalInsts << '\t'
+     << C.totalUnsafeInsts;
+  for (unsigned Cat = 0; Cat < UIC::MAX_UNSAFE_CATEGORIES; ++Cat)
+    OS << '\t' << C.unsafeCounts[Cat];
+  OS << '\t' << C.totalUnsafeElems;
+  for (unsigned Cat = 0; Cat < UIC::MAX_UNSAFE_CATEGORIES; ++Cat)
+    OS << '\t' << C.unsafeElemCounts[Cat];
+  OS << '\n';
 }
 
 } // anonymous namespace
 
 namespace llvm {
 
-UnsafeInstCounterPass::BlockCounts::BlockCounts() 
-  : totalInsts(0), totalUnsafeInsts(0) {
+UnsafeInstCounterPass::BlockCounts::BlockCounts()
+  : totalInsts(0), totalUnsafeInsts(0), totalUnsafeElems(0),
+    execMultiplier(1) {
   std::memset(unsafeCounts, 0, sizeof(unsafeCounts));
+  std::memset(unsafeElemCounts, 0, sizeof(unsafeElemCounts));
+}
+
+void UnsafeInstCounterPass::BlockCounts::add(const BlockCounts &Other) {
+  totalInsts += Other.totalInsts;
+  totalUnsafeInsts += Other.totalUnsafeInsts;
+  totalUnsafeElems += Other.totalUnsafeElems;
+  for (unsigned C = 0; C < MAX_UNSAFE_CATEGORIES; ++C) {
+    unsafeCounts[C] += Other.unsafeCounts[C];
+    unsafeElemCounts[C] += Other.unsafeElemCounts[C];
+  }
+}
+
+bool UnsafeInstCounterPass::BlockCounts::operator==(
+    const BlockCounts &Other) const {
+  if (totalInsts != Other.totalInsts ||
+      totalUnsafeInsts != Other.totalUnsafeInsts ||
+      totalUnsafeElems != Other.totalUnsafeElems)
+    return false;
+  for (unsigned C = 0; C < MAX_UNSAFE_CATEGORIES; ++C)
+    if (unsafeCounts[C] != Other.unsafeCounts[C] ||
+        unsafeElemCounts[C] != Other.unsafeElemCounts[C])
+      return false;
+  return true;
+}
+
+bool UnsafeInstCounterPass::coalesceEnabled() { return UnsafeCounterCoalesce; }
+
+bool UnsafeInstCounterPass::reportOnlyEnabled() {
+  return !UnsafeCounterReportDir.empty();
+}
+
+bool UnsafeInstCounterPass::coldSuppressEnabled() {
+  return UnsafeCounterColdSuppress;
+}
+
+void UnsafeInstCounterPass::coalesceEquivalentBlocks(
+    DominatorTree &DT, PostDominatorTree &PDT,
+    SmallVectorImpl<std::pair<BasicBlock *, BlockCounts>> &Blocks) {
+  if (Blocks.size() < 2)
+    return;
+
+  SmallDenseMap<BasicBlock *, const BlockCounts *, 16> Analyzed;
+  for (const auto &P : Blocks)
+    Analyzed[P.first] = &P.second;
+
+  SmallVector<std::pair<BasicBlock *, BlockCounts>, 16> Merged;
+  SmallDenseMap<BasicBlock *, unsigned, 16> SlotOf;
+
+  // Visit in reverse post-order so every dominator is slotted before the
+  // blocks it dominates.
+  ReversePostOrderTraversal<Function *> RPOT(Blocks.front().first->getParent());
+  for (BasicBlock *BB : RPOT) {
+    auto It = Analyzed.find(BB);
+    if (It == Analyzed.end())
+      continue;
+
+    // A block executes exactly as often as any dominator it also
+    // post-dominates: control cannot reach one without the other. Share the
+    // nearest such dominator's slot (transitively, its representative's).
+    unsigned Slot = ~0u;
+    for (auto *Node = DT.getNode(BB)->getIDom(); Node; Node = Node->getIDom()) {
+      auto SlotIt = SlotOf.find(Node->getBlock());
+      if (SlotIt != SlotOf.end() && PDT.dominates(BB, Node->getBlock())) {
+        Slot = SlotIt->second;
+        break;
+      }
+    }
+
+    if (Slot == ~0u) {
+      Slot = Merged.size();
+      Merged.push_back({BB, *It->second});
+    } else {
+      Merged[Slot].second.add(*It->second);
+    }
+    SlotOf[BB] = Slot;
+  }
+
+  // The traversal only sees reachable blocks; keep any unreachable
+  // instrumented block as its own slot rather than dropping its row.
+  for (const auto &P : Blocks)
+    if (!SlotOf.count(P.first))
+      Merged.push_back(P);
+
+  Blocks.swap(Merged);
+}
+
+bool UnsafeInstCounterPass::diamondMergeEnabled() {
+  return UnsafeCounterMergeDiamonds;
+}
+
+void UnsafeInstCounterPass::mergeDiamondRecords(
+    SmallVectorImpl<std::pair<BasicBlock *, BlockCounts>> &Blocks) {
+  if (Blocks.size() < 2)
+    return;
+
+  SmallDenseMap<BasicBlock *, unsigned, 16> IndexOf;
+  for (unsigned Idx = 0; Idx < Blocks.size(); ++Idx)
+    IndexOf[Blocks[Idx].first] = Idx;
+
+  SmallVector<bool, 16> Dead(Blocks.size(), false);
+
+  // Walk joins in layout order so the result does not depend on the order
+  // analysis produced the entries.
+  Function &F = *Blocks.front().first->getParent();
+  for (BasicBlock &Join : F) {
+    if (pred_size(&Join) < 2)
+      continue;
+
+    // Every predecessor must be a distinct live entry whose only successor
+    // is the join: then the join executes exactly as often as all arms
+    // together, and identical per-arm rows collapse into one row recorded
+    // at the join. A conditional branch with both edges to the join fails
+    // the distinctness test on purpose — it would double-count.
+    SmallPtrSet<BasicBlock *, 4> SeenArms;
+    SmallVector<unsigned, 4> ArmIdx;
+    bool Mergeable = true;
+    for (BasicBlock *Pred : predecessors(&Join)) {
+      auto It = IndexOf.find(Pred);
+      if (Pred == &Join || Pred->getSingleSuccessor() != &Join ||
+          It == IndexOf.end() || Dead[It->second] ||
+          !SeenArms.insert(Pred).second) {
+        Mergeable = false;
+        break;
+      }
+      ArmIdx.push_back(It->second);
+    }
+    if (!Mergeable || ArmIdx.size() < 2)
+      continue;
+
+    const BlockCounts &ArmCounts = Blocks[ArmIdx.front()].second;
+    bool Identical = true;
+    for (unsigned Idx : ArmIdx)
+      if (!(Blocks[Idx].second == ArmCounts)) {
+        Identical = false;
+        break;
+      }
+    if (!Identical)
+      continue;
+
+    // One execution of the join covers exactly one arm, so the shared row
+    // folds in once. A join without its own entry gets one holding only the
+    // arm row.
+    for (unsigned Idx : ArmIdx)
+      Dead[Idx] = true;
+    auto JoinIt = IndexOf.find(&Join);
+    if (JoinIt != IndexOf.end() && !Dead[JoinIt->second]) {
+      Blocks[JoinIt->second].second.add(ArmCounts);
+    } else {
+      IndexOf[&Join] = Blocks.size();
+      Blocks.push_back({&Join, ArmCounts});
+      Dead.push_back(false);
+    }
+    NumDiamondRecordsMerged += ArmIdx.size();
+  }
+
+  SmallVector<std::pair<BasicBlock *, BlockCounts>, 16> Kept;
+  for (unsigned Idx = 0; Idx < Blocks.size(); ++Idx)
+    if (!Dead[Idx])
+      Kept.push_back(Blocks[Idx]);
+  Blocks.swap(Kept);
 }
 
 bool UnsafeInstCounterPass::isPrimaryPackage() {
-  const char *P = std::getenv("CARGO_PRIMARY_PACKAGE");
-  return P && std::strcmp(P, "1") == 0;
+  return isUnsafePrimaryPackage();
 }
 
 bool UnsafeInstCounterPass::getUnsafeCategory(const Instruction &I, 
@@ -130,19 +1056,21 @@ bool UnsafeInstCounterPass::getUnsafeCategory(const Instruction &I,
   }
 }
 
-UnsafeInstCounterPass::BlockCounts 
-UnsafeInstCounterPass::analyzeBasicBlock(BasicBlock &BB) {
+UnsafeInstCounterPass::BlockCounts
+UnsafeInstCounterPass::analyzeBasicBlock(BasicBlock &BB,
+                                         const UnsafeRegionInfo &Regions,
+                                         bool *HasUnsafeMetadataInRegion) {
   BlockCounts counts;
   bool inUnsafeRegion = false;
-  
+
   for (Instruction &I : BB) {
     // Skip debug intrinsics
     if (isa<DbgInfoIntrinsic>(&I))
       continue;
-    
+
     // Check for markers
     bool isBegin = false, isEnd = false;
-    if (isMarkerInstruction(I, isBegin, isEnd)) {
+    if (Regions.isMarker(I, isBegin, isEnd)) {
       if (isBegin) {
         inUnsafeRegion = true;
       } else if (isEnd) {
@@ -156,11 +1084,16 @@ UnsafeInstCounterPass::analyzeBasicBlock(BasicBlock &BB) {
     
     // Count unsafe instructions if in unsafe region
     if (inUnsafeRegion) {
+      if (HasUnsafeMetadataInRegion && I.getMetadata(LLVMContext::MD_unsafe_inst))
+        *HasUnsafeMetadataInRegion = true;
       counts.totalUnsafeInsts++;
-      
+      uint32_t Scale = getElementScale(I);
+      counts.totalUnsafeElems += Scale;
+
       UnsafeCategory category;
       if (getUnsafeCategory(I, category)) {
         counts.unsafeCounts[category]++;
+        counts.unsafeElemCounts[category] += Scale;
       }
     }
   }
@@ -187,61 +1120,314 @@ PreservedAnalyses UnsafeInstCounterPass::run(Function &F,
   
   if (!shouldInstrumentFunction(F))
     return PreservedAnalyses::all();
-  
-  // Get function ID from metadata
+
+  // The early-phase instance exists only for the static reports: planting
+  // probes here would hand them to the optimizer and to the late instance.
+  bool ReportOnly = !UnsafeCounterReportDir.empty() || EarlyPhase;
+
+  const UnsafeRegionInfo &Regions = AM.getResult<UnsafeRegionAnalysis>(F);
+
+  // Region-mix report: stream one histogram row per unsafe region. Like the
+  // density report it keys rows by name, so it needs no tracker run.
+  if (!UnsafeRegionMixDir.empty() && !Regions.regions().empty()) {
+    Module *Mod = F.getParent();
+    if (MixModule != Mod) {
+      MixModule = Mod;
+      MixOS = openModuleReport(*Mod, UnsafeRegionMixDir,
+                               EarlyPhase ? ".early.unsafe_region_mix.tsv"
+                                          : ".unsafe_region_mix.tsv");
+      if (MixOS)
+        writeUnsafeStatsHeader(*MixOS, getUnsafeModuleHash(*Mod));
+    }
+    if (MixOS)
+      writeRegionMixRows(*MixOS, F, Regions);
+  }
+
+  // Get function ID from metadata. Report-only mode keys its rows by name
+  // instead and so works without a preceding tracker run.
   uint32_t funcId = getFunctionId(F);
-  if (funcId == UINT32_MAX)
+  if (funcId == UINT32_MAX && !ReportOnly)
     return PreservedAnalyses::all();
-  
-  // Get or create runtime function
-  Module *M = F.getParent();
-  FunctionCallee RecordBlockFn = getOrCreateRecordBlockFn(*M);
-  
-  // Analyze and instrument basic blocks
-  bool modified = false;
+
+  // Analyze first, mutate after, so instrumentation cannot disturb the walk.
+  SmallVector<std::pair<BasicBlock *, BlockCounts>, 16> BlocksToInstrument;
   for (BasicBlock &BB : F) {
-    BlockCounts counts = analyzeBasicBlock(BB);
-    
+    BlockCounts counts = analyzeBasicBlock(BB, Regions);
+
     // Only instrument blocks with instructions
-    if (!counts.hasInstructions())
-      continue;
-    
-    // Only create runtime call for blocks with unsafe instructions
-    if (!counts.hasUnsafeInstructions()) {
-      // For safe blocks, we still need total instruction count
-      // Create a simplified call with all unsafe counts as zero
-      IRBuilder<> Builder(BB.getTerminator());
-      Builder.CreateCall(RecordBlockFn, {
-        ConstantInt::get(Type::getInt32Ty(F.getContext()), funcId),
-        ConstantInt::get(Type::getInt32Ty(F.getContext()), counts.totalInsts),
-        ConstantInt::get(Type::getInt32Ty(F.getContext()), 0),
-        ConstantInt::get(Type::getInt16Ty(F.getContext()), 0),
-        ConstantInt::get(Type::getInt16Ty(F.getContext()), 0),
-        ConstantInt::get(Type::getInt16Ty(F.getContext()), 0),
-        ConstantInt::get(Type::getInt16Ty(F.getContext()), 0),
-        ConstantInt::get(Type::getInt16Ty(F.getContext()), 0),
-        ConstantInt::get(Type::getInt16Ty(F.getContext()), 0)
-      });
-    } else {
-      // Instrument block with unsafe counts
-      IRBuilder<> Builder(BB.getTerminator());
-      Builder.CreateCall(RecordBlockFn, {
-        ConstantInt::get(Type::getInt32Ty(F.getContext()), funcId),
-        ConstantInt::get(Type::getInt32Ty(F.getContext()), counts.totalInsts),
-        ConstantInt::get(Type::getInt32Ty(F.getContext()), counts.totalUnsafeInsts),
-        ConstantInt::get(Type::getInt16Ty(F.getContext()), counts.unsafeCounts[UNSAFE_LOAD]),
-        ConstantInt::get(Type::getInt16Ty(F.getContext()), counts.unsafeCounts[UNSAFE_STORE]),
-        ConstantInt::get(Type::getInt16Ty(F.getContext()), counts.unsafeCounts[UNSAFE_CALL]),
-        ConstantInt::get(Type::getInt16Ty(F.getContext()), counts.unsafeCounts[UNSAFE_CAST]),
-        ConstantInt::get(Type::getInt16Ty(F.getContext()), counts.unsafeCounts[UNSAFE_GEP]),
-        ConstantInt::get(Type::getInt16Ty(F.getContext()), counts.unsafeCounts[UNSAFE_OTHER])
-      });
+    if (counts.hasInstructions())
+      BlocksToInstrument.push_back({&BB, counts});
+  }
+
+  if (BlocksToInstrument.empty())
+    return PreservedAnalyses::all();
+
+  // Report-only mode: stream this function's summed counts and touch no IR.
+  // Coalescing is skipped — it exists to reduce runtime counter updates, and
+  // there are none.
+  if (ReportOnly) {
+    Module *M = F.getParent();
+    if (!UnsafeCounterReportDir.empty() && ReportModule != M) {
+      ReportModule = M;
+      ReportOS = openModuleReport(*M, UnsafeCounterReportDir,
+                                  EarlyPhase ? ".early.unsafe_density.tsv"
+                                             : ".unsafe_density.tsv");
+      if (ReportOS)
+        writeUnsafeStatsHeader(*ReportOS, getUnsafeModuleHash(*M));
     }
-    
-    modified = true;
+    if (ReportOS) {
+      BlockCounts Sum;
+      for (const auto &P : BlocksToInstrument)
+        Sum.add(P.second);
+      writeDensityRow(*ReportOS, F.getName(), BlocksToInstrument.size(), Sum);
+    }
+    return PreservedAnalyses::all();
   }
-  
-  return modified ? PreservedAnalyses::none() : PreservedAnalyses::all();
+
+  // Cold-function suppression, ahead of the slot-merging stages (which
+  // all no-op on the single row it leaves): when the profile proves this
+  // function cold, collapse everything to one summed row counted in the
+  // entry block. A cached ProfileSummaryAnalysis is only available under
+  // PGO, which is also the only time coldness is provable.
+  if (UnsafeCounterColdSuppress) {
+    auto &MAMProxy = AM.getResult<ModuleAnalysisManagerFunctionProxy>(F);
+    ProfileSummaryInfo *PSI =
+        MAMProxy.getCachedResult<ProfileSummaryAnalysis>(*F.getParent());
+    if (PSI && PSI->hasProfileSummary()) {
+      BlockFrequencyInfo &BFI = AM.getResult<BlockFrequencyAnalysis>(F);
+      if (PSI->isFunctionColdInCallGraph(&F, BFI)) {
+        BlockCounts Sum;
+        for (const auto &P : BlocksToInstrument)
+          Sum.add(P.second);
+        BlocksToInstrument.clear();
+        BlocksToInstrument.push_back({&F.getEntryBlock(), Sum});
+        ++NumColdFunctionsSuppressed;
+      }
+    }
+  }
+
+  if (coalesceEnabled()) {
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    PostDominatorTree &PDT = AM.getResult<PostDominatorTreeAnalysis>(F);
+    coalesceEquivalentBlocks(DT, PDT, BlocksToInstrument);
+  }
+
+  if (diamondMergeEnabled())
+    mergeDiamondRecords(BlocksToInstrument);
+
+  // Counted-loop scaling, applied after the slot-merging stages so the
+  // hoist sees the final slot per block: when the block provably runs
+  // trip-count times per loop entry, move its increment to the preheader
+  // and record the trip count as the row's static multiplier. Soundness
+  // needs the loop to exit only through its latch and the block to
+  // execute once per iteration — it must dominate the latch and not sit
+  // in a nested loop (getLoopFor is innermost, so the latter is implied).
+  if (UnsafeCounterLoopScale) {
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    for (auto &P : BlocksToInstrument) {
+      BasicBlock *BB = P.first;
+      Loop *L = LI.getLoopFor(BB);
+      if (!L)
+        continue;
+      BasicBlock *Latch = L->getLoopLatch();
+      BasicBlock *Preheader = L->getLoopPreheader();
+      if (!Latch || !Preheader || L->getExitingBlock() != Latch)
+        continue;
+      if (BB != L->getHeader() && !DT.dominates(BB, Latch))
+        continue;
+      unsigned Trip = SE.getSmallConstantTripCount(L);
+      if (Trip == 0)
+        continue;
+      P.first = Preheader;
+      P.second.execMultiplier = Trip;
+      ++NumLoopCountersHoisted;
+    }
+  }
+
+  emitBlockCounts(F, funcId, BlocksToInstrument);
+  return PreservedAnalyses::none();
+}
+
+void UnsafeInstCounterPass::emitBlockCounts(
+    Function &F, uint32_t FuncId,
+    ArrayRef<std::pair<BasicBlock *, BlockCounts>> Blocks) {
+  Module *M = F.getParent();
+  LLVMContext &Ctx = F.getContext();
+
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  StructType *RowTy = getBlockCountsRowTy(Ctx);
+
+  // Static side: every column is a compile-time constant, so emit one row
+  // per block instead of passing the same values on every execution.
+  std::vector<Constant *> Rows;
+  Rows.reserve(Blocks.size());
+  SmallVector<Constant *, 8> OverflowWords;
+  for (auto &[BBPtr, counts] : Blocks) {
+    (void)BBPtr;
+    Rows.push_back(
+        buildCountsRow(RowTy, FuncId, counts, Rows.size(), OverflowWords));
+  }
+
+  ArrayType *TableTy = ArrayType::get(RowTy, Rows.size());
+  auto *CountsGV = new GlobalVariable(
+    *M, TableTy, /*isConstant=*/true, GlobalValue::InternalLinkage,
+    ConstantArray::get(TableTy, Rows), "__unsafe_block_counts." + F.getName());
+  CountsGV->setAlignment(Align(8));
+  placeUnsafeTableGlobal(CountsGV);
+
+  // Saturated columns, if any, get their exact values in a cold sidecar.
+  GlobalVariable *OverflowGV = nullptr;
+  if (!OverflowWords.empty()) {
+    ArrayType *OverflowTy = ArrayType::get(Int64Ty, OverflowWords.size());
+    OverflowGV = new GlobalVariable(
+        *M, OverflowTy, /*isConstant=*/true, GlobalValue::InternalLinkage,
+        ConstantArray::get(OverflowTy, OverflowWords),
+        "__unsafe_block_count_overflow." + F.getName());
+    OverflowGV->setAlignment(Align(8));
+    placeUnsafeTableGlobal(OverflowGV);
+  }
+
+  // In rseq mode every CPU gets its own row of slots; flat otherwise.
+  uint64_t CounterSlots = UnsafeRseqCounters
+                              ? Blocks.size() * rseqRowCount()
+                              : Blocks.size();
+  ArrayType *CountersTy = ArrayType::get(Int64Ty, CounterSlots);
+  GlobalVariable *CountersGV;
+  if (UnsafeGuardedTables) {
+    // Guarded mode keeps only the base pointer static; the registration
+    // ctor fills it from unsafe_instr_alloc_guarded.
+    Type *Int64PtrTy = PointerType::get(Int64Ty, 0);
+    CountersGV = new GlobalVariable(
+        *M, Int64PtrTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+        ConstantPointerNull::get(cast<PointerType>(Int64PtrTy)),
+        "__unsafe_block_execs_ptr." + F.getName());
+  } else {
+    CountersGV = new GlobalVariable(
+        *M, CountersTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+        ConstantAggregateZero::get(CountersTy),
+        "__unsafe_block_execs." + F.getName());
+  }
+  CountersGV->setAlignment(Align(8));
+  placeUnsafeTableGlobal(CountersGV);
+
+  // Dynamic side: a single increment per block execution, keyed by the
+  // block's dense index into both arrays. A block whose PGO counter is
+  // borrowable gets a sidecar entry instead of an increment of its own.
+  SmallVector<Constant *, 8> BorrowedEntries;
+  StructType *BorrowTy = getBorrowedEntryTy(Ctx);
+  for (size_t Idx = 0; Idx < Blocks.size(); ++Idx) {
+    if (UnsafeCounterBorrowPGO)
+      if (Constant *Slot = findBorrowablePGOCounter(*Blocks[Idx].first)) {
+        BorrowedEntries.push_back(ConstantStruct::get(
+            BorrowTy, ConstantInt::get(Int64Ty, Idx),
+            ConstantExpr::getBitCast(Slot, PointerType::get(Int64Ty, 0))));
+        ++NumPGOCountersBorrowed;
+        continue;
+      }
+    emitBlockIncrement(*Blocks[Idx].first, CountersTy, CountersGV, Idx,
+                       Blocks.size());
+  }
+  GlobalVariable *BorrowedGV = emitBorrowedSidecar(
+      *M, "__unsafe_block_borrowed." + F.getName(), BorrowedEntries);
+
+  // Hand both arrays to the runtime, which multiplies row by execution count
+  // at dump time.
+  emitRegistrationCtor(*M, "__unsafe_register_blocks." + F.getName(), CountsGV,
+                       CountersGV, Rows.size(), OverflowGV,
+                       OverflowWords.size() / 3, BorrowedGV,
+                       BorrowedEntries.size());
+}
+
+void UnsafeInstCounterPass::emitModuleBlockCounts(
+    Module &M, ArrayRef<uint32_t> FuncIds, ArrayRef<BlockList> BlockLists) {
+  assert(FuncIds.size() == BlockLists.size() &&
+         "one block list per function id");
+  LLVMContext &Ctx = M.getContext();
+
+  // Same table and counter layout as the per-function variant, but one pair
+  // of arrays spans the whole module: each block gets a module-dense slot,
+  // and a single ctor registers everything. Per-function ctors add up on
+  // large crates — tens of microseconds of startup per thousand functions —
+  // and this is the natural shape for the combined module pass anyway.
+  StructType *RowTy = getBlockCountsRowTy(Ctx);
+  std::vector<Constant *> Rows;
+  SmallVector<Constant *, 8> OverflowWords;
+  for (size_t FIdx = 0; FIdx < BlockLists.size(); ++FIdx)
+    for (const auto &[BBPtr, counts] : BlockLists[FIdx]) {
+      (void)BBPtr;
+      Rows.push_back(buildCountsRow(RowTy, FuncIds[FIdx], counts, Rows.size(),
+                                    OverflowWords));
+    }
+
+  if (Rows.empty())
+    return;
+
+  ArrayType *TableTy = ArrayType::get(RowTy, Rows.size());
+  auto *CountsGV = new GlobalVariable(
+    M, TableTy, /*isConstant=*/true, GlobalValue::InternalLinkage,
+    ConstantArray::get(TableTy, Rows), "__unsafe_block_counts");
+  CountsGV->setAlignment(Align(8));
+  placeUnsafeTableGlobal(CountsGV);
+
+  uint64_t CounterSlots = UnsafeRseqCounters ? Rows.size() * rseqRowCount()
+                                             : Rows.size();
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+
+  // Saturated columns, if any, get their exact values in a cold sidecar.
+  GlobalVariable *OverflowGV = nullptr;
+  if (!OverflowWords.empty()) {
+    ArrayType *OverflowTy = ArrayType::get(Int64Ty, OverflowWords.size());
+    OverflowGV = new GlobalVariable(
+        M, OverflowTy, /*isConstant=*/true, GlobalValue::InternalLinkage,
+        ConstantArray::get(OverflowTy, OverflowWords),
+        "__unsafe_block_count_overflow");
+    OverflowGV->setAlignment(Align(8));
+    placeUnsafeTableGlobal(OverflowGV);
+  }
+  ArrayType *CountersTy = ArrayType::get(Int64Ty, CounterSlots);
+  GlobalVariable *CountersGV;
+  if (UnsafeGuardedTables) {
+    // Guarded mode keeps only the base pointer static; the registration
+    // ctor fills it from unsafe_instr_alloc_guarded.
+    Type *Int64PtrTy = PointerType::get(Int64Ty, 0);
+    CountersGV = new GlobalVariable(
+        M, Int64PtrTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+        ConstantPointerNull::get(cast<PointerType>(Int64PtrTy)),
+        "__unsafe_block_execs_ptr");
+  } else {
+    CountersGV = new GlobalVariable(
+        M, CountersTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+        ConstantAggregateZero::get(CountersTy), "__unsafe_block_execs");
+  }
+  CountersGV->setAlignment(Align(8));
+  placeUnsafeTableGlobal(CountersGV);
+
+  SmallVector<Constant *, 8> BorrowedEntries;
+  StructType *BorrowTy = getBorrowedEntryTy(Ctx);
+  uint64_t Slot = 0;
+  for (const BlockList &Blocks : BlockLists)
+    for (const auto &[BBPtr, counts] : Blocks) {
+      (void)counts;
+      uint64_t Idx = Slot++;
+      if (UnsafeCounterBorrowPGO)
+        if (Constant *PGOSlot = findBorrowablePGOCounter(*BBPtr)) {
+          BorrowedEntries.push_back(ConstantStruct::get(
+              BorrowTy, ConstantInt::get(Int64Ty, Idx),
+              ConstantExpr::getBitCast(PGOSlot,
+                                       PointerType::get(Int64Ty, 0))));
+          ++NumPGOCountersBorrowed;
+          continue;
+        }
+      emitBlockIncrement(*BBPtr, CountersTy, CountersGV, Idx, Rows.size());
+    }
+  GlobalVariable *BorrowedGV =
+      emitBorrowedSidecar(M, "__unsafe_block_borrowed", BorrowedEntries);
+
+  emitRegistrationCtor(M, "__unsafe_register_blocks", CountsGV, CountersGV,
+                       Rows.size(), OverflowGV, OverflowWords.size() / 3,
+                       BorrowedGV, BorrowedEntries.size());
 }
 
 } // namespace llvm
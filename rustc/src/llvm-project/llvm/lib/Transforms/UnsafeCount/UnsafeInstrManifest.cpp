@@ -0,0 +1,127 @@
+//===-- UnsafeInstrManifest.cpp - Instrumentation manifest -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/UnsafeCount/UnsafeInstrManifest.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeInstCounter.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include <string>
+
+using namespace llvm;
+
+namespace {
+
+/// \brief Hash every global whose name starts with \p Prefix.
+///
+/// Name and printed initializer of each matching global feed one running
+/// blob in module order, which is deterministic, so equal instrumentation
+/// tables hash equal across builds. Returns 0 when nothing matched, which
+/// the manifest prints as "none".
+static uint64_t hashTableFamily(const Module &M, StringRef Prefix) {
+  std::string Blob;
+  raw_string_ostream OS(Blob);
+  bool Any = false;
+  for (const GlobalVariable &GV : M.globals()) {
+    if (!GV.getName().startswith(Prefix) || !GV.hasInitializer())
+      continue;
+    Any = true;
+    OS << GV.getName() << ':';
+    GV.getInitializer()->print(OS);
+    OS << '\n';
+  }
+  return Any ? xxHash64(OS.str()) : 0;
+}
+
+/// \brief Append "key:value\n".
+static void emitLine(raw_ostream &OS, StringRef Key, const Twine &Value) {
+  OS << Key << ':' << Value << '\n';
+}
+
+/// \brief Append a table-hash line, with 0 rendered as "none".
+static void emitHashLine(raw_ostream &OS, StringRef Key, uint64_t Hash) {
+  if (Hash == 0) {
+    emitLine(OS, Key, "none");
+    return;
+  }
+  OS << Key << ':' << format_hex_no_prefix(Hash, 16) << '\n';
+}
+
+} // anonymous namespace
+
+namespace llvm {
+
+bool UnsafeInstrManifestPass::isPrimaryPackage() {
+  return isUnsafePrimaryPackage();
+}
+
+PreservedAnalyses UnsafeInstrManifestPass::run(Module &M,
+                                               ModuleAnalysisManager &AM) {
+  if (!isPrimaryPackage())
+    return PreservedAnalyses::all();
+
+  // Region markers: one begin call per region, and the set of distinct
+  // parent functions is the set of instrumented functions.
+  uint64_t NumRegions = 0;
+  SmallPtrSet<const Function *, 16> MarkedFunctions;
+  if (const Function *Begin =
+          M.getFunction(Intrinsic::getName(Intrinsic::unsafe_region_begin)))
+    for (const User *U : Begin->users())
+      if (const auto *CB = dyn_cast<CallBase>(U)) {
+        ++NumRegions;
+        MarkedFunctions.insert(CB->getFunction());
+      }
+
+  std::string Text;
+  raw_string_ostream OS(Text);
+  emitLine(OS, "manifest_version", Twine(MANIFEST_VERSION));
+  emitLine(OS, "module", M.getModuleIdentifier());
+  emitLine(OS, "regions", Twine(NumRegions));
+  emitLine(OS, "marked_functions", Twine(MarkedFunctions.size()));
+  emitLine(OS, "sample_rate", Twine(getUnsafeInstrSampleRate()));
+  emitLine(OS, "counter_coalesce",
+           Twine(UnsafeInstCounterPass::coalesceEnabled() ? 1 : 0));
+  // Tells the aggregator whether runtime dumps carry raw IDs it must join
+  // against the extracted .unsafe_tables stream.
+  emitLine(OS, "extern_tables", Twine(unsafeExternTablesEnabled() ? 1 : 0));
+  // The three static table families the runtime consumes; a change in any
+  // of them means the instrumentation inputs changed and the crate must be
+  // rebuilt and re-run.
+  emitHashLine(OS, "block_counts_hash",
+               hashTableFamily(M, "__unsafe_block_counts"));
+  emitHashLine(OS, "func_table_hash",
+               hashTableFamily(M, "__unsafe_metadata_table"));
+  emitHashLine(OS, "line_table_hash",
+               hashTableFamily(M, "__unsafe_line_"));
+
+  // One blob per codegen unit; the section concatenates at link time and
+  // llvm-readobj -x dumps it as-is.
+  LLVMContext &Ctx = M.getContext();
+  Constant *Blob = ConstantDataArray::getString(Ctx, OS.str(),
+                                                /*AddNull=*/false);
+  auto *GV = new GlobalVariable(M, Blob->getType(), /*isConstant=*/true,
+                                GlobalValue::PrivateLinkage, Blob,
+                                "__unsafe_instr_manifest");
+  GV->setSection(SECTION_NAME);
+  GV->setAlignment(Align(1));
+  appendToCompilerUsed(M, {GV});
+
+  return PreservedAnalyses::all();
+}
+
+} // namespace llvm
@@ -0,0 +1,156 @@
+//===-- UnsafeProfile.cpp - Combined unsafe function/block profiling -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/UnsafeCount/UnsafeProfile.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeFunctionTracker.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeInstCounter.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/InstMarker/UnsafeRegionAnalysis.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Type.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include <vector>
+
+using namespace llvm;
+
+// The analysis half of this pass — region scan, per-block counting,
+// dominator-based coalescing — only reads the IR, so distinct functions can
+// be analyzed on a thread pool while every IR mutation (metadata stamps,
+// table and probe emission) stays on the calling thread. LLVMContext is not
+// thread-safe, which is also why the serial standalone passes cannot simply
+// be run concurrently; splitting analysis from emission is the part that
+// parallelizes soundly. 0 keeps the phase serial.
+static cl::opt<unsigned> UnsafeProfileThreads(
+  "unsafe-profile-threads", cl::init(0), cl::Hidden,
+  cl::desc("Analyze functions for the combined unsafe profile pass on this "
+           "many threads (0 = serial)")
+);
+
+namespace llvm {
+
+bool UnsafeProfilePass::isPrimaryPackage() {
+  return isUnsafePrimaryPackage();
+}
+
+PreservedAnalyses UnsafeProfilePass::run(Module &M, ModuleAnalysisManager &AM) {
+  if (!isPrimaryPackage())
+    return PreservedAnalyses::all();
+
+  LLVMContext &Ctx = M.getContext();
+  FunctionAnalysisManager &FAM =
+      AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+  using BlockCounts = UnsafeInstCounterPass::BlockCounts;
+  using BlockList = UnsafeInstCounterPass::BlockList;
+
+  std::vector<UnsafeFunctionTrackerPass::FunctionMetadata> metadata;
+  std::vector<Function *> functionsToInstrument;
+  std::vector<uint32_t> funcIds;
+  std::vector<BlockList> blockLists;
+
+  // Phase 1 (serial, mutates IR): pick the functions and stamp their IDs.
+  for (Function &F : M)
+    if (UnsafeFunctionTrackerPass::shouldInstrument(F))
+      functionsToInstrument.push_back(&F);
+
+  if (functionsToInstrument.empty())
+    return PreservedAnalyses::all();
+
+  funcIds = UnsafeFunctionTrackerPass::assignFunctionIds(functionsToInstrument);
+  for (size_t Idx = 0; Idx < functionsToInstrument.size(); ++Idx)
+    functionsToInstrument[Idx]->setMetadata(
+        UnsafeFunctionTrackerPass::FUNCTION_ID_METADATA,
+        MDNode::get(Ctx, ConstantAsMetadata::get(ConstantInt::get(
+                             Type::getInt32Ty(Ctx), funcIds[Idx]))));
+
+  // Phase 2 (read-only): classify each function and gather its block
+  // counts in one walk, where the standalone tracker and counter each
+  // walked every block themselves. Results land in index-addressed slots,
+  // so the parallel path needs no locking.
+  std::vector<uint8_t> unsafeFlags(functionsToInstrument.size(), 0);
+  blockLists.resize(functionsToInstrument.size());
+
+  auto AnalyzeOne = [&](size_t Idx, const UnsafeRegionInfo &Regions,
+                        DominatorTree *DT, PostDominatorTree *PDT) {
+    Function &F = *functionsToInstrument[Idx];
+    bool isUnsafe = false;
+    // Targeted runs (-unsafe-instr-funcs) get block-count probes only in
+    // the listed functions; the classification still runs so the function
+    // metadata table stays complete.
+    bool Probe = unsafeInstrFuncFilterAllows(F);
+    BlockList blocks;
+    for (BasicBlock &BB : F) {
+      BlockCounts counts =
+          UnsafeInstCounterPass::analyzeBasicBlock(BB, Regions, &isUnsafe);
+      if (Probe && counts.hasInstructions())
+        blocks.push_back({&BB, counts});
+    }
+    if (DT && PDT && !blocks.empty())
+      UnsafeInstCounterPass::coalesceEquivalentBlocks(*DT, *PDT, blocks);
+    if (UnsafeInstCounterPass::diamondMergeEnabled())
+      UnsafeInstCounterPass::mergeDiamondRecords(blocks);
+    unsafeFlags[Idx] = isUnsafe ? 1 : 0;
+    blockLists[Idx] = std::move(blocks);
+  };
+
+  bool Coalesce = UnsafeInstCounterPass::coalesceEnabled();
+  if (UnsafeProfileThreads > 0) {
+    // Workers compute the region scan and (when coalescing) their own
+    // dominator trees locally instead of through the analysis manager,
+    // which is not thread-safe.
+    ThreadPool Pool(hardware_concurrency(UnsafeProfileThreads));
+    for (size_t Idx = 0; Idx < functionsToInstrument.size(); ++Idx)
+      Pool.async([&, Idx] {
+        Function &F = *functionsToInstrument[Idx];
+        UnsafeRegionInfo Regions = UnsafeRegionAnalysis::compute(F);
+        if (Coalesce) {
+          DominatorTree DT(F);
+          PostDominatorTree PDT(F);
+          AnalyzeOne(Idx, Regions, &DT, &PDT);
+        } else {
+          AnalyzeOne(Idx, Regions, nullptr, nullptr);
+        }
+      });
+    Pool.wait();
+  } else {
+    for (size_t Idx = 0; Idx < functionsToInstrument.size(); ++Idx) {
+      Function &F = *functionsToInstrument[Idx];
+      const UnsafeRegionInfo &Regions = FAM.getResult<UnsafeRegionAnalysis>(F);
+      DominatorTree *DT = nullptr;
+      PostDominatorTree *PDT = nullptr;
+      if (Coalesce) {
+        DT = &FAM.getResult<DominatorTreeAnalysis>(F);
+        PDT = &FAM.getResult<PostDominatorTreeAnalysis>(F);
+      }
+      AnalyzeOne(Idx, Regions, DT, PDT);
+    }
+  }
+
+  // Phase 3 (serial, mutates IR): emit everything.
+  for (size_t Idx = 0; Idx < functionsToInstrument.size(); ++Idx)
+    metadata.push_back({funcIds[Idx], unsafeFlags[Idx], 0, 0});
+
+  // Emission reuses the standalone passes' helpers, so the instrumentation
+  // and runtime contract are identical to running both passes — except that
+  // at module scope the block tables and counters consolidate into a single
+  // array pair registered by one ctor, instead of one per function.
+  UnsafeFunctionTrackerPass::emitTracking(M, metadata, functionsToInstrument);
+  UnsafeInstCounterPass::emitModuleBlockCounts(M, funcIds, blockLists);
+
+  return PreservedAnalyses::none();
+}
+
+} // namespace llvm
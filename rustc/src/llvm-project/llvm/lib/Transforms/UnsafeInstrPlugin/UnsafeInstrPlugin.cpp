@@ -0,0 +1,124 @@
+//===-- UnsafeInstrPlugin.cpp - opt plugin for the unsafe pass family -----===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Pass-plugin registration for the unsafe instrumentation passes, so they
+// load into opt via -load-pass-plugin. Iterating on a pass then means
+// rebuilding one shared library and re-running a .ll corpus in seconds,
+// instead of rebuilding rustc's LLVM. The pipeline names match the static
+// PassRegistry.def entries, so opt invocations and lit RUN lines work
+// unchanged against either build.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Transforms/CpuCycleCount/CpuCycleCount.h"
+#include "llvm/Transforms/CpuCycleCount/ExternalCallTracker.h"
+#include "llvm/Transforms/CpuCycleCount/UnsafeShareEstimator.h"
+#include "llvm/Transforms/DebugInfoPreserve/DebugInfoPreserver.h"
+#include "llvm/Transforms/DynamicLineCount/DynamicLineCount.h"
+#include "llvm/Transforms/HeapTracker/AllocTracker.h"
+#include "llvm/Transforms/HeapTracker/HeapTracker.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/InstMarker/UnsafeInstrCheckpoint.h"
+#include "llvm/Transforms/InstMarker/UnsafeInstrConsolidate.h"
+#include "llvm/Transforms/InstMarker/UnsafeMultiVersion.h"
+#include "llvm/Transforms/InstMarker/UnsafeRegionAnalysis.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeFunctionTracker.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeInstCounter.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeInstrManifest.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeProfile.h"
+
+using namespace llvm;
+
+static void registerUnsafeInstrPasses(PassBuilder &PB) {
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, ModulePassManager &MPM,
+         ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "cpu-cycle-count") {
+          MPM.addPass(CpuCycleCountPass());
+          return true;
+        }
+        if (Name == "external-call-tracker") {
+          MPM.addPass(ExternalCallTrackerPass());
+          return true;
+        }
+        if (Name == "debug-info-preserver") {
+          MPM.addPass(DebugInfoPreserverPass());
+          return true;
+        }
+        if (Name == "dynamic-line-count") {
+          MPM.addPass(DynamicLineCountPass());
+          return true;
+        }
+        if (Name == "unsafe-function-tracker") {
+          MPM.addPass(UnsafeFunctionTrackerPass());
+          return true;
+        }
+        if (Name == "unsafe-instr-manifest") {
+          MPM.addPass(UnsafeInstrManifestPass());
+          return true;
+        }
+        if (Name == "unsafe-profile") {
+          MPM.addPass(UnsafeProfilePass());
+          return true;
+        }
+        if (Name == "unsafe-share-estimator") {
+          MPM.addPass(UnsafeShareEstimatorPass());
+          return true;
+        }
+        if (Name == "unsafe-instr-checkpoint") {
+          MPM.addPass(UnsafeInstrCheckpointPass());
+          return true;
+        }
+        if (Name == "unsafe-instr-consolidate") {
+          MPM.addPass(UnsafeInstrConsolidatePass());
+          return true;
+        }
+        if (Name == "unsafe-multi-version") {
+          MPM.addPass(UnsafeMultiVersionPass());
+          return true;
+        }
+        return false;
+      });
+
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, FunctionPassManager &FPM,
+         ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "instmarker") {
+          FPM.addPass(InstMarkerPass());
+          return true;
+        }
+        if (Name == "alloc-tracker") {
+          FPM.addPass(AllocTrackerPass());
+          return true;
+        }
+        if (Name == "heap-tracker") {
+          FPM.addPass(HeapTrackerPass());
+          return true;
+        }
+        if (Name == "unsafe-inst-counter") {
+          FPM.addPass(UnsafeInstCounterPass());
+          return true;
+        }
+        if (Name == "unsafe-region-verify") {
+          FPM.addPass(UnsafeRegionVerifierPass());
+          return true;
+        }
+        return false;
+      });
+
+  PB.registerAnalysisRegistrationCallback([](FunctionAnalysisManager &FAM) {
+    FAM.registerPass([] { return UnsafeRegionAnalysis(); });
+  });
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "UnsafeInstr", LLVM_VERSION_STRING,
+          registerUnsafeInstrPasses};
+}
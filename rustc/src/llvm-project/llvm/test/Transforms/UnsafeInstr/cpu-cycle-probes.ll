@@ -0,0 +1,40 @@
+; Probe-cost invariants for CpuCycleCountPass in the default runtime-call
+; mode: exactly one start/end probe pair per region, exactly one fence per
+; probe (the legacy SequentiallyConsistent default), markers stripped, and
+; no fences at all under -probe-serialization=none.
+;
+; RUN: env CARGO_PRIMARY_PACKAGE=1 opt -passes=cpu-cycle-count -S %s | FileCheck %s
+; RUN: env CARGO_PRIMARY_PACKAGE=1 opt -passes=cpu-cycle-count -probe-serialization=none -S %s | FileCheck --check-prefix=NOFENCE %s
+
+declare void @llvm.unsafe.region.begin()
+declare void @llvm.unsafe.region.end()
+
+define i64 @one_region(ptr %p) "unsafe-region-markers" {
+; CHECK-LABEL: define i64 @one_region(
+; CHECK: fence seq_cst
+; CHECK-NEXT: [[START:%.*]] = call i64 @cpu_cycle_start_measurement()
+; CHECK-NEXT: %a = load i64, ptr %p
+; CHECK-NEXT: %b = add i64 %a, 1
+; CHECK-NEXT: fence seq_cst
+; CHECK-NEXT: call void @cpu_cycle_end_measurement(i64 [[START]])
+; CHECK-NOT: cpu_cycle_start_measurement
+; CHECK-NOT: fence
+; CHECK-NOT: llvm.unsafe.region
+entry:
+  call void @llvm.unsafe.region.begin()
+  %a = load i64, ptr %p
+  %b = add i64 %a, 1
+  call void @llvm.unsafe.region.end()
+  ret i64 %b
+}
+
+; Module hooks: one startup-record ctor, one print-stats dtor.
+; CHECK: call void @record_program_start()
+; CHECK: declare void @print_cpu_cycle_stats()
+
+; NOFENCE-LABEL: define i64 @one_region(
+; NOFENCE-NOT: fence
+; NOFENCE: call i64 @cpu_cycle_start_measurement()
+; NOFENCE-NOT: fence
+; NOFENCE: call void @cpu_cycle_end_measurement(
+; NOFENCE-NOT: fence
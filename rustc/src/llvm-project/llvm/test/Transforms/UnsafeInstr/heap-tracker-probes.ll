@@ -0,0 +1,29 @@
+; Probe-count invariants for HeapTrackerPass on the default runtime-call
+; path: every load/store gets exactly one classification probe, in-region
+; accesses get exactly one unsafe probe on top, and nothing is duplicated.
+;
+; RUN: env CARGO_PRIMARY_PACKAGE=1 opt -passes=heap-tracker -S %s | FileCheck %s
+
+declare void @llvm.unsafe.region.begin()
+declare void @llvm.unsafe.region.end()
+
+define i64 @mixed(ptr %p, ptr %q) "unsafe-region-markers" {
+; CHECK-LABEL: define i64 @mixed(
+; CHECK: call void @dyn_mem_access(ptr %q)
+; CHECK-NEXT: %outside = load i64, ptr %q
+; CHECK: call void @dyn_mem_access(ptr %p)
+; CHECK-NEXT: call void @dyn_unsafe_mem_access(ptr %p, i1 true)
+; CHECK-NEXT: %a = load i64, ptr %p
+; CHECK: call void @dyn_mem_access(ptr %p)
+; CHECK-NEXT: call void @dyn_unsafe_mem_access(ptr %p, i1 false)
+; CHECK-NEXT: store i64 %a, ptr %p
+; CHECK-NOT: call void @dyn_mem_access
+; CHECK-NOT: call void @dyn_unsafe_mem_access
+entry:
+  %outside = load i64, ptr %q
+  call void @llvm.unsafe.region.begin()
+  %a = load i64, ptr %p
+  store i64 %a, ptr %p
+  call void @llvm.unsafe.region.end()
+  ret i64 %a
+}
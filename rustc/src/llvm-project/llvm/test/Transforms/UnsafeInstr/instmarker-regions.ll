@@ -0,0 +1,52 @@
+; Structural invariants for InstMarkerPass: exactly one begin/end pair per
+; block with tagged instructions, the marker attribute on every marked
+; function, and no output at all without the CARGO_PRIMARY_PACKAGE gate.
+;
+; RUN: env CARGO_PRIMARY_PACKAGE=1 opt -passes=instmarker -S %s | FileCheck %s
+; RUN: env -u CARGO_PRIMARY_PACKAGE opt -passes=instmarker -S %s | FileCheck --check-prefix=GATED %s
+
+define i64 @two_blocks(ptr %p) {
+; CHECK-LABEL: define i64 @two_blocks(ptr %p) #[[ATTR:[0-9]+]] {
+; One pair spans from the first to the last tagged instruction of the block:
+; the untagged mul in between lands inside the region, matching the
+; source-level unsafe block it came from.
+; CHECK: call void @llvm.unsafe.region.begin()
+; CHECK-NEXT: %a = load i64, ptr %p
+; CHECK-NEXT: %b = mul i64 %a, 3
+; CHECK-NEXT: %c = add i64 %a, 1
+; CHECK-NEXT: call void @llvm.unsafe.region.end()
+; CHECK-NOT: call void @llvm.unsafe.region.begin()
+entry:
+  %a = load i64, ptr %p, !unsafe_inst !0
+  %b = mul i64 %a, 3
+  %c = add i64 %a, 1, !unsafe_inst !0
+  br label %next
+
+; The second block gets its own pair.
+; CHECK: call void @llvm.unsafe.region.begin()
+; CHECK-NEXT: store i64 %c, ptr %p
+; CHECK-NEXT: call void @llvm.unsafe.region.end()
+; CHECK-NOT: llvm.unsafe.region
+next:
+  store i64 %c, ptr %p, !unsafe_inst !0
+  ret i64 %c
+}
+
+define i64 @no_unsafe(ptr %p) {
+; CHECK-LABEL: define i64 @no_unsafe(
+; CHECK-NOT: llvm.unsafe.region
+entry:
+  %v = load i64, ptr %p
+  ret i64 %v
+}
+
+; The attribute is what lets the region-dependent passes skip unmarked
+; functions on one test instead of a block walk.
+; CHECK: attributes #[[ATTR]] = {{.*}}"unsafe-region-markers"
+
+; Without CARGO_PRIMARY_PACKAGE=1 the pass must touch nothing.
+; GATED-LABEL: define i64 @two_blocks(
+; GATED-NOT: llvm.unsafe.region
+; GATED-NOT: "unsafe-region-markers"
+
+!0 = !{}
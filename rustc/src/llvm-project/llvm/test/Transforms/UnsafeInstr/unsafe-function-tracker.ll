@@ -0,0 +1,33 @@
+; Structural invariants for UnsafeFunctionTrackerPass: exactly one entry
+; record per tracked function, one metadata table, one registration ctor and
+; one dump dtor per module — and nothing without the CARGO_PRIMARY_PACKAGE
+; gate.
+;
+; RUN: env CARGO_PRIMARY_PACKAGE=1 opt -passes=unsafe-function-tracker -S %s | FileCheck %s
+; RUN: env -u CARGO_PRIMARY_PACKAGE opt -passes=unsafe-function-tracker -S %s | FileCheck --check-prefix=GATED %s
+
+; CHECK: @__unsafe_metadata_table = internal constant [2 x { i32, i8, i8, i16 }]
+; CHECK-DAG: @llvm.global_ctors = {{.*}}@__unsafe_module_init
+; CHECK-DAG: @llvm.global_dtors = {{.*}}@__unsafe_dump_stats
+
+define void @f() {
+; CHECK-LABEL: define void @f() {
+; CHECK-NEXT: entry:
+; CHECK-NEXT: call void @__unsafe_record_function(i32 0)
+; CHECK-NOT: call void @__unsafe_record_function
+entry:
+  ret void
+}
+
+define void @g() {
+; CHECK-LABEL: define void @g() {
+; CHECK-NEXT: entry:
+; CHECK-NEXT: call void @__unsafe_record_function(i32 1)
+; CHECK-NOT: call void @__unsafe_record_function
+entry:
+  ret void
+}
+
+; GATED-NOT: __unsafe_metadata_table
+; GATED-LABEL: define void @f() {
+; GATED-NOT: __unsafe_
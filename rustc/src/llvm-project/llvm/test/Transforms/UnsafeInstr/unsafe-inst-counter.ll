@@ -0,0 +1,34 @@
+; Probe-cost invariants for UnsafeInstCounterPass: one atomic increment per
+; instrumented block — never more — plus one static row per block and one
+; registration ctor per function. The counter needs the tracker's ID
+; metadata, so the tracker runs first, as in the real pipeline.
+;
+; RUN: env CARGO_PRIMARY_PACKAGE=1 opt -passes='unsafe-function-tracker,function(unsafe-inst-counter)' -S %s | FileCheck %s
+
+declare void @llvm.unsafe.region.begin()
+declare void @llvm.unsafe.region.end()
+
+; Three non-empty blocks: three table rows, three counter slots.
+; CHECK-DAG: @__unsafe_block_counts.counted = internal constant [3 x
+; CHECK-DAG: @__unsafe_block_execs.counted = internal global [3 x i64] zeroinitializer
+
+define i64 @counted(ptr %p, i1 %c) "unsafe-region-markers" {
+; CHECK-LABEL: define i64 @counted(
+; CHECK-COUNT-3: atomicrmw add ptr {{.*}} monotonic
+; CHECK-NOT: atomicrmw
+entry:
+  call void @llvm.unsafe.region.begin()
+  %a = load i64, ptr %p
+  call void @llvm.unsafe.region.end()
+  br i1 %c, label %then, label %exit
+
+then:
+  store i64 %a, ptr %p
+  br label %exit
+
+exit:
+  ret i64 %a
+}
+
+; One registration ctor hands both arrays to the runtime.
+; CHECK: call void @__unsafe_register_block_counts(ptr @__unsafe_block_counts.counted, ptr @__unsafe_block_execs.counted, i32 3)
@@ -0,0 +1,686 @@
+//===-- llvm-unsafe-overhead-gate.cpp - differential overhead CI gate -----===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// End-to-end regression gate for the unsafe instrumentation stack. The unit
+// tests pin per-pass behavior and the microbenchmark suite pins pass compile
+// time, but an instrumentation-overhead regression — more probes emitted,
+// fatter probe sequences, worse code growth — previously surfaced only after
+// a full benchmark-matrix run. This tool runs each pipeline configuration
+// over two inputs:
+//
+//   * fixed synthetic kernels (the microbenchmark suite's generator, fixed
+//     seed, so every run sees identical IR), which are also JIT-executed
+//     against no-op runtime stubs to measure the probes' own run-time cost;
+//   * optionally an extracted IR corpus (UNSAFE_INSTR_CORPUS_DIR /
+//     -corpus-dir, the checkpoint bitcode the pipeline archives), for probe
+//     counts and code growth on real pre-instrumentation rustc output.
+//
+// Per (configuration, module) it records probe call sites, instruction
+// counts before/after, and — for the kernels — the instrumented/plain
+// execution time ratio, then compares against a checked-in baseline TSV:
+// the static columns exactly, the timing ratio within a tolerance band.
+// -update-baseline records the current numbers as the new baseline.
+//
+//   llvm-unsafe-overhead-gate -baseline overhead-baseline.tsv
+//   llvm-unsafe-overhead-gate -baseline ... -corpus-dir corpus/
+//   llvm-unsafe-overhead-gate -baseline ... -update-baseline
+//
+// Wired up as the check-unsafe-overhead-gate target; see CMakeLists.txt.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/CpuCycleCount/CpuCycleCount.h"
+#include "llvm/Transforms/CpuCycleCount/ExternalCallTracker.h"
+#include "llvm/Transforms/HeapTracker/HeapTracker.h"
+#include "llvm/Transforms/InstMarker/InstMarker.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeFunctionTracker.h"
+#include "llvm/Transforms/UnsafeCount/UnsafeInstCounter.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+cl::OptionCategory GateCategory("llvm-unsafe-overhead-gate options");
+
+cl::opt<std::string> BaselineFile(
+    "baseline", cl::Required,
+    cl::desc("Checked-in baseline TSV to gate against"),
+    cl::cat(GateCategory));
+
+cl::opt<bool> UpdateBaseline(
+    "update-baseline", cl::init(false),
+    cl::desc("Rewrite the baseline with the current measurements"),
+    cl::cat(GateCategory));
+
+cl::opt<std::string> CorpusDir(
+    "corpus-dir", cl::init(""),
+    cl::desc("Extracted IR corpus directory (default: the "
+             "UNSAFE_INSTR_CORPUS_DIR environment variable); adds probe "
+             "count and code growth rows for each corpus module"),
+    cl::cat(GateCategory));
+
+// Timing in CI is noisy; the gated value is the instrumented/plain ratio,
+// which mostly cancels machine speed but not scheduler luck. The static
+// columns carry the tight regression signal, so the band here only has to
+// catch probes getting categorically more expensive.
+cl::opt<unsigned> OverheadTolerancePct(
+    "overhead-tolerance", cl::init(50),
+    cl::desc("Allowed relative drift of the execution overhead ratio, in "
+             "percent (default 50)"),
+    cl::cat(GateCategory));
+
+cl::opt<bool> NoExecute(
+    "no-execute", cl::init(false),
+    cl::desc("Skip JIT execution of the kernels; gate on probe counts and "
+             "code growth only"),
+    cl::cat(GateCategory));
+
+// Every unsafe pass exits early unless compiling the primary package, and
+// the check caches its getenv result on first query — so set the variable
+// before any pass can run. Same preamble as the microbenchmark suite.
+const bool PrimaryPackageSet = [] {
+#ifdef _WIN32
+  _putenv_s("CARGO_PRIMARY_PACKAGE", "1");
+#else
+  setenv("CARGO_PRIMARY_PACKAGE", "1", 1);
+#endif
+  return true;
+}();
+
+/// One gated measurement. Overhead < 0 means not measured (corpus modules,
+/// -no-execute); the baseline writes it as "-" and the compare skips it.
+struct GateRow {
+  std::string Config;
+  std::string ModuleName;
+  uint64_t ProbeCalls = 0;
+  uint64_t InstsBefore = 0;
+  uint64_t InstsAfter = 0;
+  double Overhead = -1.0;
+};
+
+/// The pipeline configurations under gate, in the canonical block order
+/// (heap, tracker, counter, cycles, external — see
+/// addUnsafeInstrumentationBlock). The marker runs first for every
+/// configuration on kernel input; corpus checkpoints already carry markers.
+struct GateConfig {
+  const char *Name;
+  bool Heap, Tracker, Counter, Cycles, External;
+};
+
+const GateConfig Configs[] = {
+    {"marker", false, false, false, false, false},
+    {"heap", true, false, false, false, false},
+    {"counter", false, true, true, false, false},
+    {"cycles", false, false, false, true, false},
+    {"full", true, true, true, true, true},
+};
+
+/// Runtime symbol detection, for probe counting and for stubbing before
+/// execution. Matches the naming families the passes emit calls and global
+/// references to; callee names come from declarations, so corpus user code
+/// cannot collide unless it declares-and-calls these exact prefixes.
+bool isUnsafeRuntimeName(StringRef Name) {
+  return Name.starts_with("cpu_cycle_") || Name.starts_with("__cpu_cycle_") ||
+         Name.starts_with("external_call_") ||
+         Name.starts_with("heap_tracker_") ||
+         Name.starts_with("__heap_tracker_") ||
+         Name.starts_with("__unsafe_") || Name.starts_with("unsafe_instr_") ||
+         Name.starts_with("track_unsafe_") ||
+         Name.starts_with("register_unsafe_") ||
+         Name.starts_with("print_unsafe_") ||
+         Name.starts_with("dump_unsafe_") ||
+         Name.starts_with("record_program_");
+}
+
+uint64_t countInstructions(const Module &M) {
+  uint64_t N = 0;
+  for (const Function &F : M)
+    for (const BasicBlock &BB : F)
+      N += BB.size();
+  return N;
+}
+
+/// Static probe call sites: calls whose callee is a declaration with a
+/// runtime name. Registration ctors count too — they are emitted code the
+/// binary carries, and their count regresses with the same changes.
+uint64_t countProbeCalls(const Module &M) {
+  uint64_t N = 0;
+  for (const Function &F : M)
+    for (const BasicBlock &BB : F)
+      for (const Instruction &I : BB)
+        if (const auto *Call = dyn_cast<CallBase>(&I))
+          if (const auto *Callee = dyn_cast<Function>(
+                  Call->getCalledOperand()->stripPointerCastsAndAliases()))
+            if (Callee->isDeclaration() &&
+                isUnsafeRuntimeName(Callee->getName()))
+              ++N;
+  return N;
+}
+
+/// Run \p MPM over \p M through a freshly built PassBuilder pipeline, the
+/// way a rustc codegen thread would: new analysis managers each time, with
+/// cross-registered proxies.
+void runPipeline(Module &M, ModulePassManager MPM) {
+  PassBuilder PB;
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  MPM.run(M, MAM);
+}
+
+void applyConfig(Module &M, const GateConfig &C, bool RunMarker) {
+  ModulePassManager MPM;
+  if (RunMarker) {
+    FunctionPassManager FPM;
+    FPM.addPass(InstMarkerPass());
+    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+  }
+  if (C.Heap) {
+    FunctionPassManager FPM;
+    FPM.addPass(HeapTrackerPass());
+    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+  }
+  if (C.Tracker)
+    MPM.addPass(UnsafeFunctionTrackerPass());
+  if (C.Counter) {
+    FunctionPassManager FPM;
+    FPM.addPass(UnsafeInstCounterPass());
+    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+  }
+  if (C.Cycles)
+    MPM.addPass(CpuCycleCountPass());
+  if (C.External)
+    MPM.addPass(ExternalCallTrackerPass());
+  runPipeline(M, std::move(MPM));
+}
+
+/// Build the fixed kernel module: the microbenchmark generator's synthetic
+/// functions (fixed-seed LCG, so every gate run measures identical IR) plus
+/// an executable entry that drives them enough iterations to time. Memory
+/// ops in tagged blocks carry unsafe_inst metadata in contiguous runs, the
+/// shape InstMarkerPass wraps into regions.
+std::unique_ptr<Module> buildKernelModule(LLVMContext &Ctx) {
+  constexpr unsigned NumFuncs = 8;
+  constexpr unsigned NumBlocks = 6;
+  constexpr unsigned DensityPct = 25;
+  constexpr unsigned KernelIterations = 512;
+
+  auto M = std::make_unique<Module>("unsafe_gate_kernel", Ctx);
+  IRBuilder<> Builder(Ctx);
+  Type *I64 = Builder.getInt64Ty();
+  PointerType *I64Ptr = PointerType::get(I64, 0);
+  MDNode *UnsafeTag = MDNode::get(Ctx, {});
+
+  uint64_t Rng = 0x9E3779B97F4A7C15ULL;
+  auto NextPercent = [&Rng]() {
+    Rng = Rng * 6364136223846793005ULL + 1442695040888963407ULL;
+    return unsigned((Rng >> 33) % 100);
+  };
+
+  SmallVector<Function *, 8> SynthFns;
+  for (unsigned FI = 0; FI < NumFuncs; ++FI) {
+    Function *F = Function::Create(FunctionType::get(I64, {I64Ptr}, false),
+                                   GlobalValue::InternalLinkage,
+                                   "synth_fn_" + std::to_string(FI), M.get());
+    SynthFns.push_back(F);
+    Value *Ptr = F->getArg(0);
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", F);
+    Builder.SetInsertPoint(Entry);
+    Value *Acc = Builder.getInt64(FI);
+
+    for (unsigned BI = 0; BI < NumBlocks; ++BI) {
+      BasicBlock *BB = BasicBlock::Create(Ctx, "body", F);
+      Builder.CreateBr(BB);
+      Builder.SetInsertPoint(BB);
+
+      bool Unsafe = NextPercent() < DensityPct;
+      for (unsigned II = 0; II < 8; ++II) {
+        Value *Loaded = Builder.CreateLoad(I64, Ptr);
+        Acc = Builder.CreateAdd(Acc, Loaded);
+        Acc = Builder.CreateMul(Acc, Builder.getInt64((II << 1) | 1));
+        StoreInst *St = Builder.CreateStore(Acc, Ptr);
+        if (Unsafe) {
+          cast<Instruction>(Loaded)->setMetadata(LLVMContext::MD_unsafe_inst,
+                                                 UnsafeTag);
+          St->setMetadata(LLVMContext::MD_unsafe_inst, UnsafeTag);
+        }
+      }
+    }
+    Builder.CreateRet(Acc);
+  }
+
+  // i64 @unsafe_gate_kernel(): loop the synthetic functions over one shared
+  // slot and fold their results, so nothing is dead-code-eliminable.
+  Function *Kernel =
+      Function::Create(FunctionType::get(I64, false),
+                       GlobalValue::ExternalLinkage, "unsafe_gate_kernel",
+                       M.get());
+  BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", Kernel);
+  BasicBlock *Loop = BasicBlock::Create(Ctx, "loop", Kernel);
+  BasicBlock *Exit = BasicBlock::Create(Ctx, "exit", Kernel);
+
+  Builder.SetInsertPoint(Entry);
+  Value *Slot = Builder.CreateAlloca(I64);
+  Builder.CreateStore(Builder.getInt64(1), Slot);
+  Builder.CreateBr(Loop);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *Iv = Builder.CreatePHI(I64, 2, "iv");
+  PHINode *Acc = Builder.CreatePHI(I64, 2, "acc");
+  Iv->addIncoming(Builder.getInt64(0), Entry);
+  Acc->addIncoming(Builder.getInt64(0), Entry);
+  Value *Sum = Acc;
+  for (Function *F : SynthFns)
+    Sum = Builder.CreateAdd(Sum, Builder.CreateCall(F, {Slot}));
+  Value *Next = Builder.CreateAdd(Iv, Builder.getInt64(1));
+  Iv->addIncoming(Next, Loop);
+  Acc->addIncoming(Sum, Loop);
+  Builder.CreateCondBr(
+      Builder.CreateICmpULT(Next, Builder.getInt64(KernelIterations)), Loop,
+      Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRet(Sum);
+  return M;
+}
+
+/// Make an instrumented module self-contained for JIT execution: no-op
+/// bodies for the runtime declarations (so the gate times the emitted probe
+/// sequences and call overhead, not the real runtime's accumulation),
+/// zero-initialized definitions for runtime-owned globals the inline probe
+/// paths read, no registration ctors/dtors (registration is meaningless
+/// against stubs), and no leftover region marker intrinsics (they have no
+/// codegen lowering).
+void prepareForExecution(Module &M) {
+  if (GlobalVariable *Ctors = M.getGlobalVariable("llvm.global_ctors"))
+    Ctors->eraseFromParent();
+  if (GlobalVariable *Dtors = M.getGlobalVariable("llvm.global_dtors"))
+    Dtors->eraseFromParent();
+
+  SmallVector<Instruction *, 32> Markers;
+  for (Function &F : M)
+    for (BasicBlock &BB : F)
+      for (Instruction &I : BB)
+        if (auto *II = dyn_cast<IntrinsicInst>(&I))
+          if (II->getIntrinsicID() == Intrinsic::unsafe_region_begin ||
+              II->getIntrinsicID() == Intrinsic::unsafe_region_end)
+            Markers.push_back(II);
+  for (Instruction *I : Markers)
+    I->eraseFromParent();
+
+  for (Function &F : M) {
+    if (!F.isDeclaration() || F.isIntrinsic() ||
+        !isUnsafeRuntimeName(F.getName()))
+      continue;
+    BasicBlock *BB = BasicBlock::Create(M.getContext(), "entry", &F);
+    IRBuilder<> Builder(BB);
+    Type *RetTy = F.getReturnType();
+    if (RetTy->isVoidTy())
+      Builder.CreateRetVoid();
+    else
+      Builder.CreateRet(Constant::getNullValue(RetTy));
+  }
+
+  for (GlobalVariable &G : M.globals())
+    if (G.isDeclaration() && isUnsafeRuntimeName(G.getName())) {
+      G.setInitializer(Constant::getNullValue(G.getValueType()));
+      G.setLinkage(GlobalValue::InternalLinkage);
+    }
+}
+
+/// JIT \p M and return the best-of-five wall time of the kernel entry, in
+/// seconds. The module round-trips through bitcode into a fresh context so
+/// each measurement owns its ThreadSafeModule. Best-of-N because the gated
+/// value is a ratio of two such minima — the scheduler only ever adds time.
+Expected<double> timeKernel(Module &M) {
+  SmallString<0> Bitcode;
+  {
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(M, OS);
+  }
+  auto Ctx = std::make_unique<LLVMContext>();
+  Expected<std::unique_ptr<Module>> Parsed = parseBitcodeFile(
+      MemoryBufferRef(Bitcode.str(), M.getName()), *Ctx);
+  if (!Parsed)
+    return Parsed.takeError();
+
+  auto JIT = orc::LLJITBuilder().create();
+  if (!JIT)
+    return JIT.takeError();
+  (*Parsed)->setDataLayout((*JIT)->getDataLayout());
+  (*Parsed)->setTargetTriple((*JIT)->getTargetTriple().str());
+  if (Error E = (*JIT)->addIRModule(
+          orc::ThreadSafeModule(std::move(*Parsed), std::move(Ctx))))
+    return std::move(E);
+
+  Expected<orc::ExecutorAddr> Sym = (*JIT)->lookup("unsafe_gate_kernel");
+  if (!Sym)
+    return Sym.takeError();
+  auto *Kernel = Sym->toPtr<uint64_t (*)()>();
+
+  volatile uint64_t Sink = Kernel(); // warm-up and code materialization
+  double Best = 0;
+  for (unsigned Rep = 0; Rep < 5; ++Rep) {
+    auto Start = std::chrono::steady_clock::now();
+    for (unsigned I = 0; I < 16; ++I)
+      Sink = Kernel();
+    double Secs = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - Start)
+                      .count();
+    if (Rep == 0 || Secs < Best)
+      Best = Secs;
+  }
+  (void)Sink;
+  return Best;
+}
+
+/// Gate the kernels: every configuration, static metrics plus (unless
+/// -no-execute) the instrumented/plain execution time ratio.
+Error runKernelGate(std::vector<GateRow> &Rows) {
+  LLVMContext Ctx;
+  std::unique_ptr<Module> Template = buildKernelModule(Ctx);
+  uint64_t InstsBefore = countInstructions(*Template);
+
+  double PlainTime = 0;
+  if (!NoExecute) {
+    std::unique_ptr<Module> Plain = CloneModule(*Template);
+    prepareForExecution(*Plain);
+    Expected<double> T = timeKernel(*Plain);
+    if (!T)
+      return T.takeError();
+    PlainTime = *T;
+  }
+
+  for (const GateConfig &C : Configs) {
+    std::unique_ptr<Module> M = CloneModule(*Template);
+    applyConfig(*M, C, /*RunMarker=*/true);
+
+    GateRow Row;
+    Row.Config = C.Name;
+    Row.ModuleName = "kernel";
+    Row.ProbeCalls = countProbeCalls(*M);
+    Row.InstsBefore = InstsBefore;
+    Row.InstsAfter = countInstructions(*M);
+
+    if (!NoExecute && PlainTime > 0) {
+      prepareForExecution(*M);
+      Expected<double> T = timeKernel(*M);
+      if (!T)
+        return T.takeError();
+      Row.Overhead = *T / PlainTime;
+    }
+    Rows.push_back(std::move(Row));
+  }
+  return Error::success();
+}
+
+/// The corpus modules to gate: the manifest's file column when the
+/// extraction wrote one, otherwise every .bc in the directory.
+std::vector<std::string> collectCorpusFiles(StringRef Dir) {
+  std::vector<std::string> Files;
+  SmallString<256> ManifestPath(Dir);
+  sys::path::append(ManifestPath, "corpus_manifest.tsv");
+  if (auto BufOrErr = MemoryBuffer::getFile(ManifestPath)) {
+    for (StringRef Line : split((*BufOrErr)->getBuffer(), '\n')) {
+      SmallVector<StringRef, 5> Cols;
+      Line.rtrim().split(Cols, '\t');
+      // crate, module identifier, file, module hash, byte size
+      if (Cols.size() >= 3 && !Cols[0].starts_with("#"))
+        Files.push_back(Cols[2].str());
+    }
+    return Files;
+  }
+  std::error_code EC;
+  for (sys::fs::directory_iterator It(Dir, EC), End; It != End && !EC;
+       It.increment(EC))
+    if (StringRef(It->path()).ends_with(".bc"))
+      Files.push_back(std::string(sys::path::filename(It->path())));
+  llvm::sort(Files);
+  return Files;
+}
+
+/// Gate the corpus: probe counts and code growth per configuration. No
+/// marker pass — checkpoint bitcode carries the markers already, and no
+/// execution — corpus modules have no known entry point. The "marker"
+/// configuration is skipped for the same reason: with markers pre-applied
+/// it measures nothing.
+Error runCorpusGate(StringRef Dir, std::vector<GateRow> &Rows) {
+  for (const std::string &File : collectCorpusFiles(Dir)) {
+    SmallString<256> Path(Dir);
+    sys::path::append(Path, File);
+    auto BufOrErr = MemoryBuffer::getFile(Path);
+    if (!BufOrErr) {
+      WithColor::warning() << Path << ": cannot read corpus module: "
+                           << BufOrErr.getError().message() << '\n';
+      continue;
+    }
+
+    LLVMContext Ctx;
+    Expected<std::unique_ptr<Module>> Parsed =
+        parseBitcodeFile(**BufOrErr, Ctx);
+    if (!Parsed) {
+      WithColor::warning() << Path << ": cannot parse: "
+                           << toString(Parsed.takeError()) << '\n';
+      continue;
+    }
+    uint64_t InstsBefore = countInstructions(**Parsed);
+
+    for (const GateConfig &C : Configs) {
+      if (StringRef(C.Name) == "marker")
+        continue;
+      std::unique_ptr<Module> M = CloneModule(**Parsed);
+      applyConfig(*M, C, /*RunMarker=*/false);
+
+      GateRow Row;
+      Row.Config = C.Name;
+      Row.ModuleName = File;
+      Row.ProbeCalls = countProbeCalls(*M);
+      Row.InstsBefore = InstsBefore;
+      Row.InstsAfter = countInstructions(*M);
+      Rows.push_back(std::move(Row));
+    }
+  }
+  return Error::success();
+}
+
+void writeBaseline(raw_ostream &OS, ArrayRef<GateRow> Rows) {
+  OS << "#!unsafe-overhead-gate\t1\n";
+  OS << "config\tmodule\tprobe_calls\tinsts_before\tinsts_after\t"
+        "overhead\n";
+  for (const GateRow &Row : Rows) {
+    OS << Row.Config << '\t' << Row.ModuleName << '\t' << Row.ProbeCalls
+       << '\t' << Row.InstsBefore << '\t' << Row.InstsAfter << '\t';
+    if (Row.Overhead < 0)
+      OS << '-';
+    else
+      OS << format("%.3f", Row.Overhead);
+    OS << '\n';
+  }
+}
+
+Error readBaseline(StringRef Path, std::map<std::string, GateRow> &Rows) {
+  auto BufOrErr = MemoryBuffer::getFile(Path);
+  if (!BufOrErr)
+    return createStringError(
+        BufOrErr.getError(),
+        "%s: cannot read baseline (record one with -update-baseline)",
+        Path.str().c_str());
+  for (StringRef Line : split((*BufOrErr)->getBuffer(), '\n')) {
+    Line = Line.rtrim();
+    if (Line.empty() || Line.front() == '#' || Line.starts_with("config\t"))
+      continue;
+    SmallVector<StringRef, 6> Cols;
+    Line.split(Cols, '\t');
+    if (Cols.size() < 6)
+      continue;
+    GateRow Row;
+    Row.Config = Cols[0].str();
+    Row.ModuleName = Cols[1].str();
+    if (Cols[2].getAsInteger(10, Row.ProbeCalls) ||
+        Cols[3].getAsInteger(10, Row.InstsBefore) ||
+        Cols[4].getAsInteger(10, Row.InstsAfter))
+      continue;
+    if (Cols[5] != "-" && Cols[5].getAsDouble(Row.Overhead))
+      Row.Overhead = -1.0;
+    Rows[Row.Config + "\t" + Row.ModuleName] = std::move(Row);
+  }
+  return Error::success();
+}
+
+/// Compares against the baseline. Static columns gate exactly — they are
+/// deterministic for fixed inputs, and an intentional change is exactly
+/// what -update-baseline exists to record. The timing ratio gates within
+/// the tolerance band, in both directions: an unexplained speedup is a
+/// measurement change worth a look too.
+unsigned compareToBaseline(ArrayRef<GateRow> Current,
+                           const std::map<std::string, GateRow> &Baseline) {
+  unsigned Failures = 0;
+  for (const GateRow &Row : Current) {
+    std::string Key = Row.Config + "\t" + Row.ModuleName;
+    auto It = Baseline.find(Key);
+    if (It == Baseline.end()) {
+      WithColor::error() << Row.Config << " / " << Row.ModuleName
+                         << ": not in the baseline; run -update-baseline "
+                            "to adopt it\n";
+      ++Failures;
+      continue;
+    }
+    const GateRow &Base = It->second;
+    if (Row.ProbeCalls != Base.ProbeCalls) {
+      WithColor::error() << Row.Config << " / " << Row.ModuleName
+                         << ": probe call sites " << Row.ProbeCalls
+                         << " != baseline " << Base.ProbeCalls << '\n';
+      ++Failures;
+    }
+    if (Row.InstsBefore != Base.InstsBefore ||
+        Row.InstsAfter != Base.InstsAfter) {
+      WithColor::error() << Row.Config << " / " << Row.ModuleName
+                         << ": code size " << Row.InstsBefore << " -> "
+                         << Row.InstsAfter << " != baseline "
+                         << Base.InstsBefore << " -> " << Base.InstsAfter
+                         << '\n';
+      ++Failures;
+    }
+    if (Row.Overhead >= 0 && Base.Overhead >= 0) {
+      double Drift = std::abs(Row.Overhead - Base.Overhead) / Base.Overhead;
+      if (Drift > OverheadTolerancePct / 100.0) {
+        WithColor::error()
+            << Row.Config << " / " << Row.ModuleName << ": overhead ratio "
+            << format("%.3f", Row.Overhead) << " drifts "
+            << format("%.0f%%", Drift * 100) << " from baseline "
+            << format("%.3f", Base.Overhead) << " (tolerance "
+            << OverheadTolerancePct << "%)\n";
+        ++Failures;
+      }
+    }
+  }
+  return Failures;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  (void)PrimaryPackageSet;
+  cl::HideUnrelatedOptions(GateCategory);
+  cl::ParseCommandLineOptions(
+      argc, argv,
+      "differential overhead gate for the unsafe instrumentation stack\n");
+
+  if (!NoExecute) {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+  }
+
+  std::vector<GateRow> Rows;
+  if (Error E = runKernelGate(Rows)) {
+    WithColor::error() << toString(std::move(E)) << '\n';
+    return 1;
+  }
+
+  std::string Corpus = CorpusDir;
+  if (Corpus.empty())
+    if (const char *Env = getenv("UNSAFE_INSTR_CORPUS_DIR"))
+      Corpus = Env;
+  if (!Corpus.empty())
+    if (Error E = runCorpusGate(Corpus, Rows)) {
+      WithColor::error() << toString(std::move(E)) << '\n';
+      return 1;
+    }
+
+  if (UpdateBaseline) {
+    std::error_code EC;
+    raw_fd_ostream OS(BaselineFile, EC, sys::fs::OF_Text);
+    if (EC) {
+      WithColor::error() << BaselineFile << ": " << EC.message() << '\n';
+      return 1;
+    }
+    writeBaseline(OS, Rows);
+    outs() << "recorded " << Rows.size() << " baseline rows to "
+           << BaselineFile << '\n';
+    return 0;
+  }
+
+  std::map<std::string, GateRow> Baseline;
+  if (Error E = readBaseline(BaselineFile, Baseline)) {
+    WithColor::error() << toString(std::move(E)) << '\n';
+    return 1;
+  }
+
+  unsigned Failures = compareToBaseline(Rows, Baseline);
+  if (Failures) {
+    WithColor::error() << Failures << " gate violation(s); re-record with "
+                          "-update-baseline if the change is intentional\n";
+    return 1;
+  }
+  outs() << "unsafe overhead gate: " << Rows.size()
+         << " measurements within baseline\n";
+  return 0;
+}
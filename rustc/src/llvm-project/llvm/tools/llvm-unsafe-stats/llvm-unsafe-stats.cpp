@@ -0,0 +1,504 @@
+//===-- llvm-unsafe-stats.cpp - merge and query unsafe_instr stat files ---===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Native aggregation for the .stat files the unsafe_instr runtime writes
+// (cpu_cycle.stat, heap_stat.stat, unsafe_counter.stat, ...). The files are
+// sectioned TSV: "== section ==" headers followed by scalar "key<TAB>value"
+// rows (possibly several pairs per line) and tagged rows such as
+// "scope<TAB>name<TAB>cycles<TAB>count". The benchmark pipeline used to fold
+// these in Python, which for the full matrix takes longer than some of the
+// runs being folded; this tool merges whole directories of them at native
+// speed, answers top-N-by-unsafe-cycle-share queries, and emits JSON with a
+// stable schema for master_runtime_stats.json.
+//
+//   llvm-unsafe-stats merge -o merged.stat a.stat b.stat ...
+//   llvm-unsafe-stats top [-n 10] a.stat b.stat ...
+//   llvm-unsafe-stats json [-o out.json] a.stat b.stat ...
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/InstMarker/UnsafeStatsFormat.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+cl::OptionCategory StatsCategory("llvm-unsafe-stats options");
+
+cl::opt<std::string> Command(cl::Positional, cl::Required,
+                             cl::desc("<merge|top|json>"),
+                             cl::cat(StatsCategory));
+
+cl::list<std::string> InputFilenames(cl::Positional, cl::OneOrMore,
+                                     cl::desc("<stat files>"),
+                                     cl::cat(StatsCategory));
+
+cl::opt<std::string> OutputFilename("o", cl::init("-"),
+                                    cl::desc("Output file (default stdout)"),
+                                    cl::cat(StatsCategory));
+
+cl::opt<unsigned> TopN("n", cl::init(10),
+                       cl::desc("Number of rows for the top query"),
+                       cl::cat(StatsCategory));
+
+// Stripped-build support (-unsafe-name-sidecar-dir on the compile side):
+// dumps from name-free binaries carry "id:<n>" identities (and func rows
+// always carried bare IDs); given the directory of compile-time name
+// sidecars, those identities are swapped back to names before any output,
+// so merge/top/json look identical to a name-embedding build's.
+cl::opt<std::string> SymbolizeDir(
+    "symbolize-dir", cl::init(""),
+    cl::desc("Directory of compile-time name sidecars (*.tsv); ID "
+             "identities in the inputs are re-symbolized from them"),
+    cl::cat(StatsCategory));
+
+/// MapVector's default DenseMap index has no DenseMapInfo for std::string;
+/// back the index with std::map instead. Iteration order stays first-seen,
+/// which is what keeps merged output in the runtime's own section order.
+template <typename ValueT>
+using StringMapVector =
+    MapVector<std::string, ValueT, std::map<std::string, unsigned>>;
+
+/// One section's accumulated contents. Scalar keys map to positional value
+/// sums; tagged rows are keyed by their identity columns.
+struct Section {
+  StringMapVector<std::vector<double>> Scalars;
+  // Tag -> identity columns -> summed value columns, in first-seen tag order.
+  StringMapVector<std::map<std::vector<std::string>, std::vector<double>>>
+      Rows;
+};
+
+using StatMap = StringMapVector<Section>;
+
+/// Identity column count (after the tag itself) for the tagged row kinds the
+/// runtime emits. Everything following the identity is numeric and summable.
+/// The m-prefixed tags are the module-hash-qualified variants written when
+/// the build recorded a module content hash with its ID tables: the hash is
+/// one extra leading identity column, so IDs from differently-built shards
+/// stay distinct instead of summing into each other.
+unsigned identityColumns(StringRef Tag) {
+  if (Tag == "line")
+    return 2; // file, line number
+  if (Tag == "mfunc" || Tag == "mregion")
+    return 2; // module hash, id
+  if (Tag == "mline")
+    return 3; // module hash, file, line number
+  if (Tag == "thread")
+    return 2; // ordinal, pthread name — merging by identity is the
+              // per-executor-thread grouping the rows exist for
+  return 1;   // func, scope, callee, calibrate, task, gap: one name/id
+              // column (gap's numeric tail is its 16 log2 buckets, which
+              // sum per-bucket like any other value columns)
+}
+
+bool isKnownTag(StringRef Tag) {
+  return Tag == "func" || Tag == "scope" || Tag == "line" ||
+         Tag == "callee" || Tag == "calibrate" || Tag == "mfunc" ||
+         Tag == "mregion" || Tag == "mline" || Tag == "thread" ||
+         Tag == "task" || Tag == "gap";
+}
+
+void sumInto(std::vector<double> &Acc, ArrayRef<double> Values) {
+  if (Acc.size() < Values.size())
+    Acc.resize(Values.size(), 0.0);
+  for (size_t I = 0; I < Values.size(); ++I)
+    Acc[I] += Values[I];
+}
+
+/// Parses one stat file into \p Stats. Unknown rows are tolerated and merged
+/// by the same rules, so runtime additions do not break old tools; a format
+/// header from a newer toolchain (see UnsafeStatsFormat.h) downgrades that
+/// from silent to a warning, since "the same rules" may then be the wrong
+/// rules. The buffer is memory-mapped and rows are parsed as StringRef
+/// slices of it, so nothing is copied until a row is accumulated.
+Error parseStatFile(StringRef Path, StatMap &Stats) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr =
+      MemoryBuffer::getFileOrSTDIN(Path);
+  if (!BufOrErr)
+    return createStringError(BufOrErr.getError(), "%s: cannot read",
+                             Path.str().c_str());
+
+  Section *Cur = nullptr;
+  for (StringRef Line : split((*BufOrErr)->getBuffer(), '\n')) {
+    Line = Line.rtrim();
+    if (Line.empty())
+      continue;
+    // '#' never starts a data row: header and any future metadata lines.
+    // Headerless files are version 0 — everything before the header
+    // existed — and parse exactly as they always did.
+    if (Line.front() == '#') {
+      unsigned Version = 0;
+      if (parseUnsafeStatsHeader(Line, Version) &&
+          Version > UnsafeStatsFormatVersion)
+        WithColor::warning()
+            << Path << ": format version " << Version
+            << " is newer than this tool (version "
+            << UnsafeStatsFormatVersion
+            << "); rows this tool does not know may merge incorrectly\n";
+      continue;
+    }
+    if (Line.starts_with("== ") && Line.ends_with(" ==")) {
+      Cur = &Stats[Line.drop_front(3).drop_back(3).str()];
+      continue;
+    }
+    if (!Cur)
+      Cur = &Stats["<no section>"];
+
+    SmallVector<StringRef, 8> Tokens;
+    Line.split(Tokens, '\t', -1, /*KeepEmpty=*/false);
+    if (Tokens.empty())
+      continue;
+
+    if (isKnownTag(Tokens[0])) {
+      unsigned IdCols = identityColumns(Tokens[0]);
+      if (Tokens.size() <= IdCols)
+        continue;
+      std::vector<std::string> Identity;
+      for (unsigned I = 1; I <= IdCols && I < Tokens.size(); ++I)
+        Identity.push_back(Tokens[I].str());
+      std::vector<double> Values;
+      for (unsigned I = IdCols + 1; I < Tokens.size(); ++I) {
+        double V = 0;
+        if (Tokens[I].getAsDouble(V))
+          V = 0;
+        Values.push_back(V);
+      }
+      // Calibrate rows carry means and a factor; convert the means back
+      // into call-weighted totals so merging stays exact, and recompute
+      // the derived columns on output.
+      if (Tokens[0] == "calibrate" && Values.size() >= 5) {
+        double ProbedMean = Values[0], RefMean = Values[1];
+        double ProbedCalls = Values[3], RefCalls = Values[4];
+        Values = {ProbedMean * ProbedCalls, RefMean * RefCalls, ProbedCalls,
+                  RefCalls};
+      }
+      sumInto(Cur->Rows[Tokens[0].str()][Identity], Values);
+      continue;
+    }
+
+    // Scalar rows: alternating keys and numeric values, one or more pairs
+    // per line (the heap section packs several on one line).
+    std::string Key;
+    std::vector<double> Values;
+    auto Flush = [&] {
+      if (!Key.empty())
+        sumInto(Cur->Scalars[Key], Values);
+      Key.clear();
+      Values.clear();
+    };
+    for (StringRef Tok : Tokens) {
+      double V;
+      if (!Tok.getAsDouble(V)) {
+        Values.push_back(V);
+      } else {
+        Flush();
+        Key = Tok.str();
+      }
+    }
+    Flush();
+  }
+  return Error::success();
+}
+
+/// Sidecar name tables, keyed (kind, id). Kinds mirror the sidecar row
+/// tags: "callee", "scope", "stack", plus "func" for the function
+/// tracker's untagged (id, name, has_unsafe) rows. One map across every
+/// sidecar in the directory: IDs are dense per module, so aggregating
+/// dumps from differently-built modules through one directory can
+/// collide — the loader warns when two sidecars disagree on a key.
+using NameTable = std::map<std::pair<std::string, uint64_t>, std::string>;
+
+Error loadNameSidecars(StringRef Dir, NameTable &Names) {
+  std::error_code EC;
+  for (sys::fs::directory_iterator It(Dir, EC), End; It != End && !EC;
+       It.increment(EC)) {
+    StringRef Path = It->path();
+    if (!Path.ends_with(".tsv"))
+      continue;
+    ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr =
+        MemoryBuffer::getFile(Path);
+    if (!BufOrErr) {
+      WithColor::warning() << Path << ": cannot read sidecar: "
+                           << BufOrErr.getError().message() << '\n';
+      continue;
+    }
+    for (StringRef Line : split((*BufOrErr)->getBuffer(), '\n')) {
+      Line = Line.rtrim();
+      if (Line.empty() || Line.front() == '#')
+        continue;
+      SmallVector<StringRef, 4> Tokens;
+      Line.split(Tokens, '\t', -1, /*KeepEmpty=*/false);
+      uint64_t Id;
+      std::string Kind, Name;
+      if (Tokens.size() >= 3 &&
+          (Tokens[0] == "callee" || Tokens[0] == "scope" ||
+           Tokens[0] == "stack") &&
+          !Tokens[1].getAsInteger(10, Id)) {
+        Kind = Tokens[0].str();
+        Name = Tokens[2].str();
+      } else if (Tokens.size() >= 2 && !Tokens[0].getAsInteger(10, Id)) {
+        // Function tracker sidecar row: id, name, has_unsafe.
+        Kind = "func";
+        Name = Tokens[1].str();
+      } else {
+        continue; // module_hash row, or something newer.
+      }
+      auto [MapIt, Inserted] = Names.insert({{Kind, Id}, Name});
+      if (!Inserted && MapIt->second != Name)
+        WithColor::warning()
+            << Path << ": " << Kind << " id " << Id << " is '" << Name
+            << "' here but '" << MapIt->second
+            << "' in an earlier sidecar; keeping the earlier name "
+            << "(differently-built modules need separate directories)\n";
+    }
+  }
+  if (EC)
+    return createStringError(EC, "%s: cannot list sidecar directory",
+                             Dir.str().c_str());
+  return Error::success();
+}
+
+/// Rewrites ID identities back to names in place. Covers the tags whose
+/// identity is a callee/scope/function: "id:<n>" placeholders from
+/// stripped builds, and func rows' bare numeric IDs. Rows whose ID has no
+/// sidecar entry keep the ID — still mergeable, just unresolved. Renaming
+/// can make previously distinct keys equal (two shards, same name), so
+/// rewritten rows re-merge through sumInto.
+void symbolizeStats(StatMap &Stats, const NameTable &Names) {
+  for (auto &SecKV : Stats) {
+    for (auto &TagKV : SecKV.second.Rows) {
+      StringRef Kind = StringSwitch<StringRef>(TagKV.first)
+                           .Case("callee", "callee")
+                           .Case("gap", "callee") // gap rows name a callee
+                           .Case("scope", "scope")
+                           .Case("func", "func")
+                           .Default("");
+      if (Kind.empty())
+        continue;
+      std::map<std::vector<std::string>, std::vector<double>> Rewritten;
+      for (const auto &RowKV : TagKV.second) {
+        std::vector<std::string> Identity = RowKV.first;
+        StringRef Id0(Identity.front());
+        uint64_t Id;
+        bool HasId = Id0.consume_front("id:")
+                         ? !Id0.getAsInteger(10, Id)
+                         : (Kind == "func" && !Id0.getAsInteger(10, Id));
+        if (HasId) {
+          auto It = Names.find({Kind.str(), Id});
+          if (It != Names.end())
+            Identity.front() = It->second;
+        }
+        sumInto(Rewritten[Identity], RowKV.second);
+      }
+      TagKV.second = std::move(Rewritten);
+    }
+  }
+}
+
+void printValue(raw_ostream &OS, double V) {
+  if (V == (double)(uint64_t)V)
+    OS << (uint64_t)V;
+  else
+    OS << format("%.3f", V);
+}
+
+/// Writes the merged statistics back out in the runtime's own format, one
+/// scalar pair per line, so merged files feed back into any consumer of the
+/// originals (including this tool).
+void writeMerged(raw_ostream &OS, const StatMap &Stats) {
+  // Module hash 0: merged output spans modules by construction.
+  writeUnsafeStatsHeader(OS, 0);
+  for (const auto &SecKV : Stats) {
+    OS << "== " << SecKV.first << " ==\n";
+    const Section &Sec = SecKV.second;
+    for (const auto &KV : Sec.Scalars) {
+      OS << KV.first;
+      for (double V : KV.second) {
+        OS << '\t';
+        printValue(OS, V);
+      }
+      OS << '\n';
+    }
+    for (const auto &TagKV : Sec.Rows) {
+      for (const auto &RowKV : TagKV.second) {
+        OS << TagKV.first;
+        for (const std::string &Id : RowKV.first)
+          OS << '\t' << Id;
+        if (TagKV.first == "calibrate" && RowKV.second.size() >= 4) {
+          // Recompute the derived mean/factor columns from the totals.
+          double ProbedCalls = RowKV.second[2], RefCalls = RowKV.second[3];
+          double ProbedMean =
+              ProbedCalls > 0 ? RowKV.second[0] / ProbedCalls : 0;
+          double RefMean = RefCalls > 0 ? RowKV.second[1] / RefCalls : 0;
+          OS << format("\t%.1f\t%.1f\t%.3f", ProbedMean, RefMean,
+                       RefMean > 0 ? ProbedMean / RefMean : 0.0);
+          OS << '\t' << (uint64_t)ProbedCalls << '\t' << (uint64_t)RefCalls;
+        } else {
+          for (double V : RowKV.second) {
+            OS << '\t';
+            printValue(OS, V);
+          }
+        }
+        OS << '\n';
+      }
+    }
+  }
+}
+
+/// Top-N functions by unsafe cycle share. Scope rows carry per-source-
+/// function cycles (-cpu-cycle-scope-attribution); without them the split
+/// does not exist in the inputs and the query says so.
+int runTop(const StatMap &Stats, raw_ostream &OS) {
+  const Section *Cycle = nullptr;
+  for (const auto &KV : Stats)
+    if (KV.first == "cpu_cycle")
+      Cycle = &KV.second;
+  if (!Cycle) {
+    WithColor::error() << "no cpu_cycle section in the inputs\n";
+    return 1;
+  }
+
+  auto ScopesIt = Cycle->Rows.find("scope");
+  if (ScopesIt == Cycle->Rows.end() || ScopesIt->second.empty()) {
+    WithColor::error() << "no per-function scope rows; rebuild with "
+                          "-cpu-cycle-scope-attribution to attribute "
+                          "cycles to source functions\n";
+    return 1;
+  }
+
+  double Total = 0;
+  auto TotalIt = Cycle->Scalars.find("unsafe_cycles");
+  if (TotalIt != Cycle->Scalars.end() && !TotalIt->second.empty())
+    Total = TotalIt->second[0];
+
+  std::vector<std::pair<double, const std::vector<std::string> *>> Ranked;
+  for (const auto &RowKV : ScopesIt->second)
+    Ranked.push_back(
+        {RowKV.second.empty() ? 0 : RowKV.second[0], &RowKV.first});
+  llvm::stable_sort(Ranked, [](const auto &A, const auto &B) {
+    return A.first > B.first;
+  });
+
+  OS << "rank\tfunction\tcycles\tshare\n";
+  for (unsigned I = 0; I < Ranked.size() && I < TopN; ++I) {
+    OS << (I + 1) << '\t' << Ranked[I].second->front() << '\t';
+    printValue(OS, Ranked[I].first);
+    OS << '\t'
+       << format("%.2f%%",
+                 Total > 0 ? 100.0 * Ranked[I].first / Total : 0.0)
+       << '\n';
+  }
+  return 0;
+}
+
+/// JSON with a stable schema: one object per section, scalar keys inline
+/// (single values unwrapped), tagged rows grouped by tag as arrays of
+/// {key, values} objects. run_pipeline.py folds this straight into
+/// master_runtime_stats.json.
+void writeJSON(raw_ostream &OS, const StatMap &Stats) {
+  json::OStream J(OS, /*IndentSize=*/2);
+  J.object([&] {
+    for (const auto &SecKV : Stats) {
+      J.attributeObject(SecKV.first, [&] {
+        const Section &Sec = SecKV.second;
+        for (const auto &KV : Sec.Scalars) {
+          if (KV.second.size() == 1) {
+            J.attribute(KV.first, KV.second[0]);
+          } else {
+            J.attributeArray(KV.first, [&] {
+              for (double V : KV.second)
+                J.value(V);
+            });
+          }
+        }
+        for (const auto &TagKV : Sec.Rows) {
+          J.attributeArray(TagKV.first, [&] {
+            for (const auto &RowKV : TagKV.second) {
+              J.object([&] {
+                J.attributeArray("key", [&] {
+                  for (const std::string &Id : RowKV.first)
+                    J.value(Id);
+                });
+                J.attributeArray("values", [&] {
+                  for (double V : RowKV.second)
+                    J.value(V);
+                });
+              });
+            }
+          });
+        }
+      });
+    }
+  });
+  OS << '\n';
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::HideUnrelatedOptions(StatsCategory);
+  cl::ParseCommandLineOptions(
+      argc, argv, "merge and query unsafe_instr .stat files\n");
+
+  if (Command != "merge" && Command != "top" && Command != "json") {
+    WithColor::error() << "unknown command '" << Command
+                       << "'; expected merge, top or json\n";
+    return 1;
+  }
+
+  StatMap Stats;
+  for (const std::string &Path : InputFilenames)
+    if (Error E = parseStatFile(Path, Stats)) {
+      WithColor::error() << toString(std::move(E)) << '\n';
+      return 1;
+    }
+
+  if (!SymbolizeDir.empty()) {
+    NameTable Names;
+    if (Error E = loadNameSidecars(SymbolizeDir, Names)) {
+      WithColor::error() << toString(std::move(E)) << '\n';
+      return 1;
+    }
+    symbolizeStats(Stats, Names);
+  }
+
+  std::error_code EC;
+  raw_fd_ostream OS(OutputFilename, EC,
+                    sys::fs::OF_Text);
+  if (EC) {
+    WithColor::error() << OutputFilename << ": " << EC.message() << '\n';
+    return 1;
+  }
+
+  if (Command == "merge")
+    writeMerged(OS, Stats);
+  else if (Command == "json")
+    writeJSON(OS, Stats);
+  else
+    return runTop(Stats, OS);
+  return 0;
+}